@@ -0,0 +1,1791 @@
+/*
+* Archive purged items into a compressed, seekable archive per volume
+*
+* Copyright(C) 2024 ERROR_SUCCESS Software
+*
+* This program is free software : you can redistribute it and /or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.If not, see < https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#include "archive.h"
+#include "cli.h"
+#include "dirtree.h"
+#include "ini.h"
+#include "parallel.h"
+#include "reclaim.h"
+#include "logger.h"
+
+typedef struct ArchiveWalk
+{
+    ArchiveWriter* writer;
+    DWORD volume;
+    size_t pathLength; // Of the folder being listed, in writer->path
+    ULONGLONG deletionTime;
+    BOOL result;
+} ArchiveWalk;
+
+typedef struct ArchiveBenchList
+{
+    const wchar_t* folder;
+    const wchar_t* outputPath;
+    BYTE* expected;
+    BYTE* actual;
+    double seconds;
+    ULONGLONG files;
+    BOOL verified;
+} ArchiveBenchList;
+
+#ifndef NDEBUG
+typedef struct ArchiveTestList
+{
+    ArchiveEntry entries[16];
+    DWORD count;
+} ArchiveTestList;
+#endif
+
+static BOOL archiveChild(HANDLE hDirectory, const DirEntry* entry, void* context);
+static BOOL archiveOpenTree(ArchiveWriter* writer, DWORD volume, HANDLE hItem,
+                            size_t pathLength, ULONGLONG deletionTime);
+static BOOL buildArchivePath(const wchar_t* folder, const wchar_t* format, wchar_t driveLetter,
+                             wchar_t* path);
+static void compressArchiveFrame(DWORD index, void* context);
+static BOOL extractBenchEntry(const ArchiveEntry* entry, const wchar_t* path, void* context);
+static BOOL findArchiveIndexEnd(HANDLE hIndex, ULONGLONG size, ULONGLONG* end);
+static BOOL findArchiveMatch(const ArchiveEntry* entry, const wchar_t* path, void* context);
+static void finishArchivePending(ArchiveWriter* writer, ArchivePending* pending);
+static BOOL flushArchiveFrames(ArchiveWriter* writer);
+static DWORD generateArchiveContent(BYTE* buffer, DWORD seed);
+static BOOL openArchiveVolume(ArchiveWriter* writer, DWORD volume);
+static BOOL rotateArchive(const wchar_t* folder, wchar_t driveLetter);
+static BOOL writeArchiveBytes(HANDLE hFile, const void* buffer, DWORD bytes);
+#ifndef NDEBUG
+static BOOL collectTestEntry(const ArchiveEntry* entry, const wchar_t* path, void* context);
+static void createTestArchiveFile(const wchar_t* path, const BYTE* contents, DWORD bytes);
+#endif
+
+/// @brief archives every item in a bin or staging folder
+/// @param writer the writer
+/// @param driveLetter the volume the folder is on, which picks the archive
+/// @param folder the folder
+/// @return TRUE if every item was queued, FALSE if any could not be read
+BOOL archiveBinFolder(ArchiveWriter* writer,
+                      wchar_t driveLetter,
+                      const wchar_t* folder)
+{
+    wchar_t infoPattern[MAX_PATH + 1] = { 0 };
+    int written = _snwprintf(infoPattern,
+                             ARRAYSIZE(infoPattern),
+                             L"%s\\%s*",
+                             folder,
+                             BIN_INFO_PREFIX);
+    infoPattern[MAX_PATH] = 0;
+    if ((written < 0) || (written > MAX_PATH))
+    {
+        return FALSE;
+    }
+    WIN32_FIND_DATAW findData = { 0 };
+    HANDLE hFind = FindFirstFileExW(infoPattern,
+                                    FindExInfoBasic,
+                                    &findData,
+                                    FindExSearchNameMatch,
+                                    NULL,
+                                    FIND_FIRST_EX_LARGE_FETCH);
+    if (hFind == INVALID_HANDLE_VALUE)
+    {
+        return (GetLastError() == ERROR_FILE_NOT_FOUND);
+    }
+    BOOL result = TRUE;
+    do
+    {
+        wchar_t infoPath[MAX_PATH + 1] = { 0 };
+        wchar_t contentPath[MAX_PATH + 1] = { 0 };
+        written = _snwprintf(infoPath,
+                             ARRAYSIZE(infoPath),
+                             L"%s\\%s",
+                             folder,
+                             findData.cFileName);
+        infoPath[MAX_PATH] = 0;
+        if ((written < 0) || (written > MAX_PATH))
+        {
+            result = FALSE;
+            continue;
+        }
+        // $I and $R are the same length, so the prefix is at the same place
+        wcscpy(contentPath,
+               infoPath);
+        contentPath[wcslen(folder) + 2] = BIN_CONTENT_PREFIX[1];
+        if (archiveBinItem(writer,
+                           driveLetter,
+                           infoPath,
+                           contentPath) == FALSE)
+        {
+            result = FALSE;
+        }
+    } while (FindNextFileW(hFind, &findData));
+    FindClose(hFind);
+    return result;
+}
+
+/// @brief queues one bin item for the archive: its file, or its folder and
+/// everything in it. Nothing is on disk until the frames are flushed.
+/// @param writer the writer
+/// @param driveLetter the volume the item is on, which picks the archive
+/// @param infoPath the $I file, for the original path and deletion time
+/// @param contentPath the $R file or folder
+/// @return TRUE if the item was queued or has no $R, FALSE if any of it
+///         could not be read
+BOOL archiveBinItem(ArchiveWriter* writer,
+                    wchar_t driveLetter,
+                    const wchar_t* infoPath,
+                    const wchar_t* contentPath)
+{
+    DWORD volume = (DWORD) (towupper(driveLetter) - L'A');
+    if (volume >= ARCHIVE_VOLUMES)
+    {
+        return FALSE;
+    }
+    BinItem item = { 0 };
+    if (readBinInfoFile(infoPath,
+                        writer->info,
+                        &item,
+                        writer->path,
+                        BIN_PATH_MAX_CCH) == FALSE)
+    {
+        return FALSE;
+    }
+    HANDLE hItem = openTreePath(contentPath,
+                                DIRTREE_READ_ACCESS | FILE_READ_DATA);
+    if (hItem == INVALID_HANDLE_VALUE)
+    {
+        DWORD error = GetLastError();
+        return ((error == ERROR_FILE_NOT_FOUND) || (error == ERROR_PATH_NOT_FOUND));
+    }
+    BOOL result = archiveOpenTree(writer,
+                                  volume,
+                                  hItem,
+                                  wcslen(writer->path),
+                                  item.deletionTime);
+    CloseHandle(hItem);
+    return result;
+}
+
+/// @brief archives one entry of a folder item that is being archived
+/// @param hDirectory the folder
+/// @param entry the entry
+/// @param context the ArchiveWalk
+/// @return TRUE to keep listing
+static BOOL archiveChild(HANDLE hDirectory,
+                         const DirEntry* entry,
+                         void* context)
+{
+    ArchiveWalk* walk = (ArchiveWalk*) context;
+    if (((entry->nameLength == 1) && (entry->name[0] == L'.')) ||
+        ((entry->nameLength == 2) && (entry->name[0] == L'.') && (entry->name[1] == L'.')))
+    {
+        return TRUE;
+    }
+    wchar_t* path = walk->writer->path;
+    size_t childLength = walk->pathLength + 1 + entry->nameLength;
+    if (childLength >= BIN_PATH_MAX_CCH)
+    {
+        walk->result = FALSE;
+        return TRUE;
+    }
+    path[walk->pathLength] = L'\\';
+    memcpy(path + walk->pathLength + 1,
+           entry->name,
+           entry->nameLength * sizeof(wchar_t));
+    path[childLength] = 0;
+
+    HANDLE hChild = openTreeChild(hDirectory,
+                                  entry,
+                                  DIRTREE_READ_ACCESS | FILE_READ_DATA);
+    if ((hChild == INVALID_HANDLE_VALUE) ||
+        (archiveOpenTree(walk->writer,
+                         walk->volume,
+                         hChild,
+                         childLength,
+                         walk->deletionTime) == FALSE))
+    {
+        walk->result = FALSE;
+    }
+    if (hChild != INVALID_HANDLE_VALUE)
+    {
+        CloseHandle(hChild);
+    }
+    path[walk->pathLength] = 0;
+    return TRUE;
+}
+
+/// @brief queues an open file, or an open folder and everything in it, for
+/// the archive under the path in writer->path. Junctions and symbolic
+/// links get a record of their own but are not followed.
+/// @param writer the writer
+/// @param volume the archive to add to, 0 for A:
+/// @param hItem the file or folder, opened with DIRTREE_READ_ACCESS and
+/// FILE_READ_DATA
+/// @param pathLength the length of writer->path
+/// @param deletionTime when the bin item was deleted
+/// @return TRUE if all of it was queued, FALSE if any of it could not be read
+static BOOL archiveOpenTree(ArchiveWriter* writer,
+                            DWORD volume,
+                            HANDLE hItem,
+                            size_t pathLength,
+                            ULONGLONG deletionTime)
+{
+    BY_HANDLE_FILE_INFORMATION info = { 0 };
+    if ((writer->failed) ||
+        (GetFileInformationByHandle(hItem, &info) == FALSE) ||
+        (openArchiveVolume(writer, volume) == FALSE))
+    {
+        return FALSE;
+    }
+    ArchivePending* pending = HeapAlloc(GetProcessHeap(),
+                                        HEAP_ZERO_MEMORY,
+                                        sizeof(ArchivePending));
+    wchar_t* path = HeapAlloc(GetProcessHeap(),
+                              0,
+                              (pathLength + 1) * sizeof(wchar_t));
+    if ((pending == NULL) || (path == NULL))
+    {
+        // Memory allocation failed
+        if (pending != NULL)
+        {
+            HeapFree(GetProcessHeap(),
+                     0,
+                     pending);
+        }
+        if (path != NULL)
+        {
+            HeapFree(GetProcessHeap(),
+                     0,
+                     path);
+        }
+        return FALSE;
+    }
+    memcpy(path,
+           writer->path,
+           (pathLength + 1) * sizeof(wchar_t));
+    pending->path = path;
+    pending->volume = volume;
+    pending->entry.deletionTime = deletionTime;
+    pending->entry.archiveTime = getCurrentFileTime();
+    pending->entry.attributes = info.dwFileAttributes;
+    pending->entry.pathLength = (DWORD) pathLength;
+
+    BOOL isFile = ((info.dwFileAttributes & (FILE_ATTRIBUTE_DIRECTORY | FILE_ATTRIBUTE_REPARSE_POINT)) == 0);
+    while (isFile)
+    {
+        if ((writer->frameCount == ARCHIVE_BATCH_FRAMES) &&
+            (flushArchiveFrames(writer) == FALSE))
+        {
+            pending->readFailed = TRUE;
+            break;
+        }
+        ArchiveFrame* frame = &writer->frames[writer->frameCount];
+        DWORD bytesRead = 0;
+        if (ReadFile(hItem,
+                     frame->raw,
+                     ARCHIVE_FRAME_BYTES,
+                     &bytesRead,
+                     NULL) == FALSE)
+        {
+            pending->readFailed = TRUE;
+            break;
+        }
+        if (bytesRead == 0)
+        {
+            break;
+        }
+        frame->rawBytes = bytesRead;
+        frame->pending = pending;
+        pending->entry.rawBytes += bytesRead;
+        pending->queued++;
+        writer->frameCount++;
+    }
+    pending->complete = TRUE;
+    BOOL result = (pending->readFailed == FALSE);
+    if (pending->queued == 0)
+    {
+        finishArchivePending(writer,
+                             pending);
+    }
+
+    if (result &&
+        ((info.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0) &&
+        ((info.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) == 0))
+    {
+        ArchiveWalk walk = { writer, volume, pathLength, deletionTime, TRUE };
+        result = listOpenDirectory(hItem,
+                                   archiveChild,
+                                   &walk) &&
+            walk.result;
+    }
+    return (result && (writer->failed == FALSE));
+}
+
+/// @brief archives the items a purge is about to delete, so that only the
+/// ones that are safely in the archive are deleted
+/// @param items the items, each with the $R path after its $I path
+/// @param count the number of items
+/// @param otherVolumesOnly TRUE to leave out items on the archive folder's
+/// own volume, for a purge that is there to free space on that volume
+/// @param deletable receives TRUE for each item that was archived or left
+/// out, which may be deleted
+/// @return TRUE if every item was archived or left out, FALSE if any were not
+BOOL archivePurgeItems(const PurgeItem* items,
+                       DWORD count,
+                       BOOL otherVolumesOnly,
+                       BOOL* deletable)
+{
+    memset(deletable,
+           0,
+           count * sizeof(BOOL));
+    wchar_t folder[MAX_PATH + 1] = { 0 };
+    wchar_t archiveVolume[MAX_PATH + 1] = { 0 };
+    ArchiveWriter* writer = HeapAlloc(GetProcessHeap(),
+                                      0,
+                                      sizeof(ArchiveWriter));
+    if (writer == NULL)
+    {
+        // Memory allocation failed
+        return FALSE;
+    }
+    if (getArchiveFolder(folder,
+                         ARRAYSIZE(folder)) == FALSE)
+    {
+        HeapFree(GetProcessHeap(),
+                 0,
+                 writer);
+        return FALSE;
+    }
+    if (otherVolumesOnly &&
+        (GetVolumePathNameW(folder, archiveVolume, ARRAYSIZE(archiveVolume)) == FALSE))
+    {
+        // Without it, any item might be on the archive's volume
+        LOG(L"Failed to find the volume of %s, error code %d\n",
+            folder,
+            GetLastError());
+        HeapFree(GetProcessHeap(),
+                 0,
+                 writer);
+        return FALSE;
+    }
+
+    // Archiving onto the volume being purged would use up the space the
+    // purge is there to free
+    BOOL result = openArchiveWriter(writer,
+                                    folder,
+                                    getDefaultThreadCount());
+    DWORD leftOut = 0;
+    for (DWORD i = 0; (i < count) && (writer->failed == FALSE); i++)
+    {
+        const wchar_t* infoPath = items[i].infoPath;
+        wchar_t itemVolume[MAX_PATH + 1] = { 0 };
+        if (otherVolumesOnly &&
+            (GetVolumePathNameW(infoPath, itemVolume, ARRAYSIZE(itemVolume)) == FALSE))
+        {
+            LOG(L"Failed to find the volume of %s, error code %d\n",
+                infoPath,
+                GetLastError());
+            result = FALSE;
+            continue;
+        }
+        if (otherVolumesOnly &&
+            (_wcsicmp(itemVolume, archiveVolume) == 0))
+        {
+            deletable[i] = TRUE;
+            leftOut++;
+            continue;
+        }
+        deletable[i] = archiveBinItem(writer,
+                                      infoPath[0],
+                                      infoPath,
+                                      infoPath + wcslen(infoPath) + 1);
+        if (deletable[i] == FALSE)
+        {
+            LOG(L"Failed to archive %s, error code %d\n",
+                infoPath,
+                GetLastError());
+            result = FALSE;
+        }
+    }
+    if (closeArchiveWriter(writer) == FALSE)
+    {
+        memset(deletable,
+               0,
+               count * sizeof(BOOL));
+        result = FALSE;
+    }
+    else if (leftOut > 0)
+    {
+        LOG(L"Left %lu items on the archive's own volume out of the archive\n",
+            leftOut);
+    }
+    HeapFree(GetProcessHeap(),
+             0,
+             writer);
+    return result;
+}
+
+/// @brief archives everything in a staging folder before the reclaimer
+/// deletes it
+/// @param stagingPath the staging folder
+/// @return TRUE if every item is safely in the archive of the folder's
+///         volume, FALSE if not
+BOOL archiveStagedItems(const wchar_t* stagingPath)
+{
+    wchar_t folder[MAX_PATH + 1] = { 0 };
+    ArchiveWriter* writer = HeapAlloc(GetProcessHeap(),
+                                      0,
+                                      sizeof(ArchiveWriter));
+    if (writer == NULL)
+    {
+        // Memory allocation failed
+        return FALSE;
+    }
+    if (getArchiveFolder(folder,
+                         ARRAYSIZE(folder)) == FALSE)
+    {
+        HeapFree(GetProcessHeap(),
+                 0,
+                 writer);
+        return FALSE;
+    }
+    BOOL result = openArchiveWriter(writer,
+                                    folder,
+                                    getDefaultThreadCount()) &&
+        archiveBinFolder(writer,
+                         stagingPath[0],
+                         stagingPath);
+    result = closeArchiveWriter(writer) && result;
+    HeapFree(GetProcessHeap(),
+             0,
+             writer);
+    return result;
+}
+
+/// @brief archives and extracts synthetic files and times both. A third of
+/// the files are text, a third are log lines and a third are random bytes.
+/// @param folder where to build the files and the archive, which are
+/// deleted afterwards
+/// @param megabytes roughly how much to archive
+/// @param threads the most compression workers
+/// @param result receives the sizes and times
+/// @return TRUE if the benchmark ran, FALSE if the files could not be built
+BOOL benchmarkArchive(const wchar_t* folder,
+                      DWORD megabytes,
+                      DWORD threads,
+                      ArchiveBenchmark* result)
+{
+    memset(result,
+           0,
+           sizeof(ArchiveBenchmark));
+    wchar_t root[MAX_PATH + 1] = { 0 };
+    wchar_t binDirectory[MAX_PATH + 1] = { 0 };
+    wchar_t outputPath[MAX_PATH + 1] = { 0 };
+    _snwprintf(root,
+               ARRAYSIZE(root),
+               L"%s\\rbmarchive%08X",
+               folder,
+               GetCurrentProcessId());
+    root[MAX_PATH] = 0;
+    _snwprintf(binDirectory,
+               ARRAYSIZE(binDirectory),
+               L"%s\\bin",
+               root);
+    binDirectory[MAX_PATH] = 0;
+    _snwprintf(outputPath,
+               ARRAYSIZE(outputPath),
+               L"%s\\extracted",
+               root);
+    outputPath[MAX_PATH] = 0;
+    deleteTree(root,
+               NULL);
+
+    // The writer and two buffers for the largest file
+    ArchiveWriter* writer = HeapAlloc(GetProcessHeap(),
+                                      0,
+                                      sizeof(ArchiveWriter));
+    BYTE* expected = HeapAlloc(GetProcessHeap(),
+                               0,
+                               ARCHIVE_BENCH_FILE_MB * 1048576);
+    BYTE* actual = HeapAlloc(GetProcessHeap(),
+                             0,
+                             ARCHIVE_BENCH_FILE_MB * 1048576);
+    BYTE* info = HeapAlloc(GetProcessHeap(),
+                           0,
+                           BIN_INFO_MAX_SIZE);
+    BOOL success = (writer != NULL) && (expected != NULL) && (actual != NULL) && (info != NULL) &&
+        CreateDirectoryW(root, NULL) &&
+        CreateDirectoryW(binDirectory, NULL);
+
+    // The content of each file is decided by its number, so it can be
+    // built again to check what comes out of the archive
+    ULONGLONG target = (ULONGLONG) megabytes * 1048576;
+    for (DWORD i = 0; success && (result->rawBytes < target); i++)
+    {
+        wchar_t originalPath[MAX_PATH + 1] = { 0 };
+        wchar_t infoPath[MAX_PATH + 1] = { 0 };
+        wchar_t contentPath[MAX_PATH + 1] = { 0 };
+        _snwprintf(originalPath,
+                   ARRAYSIZE(originalPath),
+                   L"C:\\Bench\\%u.dat",
+                   i);
+        _snwprintf(infoPath,
+                   ARRAYSIZE(infoPath),
+                   L"%s\\%s%06u.dat",
+                   binDirectory,
+                   BIN_INFO_PREFIX,
+                   i);
+        _snwprintf(contentPath,
+                   ARRAYSIZE(contentPath),
+                   L"%s\\%s%06u.dat",
+                   binDirectory,
+                   BIN_CONTENT_PREFIX,
+                   i);
+        DWORD bytes = generateArchiveContent(expected,
+                                             i);
+        DWORD infoBytes = buildBinInfo(info,
+                                       originalPath,
+                                       bytes,
+                                       getCurrentFileTime());
+        HANDLE hInfo = CreateFileW(infoPath,
+                                   GENERIC_WRITE,
+                                   0,
+                                   NULL,
+                                   CREATE_NEW,
+                                   FILE_ATTRIBUTE_NORMAL,
+                                   NULL);
+        HANDLE hContent = CreateFileW(contentPath,
+                                      GENERIC_WRITE,
+                                      0,
+                                      NULL,
+                                      CREATE_NEW,
+                                      FILE_ATTRIBUTE_NORMAL,
+                                      NULL);
+        success = (hInfo != INVALID_HANDLE_VALUE) && (hContent != INVALID_HANDLE_VALUE) &&
+            writeArchiveBytes(hInfo, info, infoBytes) &&
+            writeArchiveBytes(hContent, expected, bytes);
+        if (hInfo != INVALID_HANDLE_VALUE)
+        {
+            CloseHandle(hInfo);
+        }
+        if (hContent != INVALID_HANDLE_VALUE)
+        {
+            CloseHandle(hContent);
+        }
+        result->files++;
+        result->rawBytes += bytes;
+    }
+
+    LARGE_INTEGER frequency = { 0 };
+    LARGE_INTEGER start = { 0 };
+    LARGE_INTEGER end = { 0 };
+    QueryPerformanceFrequency(&frequency);
+    if (success)
+    {
+        QueryPerformanceCounter(&start);
+        success = openArchiveWriter(writer,
+                                    root,
+                                    threads) &&
+            archiveBinFolder(writer,
+                             L'B',
+                             binDirectory);
+        success = closeArchiveWriter(writer) && success;
+        QueryPerformanceCounter(&end);
+        result->archiveSeconds = (double) (end.QuadPart - start.QuadPart) / (double) frequency.QuadPart;
+        result->storedBytes = writer->storedBytes;
+    }
+    if (success)
+    {
+        ArchiveBenchList list = { root, outputPath, expected, actual, 0.0, 0, TRUE };
+        success = listArchive(root,
+                              L'B',
+                              extractBenchEntry,
+                              &list);
+        result->extractSeconds = list.seconds;
+        result->verified = list.verified && (list.files == result->files);
+    }
+
+    if (writer != NULL)
+    {
+        HeapFree(GetProcessHeap(),
+                 0,
+                 writer);
+    }
+    if (expected != NULL)
+    {
+        HeapFree(GetProcessHeap(),
+                 0,
+                 expected);
+    }
+    if (actual != NULL)
+    {
+        HeapFree(GetProcessHeap(),
+                 0,
+                 actual);
+    }
+    if (info != NULL)
+    {
+        HeapFree(GetProcessHeap(),
+                 0,
+                 info);
+    }
+    deleteTree(root,
+               NULL);
+    return success;
+}
+
+/// @brief builds the path of an archive file
+/// @param folder the archive folder
+/// @param format ARCHIVE_DATA_FORMAT or ARCHIVE_INDEX_FORMAT
+/// @param driveLetter the volume
+/// @param path receives the path, MAX_PATH + 1 characters
+/// @return TRUE if the path fits, FALSE if not
+static BOOL buildArchivePath(const wchar_t* folder,
+                             const wchar_t* format,
+                             wchar_t driveLetter,
+                             wchar_t* path)
+{
+    wchar_t name[MAX_PATH + 1] = { 0 };
+    _snwprintf(name,
+               ARRAYSIZE(name),
+               format,
+               towupper(driveLetter));
+    int written = _snwprintf(path,
+                             MAX_PATH + 1,
+                             L"%s\\%s",
+                             folder,
+                             name);
+    path[MAX_PATH] = 0;
+    return ((written >= 0) && (written <= MAX_PATH));
+}
+
+/// @brief writes out everything still queued, flushes every archive to
+/// disk and closes the writer
+/// @param writer the writer
+/// @return TRUE if everything queued is safely on disk, FALSE if not, in
+///         which case nothing that was queued may be deleted
+BOOL closeArchiveWriter(ArchiveWriter* writer)
+{
+    flushArchiveFrames(writer);
+    for (DWORD i = 0; i < ARCHIVE_VOLUMES; i++)
+    {
+        ArchiveVolume* volume = &writer->volumes[i];
+        if (volume->hData != INVALID_HANDLE_VALUE)
+        {
+            if ((FlushFileBuffers(volume->hData) == FALSE) ||
+                (FlushFileBuffers(volume->hIndex) == FALSE))
+            {
+                writer->failed = TRUE;
+            }
+            CloseHandle(volume->hData);
+            CloseHandle(volume->hIndex);
+            volume->hData = INVALID_HANDLE_VALUE;
+            volume->hIndex = INVALID_HANDLE_VALUE;
+        }
+    }
+    for (DWORD i = 0; i < ARCHIVE_BATCH_FRAMES; i++)
+    {
+        ArchiveFrame* frame = &writer->frames[i];
+        if (frame->hCompressor != NULL)
+        {
+            CloseCompressor(frame->hCompressor);
+            frame->hCompressor = NULL;
+        }
+        if (frame->raw != NULL)
+        {
+            HeapFree(GetProcessHeap(),
+                     0,
+                     frame->raw);
+            frame->raw = NULL;
+        }
+        if (frame->stored != NULL)
+        {
+            HeapFree(GetProcessHeap(),
+                     0,
+                     frame->stored);
+            frame->stored = NULL;
+        }
+    }
+    if (writer->path != NULL)
+    {
+        HeapFree(GetProcessHeap(),
+                 0,
+                 writer->path);
+        writer->path = NULL;
+    }
+    if (writer->info != NULL)
+    {
+        HeapFree(GetProcessHeap(),
+                 0,
+                 writer->info);
+        writer->info = NULL;
+    }
+    return (writer->failed == FALSE);
+}
+
+/// @brief compresses one queued frame. A frame that does not get smaller is
+/// stored as it is.
+/// @param index the frame
+/// @param context the ArchiveWriter
+static void compressArchiveFrame(DWORD index,
+                                 void* context)
+{
+    ArchiveFrame* frame = &((ArchiveWriter*) context)->frames[index];
+    SIZE_T compressedBytes = 0;
+    if ((Compress(frame->hCompressor,
+                  frame->raw,
+                  frame->rawBytes,
+                  frame->stored,
+                  ARCHIVE_FRAME_BYTES,
+                  &compressedBytes) == FALSE) ||
+        (compressedBytes >= frame->rawBytes))
+    {
+        frame->storedBytes = frame->rawBytes;
+        return;
+    }
+    frame->storedBytes = (DWORD) compressedBytes;
+}
+
+/// @brief extracts one file or folder from an archive
+/// @param folder the archive folder
+/// @param driveLetter the volume whose archive holds it
+/// @param entry its record, from listArchive()
+/// @param destination where to put it, which must not exist yet
+/// @return TRUE if it was extracted whole, FALSE if not
+BOOL extractArchiveEntry(const wchar_t* folder,
+                         wchar_t driveLetter,
+                         const ArchiveEntry* entry,
+                         const wchar_t* destination)
+{
+    if (entry->attributes & FILE_ATTRIBUTE_DIRECTORY)
+    {
+        return CreateDirectoryW(destination,
+                                NULL);
+    }
+    wchar_t dataPath[MAX_PATH + 1] = { 0 };
+    if (buildArchivePath(folder,
+                         ARCHIVE_DATA_FORMAT,
+                         driveLetter,
+                         dataPath) == FALSE)
+    {
+        return FALSE;
+    }
+    HANDLE hData = CreateFileW(dataPath,
+                               GENERIC_READ,
+                               FILE_SHARE_READ | FILE_SHARE_WRITE,
+                               NULL,
+                               OPEN_EXISTING,
+                               FILE_FLAG_SEQUENTIAL_SCAN,
+                               NULL);
+    if (hData == INVALID_HANDLE_VALUE)
+    {
+        return FALSE;
+    }
+    HANDLE hOutput = CreateFileW(destination,
+                                 GENERIC_WRITE,
+                                 0,
+                                 NULL,
+                                 CREATE_NEW,
+                                 FILE_ATTRIBUTE_NORMAL,
+                                 NULL);
+    BYTE* stored = HeapAlloc(GetProcessHeap(),
+                             0,
+                             ARCHIVE_FRAME_BYTES);
+    BYTE* raw = HeapAlloc(GetProcessHeap(),
+                          0,
+                          ARCHIVE_FRAME_BYTES);
+    DECOMPRESSOR_HANDLE hDecompressor = NULL;
+    LARGE_INTEGER offset = { .QuadPart = (LONGLONG) entry->offset };
+    BOOL result = (hOutput != INVALID_HANDLE_VALUE) && (stored != NULL) && (raw != NULL) &&
+        CreateDecompressor(ARCHIVE_ALGORITHM, NULL, &hDecompressor) &&
+        SetFilePointerEx(hData, offset, NULL, FILE_BEGIN);
+
+    ULONGLONG extracted = 0;
+    for (DWORD i = 0; result && (i < entry->frames); i++)
+    {
+        ArchiveFrameHeader header = { 0 };
+        DWORD bytesRead = 0;
+        result = ReadFile(hData, &header, sizeof(header), &bytesRead, NULL) &&
+            (bytesRead == sizeof(header)) &&
+            (header.storedBytes <= ARCHIVE_FRAME_BYTES) &&
+            (header.rawBytes <= ARCHIVE_FRAME_BYTES) &&
+            ReadFile(hData, stored, header.storedBytes, &bytesRead, NULL) &&
+            (bytesRead == header.storedBytes);
+        if (result == FALSE)
+        {
+            break;
+        }
+        const BYTE* frame = stored;
+        if (header.storedBytes < header.rawBytes)
+        {
+            SIZE_T decompressedBytes = 0;
+            result = Decompress(hDecompressor,
+                                stored,
+                                header.storedBytes,
+                                raw,
+                                header.rawBytes,
+                                &decompressedBytes) &&
+                (decompressedBytes == header.rawBytes);
+            frame = raw;
+        }
+        result = result && writeArchiveBytes(hOutput,
+                                             frame,
+                                             header.rawBytes);
+        extracted += header.rawBytes;
+    }
+    result = result && (extracted == entry->rawBytes);
+
+    if (hDecompressor != NULL)
+    {
+        CloseDecompressor(hDecompressor);
+    }
+    if (stored != NULL)
+    {
+        HeapFree(GetProcessHeap(),
+                 0,
+                 stored);
+    }
+    if (raw != NULL)
+    {
+        HeapFree(GetProcessHeap(),
+                 0,
+                 raw);
+    }
+    if (hOutput != INVALID_HANDLE_VALUE)
+    {
+        CloseHandle(hOutput);
+        if (result == FALSE)
+        {
+            DeleteFileW(destination);
+        }
+    }
+    CloseHandle(hData);
+    return result;
+}
+
+/// @brief extracts one file of the benchmark, times it and checks it
+/// @param entry the record
+/// @param path the original path, which holds the file's number
+/// @param context the ArchiveBenchList
+/// @return TRUE to keep listing
+static BOOL extractBenchEntry(const ArchiveEntry* entry,
+                              const wchar_t* path,
+                              void* context)
+{
+    ArchiveBenchList* list = (ArchiveBenchList*) context;
+    const wchar_t* name = wcsrchr(path, L'\\');
+    DWORD number = (name == NULL) ? 0 : wcstoul(name + 1, NULL, 10);
+    LARGE_INTEGER frequency = { 0 };
+    LARGE_INTEGER start = { 0 };
+    LARGE_INTEGER end = { 0 };
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&start);
+    BOOL result = extractArchiveEntry(list->folder,
+                                      L'B',
+                                      entry,
+                                      list->outputPath);
+    QueryPerformanceCounter(&end);
+    list->seconds += (double) (end.QuadPart - start.QuadPart) / (double) frequency.QuadPart;
+    list->files++;
+
+    DWORD bytes = generateArchiveContent(list->expected,
+                                         number);
+    DWORD bytesRead = 0;
+    HANDLE hFile = CreateFileW(list->outputPath,
+                               GENERIC_READ,
+                               0,
+                               NULL,
+                               OPEN_EXISTING,
+                               FILE_FLAG_DELETE_ON_CLOSE,
+                               NULL);
+    if (hFile != INVALID_HANDLE_VALUE)
+    {
+        ReadFile(hFile,
+                 list->actual,
+                 ARCHIVE_BENCH_FILE_MB * 1048576,
+                 &bytesRead,
+                 NULL);
+        CloseHandle(hFile);
+    }
+    if ((result == FALSE) ||
+        (bytesRead != bytes) ||
+        (memcmp(list->actual, list->expected, bytes) != 0))
+    {
+        list->verified = FALSE;
+    }
+    return TRUE;
+}
+
+/// @brief finds the newest record of a file or folder in a volume's archive
+/// @param folder the archive folder
+/// @param driveLetter the volume
+/// @param path the original path of the file or folder, in any case
+/// @param entry receives the record
+/// @return TRUE if it was found, FALSE if not
+BOOL findArchiveEntry(const wchar_t* folder,
+                      wchar_t driveLetter,
+                      const wchar_t* path,
+                      ArchiveEntry* entry)
+{
+    ArchiveMatch match = { 0 };
+    match.path = path;
+    if ((listArchive(folder, driveLetter, findArchiveMatch, &match) == FALSE) ||
+        (match.found == FALSE))
+    {
+        return FALSE;
+    }
+    *entry = match.entry;
+    return TRUE;
+}
+
+/// @brief walks an index to the end of its last whole record
+/// @param hIndex the index, past its header
+/// @param size its size in bytes
+/// @param end receives the offset after the last whole record
+/// @return TRUE if the index could be read, FALSE if not
+static BOOL findArchiveIndexEnd(HANDLE hIndex,
+                                ULONGLONG size,
+                                ULONGLONG* end)
+{
+    ULONGLONG offset = sizeof(ArchiveHeader);
+    while (offset + sizeof(ArchiveEntry) <= size)
+    {
+        ArchiveEntry entry = { 0 };
+        DWORD bytesRead = 0;
+        LARGE_INTEGER position = { 0 };
+        position.QuadPart = (LONGLONG) offset;
+        if ((SetFilePointerEx(hIndex, position, NULL, FILE_BEGIN) == FALSE) ||
+            (ReadFile(hIndex, &entry, sizeof(entry), &bytesRead, NULL) == FALSE))
+        {
+            return FALSE;
+        }
+        ULONGLONG recordBytes = sizeof(entry) + (ULONGLONG) entry.pathLength * sizeof(wchar_t);
+        if ((bytesRead != sizeof(entry)) ||
+            (entry.pathLength >= BIN_PATH_MAX_CCH) ||
+            (offset + recordBytes > size))
+        {
+            break;
+        }
+        offset += recordBytes;
+    }
+    *end = offset;
+    return TRUE;
+}
+
+/// @brief keeps a record if it has the path findArchiveEntry() looks for.
+/// Records are appended, so the last one to match is the newest.
+/// @param entry the record
+/// @param path its path
+/// @param context the ArchiveMatch
+/// @return TRUE to keep listing
+static BOOL findArchiveMatch(const ArchiveEntry* entry,
+                             const wchar_t* path,
+                             void* context)
+{
+    ArchiveMatch* match = (ArchiveMatch*) context;
+    if (_wcsicmp(path, match->path) == 0)
+    {
+        match->entry = *entry;
+        match->found = TRUE;
+    }
+    return TRUE;
+}
+
+/// @brief writes the index record of a file whose frames are all written,
+/// then lets it go
+/// @param writer the writer
+/// @param pending the file
+static void finishArchivePending(ArchiveWriter* writer,
+                                 ArchivePending* pending)
+{
+    ArchiveVolume* volume = &writer->volumes[pending->volume];
+
+    // After a failure its frames may not all have been written
+    if ((pending->readFailed == FALSE) &&
+        (writer->failed == FALSE))
+    {
+        DWORD pathBytes = pending->entry.pathLength * sizeof(wchar_t);
+        if (writeArchiveBytes(volume->hIndex, &pending->entry, sizeof(ArchiveEntry)) &&
+            writeArchiveBytes(volume->hIndex, pending->path, pathBytes))
+        {
+            volume->indexEnd += sizeof(ArchiveEntry) + pathBytes;
+            writer->files++;
+            writer->rawBytes += pending->entry.rawBytes;
+        }
+        else
+        {
+            // Cut off whatever part of the record made it to the file
+            LARGE_INTEGER end = { 0 };
+            end.QuadPart = (LONGLONG) volume->indexEnd;
+            SetFilePointerEx(volume->hIndex,
+                             end,
+                             NULL,
+                             FILE_BEGIN);
+            SetEndOfFile(volume->hIndex);
+            writer->failed = TRUE;
+        }
+    }
+    HeapFree(GetProcessHeap(),
+             0,
+             pending->path);
+    HeapFree(GetProcessHeap(),
+             0,
+             pending);
+}
+
+/// @brief compresses the queued frames in parallel and writes them out in
+/// the order they were queued
+/// @param writer the writer
+/// @return TRUE if every frame was written, FALSE if not
+static BOOL flushArchiveFrames(ArchiveWriter* writer)
+{
+    if (writer->frameCount == 0)
+    {
+        return (writer->failed == FALSE);
+    }
+    parallelFor(writer->frameCount,
+                writer->threads,
+                compressArchiveFrame,
+                writer);
+    for (DWORD i = 0; i < writer->frameCount; i++)
+    {
+        ArchiveFrame* frame = &writer->frames[i];
+        ArchivePending* pending = frame->pending;
+        ArchiveVolume* volume = &writer->volumes[pending->volume];
+        ArchiveFrameHeader header = { frame->storedBytes, frame->rawBytes };
+        const BYTE* data = (frame->storedBytes < frame->rawBytes) ? frame->stored : frame->raw;
+        if (pending->entry.frames == 0)
+        {
+            pending->entry.offset = volume->dataEnd;
+        }
+        if ((writer->failed == FALSE) &&
+            writeArchiveBytes(volume->hData, &header, sizeof(header)) &&
+            writeArchiveBytes(volume->hData, data, frame->storedBytes))
+        {
+            volume->dataEnd += sizeof(header) + frame->storedBytes;
+            writer->storedBytes += sizeof(header) + frame->storedBytes;
+        }
+        else
+        {
+            writer->failed = TRUE;
+        }
+        pending->entry.frames++;
+        pending->entry.storedBytes += sizeof(header) + frame->storedBytes;
+        pending->queued--;
+        if (pending->complete && (pending->queued == 0))
+        {
+            finishArchivePending(writer,
+                                 pending);
+        }
+        frame->pending = NULL;
+    }
+    writer->frameCount = 0;
+    return (writer->failed == FALSE);
+}
+
+/// @brief fills a buffer with synthetic content for benchmarkArchive()
+/// @param buffer receives the content, ARCHIVE_BENCH_FILE_MB megabytes
+/// @param seed the file's number, which decides its size and content
+/// @return the size of the content in bytes
+static DWORD generateArchiveContent(BYTE* buffer,
+                                    DWORD seed)
+{
+    static const char* words[] = { "the ", "bin ", "item ", "deleted ", "from ", "volume ",
+                                   "report ", "quarterly ", "draft ", "final ", "and ", "of ",
+                                   "project ", "notes ", "meeting ", "2024 ", "budget ", "\r\n" };
+    ULONGLONG state = 0x9E3779B97F4A7C15ULL * (seed + 1);
+    DWORD bytes = 1 + (DWORD) (((seed * 2654435761U) % (ARCHIVE_BENCH_FILE_MB * 1024)) * 1024);
+    for (DWORD position = 0; position < bytes;)
+    {
+        // xorshift64
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        if ((seed % 3) == 0)
+        {
+            const char* word = words[state % ARRAYSIZE(words)];
+            for (; (*word != 0) && (position < bytes); word++)
+            {
+                buffer[position++] = (BYTE) *word;
+            }
+        }
+        else if ((seed % 3) == 1)
+        {
+            char line[80] = { 0 };
+            int length = _snprintf(line,
+                                   ARRAYSIZE(line),
+                                   "2024-06-%02u 12:%02u:%02u INFO moved item %u to bin\r\n",
+                                   (DWORD) (1 + (position / 65536) % 28),
+                                   (DWORD) ((position / 1024) % 60),
+                                   (DWORD) ((position / 16) % 60),
+                                   (DWORD) (state % 1000));
+            for (int i = 0; (i < length) && (position < bytes); i++)
+            {
+                buffer[position++] = (BYTE) line[i];
+            }
+        }
+        else
+        {
+            for (DWORD i = 0; (i < 8) && (position < bytes); i++)
+            {
+                buffer[position++] = (BYTE) (state >> (i * 8));
+            }
+        }
+    }
+    return bytes;
+}
+
+/// @brief gets the folder archives go in, from Settings.ini
+/// @param folder receives the folder, without a trailing backslash
+/// @param cchFolder the size of folder in characters
+/// @return TRUE on success, FALSE if there is no folder
+BOOL getArchiveFolder(wchar_t* folder,
+                      size_t cchFolder)
+{
+    if (getIniString(INI_KEY_ARCHIVE_FOLDER,
+                     folder,
+                     (DWORD) cchFolder) == FALSE)
+    {
+        if (getAppDataFilePath(L"",
+                               folder,
+                               cchFolder) == FALSE)
+        {
+            return FALSE;
+        }
+    }
+    size_t length = wcslen(folder);
+    if ((length > 0) && (folder[length - 1] == L'\\'))
+    {
+        folder[length - 1] = 0;
+    }
+    return (folder[0] != 0);
+}
+
+/// @brief checks if purged and reclaimed items are archived, from Settings.ini
+/// @param none
+/// @return TRUE if they are
+BOOL isArchiveEnabled(void)
+{
+    return (getIniInt(INI_KEY_ARCHIVE_PURGED, INI_DEFAULT_VALUE_ARCHIVE_PURGED) > 0);
+}
+
+/// @brief reads every record in a volume's archive index
+/// @param folder the archive folder
+/// @param driveLetter the volume
+/// @param callback called for every record, with its path
+/// @param context passed to the callback
+/// @return TRUE if the index was read, FALSE if it could not be opened or
+///         is not an archive index. A record cut short by a crash that no
+///         writer has cut off yet ends the list without an error.
+BOOL listArchive(const wchar_t* folder,
+                 wchar_t driveLetter,
+                 ArchiveEntryCallback callback,
+                 void* context)
+{
+    wchar_t indexPath[MAX_PATH + 1] = { 0 };
+    if (buildArchivePath(folder,
+                         ARCHIVE_INDEX_FORMAT,
+                         driveLetter,
+                         indexPath) == FALSE)
+    {
+        return FALSE;
+    }
+    HANDLE hIndex = CreateFileW(indexPath,
+                                GENERIC_READ,
+                                FILE_SHARE_READ | FILE_SHARE_WRITE,
+                                NULL,
+                                OPEN_EXISTING,
+                                FILE_FLAG_SEQUENTIAL_SCAN,
+                                NULL);
+    if (hIndex == INVALID_HANDLE_VALUE)
+    {
+        return FALSE;
+    }
+    wchar_t* path = HeapAlloc(GetProcessHeap(),
+                              0,
+                              BIN_PATH_MAX_CCH * sizeof(wchar_t));
+    ArchiveHeader header = { 0 };
+    DWORD bytesRead = 0;
+    BOOL result = (path != NULL) &&
+        ReadFile(hIndex, &header, sizeof(header), &bytesRead, NULL) &&
+        (bytesRead == sizeof(header)) &&
+        (header.magic == ARCHIVE_MAGIC) &&
+        (header.version == ARCHIVE_VERSION);
+    while (result)
+    {
+        ArchiveEntry entry = { 0 };
+        if ((ReadFile(hIndex, &entry, sizeof(entry), &bytesRead, NULL) == FALSE) ||
+            (bytesRead != sizeof(entry)) ||
+            (entry.pathLength >= BIN_PATH_MAX_CCH) ||
+            (ReadFile(hIndex, path, entry.pathLength * sizeof(wchar_t), &bytesRead, NULL) == FALSE) ||
+            (bytesRead != entry.pathLength * sizeof(wchar_t)))
+        {
+            break;
+        }
+        path[entry.pathLength] = 0;
+        if (callback(&entry, path, context) == FALSE)
+        {
+            break;
+        }
+    }
+    if (path != NULL)
+    {
+        HeapFree(GetProcessHeap(),
+                 0,
+                 path);
+    }
+    CloseHandle(hIndex);
+    return result;
+}
+
+/// @brief opens a volume's archive the first time something is added to it,
+/// creating it if needed, ready to append to. An archive that has reached
+/// the writer's cap is rotated out first, and a record torn by a crash is
+/// cut off the end of the index.
+/// @param writer the writer
+/// @param volume 0 for A:
+/// @return TRUE if the archive is open, FALSE if not
+static BOOL openArchiveVolume(ArchiveWriter* writer,
+                              DWORD volume)
+{
+    ArchiveVolume* archive = &writer->volumes[volume];
+    if (archive->hData != INVALID_HANDLE_VALUE)
+    {
+        return TRUE;
+    }
+    HANDLE handles[2] = { INVALID_HANDLE_VALUE, INVALID_HANDLE_VALUE };
+    const wchar_t* formats[2] = { ARCHIVE_DATA_FORMAT, ARCHIVE_INDEX_FORMAT };
+    LARGE_INTEGER sizes[2] = { 0 };
+    wchar_t dataPath[MAX_PATH + 1] = { 0 };
+    WIN32_FILE_ATTRIBUTE_DATA dataAttributes = { 0 };
+    if ((writer->maxBytes > 0) &&
+        buildArchivePath(writer->folder, ARCHIVE_DATA_FORMAT, (wchar_t) (L'A' + volume), dataPath) &&
+        GetFileAttributesExW(dataPath, GetFileExInfoStandard, &dataAttributes) &&
+        ((((ULONGLONG) dataAttributes.nFileSizeHigh << 32) | dataAttributes.nFileSizeLow) >= writer->maxBytes))
+    {
+        if (rotateArchive(writer->folder,
+                          (wchar_t) (L'A' + volume)) == FALSE)
+        {
+            return FALSE;
+        }
+        LOG(L"Rotated %s after it reached %llu bytes\n",
+            dataPath,
+            writer->maxBytes);
+    }
+    for (DWORD i = 0; i < ARRAYSIZE(handles); i++)
+    {
+        wchar_t path[MAX_PATH + 1] = { 0 };
+        if (buildArchivePath(writer->folder, formats[i], (wchar_t) (L'A' + volume), path))
+        {
+            handles[i] = CreateFileW(path,
+                                     GENERIC_READ | GENERIC_WRITE,
+                                     FILE_SHARE_READ,
+                                     NULL,
+                                     OPEN_ALWAYS,
+                                     FILE_ATTRIBUTE_NORMAL,
+                                     NULL);
+        }
+        if (handles[i] == INVALID_HANDLE_VALUE)
+        {
+            break;
+        }
+
+        // A new file gets a header, anything else must already have one
+        ArchiveHeader header = { ARCHIVE_MAGIC, ARCHIVE_VERSION };
+        ArchiveHeader existing = { 0 };
+        DWORD bytesRead = 0;
+        BOOL valid = GetFileSizeEx(handles[i], &sizes[i]);
+        if (valid && (sizes[i].QuadPart == 0))
+        {
+            valid = writeArchiveBytes(handles[i], &header, sizeof(header));
+            sizes[i].QuadPart = sizeof(header);
+        }
+        else if (valid)
+        {
+            ULONGLONG end = (ULONGLONG) sizes[i].QuadPart;
+            valid = ReadFile(handles[i], &existing, sizeof(existing), &bytesRead, NULL) &&
+                (bytesRead == sizeof(existing)) &&
+                (memcmp(&existing, &header, sizeof(header)) == 0) &&
+                ((i == 0) || findArchiveIndexEnd(handles[i], end, &end));
+            if (valid && (end < (ULONGLONG) sizes[i].QuadPart))
+            {
+                LOG(L"Cutting a torn record off the end of %s\n",
+                    path);
+            }
+
+            // Frames past the last record are never read, so only the index
+            // needs cutting
+            sizes[i].QuadPart = (LONGLONG) end;
+            valid = valid &&
+                SetFilePointerEx(handles[i], sizes[i], NULL, FILE_BEGIN) &&
+                SetEndOfFile(handles[i]);
+        }
+        if (valid == FALSE)
+        {
+            LOG(L"%s is not an archive this version can add to\n",
+                path);
+            CloseHandle(handles[i]);
+            handles[i] = INVALID_HANDLE_VALUE;
+            break;
+        }
+    }
+    if ((handles[0] == INVALID_HANDLE_VALUE) || (handles[1] == INVALID_HANDLE_VALUE))
+    {
+        if (handles[0] != INVALID_HANDLE_VALUE)
+        {
+            CloseHandle(handles[0]);
+        }
+        return FALSE;
+    }
+    archive->hData = handles[0];
+    archive->hIndex = handles[1];
+    archive->dataEnd = (ULONGLONG) sizes[0].QuadPart;
+    archive->indexEnd = (ULONGLONG) sizes[1].QuadPart;
+    return TRUE;
+}
+
+/// @brief starts a writer with its frame buffers and compressors
+/// @param writer receives the writer. Close it with closeArchiveWriter()
+/// even if this fails.
+/// @param folder where the archives are, which must exist
+/// @param threads the most compression workers
+/// @return TRUE on success, FALSE if memory or compressors ran out
+BOOL openArchiveWriter(ArchiveWriter* writer,
+                       const wchar_t* folder,
+                       DWORD threads)
+{
+    memset(writer,
+           0,
+           sizeof(ArchiveWriter));
+    for (DWORD i = 0; i < ARCHIVE_VOLUMES; i++)
+    {
+        writer->volumes[i].hData = INVALID_HANDLE_VALUE;
+        writer->volumes[i].hIndex = INVALID_HANDLE_VALUE;
+    }
+    wcsncpy(writer->folder,
+            folder,
+            MAX_PATH);
+    writer->threads = max(threads, 1);
+    int maxMegabytes = getIniInt(INI_KEY_ARCHIVE_MAX_MEGABYTES,
+                                 INI_DEFAULT_VALUE_ARCHIVE_MAX_MEGABYTES);
+    writer->maxBytes = (maxMegabytes > 0) ? (ULONGLONG) maxMegabytes * 1048576 : 0;
+    writer->path = HeapAlloc(GetProcessHeap(),
+                             0,
+                             BIN_PATH_MAX_CCH * sizeof(wchar_t));
+    writer->info = HeapAlloc(GetProcessHeap(),
+                             0,
+                             BIN_INFO_MAX_SIZE);
+    BOOL result = (writer->path != NULL) && (writer->info != NULL);
+    for (DWORD i = 0; result && (i < ARCHIVE_BATCH_FRAMES); i++)
+    {
+        ArchiveFrame* frame = &writer->frames[i];
+        frame->raw = HeapAlloc(GetProcessHeap(),
+                               0,
+                               ARCHIVE_FRAME_BYTES);
+        frame->stored = HeapAlloc(GetProcessHeap(),
+                                  0,
+                                  ARCHIVE_FRAME_BYTES);
+        result = (frame->raw != NULL) &&
+            (frame->stored != NULL) &&
+            CreateCompressor(ARCHIVE_ALGORITHM, NULL, &frame->hCompressor);
+    }
+    writer->failed = (result == FALSE);
+    return result;
+}
+
+/// @brief renames a volume's archive to the first generation number that is
+/// not taken, so that no earlier generation is ever replaced
+/// @param folder the archive folder
+/// @param driveLetter the volume
+/// @return TRUE if it was renamed, FALSE if not, in which case the archive
+///         is where it was
+static BOOL rotateArchive(const wchar_t* folder,
+                          wchar_t driveLetter)
+{
+    const wchar_t* formats[2] = { ARCHIVE_DATA_FORMAT, ARCHIVE_INDEX_FORMAT };
+    const wchar_t* rotatedFormats[2] = { ARCHIVE_ROTATED_DATA_FORMAT, ARCHIVE_ROTATED_INDEX_FORMAT };
+    wchar_t paths[2][MAX_PATH + 1] = { 0 };
+    wchar_t rotatedPaths[2][MAX_PATH + 1] = { 0 };
+    for (DWORD i = 0; i < ARRAYSIZE(formats); i++)
+    {
+        if (buildArchivePath(folder, formats[i], driveLetter, paths[i]) == FALSE)
+        {
+            return FALSE;
+        }
+    }
+    DWORD generation = 1;
+    for (; generation <= ARCHIVE_MAX_GENERATIONS; generation++)
+    {
+        BOOL unused = TRUE;
+        for (DWORD i = 0; i < ARRAYSIZE(formats); i++)
+        {
+            wchar_t name[MAX_PATH + 1] = { 0 };
+            _snwprintf(name,
+                       ARRAYSIZE(name),
+                       rotatedFormats[i],
+                       towupper(driveLetter),
+                       generation);
+            int written = _snwprintf(rotatedPaths[i],
+                                     MAX_PATH + 1,
+                                     L"%s\\%s",
+                                     folder,
+                                     name);
+            rotatedPaths[i][MAX_PATH] = 0;
+            if ((written < 0) || (written > MAX_PATH))
+            {
+                return FALSE;
+            }
+            unused = unused && (GetFileAttributesW(rotatedPaths[i]) == INVALID_FILE_ATTRIBUTES);
+        }
+        if (unused)
+        {
+            break;
+        }
+    }
+    if (generation > ARCHIVE_MAX_GENERATIONS)
+    {
+        LOG(L"Every generation of %s is taken, so it is not rotated\n",
+            paths[0]);
+        return FALSE;
+    }
+
+    // The index goes first and comes back if the data file can't follow, so
+    // an index is never paired with the wrong data file
+    if (MoveFileExW(paths[1], rotatedPaths[1], 0) == FALSE)
+    {
+        LOG(L"Failed to rotate %s, error code %d\n",
+            paths[1],
+            GetLastError());
+        return FALSE;
+    }
+    if (MoveFileExW(paths[0], rotatedPaths[0], 0) == FALSE)
+    {
+        LOG(L"Failed to rotate %s, error code %d\n",
+            paths[0],
+            GetLastError());
+        MoveFileExW(rotatedPaths[1],
+                    paths[1],
+                    0);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/// @brief writes a whole buffer to a file
+/// @param hFile the file
+/// @param buffer what to write
+/// @param bytes how much
+/// @return TRUE if all of it was written, FALSE if not
+static BOOL writeArchiveBytes(HANDLE hFile,
+                              const void* buffer,
+                              DWORD bytes)
+{
+    DWORD bytesWritten = 0;
+    return (WriteFile(hFile, buffer, bytes, &bytesWritten, NULL) &&
+            (bytesWritten == bytes));
+}
+
+/// @brief prints one record for /listarchive: when the item was deleted,
+/// its size, how much it takes in the archive and its original path
+/// @param entry the record
+/// @param path its path
+/// @param context unused
+/// @return TRUE to keep listing
+BOOL writeArchiveEntry(const ArchiveEntry* entry,
+                       const wchar_t* path,
+                       void* context)
+{
+    UNREFERENCED_PARAMETER(context);
+    wchar_t deleted[64] = { 0 };
+    formatFileTime(entry->deletionTime,
+                   deleted,
+                   ARRAYSIZE(deleted));
+    writeOutput(L"%s %14llu %14llu %s%s\n",
+                deleted,
+                entry->rawBytes,
+                entry->storedBytes,
+                path,
+                (entry->attributes & FILE_ATTRIBUTE_DIRECTORY) ? L"\\" : L"");
+    return TRUE;
+}
+
+#ifndef NDEBUG
+/// @brief keeps the records listed by testArchive()
+/// @param entry the record
+/// @param path its path
+/// @param context the ArchiveTestList
+/// @return TRUE to keep listing
+static BOOL collectTestEntry(const ArchiveEntry* entry,
+                             const wchar_t* path,
+                             void* context)
+{
+    ArchiveTestList* list = (ArchiveTestList*) context;
+    assert(wcsncmp(path, L"C:\\Docs\\", 8) == 0);
+    if (list->count < ARRAYSIZE(list->entries))
+    {
+        list->entries[list->count] = *entry;
+    }
+    list->count++;
+    return TRUE;
+}
+
+/// @brief creates a file with some contents for testArchive()
+/// @param path the file
+/// @param contents what to write
+/// @param bytes how much
+static void createTestArchiveFile(const wchar_t* path,
+                                  const BYTE* contents,
+                                  DWORD bytes)
+{
+    HANDLE hFile = CreateFileW(path,
+                               GENERIC_WRITE,
+                               0,
+                               NULL,
+                               CREATE_ALWAYS,
+                               FILE_ATTRIBUTE_NORMAL,
+                               NULL);
+    assert(hFile != INVALID_HANDLE_VALUE);
+    BOOL result = writeArchiveBytes(hFile,
+                                    contents,
+                                    bytes);
+    assert(result);
+    CloseHandle(hFile);
+}
+#endif
+
+/// @brief archives a file of several frames and a folder item, then lists
+/// and extracts them in a debug build, returns immediately in a release
+/// build
+/// @param none
+void testArchive(void)
+{
+#ifndef NDEBUG
+    wchar_t tempDirectory[MAX_PATH + 1] = { 0 };
+    wchar_t root[MAX_PATH + 1] = { 0 };
+    wchar_t path[MAX_PATH + 1] = { 0 };
+    GetTempPathW(ARRAYSIZE(tempDirectory),
+                 tempDirectory);
+    _snwprintf(root,
+               ARRAYSIZE(root),
+               L"%srbmarchive%08X",
+               tempDirectory,
+               GetCurrentProcessId());
+    root[MAX_PATH] = 0;
+    deleteTree(root, NULL);
+    BOOL result = CreateDirectoryW(root,
+                                   NULL);
+    assert(result);
+
+    // A file of two and a half frames, runs of letters then random bytes
+    // so one frame compresses and two are stored, and a folder with a file, an
+    // empty file and an empty folder in it
+    DWORD bigBytes = (ARCHIVE_FRAME_BYTES * 5) / 2;
+    BYTE* big = HeapAlloc(GetProcessHeap(),
+                          0,
+                          bigBytes);
+    BYTE* info = HeapAlloc(GetProcessHeap(),
+                           0,
+                           BIN_INFO_MAX_SIZE);
+    assert((big != NULL) && (info != NULL));
+    ULONGLONG state = 1;
+    for (DWORD i = 0; i < bigBytes; i++)
+    {
+        state = (state * 6364136223846793005ULL) + 1442695040888963407ULL;
+        big[i] = (i < ARCHIVE_FRAME_BYTES) ? (BYTE) ('a' + ((i / 4096) % 26)) : (BYTE) (state >> 56);
+    }
+    DWORD infoBytes = buildBinInfo(info, L"C:\\Docs\\big.bin", bigBytes, 1000);
+    _snwprintf(path, ARRAYSIZE(path), L"%s\\$IAAAAAA.bin", root);
+    createTestArchiveFile(path, info, infoBytes);
+    _snwprintf(path, ARRAYSIZE(path), L"%s\\$RAAAAAA.bin", root);
+    createTestArchiveFile(path, big, bigBytes);
+    infoBytes = buildBinInfo(info, L"C:\\Docs\\Folder", 5, 2000);
+    _snwprintf(path, ARRAYSIZE(path), L"%s\\$IBBBBBB", root);
+    createTestArchiveFile(path, info, infoBytes);
+    _snwprintf(path, ARRAYSIZE(path), L"%s\\$RBBBBBB", root);
+    result = CreateDirectoryW(path,
+                              NULL);
+    assert(result);
+    _snwprintf(path, ARRAYSIZE(path), L"%s\\$RBBBBBB\\hello.txt", root);
+    createTestArchiveFile(path, (const BYTE*) "hello", 5);
+    _snwprintf(path, ARRAYSIZE(path), L"%s\\$RBBBBBB\\empty.txt", root);
+    createTestArchiveFile(path, (const BYTE*) "", 0);
+    _snwprintf(path, ARRAYSIZE(path), L"%s\\$RBBBBBB\\sub", root);
+    result = CreateDirectoryW(path,
+                              NULL);
+    assert(result);
+
+    // Archiving the folder twice appends to what is there
+    ArchiveWriter* writer = HeapAlloc(GetProcessHeap(),
+                                      0,
+                                      sizeof(ArchiveWriter));
+    assert(writer != NULL);
+    for (DWORD pass = 0; pass < 2; pass++)
+    {
+        result = openArchiveWriter(writer,
+                                   root,
+                                   2);
+        assert(result);
+        result = archiveBinFolder(writer,
+                                  L't',
+                                  root);
+        assert(result);
+        result = closeArchiveWriter(writer);
+        assert(result);
+        assert(writer->files == 5);
+        assert(writer->rawBytes == bigBytes + 5);
+        assert(writer->storedBytes < bigBytes);
+    }
+
+    // Records are written as files finish, so the order within a pass
+    // depends on when frames were flushed
+    ArchiveTestList list = { 0 };
+    result = listArchive(root,
+                         L'T',
+                         collectTestEntry,
+                         &list);
+    assert(result);
+    assert(list.count == 10);
+    DWORD bigIndex = ARRAYSIZE(list.entries);
+    DWORD helloIndex = ARRAYSIZE(list.entries);
+    for (DWORD i = 0; i < list.count; i++)
+    {
+        const ArchiveEntry* entry = &list.entries[i];
+        if (entry->rawBytes == bigBytes)
+        {
+            assert((entry->frames == 3) && (entry->deletionTime == 1000));
+            bigIndex = i; // The last one, in the second pass
+        }
+        else if ((entry->rawBytes == 5) && (helloIndex == ARRAYSIZE(list.entries)))
+        {
+            assert((entry->frames == 1) && (entry->deletionTime == 2000));
+            helloIndex = i;
+        }
+    }
+    assert((bigIndex >= 5) && (helloIndex < 5));
+
+    // The second copy of the big file is extracted from the middle
+    _snwprintf(path, ARRAYSIZE(path), L"%s\\out.bin", root);
+    result = extractArchiveEntry(root,
+                                 L'T',
+                                 &list.entries[bigIndex],
+                                 path);
+    assert(result);
+    HANDLE hFile = CreateFileW(path,
+                               GENERIC_READ,
+                               0,
+                               NULL,
+                               OPEN_EXISTING,
+                               FILE_FLAG_DELETE_ON_CLOSE,
+                               NULL);
+    assert(hFile != INVALID_HANDLE_VALUE);
+    BYTE* check = HeapAlloc(GetProcessHeap(),
+                            0,
+                            bigBytes + 1);
+    assert(check != NULL);
+    DWORD bytesRead = 0;
+    ReadFile(hFile,
+             check,
+             bigBytes + 1,
+             &bytesRead,
+             NULL);
+    CloseHandle(hFile);
+    assert((bytesRead == bigBytes) && (memcmp(check, big, bigBytes) == 0));
+    ArchiveEntry entry = { 0 };
+    result = findArchiveEntry(root,
+                              L'T',
+                              L"c:\\docs\\folder\\HELLO.TXT",
+                              &entry);
+    assert(result);
+    assert((entry.rawBytes == 5) && (entry.offset > list.entries[helloIndex].offset));
+    _snwprintf(path, ARRAYSIZE(path), L"%s\\hello.txt", root);
+    result = extractArchiveEntry(root,
+                                 L'T',
+                                 &entry,
+                                 path);
+    assert(result);
+
+    // Past the cap, the archive is rotated before it is added to
+    result = openArchiveWriter(writer,
+                               root,
+                               2);
+    assert(result);
+    writer->maxBytes = 1;
+    result = archiveBinFolder(writer,
+                              L't',
+                              root);
+    assert(result);
+    result = closeArchiveWriter(writer);
+    assert(result);
+    ArchiveTestList rotated = { 0 };
+    result = listArchive(root,
+                         L'T',
+                         collectTestEntry,
+                         &rotated);
+    assert(result);
+    assert(rotated.count == 5);
+    _snwprintf(path, ARRAYSIZE(path), L"%s\\" ARCHIVE_ROTATED_DATA_FORMAT, root, L'T', 1);
+    assert(GetFileAttributesW(path) != INVALID_FILE_ATTRIBUTES);
+    _snwprintf(path, ARRAYSIZE(path), L"%s\\" ARCHIVE_ROTATED_INDEX_FORMAT, root, L'T', 1);
+    assert(GetFileAttributesW(path) != INVALID_FILE_ATTRIBUTES);
+
+    // A torn record is cut off before the next ones are appended
+    BYTE torn[sizeof(ArchiveEntry) / 2] = { 0 };
+    _snwprintf(path, ARRAYSIZE(path), L"%s\\" ARCHIVE_INDEX_FORMAT, root, L'T');
+    hFile = CreateFileW(path,
+                        GENERIC_WRITE,
+                        0,
+                        NULL,
+                        OPEN_EXISTING,
+                        FILE_ATTRIBUTE_NORMAL,
+                        NULL);
+    assert(hFile != INVALID_HANDLE_VALUE);
+    LARGE_INTEGER zero = { 0 };
+    result = SetFilePointerEx(hFile,
+                              zero,
+                              NULL,
+                              FILE_END) &&
+        writeArchiveBytes(hFile,
+                          torn,
+                          sizeof(torn));
+    assert(result);
+    CloseHandle(hFile);
+    result = openArchiveWriter(writer,
+                               root,
+                               2);
+    assert(result);
+    result = archiveBinFolder(writer,
+                              L't',
+                              root);
+    assert(result);
+    result = closeArchiveWriter(writer);
+    assert(result);
+    ArchiveTestList appended = { 0 };
+    result = listArchive(root,
+                         L'T',
+                         collectTestEntry,
+                         &appended);
+    assert(result);
+    assert(appended.count == 10);
+
+    HeapFree(GetProcessHeap(), 0, check);
+    HeapFree(GetProcessHeap(), 0, writer);
+    HeapFree(GetProcessHeap(), 0, info);
+    HeapFree(GetProcessHeap(), 0, big);
+    result = deleteTree(root, NULL);
+    assert(result);
+#endif
+}
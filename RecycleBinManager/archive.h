@@ -0,0 +1,162 @@
+#define _CRT_SECURE_NO_WARNINGS
+
+#pragma once
+#include <Windows.h>
+#include <compressapi.h>
+#include <stdio.h>
+#include <wctype.h>
+#include <assert.h>
+#include "bin.h"
+#include "maintenance.h"
+
+// Archive parameters. With ArchivePurged set, items are copied into a
+// compressed archive before a purge or the reclaimer deletes them. Each
+// volume has its own archive in ArchiveFolder, or the app data folder if
+// that is not set: a data file of compressed frames and an index file with
+// one record for every file and folder. Files are cut into frames of up
+// to ARCHIVE_FRAME_BYTES that are compressed on their own, so a single file
+// is extracted by seeking to its first frame and reading only its frames.
+// Frames are queued in batches that are compressed in parallel, each slot
+// with its own compressor, and written in order. A file's index record is
+// only written once its last frame is, and the originals are only deleted
+// once both files are flushed, so a failure leaves the item in the bin.
+// A record that could not be written in full is cut off again, and one
+// torn by a crash is cut off the next time the archive is opened, so new
+// records always follow the last whole one.
+// An archive whose data file has passed ArchiveMaxMegabytes when a writer
+// first adds to it is renamed to the next free generation number of its
+// volume, oldest first, and a new archive is started. Rotated archives are
+// never deleted or replaced here; once every number is taken, nothing more
+// is archived onto that volume. A purge that frees space on a low volume
+// does not archive items onto that same volume, and one that cannot tell
+// which volume the archive is on leaves its items in the bin.
+
+#define ARCHIVE_DATA_FORMAT     L"Archive-%c.rbma" // Followed by the drive letter
+#define ARCHIVE_INDEX_FORMAT    L"Archive-%c.rbmi"
+#define ARCHIVE_ROTATED_DATA_FORMAT  L"Archive-%c.%lu.rbma" // Followed by the generation
+#define ARCHIVE_ROTATED_INDEX_FORMAT L"Archive-%c.%lu.rbmi"
+#define ARCHIVE_MAX_GENERATIONS      9999
+#define ARCHIVE_MAGIC           0x41424D52 // "RMBA" when read as bytes
+#define ARCHIVE_VERSION         1
+#define ARCHIVE_ALGORITHM       COMPRESS_ALGORITHM_XPRESS_HUFF
+#define ARCHIVE_FRAME_BYTES     (1024 * 1024)
+#define ARCHIVE_BATCH_FRAMES    16 // Frames compressed in parallel
+#define ARCHIVE_VOLUMES         26 // One for each drive letter
+#define ARCHIVE_BENCH_MEGABYTES 256
+#define ARCHIVE_BENCH_FILE_MB   8 // Largest synthetic file
+
+// Structs
+
+typedef struct ArchiveHeader // Starts both the data and the index file
+{
+    DWORD magic; // Always ARCHIVE_MAGIC
+    DWORD version; // Always ARCHIVE_VERSION
+} ArchiveHeader;
+
+typedef struct ArchiveFrameHeader // Precedes each frame in the data file
+{
+    DWORD storedBytes; // Bytes that follow
+    DWORD rawBytes; // Bytes once decompressed, the same if stored as is
+} ArchiveFrameHeader;
+
+typedef struct ArchiveEntry // One index record, followed by the path
+{
+    ULONGLONG offset; // Of the first frame in the data file
+    ULONGLONG rawBytes; // Size of the file
+    ULONGLONG storedBytes; // Size of its frames, with their headers
+    ULONGLONG deletionTime; // FILETIME from the $I file
+    ULONGLONG archiveTime; // FILETIME the item was archived
+    DWORD frames;
+    DWORD attributes;
+    DWORD pathLength; // Characters in the path, which is not terminated
+    DWORD reserved;
+} ArchiveEntry;
+
+/// @brief called once for every record in an index
+/// @return TRUE to continue listing, FALSE to stop
+typedef BOOL (*ArchiveEntryCallback)(const ArchiveEntry* entry, const wchar_t* path,
+                                     void* context);
+
+typedef struct ArchivePending // A file whose frames are not all written yet
+{
+    ArchiveEntry entry;
+    wchar_t* path; // On the process heap
+    DWORD volume;
+    DWORD queued; // Frames still in the batch
+    BOOL complete; // Every frame has been queued
+    BOOL readFailed; // The file could not be read in full, so it gets no record
+} ArchivePending;
+
+typedef struct ArchiveFrame
+{
+    BYTE* raw; // ARCHIVE_FRAME_BYTES
+    BYTE* stored; // ARCHIVE_FRAME_BYTES, compressed
+    DWORD rawBytes;
+    DWORD storedBytes; // rawBytes if the frame did not compress
+    COMPRESSOR_HANDLE hCompressor; // Only ever used by this slot
+    ArchivePending* pending; // The file it belongs to
+} ArchiveFrame;
+
+typedef struct ArchiveVolume
+{
+    HANDLE hData; // INVALID_HANDLE_VALUE until the volume is first archived
+    HANDLE hIndex;
+    ULONGLONG dataEnd;
+    ULONGLONG indexEnd; // End of the last whole record
+} ArchiveVolume;
+
+typedef struct ArchiveWriter
+{
+    wchar_t folder[MAX_PATH + 1];
+    ArchiveVolume volumes[ARCHIVE_VOLUMES];
+    ArchiveFrame frames[ARCHIVE_BATCH_FRAMES];
+    DWORD frameCount; // Frames queued in the batch
+    DWORD threads;
+    wchar_t* path; // BIN_PATH_MAX_CCH, built up while walking a folder item
+    BYTE* info; // BIN_INFO_MAX_SIZE, for reading $I files
+    ULONGLONG files; // Index records written
+    ULONGLONG rawBytes;
+    ULONGLONG storedBytes;
+    ULONGLONG maxBytes; // A data file this large is rotated before it is added to, 0 for no cap
+    BOOL failed; // Something could not be written, nothing may be deleted
+} ArchiveWriter;
+
+typedef struct ArchiveMatch // What findArchiveEntry() looks for and finds
+{
+    const wchar_t* path;
+    ArchiveEntry entry;
+    BOOL found;
+} ArchiveMatch;
+
+typedef struct ArchiveBenchmark
+{
+    ULONGLONG files;
+    ULONGLONG rawBytes;
+    ULONGLONG storedBytes;
+    double archiveSeconds;
+    double extractSeconds;
+    BOOL verified; // Every file extracted matched what was archived
+} ArchiveBenchmark;
+
+// Functions
+
+BOOL archiveBinFolder(ArchiveWriter* writer, wchar_t driveLetter, const wchar_t* folder);
+BOOL archiveBinItem(ArchiveWriter* writer, wchar_t driveLetter, const wchar_t* infoPath,
+                    const wchar_t* contentPath);
+BOOL archivePurgeItems(const PurgeItem* items, DWORD count, BOOL otherVolumesOnly,
+                       BOOL* deletable);
+BOOL archiveStagedItems(const wchar_t* stagingPath);
+BOOL benchmarkArchive(const wchar_t* folder, DWORD megabytes, DWORD threads,
+                      ArchiveBenchmark* result);
+BOOL closeArchiveWriter(ArchiveWriter* writer);
+BOOL extractArchiveEntry(const wchar_t* folder, wchar_t driveLetter, const ArchiveEntry* entry,
+                         const wchar_t* destination);
+BOOL findArchiveEntry(const wchar_t* folder, wchar_t driveLetter, const wchar_t* path,
+                      ArchiveEntry* entry);
+BOOL getArchiveFolder(wchar_t* folder, size_t cchFolder);
+BOOL isArchiveEnabled(void);
+BOOL listArchive(const wchar_t* folder, wchar_t driveLetter, ArchiveEntryCallback callback,
+                 void* context);
+BOOL openArchiveWriter(ArchiveWriter* writer, const wchar_t* folder, DWORD threads);
+void testArchive(void);
+BOOL writeArchiveEntry(const ArchiveEntry* entry, const wchar_t* path, void* context);
@@ -0,0 +1,1975 @@
+/*
+* Append-only binary audit log of bin operations, in rotating segments
+*
+* Copyright(C) 2024 ERROR_SUCCESS Software
+*
+* This program is free software : you can redistribute it and /or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.If not, see < https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#include "audit.h"
+#include "cli.h"
+#include "ini.h"
+#include "reclaim.h"
+#include "logger.h"
+
+#define AUDIT_RECORD_MAX_BYTES  64 // An event record, with room to spare
+#define AUDIT_NODE_MAX_BYTES    16 // Per character of a new path, with its record headers
+#define AUDIT_FILE_MAX_BYTES    (16 * AUDIT_SEGMENT_BYTES) // Larger segments are damaged
+#define AUDIT_NAME_ATTEMPTS     16
+
+/// @brief called for every record of an active segment, with the event if
+/// it is one
+/// @return TRUE to continue, FALSE to stop
+typedef BOOL (*AuditRecordSink)(const BYTE* record, DWORD bytes, const AuditEvent* event,
+                                void* context);
+
+typedef struct AuditSeal // An active segment being sealed
+{
+    HANDLE hFile;
+    COMPRESSOR_HANDLE hCompressor;
+    AuditSealedHeader header;
+    AuditEvent events[AUDIT_INDEX_EVENTS]; // The block being regrouped
+    DWORD eventCount;
+    BYTE* raw; // AUDIT_BLOCK_BYTES
+    BYTE* stored; // AUDIT_BLOCK_BYTES
+    BYTE* nodes; // Every node record, in the order they were written
+    DWORD nodeBytes;
+    AuditIndexEntry* index;
+    DWORD indexCapacity;
+    ULONGLONG offset; // Where the next block goes
+    BOOL result;
+} AuditSeal;
+
+typedef struct AuditQuery
+{
+    ULONGLONG from;
+    ULONGLONG to;
+    AuditEventCallback callback;
+    void* context;
+    PathStore paths; // Of the segment being read
+    wchar_t* path; // BIN_PATH_MAX_CCH
+    wchar_t* actor; // BIN_PATH_MAX_CCH
+    BYTE* raw; // AUDIT_BLOCK_BYTES
+    BYTE* stored; // AUDIT_BLOCK_BYTES
+    DECOMPRESSOR_HANDLE hDecompressor;
+    BOOL stopped; // The callback asked to stop
+} AuditQuery;
+
+typedef struct AuditTestQuery
+{
+    ULONGLONG events;
+    ULONGLONG items; // Sum of every event's items
+    const wchar_t* actor;
+} AuditTestQuery;
+
+static AuditWriter auditLog = { 0 };
+static INIT_ONCE auditLogOnce = INIT_ONCE_STATIC_INIT;
+static BOOL auditLogStarted = FALSE;
+
+static BOOL addAuditNode(PathStore* store, const BYTE* record, DWORD bytes, wchar_t* path);
+static DWORD WINAPI auditWriterThread(void* parameter);
+static BOOL buildAuditPath(const wchar_t* folder, const wchar_t* name, wchar_t* path);
+static BOOL closeAuditSegment(AuditWriter* writer, BOOL seal);
+static BOOL collectSealedRecord(const BYTE* record, DWORD bytes, const AuditEvent* event,
+                                void* context);
+static DWORD decodeAuditRecord(const BYTE* buffer, DWORD size, DWORD* position,
+                               ULONGLONG* previousTime, AuditEvent* event);
+static DWORD encodeAuditEvent(BYTE* buffer, const AuditEvent* event, ULONGLONG previousTime);
+static void flushAuditQueue(AuditWriter* writer, const BYTE* queue, DWORD used);
+static const wchar_t* getAuditPath(const PathStore* store, DWORD id, wchar_t* buffer);
+static BOOL getAuditVarint(const BYTE* buffer, DWORD size, DWORD* position, ULONGLONG* value);
+static BOOL isAuditProcessRunning(DWORD processId);
+static BOOL openAuditSegment(AuditWriter* writer);
+static DWORD putAuditNodes(AuditWriter* writer, BYTE* buffer);
+static DWORD putAuditVarint(BYTE* buffer, ULONGLONG value);
+static BOOL queryActiveSegment(AuditQuery* query, const wchar_t* path);
+static BOOL querySealedSegment(AuditQuery* query, const wchar_t* path);
+static BOOL readAuditBytes(HANDLE hFile, ULONGLONG offset, void* buffer, DWORD bytes);
+static BOOL readAuditFile(const wchar_t* path, BYTE** buffer, DWORD* size);
+static const BYTE* readAuditFrame(AuditQuery* query, HANDLE hFile, ULONGLONG offset,
+                                  DWORD storedBytes, DWORD rawBytes, BYTE* stored, BYTE* raw);
+static BOOL reportActiveRecord(const BYTE* record, DWORD bytes, const AuditEvent* event,
+                               void* context);
+static BOOL reportAuditEvent(AuditQuery* query, const AuditEvent* event);
+static BOOL CALLBACK startAuditLog(PINIT_ONCE initOnce, void* parameter, void** context);
+static void tidyAuditFolder(const wchar_t* folder);
+static BOOL walkActiveSegment(const BYTE* buffer, DWORD size, AuditRecordSink sink,
+                              void* context);
+static BOOL writeAuditBlock(AuditWriter* writer, DWORD bytes, DWORD events,
+                            ULONGLONG baseTime, ULONGLONG minTime, ULONGLONG maxTime);
+static BOOL writeAuditBytes(HANDLE hFile, const void* buffer, DWORD bytes);
+static BOOL writeSealedBlock(AuditSeal* seal);
+#ifndef NDEBUG
+static BOOL collectTestEvent(const AuditEvent* event, const wchar_t* path, const wchar_t* actor,
+                             void* context);
+#endif
+
+/// @brief adds the node of a node record to a path store. Records are read
+/// in the order they were written, so the node must get the next id.
+/// @param store the path store of the segment
+/// @param record the record, starting with its type
+/// @param bytes the size of the record
+/// @param path BIN_PATH_MAX_CCH characters of scratch space
+/// @return TRUE if the node was added with the id it was written with
+static BOOL addAuditNode(PathStore* store,
+                         const BYTE* record,
+                         DWORD bytes,
+                         wchar_t* path)
+{
+    DWORD position = 1;
+    ULONGLONG parent = 0;
+    ULONGLONG length = 0;
+    if ((getAuditVarint(record, bytes, &position, &parent) == FALSE) ||
+        (getAuditVarint(record, bytes, &position, &length) == FALSE) ||
+        (length == 0) ||
+        (length > bytes - position) ||
+        (parent > store->nodeCount))
+    {
+        return FALSE;
+    }
+    size_t prefix = 0;
+    if (parent > 0)
+    {
+        prefix = getPathFromId(store,
+                               (DWORD) (parent - 1),
+                               path,
+                               BIN_PATH_MAX_CCH);
+        if ((prefix == 0) || (prefix + 2 >= BIN_PATH_MAX_CCH))
+        {
+            return FALSE;
+        }
+        path[prefix++] = L'\\';
+    }
+    int characters = MultiByteToWideChar(CP_UTF8,
+                                         0,
+                                         (LPCSTR) (record + position),
+                                         (int) length,
+                                         path + prefix,
+                                         (int) (BIN_PATH_MAX_CCH - prefix - 1));
+    if (characters <= 0)
+    {
+        return FALSE;
+    }
+    path[prefix + characters] = 0;
+    DWORD expected = store->nodeCount;
+    return (addPath(store, path) == expected);
+}
+
+/// @brief adds an event to the audit log, if AuditLog is set. The writer is
+/// started by the first event. This only copies the event into a queue, so
+/// it is cheap enough to call for every item.
+/// @param operation one of the AUDIT_OP_ values
+/// @param path the item's original path, or the bin folder, NULL for none
+/// @param bytes the size of the item, or of everything removed
+/// @param items the number of items
+void auditEvent(DWORD operation,
+                const wchar_t* path,
+                ULONGLONG bytes,
+                ULONGLONG items)
+{
+    InitOnceExecuteOnce(&auditLogOnce,
+                        startAuditLog,
+                        NULL,
+                        NULL);
+    if (auditLogStarted)
+    {
+        queueAuditEvent(&auditLog,
+                        getCurrentFileTime(),
+                        operation,
+                        path,
+                        bytes,
+                        items);
+    }
+}
+
+/// @brief the writer thread. It first seals segments left behind by
+/// processes that have exited and deletes expired ones, then writes what is
+/// queued once a second, or as soon as the queue is half full, until it is
+/// stopped.
+/// @param parameter the AuditWriter
+/// @return 0
+static DWORD WINAPI auditWriterThread(void* parameter)
+{
+    AuditWriter* writer = (AuditWriter*) parameter;
+    tidyAuditFolder(writer->folder);
+
+    EnterCriticalSection(&writer->lock);
+    for (;;)
+    {
+        while ((writer->queueUsed == 0) && (writer->stopping == FALSE))
+        {
+            SleepConditionVariableCS(&writer->queued,
+                                     &writer->lock,
+                                     INFINITE);
+        }
+        // Let more events gather unless the queue is already half full
+        if ((writer->stopping == FALSE) && (writer->queueUsed < AUDIT_QUEUE_BYTES / 2))
+        {
+            SleepConditionVariableCS(&writer->queued,
+                                     &writer->lock,
+                                     AUDIT_FLUSH_MILLISECONDS);
+        }
+        BYTE* queue = writer->queues[0];
+        writer->queues[0] = writer->queues[1];
+        writer->queues[1] = queue;
+        DWORD used = writer->queueUsed;
+        writer->queueUsed = 0;
+        BOOL stopping = writer->stopping;
+        LeaveCriticalSection(&writer->lock);
+        WakeAllConditionVariable(&writer->drained);
+
+        if (used > 0)
+        {
+            flushAuditQueue(writer,
+                            queue,
+                            used);
+        }
+
+        EnterCriticalSection(&writer->lock);
+        if (stopping && (writer->queueUsed == 0))
+        {
+            break;
+        }
+    }
+    LeaveCriticalSection(&writer->lock);
+
+    closeAuditSegment(writer,
+                      (writer->keepActive == FALSE));
+    return 0;
+}
+
+/// @brief builds the path of a file in the audit folder
+/// @param folder the audit folder
+/// @param name the file name
+/// @param path receives the path, MAX_PATH + 1 characters
+/// @return TRUE on success, FALSE if the path is too long
+static BOOL buildAuditPath(const wchar_t* folder,
+                           const wchar_t* name,
+                           wchar_t* path)
+{
+    int written = _snwprintf(path,
+                             MAX_PATH + 1,
+                             L"%s\\%s",
+                             folder,
+                             name);
+    path[MAX_PATH] = 0;
+    return ((written >= 0) && (written <= MAX_PATH));
+}
+
+/// @brief stops the audit log started by auditEvent(), writing and sealing
+/// everything queued. Events added after this are dropped.
+/// @param none
+void closeAuditLog(void)
+{
+    if (auditLogStarted)
+    {
+        auditLogStarted = FALSE;
+        closeAuditWriter(&auditLog);
+    }
+}
+
+/// @brief closes the active segment, the next block starts a new one
+/// @param writer the audit writer
+/// @param seal TRUE to seal the segment, FALSE to leave it active
+/// @return TRUE unless the segment could not be sealed
+static BOOL closeAuditSegment(AuditWriter* writer,
+                              BOOL seal)
+{
+    if (writer->hSegment == INVALID_HANDLE_VALUE)
+    {
+        return TRUE;
+    }
+    CloseHandle(writer->hSegment);
+    writer->hSegment = INVALID_HANDLE_VALUE;
+    freePathStore(&writer->paths);
+    writer->nodesWritten = 0;
+    BOOL result = (seal == FALSE) || sealAuditSegment(writer->segmentPath);
+    writer->segmentPath[0] = 0;
+    return result;
+}
+
+/// @brief stops the writer thread once everything queued is written, seals
+/// the active segment and frees the writer
+/// @param writer the audit writer
+/// @return TRUE if every event queued was written, FALSE if some were lost
+BOOL closeAuditWriter(AuditWriter* writer)
+{
+    if (writer->hThread != NULL)
+    {
+        EnterCriticalSection(&writer->lock);
+        writer->stopping = TRUE;
+        LeaveCriticalSection(&writer->lock);
+        WakeAllConditionVariable(&writer->queued);
+        WakeAllConditionVariable(&writer->drained);
+        WaitForSingleObject(writer->hThread,
+                            INFINITE);
+        CloseHandle(writer->hThread);
+        writer->hThread = NULL;
+        DeleteCriticalSection(&writer->lock);
+    }
+    for (DWORD i = 0; i < ARRAYSIZE(writer->queues); i++)
+    {
+        if (writer->queues[i] != NULL)
+        {
+            HeapFree(GetProcessHeap(),
+                     0,
+                     writer->queues[i]);
+            writer->queues[i] = NULL;
+        }
+    }
+    if (writer->block != NULL)
+    {
+        HeapFree(GetProcessHeap(),
+                 0,
+                 writer->block);
+        writer->block = NULL;
+    }
+    if (writer->lost > 0)
+    {
+        LOG(L"%llu audit events could not be written\n",
+            writer->lost);
+    }
+    return (writer->lost == 0);
+}
+
+/// @brief keeps a record of an active segment being sealed: node records are
+/// copied as they are, events are gathered into blocks of AUDIT_INDEX_EVENTS
+/// @param record the record
+/// @param bytes its size
+/// @param event the event, NULL for a node record
+/// @param context the AuditSeal
+/// @return TRUE to continue, FALSE if a block could not be written
+static BOOL collectSealedRecord(const BYTE* record,
+                                DWORD bytes,
+                                const AuditEvent* event,
+                                void* context)
+{
+    AuditSeal* seal = (AuditSeal*) context;
+    if (event == NULL)
+    {
+        memcpy(seal->nodes + seal->nodeBytes,
+               record,
+               bytes);
+        seal->nodeBytes += bytes;
+        seal->header.nodes++;
+        return TRUE;
+    }
+    seal->events[seal->eventCount++] = *event;
+    if (seal->eventCount == AUDIT_INDEX_EVENTS)
+    {
+        return writeSealedBlock(seal);
+    }
+    return TRUE;
+}
+
+/// @brief decodes one record
+/// @param buffer the records
+/// @param size the end of the records in buffer
+/// @param position the offset of the record, moved past it
+/// @param previousTime the time of the previous event, updated by an event
+/// @param event receives an event record
+/// @return AUDIT_RECORD_NODE or AUDIT_RECORD_EVENT, 0 if the record is
+///         damaged or cut short
+static DWORD decodeAuditRecord(const BYTE* buffer,
+                               DWORD size,
+                               DWORD* position,
+                               ULONGLONG* previousTime,
+                               AuditEvent* event)
+{
+    if (*position >= size)
+    {
+        return 0;
+    }
+    BYTE type = buffer[(*position)++];
+    ULONGLONG values[6] = { 0 };
+    if (type == AUDIT_RECORD_NODE)
+    {
+        if ((getAuditVarint(buffer, size, position, &values[0]) == FALSE) ||
+            (getAuditVarint(buffer, size, position, &values[1]) == FALSE) ||
+            (values[1] > size - *position))
+        {
+            return 0;
+        }
+        *position += (DWORD) values[1];
+        return AUDIT_RECORD_NODE;
+    }
+    if (type != AUDIT_RECORD_EVENT)
+    {
+        return 0;
+    }
+    for (DWORD i = 0; i < ARRAYSIZE(values); i++)
+    {
+        if (getAuditVarint(buffer, size, position, &values[i]) == FALSE)
+        {
+            return 0;
+        }
+    }
+    // The time delta is zigzag encoded, so a clock that steps back stays small
+    *previousTime += (values[0] >> 1) ^ (0 - (values[0] & 1));
+    event->time = *previousTime;
+    event->operation = (DWORD) values[1];
+    event->path = (values[2] == 0) ? PATH_STORE_NO_NODE : (DWORD) (values[2] - 1);
+    event->actor = (values[3] == 0) ? PATH_STORE_NO_NODE : (DWORD) (values[3] - 1);
+    event->bytes = values[4];
+    event->items = values[5];
+    return AUDIT_RECORD_EVENT;
+}
+
+/// @brief encodes an event record
+/// @param buffer receives at most AUDIT_RECORD_MAX_BYTES
+/// @param event the event
+/// @param previousTime the time of the previous event, or the block's base
+/// @return the size of the record
+static DWORD encodeAuditEvent(BYTE* buffer,
+                              const AuditEvent* event,
+                              ULONGLONG previousTime)
+{
+    LONGLONG delta = (LONGLONG) (event->time - previousTime);
+    DWORD length = 0;
+    buffer[length++] = AUDIT_RECORD_EVENT;
+    length += putAuditVarint(buffer + length,
+                             ((ULONGLONG) delta << 1) ^ (ULONGLONG) (delta >> 63));
+    length += putAuditVarint(buffer + length,
+                             event->operation);
+    length += putAuditVarint(buffer + length,
+                             (event->path == PATH_STORE_NO_NODE) ? 0 : (ULONGLONG) event->path + 1);
+    length += putAuditVarint(buffer + length,
+                             (event->actor == PATH_STORE_NO_NODE) ? 0 : (ULONGLONG) event->actor + 1);
+    length += putAuditVarint(buffer + length,
+                             event->bytes);
+    length += putAuditVarint(buffer + length,
+                             event->items);
+    return length;
+}
+
+/// @brief encodes the events of a swapped out queue into blocks and appends
+/// them to the active segment, opening one if needed. Only the writer thread
+/// calls this.
+/// @param writer the audit writer
+/// @param queue the queue buffer
+/// @param used the bytes of events in it
+static void flushAuditQueue(AuditWriter* writer,
+                            const BYTE* queue,
+                            DWORD used)
+{
+    DWORD position = sizeof(AuditBlockHeader);
+    DWORD events = 0;
+    ULONGLONG baseTime = 0;
+    ULONGLONG previousTime = 0;
+    ULONGLONG minTime = MAXULONGLONG;
+    ULONGLONG maxTime = 0;
+    for (DWORD offset = 0; offset < used; )
+    {
+        const AuditQueued* queued = (const AuditQueued*) (queue + offset);
+        const wchar_t* path = (const wchar_t*) (queued + 1);
+        offset += (DWORD) ((sizeof(AuditQueued) + queued->pathLength * sizeof(wchar_t) + 7) & ~7);
+
+        // Start a new block if this event and the nodes of a path that is
+        // new to the segment might not fit
+        DWORD worst = AUDIT_RECORD_MAX_BYTES +
+            (queued->pathLength + BIN_SID_MAX_CCH) * AUDIT_NODE_MAX_BYTES;
+        if ((events > 0) && (position + worst > AUDIT_BLOCK_BYTES))
+        {
+            writeAuditBlock(writer,
+                            position - sizeof(AuditBlockHeader),
+                            events,
+                            baseTime,
+                            minTime,
+                            maxTime);
+            position = sizeof(AuditBlockHeader);
+            events = 0;
+            minTime = MAXULONGLONG;
+            maxTime = 0;
+        }
+        if ((writer->hSegment == INVALID_HANDLE_VALUE) &&
+            (openAuditSegment(writer) == FALSE))
+        {
+            writer->lost++;
+            continue;
+        }
+
+        AuditEvent event = { 0 };
+        event.time = queued->time;
+        event.bytes = queued->bytes;
+        event.items = queued->items;
+        event.operation = queued->operation;
+        event.path = (queued->pathLength > 1) ? addPath(&writer->paths, path) : PATH_STORE_NO_NODE;
+        event.actor = (writer->actor[0] != 0) ? addPath(&writer->paths, writer->actor) :
+            PATH_STORE_NO_NODE;
+        position += putAuditNodes(writer,
+                                  writer->block + position);
+        if (events == 0)
+        {
+            baseTime = event.time;
+            previousTime = event.time;
+        }
+        position += encodeAuditEvent(writer->block + position,
+                                     &event,
+                                     previousTime);
+        previousTime = event.time;
+        minTime = min(minTime, event.time);
+        maxTime = max(maxTime, event.time);
+        events++;
+    }
+    if (events > 0)
+    {
+        writeAuditBlock(writer,
+                        position - sizeof(AuditBlockHeader),
+                        events,
+                        baseTime,
+                        minTime,
+                        maxTime);
+    }
+}
+
+/// @brief gets the folder audit segments are kept in, the app data folder
+/// @param folder receives the folder, without a trailing backslash
+/// @param cchFolder the size of folder in characters
+/// @return TRUE on success, FALSE if it could not be found
+BOOL getAuditFolder(wchar_t* folder,
+                    size_t cchFolder)
+{
+    if (getAppDataFilePath(L"",
+                           folder,
+                           cchFolder) == FALSE)
+    {
+        return FALSE;
+    }
+    size_t length = wcslen(folder);
+    if ((length > 0) && (folder[length - 1] == L'\\'))
+    {
+        folder[length - 1] = 0;
+    }
+    return (folder[0] != 0);
+}
+
+/// @brief gets the name /auditlog shows for an operation
+/// @param operation one of the AUDIT_OP_ values
+/// @return the name, "unknown" for a value written by a later version
+const wchar_t* getAuditOperationName(DWORD operation)
+{
+    switch (operation)
+    {
+    case AUDIT_OP_TRASH:
+        return L"trash";
+    case AUDIT_OP_RESTORE:
+        return L"restore";
+    case AUDIT_OP_PURGE:
+        return L"purge";
+    case AUDIT_OP_EMPTY:
+        return L"empty";
+    case AUDIT_OP_ERASE:
+        return L"erase";
+    default:
+        return L"unknown";
+    }
+}
+
+/// @brief rebuilds the path of a node for a query
+/// @param store the path store of the segment
+/// @param id the node, PATH_STORE_NO_NODE for none
+/// @param buffer BIN_PATH_MAX_CCH characters, receives the path
+/// @return buffer, empty if there is no path
+static const wchar_t* getAuditPath(const PathStore* store,
+                                   DWORD id,
+                                   wchar_t* buffer)
+{
+    size_t length = getPathFromId(store,
+                                  id,
+                                  buffer,
+                                  BIN_PATH_MAX_CCH);
+    if ((length == 0) || (length >= BIN_PATH_MAX_CCH))
+    {
+        buffer[0] = 0;
+    }
+    return buffer;
+}
+
+/// @brief reads a varint, 7 bits per byte with the high bit set on every
+/// byte but the last
+/// @param buffer the records
+/// @param size the end of the records in buffer
+/// @param position the offset of the varint, moved past it
+/// @param value receives the value
+/// @return TRUE on success, FALSE if it runs past size or 64 bits
+static BOOL getAuditVarint(const BYTE* buffer,
+                           DWORD size,
+                           DWORD* position,
+                           ULONGLONG* value)
+{
+    ULONGLONG result = 0;
+    for (DWORD shift = 0; (shift < 64) && (*position < size); shift += 7)
+    {
+        BYTE next = buffer[(*position)++];
+        result |= (ULONGLONG) (next & 0x7F) << shift;
+        if ((next & 0x80) == 0)
+        {
+            *value = result;
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+/// @brief checks if auditing is on, from Settings.ini
+/// @param none
+/// @return TRUE if it is
+BOOL isAuditEnabled(void)
+{
+    return (getIniInt(INI_KEY_AUDIT_LOG, INI_DEFAULT_VALUE_AUDIT_LOG) > 0);
+}
+
+/// @brief checks if the process that wrote an active segment is still
+/// running. A process we may not open is running.
+/// @param processId the id in the segment's name
+/// @return TRUE if it is running
+static BOOL isAuditProcessRunning(DWORD processId)
+{
+    HANDLE hProcess = OpenProcess(SYNCHRONIZE,
+                                  FALSE,
+                                  processId);
+    if (hProcess == NULL)
+    {
+        return (GetLastError() == ERROR_ACCESS_DENIED);
+    }
+    BOOL running = (WaitForSingleObject(hProcess, 0) == WAIT_TIMEOUT);
+    CloseHandle(hProcess);
+    return running;
+}
+
+/// @brief creates a new active segment named after the time and our process
+/// @param writer the audit writer
+/// @return TRUE on success, FALSE if it could not be created
+static BOOL openAuditSegment(AuditWriter* writer)
+{
+    // Segments opened within one clock tick get the next free name, which
+    // must not be taken by a segment that is already sealed either
+    writer->segmentStart = max(getCurrentFileTime(),
+                               writer->segmentStart + 1);
+    for (DWORD attempt = 0; attempt < AUDIT_NAME_ATTEMPTS; attempt++, writer->segmentStart++)
+    {
+        wchar_t name[MAX_PATH + 1] = { 0 };
+        wchar_t sealedPath[MAX_PATH + 1] = { 0 };
+        _snwprintf(name,
+                   ARRAYSIZE(name),
+                   AUDIT_ACTIVE_FORMAT,
+                   writer->segmentStart,
+                   GetCurrentProcessId());
+        name[MAX_PATH] = 0;
+        if (buildAuditPath(writer->folder,
+                           name,
+                           writer->segmentPath) == FALSE)
+        {
+            break;
+        }
+        wcscpy(sealedPath,
+               writer->segmentPath);
+        wcscpy(wcsrchr(sealedPath, L'.'),
+               AUDIT_SEALED_EXTENSION);
+        if (GetFileAttributesW(sealedPath) != INVALID_FILE_ATTRIBUTES)
+        {
+            continue;
+        }
+        writer->hSegment = CreateFileW(writer->segmentPath,
+                                       GENERIC_WRITE,
+                                       FILE_SHARE_READ,
+                                       NULL,
+                                       CREATE_NEW,
+                                       FILE_ATTRIBUTE_NORMAL,
+                                       NULL);
+        if ((writer->hSegment != INVALID_HANDLE_VALUE) ||
+            (GetLastError() != ERROR_FILE_EXISTS))
+        {
+            break;
+        }
+    }
+    if (writer->hSegment == INVALID_HANDLE_VALUE)
+    {
+        LOG(L"Failed to create audit segment %s, error code %d\n",
+            writer->segmentPath,
+            GetLastError());
+        writer->segmentPath[0] = 0;
+        return FALSE;
+    }
+    AuditSegmentHeader header = { 0 };
+    header.magic = AUDIT_MAGIC;
+    header.version = AUDIT_VERSION;
+    header.startTime = writer->segmentStart;
+    header.processId = GetCurrentProcessId();
+    if ((initPathStore(&writer->paths) == FALSE) ||
+        (writeAuditBytes(writer->hSegment, &header, sizeof(header)) == FALSE))
+    {
+        CloseHandle(writer->hSegment);
+        writer->hSegment = INVALID_HANDLE_VALUE;
+        freePathStore(&writer->paths);
+        DeleteFileW(writer->segmentPath);
+        writer->segmentPath[0] = 0;
+        return FALSE;
+    }
+    writer->segmentBytes = sizeof(header);
+    writer->nodesWritten = 0;
+    return TRUE;
+}
+
+/// @brief starts a writer thread for an audit folder
+/// @param writer the audit writer to initialize
+/// @param folder the folder segments are kept in
+/// @return TRUE on success, FALSE if memory allocation or the thread failed
+BOOL openAuditWriter(AuditWriter* writer,
+                     const wchar_t* folder)
+{
+    ZeroMemory(writer,
+               sizeof(AuditWriter));
+    wcsncpy(writer->folder,
+            folder,
+            MAX_PATH);
+    writer->hSegment = INVALID_HANDLE_VALUE;
+    writer->segmentLimit = AUDIT_SEGMENT_BYTES;
+    const wchar_t* sid = getCurrentUserSid();
+    if (sid != NULL)
+    {
+        wcsncpy(writer->actor,
+                sid,
+                ARRAYSIZE(writer->actor) - 1);
+    }
+    for (DWORD i = 0; i < ARRAYSIZE(writer->queues); i++)
+    {
+        writer->queues[i] = HeapAlloc(GetProcessHeap(),
+                                      0,
+                                      AUDIT_QUEUE_BYTES);
+    }
+    writer->block = HeapAlloc(GetProcessHeap(),
+                              0,
+                              AUDIT_BLOCK_BYTES);
+    if ((writer->queues[0] == NULL) || (writer->queues[1] == NULL) || (writer->block == NULL))
+    {
+        // Memory allocation failed
+        closeAuditWriter(writer);
+        return FALSE;
+    }
+    InitializeCriticalSection(&writer->lock);
+    InitializeConditionVariable(&writer->queued);
+    InitializeConditionVariable(&writer->drained);
+    writer->hThread = CreateThread(NULL,
+                                   0,
+                                   auditWriterThread,
+                                   writer,
+                                   0,
+                                   NULL);
+    if (writer->hThread == NULL)
+    {
+        LOG(L"Failed to start the audit writer, error code %d\n",
+            GetLastError());
+        DeleteCriticalSection(&writer->lock);
+        closeAuditWriter(writer);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/// @brief encodes a node record for every node added to the segment's path
+/// store since the last call. Parents are always added before their
+/// children, so a reader can rebuild the store in the same order.
+/// @param writer the audit writer
+/// @param buffer receives the records
+/// @return the bytes written to buffer
+static DWORD putAuditNodes(AuditWriter* writer,
+                           BYTE* buffer)
+{
+    DWORD length = 0;
+    for (; writer->nodesWritten < writer->paths.nodeCount; writer->nodesWritten++)
+    {
+        const PathNode* node = &writer->paths.nodes[writer->nodesWritten];
+        const PathComponent* component = &writer->paths.components[node->component];
+        const wchar_t* name = writer->paths.pool + component->offset;
+        int nameBytes = WideCharToMultiByte(CP_UTF8,
+                                            0,
+                                            name,
+                                            component->length,
+                                            NULL,
+                                            0,
+                                            NULL,
+                                            NULL);
+        buffer[length++] = AUDIT_RECORD_NODE;
+        length += putAuditVarint(buffer + length,
+                                 (node->parent == PATH_STORE_NO_NODE) ? 0 : (ULONGLONG) node->parent + 1);
+        length += putAuditVarint(buffer + length,
+                                 (ULONGLONG) nameBytes);
+        WideCharToMultiByte(CP_UTF8,
+                            0,
+                            name,
+                            component->length,
+                            (LPSTR) (buffer + length),
+                            nameBytes,
+                            NULL,
+                            NULL);
+        length += (DWORD) nameBytes;
+    }
+    return length;
+}
+
+/// @brief writes a varint, 7 bits per byte with the high bit set on every
+/// byte but the last
+/// @param buffer receives at most 10 bytes
+/// @param value the value
+/// @return the bytes written
+static DWORD putAuditVarint(BYTE* buffer,
+                            ULONGLONG value)
+{
+    DWORD length = 0;
+    while (value >= 0x80)
+    {
+        buffer[length++] = (BYTE) (value | 0x80);
+        value >>= 7;
+    }
+    buffer[length++] = (BYTE) value;
+    return length;
+}
+
+/// @brief copies an event into the writer's queue, waiting for room if the
+/// writer thread has fallen a whole queue behind. Wakes the writer for the
+/// first event queued and once the queue is half full.
+/// @param writer the audit writer
+/// @param time the FILETIME of the event
+/// @param operation one of the AUDIT_OP_ values
+/// @param path the path, NULL for none
+/// @param bytes the size of what the operation removed or restored
+/// @param items the number of items
+void queueAuditEvent(AuditWriter* writer,
+                     ULONGLONG time,
+                     DWORD operation,
+                     const wchar_t* path,
+                     ULONGLONG bytes,
+                     ULONGLONG items)
+{
+    size_t pathLength = (path != NULL) ? wcslen(path) + 1 : 1;
+    if (pathLength > BIN_PATH_MAX_CCH)
+    {
+        pathLength = 1;
+    }
+    DWORD recordBytes = (DWORD) ((sizeof(AuditQueued) + pathLength * sizeof(wchar_t) + 7) & ~7);
+
+    EnterCriticalSection(&writer->lock);
+    while ((writer->stopping == FALSE) &&
+           (writer->queueUsed + recordBytes > AUDIT_QUEUE_BYTES))
+    {
+        WakeConditionVariable(&writer->queued);
+        SleepConditionVariableCS(&writer->drained,
+                                 &writer->lock,
+                                 INFINITE);
+    }
+    if (writer->stopping)
+    {
+        LeaveCriticalSection(&writer->lock);
+        return;
+    }
+    AuditQueued* queued = (AuditQueued*) (writer->queues[0] + writer->queueUsed);
+    queued->time = time;
+    queued->bytes = bytes;
+    queued->items = items;
+    queued->operation = operation;
+    queued->pathLength = (DWORD) pathLength;
+    wchar_t* queuedPath = (wchar_t*) (queued + 1);
+    if (pathLength > 1)
+    {
+        memcpy(queuedPath,
+               path,
+               pathLength * sizeof(wchar_t));
+    }
+    else
+    {
+        queuedPath[0] = 0;
+    }
+    BOOL wake = (writer->queueUsed == 0) ||
+        ((writer->queueUsed < AUDIT_QUEUE_BYTES / 2) &&
+         (writer->queueUsed + recordBytes >= AUDIT_QUEUE_BYTES / 2));
+    writer->queueUsed += recordBytes;
+    LeaveCriticalSection(&writer->lock);
+    if (wake)
+    {
+        WakeConditionVariable(&writer->queued);
+    }
+}
+
+/// @brief reads every block of an active segment, one that is still being
+/// written or was left behind by a process that did not exit cleanly
+/// @param query the query
+/// @param path the segment
+/// @return TRUE if the segment was read, FALSE if it could not be
+static BOOL queryActiveSegment(AuditQuery* query,
+                               const wchar_t* path)
+{
+    BYTE* buffer = NULL;
+    DWORD size = 0;
+    if (readAuditFile(path,
+                      &buffer,
+                      &size) == FALSE)
+    {
+        return FALSE;
+    }
+    const AuditSegmentHeader* header = (const AuditSegmentHeader*) buffer;
+    BOOL result = (size >= sizeof(AuditSegmentHeader)) &&
+        (header->magic == AUDIT_MAGIC) &&
+        (header->version == AUDIT_VERSION) &&
+        initPathStore(&query->paths);
+    if (result)
+    {
+        walkActiveSegment(buffer,
+                          size,
+                          reportActiveRecord,
+                          query);
+        freePathStore(&query->paths);
+    }
+    HeapFree(GetProcessHeap(),
+             0,
+             buffer);
+    return result;
+}
+
+/// @brief reads the events of every segment in an audit folder within a
+/// time range, oldest segment first. Sealed segments outside the range are
+/// skipped from their header, and only the blocks of a sealed segment whose
+/// index entry overlaps the range are read.
+/// @param folder the audit folder
+/// @param from the earliest FILETIME to report
+/// @param to the latest FILETIME to report
+/// @param callback called for every event in the range
+/// @param context passed to the callback
+/// @return TRUE if the folder was read, FALSE if it could not be or memory
+///         allocation failed. Damaged segments are skipped.
+BOOL queryAuditLog(const wchar_t* folder,
+                   ULONGLONG from,
+                   ULONGLONG to,
+                   AuditEventCallback callback,
+                   void* context)
+{
+    AuditQuery query = { 0 };
+    query.from = from;
+    query.to = to;
+    query.callback = callback;
+    query.context = context;
+    query.path = HeapAlloc(GetProcessHeap(),
+                           0,
+                           BIN_PATH_MAX_CCH * sizeof(wchar_t));
+    query.actor = HeapAlloc(GetProcessHeap(),
+                            0,
+                            BIN_PATH_MAX_CCH * sizeof(wchar_t));
+    query.raw = HeapAlloc(GetProcessHeap(),
+                          0,
+                          AUDIT_BLOCK_BYTES);
+    query.stored = HeapAlloc(GetProcessHeap(),
+                             0,
+                             AUDIT_BLOCK_BYTES);
+    wchar_t pattern[MAX_PATH + 1] = { 0 };
+    BOOL result = (query.path != NULL) && (query.actor != NULL) &&
+        (query.raw != NULL) && (query.stored != NULL) &&
+        CreateDecompressor(AUDIT_ALGORITHM, NULL, &query.hDecompressor) &&
+        buildAuditPath(folder, AUDIT_PATTERN, pattern);
+
+    WIN32_FIND_DATAW data = { 0 };
+    HANDLE hFind = INVALID_HANDLE_VALUE;
+    if (result)
+    {
+        hFind = FindFirstFileW(pattern,
+                               &data);
+        if (hFind == INVALID_HANDLE_VALUE)
+        {
+            result = (GetLastError() == ERROR_FILE_NOT_FOUND);
+        }
+    }
+    // NTFS lists names in order, and names start with the segment's start time
+    while (hFind != INVALID_HANDLE_VALUE)
+    {
+        wchar_t path[MAX_PATH + 1] = { 0 };
+        size_t length = wcslen(data.cFileName);
+        if (buildAuditPath(folder, data.cFileName, path) &&
+            (length > 5))
+        {
+            BOOL read = (_wcsicmp(data.cFileName + length - 5, AUDIT_SEALED_EXTENSION) == 0) ?
+                querySealedSegment(&query, path) :
+                queryActiveSegment(&query, path);
+            if (read == FALSE)
+            {
+                LOG(L"Skipped damaged audit segment %s\n",
+                    path);
+            }
+        }
+        if (query.stopped ||
+            (FindNextFileW(hFind, &data) == FALSE))
+        {
+            FindClose(hFind);
+            hFind = INVALID_HANDLE_VALUE;
+        }
+    }
+
+    if (query.hDecompressor != NULL)
+    {
+        CloseDecompressor(query.hDecompressor);
+    }
+    void* buffers[] = { query.path, query.actor, query.raw, query.stored };
+    for (DWORD i = 0; i < ARRAYSIZE(buffers); i++)
+    {
+        if (buffers[i] != NULL)
+        {
+            HeapFree(GetProcessHeap(),
+                     0,
+                     buffers[i]);
+        }
+    }
+    return result;
+}
+
+/// @brief reads the blocks of a sealed segment that overlap the query's time
+/// range, through its index
+/// @param query the query
+/// @param path the segment
+/// @return TRUE if the segment was read or skipped, FALSE if it is damaged
+static BOOL querySealedSegment(AuditQuery* query,
+                               const wchar_t* path)
+{
+    HANDLE hFile = CreateFileW(path,
+                               GENERIC_READ,
+                               FILE_SHARE_READ | FILE_SHARE_DELETE,
+                               NULL,
+                               OPEN_EXISTING,
+                               FILE_FLAG_RANDOM_ACCESS,
+                               NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+    {
+        return FALSE;
+    }
+    AuditSealedHeader header = { 0 };
+    if ((readAuditBytes(hFile, 0, &header, sizeof(header)) == FALSE) ||
+        (header.magic != AUDIT_MAGIC) ||
+        (header.version != AUDIT_VERSION) ||
+        (header.nodeStored > header.nodeRaw) ||
+        (header.blocks > header.events) ||
+        (header.blocks > AUDIT_FILE_MAX_BYTES / sizeof(AuditIndexEntry)))
+    {
+        CloseHandle(hFile);
+        return FALSE;
+    }
+    if ((header.events == 0) || (header.maxTime < query->from) || (header.minTime > query->to))
+    {
+        CloseHandle(hFile);
+        return TRUE;
+    }
+
+    DWORD indexBytes = header.blocks * sizeof(AuditIndexEntry);
+    AuditIndexEntry* index = HeapAlloc(GetProcessHeap(),
+                                       0,
+                                       max(indexBytes, 1));
+    BYTE* nodeRaw = HeapAlloc(GetProcessHeap(),
+                              0,
+                              max(header.nodeRaw, 1));
+    BYTE* nodeStored = HeapAlloc(GetProcessHeap(),
+                                 0,
+                                 max(header.nodeStored, 1));
+    const BYTE* nodes = NULL;
+    BOOL result = (index != NULL) && (nodeRaw != NULL) && (nodeStored != NULL) &&
+        readAuditBytes(hFile, header.indexOffset, index, indexBytes) &&
+        ((nodes = readAuditFrame(query,
+                                 hFile,
+                                 header.nodeOffset,
+                                 header.nodeStored,
+                                 header.nodeRaw,
+                                 nodeStored,
+                                 nodeRaw)) != NULL) &&
+        initPathStore(&query->paths);
+
+    // Rebuild the segment's path store, then read only the blocks we need
+    if (result)
+    {
+        ULONGLONG previousTime = 0;
+        AuditEvent event = { 0 };
+        for (DWORD position = 0; result && (position < header.nodeRaw); )
+        {
+            DWORD start = position;
+            result = (decodeAuditRecord(nodes,
+                                        header.nodeRaw,
+                                        &position,
+                                        &previousTime,
+                                        &event) == AUDIT_RECORD_NODE) &&
+                addAuditNode(&query->paths,
+                             nodes + start,
+                             position - start,
+                             query->path);
+        }
+        for (DWORD i = 0; result && (i < header.blocks) && (query->stopped == FALSE); i++)
+        {
+            const AuditIndexEntry* entry = &index[i];
+            if ((entry->maxTime < query->from) || (entry->minTime > query->to))
+            {
+                continue;
+            }
+            const BYTE* block = NULL;
+            result = (entry->rawBytes <= AUDIT_BLOCK_BYTES) &&
+                (entry->storedBytes <= entry->rawBytes) &&
+                ((block = readAuditFrame(query,
+                                         hFile,
+                                         entry->offset,
+                                         entry->storedBytes,
+                                         entry->rawBytes,
+                                         query->stored,
+                                         query->raw)) != NULL);
+            previousTime = entry->minTime;
+            for (DWORD position = 0; result && (position < entry->rawBytes); )
+            {
+                result = (decodeAuditRecord(block,
+                                            entry->rawBytes,
+                                            &position,
+                                            &previousTime,
+                                            &event) == AUDIT_RECORD_EVENT);
+                if (result &&
+                    (reportAuditEvent(query, &event) == FALSE))
+                {
+                    break;
+                }
+            }
+        }
+        freePathStore(&query->paths);
+    }
+
+    CloseHandle(hFile);
+    void* buffers[] = { index, nodeRaw, nodeStored };
+    for (DWORD i = 0; i < ARRAYSIZE(buffers); i++)
+    {
+        if (buffers[i] != NULL)
+        {
+            HeapFree(GetProcessHeap(),
+                     0,
+                     buffers[i]);
+        }
+    }
+    return result;
+}
+
+/// @brief reads bytes at an offset
+/// @param hFile the file
+/// @param offset where to read from
+/// @param buffer receives the bytes
+/// @param bytes how many to read
+/// @return TRUE if they were all read
+static BOOL readAuditBytes(HANDLE hFile,
+                           ULONGLONG offset,
+                           void* buffer,
+                           DWORD bytes)
+{
+    LARGE_INTEGER position = { .QuadPart = (LONGLONG) offset };
+    DWORD bytesRead = 0;
+    return SetFilePointerEx(hFile, position, NULL, FILE_BEGIN) &&
+        ReadFile(hFile, buffer, bytes, &bytesRead, NULL) &&
+        (bytesRead == bytes);
+}
+
+/// @brief reads a whole active segment into memory. The writer may still be
+/// appending to it, so the last block may be cut short.
+/// @param path the segment
+/// @param buffer receives the contents, free with HeapFree()
+/// @param size receives the size of the contents
+/// @return TRUE on success, FALSE if it could not be read
+static BOOL readAuditFile(const wchar_t* path,
+                          BYTE** buffer,
+                          DWORD* size)
+{
+    *buffer = NULL;
+    *size = 0;
+    HANDLE hFile = CreateFileW(path,
+                               GENERIC_READ,
+                               FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                               NULL,
+                               OPEN_EXISTING,
+                               FILE_FLAG_SEQUENTIAL_SCAN,
+                               NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+    {
+        return FALSE;
+    }
+    LARGE_INTEGER fileSize = { 0 };
+    BOOL result = GetFileSizeEx(hFile, &fileSize) &&
+        (fileSize.QuadPart <= AUDIT_FILE_MAX_BYTES);
+    if (result)
+    {
+        *size = (DWORD) fileSize.QuadPart;
+        *buffer = HeapAlloc(GetProcessHeap(),
+                            0,
+                            max(*size, 1));
+        result = (*buffer != NULL) &&
+            readAuditBytes(hFile, 0, *buffer, *size);
+    }
+    CloseHandle(hFile);
+    if ((result == FALSE) && (*buffer != NULL))
+    {
+        HeapFree(GetProcessHeap(),
+                 0,
+                 *buffer);
+        *buffer = NULL;
+    }
+    return result;
+}
+
+/// @brief reads a compressed frame of a sealed segment
+/// @param query the query, for its decompressor
+/// @param hFile the segment
+/// @param offset where the frame starts
+/// @param storedBytes the size of the frame, rawBytes if it is stored as is
+/// @param rawBytes the size once decompressed
+/// @param stored receives the frame
+/// @param raw receives the decompressed frame
+/// @return the frame's contents, stored or raw, NULL if it could not be read
+static const BYTE* readAuditFrame(AuditQuery* query,
+                                  HANDLE hFile,
+                                  ULONGLONG offset,
+                                  DWORD storedBytes,
+                                  DWORD rawBytes,
+                                  BYTE* stored,
+                                  BYTE* raw)
+{
+    if (readAuditBytes(hFile,
+                       offset,
+                       stored,
+                       storedBytes) == FALSE)
+    {
+        return NULL;
+    }
+    if (storedBytes == rawBytes)
+    {
+        return stored;
+    }
+    SIZE_T decompressedBytes = 0;
+    if ((Decompress(query->hDecompressor,
+                    stored,
+                    storedBytes,
+                    raw,
+                    rawBytes,
+                    &decompressedBytes) == FALSE) ||
+        (decompressedBytes != rawBytes))
+    {
+        return NULL;
+    }
+    return raw;
+}
+
+/// @brief handles a record of an active segment for a query: a node is
+/// added to the segment's path store, an event is reported
+/// @param record the record
+/// @param bytes its size
+/// @param event the event, NULL for a node record
+/// @param context the AuditQuery
+/// @return TRUE to continue, FALSE to stop reading the segment
+static BOOL reportActiveRecord(const BYTE* record,
+                               DWORD bytes,
+                               const AuditEvent* event,
+                               void* context)
+{
+    AuditQuery* query = (AuditQuery*) context;
+    if (event == NULL)
+    {
+        return addAuditNode(&query->paths,
+                            record,
+                            bytes,
+                            query->path);
+    }
+    return reportAuditEvent(query,
+                            event);
+}
+
+/// @brief passes an event to the query's callback if it is in the range
+/// @param query the query
+/// @param event the event
+/// @return TRUE to continue, FALSE if the callback asked to stop
+static BOOL reportAuditEvent(AuditQuery* query,
+                             const AuditEvent* event)
+{
+    if ((event->time < query->from) || (event->time > query->to))
+    {
+        return TRUE;
+    }
+    if (query->callback(event,
+                        getAuditPath(&query->paths, event->path, query->path),
+                        getAuditPath(&query->paths, event->actor, query->actor),
+                        query->context) == FALSE)
+    {
+        query->stopped = TRUE;
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/// @brief seals an active segment: its events are regrouped into blocks of
+/// AUDIT_INDEX_EVENTS that are compressed on their own, its node records
+/// into one compressed frame, followed by an index of the blocks. The sealed
+/// segment is written under a temporary name and renamed over, and only then
+/// is the active segment deleted, so a crash leaves one or the other. A
+/// block cut short at the end of the active segment is dropped.
+/// @param activePath the active segment, whose writer has closed it
+/// @return TRUE if it was sealed, FALSE if it could not be read or written
+BOOL sealAuditSegment(const wchar_t* activePath)
+{
+    BYTE* buffer = NULL;
+    DWORD size = 0;
+    if (readAuditFile(activePath,
+                      &buffer,
+                      &size) == FALSE)
+    {
+        return FALSE;
+    }
+    const AuditSegmentHeader* segmentHeader = (const AuditSegmentHeader*) buffer;
+    wchar_t sealedPath[MAX_PATH + 1] = { 0 };
+    wchar_t tempPath[MAX_PATH + 1] = { 0 };
+    wcsncpy(sealedPath,
+            activePath,
+            MAX_PATH);
+    wchar_t* extension = wcsrchr(sealedPath, L'.');
+    wchar_t* name = wcsrchr(sealedPath, L'\\');
+    AuditSeal* seal = HeapAlloc(GetProcessHeap(),
+                                HEAP_ZERO_MEMORY,
+                                sizeof(AuditSeal));
+    if ((size < sizeof(AuditSegmentHeader)) ||
+        (segmentHeader->magic != AUDIT_MAGIC) ||
+        (segmentHeader->version != AUDIT_VERSION) ||
+        (extension == NULL) || (name == NULL) || (seal == NULL))
+    {
+        if (seal != NULL)
+        {
+            HeapFree(GetProcessHeap(),
+                     0,
+                     seal);
+        }
+        HeapFree(GetProcessHeap(),
+                 0,
+                 buffer);
+        return FALSE;
+    }
+    wcscpy(extension,
+           AUDIT_SEALED_EXTENSION);
+    _snwprintf(tempPath,
+               ARRAYSIZE(tempPath),
+               L"%.*s" AUDIT_TEMP_PREFIX L"%s",
+               (int) (name + 1 - sealedPath),
+               sealedPath,
+               name + 1);
+    tempPath[MAX_PATH] = 0;
+
+    seal->hFile = INVALID_HANDLE_VALUE;
+    seal->raw = HeapAlloc(GetProcessHeap(),
+                          0,
+                          AUDIT_BLOCK_BYTES);
+    seal->stored = HeapAlloc(GetProcessHeap(),
+                             0,
+                             AUDIT_BLOCK_BYTES);
+    seal->nodes = HeapAlloc(GetProcessHeap(),
+                            0,
+                            size);
+    seal->header.magic = AUDIT_MAGIC;
+    seal->header.version = AUDIT_VERSION;
+    seal->header.minTime = MAXULONGLONG;
+    seal->offset = sizeof(AuditSealedHeader);
+    seal->result = (seal->raw != NULL) && (seal->stored != NULL) && (seal->nodes != NULL) &&
+        CreateCompressor(AUDIT_ALGORITHM, NULL, &seal->hCompressor);
+    if (seal->result)
+    {
+        seal->hFile = CreateFileW(tempPath,
+                                  GENERIC_WRITE,
+                                  0,
+                                  NULL,
+                                  CREATE_ALWAYS,
+                                  FILE_ATTRIBUTE_NORMAL,
+                                  NULL);
+        seal->result = (seal->hFile != INVALID_HANDLE_VALUE) &&
+            writeAuditBytes(seal->hFile, &seal->header, sizeof(seal->header));
+    }
+    if (seal->result)
+    {
+        walkActiveSegment(buffer,
+                          size,
+                          collectSealedRecord,
+                          seal);
+        writeSealedBlock(seal);
+    }
+
+    // The node frame, then the index, then the finished header
+    BYTE* nodeStored = NULL;
+    if (seal->result && (seal->nodeBytes > 0))
+    {
+        nodeStored = HeapAlloc(GetProcessHeap(),
+                               0,
+                               seal->nodeBytes);
+        SIZE_T compressedBytes = 0;
+        const BYTE* frame = seal->nodes;
+        seal->header.nodeRaw = seal->nodeBytes;
+        seal->header.nodeStored = seal->nodeBytes;
+        if ((nodeStored != NULL) &&
+            Compress(seal->hCompressor,
+                     seal->nodes,
+                     seal->nodeBytes,
+                     nodeStored,
+                     seal->nodeBytes,
+                     &compressedBytes) &&
+            (compressedBytes < seal->nodeBytes))
+        {
+            seal->header.nodeStored = (DWORD) compressedBytes;
+            frame = nodeStored;
+        }
+        seal->result = writeAuditBytes(seal->hFile,
+                                       frame,
+                                       seal->header.nodeStored);
+    }
+    seal->header.nodeOffset = seal->offset;
+    seal->header.indexOffset = seal->offset + seal->header.nodeStored;
+    LARGE_INTEGER start = { 0 };
+    seal->result = seal->result &&
+        ((seal->header.blocks == 0) ||
+         writeAuditBytes(seal->hFile,
+                         seal->index,
+                         seal->header.blocks * sizeof(AuditIndexEntry))) &&
+        SetFilePointerEx(seal->hFile, start, NULL, FILE_BEGIN) &&
+        writeAuditBytes(seal->hFile, &seal->header, sizeof(seal->header)) &&
+        FlushFileBuffers(seal->hFile);
+    if (seal->hFile != INVALID_HANDLE_VALUE)
+    {
+        CloseHandle(seal->hFile);
+    }
+
+    BOOL result = seal->result;
+    if (result && (seal->header.events == 0))
+    {
+        DeleteFileW(tempPath);
+        DeleteFileW(activePath);
+    }
+    else if (result &&
+             MoveFileExW(tempPath,
+                         sealedPath,
+                         MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH))
+    {
+        DeleteFileW(activePath);
+    }
+    else
+    {
+        LOG(L"Failed to seal audit segment %s, error code %d\n",
+            activePath,
+            GetLastError());
+        DeleteFileW(tempPath);
+        result = FALSE;
+    }
+
+    if (seal->hCompressor != NULL)
+    {
+        CloseCompressor(seal->hCompressor);
+    }
+    void* buffers[] = { seal->raw, seal->stored, seal->nodes, seal->index, nodeStored, buffer };
+    for (DWORD i = 0; i < ARRAYSIZE(buffers); i++)
+    {
+        if (buffers[i] != NULL)
+        {
+            HeapFree(GetProcessHeap(),
+                     0,
+                     buffers[i]);
+        }
+    }
+    HeapFree(GetProcessHeap(),
+             0,
+             seal);
+    return result;
+}
+
+/// @brief starts the audit log the first time auditEvent() is called, if
+/// AuditLog is set
+/// @param initOnce unused
+/// @param parameter unused
+/// @param context unused
+/// @return TRUE, an audit log that could not start stays off
+static BOOL CALLBACK startAuditLog(PINIT_ONCE initOnce,
+                                   void* parameter,
+                                   void** context)
+{
+    UNREFERENCED_PARAMETER(initOnce);
+    UNREFERENCED_PARAMETER(parameter);
+    UNREFERENCED_PARAMETER(context);
+    wchar_t folder[MAX_PATH + 1] = { 0 };
+    auditLogStarted = isAuditEnabled() &&
+        getAuditFolder(folder, ARRAYSIZE(folder)) &&
+        openAuditWriter(&auditLog, folder);
+    return TRUE;
+}
+
+#ifndef NDEBUG
+/// @brief counts the events found by testAudit() and checks each one
+/// against how it was queued
+/// @param event the event
+/// @param path its path
+/// @param actor its actor
+/// @param context the AuditTestQuery
+/// @return TRUE to continue
+static BOOL collectTestEvent(const AuditEvent* event,
+                             const wchar_t* path,
+                             const wchar_t* actor,
+                             void* context)
+{
+    AuditTestQuery* query = (AuditTestQuery*) context;
+    wchar_t expected[MAX_PATH + 1] = { 0 };
+    if (event->items % 100 != 99)
+    {
+        _snwprintf(expected,
+                   ARRAYSIZE(expected),
+                   L"C:\\Users\\Test\\Documents\\Folder%llu\\File%llu.txt",
+                   event->items % 7,
+                   event->items);
+    }
+    assert(wcscmp(path, expected) == 0);
+    assert(wcscmp(actor, query->actor) == 0);
+    assert(event->bytes == event->items * 3);
+    assert(event->operation == AUDIT_OP_TRASH + event->items % 5);
+    query->events++;
+    query->items += event->items;
+    return TRUE;
+}
+#endif
+
+/// @brief writes events through several writers, with rotation, sealing and
+/// a segment left active as if its process crashed, then queries time ranges
+/// across them in a debug build, returns immediately in a release build
+/// @param none
+void testAudit(void)
+{
+#ifndef NDEBUG
+    wchar_t tempDirectory[MAX_PATH + 1] = { 0 };
+    wchar_t root[MAX_PATH + 1] = { 0 };
+    GetTempPathW(ARRAYSIZE(tempDirectory),
+                 tempDirectory);
+    _snwprintf(root,
+               ARRAYSIZE(root),
+               L"%srbmaudit%08X",
+               tempDirectory,
+               GetCurrentProcessId());
+    root[MAX_PATH] = 0;
+    deleteTree(root, NULL);
+    BOOL result = CreateDirectoryW(root,
+                                   NULL);
+    assert(result);
+
+    // Event i happens 10 seconds after event i - 1. The first writer gets
+    // enough events for several index blocks, the second rotates after every
+    // block and the third leaves its segment active.
+    const ULONGLONG step = 10 * FILETIME_PER_SECOND;
+    const ULONGLONG start = getCurrentFileTime() - 40000 * step;
+    const ULONGLONG firsts[] = { 0, 20000, 30000 };
+    const ULONGLONG counts[] = { 10000, 500, 50 };
+    wchar_t path[MAX_PATH + 1] = { 0 };
+    AuditWriter writer = { 0 };
+    for (DWORD w = 0; w < ARRAYSIZE(firsts); w++)
+    {
+        result = openAuditWriter(&writer,
+                                 root);
+        assert(result);
+        writer.segmentLimit = (w == 1) ? 1 : AUDIT_SEGMENT_BYTES;
+        writer.keepActive = (w == 2);
+        for (ULONGLONG i = firsts[w]; i < firsts[w] + counts[w]; i++)
+        {
+            _snwprintf(path,
+                       ARRAYSIZE(path),
+                       L"C:\\Users\\Test\\Documents\\Folder%llu\\File%llu.txt",
+                       i % 7,
+                       i);
+            queueAuditEvent(&writer,
+                            start + i * step,
+                            AUDIT_OP_TRASH + (DWORD) (i % 5),
+                            (i % 100 == 99) ? NULL : path,
+                            i * 3,
+                            i);
+        }
+        result = closeAuditWriter(&writer);
+        assert(result);
+    }
+
+    // Only the third writer's segment is still active
+    WIN32_FIND_DATAW data = { 0 };
+    DWORD active = 0;
+    DWORD sealed = 0;
+    for (DWORD pass = 0; pass < 2; pass++)
+    {
+        buildAuditPath(root,
+                       (pass == 0) ? AUDIT_ACTIVE_PATTERN : L"Audit-*" AUDIT_SEALED_EXTENSION,
+                       path);
+        HANDLE hFind = FindFirstFileW(path,
+                                      &data);
+        if (hFind != INVALID_HANDLE_VALUE)
+        {
+            do
+            {
+                if (pass == 0)
+                {
+                    active++;
+                }
+                else
+                {
+                    sealed++;
+                }
+            } while (FindNextFileW(hFind, &data));
+            FindClose(hFind);
+        }
+    }
+    assert(active == 1);
+    assert(sealed >= 2);
+
+    // Query ranges in each writer and across them, then again once the
+    // next writer to start has sealed the active segment
+    const ULONGLONG ranges[][2] = {
+        { 0, MAXULONGLONG },
+        { 5000, 5099 },
+        { 4090, 4100 },
+        { 9990, 20009 },
+        { 20100, 30009 },
+        { 30040, 40000 },
+        { 10000, 19999 },
+    };
+    AuditTestQuery query = { 0 };
+    query.actor = writer.actor;
+    for (DWORD pass = 0; pass < 2; pass++)
+    {
+        for (DWORD r = 0; r < ARRAYSIZE(ranges); r++)
+        {
+            ULONGLONG expectedEvents = 0;
+            ULONGLONG expectedItems = 0;
+            for (DWORD w = 0; w < ARRAYSIZE(firsts); w++)
+            {
+                for (ULONGLONG i = firsts[w]; i < firsts[w] + counts[w]; i++)
+                {
+                    if ((i >= ranges[r][0]) && (i <= ranges[r][1]))
+                    {
+                        expectedEvents++;
+                        expectedItems += i;
+                    }
+                }
+            }
+            query.events = 0;
+            query.items = 0;
+            result = queryAuditLog(root,
+                                   start + ranges[r][0] * step,
+                                   (ranges[r][1] == MAXULONGLONG) ? MAXULONGLONG :
+                                   start + ranges[r][1] * step,
+                                   collectTestEvent,
+                                   &query);
+            assert(result);
+            assert(query.events == expectedEvents);
+            assert(query.items == expectedItems);
+        }
+        if (pass == 0)
+        {
+            result = openAuditWriter(&writer,
+                                     root) &&
+                closeAuditWriter(&writer);
+            assert(result);
+            buildAuditPath(root,
+                           AUDIT_ACTIVE_PATTERN,
+                           path);
+            HANDLE hFind = FindFirstFileW(path,
+                                          &data);
+            assert(hFind == INVALID_HANDLE_VALUE);
+        }
+    }
+
+    result = deleteTree(root, NULL);
+    assert(result);
+#endif
+}
+
+/// @brief seals segments left active by processes that are no longer
+/// running, including ones with our process id from before a restart, and
+/// deletes sealed segments that ended more than AuditKeepDays ago. Called
+/// before the writer opens its first segment.
+/// @param folder the audit folder
+static void tidyAuditFolder(const wchar_t* folder)
+{
+    wchar_t pattern[MAX_PATH + 1] = { 0 };
+    wchar_t path[MAX_PATH + 1] = { 0 };
+    WIN32_FIND_DATAW data = { 0 };
+    if (buildAuditPath(folder, AUDIT_ACTIVE_PATTERN, pattern))
+    {
+        HANDLE hFind = FindFirstFileW(pattern,
+                                      &data);
+        if (hFind != INVALID_HANDLE_VALUE)
+        {
+            do
+            {
+                ULONGLONG startTime = 0;
+                DWORD processId = 0;
+                if ((swscanf(data.cFileName,
+                             L"Audit-%16llX-%8X",
+                             &startTime,
+                             &processId) == 2) &&
+                    ((processId == GetCurrentProcessId()) ||
+                     (isAuditProcessRunning(processId) == FALSE)) &&
+                    buildAuditPath(folder, data.cFileName, path))
+                {
+                    sealAuditSegment(path);
+                }
+            } while (FindNextFileW(hFind, &data));
+            FindClose(hFind);
+        }
+    }
+
+    int keepDays = getIniInt(INI_KEY_AUDIT_KEEP_DAYS,
+                             INI_DEFAULT_VALUE_AUDIT_KEEP_DAYS);
+    if ((keepDays <= 0) ||
+        (buildAuditPath(folder, L"Audit-*" AUDIT_SEALED_EXTENSION, pattern) == FALSE))
+    {
+        return;
+    }
+    ULONGLONG cutoff = getCurrentFileTime() - (ULONGLONG) keepDays * 24 * 60 * 60 * FILETIME_PER_SECOND;
+    HANDLE hFind = FindFirstFileW(pattern,
+                                  &data);
+    if (hFind == INVALID_HANDLE_VALUE)
+    {
+        return;
+    }
+    do
+    {
+        if (buildAuditPath(folder, data.cFileName, path) == FALSE)
+        {
+            continue;
+        }
+        HANDLE hFile = CreateFileW(path,
+                                   GENERIC_READ,
+                                   FILE_SHARE_READ | FILE_SHARE_DELETE,
+                                   NULL,
+                                   OPEN_EXISTING,
+                                   FILE_ATTRIBUTE_NORMAL,
+                                   NULL);
+        if (hFile == INVALID_HANDLE_VALUE)
+        {
+            continue;
+        }
+        AuditSealedHeader header = { 0 };
+        BOOL expired = readAuditBytes(hFile, 0, &header, sizeof(header)) &&
+            (header.magic == AUDIT_MAGIC) &&
+            (header.maxTime < cutoff);
+        CloseHandle(hFile);
+        if (expired)
+        {
+            DeleteFileW(path);
+        }
+    } while (FindNextFileW(hFind, &data));
+    FindClose(hFind);
+}
+
+/// @brief reads the records of an active segment block by block. A block
+/// cut short by a crash or a writer still appending to it, or a damaged
+/// record, ends the segment.
+/// @param buffer the whole segment
+/// @param size its size
+/// @param sink called for every record
+/// @param context passed to sink
+/// @return TRUE if every record was read, FALSE if sink asked to stop
+static BOOL walkActiveSegment(const BYTE* buffer,
+                              DWORD size,
+                              AuditRecordSink sink,
+                              void* context)
+{
+    DWORD position = sizeof(AuditSegmentHeader);
+    while (size - position >= sizeof(AuditBlockHeader))
+    {
+        AuditBlockHeader header = { 0 };
+        memcpy(&header,
+               buffer + position,
+               sizeof(header));
+        position += sizeof(header);
+        if (header.bytes > size - position)
+        {
+            return TRUE;
+        }
+        DWORD end = position + header.bytes;
+        ULONGLONG previousTime = header.baseTime;
+        while (position < end)
+        {
+            DWORD start = position;
+            AuditEvent event = { 0 };
+            DWORD type = decodeAuditRecord(buffer,
+                                           end,
+                                           &position,
+                                           &previousTime,
+                                           &event);
+            if (type == 0)
+            {
+                return TRUE;
+            }
+            if (sink(buffer + start,
+                     position - start,
+                     (type == AUDIT_RECORD_EVENT) ? &event : NULL,
+                     context) == FALSE)
+            {
+                return FALSE;
+            }
+        }
+    }
+    return TRUE;
+}
+
+/// @brief appends the block being encoded to the active segment, then seals
+/// the segment if it has passed its limit or the write failed
+/// @param writer the audit writer
+/// @param bytes the bytes of records after the block header
+/// @param events the number of events in the block
+/// @param baseTime the first event's time
+/// @param minTime the earliest event's time
+/// @param maxTime the latest event's time
+/// @return TRUE if the block was written
+static BOOL writeAuditBlock(AuditWriter* writer,
+                            DWORD bytes,
+                            DWORD events,
+                            ULONGLONG baseTime,
+                            ULONGLONG minTime,
+                            ULONGLONG maxTime)
+{
+    AuditBlockHeader* header = (AuditBlockHeader*) writer->block;
+    header->bytes = bytes;
+    header->events = events;
+    header->baseTime = baseTime;
+    header->minTime = minTime;
+    header->maxTime = maxTime;
+    BOOL result = writeAuditBytes(writer->hSegment,
+                                  writer->block,
+                                  sizeof(AuditBlockHeader) + bytes);
+    if (result)
+    {
+        writer->segmentBytes += sizeof(AuditBlockHeader) + bytes;
+        writer->events += events;
+    }
+    else
+    {
+        LOG(L"Failed to write to audit segment %s, error code %d\n",
+            writer->segmentPath,
+            GetLastError());
+        writer->lost += events;
+    }
+    // A failed write may have left part of a block, which ends the segment
+    if ((result == FALSE) || (writer->segmentBytes >= writer->segmentLimit))
+    {
+        closeAuditSegment(writer,
+                          TRUE);
+    }
+    return result;
+}
+
+/// @brief writes all of a buffer at the file pointer
+/// @param hFile the file
+/// @param buffer the bytes
+/// @param bytes how many to write
+/// @return TRUE if they were all written
+static BOOL writeAuditBytes(HANDLE hFile,
+                            const void* buffer,
+                            DWORD bytes)
+{
+    DWORD bytesWritten = 0;
+    return WriteFile(hFile, buffer, bytes, &bytesWritten, NULL) &&
+        (bytesWritten == bytes);
+}
+
+/// @brief prints one event for /auditlog: when it happened, the operation,
+/// the bytes and items it covered, who did it and the path
+/// @param event the event
+/// @param path its path, empty for none
+/// @param actor the SID of the user who did it
+/// @param context unused
+/// @return TRUE to keep listing
+BOOL writeAuditEvent(const AuditEvent* event,
+                     const wchar_t* path,
+                     const wchar_t* actor,
+                     void* context)
+{
+    UNREFERENCED_PARAMETER(context);
+    wchar_t time[64] = { 0 };
+    formatFileTime(event->time,
+                   time,
+                   ARRAYSIZE(time));
+    writeOutput(L"%s %-7s %14llu %8llu %s %s\n",
+                time,
+                getAuditOperationName(event->operation),
+                event->bytes,
+                event->items,
+                (actor[0] != 0) ? actor : L"-",
+                path);
+    return TRUE;
+}
+
+/// @brief compresses the events gathered while sealing as one block and
+/// adds it to the index. Its events are encoded from the block's earliest
+/// time, which the index entry keeps.
+/// @param seal the segment being sealed
+/// @return TRUE if the block was written or there was nothing to write
+static BOOL writeSealedBlock(AuditSeal* seal)
+{
+    if ((seal->result == FALSE) || (seal->eventCount == 0))
+    {
+        return seal->result;
+    }
+    AuditIndexEntry entry = { 0 };
+    entry.offset = seal->offset;
+    entry.minTime = MAXULONGLONG;
+    entry.events = seal->eventCount;
+    for (DWORD i = 0; i < seal->eventCount; i++)
+    {
+        entry.minTime = min(entry.minTime, seal->events[i].time);
+        entry.maxTime = max(entry.maxTime, seal->events[i].time);
+    }
+    ULONGLONG previousTime = entry.minTime;
+    for (DWORD i = 0; i < seal->eventCount; i++)
+    {
+        entry.rawBytes += encodeAuditEvent(seal->raw + entry.rawBytes,
+                                           &seal->events[i],
+                                           previousTime);
+        previousTime = seal->events[i].time;
+    }
+    SIZE_T compressedBytes = 0;
+    const BYTE* frame = seal->raw;
+    entry.storedBytes = entry.rawBytes;
+    if (Compress(seal->hCompressor,
+                 seal->raw,
+                 entry.rawBytes,
+                 seal->stored,
+                 AUDIT_BLOCK_BYTES,
+                 &compressedBytes) &&
+        (compressedBytes < entry.rawBytes))
+    {
+        entry.storedBytes = (DWORD) compressedBytes;
+        frame = seal->stored;
+    }
+
+    if (seal->header.blocks == seal->indexCapacity)
+    {
+        DWORD capacity = max(seal->indexCapacity * 2, 16);
+        AuditIndexEntry* index = (seal->index == NULL) ?
+            HeapAlloc(GetProcessHeap(), 0, capacity * sizeof(AuditIndexEntry)) :
+            HeapReAlloc(GetProcessHeap(), 0, seal->index, capacity * sizeof(AuditIndexEntry));
+        if (index == NULL)
+        {
+            // Memory allocation failed
+            seal->result = FALSE;
+            return FALSE;
+        }
+        seal->index = index;
+        seal->indexCapacity = capacity;
+    }
+    seal->result = writeAuditBytes(seal->hFile,
+                                   frame,
+                                   entry.storedBytes);
+    seal->index[seal->header.blocks++] = entry;
+    seal->header.minTime = min(seal->header.minTime, entry.minTime);
+    seal->header.maxTime = max(seal->header.maxTime, entry.maxTime);
+    seal->header.events += entry.events;
+    seal->offset += entry.storedBytes;
+    seal->eventCount = 0;
+    return seal->result;
+}
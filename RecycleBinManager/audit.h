@@ -0,0 +1,161 @@
+#define _CRT_SECURE_NO_WARNINGS
+
+#pragma once
+#include <Windows.h>
+#include <compressapi.h>
+#include <stdio.h>
+#include <assert.h>
+#include "bin.h"
+#include "pathstore.h"
+
+// Audit log parameters. With AuditLog set, every item trashed, restored or
+// purged, and every empty, is added to an append-only log in the app data
+// folder along with who did it. Callers only copy the event into a queue;
+// a background thread wakes once a second, or as soon as the queue is half
+// full, and writes everything queued as one block. Each process writes its
+// own segment, so processes never share a file. Records are varints: times
+// are deltas from the previous event, and paths and users are interned in a
+// PathStore, so each folder name is written once per segment and an event
+// refers to its path by node id. A segment is sealed once it passes
+// AUDIT_SEGMENT_BYTES, or when its process exits: its events are regrouped
+// into blocks of AUDIT_INDEX_EVENTS that are compressed on their own, its
+// path nodes are compressed into one frame, and a sparse index of each
+// block's offset and time range goes at the end. A query reads the header
+// of each sealed segment, skips those outside the time range, and jumps
+// through the index to only the blocks it needs. Segments left behind by a
+// process that did not exit cleanly are read whole, and sealed by the next
+// process to start writing. Sealed segments are deleted after
+// AuditKeepDays.
+
+#define AUDIT_ACTIVE_FORMAT     L"Audit-%016llX-%08X.rbal" // Start time and process id
+#define AUDIT_SEALED_EXTENSION  L".rbaz" // Replaces .rbal once sealed
+#define AUDIT_PATTERN           L"Audit-*.rba?" // Active and sealed segments
+#define AUDIT_ACTIVE_PATTERN    L"Audit-*.rbal"
+#define AUDIT_TEMP_PREFIX       L"~" // A sealed segment while it is written
+#define AUDIT_MAGIC             0x4C424D52 // "RMBL" when read as bytes
+#define AUDIT_VERSION           1
+#define AUDIT_ALGORITHM         COMPRESS_ALGORITHM_XPRESS_HUFF
+#define AUDIT_QUEUE_BYTES       (256 * 1024) // Each of the two queue buffers
+#define AUDIT_BLOCK_BYTES       (1024 * 1024) // Largest block, encoded
+#define AUDIT_FLUSH_MILLISECONDS 1000
+#define AUDIT_SEGMENT_BYTES     (4 * 1024 * 1024) // An active segment is sealed past this
+#define AUDIT_INDEX_EVENTS      4096 // Events per block of a sealed segment
+#define AUDIT_RECORD_NODE       1 // Parent node + 1, name length, UTF-8 name
+#define AUDIT_RECORD_EVENT      2 // Time delta, operation, path + 1, actor + 1, bytes, items
+#define AUDIT_OP_TRASH          1
+#define AUDIT_OP_RESTORE        2
+#define AUDIT_OP_PURGE          3
+#define AUDIT_OP_EMPTY          4 // A whole bin folder, path is the folder
+#define AUDIT_OP_ERASE          5 // A whole bin folder securely erased
+
+// Structs
+
+typedef struct AuditSegmentHeader // Starts an active segment
+{
+    DWORD magic; // Always AUDIT_MAGIC
+    DWORD version; // Always AUDIT_VERSION
+    ULONGLONG startTime;
+    DWORD processId;
+    DWORD reserved;
+} AuditSegmentHeader;
+
+typedef struct AuditBlockHeader // Precedes each block of an active segment
+{
+    DWORD bytes; // Of records that follow
+    DWORD events;
+    ULONGLONG baseTime; // The first event's delta is from this
+    ULONGLONG minTime;
+    ULONGLONG maxTime;
+} AuditBlockHeader;
+
+typedef struct AuditSealedHeader // Starts a sealed segment
+{
+    DWORD magic; // Always AUDIT_MAGIC
+    DWORD version; // Always AUDIT_VERSION
+    ULONGLONG minTime;
+    ULONGLONG maxTime;
+    ULONGLONG events;
+    ULONGLONG nodeOffset; // Of the compressed node frame
+    ULONGLONG indexOffset; // Of the AuditIndexEntry array
+    DWORD nodeStored; // Bytes of the node frame, nodeRaw if stored as is
+    DWORD nodeRaw;
+    DWORD nodes;
+    DWORD blocks; // Entries in the index
+} AuditSealedHeader;
+
+typedef struct AuditIndexEntry // One block of a sealed segment
+{
+    ULONGLONG offset;
+    ULONGLONG minTime; // The first event's delta is from this
+    ULONGLONG maxTime;
+    DWORD storedBytes; // rawBytes if the block did not compress
+    DWORD rawBytes;
+    DWORD events;
+    DWORD reserved;
+} AuditIndexEntry;
+
+typedef struct AuditQueued // An event in a queue buffer, followed by its path
+{
+    ULONGLONG time;
+    ULONGLONG bytes;
+    ULONGLONG items;
+    DWORD operation;
+    DWORD pathLength; // Characters with the terminator, 1 for no path
+} AuditQueued;
+
+typedef struct AuditEvent
+{
+    ULONGLONG time; // FILETIME
+    ULONGLONG bytes;
+    ULONGLONG items;
+    DWORD operation; // One of the AUDIT_OP_ values
+    DWORD path; // Node id, PATH_STORE_NO_NODE for none
+    DWORD actor; // Node id of the user's SID
+} AuditEvent;
+
+/// @brief called once for every event a query finds
+/// @return TRUE to continue the query, FALSE to stop
+typedef BOOL (*AuditEventCallback)(const AuditEvent* event, const wchar_t* path,
+                                   const wchar_t* actor, void* context);
+
+typedef struct AuditWriter
+{
+    wchar_t folder[MAX_PATH + 1];
+    wchar_t segmentPath[MAX_PATH + 1]; // The active segment, empty if none is open
+    HANDLE hSegment;
+    ULONGLONG segmentBytes; // Written to the active segment
+    ULONGLONG segmentLimit; // AUDIT_SEGMENT_BYTES, sealed once past this
+    ULONGLONG segmentStart; // FILETIME in the active segment's name
+    PathStore paths; // Interned paths of the active segment
+    DWORD nodesWritten; // Nodes of paths already in the segment
+    BYTE* queues[2]; // AUDIT_QUEUE_BYTES each, callers fill [0] while [1] is written
+    DWORD queueUsed; // Bytes in queues[0]
+    BYTE* block; // AUDIT_BLOCK_BYTES, a block being encoded
+    CRITICAL_SECTION lock; // Guards queues, queueUsed and stopping
+    CONDITION_VARIABLE queued; // Wakes the writer thread
+    CONDITION_VARIABLE drained; // Wakes callers waiting for room in the queue
+    HANDLE hThread;
+    BOOL stopping;
+    BOOL keepActive; // Leave the last segment unsealed, only to test recovery
+    wchar_t actor[BIN_SID_MAX_CCH]; // The user's SID
+    ULONGLONG events; // Written so far
+    ULONGLONG lost; // Events in blocks that could not be written
+} AuditWriter;
+
+// Functions
+
+void auditEvent(DWORD operation, const wchar_t* path, ULONGLONG bytes, ULONGLONG items);
+void closeAuditLog(void);
+BOOL closeAuditWriter(AuditWriter* writer);
+BOOL getAuditFolder(wchar_t* folder, size_t cchFolder);
+const wchar_t* getAuditOperationName(DWORD operation);
+BOOL isAuditEnabled(void);
+BOOL openAuditWriter(AuditWriter* writer, const wchar_t* folder);
+BOOL queryAuditLog(const wchar_t* folder, ULONGLONG from, ULONGLONG to,
+                   AuditEventCallback callback, void* context);
+void queueAuditEvent(AuditWriter* writer, ULONGLONG time, DWORD operation,
+                     const wchar_t* path, ULONGLONG bytes, ULONGLONG items);
+BOOL sealAuditSegment(const wchar_t* activePath);
+void testAudit(void);
+BOOL writeAuditEvent(const AuditEvent* event, const wchar_t* path, const wchar_t* actor,
+                     void* context);
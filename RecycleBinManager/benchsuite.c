@@ -0,0 +1,579 @@
+/*
+* Benchmark suite run against a generated bin folder
+*
+* Copyright(C) 2024 ERROR_SUCCESS Software
+*
+* This program is free software : you can redistribute it and /or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.If not, see < https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#include "benchsuite.h"
+#include "bin.h"
+#include "reclaim.h"
+#include "trash.h"
+#include "logger.h"
+
+typedef struct BinTally
+{
+    ULONGLONG items;
+    ULONGLONG bytes;
+    BOOL sizeContent; // Size the $R file or folder rather than trusting the $I file
+} BinTally;
+
+static BOOL createSizedFile(const wchar_t* path, ULONGLONG size);
+static BOOL generateFolderItem(const wchar_t* path, DWORD levels, ULONGLONG* random,
+                               const TrashSpec* spec, BenchSuiteResult* result,
+                               ULONGLONG* bytes);
+static ULONGLONG generateSize(ULONGLONG* random, ULONGLONG medianBytes);
+static double millisecondsSince(const LARGE_INTEGER* start);
+static ULONGLONG nextRandom(ULONGLONG* state);
+static BOOL parseGeneratedInfo(const TrashSpec* spec, BenchPhase* phase);
+static BOOL tallyBinItem(const BinItem* item, void* context);
+
+/// @brief creates a file and extends it to a size without writing to it
+/// @param path the full path of the file, which must not exist yet
+/// @param size the size in bytes
+/// @return TRUE on success, FALSE if the file could not be created
+static BOOL createSizedFile(const wchar_t* path,
+                            ULONGLONG size)
+{
+    HANDLE hFile = CreateFileW(path,
+                               GENERIC_WRITE,
+                               0,
+                               NULL,
+                               CREATE_NEW,
+                               FILE_ATTRIBUTE_NORMAL,
+                               NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+    {
+        return FALSE;
+    }
+    LARGE_INTEGER end = { .QuadPart = (LONGLONG) size };
+    BOOL result = SetFilePointerEx(hFile,
+                                   end,
+                                   NULL,
+                                   FILE_BEGIN) &&
+        SetEndOfFile(hFile);
+    CloseHandle(hFile);
+    return result;
+}
+
+/// @brief builds a folder item: a few files in each folder, and one
+/// folder inside it until the levels run out
+/// @param path the full path of the folder, which must not exist yet
+/// @param levels the folders from here down, at least 1
+/// @param random the generator state
+/// @param spec the file size distribution
+/// @param result counts the files and folders created
+/// @param bytes incremented by the size of every file created
+/// @return TRUE on success, FALSE if anything could not be created
+static BOOL generateFolderItem(const wchar_t* path,
+                               DWORD levels,
+                               ULONGLONG* random,
+                               const TrashSpec* spec,
+                               BenchSuiteResult* result,
+                               ULONGLONG* bytes)
+{
+    if (CreateDirectoryW(path,
+                         NULL) == FALSE)
+    {
+        return FALSE;
+    }
+    result->folders++;
+
+    wchar_t childPath[MAX_PATH + 1] = { 0 };
+    DWORD files = 1 + (DWORD) (nextRandom(random) % BENCH_MAX_FOLDER_FILES);
+    for (DWORD i = 0; i < files; i++)
+    {
+        _snwprintf(childPath,
+                   ARRAYSIZE(childPath),
+                   L"%s\\file%u.dat",
+                   path,
+                   i);
+        childPath[MAX_PATH] = 0;
+        ULONGLONG size = generateSize(random,
+                                      spec->medianBytes);
+        if (createSizedFile(childPath,
+                            size) == FALSE)
+        {
+            return FALSE;
+        }
+        result->files++;
+        *bytes += size;
+    }
+    if (levels <= 1)
+    {
+        return TRUE;
+    }
+    _snwprintf(childPath,
+               ARRAYSIZE(childPath),
+               L"%s\\sub%u",
+               path,
+               levels - 1);
+    childPath[MAX_PATH] = 0;
+    return generateFolderItem(childPath,
+                              levels - 1,
+                              random,
+                              spec,
+                              result,
+                              bytes);
+}
+
+/// @brief draws a file size from a log-normal distribution
+/// @param random the generator state
+/// @param medianBytes the median of the distribution
+/// @return the size in bytes
+static ULONGLONG generateSize(ULONGLONG* random,
+                              ULONGLONG medianBytes)
+{
+    // Box-Muller turns two uniform numbers into a normal one
+    double u1 = ((double) (nextRandom(random) >> 11) + 1.0) / 9007199254740993.0;
+    double u2 = (double) (nextRandom(random) >> 11) / 9007199254740992.0;
+    double normal = sqrt(-2.0 * log(u1)) * cos(6.283185307179586 * u2);
+    double size = (double) medianBytes * exp(BENCH_SIZE_SIGMA * normal);
+    if (size >= (double) BENCH_MAX_FILE_BYTES)
+    {
+        return BENCH_MAX_FILE_BYTES;
+    }
+    return (ULONGLONG) size;
+}
+
+/// @brief fills a folder with items in the format the shell uses for a bin
+/// @param binDirectory the folder, which must exist and be empty
+/// @param spec how many items, how big and how old
+/// @param result receives the number of files and folders and their size
+/// @return TRUE on success, FALSE if anything could not be created
+BOOL generateTrash(const wchar_t* binDirectory,
+                   const TrashSpec* spec,
+                   BenchSuiteResult* result)
+{
+    static const wchar_t* extensions[] = { L".txt", L".docx", L".jpg", L".pdf", L".log", L".zip" };
+    static const wchar_t digits[] = L"0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ";
+
+    BYTE* buffer = HeapAlloc(GetProcessHeap(),
+                             0,
+                             BIN_INFO_MAX_SIZE);
+    if (buffer == NULL)
+    {
+        // Memory allocation failed
+        return FALSE;
+    }
+
+    ULONGLONG random = (spec->seed == 0) ? BENCH_DEFAULT_SEED : spec->seed;
+    ULONGLONG now = getCurrentFileTime();
+    ULONGLONG spread = (ULONGLONG) spec->spreadDays * 86400 * FILETIME_PER_SECOND;
+    BOOL success = TRUE;
+    for (DWORD i = 0; (i < spec->items) && success; i++)
+    {
+        // The index in base 36 keeps the random looking suffixes unique
+        wchar_t suffix[BIN_SUFFIX_CCH + 1] = { 0 };
+        DWORD value = i;
+        for (int digit = BIN_SUFFIX_CCH - 1; digit >= 0; digit--)
+        {
+            suffix[digit] = digits[value % 36];
+            value /= 36;
+        }
+
+        BOOL folder = ((nextRandom(&random) % 100) < BENCH_FOLDER_PERCENT);
+        const wchar_t* extension = (folder) ? L"" :
+            extensions[nextRandom(&random) % ARRAYSIZE(extensions)];
+        wchar_t contentPath[MAX_PATH + 1] = { 0 };
+        wchar_t infoPath[MAX_PATH + 1] = { 0 };
+        wchar_t originalPath[MAX_PATH + 1] = { 0 };
+        _snwprintf(contentPath,
+                   ARRAYSIZE(contentPath),
+                   L"%s\\%s%s%s",
+                   binDirectory,
+                   BIN_CONTENT_PREFIX,
+                   suffix,
+                   extension);
+        contentPath[MAX_PATH] = 0;
+        _snwprintf(infoPath,
+                   ARRAYSIZE(infoPath),
+                   L"%s\\%s%s%s",
+                   binDirectory,
+                   BIN_INFO_PREFIX,
+                   suffix,
+                   extension);
+        infoPath[MAX_PATH] = 0;
+        _snwprintf(originalPath,
+                   ARRAYSIZE(originalPath),
+                   L"C:\\Users\\Bench\\Documents\\Project%u\\%s%u%s",
+                   (DWORD) (nextRandom(&random) % 50),
+                   (folder) ? L"Folder" : L"File",
+                   i,
+                   extension);
+        originalPath[MAX_PATH] = 0;
+
+        ULONGLONG size = 0;
+        if (folder)
+        {
+            DWORD levels = 1 + (DWORD) (nextRandom(&random) % max(spec->depth, 1));
+            success = generateFolderItem(contentPath,
+                                         levels,
+                                         &random,
+                                         spec,
+                                         result,
+                                         &size);
+        }
+        else
+        {
+            size = generateSize(&random,
+                                spec->medianBytes);
+            success = createSizedFile(contentPath,
+                                      size);
+            result->files++;
+        }
+        if (success == FALSE)
+        {
+            LOG(L"Failed to generate %s, error %lu\n",
+                contentPath,
+                GetLastError());
+            break;
+        }
+        result->bytes += size;
+
+        ULONGLONG age = (spread == 0) ? 0 : nextRandom(&random) % spread;
+        DWORD infoSize = buildBinInfo(buffer,
+                                      originalPath,
+                                      size,
+                                      now - age);
+        HANDLE hInfo = CreateFileW(infoPath,
+                                   GENERIC_WRITE,
+                                   0,
+                                   NULL,
+                                   CREATE_NEW,
+                                   FILE_ATTRIBUTE_NORMAL,
+                                   NULL);
+        DWORD written = 0;
+        success = (hInfo != INVALID_HANDLE_VALUE) &&
+            WriteFile(hInfo,
+                      buffer,
+                      infoSize,
+                      &written,
+                      NULL) &&
+            (written == infoSize);
+        if (hInfo != INVALID_HANDLE_VALUE)
+        {
+            CloseHandle(hInfo);
+        }
+    }
+    HeapFree(GetProcessHeap(),
+             0,
+             buffer);
+    return success;
+}
+
+/// @brief fills in the default benchmark specification
+/// @param spec receives the defaults
+void initTrashSpec(TrashSpec* spec)
+{
+    spec->items = BENCH_DEFAULT_ITEMS;
+    spec->medianBytes = BENCH_DEFAULT_MEDIAN_KB * 1024ULL;
+    spec->depth = BENCH_DEFAULT_DEPTH;
+    spec->spreadDays = BENCH_DEFAULT_SPREAD_DAYS;
+    spec->seed = BENCH_DEFAULT_SEED;
+}
+
+/// @brief returns the time since a performance counter reading
+/// @param start the earlier reading
+/// @return the time in milliseconds
+static double millisecondsSince(const LARGE_INTEGER* start)
+{
+    static LARGE_INTEGER frequency = { 0 };
+    if (frequency.QuadPart == 0)
+    {
+        QueryPerformanceFrequency(&frequency);
+    }
+    LARGE_INTEGER now = { 0 };
+    QueryPerformanceCounter(&now);
+    return ((double) (now.QuadPart - start->QuadPart) * 1e3) / (double) frequency.QuadPart;
+}
+
+/// @brief advances a xorshift64 generator
+/// @param state the generator state, never 0
+/// @return the next value
+static ULONGLONG nextRandom(ULONGLONG* state)
+{
+    ULONGLONG x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *state = x;
+    return x;
+}
+
+/// @brief times parsing $I metadata that is already in memory, so the cost
+/// of the format can be told apart from the cost of reading the files
+/// @param spec the number of items decides the number of parses
+/// @param phase receives the timing
+/// @return TRUE on success, FALSE if memory ran out or a buffer did not parse
+static BOOL parseGeneratedInfo(const TrashSpec* spec,
+                               BenchPhase* phase)
+{
+    // Every generated path fits in MAX_PATH
+    const DWORD stride = BIN_INFO_HEADER_SIZE + sizeof(DWORD) + ((MAX_PATH + 1) * sizeof(wchar_t));
+    BYTE* buffers = HeapAlloc(GetProcessHeap(),
+                              0,
+                              (SIZE_T) stride * BENCH_PARSE_BUFFERS);
+    DWORD* sizes = HeapAlloc(GetProcessHeap(),
+                             0,
+                             sizeof(DWORD) * BENCH_PARSE_BUFFERS);
+    if ((buffers == NULL) || (sizes == NULL))
+    {
+        // Memory allocation failed
+        if (buffers != NULL)
+        {
+            HeapFree(GetProcessHeap(), 0, buffers);
+        }
+        if (sizes != NULL)
+        {
+            HeapFree(GetProcessHeap(), 0, sizes);
+        }
+        return FALSE;
+    }
+    wchar_t originalPath[MAX_PATH + 1] = { 0 };
+    for (DWORD i = 0; i < BENCH_PARSE_BUFFERS; i++)
+    {
+        _snwprintf(originalPath,
+                   ARRAYSIZE(originalPath),
+                   L"C:\\Users\\Bench\\Documents\\Project%u\\File%u.txt",
+                   i % 50,
+                   i);
+        originalPath[MAX_PATH] = 0;
+        sizes[i] = buildBinInfo(buffers + ((SIZE_T) i * stride),
+                                originalPath,
+                                (ULONGLONG) i * 4096,
+                                getCurrentFileTime());
+    }
+
+    BOOL success = TRUE;
+    ULONGLONG parses = (ULONGLONG) spec->items * BENCH_PARSE_PASSES;
+    LARGE_INTEGER start = { 0 };
+    QueryPerformanceCounter(&start);
+    for (ULONGLONG i = 0; (i < parses) && success; i++)
+    {
+        DWORD index = (DWORD) (i % BENCH_PARSE_BUFFERS);
+        BinItem item = { 0 };
+        success = parseBinInfo(buffers + ((SIZE_T) index * stride),
+                               sizes[index],
+                               &item,
+                               originalPath,
+                               ARRAYSIZE(originalPath));
+    }
+    phase->milliseconds = millisecondsSince(&start);
+    phase->items = parses;
+
+    HeapFree(GetProcessHeap(),
+             0,
+             buffers);
+    HeapFree(GetProcessHeap(),
+             0,
+             sizes);
+    return success;
+}
+
+/// @brief generates a bin folder inside a folder and times every operation
+/// on it, then deletes it
+/// @param folder where to put the bin folder. Put it on the volume to be
+/// measured, a RAM disk takes the disk out of the numbers.
+/// @param spec how many items, how big and how old
+/// @param result receives the timings
+/// @return TRUE if every phase ran, FALSE if the bin could not be generated
+BOOL runBenchSuite(const wchar_t* folder,
+                   const TrashSpec* spec,
+                   BenchSuiteResult* result)
+{
+    memset(result,
+           0,
+           sizeof(BenchSuiteResult));
+    result->spec = *spec;
+
+    wchar_t binDirectory[MAX_PATH + 1] = { 0 };
+    size_t length = wcslen(folder);
+    _snwprintf(binDirectory,
+               ARRAYSIZE(binDirectory),
+               L"%s%s%s%08X",
+               folder,
+               ((length > 0) && (folder[length - 1] == L'\\')) ? L"" : L"\\",
+               BENCH_FOLDER_PREFIX,
+               GetCurrentProcessId());
+    binDirectory[MAX_PATH] = 0;
+    deleteTree(binDirectory,
+               NULL);
+    if (CreateDirectoryW(binDirectory,
+                         NULL) == FALSE)
+    {
+        LOG(L"Unable to create the benchmark folder %s, error %lu\n",
+            binDirectory,
+            GetLastError());
+        return FALSE;
+    }
+
+    LARGE_INTEGER start = { 0 };
+    QueryPerformanceCounter(&start);
+    BOOL success = generateTrash(binDirectory,
+                                 spec,
+                                 result);
+    result->generate.milliseconds = millisecondsSince(&start);
+    result->generate.items = spec->items;
+    if (success == FALSE)
+    {
+        deleteTree(binDirectory,
+                   NULL);
+        return FALSE;
+    }
+
+    success = parseGeneratedInfo(spec,
+                                 &result->parse);
+
+    BYTE* buffer = HeapAlloc(GetProcessHeap(),
+                             0,
+                             BIN_INFO_MAX_SIZE);
+    if (buffer == NULL)
+    {
+        // Memory allocation failed
+        deleteTree(binDirectory,
+                   NULL);
+        return FALSE;
+    }
+    BinTally query = { 0 };
+    QueryPerformanceCounter(&start);
+    enumerateBinDirectory(binDirectory,
+                          0,
+                          buffer,
+                          tallyBinItem,
+                          &query);
+    result->query.milliseconds = millisecondsSince(&start);
+    result->query.items = query.items;
+
+    BinTally count = { .sizeContent = TRUE };
+    QueryPerformanceCounter(&start);
+    enumerateBinDirectory(binDirectory,
+                          0,
+                          buffer,
+                          tallyBinItem,
+                          &count);
+    result->count.milliseconds = millisecondsSince(&start);
+    result->count.items = count.items;
+    HeapFree(GetProcessHeap(),
+             0,
+             buffer);
+
+    QueryPerformanceCounter(&start);
+    stageBinDirectory(binDirectory,
+                      1,
+                      &result->stage.items);
+    result->stage.milliseconds = millisecondsSince(&start);
+
+    QueryPerformanceCounter(&start);
+    restoreBinDirectory(binDirectory,
+                        &result->restore.items);
+    result->restore.milliseconds = millisecondsSince(&start);
+
+    // Swapping takes the same few renames however many items there are,
+    // so it is measured against the items it took out of the bin
+    ULONGLONG swapped = 0;
+    ULONGLONG swapRestored = 0;
+    QueryPerformanceCounter(&start);
+    swapBinDirectory(binDirectory,
+                     1,
+                     &swapped);
+    result->swap.milliseconds = millisecondsSince(&start);
+    restoreBinDirectory(binDirectory,
+                        &swapRestored);
+    result->swap.items = swapRestored;
+
+    // Deleting is timed on its own, without the move into staging
+    ULONGLONG staged = 0;
+    stageBinDirectory(binDirectory,
+                      1,
+                      &staged);
+    ReclaimPass pass = { 0 };
+    QueryPerformanceCounter(&start);
+    reclaimBinDirectory(binDirectory,
+                        getCurrentFileTime(),
+                        NULL,
+                        NULL,
+                        &pass);
+    result->empty.milliseconds = millisecondsSince(&start);
+    result->empty.items = pass.reclaimed;
+
+    result->consistent = success &&
+        (query.items == spec->items) &&
+        (query.bytes == result->bytes) &&
+        (count.items == spec->items) &&
+        (count.bytes == result->bytes) &&
+        (result->stage.items == spec->items) &&
+        (result->restore.items == spec->items) &&
+        (swapped == 1) &&
+        (swapRestored == spec->items) &&
+        (staged == spec->items) &&
+        (pass.reclaimed == spec->items);
+    if (result->consistent == FALSE)
+    {
+        LOG(L"Benchmark phases disagree on the contents of %s\n",
+            binDirectory);
+    }
+    deleteTree(binDirectory,
+               NULL);
+    return TRUE;
+}
+
+/// @brief adds up the items in a bin folder
+/// @param item the item found
+/// @param context the BinTally
+/// @return TRUE to continue
+static BOOL tallyBinItem(const BinItem* item,
+                         void* context)
+{
+    BinTally* tally = context;
+    tally->items++;
+    tally->bytes += (tally->sizeContent) ? getTreeSize(item->contentPath) : item->size;
+    return TRUE;
+}
+
+/// @brief runs a small benchmark in a debug build and checks every phase
+/// saw the whole bin, returns immediately in a release build
+/// @param none
+void testBenchSuite(void)
+{
+#ifndef NDEBUG
+    wchar_t tempDirectory[MAX_PATH + 1] = { 0 };
+    GetTempPathW(ARRAYSIZE(tempDirectory),
+                 tempDirectory);
+
+    TrashSpec spec = { 0 };
+    initTrashSpec(&spec);
+    spec.items = 200;
+    spec.depth = 3;
+    BenchSuiteResult result = { 0 };
+    BOOL success = runBenchSuite(tempDirectory,
+                                 &spec,
+                                 &result);
+    assert(success);
+    assert(result.consistent);
+    assert(result.files >= spec.items);
+    assert(result.folders > 0);
+    assert(result.parse.items == (ULONGLONG) spec.items * BENCH_PARSE_PASSES);
+
+    // The same seed builds the same bin
+    BenchSuiteResult again = { 0 };
+    success = runBenchSuite(tempDirectory,
+                            &spec,
+                            &again);
+    assert(success && again.consistent);
+    assert((again.files == result.files) && (again.bytes == result.bytes));
+#endif
+}
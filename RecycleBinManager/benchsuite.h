@@ -0,0 +1,72 @@
+#define _CRT_SECURE_NO_WARNINGS
+
+#pragma once
+#include <Windows.h>
+#include <stdio.h>
+#include <math.h>
+#include <assert.h>
+
+// Benchmark suite parameters. The suite builds a synthetic bin folder in
+// the same $I/$R format the shell writes, then times the operations the
+// app performs on a real bin: parsing metadata, listing the bin, sizing
+// every item, an instant empty item by item and by swapping the whole bin
+// folder out, undoing it and deleting everything. Item
+// sizes follow a log-normal distribution around a median, a share of the
+// items are folder trees of random depth, and deletion times are spread
+// evenly over a number of days. Files are extended to their size without
+// being written, so even a large bin is quick to generate.
+
+#define BENCH_DEFAULT_ITEMS         10000
+#define BENCH_DEFAULT_MEDIAN_KB     64
+#define BENCH_DEFAULT_DEPTH         4
+#define BENCH_DEFAULT_SPREAD_DAYS   90
+#define BENCH_DEFAULT_SEED          0x243F6A8885A308D3ULL
+#define BENCH_FOLDER_PERCENT        10 // Items that are folders rather than files
+#define BENCH_MAX_FOLDER_FILES      4 // Most files in each folder of a folder item
+#define BENCH_SIZE_SIGMA            1.5 // Spread of the log-normal file sizes
+#define BENCH_MAX_FILE_BYTES        (1ULL << 32)
+#define BENCH_PARSE_PASSES          16 // Times each metadata buffer is parsed
+#define BENCH_PARSE_BUFFERS         256 // Distinct metadata buffers parsed
+#define BENCH_FOLDER_PREFIX         L"rbmbench"
+
+// Structs
+
+typedef struct TrashSpec
+{
+    DWORD items; // Files and folders at the top of the bin
+    ULONGLONG medianBytes; // Median file size
+    DWORD depth; // Deepest a folder item goes, 1 for folders of files
+    DWORD spreadDays; // Deletion times fall in this many days before now
+    ULONGLONG seed; // The same seed builds the same bin
+} TrashSpec;
+
+typedef struct BenchPhase
+{
+    ULONGLONG items; // What the phase worked through
+    double milliseconds;
+} BenchPhase;
+
+typedef struct BenchSuiteResult
+{
+    TrashSpec spec;
+    ULONGLONG files; // Every file generated, including those inside folders
+    ULONGLONG folders; // Every folder generated, including those inside folders
+    ULONGLONG bytes;
+    BenchPhase generate;
+    BenchPhase parse; // Metadata held in memory
+    BenchPhase query; // Listing the bin and reading every $I file
+    BenchPhase count; // Sizing every $R file and folder tree
+    BenchPhase stage; // Instant empty
+    BenchPhase restore; // Undoing it
+    BenchPhase swap; // Instant empty by swapping the bin folder, per item swapped out
+    BenchPhase empty; // Deleting everything
+    BOOL consistent; // Every phase saw every item and byte that was generated
+} BenchSuiteResult;
+
+// Functions
+
+BOOL generateTrash(const wchar_t* binDirectory, const TrashSpec* spec,
+                   BenchSuiteResult* result);
+void initTrashSpec(TrashSpec* spec);
+BOOL runBenchSuite(const wchar_t* folder, const TrashSpec* spec, BenchSuiteResult* result);
+void testBenchSuite(void);
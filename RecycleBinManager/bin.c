@@ -0,0 +1,493 @@
+/*
+* Read items directly out of the per-volume Recycle Bin folders
+*
+* Copyright(C) 2024 ERROR_SUCCESS Software
+*
+* This program is free software : you can redistribute it and /or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.If not, see < https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#include "bin.h"
+#include "logger.h"
+
+static wchar_t currentUserSid[BIN_SID_MAX_CCH] = { 0 };
+static INIT_ONCE currentUserSidOnce = INIT_ONCE_STATIC_INIT;
+
+static BOOL CALLBACK lookUpCurrentUserSid(PINIT_ONCE initOnce, void* parameter, void** context);
+
+/// @brief builds the contents of a $I metadata file in the format used by
+/// Windows 10 and later
+/// @param buffer receives the contents, at least BIN_INFO_MAX_SIZE bytes
+/// @param originalPath the full path the item was deleted from
+/// @param size the size of the item in bytes
+/// @param deletionTime the FILETIME of the deletion, as a 64 bit value
+/// @return the number of bytes written to buffer, 0 if the path is too long
+DWORD buildBinInfo(BYTE* buffer,
+                   const wchar_t* originalPath,
+                   ULONGLONG size,
+                   ULONGLONG deletionTime)
+{
+    // The stored length includes the terminator
+    DWORD nameLength = (DWORD) wcslen(originalPath) + 1;
+    DWORD totalSize = BIN_INFO_HEADER_SIZE + sizeof(DWORD) + (nameLength * sizeof(wchar_t));
+    if (totalSize > BIN_INFO_MAX_SIZE)
+    {
+        return 0;
+    }
+    LONGLONG version = BIN_INFO_VERSION_WIN10;
+    memcpy(buffer, &version, sizeof(version));
+    memcpy(buffer + 8, &size, sizeof(size));
+    memcpy(buffer + 16, &deletionTime, sizeof(deletionTime));
+    memcpy(buffer + BIN_INFO_HEADER_SIZE, &nameLength, sizeof(nameLength));
+    memcpy(buffer + BIN_INFO_HEADER_SIZE + sizeof(DWORD),
+           originalPath,
+           nameLength * sizeof(wchar_t));
+    return totalSize;
+}
+
+/// @brief calls the callback for every item in one bin folder
+/// @param binDirectory the bin folder
+/// @param volumeSerial the serial number of the volume it is on
+/// @param buffer scratch space of at least BIN_INFO_MAX_SIZE bytes
+/// @param callback the function to call for each item
+/// @param context passed through to the callback unchanged
+/// @return TRUE to carry on with the next folder, FALSE if the callback
+///         stopped the enumeration
+BOOL enumerateBinDirectory(const wchar_t* binDirectory,
+                           DWORD volumeSerial,
+                           BYTE* buffer,
+                           BinItemCallback callback,
+                           void* context)
+{
+    // Every item in the bin has exactly one $I file
+    wchar_t searchPattern[MAX_PATH + 1] = { 0 };
+    _snwprintf(searchPattern,
+               ARRAYSIZE(searchPattern),
+               L"%s\\%s*",
+               binDirectory,
+               BIN_INFO_PREFIX);
+    searchPattern[MAX_PATH] = 0;
+
+    WIN32_FIND_DATAW findData = { 0 };
+    HANDLE hFind = FindFirstFileExW(searchPattern,
+                                    FindExInfoBasic,
+                                    &findData,
+                                    FindExSearchNameMatch,
+                                    NULL,
+                                    FIND_FIRST_EX_LARGE_FETCH);
+    if (hFind == INVALID_HANDLE_VALUE)
+    {
+        return TRUE;
+    }
+
+    // Items deleted from deep folders record paths well past MAX_PATH
+    wchar_t* originalPath = HeapAlloc(GetProcessHeap(),
+                                      0,
+                                      BIN_PATH_MAX_CCH * sizeof(wchar_t));
+    if (originalPath == NULL) // Memory allocation failed
+    {
+        FindClose(hFind);
+        return TRUE;
+    }
+
+    BOOL keepGoing = TRUE;
+    do
+    {
+        if (findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+        {
+            continue;
+        }
+
+        wchar_t infoPath[MAX_PATH + 1] = { 0 };
+        wchar_t contentPath[MAX_PATH + 1] = { 0 };
+        _snwprintf(infoPath,
+                   ARRAYSIZE(infoPath),
+                   L"%s\\%s",
+                   binDirectory,
+                   findData.cFileName);
+        infoPath[MAX_PATH] = 0;
+
+        // The content file has the same name with $R in place of $I
+        _snwprintf(contentPath,
+                   ARRAYSIZE(contentPath),
+                   L"%s\\%s%s",
+                   binDirectory,
+                   BIN_CONTENT_PREFIX,
+                   findData.cFileName + wcslen(BIN_INFO_PREFIX));
+        contentPath[MAX_PATH] = 0;
+
+        BinItem item = { 0 };
+        if (readBinInfoFile(infoPath,
+                            buffer,
+                            &item,
+                            originalPath,
+                            BIN_PATH_MAX_CCH) == FALSE)
+        {
+            LOG(L"Skipping unreadable bin metadata %s\n",
+                infoPath);
+            continue;
+        }
+        item.volumeSerial = volumeSerial;
+        item.infoPath = infoPath;
+        item.contentPath = contentPath;
+        keepGoing = callback(&item,
+                             context);
+    } while (keepGoing && FindNextFileW(hFind, &findData));
+    FindClose(hFind);
+    HeapFree(GetProcessHeap(),
+             0,
+             originalPath);
+    return keepGoing;
+}
+
+/// @brief calls the callback for every item in the current user's bin on
+/// every fixed volume
+/// @param callback the function to call for each item
+/// @param context passed through to the callback unchanged
+/// @return TRUE if enumeration completed or was stopped by the callback,
+///         FALSE if the bin could not be read at all. A volume whose bin
+///         folder cannot be read is skipped rather than failing the rest.
+BOOL enumerateBinItems(BinItemCallback callback,
+                       void* context)
+{
+    // Without the user's SID there is no bin folder to look in
+    if (getCurrentUserSid() == NULL)
+    {
+        return FALSE;
+    }
+
+    BYTE* buffer = HeapAlloc(GetProcessHeap(),
+                             0,
+                             BIN_INFO_MAX_SIZE);
+    if (buffer == NULL) // Memory allocation failed
+    {
+        return FALSE;
+    }
+
+    BOOL keepGoing = TRUE;
+    DWORD drives = GetLogicalDrives();
+    for (wchar_t driveLetter = L'A'; (driveLetter <= L'Z') && keepGoing; driveLetter++)
+    {
+        if ((drives & (1 << (driveLetter - L'A'))) == 0)
+        {
+            continue;
+        }
+
+        wchar_t binDirectory[MAX_PATH + 1] = { 0 };
+        if (getBinDirectory(driveLetter,
+                            binDirectory,
+                            ARRAYSIZE(binDirectory)) == FALSE)
+        {
+            continue;
+        }
+
+        DWORD volumeSerial = 0;
+        wchar_t volumeRoot[] = { driveLetter, L':', L'\\', 0 };
+        GetVolumeInformationW(volumeRoot,
+                              NULL,
+                              0,
+                              &volumeSerial,
+                              NULL,
+                              NULL,
+                              NULL,
+                              0);
+        keepGoing = enumerateBinDirectory(binDirectory,
+                                          volumeSerial,
+                                          buffer,
+                                          callback,
+                                          context);
+    }
+
+    HeapFree(GetProcessHeap(),
+             0,
+             buffer);
+    return TRUE;
+}
+
+/// @brief builds the path to the current user's bin folder on a volume
+/// @param driveLetter the drive letter of the volume
+/// @param binDirectory receives the path, without a trailing backslash
+/// @param cchBinDirectory the size of binDirectory in characters
+/// @return TRUE if the volume has a bin folder for the current user,
+///         FALSE if not
+BOOL getBinDirectory(wchar_t driveLetter,
+                     wchar_t* binDirectory,
+                     size_t cchBinDirectory)
+{
+    wchar_t volumeRoot[] = { driveLetter, L':', L'\\', 0 };
+    if (GetDriveTypeW(volumeRoot) != DRIVE_FIXED)
+    {
+        return FALSE;
+    }
+
+    wchar_t* sid = getCurrentUserSid();
+    if (sid == NULL)
+    {
+        return FALSE;
+    }
+
+    int written = _snwprintf(binDirectory,
+                             cchBinDirectory,
+                             L"%c:\\%s\\%s",
+                             driveLetter,
+                             BIN_FOLDER_NAME,
+                             sid);
+    binDirectory[cchBinDirectory - 1] = 0;
+    if ((written < 0) || ((size_t) written >= cchBinDirectory))
+    {
+        return FALSE;
+    }
+    DWORD attributes = GetFileAttributesW(binDirectory);
+    return ((attributes != INVALID_FILE_ATTRIBUTES) &&
+            (attributes & FILE_ATTRIBUTE_DIRECTORY));
+}
+
+/// @brief builds the path to the current user's bin folder on the volume
+/// that holds a path. This also works for volumes mounted in a folder.
+/// @param path a full path on the volume
+/// @param binDirectory receives the path, without a trailing backslash
+/// @param cchBinDirectory the size of binDirectory in characters
+/// @return TRUE if the volume has a bin folder for the current user,
+///         FALSE if not
+BOOL getBinDirectoryForPath(const wchar_t* path,
+                            wchar_t* binDirectory,
+                            size_t cchBinDirectory)
+{
+    wchar_t volumeRoot[MAX_PATH + 1] = { 0 };
+    if (GetVolumePathNameW(path,
+                           volumeRoot,
+                           ARRAYSIZE(volumeRoot)) == FALSE)
+    {
+        return FALSE;
+    }
+
+    wchar_t* sid = getCurrentUserSid();
+    if (sid == NULL)
+    {
+        return FALSE;
+    }
+
+    // The volume root always ends with a backslash
+    int written = _snwprintf(binDirectory,
+                             cchBinDirectory,
+                             L"%s%s\\%s",
+                             volumeRoot,
+                             BIN_FOLDER_NAME,
+                             sid);
+    binDirectory[cchBinDirectory - 1] = 0;
+    if ((written < 0) || ((size_t) written >= cchBinDirectory))
+    {
+        return FALSE;
+    }
+    DWORD attributes = GetFileAttributesW(binDirectory);
+    return ((attributes != INVALID_FILE_ATTRIBUTES) &&
+            (attributes & FILE_ATTRIBUTE_DIRECTORY));
+}
+
+/// @brief gets the current user's SID as a string, which is the name of
+/// their folder inside each volume's $Recycle.Bin. It is looked up once,
+/// whichever thread asks first.
+/// @param none
+/// @return the SID string, or NULL if it cannot be retrieved
+wchar_t* getCurrentUserSid(void)
+{
+    if (InitOnceExecuteOnce(&currentUserSidOnce,
+                            lookUpCurrentUserSid,
+                            NULL,
+                            NULL) == FALSE)
+    {
+        return NULL;
+    }
+    return currentUserSid;
+}
+
+/// @brief gets the current time as a 64 bit FILETIME value
+/// @param none
+/// @return the number of 100ns intervals since January 1, 1601 (UTC)
+ULONGLONG getCurrentFileTime(void)
+{
+    FILETIME now = { 0 };
+    GetSystemTimeAsFileTime(&now);
+    ULARGE_INTEGER value = { 0 };
+    value.LowPart = now.dwLowDateTime;
+    value.HighPart = now.dwHighDateTime;
+    return value.QuadPart;
+}
+
+/// @brief looks up the current user's SID for getCurrentUserSid()
+/// @param initOnce unused
+/// @param parameter unused
+/// @param context unused
+/// @return TRUE if it was found, FALSE to try again on the next call
+static BOOL CALLBACK lookUpCurrentUserSid(PINIT_ONCE initOnce,
+                                          void* parameter,
+                                          void** context)
+{
+    UNREFERENCED_PARAMETER(initOnce);
+    UNREFERENCED_PARAMETER(parameter);
+    UNREFERENCED_PARAMETER(context);
+    HANDLE hToken = NULL;
+    if (OpenProcessToken(GetCurrentProcess(),
+                         TOKEN_QUERY,
+                         &hToken) == FALSE)
+    {
+        LOG(L"Failed to open the process token, error code %d\n",
+            GetLastError());
+        return FALSE;
+    }
+
+    BYTE tokenBuffer[256] = { 0 };
+    DWORD tokenSize = 0;
+    BOOL result = GetTokenInformation(hToken,
+                                      TokenUser,
+                                      tokenBuffer,
+                                      sizeof(tokenBuffer),
+                                      &tokenSize);
+    CloseHandle(hToken);
+    if (result == FALSE)
+    {
+        LOG(L"Failed to query the token user, error code %d\n",
+            GetLastError());
+        return FALSE;
+    }
+
+    wchar_t* convertedSid = NULL;
+    TOKEN_USER* tokenUser = (TOKEN_USER*) tokenBuffer;
+    if (ConvertSidToStringSidW(tokenUser->User.Sid,
+                               &convertedSid) == FALSE)
+    {
+        return FALSE;
+    }
+    wcsncpy(currentUserSid,
+            convertedSid,
+            ARRAYSIZE(currentUserSid) - 1);
+    LocalFree(convertedSid);
+    return TRUE;
+}
+
+/// @brief parses the contents of a $I metadata file
+/// @param buffer the contents of the file
+/// @param bufferSize the number of valid bytes in buffer
+/// @param item receives the size, deletion time and original path
+/// @param originalPath receives the original path, item->originalPath
+/// will point at this buffer
+/// @param cchOriginalPath the size of originalPath in characters
+/// @return TRUE if the metadata is valid, FALSE if not
+BOOL parseBinInfo(const BYTE* buffer,
+                  DWORD bufferSize,
+                  BinItem* item,
+                  wchar_t* originalPath,
+                  size_t cchOriginalPath)
+{
+    if (bufferSize < BIN_INFO_HEADER_SIZE)
+    {
+        return FALSE;
+    }
+
+    LONGLONG version = 0;
+    FILETIME deletionTime = { 0 };
+    memcpy(&version, buffer, sizeof(version));
+    memcpy(&item->size, buffer + 8, sizeof(item->size));
+    memcpy(&deletionTime, buffer + 16, sizeof(deletionTime));
+    ULARGE_INTEGER time = { 0 };
+    time.LowPart = deletionTime.dwLowDateTime;
+    time.HighPart = deletionTime.dwHighDateTime;
+    item->deletionTime = time.QuadPart;
+
+    // Vista through 8.1 use a fixed MAX_PATH buffer, 10 and later store
+    // the length of the path followed by the path itself
+    const wchar_t* path = NULL;
+    size_t pathLength = 0;
+    if (version == BIN_INFO_VERSION_VISTA)
+    {
+        if (bufferSize < BIN_INFO_HEADER_SIZE + (BIN_INFO_VISTA_PATH_CCH * sizeof(wchar_t)))
+        {
+            return FALSE;
+        }
+        path = (const wchar_t*) (buffer + BIN_INFO_HEADER_SIZE);
+        pathLength = wcsnlen(path, BIN_INFO_VISTA_PATH_CCH);
+    }
+    else if (version == BIN_INFO_VERSION_WIN10)
+    {
+        DWORD nameLength = 0;
+        if (bufferSize < BIN_INFO_HEADER_SIZE + sizeof(DWORD))
+        {
+            return FALSE;
+        }
+        memcpy(&nameLength, buffer + BIN_INFO_HEADER_SIZE, sizeof(nameLength));
+
+        // Divide rather than multiply, which could wrap on 32 bit builds
+        if (nameLength > (bufferSize - BIN_INFO_HEADER_SIZE - sizeof(DWORD)) / sizeof(wchar_t))
+        {
+            return FALSE;
+        }
+        path = (const wchar_t*) (buffer + BIN_INFO_HEADER_SIZE + sizeof(DWORD));
+        pathLength = wcsnlen(path, nameLength);
+    }
+    else
+    {
+        return FALSE;
+    }
+
+    if (pathLength >= cchOriginalPath)
+    {
+        pathLength = cchOriginalPath - 1;
+    }
+    memcpy(originalPath, path, pathLength * sizeof(wchar_t));
+    originalPath[pathLength] = 0;
+    item->originalPath = originalPath;
+    return TRUE;
+}
+
+/// @brief reads and parses a $I metadata file
+/// @param infoPath the full path to the $I file
+/// @param buffer scratch space of at least BIN_INFO_MAX_SIZE bytes
+/// @param item receives the size, deletion time and original path
+/// @param originalPath receives the original path
+/// @param cchOriginalPath the size of originalPath in characters
+/// @return TRUE if the file was read and is valid, FALSE if not
+BOOL readBinInfoFile(const wchar_t* infoPath,
+                     BYTE* buffer,
+                     BinItem* item,
+                     wchar_t* originalPath,
+                     size_t cchOriginalPath)
+{
+    HANDLE hFile = CreateFileW(infoPath,
+                               GENERIC_READ,
+                               FILE_SHARE_READ | FILE_SHARE_DELETE,
+                               NULL,
+                               OPEN_EXISTING,
+                               FILE_FLAG_SEQUENTIAL_SCAN,
+                               NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+    {
+        return FALSE;
+    }
+    DWORD bytesRead = 0;
+    BOOL result = ReadFile(hFile,
+                           buffer,
+                           BIN_INFO_MAX_SIZE,
+                           &bytesRead,
+                           NULL);
+    CloseHandle(hFile);
+    if (result == FALSE)
+    {
+        return FALSE;
+    }
+    return parseBinInfo(buffer,
+                        bytesRead,
+                        item,
+                        originalPath,
+                        cchOriginalPath);
+}
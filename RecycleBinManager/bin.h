@@ -0,0 +1,58 @@
+#define _CRT_SECURE_NO_WARNINGS
+
+#pragma once
+#include <Windows.h>
+#include <sddl.h>
+#include <stdio.h>
+#include <assert.h>
+
+// Recycle Bin layout. Every volume has a $Recycle.Bin folder containing one
+// folder per user SID. Each deleted item is stored as a pair of files that
+// share a random suffix: $I<suffix> holds the metadata and $R<suffix> holds
+// the item itself.
+
+#define BIN_FOLDER_NAME         L"$Recycle.Bin"
+#define BIN_INFO_PREFIX         L"$I"
+#define BIN_CONTENT_PREFIX      L"$R"
+#define BIN_INFO_VERSION_VISTA  1
+#define BIN_INFO_VERSION_WIN10  2
+#define BIN_INFO_HEADER_SIZE    24 // Version, file size and deletion time
+#define BIN_INFO_VISTA_PATH_CCH 260
+#define BIN_PATH_MAX_CCH        32768 // Longest path Windows 10 can record, with the terminator
+#define BIN_INFO_MAX_SIZE       (BIN_INFO_HEADER_SIZE + sizeof(DWORD) + \
+                                 (BIN_PATH_MAX_CCH * sizeof(wchar_t)))
+#define BIN_SID_MAX_CCH         256
+#define BIN_SUFFIX_CCH          6 // Random characters between $I/$R and the extension
+
+// Structs
+
+typedef struct BinItem
+{
+    ULONGLONG size; // Size of the item in bytes, as recorded by the shell
+    ULONGLONG deletionTime; // FILETIME of the deletion, as a 64 bit value
+    DWORD volumeSerial; // Serial number of the volume the item lives on
+    const wchar_t* originalPath; // Where the item was deleted from
+    const wchar_t* infoPath; // Full path to the $I metadata file
+    const wchar_t* contentPath; // Full path to the $R content file or folder
+} BinItem;
+
+/// @brief called once for every item found in the bin
+/// @return TRUE to continue enumerating, FALSE to stop
+typedef BOOL (*BinItemCallback)(const BinItem* item, void* context);
+
+// Functions
+
+DWORD buildBinInfo(BYTE* buffer, const wchar_t* originalPath, ULONGLONG size,
+                   ULONGLONG deletionTime);
+BOOL enumerateBinDirectory(const wchar_t* binDirectory, DWORD volumeSerial, BYTE* buffer,
+                           BinItemCallback callback, void* context);
+BOOL enumerateBinItems(BinItemCallback callback, void* context);
+BOOL getBinDirectory(wchar_t driveLetter, wchar_t* binDirectory, size_t cchBinDirectory);
+BOOL getBinDirectoryForPath(const wchar_t* path, wchar_t* binDirectory,
+                            size_t cchBinDirectory);
+wchar_t* getCurrentUserSid(void);
+ULONGLONG getCurrentFileTime(void);
+BOOL parseBinInfo(const BYTE* buffer, DWORD bufferSize, BinItem* item,
+                  wchar_t* originalPath, size_t cchOriginalPath);
+BOOL readBinInfoFile(const wchar_t* infoPath, BYTE* buffer, BinItem* item,
+                     wchar_t* originalPath, size_t cchOriginalPath);
@@ -0,0 +1,679 @@
+/*
+* Query, empty and watch the Recycle Bin through a swappable backend
+*
+* Copyright(C) 2024 ERROR_SUCCESS Software
+*
+* This program is free software : you can redistribute it and /or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.If not, see < https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#include "binbackend.h"
+#include "audit.h"
+#include "throttle.h"
+#include "logger.h"
+
+static BOOL drawFailure(MemoryBin* bin, DWORD failuresPerMillion);
+static void injectLatency(MemoryBin* bin, ULONGLONG nanoseconds, BOOL finished);
+static BOOL memoryBinEmpty(void* context, HWND hWnd, DWORD flags);
+static BOOL memoryBinQuery(void* context, ULONGLONG* items, ULONGLONG* bytes);
+static void memoryBinUnwatch(void* context, ULONG registrationId);
+static ULONG memoryBinWatch(void* context, HWND hWnd, UINT message);
+static ULONGLONG nextRandom(ULONGLONG* state);
+static void notifyWatchers(MemoryBin* bin);
+static BOOL shellEmpty(void* context, HWND hWnd, DWORD flags);
+static BOOL shellQuery(void* context, ULONGLONG* items, ULONGLONG* bytes);
+static void shellUnwatch(void* context, ULONG registrationId);
+static ULONG shellWatch(void* context, HWND hWnd, UINT message);
+
+// The backend the dialog uses, the shell unless setBinBackend() says otherwise
+static BinBackend activeBackend =
+{
+    L"shell",
+    shellQuery,
+    shellEmpty,
+    shellWatch,
+    shellUnwatch,
+    NULL
+};
+
+/// @brief puts items in a memory bin. Watchers are told if the bin was
+/// empty before.
+/// @param bin the memory bin
+/// @param count the number of items to add
+/// @param size the size of each item in bytes
+/// @return TRUE on success, FALSE if memory ran out
+BOOL addMemoryBinItems(MemoryBin* bin,
+                       ULONGLONG count,
+                       ULONGLONG size)
+{
+    EnterCriticalSection(&bin->lock);
+    if ((bin->count + count) > bin->capacity)
+    {
+        ULONGLONG capacity = (bin->capacity == 0) ? MEMORY_BIN_INITIAL_CAPACITY : bin->capacity;
+        while (capacity < (bin->count + count))
+        {
+            capacity *= 2;
+        }
+        ULONGLONG* sizes = (bin->sizes == NULL) ?
+            HeapAlloc(GetProcessHeap(),
+                      0,
+                      (SIZE_T) (capacity * sizeof(ULONGLONG))) :
+            HeapReAlloc(GetProcessHeap(),
+                        0,
+                        bin->sizes,
+                        (SIZE_T) (capacity * sizeof(ULONGLONG)));
+        if (sizes == NULL)
+        {
+            // Memory allocation failed
+            LeaveCriticalSection(&bin->lock);
+            return FALSE;
+        }
+        bin->sizes = sizes;
+        bin->capacity = capacity;
+    }
+    BOOL wasEmpty = (bin->count == 0);
+    for (ULONGLONG i = 0; i < count; i++)
+    {
+        bin->sizes[bin->count++] = size;
+    }
+    bin->bytes += count * size;
+    if (wasEmpty && (count > 0))
+    {
+        notifyWatchers(bin);
+    }
+    LeaveCriticalSection(&bin->lock);
+    return TRUE;
+}
+
+/// @brief times the memory backend: filling a bin, querying it and emptying
+/// it with a share of the deletes failing, then retrying until it is empty
+/// @param items the number of items to put in the bin
+/// @param deleteFailuresPerMillion the share of deletes that fail
+/// @param result receives the timings
+/// @return TRUE on success, FALSE if memory ran out
+BOOL benchmarkBinBackend(ULONGLONG items,
+                         DWORD deleteFailuresPerMillion,
+                         BinBackendBenchmark* result)
+{
+    memset(result,
+           0,
+           sizeof(BinBackendBenchmark));
+    result->items = items;
+    result->deleteFailuresPerMillion = min(deleteFailuresPerMillion, 1000000);
+
+    MemoryBinFaults faults = { 0 };
+    faults.deleteFailuresPerMillion = result->deleteFailuresPerMillion;
+    MemoryBin bin = { 0 };
+    BinBackend backend = { 0 };
+    initMemoryBin(&bin,
+                  &faults,
+                  &backend);
+    ULONG registrationId = backend.watch(backend.context,
+                                         NULL,
+                                         0);
+
+    // One item at a time, the way deletions arrive, with sizes from 4KB
+    // to about 512KB
+    LARGE_INTEGER frequency, start, end;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&start);
+    for (ULONGLONG i = 0; i < items; i++)
+    {
+        if (addMemoryBinItems(&bin,
+                              1,
+                              4096 + ((i % 1024) * 512)) == FALSE)
+        {
+            freeMemoryBin(&bin);
+            return FALSE;
+        }
+    }
+    QueryPerformanceCounter(&end);
+    double seconds = (double) (end.QuadPart - start.QuadPart) / (double) frequency.QuadPart;
+    result->nanosecondsPerAdd = (items == 0) ? 0.0 : (seconds * 1e9) / (double) items;
+
+    ULONGLONG count = 0;
+    ULONGLONG bytes = 0;
+    QueryPerformanceCounter(&start);
+    for (DWORD i = 0; i < BIN_BACKEND_BENCH_QUERIES; i++)
+    {
+        backend.query(backend.context,
+                      &count,
+                      &bytes);
+    }
+    QueryPerformanceCounter(&end);
+    seconds = (double) (end.QuadPart - start.QuadPart) / (double) frequency.QuadPart;
+    result->nanosecondsPerQuery = (seconds * 1e9) / BIN_BACKEND_BENCH_QUERIES;
+
+    QueryPerformanceCounter(&start);
+    backend.empty(backend.context,
+                  NULL,
+                  SHERB_NOCONFIRMATION | SHERB_NOPROGRESSUI | SHERB_NOSOUND);
+    QueryPerformanceCounter(&end);
+    seconds = (double) (end.QuadPart - start.QuadPart) / (double) frequency.QuadPart;
+    result->emptyMilliseconds = seconds * 1e3;
+    result->left = bin.count;
+    result->itemsPerSecond = (seconds > 0.0) ? (double) (items - bin.count) / seconds : 0.0;
+
+    // Every failure rate short of all of them empties the bin eventually
+    while ((bin.count > 0) && (result->retries < 64))
+    {
+        backend.empty(backend.context,
+                      NULL,
+                      SHERB_NOCONFIRMATION | SHERB_NOPROGRESSUI | SHERB_NOSOUND);
+        result->retries++;
+    }
+    backend.unwatch(backend.context,
+                    registrationId);
+    result->notifications = bin.notifications;
+    freeMemoryBin(&bin);
+    return TRUE;
+}
+
+/// @brief decides whether an injected failure happens
+/// @param bin the memory bin, its random state moves on
+/// @param failuresPerMillion the odds of a failure
+/// @return TRUE if the operation should fail
+static BOOL drawFailure(MemoryBin* bin,
+                        DWORD failuresPerMillion)
+{
+    if (failuresPerMillion == 0)
+    {
+        return FALSE;
+    }
+    return ((nextRandom(&bin->random) % 1000000) < failuresPerMillion);
+}
+
+/// @brief frees a memory bin set up by initMemoryBin()
+/// @param bin the memory bin
+void freeMemoryBin(MemoryBin* bin)
+{
+    if (bin->sizes != NULL)
+    {
+        HeapFree(GetProcessHeap(),
+                 0,
+                 bin->sizes);
+        bin->sizes = NULL;
+    }
+    bin->count = 0;
+    bin->capacity = 0;
+    bin->bytes = 0;
+    DeleteCriticalSection(&bin->lock);
+}
+
+/// @brief returns the backend the dialog queries, empties and watches the
+/// bin through
+/// @param none
+/// @return the backend, never NULL
+const BinBackend* getBinBackend(void)
+{
+    return &activeBackend;
+}
+
+/// @brief charges latency to a memory bin and waits it out. Waits shorter
+/// than a sleep can manage are saved up so millions of tiny delays add up
+/// to the right total, and the remainder is spun off at the end of the
+/// operation.
+/// @param bin the memory bin
+/// @param nanoseconds the latency to add
+/// @param finished TRUE at the end of an operation
+static void injectLatency(MemoryBin* bin,
+                          ULONGLONG nanoseconds,
+                          BOOL finished)
+{
+    bin->owedNanoseconds += nanoseconds;
+    bin->injectedNanoseconds += nanoseconds;
+    if (bin->owedNanoseconds >= (MEMORY_BIN_SLEEP_US * 1000ULL))
+    {
+        DWORD milliseconds = (DWORD) (bin->owedNanoseconds / 1000000);
+        Sleep(milliseconds);
+        bin->owedNanoseconds -= (ULONGLONG) milliseconds * 1000000;
+    }
+    if (finished && (bin->owedNanoseconds >= 1000))
+    {
+        ULONGLONG until = getThrottleClock() + (bin->owedNanoseconds / 1000);
+        while (getThrottleClock() < until)
+        {
+            YieldProcessor();
+        }
+        bin->owedNanoseconds %= 1000;
+    }
+}
+
+/// @brief sets up an empty memory bin and a backend that uses it
+/// @param bin the memory bin, freed with freeMemoryBin()
+/// @param faults the latency and failures to inject, NULL for none
+/// @param backend receives the backend
+void initMemoryBin(MemoryBin* bin,
+                   const MemoryBinFaults* faults,
+                   BinBackend* backend)
+{
+    memset(bin,
+           0,
+           sizeof(MemoryBin));
+    if (faults != NULL)
+    {
+        bin->faults = *faults;
+    }
+    bin->random = (bin->faults.seed == 0) ? MEMORY_BIN_DEFAULT_SEED : bin->faults.seed;
+    InitializeCriticalSection(&bin->lock);
+
+    backend->name = L"memory";
+    backend->query = memoryBinQuery;
+    backend->empty = memoryBinEmpty;
+    backend->watch = memoryBinWatch;
+    backend->unwatch = memoryBinUnwatch;
+    backend->context = bin;
+}
+
+/// @brief fills in the backend that goes to the shell
+/// @param backend receives the backend
+void initShellBinBackend(BinBackend* backend)
+{
+    backend->name = L"shell";
+    backend->query = shellQuery;
+    backend->empty = shellEmpty;
+    backend->watch = shellWatch;
+    backend->unwatch = shellUnwatch;
+    backend->context = NULL;
+}
+
+/// @brief empties a memory bin. Items whose delete fails stay behind, in
+/// their original order.
+/// @param context the memory bin
+/// @param hWnd unused
+/// @param flags unused
+/// @return TRUE if everything was deleted, FALSE if anything was left
+static BOOL memoryBinEmpty(void* context,
+                           HWND hWnd,
+                           DWORD flags)
+{
+    UNREFERENCED_PARAMETER(hWnd);
+    UNREFERENCED_PARAMETER(flags);
+    MemoryBin* bin = context;
+    EnterCriticalSection(&bin->lock);
+    BOOL wasEmpty = (bin->count == 0);
+    injectLatency(bin,
+                  (ULONGLONG) bin->faults.emptyMicroseconds * 1000,
+                  FALSE);
+    ULONGLONG kept = 0;
+    for (ULONGLONG i = 0; i < bin->count; i++)
+    {
+        if (bin->faults.deleteNanoseconds > 0)
+        {
+            injectLatency(bin,
+                          bin->faults.deleteNanoseconds,
+                          FALSE);
+        }
+        if (drawFailure(bin,
+                        bin->faults.deleteFailuresPerMillion))
+        {
+            bin->sizes[kept++] = bin->sizes[i];
+            bin->failures++;
+            continue;
+        }
+        bin->bytes -= bin->sizes[i];
+        bin->deletes++;
+    }
+    bin->count = kept;
+    injectLatency(bin,
+                  0,
+                  TRUE);
+    if ((wasEmpty == FALSE) && (kept == 0))
+    {
+        notifyWatchers(bin);
+    }
+    LeaveCriticalSection(&bin->lock);
+    if (kept > 0)
+    {
+        SetLastError(ERROR_ACCESS_DENIED);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/// @brief counts the items in a memory bin
+/// @param context the memory bin
+/// @param items receives the number of items
+/// @param bytes receives their total size
+/// @return TRUE on success, FALSE if an injected failure happened
+static BOOL memoryBinQuery(void* context,
+                           ULONGLONG* items,
+                           ULONGLONG* bytes)
+{
+    MemoryBin* bin = context;
+    EnterCriticalSection(&bin->lock);
+    bin->queries++;
+    injectLatency(bin,
+                  (ULONGLONG) bin->faults.queryMicroseconds * 1000,
+                  TRUE);
+    if (drawFailure(bin,
+                    bin->faults.queryFailuresPerMillion))
+    {
+        bin->failures++;
+        LeaveCriticalSection(&bin->lock);
+        SetLastError(ERROR_IO_DEVICE);
+        return FALSE;
+    }
+    *items = bin->count;
+    *bytes = bin->bytes;
+    LeaveCriticalSection(&bin->lock);
+    return TRUE;
+}
+
+/// @brief cancels a memory bin watch
+/// @param context the memory bin
+/// @param registrationId returned by memoryBinWatch()
+static void memoryBinUnwatch(void* context,
+                             ULONG registrationId)
+{
+    MemoryBin* bin = context;
+    if ((registrationId == 0) || (registrationId > BIN_BACKEND_MAX_WATCHERS))
+    {
+        return;
+    }
+    EnterCriticalSection(&bin->lock);
+    bin->watchers[registrationId - 1].active = FALSE;
+    LeaveCriticalSection(&bin->lock);
+}
+
+/// @brief watches a memory bin for the changes the shell would redraw the
+/// bin icon for
+/// @param context the memory bin
+/// @param hWnd the window to post to, NULL to only count notifications
+/// @param message the message to post
+/// @return the registration ID, 0 if every slot is taken
+static ULONG memoryBinWatch(void* context,
+                            HWND hWnd,
+                            UINT message)
+{
+    MemoryBin* bin = context;
+    ULONG registrationId = 0;
+    EnterCriticalSection(&bin->lock);
+    for (DWORD i = 0; i < BIN_BACKEND_MAX_WATCHERS; i++)
+    {
+        if (bin->watchers[i].active == FALSE)
+        {
+            bin->watchers[i].hWnd = hWnd;
+            bin->watchers[i].message = message;
+            bin->watchers[i].active = TRUE;
+            registrationId = i + 1;
+            break;
+        }
+    }
+    LeaveCriticalSection(&bin->lock);
+    return registrationId;
+}
+
+/// @brief advances a xorshift64 generator
+/// @param state the generator state, never 0
+/// @return the next value
+static ULONGLONG nextRandom(ULONGLONG* state)
+{
+    ULONGLONG x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *state = x;
+    return x;
+}
+
+/// @brief tells everyone watching a memory bin that it changed. Called with
+/// the lock held.
+/// @param bin the memory bin
+static void notifyWatchers(MemoryBin* bin)
+{
+    for (DWORD i = 0; i < BIN_BACKEND_MAX_WATCHERS; i++)
+    {
+        if (bin->watchers[i].active == FALSE)
+        {
+            continue;
+        }
+        bin->notifications++;
+        if (bin->watchers[i].hWnd != NULL)
+        {
+            PostMessageW(bin->watchers[i].hWnd,
+                         bin->watchers[i].message,
+                         0,
+                         0);
+        }
+    }
+}
+
+/// @brief changes the backend the dialog uses
+/// @param backend the backend, which must outlive its use. NULL goes back
+/// to the shell.
+void setBinBackend(const BinBackend* backend)
+{
+    if (backend == NULL)
+    {
+        initShellBinBackend(&activeBackend);
+        return;
+    }
+    activeBackend = *backend;
+}
+
+/// @brief empties the bin through the shell
+/// @param context unused
+/// @param hWnd the owner of any progress or confirmation UI
+/// @param flags SHERB_ flags
+/// @return TRUE if the shell reported success
+static BOOL shellEmpty(void* context,
+                       HWND hWnd,
+                       DWORD flags)
+{
+    // The shell does not say what it emptied, so ask it first
+    ULONGLONG items = 0;
+    ULONGLONG bytes = 0;
+    BOOL audit = isAuditEnabled() &&
+        shellQuery(context, &items, &bytes);
+    HRESULT result = SHEmptyRecycleBinW(hWnd,
+                                        NULL,
+                                        flags);
+    if (FAILED(result))
+    {
+        LOG(L"Emptying the recycle bin failed with HRESULT 0x%08X\n",
+            result);
+        return FALSE;
+    }
+    if (audit && (items > 0))
+    {
+        auditEvent(AUDIT_OP_EMPTY,
+                   NULL,
+                   bytes,
+                   items);
+    }
+    return TRUE;
+}
+
+/// @brief asks the shell how much is in the bin on every drive
+/// @param context unused
+/// @param items receives the number of items
+/// @param bytes receives their total size
+/// @return TRUE on success, FALSE if the shell could not be asked
+static BOOL shellQuery(void* context,
+                       ULONGLONG* items,
+                       ULONGLONG* bytes)
+{
+    UNREFERENCED_PARAMETER(context);
+    SHQUERYRBINFO info = { sizeof(SHQUERYRBINFO) };
+    HRESULT result = SHQueryRecycleBinW(L"",
+                                        &info);
+    if (result != S_OK)
+    {
+        LOG(L"Querying the recycle bin failed with HRESULT 0x%08X\n",
+            result);
+        return FALSE;
+    }
+    *items = (ULONGLONG) info.i64NumItems;
+    *bytes = (ULONGLONG) info.i64Size;
+    return TRUE;
+}
+
+/// @brief cancels a shell notification registration
+/// @param context unused
+/// @param registrationId returned by shellWatch()
+static void shellUnwatch(void* context,
+                         ULONG registrationId)
+{
+    UNREFERENCED_PARAMETER(context);
+    if (registrationId > 0)
+    {
+        SHChangeNotifyDeregister(registrationId);
+    }
+}
+
+/// @brief registers for the shell notification sent when the bin icon changes
+/// @param context unused
+/// @param hWnd the window that will receive the notifications
+/// @param message the message they arrive as
+/// @return the registration ID, 0 on failure
+static ULONG shellWatch(void* context,
+                        HWND hWnd,
+                        UINT message)
+{
+    UNREFERENCED_PARAMETER(context);
+
+    // Even though we can retrieve a PIDL for the recycle bin, it does not generate
+    // filesystem  events (create, delete, update, etc.) when files are "moved" there
+    // or deleted. There does appear to be a reliable way to track state changes of
+    // the recycle bin, and that is via the UPDATEIMAGE notification, which fires
+    // because the shell needs to update the recycle bin icon when it is
+    // emptied or becomes full. We do not need to track a specific PIDL since this
+    // is a global notification.
+    SHChangeNotifyEntry const entries[] = { NULL, FALSE };
+    int sources = SHCNRF_ShellLevel | SHCNRF_InterruptLevel | SHCNRF_NewDelivery;
+    long events = SHCNE_UPDATEIMAGE;
+    return SHChangeNotifyRegister(hWnd,
+                                  sources,
+                                  events,
+                                  message,
+                                  ARRAYSIZE(entries),
+                                  entries);
+}
+
+#ifndef NDEBUG
+/// @brief checks the memory backend: counting, notifications, injected
+/// failures and latency, and switching the active backend
+void testBinBackend(void)
+{
+    MemoryBinFaults faults = { 0 };
+    faults.deleteFailuresPerMillion = 250000;
+    faults.deleteNanoseconds = 1500;
+    faults.queryMicroseconds = 2;
+    faults.seed = 12345;
+    MemoryBin bin = { 0 };
+    BinBackend backend = { 0 };
+    initMemoryBin(&bin,
+                  &faults,
+                  &backend);
+    ULONG first = backend.watch(backend.context,
+                                NULL,
+                                0);
+    ULONG second = backend.watch(backend.context,
+                                 NULL,
+                                 0);
+    assert((first != 0) && (second != 0) && (first != second));
+
+    ULONGLONG items = 0;
+    ULONGLONG bytes = 0;
+    BOOL result = backend.query(backend.context,
+                                &items,
+                                &bytes);
+    assert(result && (items == 0) && (bytes == 0));
+
+    // Only going from empty to full is a change the icon shows
+    result = addMemoryBinItems(&bin,
+                               1000,
+                               100);
+    assert(result);
+    result = addMemoryBinItems(&bin,
+                               2000,
+                               10);
+    assert(result);
+    assert(bin.notifications == 2);
+    result = backend.query(backend.context,
+                           &items,
+                           &bytes);
+    assert(result && (items == 3000) && (bytes == 120000));
+    assert(bin.injectedNanoseconds == 2 * 2000);
+
+    // A quarter of the deletes fail, the rest go, and bytes follow
+    backend.unwatch(backend.context,
+                    second);
+    result = backend.empty(backend.context,
+                           NULL,
+                           0);
+    assert(result == FALSE);
+    assert((bin.count > 600) && (bin.count < 900));
+    assert(bin.deletes + bin.count == 3000);
+    assert(bin.injectedNanoseconds == (2 * 2000) + (3000 * 1500));
+    ULONGLONG expectedBytes = 0;
+    for (ULONGLONG i = 0; i < bin.count; i++)
+    {
+        expectedBytes += bin.sizes[i];
+    }
+    assert(bin.bytes == expectedBytes);
+    assert(bin.notifications == 2);
+
+    // Retrying gets the rest, and only the remaining watcher hears of it
+    DWORD retries = 0;
+    while ((backend.empty(backend.context,
+                          NULL,
+                          0) == FALSE) && (retries < 64))
+    {
+        retries++;
+    }
+    assert((bin.count == 0) && (bin.bytes == 0));
+    assert(bin.notifications == 3);
+
+    // The same seed fails the same deletes
+    ULONGLONG firstFailures = bin.failures;
+    freeMemoryBin(&bin);
+    initMemoryBin(&bin,
+                  &faults,
+                  &backend);
+    addMemoryBinItems(&bin,
+                      3000,
+                      100);
+    retries = 0;
+    while ((backend.empty(backend.context,
+                          NULL,
+                          0) == FALSE) && (retries < 64))
+    {
+        retries++;
+    }
+    assert(bin.failures == firstFailures);
+
+    // Every query fails when told to
+    bin.faults.queryFailuresPerMillion = 1000000;
+    result = backend.query(backend.context,
+                           &items,
+                           &bytes);
+    assert(result == FALSE);
+
+    // Swapping the active backend and going back to the shell
+    setBinBackend(&backend);
+    assert(getBinBackend()->context == &bin);
+    setBinBackend(NULL);
+    assert(getBinBackend()->query == shellQuery);
+    freeMemoryBin(&bin);
+
+    BinBackendBenchmark benchmark = { 0 };
+    result = benchmarkBinBackend(10000,
+                                 1000,
+                                 &benchmark);
+    assert(result && (benchmark.left > 0) && (benchmark.left < 100));
+    assert(benchmark.notifications == 2);
+}
+#endif
@@ -0,0 +1,110 @@
+#define _CRT_SECURE_NO_WARNINGS
+
+#pragma once
+#include <Windows.h>
+#include <shlobj_core.h>
+#include <stdio.h>
+#include <assert.h>
+
+// Bin backend parameters. The dialog queries, empties and watches the bin
+// through a backend rather than calling the shell directly. The shell
+// backend is the real one. The memory backend keeps a bin of any size in
+// memory and can be made slow or unreliable on purpose, so the code above
+// it can be benchmarked and stress tested with millions of items without
+// touching the disk or the user's bin.
+
+#define BIN_BACKEND_MAX_WATCHERS    8
+#define MEMORY_BIN_INITIAL_CAPACITY 1024
+#define MEMORY_BIN_SLEEP_US         1000 // Injected latency is slept off once this much is owed
+#define MEMORY_BIN_DEFAULT_SEED     0x9E3779B97F4A7C15ULL
+#define BIN_BACKEND_DEFAULT_BENCH_ITEMS 10000000
+#define BIN_BACKEND_BENCH_QUERIES   100000
+
+// Structs
+
+/// @brief counts the items in the bin and the bytes they hold
+/// @return TRUE on success, FALSE if the bin could not be queried
+typedef BOOL (*BinQuery)(void* context, ULONGLONG* items, ULONGLONG* bytes);
+
+/// @brief permanently deletes everything in the bin
+/// @param flags SHERB_ flags, ignored by backends without a user interface
+/// @return TRUE if everything was deleted, FALSE if anything was left
+typedef BOOL (*BinEmpty)(void* context, HWND hWnd, DWORD flags);
+
+/// @brief asks for message to be posted to hWnd whenever the bin goes from
+/// empty to full or back
+/// @return a registration ID, 0 on failure
+typedef ULONG (*BinWatch)(void* context, HWND hWnd, UINT message);
+
+/// @brief cancels a registration made by the watch function
+typedef void (*BinUnwatch)(void* context, ULONG registrationId);
+
+typedef struct BinBackend
+{
+    const wchar_t* name;
+    BinQuery query;
+    BinEmpty empty;
+    BinWatch watch;
+    BinUnwatch unwatch;
+    void* context; // Passed to every function
+} BinBackend;
+
+typedef struct MemoryBinFaults
+{
+    DWORD queryMicroseconds; // Added to every query
+    DWORD emptyMicroseconds; // Added to every empty
+    DWORD deleteNanoseconds; // Added for every item an empty deletes
+    DWORD queryFailuresPerMillion; // Queries that fail
+    DWORD deleteFailuresPerMillion; // Items an empty fails to delete, they stay in the bin
+    ULONGLONG seed; // Failures are drawn from this, so a run can be repeated exactly
+} MemoryBinFaults;
+
+typedef struct MemoryBinWatcher
+{
+    HWND hWnd; // NULL counts the notification without posting anything
+    UINT message;
+    BOOL active;
+} MemoryBinWatcher;
+
+typedef struct MemoryBin
+{
+    ULONGLONG* sizes; // Size of every item
+    ULONGLONG count;
+    ULONGLONG capacity;
+    ULONGLONG bytes;
+    MemoryBinFaults faults;
+    ULONGLONG random; // Xorshift state, never 0
+    ULONGLONG owedNanoseconds; // Injected latency not waited out yet
+    ULONGLONG injectedNanoseconds; // All latency injected so far
+    ULONGLONG queries;
+    ULONGLONG deletes;
+    ULONGLONG failures; // Failed queries and deletes
+    ULONGLONG notifications; // Sent to watchers
+    MemoryBinWatcher watchers[BIN_BACKEND_MAX_WATCHERS];
+    CRITICAL_SECTION lock;
+} MemoryBin;
+
+typedef struct BinBackendBenchmark
+{
+    ULONGLONG items;
+    DWORD deleteFailuresPerMillion;
+    double nanosecondsPerAdd;
+    double nanosecondsPerQuery;
+    double emptyMilliseconds; // First empty, with failures
+    double itemsPerSecond; // Deleted by the first empty
+    ULONGLONG left; // Items the first empty failed to delete
+    DWORD retries; // Further empties until the bin was empty
+    ULONGLONG notifications;
+} BinBackendBenchmark;
+
+// Functions
+
+BOOL addMemoryBinItems(MemoryBin* bin, ULONGLONG count, ULONGLONG size);
+BOOL benchmarkBinBackend(ULONGLONG items, DWORD deleteFailuresPerMillion,
+                         BinBackendBenchmark* result);
+void freeMemoryBin(MemoryBin* bin);
+const BinBackend* getBinBackend(void);
+void initMemoryBin(MemoryBin* bin, const MemoryBinFaults* faults, BinBackend* backend);
+void initShellBinBackend(BinBackend* backend);
+void setBinBackend(const BinBackend* backend);
+void testBinBackend(void);
@@ -0,0 +1,934 @@
+/*
+* Find and repair orphaned halves of items in the Recycle Bin
+*
+* Copyright(C) 2024 ERROR_SUCCESS Software
+*
+* This program is free software : you can redistribute it and /or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.If not, see < https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#include "bincheck.h"
+#include "bin.h"
+#include "catalog.h"
+#include "parallel.h"
+#include "reclaim.h"
+#include "throttle.h"
+#include "trash.h"
+#include "logger.h"
+
+typedef struct NameSorter
+{
+    DWORD runNames; // Most names held before a run is spilled
+    wchar_t* pool; // Names of the current run, each null terminated
+    DWORD poolLength; // In characters
+    DWORD poolCapacity; // In characters
+    const wchar_t** names; // Into pool, sorted just before a run is spilled
+    DWORD count; // Names in the current run
+    BYTE* spillBuffer; // A run as it is written, as large as the pool
+    HANDLE* runs; // Temporary files that delete themselves once closed
+    DWORD runCount;
+    DWORD runCapacity;
+    ULONGLONG total; // Names added over every run
+    BOOL failed; // A name was lost, so the sorter must not be joined
+} NameSorter;
+
+typedef struct RunReader
+{
+    HANDLE hFile;
+    DWORD position; // Next byte of buffer to use
+    DWORD length; // Valid bytes in buffer
+    BOOL failed; // The run could not be read to the end
+    wchar_t name[MAX_PATH + 1]; // Names in a folder are at most 255 characters
+    BYTE buffer[CHECK_READ_BUFFER];
+} RunReader;
+
+typedef struct NameStream
+{
+    NameSorter* sorter;
+    DWORD next; // Next name in memory, when nothing was spilled
+    RunReader* readers; // One for each run, NULL when nothing was spilled
+    RunReader** heap; // Readers that still have names, a min heap on name
+    DWORD heapCount;
+    const wchar_t* current; // NULL once every name has been seen
+    BOOL failed; // A run could not be read
+} NameStream;
+
+typedef struct CheckListing
+{
+    const wchar_t* binDirectory;
+    NameSorter sides[2]; // Suffixes of the $I files, then of the $R items
+} CheckListing;
+
+static BOOL addSorterName(NameSorter* sorter, const wchar_t* name);
+static void advanceNameStream(NameStream* stream);
+static void closeNameStream(NameStream* stream);
+static int compareNames(const void* a, const void* b);
+static void freeNameSorter(NameSorter* sorter);
+static BOOL initNameSorter(NameSorter* sorter, DWORD runNames);
+static void listCheckSide(DWORD index, void* context);
+static BOOL openNameStream(NameSorter* sorter, NameStream* stream);
+static BOOL readRunBytes(RunReader* reader, void* destination, DWORD bytes);
+static BOOL readRunName(RunReader* reader);
+static void repairOrphan(const wchar_t* binDirectory, const wchar_t* suffix, BOOL isInfo,
+                         const BinCheckOptions* options, BinCheckResult* result);
+static void siftRunReader(RunReader** heap, DWORD count, DWORD index);
+static BOOL spillRun(NameSorter* sorter);
+#ifndef NDEBUG
+static void createCheckFile(const wchar_t* directory, const wchar_t* name, ULONGLONG size);
+#endif
+
+/// @brief adds a name to a sorter, spilling the current run first if it
+/// is full
+/// @param sorter the sorter
+/// @param name the name
+/// @return TRUE if the name was kept, FALSE if not, which also marks the
+///         sorter as failed
+static BOOL addSorterName(NameSorter* sorter,
+                          const wchar_t* name)
+{
+    DWORD cchName = (DWORD) wcslen(name) + 1;
+    if (cchName > MAX_PATH + 1)
+    {
+        sorter->failed = TRUE;
+        return FALSE;
+    }
+    if (((sorter->count == sorter->runNames) ||
+         (sorter->poolLength + cchName > sorter->poolCapacity)) &&
+        (spillRun(sorter) == FALSE))
+    {
+        sorter->failed = TRUE;
+        return FALSE;
+    }
+    wchar_t* copy = sorter->pool + sorter->poolLength;
+    memcpy(copy,
+           name,
+           cchName * sizeof(wchar_t));
+    sorter->names[sorter->count++] = copy;
+    sorter->poolLength += cchName;
+    sorter->total++;
+    return TRUE;
+}
+
+/// @brief moves a stream on to its next name in order
+/// @param stream the stream
+static void advanceNameStream(NameStream* stream)
+{
+    if (stream->readers == NULL)
+    {
+        stream->next++;
+        stream->current = (stream->next < stream->sorter->count) ?
+            stream->sorter->names[stream->next] : NULL;
+        return;
+    }
+
+    // Replace the smallest name with the next one from the same run
+    RunReader* top = stream->heap[0];
+    if (readRunName(top) == FALSE)
+    {
+        if (top->failed)
+        {
+            stream->failed = TRUE;
+        }
+        stream->heap[0] = stream->heap[--stream->heapCount];
+    }
+    if (stream->heapCount > 0)
+    {
+        siftRunReader(stream->heap,
+                      stream->heapCount,
+                      0);
+    }
+    stream->current = (stream->heapCount > 0) ? stream->heap[0]->name : NULL;
+}
+
+/// @brief checks the current user's bin on every volume, repairs what the
+/// options allow, and rebuilds the catalog if it no longer matches
+/// @param options what to do with orphans
+/// @param result receives what was found and done
+/// @return TRUE if every bin was checked, FALSE if any could not be
+BOOL checkBin(const BinCheckOptions* options,
+              BinCheckResult* result)
+{
+    memset(result,
+           0,
+           sizeof(*result));
+    ULONGLONG start = getThrottleClock();
+    BOOL complete = TRUE;
+    for (wchar_t driveLetter = L'A'; driveLetter <= L'Z'; driveLetter++)
+    {
+        wchar_t binDirectory[MAX_PATH + 1] = { 0 };
+        if (getBinDirectory(driveLetter,
+                            binDirectory,
+                            ARRAYSIZE(binDirectory)) == FALSE)
+        {
+            continue;
+        }
+        if (checkBinDirectory(binDirectory,
+                              options,
+                              result) == FALSE)
+        {
+            LOG(L"Unable to check %s\n",
+                binDirectory);
+            complete = FALSE;
+        }
+    }
+
+    // The catalog holds one record for every $I file
+    wchar_t catalogPath[MAX_PATH + 1] = { 0 };
+    CatalogHeader header = { 0 };
+    if (complete &&
+        getCatalogPath(catalogPath, ARRAYSIZE(catalogPath)))
+    {
+        result->catalogStale = ((readCatalogHeader(catalogPath, &header) == FALSE) ||
+                                (header.itemCount != result->infoFiles - result->repairedInfo));
+        if (result->catalogStale && (options->mode != CHECK_REPORT))
+        {
+            result->catalogRebuilt = buildCatalog(catalogPath);
+        }
+    }
+    result->milliseconds = (getThrottleClock() - start) / 1000.0;
+    return complete;
+}
+
+/// @brief checks one bin folder for $I files with no $R item and $R items
+/// with no $I file, and repairs what the options allow
+/// @param binDirectory the bin folder
+/// @param options what to do with orphans
+/// @param result what was found and done is added to this
+/// @return TRUE if the folder was checked, FALSE if it could not be listed
+BOOL checkBinDirectory(const wchar_t* binDirectory,
+                       const BinCheckOptions* options,
+                       BinCheckResult* result)
+{
+    CheckListing listing = { 0 };
+    listing.binDirectory = binDirectory;
+    if ((initNameSorter(&listing.sides[0], options->runNames) == FALSE) ||
+        (initNameSorter(&listing.sides[1], options->runNames) == FALSE))
+    {
+        freeNameSorter(&listing.sides[0]);
+        freeNameSorter(&listing.sides[1]);
+        return FALSE;
+    }
+
+    // Both sides are listed at once, then joined in order of suffix
+    parallelFor(ARRAYSIZE(listing.sides),
+                ARRAYSIZE(listing.sides),
+                listCheckSide,
+                &listing);
+    NameStream info = { 0 };
+    NameStream content = { 0 };
+    BOOL complete = ((listing.sides[0].failed == FALSE) &&
+                     (listing.sides[1].failed == FALSE) &&
+                     openNameStream(&listing.sides[0], &info) &&
+                     openNameStream(&listing.sides[1], &content));
+    while (complete &&
+           ((info.current != NULL) || (content.current != NULL)) &&
+           (info.failed == FALSE) && (content.failed == FALSE))
+    {
+        int order = (info.current == NULL) ? 1 :
+            (content.current == NULL) ? -1 : _wcsicmp(info.current, content.current);
+        if (order == 0)
+        {
+            result->pairs++;
+            advanceNameStream(&info);
+            advanceNameStream(&content);
+        }
+        else if (order < 0)
+        {
+            result->orphanedInfo++;
+            repairOrphan(binDirectory,
+                         info.current,
+                         TRUE,
+                         options,
+                         result);
+            advanceNameStream(&info);
+        }
+        else
+        {
+            result->orphanedContent++;
+            repairOrphan(binDirectory,
+                         content.current,
+                         FALSE,
+                         options,
+                         result);
+            advanceNameStream(&content);
+        }
+    }
+    complete = (complete && (info.failed == FALSE) && (content.failed == FALSE));
+
+    // A trash put that was interrupted before renaming its $I files into
+    // place leaves them under their temporary names, which nothing reads
+    sweepTrashTempFiles(binDirectory,
+                        options->graceSeconds,
+                        options->mode != CHECK_REPORT,
+                        &result->staleTemp,
+                        &result->repairedTemp);
+
+    result->infoFiles += listing.sides[0].total;
+    result->contentItems += listing.sides[1].total;
+    result->runs += listing.sides[0].runCount + listing.sides[1].runCount;
+    closeNameStream(&info);
+    closeNameStream(&content);
+    freeNameSorter(&listing.sides[0]);
+    freeNameSorter(&listing.sides[1]);
+    return complete;
+}
+
+/// @brief frees what a stream allocated. The runs stay with the sorter.
+/// @param stream the stream, which can be zeroed
+static void closeNameStream(NameStream* stream)
+{
+    if (stream->readers != NULL)
+    {
+        HeapFree(GetProcessHeap(),
+                 0,
+                 stream->readers);
+    }
+    if (stream->heap != NULL)
+    {
+        HeapFree(GetProcessHeap(),
+                 0,
+                 stream->heap);
+    }
+    memset(stream,
+           0,
+           sizeof(*stream));
+}
+
+/// @brief orders names the way the file system compares them, for qsort()
+static int compareNames(const void* a,
+                        const void* b)
+{
+    return _wcsicmp(*(const wchar_t* const*) a,
+                    *(const wchar_t* const*) b);
+}
+
+#ifndef NDEBUG
+/// @brief creates a file of the given size for the self test
+/// @param directory the folder to create it in
+/// @param name the name of the file
+/// @param size the size of the file in bytes
+static void createCheckFile(const wchar_t* directory,
+                            const wchar_t* name,
+                            ULONGLONG size)
+{
+    wchar_t path[MAX_PATH + 1] = { 0 };
+    _snwprintf(path,
+               ARRAYSIZE(path),
+               L"%s\\%s",
+               directory,
+               name);
+    path[MAX_PATH] = 0;
+    HANDLE hFile = CreateFileW(path,
+                               GENERIC_WRITE,
+                               0,
+                               NULL,
+                               CREATE_ALWAYS,
+                               FILE_ATTRIBUTE_NORMAL,
+                               NULL);
+    assert(hFile != INVALID_HANDLE_VALUE);
+    LARGE_INTEGER fileSize = { 0 };
+    fileSize.QuadPart = (LONGLONG) size;
+    SetFilePointerEx(hFile,
+                     fileSize,
+                     NULL,
+                     FILE_BEGIN);
+    SetEndOfFile(hFile);
+    CloseHandle(hFile);
+}
+#endif
+
+/// @brief frees a sorter and deletes its runs
+/// @param sorter the sorter, which can be zeroed
+static void freeNameSorter(NameSorter* sorter)
+{
+    for (DWORD i = 0; i < sorter->runCount; i++)
+    {
+        CloseHandle(sorter->runs[i]);
+    }
+    void* blocks[] = { sorter->pool, (void*) sorter->names, sorter->spillBuffer, sorter->runs };
+    for (DWORD i = 0; i < ARRAYSIZE(blocks); i++)
+    {
+        if (blocks[i] != NULL)
+        {
+            HeapFree(GetProcessHeap(),
+                     0,
+                     blocks[i]);
+        }
+    }
+    memset(sorter,
+           0,
+           sizeof(*sorter));
+}
+
+/// @brief sets the default check options: report only, with runs of
+/// CHECK_RUN_NAMES names and a grace period of CHECK_GRACE_SECONDS
+/// @param options receives the options
+void initBinCheckOptions(BinCheckOptions* options)
+{
+    options->mode = CHECK_REPORT;
+    options->runNames = CHECK_RUN_NAMES;
+    options->graceSeconds = CHECK_GRACE_SECONDS;
+}
+
+/// @brief allocates everything a sorter holds in memory, which is all it
+/// will ever hold however many names are added
+/// @param sorter receives the sorter. Pass it to freeNameSorter() either way.
+/// @param runNames the most names to hold before spilling a run
+/// @return TRUE on success, FALSE if memory could not be allocated
+static BOOL initNameSorter(NameSorter* sorter,
+                           DWORD runNames)
+{
+    memset(sorter,
+           0,
+           sizeof(*sorter));
+    sorter->runNames = (runNames > 0) ? runNames : 1;
+
+    // However small the runs, the longest name has to fit
+    sorter->poolCapacity = sorter->runNames * CHECK_AVERAGE_NAME_CCH;
+    if (sorter->poolCapacity < MAX_PATH + 1)
+    {
+        sorter->poolCapacity = MAX_PATH + 1;
+    }
+    sorter->pool = HeapAlloc(GetProcessHeap(),
+                             0,
+                             sorter->poolCapacity * sizeof(wchar_t));
+    sorter->names = HeapAlloc(GetProcessHeap(),
+                              0,
+                              sorter->runNames * sizeof(*sorter->names));
+    sorter->spillBuffer = HeapAlloc(GetProcessHeap(),
+                                    0,
+                                    sorter->poolCapacity * sizeof(wchar_t));
+    return ((sorter->pool != NULL) && (sorter->names != NULL) && (sorter->spillBuffer != NULL));
+}
+
+/// @brief lists one side of a bin folder into its sorter, for parallelFor()
+/// @param index 0 for the $I files, 1 for the $R items
+/// @param context the CheckListing
+static void listCheckSide(DWORD index,
+                          void* context)
+{
+    CheckListing* listing = (CheckListing*) context;
+    NameSorter* sorter = &listing->sides[index];
+    const wchar_t* prefix = (index == 0) ? BIN_INFO_PREFIX : BIN_CONTENT_PREFIX;
+    size_t prefixLength = wcslen(prefix);
+
+    wchar_t searchPattern[MAX_PATH + 1] = { 0 };
+    int written = _snwprintf(searchPattern,
+                             ARRAYSIZE(searchPattern),
+                             L"%s\\%s*",
+                             listing->binDirectory,
+                             prefix);
+    searchPattern[MAX_PATH] = 0;
+    if ((written < 0) || (written > MAX_PATH))
+    {
+        sorter->failed = TRUE;
+        return;
+    }
+    WIN32_FIND_DATAW findData = { 0 };
+    HANDLE hFind = FindFirstFileExW(searchPattern,
+                                    FindExInfoBasic,
+                                    &findData,
+                                    FindExSearchNameMatch,
+                                    NULL,
+                                    FIND_FIRST_EX_LARGE_FETCH);
+    if (hFind == INVALID_HANDLE_VALUE)
+    {
+        sorter->failed = (GetLastError() != ERROR_FILE_NOT_FOUND);
+        return;
+    }
+    do
+    {
+        // A pattern can also match a short name, and every $I is a file
+        if ((_wcsnicmp(findData.cFileName, prefix, prefixLength) != 0) ||
+            ((index == 0) && (findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)))
+        {
+            continue;
+        }
+        if (addSorterName(sorter,
+                          findData.cFileName + prefixLength) == FALSE)
+        {
+            break;
+        }
+    } while (FindNextFileW(hFind, &findData));
+    FindClose(hFind);
+}
+
+/// @brief starts reading the names of a sorter back in order. If anything
+/// was spilled, the rest is spilled too and the runs are merged.
+/// @param sorter the sorter, no names can be added afterwards
+/// @param stream receives the stream, with its first name in current.
+/// Pass it to closeNameStream() either way.
+/// @return TRUE on success, FALSE if the runs could not be read
+static BOOL openNameStream(NameSorter* sorter,
+                           NameStream* stream)
+{
+    memset(stream,
+           0,
+           sizeof(*stream));
+    stream->sorter = sorter;
+    if (sorter->runCount == 0)
+    {
+        qsort((void*) sorter->names,
+              sorter->count,
+              sizeof(*sorter->names),
+              compareNames);
+        stream->current = (sorter->count > 0) ? sorter->names[0] : NULL;
+        return TRUE;
+    }
+    if ((sorter->count > 0) &&
+        (spillRun(sorter) == FALSE))
+    {
+        return FALSE;
+    }
+
+    stream->readers = HeapAlloc(GetProcessHeap(),
+                                HEAP_ZERO_MEMORY,
+                                sorter->runCount * sizeof(RunReader));
+    stream->heap = HeapAlloc(GetProcessHeap(),
+                             0,
+                             sorter->runCount * sizeof(RunReader*));
+    if ((stream->readers == NULL) || (stream->heap == NULL)) // Memory allocation failed
+    {
+        return FALSE;
+    }
+    for (DWORD i = 0; i < sorter->runCount; i++)
+    {
+        RunReader* reader = &stream->readers[i];
+        LARGE_INTEGER start = { 0 };
+        reader->hFile = sorter->runs[i];
+        if (SetFilePointerEx(reader->hFile, start, NULL, FILE_BEGIN) &&
+            readRunName(reader))
+        {
+            stream->heap[stream->heapCount++] = reader;
+        }
+        else if (reader->failed)
+        {
+            return FALSE;
+        }
+    }
+    for (DWORD i = stream->heapCount / 2; i-- > 0;)
+    {
+        siftRunReader(stream->heap,
+                      stream->heapCount,
+                      i);
+    }
+    stream->current = (stream->heapCount > 0) ? stream->heap[0]->name : NULL;
+    return TRUE;
+}
+
+/// @brief reads bytes from a run through its buffer
+/// @param reader the run
+/// @param destination receives the bytes
+/// @param bytes how many to read
+/// @return TRUE if they were all read, FALSE at the end of the run or if
+///         it could not be read, which also sets failed
+static BOOL readRunBytes(RunReader* reader,
+                         void* destination,
+                         DWORD bytes)
+{
+    BYTE* output = (BYTE*) destination;
+    while (bytes > 0)
+    {
+        if (reader->position == reader->length)
+        {
+            DWORD bytesRead = 0;
+            if (ReadFile(reader->hFile,
+                         reader->buffer,
+                         sizeof(reader->buffer),
+                         &bytesRead,
+                         NULL) == FALSE)
+            {
+                reader->failed = TRUE;
+                return FALSE;
+            }
+            if (bytesRead == 0)
+            {
+                return FALSE;
+            }
+            reader->position = 0;
+            reader->length = bytesRead;
+        }
+        DWORD chunk = min(bytes, reader->length - reader->position);
+        memcpy(output,
+               reader->buffer + reader->position,
+               chunk);
+        reader->position += chunk;
+        output += chunk;
+        bytes -= chunk;
+    }
+    return TRUE;
+}
+
+/// @brief reads the next name of a run into reader->name
+/// @param reader the run
+/// @return TRUE if there was one, FALSE at the end of the run or if it
+///         could not be read, which also sets failed
+static BOOL readRunName(RunReader* reader)
+{
+    WORD cchName = 0;
+    if (readRunBytes(reader,
+                     &cchName,
+                     sizeof(cchName)) == FALSE)
+    {
+        return FALSE;
+    }
+    if ((cchName > MAX_PATH) ||
+        (readRunBytes(reader, reader->name, cchName * sizeof(wchar_t)) == FALSE))
+    {
+        reader->failed = TRUE;
+        return FALSE;
+    }
+    reader->name[cchName] = 0;
+    return TRUE;
+}
+
+/// @brief confirms an orphan is still an orphan and deals with it as the
+/// options say. This holds the staging lock so an instant empty or undo
+/// that is moving the pair is never caught half way.
+/// @param binDirectory the bin folder
+/// @param suffix what follows $I or $R in the name
+/// @param isInfo TRUE for a $I file, FALSE for a $R item
+/// @param options what to do with orphans
+/// @param result what was done is added to this
+static void repairOrphan(const wchar_t* binDirectory,
+                         const wchar_t* suffix,
+                         BOOL isInfo,
+                         const BinCheckOptions* options,
+                         BinCheckResult* result)
+{
+    wchar_t path[MAX_PATH + 1] = { 0 };
+    wchar_t pairPath[MAX_PATH + 1] = { 0 };
+    int written = _snwprintf(path,
+                             ARRAYSIZE(path),
+                             L"%s\\%s%s",
+                             binDirectory,
+                             (isInfo) ? BIN_INFO_PREFIX : BIN_CONTENT_PREFIX,
+                             suffix);
+    int pairWritten = _snwprintf(pairPath,
+                                 ARRAYSIZE(pairPath),
+                                 L"%s\\%s%s",
+                                 binDirectory,
+                                 (isInfo) ? BIN_CONTENT_PREFIX : BIN_INFO_PREFIX,
+                                 suffix);
+    path[MAX_PATH] = 0;
+    pairPath[MAX_PATH] = 0;
+    if ((written < 0) || (written > MAX_PATH) ||
+        (pairWritten < 0) || (pairWritten > MAX_PATH))
+    {
+        result->failed++;
+        return;
+    }
+
+    HANDLE hLock = acquireStagingLock();
+    if (hLock == NULL)
+    {
+        result->failed++;
+        return;
+    }
+    WIN32_FILE_ATTRIBUTE_DATA data = { 0 };
+    if ((GetFileAttributesW(pairPath) != INVALID_FILE_ATTRIBUTES) ||
+        (GetFileAttributesExW(path, GetFileExInfoStandard, &data) == FALSE))
+    {
+        result->skipped++; // Made whole, or gone, since it was listed
+    }
+    else if (isInfo)
+    {
+        // The shell writes the $I file just before it moves the item in
+        ULARGE_INTEGER lastWrite = { 0 };
+        lastWrite.LowPart = data.ftLastWriteTime.dwLowDateTime;
+        lastWrite.HighPart = data.ftLastWriteTime.dwHighDateTime;
+        if (getCurrentFileTime() < lastWrite.QuadPart + (options->graceSeconds * FILETIME_PER_SECOND))
+        {
+            result->skipped++;
+        }
+        else if (options->mode != CHECK_REPORT)
+        {
+            if (DeleteFileW(path))
+            {
+                result->repairedInfo++;
+            }
+            else
+            {
+                result->failed++;
+            }
+        }
+    }
+    else
+    {
+        result->orphanedBytes += getTreeSize(path);
+        if (options->mode == CHECK_DELETE)
+        {
+            if (deleteTree(path, NULL))
+            {
+                result->repairedContent++;
+            }
+            else
+            {
+                result->failed++;
+            }
+        }
+        else if (options->mode == CHECK_REPAIR)
+        {
+            // Quarantined items keep their name, so they can be matched
+            // up by hand with a $I file from a backup
+            wchar_t quarantinePath[MAX_PATH + 1] = { 0 };
+            wchar_t target[MAX_PATH + 1] = { 0 };
+            _snwprintf(quarantinePath,
+                       ARRAYSIZE(quarantinePath),
+                       L"%s\\%s",
+                       binDirectory,
+                       CHECK_QUARANTINE_FOLDER);
+            quarantinePath[MAX_PATH] = 0;
+            written = _snwprintf(target,
+                                 ARRAYSIZE(target),
+                                 L"%s\\%s%s",
+                                 quarantinePath,
+                                 BIN_CONTENT_PREFIX,
+                                 suffix);
+            target[MAX_PATH] = 0;
+            if (CreateDirectoryW(quarantinePath, NULL))
+            {
+                SetFileAttributesW(quarantinePath,
+                                   FILE_ATTRIBUTE_HIDDEN);
+            }
+            if ((written >= 0) && (written <= MAX_PATH) &&
+                MoveFileExW(path, target, 0))
+            {
+                result->repairedContent++;
+            }
+            else
+            {
+                result->failed++;
+            }
+        }
+    }
+    releaseStagingLock(hLock);
+}
+
+/// @brief moves a reader down the heap until both of its children have
+/// later names
+/// @param heap the heap
+/// @param count the number of readers in the heap
+/// @param index the reader to move
+static void siftRunReader(RunReader** heap,
+                          DWORD count,
+                          DWORD index)
+{
+    for (;;)
+    {
+        DWORD smallest = index;
+        DWORD left = (2 * index) + 1;
+        DWORD right = left + 1;
+        if ((left < count) && (_wcsicmp(heap[left]->name, heap[smallest]->name) < 0))
+        {
+            smallest = left;
+        }
+        if ((right < count) && (_wcsicmp(heap[right]->name, heap[smallest]->name) < 0))
+        {
+            smallest = right;
+        }
+        if (smallest == index)
+        {
+            return;
+        }
+        RunReader* swap = heap[index];
+        heap[index] = heap[smallest];
+        heap[smallest] = swap;
+        index = smallest;
+    }
+}
+
+/// @brief sorts the names held in memory and writes them to a new run
+/// @param sorter the sorter, which is empty again afterwards
+/// @return TRUE on success, FALSE if the run could not be written
+static BOOL spillRun(NameSorter* sorter)
+{
+    static LONG runSerial = 0;
+    if (sorter->runCount == sorter->runCapacity)
+    {
+        DWORD capacity = (sorter->runCapacity > 0) ? sorter->runCapacity * 2 : 16;
+        HANDLE* runs = (sorter->runs == NULL) ?
+            HeapAlloc(GetProcessHeap(), 0, capacity * sizeof(HANDLE)) :
+            HeapReAlloc(GetProcessHeap(), 0, sorter->runs, capacity * sizeof(HANDLE));
+        if (runs == NULL) // Memory allocation failed
+        {
+            return FALSE;
+        }
+        sorter->runs = runs;
+        sorter->runCapacity = capacity;
+    }
+
+    wchar_t tempDirectory[MAX_PATH + 1] = { 0 };
+    wchar_t runPath[MAX_PATH + 1] = { 0 };
+    GetTempPathW(ARRAYSIZE(tempDirectory),
+                 tempDirectory);
+    _snwprintf(runPath,
+               ARRAYSIZE(runPath),
+               L"%s%s%08X-%08X.tmp",
+               tempDirectory,
+               CHECK_RUN_PREFIX,
+               GetCurrentProcessId(),
+               (DWORD) InterlockedIncrement(&runSerial));
+    runPath[MAX_PATH] = 0;
+    HANDLE hRun = CreateFileW(runPath,
+                              GENERIC_READ | GENERIC_WRITE,
+                              0,
+                              NULL,
+                              CREATE_NEW,
+                              FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE,
+                              NULL);
+    if (hRun == INVALID_HANDLE_VALUE)
+    {
+        return FALSE;
+    }
+
+    // Each name is written as its length and its characters, which takes
+    // no more room than the name and its terminator did in the pool
+    qsort((void*) sorter->names,
+          sorter->count,
+          sizeof(*sorter->names),
+          compareNames);
+    BYTE* output = sorter->spillBuffer;
+    for (DWORD i = 0; i < sorter->count; i++)
+    {
+        WORD cchName = (WORD) wcslen(sorter->names[i]);
+        memcpy(output,
+               &cchName,
+               sizeof(cchName));
+        memcpy(output + sizeof(cchName),
+               sorter->names[i],
+               cchName * sizeof(wchar_t));
+        output += sizeof(cchName) + (cchName * sizeof(wchar_t));
+    }
+    DWORD bytes = (DWORD) (output - sorter->spillBuffer);
+    DWORD bytesWritten = 0;
+    if ((WriteFile(hRun, sorter->spillBuffer, bytes, &bytesWritten, NULL) == FALSE) ||
+        (bytesWritten != bytes))
+    {
+        CloseHandle(hRun);
+        return FALSE;
+    }
+    sorter->runs[sorter->runCount++] = hRun;
+    sorter->count = 0;
+    sorter->poolLength = 0;
+    return TRUE;
+}
+
+/// @brief checks and repairs a fake bin folder with orphans on both sides,
+/// using runs small enough to be merged, in a debug build, returns
+/// immediately in a release build
+/// @param none
+void testBinCheck(void)
+{
+#ifndef NDEBUG
+    wchar_t tempDirectory[MAX_PATH + 1] = { 0 };
+    wchar_t binDirectory[MAX_PATH + 1] = { 0 };
+    wchar_t name[MAX_PATH + 1] = { 0 };
+    GetTempPathW(ARRAYSIZE(tempDirectory),
+                 tempDirectory);
+    _snwprintf(binDirectory,
+               ARRAYSIZE(binDirectory),
+               L"%srbmbincheck%08X",
+               tempDirectory,
+               GetCurrentProcessId());
+    binDirectory[MAX_PATH] = 0;
+    deleteTree(binDirectory, NULL);
+    BOOL result = CreateDirectoryW(binDirectory,
+                                   NULL);
+    assert(result);
+
+    // 20 whole items, 3 $I files on their own, and a $R file and folder
+    // on their own
+    for (DWORD i = 0; i < 20; i++)
+    {
+        _snwprintf(name, ARRAYSIZE(name), L"%s%06u.txt", BIN_INFO_PREFIX, (i * 7919) % 1000003);
+        createCheckFile(binDirectory, name, 0);
+        _snwprintf(name, ARRAYSIZE(name), L"%s%06u.txt", BIN_CONTENT_PREFIX, (i * 7919) % 1000003);
+        createCheckFile(binDirectory, name, 10);
+    }
+    for (DWORD i = 0; i < 3; i++)
+    {
+        _snwprintf(name, ARRAYSIZE(name), L"%sLOST%02u.txt", BIN_INFO_PREFIX, i);
+        createCheckFile(binDirectory, name, 0);
+    }
+    createCheckFile(binDirectory, BIN_CONTENT_PREFIX L"GONE01.txt", 500);
+    createCheckFile(binDirectory, TRASH_TEMP_PREFIX L"AAAAAA.tmp", 0);
+    createCheckFile(binDirectory, TRASH_TEMP_PREFIX L"BBBBBB.tmp", 0);
+    _snwprintf(name, ARRAYSIZE(name), L"%s\\%sGONE02", binDirectory, BIN_CONTENT_PREFIX);
+    result = CreateDirectoryW(name,
+                              NULL);
+    assert(result);
+    createCheckFile(name, L"inside.txt", 1000);
+
+    // Runs of 4 names spill and merge, and agree with one run in memory
+    BinCheckOptions options = { 0 };
+    initBinCheckOptions(&options);
+    options.runNames = 4;
+    options.graceSeconds = 0;
+    BinCheckResult check = { 0 };
+    result = checkBinDirectory(binDirectory,
+                               &options,
+                               &check);
+    assert(result);
+    assert((check.infoFiles == 23) && (check.contentItems == 22) && (check.pairs == 20));
+    assert((check.orphanedInfo == 3) && (check.orphanedContent == 2));
+    assert(check.orphanedBytes == 1500);
+    assert((check.repairedInfo == 0) && (check.repairedContent == 0) && (check.runs > 2));
+    assert((check.staleTemp == 2) && (check.repairedTemp == 0));
+    options.runNames = CHECK_RUN_NAMES;
+    memset(&check, 0, sizeof(check));
+    result = checkBinDirectory(binDirectory,
+                               &options,
+                               &check);
+    assert(result);
+    assert((check.pairs == 20) && (check.orphanedInfo == 3) && (check.orphanedContent == 2));
+    assert(check.runs == 0);
+
+    // New $I files are left alone, orphaned $R items are quarantined
+    options.mode = CHECK_REPAIR;
+    options.runNames = 4;
+    options.graceSeconds = 3600;
+    memset(&check, 0, sizeof(check));
+    result = checkBinDirectory(binDirectory,
+                               &options,
+                               &check);
+    assert(result);
+    assert((check.skipped == 3) && (check.repairedInfo == 0) && (check.repairedContent == 2));
+    assert(check.staleTemp == 0);
+    _snwprintf(name, ARRAYSIZE(name), L"%s\\%s\\%sGONE02\\inside.txt",
+               binDirectory, CHECK_QUARANTINE_FOLDER, BIN_CONTENT_PREFIX);
+    assert(GetFileAttributesW(name) != INVALID_FILE_ATTRIBUTES);
+
+    // Once old enough, they go too, and every item left is whole
+    options.mode = CHECK_DELETE;
+    options.graceSeconds = 0;
+    memset(&check, 0, sizeof(check));
+    result = checkBinDirectory(binDirectory,
+                               &options,
+                               &check);
+    assert(result);
+    assert((check.repairedInfo == 3) && (check.orphanedContent == 0) && (check.failed == 0));
+    assert((check.staleTemp == 2) && (check.repairedTemp == 2));
+    memset(&check, 0, sizeof(check));
+    result = checkBinDirectory(binDirectory,
+                               &options,
+                               &check);
+    assert(result);
+    assert((check.pairs == 20) && (check.orphanedInfo == 0) && (check.orphanedContent == 0));
+    assert(check.staleTemp == 0);
+
+    result = deleteTree(binDirectory, NULL);
+    assert(result);
+#endif
+}
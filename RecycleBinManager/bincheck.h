@@ -0,0 +1,67 @@
+#define _CRT_SECURE_NO_WARNINGS
+
+#pragma once
+#include <Windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+
+// Consistency check parameters. An interrupted delete, restore or empty can
+// leave a $I file whose $R item is gone, which the shell lists as an item
+// that can never be restored, or a $R item with no $I file, which takes up
+// space nobody can see. The checker lists the $I and $R sides of each bin
+// folder on two threads at once and joins them with a sort-merge on the
+// shared suffix, so no item is probed on its own. Names are sorted in runs
+// of a fixed size and spilled to temporary files, which are merged while
+// joining, so a bin with millions of items is checked in bounded memory.
+// Orphans are probed once more before anything is done to them, in case a
+// delete was still in flight when the folder was listed.
+
+#define CHECK_RUN_NAMES         65536 // Names sorted in memory before a run is spilled
+#define CHECK_AVERAGE_NAME_CCH  24 // Sizes the name pool of a run, longer names spill sooner
+#define CHECK_READ_BUFFER       4096 // Bytes read ahead from each run while merging
+#define CHECK_GRACE_SECONDS     60 // $I files younger than this may belong to a delete in progress
+#define CHECK_QUARANTINE_FOLDER L"~RBMOrphans" // Inside the bin folder, next to staging folders
+#define CHECK_RUN_PREFIX        L"rbmcheck"
+
+// Check modes
+#define CHECK_REPORT            0 // Count the orphans and change nothing
+#define CHECK_REPAIR            1 // Delete orphaned $I files, quarantine orphaned $R items
+#define CHECK_DELETE            2 // Delete orphans on both sides
+
+// Structs
+
+typedef struct BinCheckOptions
+{
+    DWORD mode; // CHECK_ value
+    DWORD runNames; // Names held in memory on each side
+    DWORD graceSeconds; // Leave $I files this new alone
+} BinCheckOptions;
+
+typedef struct BinCheckResult
+{
+    ULONGLONG infoFiles; // $I files listed
+    ULONGLONG contentItems; // $R files and folders listed
+    ULONGLONG pairs;
+    ULONGLONG orphanedInfo; // $I files with no $R item
+    ULONGLONG orphanedContent; // $R items with no $I file
+    ULONGLONG orphanedBytes; // Held by orphaned $R items
+    ULONGLONG repairedInfo; // Orphaned $I files deleted
+    ULONGLONG repairedContent; // Orphaned $R items quarantined or deleted
+    ULONGLONG skipped; // Orphans too new to touch, or whose pair turned up
+    ULONGLONG failed; // Orphans that could not be repaired
+    ULONGLONG runs; // Runs spilled to disk, on both sides
+    ULONGLONG staleTemp; // Temporary $I files left by an interrupted trash put
+    ULONGLONG repairedTemp; // Of those, deleted
+    BOOL catalogStale; // The catalog does not count the items that are left
+    BOOL catalogRebuilt;
+    double milliseconds;
+} BinCheckResult;
+
+// Functions
+
+BOOL checkBin(const BinCheckOptions* options, BinCheckResult* result);
+BOOL checkBinDirectory(const wchar_t* binDirectory, const BinCheckOptions* options,
+                       BinCheckResult* result);
+void initBinCheckOptions(BinCheckOptions* options);
+void testBinCheck(void);
@@ -0,0 +1,488 @@
+/*
+* Publish the state of the bin to other processes through shared memory
+*
+* Copyright(C) 2024 ERROR_SUCCESS Software
+*
+* This program is free software : you can redistribute it and /or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.If not, see < https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#include "binstate.h"
+#include "logger.h"
+
+typedef struct StressReader
+{
+    const BinStateView* view;
+    volatile LONG* stop;
+    ULONGLONG generationBase; // Generation when items was 0
+    ULONGLONG reads;
+    ULONGLONG retries;
+    ULONGLONG failures;
+    ULONGLONG torn;
+    ULONGLONG backwards;
+} StressReader;
+
+static DWORD WINAPI stressReaderThread(void* parameter);
+
+// What the running instance publishes to, empty until it starts publishing
+static BinStateView activePublisher = { 0 };
+
+/// @brief unmaps a view of the shared bin state
+/// @param view the view
+void closeBinStateView(BinStateView* view)
+{
+    if (view->state != NULL)
+    {
+        UnmapViewOfFile(view->state);
+        view->state = NULL;
+    }
+    if (view->hSection != NULL)
+    {
+        CloseHandle(view->hSection);
+        view->hSection = NULL;
+    }
+    if (view->hPublisher != NULL)
+    {
+        CloseHandle(view->hPublisher);
+        view->hPublisher = NULL;
+    }
+}
+
+/// @brief creates the shared bin state section for writing
+/// @param name the name of the section, NULL for BINSTATE_SECTION_NAME
+/// @param view receives the view, close with closeBinStateView()
+/// @return TRUE on success, FALSE if the section could not be created or
+///         another publisher already has it, with ERROR_ALREADY_EXISTS
+BOOL openBinStatePublisher(const wchar_t* name,
+                           BinStateView* view)
+{
+    view->state = NULL;
+    view->hSection = NULL;
+    if (name == NULL)
+    {
+        name = BINSTATE_SECTION_NAME;
+    }
+
+    // The mutex only goes away once its publisher has closed it or exited
+    wchar_t publisherName[MAX_PATH + 1] = { 0 };
+    _snwprintf(publisherName,
+               ARRAYSIZE(publisherName),
+               L"%s%s",
+               name,
+               BINSTATE_PUBLISHER_SUFFIX);
+    publisherName[MAX_PATH] = 0;
+    view->hPublisher = CreateMutexW(NULL,
+                                    FALSE,
+                                    publisherName);
+    if (view->hPublisher == NULL)
+    {
+        return FALSE;
+    }
+    if (GetLastError() == ERROR_ALREADY_EXISTS)
+    {
+        closeBinStateView(view);
+        SetLastError(ERROR_ALREADY_EXISTS);
+        return FALSE;
+    }
+    view->hSection = CreateFileMappingW(INVALID_HANDLE_VALUE,
+                                        NULL,
+                                        PAGE_READWRITE,
+                                        0,
+                                        sizeof(SharedBinState),
+                                        name);
+    if (view->hSection == NULL)
+    {
+        return FALSE;
+    }
+    view->state = MapViewOfFile(view->hSection,
+                                FILE_MAP_WRITE,
+                                0,
+                                0,
+                                sizeof(SharedBinState));
+    if (view->state == NULL)
+    {
+        closeBinStateView(view);
+        return FALSE;
+    }
+
+    // The section can outlive an earlier instance while a reader has it
+    // open, even one that stopped halfway through a write. Keep its
+    // sequence going, made odd either way, so no reader mistakes the
+    // header being written for a whole snapshot.
+    InterlockedIncrement(&view->state->sequence);
+    if ((view->state->sequence & 1) == 0)
+    {
+        InterlockedIncrement(&view->state->sequence);
+    }
+    view->state->version = BINSTATE_VERSION;
+    view->state->publisherProcessId = GetCurrentProcessId();
+    view->state->magic = BINSTATE_MAGIC;
+    InterlockedIncrement(&view->state->sequence);
+    return TRUE;
+}
+
+/// @brief opens the shared bin state section for reading
+/// @param name the name of the section, NULL for BINSTATE_SECTION_NAME
+/// @param view receives the view, close with closeBinStateView()
+/// @return TRUE on success, FALSE if nothing is publishing the state
+BOOL openBinStateReader(const wchar_t* name,
+                        BinStateView* view)
+{
+    view->state = NULL;
+    view->hPublisher = NULL;
+    view->hSection = OpenFileMappingW(FILE_MAP_READ,
+                                      FALSE,
+                                      (name == NULL) ? BINSTATE_SECTION_NAME : name);
+    if (view->hSection == NULL)
+    {
+        return FALSE;
+    }
+    view->state = MapViewOfFile(view->hSection,
+                                FILE_MAP_READ,
+                                0,
+                                0,
+                                sizeof(SharedBinState));
+    if (view->state == NULL)
+    {
+        closeBinStateView(view);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/// @brief publishes the state of the bin if startPublishingBinState() has
+/// been called. The generation and change time only move if something
+/// changed.
+/// @param items the number of items in the bin
+/// @param bytes their total size
+void publishBinState(ULONGLONG items,
+                     ULONGLONG bytes)
+{
+    if (activePublisher.state == NULL)
+    {
+        return;
+    }
+    FILETIME now = { 0 };
+    GetSystemTimeAsFileTime(&now);
+    writeBinState(&activePublisher,
+                  items,
+                  bytes,
+                  ((ULONGLONG) now.dwHighDateTime << 32) | now.dwLowDateTime);
+}
+
+/// @brief takes a consistent snapshot of the shared bin state
+/// @param view a view opened by either function
+/// @param snapshot receives the state
+/// @return TRUE on success, FALSE if nothing has been published yet or
+///         the publisher kept writing for BINSTATE_MAX_RETRIES attempts
+BOOL readBinState(const BinStateView* view,
+                  BinStateSnapshot* snapshot)
+{
+    const SharedBinState* state = view->state;
+    for (DWORD attempt = 0; attempt < BINSTATE_MAX_RETRIES; attempt++)
+    {
+        LONG before = state->sequence;
+        MemoryBarrier();
+        if ((before & 1) == 0)
+        {
+            snapshot->items = state->items;
+            snapshot->bytes = state->bytes;
+            snapshot->generation = state->generation;
+            snapshot->lastChange = state->lastChange;
+            snapshot->publisherProcessId = state->publisherProcessId;
+            DWORD magic = state->magic;
+            MemoryBarrier();
+            if (state->sequence == before)
+            {
+                snapshot->retries = attempt;
+                return (magic == BINSTATE_MAGIC);
+            }
+        }
+        YieldProcessor();
+    }
+    snapshot->retries = BINSTATE_MAX_RETRIES;
+    return FALSE;
+}
+
+/// @brief creates the shared section the running instance publishes to
+/// @param none
+/// @return TRUE on success, FALSE if the section could not be created or
+///         another instance is already publishing
+BOOL startPublishingBinState(void)
+{
+    if (activePublisher.state != NULL)
+    {
+        return TRUE;
+    }
+    if (openBinStatePublisher(NULL,
+                              &activePublisher) == FALSE)
+    {
+        DWORD error = GetLastError();
+        if (error == ERROR_ALREADY_EXISTS)
+        {
+            LOG(L"Another instance is already publishing the bin state\n");
+        }
+        else
+        {
+            LOG(L"Unable to publish the bin state, error %lu\n",
+                error);
+        }
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/// @brief stops publishing. The section goes away once no reader has it open.
+/// @param none
+void stopPublishingBinState(void)
+{
+    closeBinStateView(&activePublisher);
+}
+
+/// @brief runs one publisher, writing as fast as it can, against a number
+/// of readers for a while and checks every snapshot they take is whole.
+/// The stress test uses a section of its own, so it can run while the app
+/// is publishing.
+/// @param readers the number of reader threads, at most BINSTATE_MAX_READERS
+/// @param milliseconds how long to run for
+/// @param result receives the counts
+/// @return TRUE on success, FALSE if the section or threads could not be created
+BOOL stressBinState(DWORD readers,
+                    DWORD milliseconds,
+                    BinStateStress* result)
+{
+    memset(result,
+           0,
+           sizeof(BinStateStress));
+    readers = max(1, min(readers, BINSTATE_MAX_READERS));
+    result->readers = readers;
+
+    wchar_t name[64] = { 0 };
+    _snwprintf(name,
+               ARRAYSIZE(name),
+               L"%sStress%08X",
+               BINSTATE_SECTION_NAME,
+               GetCurrentProcessId());
+    name[ARRAYSIZE(name) - 1] = 0;
+    BinStateView publisher = { 0 };
+    BinStateView reader = { 0 };
+    if ((openBinStatePublisher(name,
+                               &publisher) == FALSE) ||
+        (openBinStateReader(name,
+                            &reader) == FALSE))
+    {
+        closeBinStateView(&publisher);
+        return FALSE;
+    }
+    writeBinState(&publisher,
+                  0,
+                  0,
+                  0);
+    BinStateSnapshot initial = { 0 };
+    readBinState(&reader,
+                 &initial);
+
+    volatile LONG stop = 0;
+    StressReader state[BINSTATE_MAX_READERS] = { 0 };
+    HANDLE threads[BINSTATE_MAX_READERS] = { 0 };
+    DWORD started = 0;
+    for (; started < readers; started++)
+    {
+        state[started].view = &reader;
+        state[started].stop = &stop;
+        state[started].generationBase = initial.generation;
+        threads[started] = CreateThread(NULL,
+                                        0,
+                                        stressReaderThread,
+                                        &state[started],
+                                        0,
+                                        NULL);
+        if (threads[started] == NULL)
+        {
+            break;
+        }
+    }
+
+    // Every write keeps bytes, generation and change time in step with
+    // items, so a reader can tell a torn snapshot from a whole one
+    LARGE_INTEGER frequency, start, now;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&start);
+    LONGLONG end = start.QuadPart + ((frequency.QuadPart * milliseconds) / 1000);
+    ULONGLONG items = 0;
+    do
+    {
+        items++;
+        writeBinState(&publisher,
+                      items,
+                      items * BINSTATE_STRESS_BYTES,
+                      items);
+        QueryPerformanceCounter(&now);
+    } while (now.QuadPart < end);
+    result->writes = items;
+    InterlockedExchange(&stop,
+                        1);
+    WaitForMultipleObjects(started,
+                           threads,
+                           TRUE,
+                           INFINITE);
+
+    for (DWORD i = 0; i < started; i++)
+    {
+        CloseHandle(threads[i]);
+        result->reads += state[i].reads;
+        result->retries += state[i].retries;
+        result->failures += state[i].failures;
+        result->torn += state[i].torn;
+        result->backwards += state[i].backwards;
+    }
+    double seconds = (double) (now.QuadPart - start.QuadPart) / (double) frequency.QuadPart;
+    result->nanosecondsPerRead = (result->reads == 0) ? 0.0 :
+        (seconds * 1e9 * started) / (double) result->reads;
+    closeBinStateView(&reader);
+    closeBinStateView(&publisher);
+    return (started == readers);
+}
+
+/// @brief reads the shared state until told to stop, checking each snapshot
+/// @param parameter the StressReader
+/// @return 0
+static DWORD WINAPI stressReaderThread(void* parameter)
+{
+    StressReader* reader = parameter;
+    ULONGLONG lastGeneration = 0;
+    while (*reader->stop == 0)
+    {
+        BinStateSnapshot snapshot = { 0 };
+        if (readBinState(reader->view,
+                         &snapshot) == FALSE)
+        {
+            reader->failures++;
+            continue;
+        }
+        reader->reads++;
+        reader->retries += snapshot.retries;
+        if ((snapshot.bytes != snapshot.items * BINSTATE_STRESS_BYTES) ||
+            (snapshot.generation != reader->generationBase + snapshot.items) ||
+            (snapshot.lastChange != snapshot.items))
+        {
+            reader->torn++;
+        }
+        if (snapshot.generation < lastGeneration)
+        {
+            reader->backwards++;
+        }
+        lastGeneration = snapshot.generation;
+    }
+    return 0;
+}
+
+/// @brief checks a snapshot can be read once published, and that
+/// concurrent readers never see a torn or stale snapshot, in a debug build,
+/// returns immediately in a release build
+/// @param none
+void testBinState(void)
+{
+#ifndef NDEBUG
+    wchar_t name[64] = { 0 };
+    _snwprintf(name,
+               ARRAYSIZE(name),
+               L"%sTest%08X",
+               BINSTATE_SECTION_NAME,
+               GetCurrentProcessId());
+    name[ARRAYSIZE(name) - 1] = 0;
+    BinStateView reader = { 0 };
+    BOOL result = openBinStateReader(name,
+                                     &reader);
+    assert(result == FALSE);
+
+    BinStateView publisher = { 0 };
+    result = openBinStatePublisher(name,
+                                   &publisher);
+    assert(result);
+    result = openBinStateReader(name,
+                                &reader);
+    assert(result);
+
+    // A second publisher would break the sequence lock
+    BinStateView second = { 0 };
+    result = openBinStatePublisher(name,
+                                   &second);
+    assert((result == FALSE) && (GetLastError() == ERROR_ALREADY_EXISTS));
+    writeBinState(&publisher,
+                  10,
+                  1000,
+                  5);
+    BinStateSnapshot snapshot = { 0 };
+    result = readBinState(&reader,
+                          &snapshot);
+    assert(result);
+    assert((snapshot.items == 10) && (snapshot.bytes == 1000));
+    assert((snapshot.generation == 1) && (snapshot.lastChange == 5));
+    assert(snapshot.publisherProcessId == GetCurrentProcessId());
+
+    // Publishing the same state again is not a change
+    writeBinState(&publisher,
+                  10,
+                  1000,
+                  9);
+    result = readBinState(&reader,
+                          &snapshot);
+    assert(result && (snapshot.generation == 1) && (snapshot.lastChange == 5));
+    writeBinState(&publisher,
+                  0,
+                  0,
+                  9);
+    result = readBinState(&reader,
+                          &snapshot);
+    assert(result && (snapshot.generation == 2) && (snapshot.lastChange == 9));
+    closeBinStateView(&reader);
+    closeBinStateView(&publisher);
+
+    BinStateStress stress = { 0 };
+    result = stressBinState(4,
+                            200,
+                            &stress);
+    assert(result);
+    assert((stress.writes > 0) && (stress.reads > 0));
+    assert((stress.torn == 0) && (stress.backwards == 0));
+#endif
+}
+
+/// @brief writes the bin state under the sequence lock. There must only be
+/// one writer at a time.
+/// @param view a view opened by openBinStatePublisher()
+/// @param items the number of items in the bin
+/// @param bytes their total size
+/// @param changeTime the FILETIME to record if anything changed
+void writeBinState(BinStateView* view,
+                   ULONGLONG items,
+                   ULONGLONG bytes,
+                   ULONGLONG changeTime)
+{
+    SharedBinState* state = view->state;
+    if ((state->generation != 0) && (state->items == items) && (state->bytes == bytes))
+    {
+        return;
+    }
+
+    // Both increments are full barriers, so the fields can't be seen
+    // changing while the sequence is even
+    InterlockedIncrement(&state->sequence);
+    state->items = items;
+    state->bytes = bytes;
+    state->generation++;
+    state->lastChange = changeTime;
+    InterlockedIncrement(&state->sequence);
+}
@@ -0,0 +1,86 @@
+#define _CRT_SECURE_NO_WARNINGS
+
+#pragma once
+#include <Windows.h>
+#include <stdio.h>
+#include <assert.h>
+
+// Shared bin state parameters. The running instance publishes the item
+// count, total size, a generation that goes up with every change and the
+// time of the last change in a small named shared memory section, so other
+// processes can read the state of the bin without scanning it or asking
+// the app. The section is guarded by a sequence lock: the publisher makes
+// the sequence odd, writes, then makes it even again, and a reader copies
+// the fields and retries if the sequence was odd or moved while it read.
+// Reading takes no locks and no system calls. Only this header, binstate.c
+// and Windows.h are needed to read it from another program. The sequence
+// lock only works with one writer, so a publisher also creates a named
+// mutex next to the section, and an instance that finds the mutex already
+// exists leaves the publishing to the one that made it.
+
+#define BINSTATE_SECTION_NAME       L"Local\\RecycleBinManagerState"
+#define BINSTATE_PUBLISHER_SUFFIX   L"Publisher" // Added to the section name for the mutex
+#define BINSTATE_MAGIC              0x53424D52 // "RMBS" when read as bytes
+#define BINSTATE_VERSION            1
+#define BINSTATE_MAX_RETRIES        4096 // Reads that race the publisher before giving up
+#define BINSTATE_STRESS_BYTES       4096 // Bytes per item the stress test publishes
+#define BINSTATE_DEFAULT_READERS    4
+#define BINSTATE_DEFAULT_STRESS_MS  2000
+#define BINSTATE_MAX_READERS        64
+
+// Structs
+
+typedef struct SharedBinState
+{
+    DWORD magic; // Always BINSTATE_MAGIC once the publisher has started
+    DWORD version; // Always BINSTATE_VERSION
+    volatile LONG sequence; // Odd while the publisher is writing
+    DWORD publisherProcessId;
+    volatile ULONGLONG items;
+    volatile ULONGLONG bytes;
+    volatile ULONGLONG generation; // Goes up by one whenever items or bytes change
+    volatile ULONGLONG lastChange; // FILETIME of the last change
+} SharedBinState;
+
+typedef struct BinStateSnapshot
+{
+    ULONGLONG items;
+    ULONGLONG bytes;
+    ULONGLONG generation;
+    ULONGLONG lastChange;
+    DWORD publisherProcessId;
+    DWORD retries; // Times the read raced the publisher and started again
+} BinStateSnapshot;
+
+typedef struct BinStateView
+{
+    HANDLE hSection;
+    HANDLE hPublisher; // The publisher's mutex, NULL in a reader
+    SharedBinState* state;
+} BinStateView;
+
+typedef struct BinStateStress
+{
+    DWORD readers;
+    ULONGLONG writes;
+    ULONGLONG reads; // Consistent snapshots, over every reader
+    ULONGLONG retries;
+    ULONGLONG failures; // Reads that gave up
+    ULONGLONG torn; // Snapshots whose fields don't belong together, must be 0
+    ULONGLONG backwards; // Snapshots older than one the reader had already seen, must be 0
+    double nanosecondsPerRead;
+} BinStateStress;
+
+// Functions
+
+void closeBinStateView(BinStateView* view);
+BOOL openBinStatePublisher(const wchar_t* name, BinStateView* view);
+BOOL openBinStateReader(const wchar_t* name, BinStateView* view);
+void publishBinState(ULONGLONG items, ULONGLONG bytes);
+BOOL readBinState(const BinStateView* view, BinStateSnapshot* snapshot);
+BOOL startPublishingBinState(void);
+void stopPublishingBinState(void);
+BOOL stressBinState(DWORD readers, DWORD milliseconds, BinStateStress* result);
+void testBinState(void);
+void writeBinState(BinStateView* view, ULONGLONG items, ULONGLONG bytes,
+                   ULONGLONG changeTime);
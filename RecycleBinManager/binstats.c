@@ -0,0 +1,740 @@
+/*
+* Break the Recycle Bin down by extension, owner and age in one pass
+*
+* Copyright(C) 2024 ERROR_SUCCESS Software
+*
+* This program is free software : you can redistribute it and /or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.If not, see < https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#include "binstats.h"
+#include "parallel.h"
+#include "reclaim.h"
+#include "scheduler.h"
+#include "userbins.h"
+#include "logger.h"
+
+typedef struct VolumeStatsJob
+{
+    wchar_t paths[26][MAX_PATH + 1]; // $Recycle.Bin folder of each volume
+    BinStats* parts; // One for each volume
+    BOOL failed; // A volume ran out of memory
+} VolumeStatsJob;
+
+static void collectVolumeStatsTask(DWORD index, void* context);
+static int compareExtensionSlots(const void* a, const void* b);
+static int compareOwnerSlots(const void* a, const void* b);
+static StatsTotals* findExtensionTotals(BinStats* stats, const wchar_t* extension);
+static StatsTotals* findOwnerTotals(BinStats* stats, const wchar_t* sid);
+static void getStatsExtension(const wchar_t* originalPath, wchar_t* extension);
+static DWORD hashStatsKey(const wchar_t* key);
+static void writeStatsRow(ReportWriter* writer, DWORD format, const char* breakdown,
+                          const wchar_t* key, const StatsTotals* totals, BOOL first);
+#ifndef NDEBUG
+static void createStatsItem(const wchar_t* directory, DWORD index, const wchar_t* originalPath,
+                            ULONGLONG size, ULONGLONG deletionTime);
+#endif
+
+/// @brief adds one item to every breakdown
+/// @param stats the statistics, not sorted yet
+/// @param sid the user the item belongs to
+/// @param originalPath where the item was deleted from
+/// @param size the size of the item in bytes
+/// @param deletionTime when the item was deleted
+void addStatsItem(BinStats* stats,
+                  const wchar_t* sid,
+                  const wchar_t* originalPath,
+                  ULONGLONG size,
+                  ULONGLONG deletionTime)
+{
+    ULONGLONG age = (stats->now > deletionTime) ? stats->now - deletionTime : 0;
+    ULONGLONG day = SECONDS_PER_DAY * FILETIME_PER_SECOND;
+    DWORD bucket = (age < day) ? STATS_AGE_TODAY :
+        (age < 7 * day) ? STATS_AGE_WEEK :
+        (age < 30 * day) ? STATS_AGE_MONTH : STATS_AGE_OLDER;
+    wchar_t extension[STATS_EXTENSION_CCH] = { 0 };
+    getStatsExtension(originalPath,
+                      extension);
+    StatsTotals* totals[] =
+    {
+        &stats->total,
+        &stats->ages[bucket],
+        findExtensionTotals(stats, extension),
+        findOwnerTotals(stats, sid),
+    };
+    for (DWORD i = 0; i < ARRAYSIZE(totals); i++)
+    {
+        totals[i]->items++;
+        totals[i]->bytes += size;
+    }
+}
+
+/// @brief reads every user's bin on every fixed volume, one thread per
+/// volume, and merges what each volume found
+/// @param stats receives the statistics, from initBinStats()
+/// @param maxThreads the most volumes to read at once, 0 for one per processor
+/// @return TRUE on success, FALSE if memory ran out
+BOOL collectBinStats(BinStats* stats,
+                     DWORD maxThreads)
+{
+    VolumeStatsJob* job = HeapAlloc(GetProcessHeap(),
+                                    HEAP_ZERO_MEMORY,
+                                    sizeof(VolumeStatsJob));
+    if (job == NULL) // Memory allocation failed
+    {
+        return FALSE;
+    }
+    DWORD volumeCount = 0;
+    DWORD drives = GetLogicalDrives();
+    for (wchar_t driveLetter = L'A'; driveLetter <= L'Z'; driveLetter++)
+    {
+        wchar_t volumeRoot[] = { driveLetter, L':', L'\\', 0 };
+        if (((drives & (1 << (driveLetter - L'A'))) == 0) ||
+            (GetDriveTypeW(volumeRoot) != DRIVE_FIXED))
+        {
+            continue;
+        }
+        _snwprintf(job->paths[volumeCount],
+                   MAX_PATH + 1,
+                   L"%c:\\%s",
+                   driveLetter,
+                   BIN_FOLDER_NAME);
+        volumeCount++;
+    }
+    job->parts = HeapAlloc(GetProcessHeap(),
+                           0,
+                           (volumeCount + 1) * sizeof(BinStats));
+    if (job->parts == NULL) // Memory allocation failed
+    {
+        HeapFree(GetProcessHeap(),
+                 0,
+                 job);
+        return FALSE;
+    }
+    for (DWORD i = 0; i < volumeCount; i++)
+    {
+        initBinStats(&job->parts[i],
+                     stats->now);
+    }
+
+    parallelFor(volumeCount,
+                (maxThreads > 0) ? maxThreads : getDefaultThreadCount(),
+                collectVolumeStatsTask,
+                job);
+    for (DWORD i = 0; i < volumeCount; i++)
+    {
+        mergeBinStats(stats,
+                      &job->parts[i]);
+    }
+    BOOL result = (job->failed == FALSE);
+    HeapFree(GetProcessHeap(),
+             0,
+             job->parts);
+    HeapFree(GetProcessHeap(),
+             0,
+             job);
+    return result;
+}
+
+/// @brief reads every user's bin in one $Recycle.Bin folder. Folders that
+/// can't be listed, usually other users' without elevation, are counted.
+/// @param stats the statistics, not sorted yet
+/// @param recycleBinPath the $Recycle.Bin folder, without a trailing backslash
+/// @return TRUE on success, FALSE if memory ran out
+BOOL collectVolumeStats(BinStats* stats,
+                        const wchar_t* recycleBinPath)
+{
+    UserBinReport report = { 0 };
+    BYTE* buffer = HeapAlloc(GetProcessHeap(),
+                             0,
+                             BIN_INFO_MAX_SIZE);
+    wchar_t* originalPath = HeapAlloc(GetProcessHeap(),
+                                      0,
+                                      BIN_PATH_MAX_CCH * sizeof(wchar_t));
+    BOOL result = ((buffer != NULL) && (originalPath != NULL) && // Memory allocation failed
+                   addUserBinRoot(&report, recycleBinPath));
+    for (DWORD i = 0; result && (i < report.folderCount); i++)
+    {
+        const UserBinFolder* folder = &report.folders[i];
+        wchar_t searchPattern[MAX_PATH + 1] = { 0 };
+        _snwprintf(searchPattern,
+                   ARRAYSIZE(searchPattern),
+                   L"%s\\%s*",
+                   folder->path,
+                   BIN_INFO_PREFIX);
+        searchPattern[MAX_PATH] = 0;
+        WIN32_FIND_DATAW findData = { 0 };
+        HANDLE hFind = FindFirstFileExW(searchPattern,
+                                        FindExInfoBasic,
+                                        &findData,
+                                        FindExSearchNameMatch,
+                                        NULL,
+                                        FIND_FIRST_EX_LARGE_FETCH);
+        if (hFind == INVALID_HANDLE_VALUE)
+        {
+            if (GetLastError() != ERROR_FILE_NOT_FOUND)
+            {
+                stats->unreadable++;
+            }
+            continue;
+        }
+        do
+        {
+            if (findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+            {
+                continue;
+            }
+            wchar_t infoPath[MAX_PATH + 1] = { 0 };
+            _snwprintf(infoPath,
+                       ARRAYSIZE(infoPath),
+                       L"%s\\%s",
+                       folder->path,
+                       findData.cFileName);
+            infoPath[MAX_PATH] = 0;
+            BinItem item = { 0 };
+            if (readBinInfoFile(infoPath,
+                                buffer,
+                                &item,
+                                originalPath,
+                                BIN_PATH_MAX_CCH))
+            {
+                addStatsItem(stats,
+                             folder->path + folder->sidOffset,
+                             originalPath,
+                             item.size,
+                             item.deletionTime);
+            }
+        } while (FindNextFileW(hFind, &findData));
+        FindClose(hFind);
+    }
+    stats->volumes++;
+
+    freeUserBinReport(&report);
+    if (buffer != NULL)
+    {
+        HeapFree(GetProcessHeap(),
+                 0,
+                 buffer);
+    }
+    if (originalPath != NULL)
+    {
+        HeapFree(GetProcessHeap(),
+                 0,
+                 originalPath);
+    }
+    return result;
+}
+
+/// @brief reads one volume into its own statistics, for parallelFor()
+/// @param index the index of the volume
+/// @param context the VolumeStatsJob
+static void collectVolumeStatsTask(DWORD index,
+                                   void* context)
+{
+    VolumeStatsJob* job = context;
+    if (collectVolumeStats(&job->parts[index],
+                           job->paths[index]) == FALSE)
+    {
+        job->failed = TRUE;
+    }
+}
+
+/// @brief orders extensions by bytes, largest first, with unused slots
+/// last, for qsort()
+static int compareExtensionSlots(const void* a,
+                                 const void* b)
+{
+    const ExtensionSlot* slotA = a;
+    const ExtensionSlot* slotB = b;
+    if ((slotA->extension[0] == 0) || (slotB->extension[0] == 0))
+    {
+        return (slotA->extension[0] == 0) - (slotB->extension[0] == 0);
+    }
+    return (slotA->totals.bytes < slotB->totals.bytes) - (slotA->totals.bytes > slotB->totals.bytes);
+}
+
+/// @brief orders owners by bytes, largest first, with unused slots last,
+/// for qsort()
+static int compareOwnerSlots(const void* a,
+                             const void* b)
+{
+    const OwnerSlot* slotA = a;
+    const OwnerSlot* slotB = b;
+    if ((slotA->sid[0] == 0) || (slotB->sid[0] == 0))
+    {
+        return (slotA->sid[0] == 0) - (slotB->sid[0] == 0);
+    }
+    return (slotA->totals.bytes < slotB->totals.bytes) - (slotA->totals.bytes > slotB->totals.bytes);
+}
+
+#ifndef NDEBUG
+/// @brief writes a $I file for the self test
+/// @param directory the user folder to write it in
+/// @param index makes the name unique
+/// @param originalPath where the item was deleted from
+/// @param size the size of the item
+/// @param deletionTime when the item was deleted
+static void createStatsItem(const wchar_t* directory,
+                            DWORD index,
+                            const wchar_t* originalPath,
+                            ULONGLONG size,
+                            ULONGLONG deletionTime)
+{
+    BYTE* buffer = HeapAlloc(GetProcessHeap(),
+                             0,
+                             BIN_INFO_MAX_SIZE);
+    assert(buffer != NULL);
+    DWORD length = buildBinInfo(buffer,
+                                originalPath,
+                                size,
+                                deletionTime);
+    assert(length > 0);
+    wchar_t path[MAX_PATH + 1] = { 0 };
+    _snwprintf(path,
+               ARRAYSIZE(path),
+               L"%s\\%s%06u",
+               directory,
+               BIN_INFO_PREFIX,
+               index);
+    path[MAX_PATH] = 0;
+    HANDLE hFile = CreateFileW(path,
+                               GENERIC_WRITE,
+                               0,
+                               NULL,
+                               CREATE_ALWAYS,
+                               FILE_ATTRIBUTE_NORMAL,
+                               NULL);
+    assert(hFile != INVALID_HANDLE_VALUE);
+    DWORD written = 0;
+    WriteFile(hFile,
+              buffer,
+              length,
+              &written,
+              NULL);
+    CloseHandle(hFile);
+    HeapFree(GetProcessHeap(),
+             0,
+             buffer);
+}
+#endif
+
+/// @brief finds the totals for an extension, adding it if there is room
+/// @param stats the statistics, not sorted yet
+/// @param extension the extension
+/// @return the totals for the extension, or for other if the table is full
+static StatsTotals* findExtensionTotals(BinStats* stats,
+                                        const wchar_t* extension)
+{
+    DWORD slot = hashStatsKey(extension) & (STATS_EXTENSION_SLOTS - 1);
+    for (;;)
+    {
+        ExtensionSlot* entry = &stats->extensions[slot];
+        if (entry->extension[0] == 0)
+        {
+            if (stats->extensionCount * 100 >= STATS_EXTENSION_SLOTS * STATS_FILL_PERCENT)
+            {
+                return &stats->otherExtensions;
+            }
+            wcscpy(entry->extension,
+                   extension);
+            stats->extensionCount++;
+            return &entry->totals;
+        }
+        if (wcscmp(entry->extension, extension) == 0)
+        {
+            return &entry->totals;
+        }
+        slot = (slot + 1) & (STATS_EXTENSION_SLOTS - 1);
+    }
+}
+
+/// @brief finds the totals for a user, adding them if there is room
+/// @param stats the statistics, not sorted yet
+/// @param sid the user's SID
+/// @return the totals for the user, or for other if the table is full
+static StatsTotals* findOwnerTotals(BinStats* stats,
+                                    const wchar_t* sid)
+{
+    if (wcslen(sid) >= BIN_SID_MAX_CCH)
+    {
+        return &stats->otherOwners;
+    }
+    DWORD slot = hashStatsKey(sid) & (STATS_OWNER_SLOTS - 1);
+    for (;;)
+    {
+        OwnerSlot* entry = &stats->owners[slot];
+        if (entry->sid[0] == 0)
+        {
+            if (stats->ownerCount * 100 >= STATS_OWNER_SLOTS * STATS_FILL_PERCENT)
+            {
+                return &stats->otherOwners;
+            }
+            wcscpy(entry->sid,
+                   sid);
+            stats->ownerCount++;
+            return &entry->totals;
+        }
+        if (_wcsicmp(entry->sid, sid) == 0)
+        {
+            return &entry->totals;
+        }
+        slot = (slot + 1) & (STATS_OWNER_SLOTS - 1);
+    }
+}
+
+/// @brief gets the extension of the name at the end of a path, in lower
+/// case with its dot, or STATS_NO_EXTENSION if it has none or it is too long
+/// @param originalPath the path
+/// @param extension receives the extension, STATS_EXTENSION_CCH characters
+static void getStatsExtension(const wchar_t* originalPath,
+                              wchar_t* extension)
+{
+    const wchar_t* name = originalPath;
+    const wchar_t* dot = NULL;
+    for (const wchar_t* character = originalPath; *character != 0; character++)
+    {
+        if ((*character == L'\\') || (*character == L'/'))
+        {
+            name = character + 1;
+            dot = NULL;
+        }
+        else if (*character == L'.')
+        {
+            dot = character;
+        }
+    }
+    if ((dot == NULL) || (dot == name) || (wcslen(dot) >= STATS_EXTENSION_CCH))
+    {
+        wcscpy(extension,
+               STATS_NO_EXTENSION);
+        return;
+    }
+    size_t i = 0;
+    for (; dot[i] != 0; i++)
+    {
+        extension[i] = towlower(dot[i]);
+    }
+    extension[i] = 0;
+}
+
+/// @brief hashes a key ignoring case, FNV-1a over each character
+/// @param key the key
+/// @return the hash
+static DWORD hashStatsKey(const wchar_t* key)
+{
+    DWORD hash = 2166136261;
+    for (const wchar_t* character = key; *character != 0; character++)
+    {
+        hash ^= (WORD) towlower(*character);
+        hash *= 16777619;
+    }
+    return hash;
+}
+
+/// @brief starts empty statistics
+/// @param stats receives the statistics
+/// @param now the FILETIME ages are measured from
+void initBinStats(BinStats* stats,
+                  ULONGLONG now)
+{
+    memset(stats,
+           0,
+           sizeof(*stats));
+    stats->now = now;
+}
+
+/// @brief adds the statistics of one part, such as a volume, to another
+/// @param stats the statistics to add to, not sorted yet
+/// @param part the statistics to add, sorted or not
+void mergeBinStats(BinStats* stats,
+                   const BinStats* part)
+{
+    const StatsTotals* sources[STATS_AGE_BUCKETS + 3] = { &part->total, &part->otherExtensions,
+                                                          &part->otherOwners };
+    StatsTotals* destinations[STATS_AGE_BUCKETS + 3] = { &stats->total, &stats->otherExtensions,
+                                                         &stats->otherOwners };
+    for (DWORD i = 0; i < STATS_AGE_BUCKETS; i++)
+    {
+        sources[3 + i] = &part->ages[i];
+        destinations[3 + i] = &stats->ages[i];
+    }
+    for (DWORD i = 0; i < ARRAYSIZE(sources); i++)
+    {
+        destinations[i]->items += sources[i]->items;
+        destinations[i]->bytes += sources[i]->bytes;
+    }
+    for (DWORD i = 0; i < STATS_EXTENSION_SLOTS; i++)
+    {
+        if (part->extensions[i].extension[0] != 0)
+        {
+            StatsTotals* totals = findExtensionTotals(stats,
+                                                      part->extensions[i].extension);
+            totals->items += part->extensions[i].totals.items;
+            totals->bytes += part->extensions[i].totals.bytes;
+        }
+    }
+    for (DWORD i = 0; i < STATS_OWNER_SLOTS; i++)
+    {
+        if (part->owners[i].sid[0] != 0)
+        {
+            StatsTotals* totals = findOwnerTotals(stats,
+                                                  part->owners[i].sid);
+            totals->items += part->owners[i].totals.items;
+            totals->bytes += part->owners[i].totals.bytes;
+        }
+    }
+    stats->volumes += part->volumes;
+    stats->unreadable += part->unreadable;
+}
+
+/// @brief packs the extensions and owners at the start of their tables,
+/// largest first. The tables stop being hash tables, so nothing more can
+/// be added or merged into these statistics afterwards.
+/// @param stats the statistics
+void sortBinStats(BinStats* stats)
+{
+    qsort(stats->extensions,
+          STATS_EXTENSION_SLOTS,
+          sizeof(ExtensionSlot),
+          compareExtensionSlots);
+    qsort(stats->owners,
+          STATS_OWNER_SLOTS,
+          sizeof(OwnerSlot),
+          compareOwnerSlots);
+    stats->sorted = TRUE;
+}
+
+/// @brief reads a fake bin with two users, checks every breakdown and the
+/// merge, fills a table past its limit and writes a report, in a debug
+/// build, returns immediately in a release build
+/// @param none
+void testBinStats(void)
+{
+#ifndef NDEBUG
+    wchar_t tempDirectory[MAX_PATH + 1] = { 0 };
+    wchar_t root[MAX_PATH + 1] = { 0 };
+    wchar_t path[MAX_PATH + 1] = { 0 };
+    GetTempPathW(ARRAYSIZE(tempDirectory),
+                 tempDirectory);
+    _snwprintf(root,
+               ARRAYSIZE(root),
+               L"%srbmstats%08X",
+               tempDirectory,
+               GetCurrentProcessId());
+    root[MAX_PATH] = 0;
+    deleteTree(root, NULL);
+    BOOL result = CreateDirectoryW(root,
+                                   NULL);
+    assert(result);
+
+    ULONGLONG hour = 3600 * FILETIME_PER_SECOND;
+    ULONGLONG now = 1000000 * hour;
+    _snwprintf(path, ARRAYSIZE(path), L"%s\\S-1-5-21-1-1001", root);
+    result = CreateDirectoryW(path, NULL);
+    assert(result);
+    createStatsItem(path, 0, L"C:\\a\\report.PDF", 100, now - hour);
+    createStatsItem(path, 1, L"C:\\a\\notes.txt", 10, now - (72 * hour));
+    createStatsItem(path, 2, L"C:\\a.b\\folder", 1000, now - (240 * hour));
+    _snwprintf(path, ARRAYSIZE(path), L"%s\\S-1-5-21-1-1002", root);
+    result = CreateDirectoryW(path, NULL);
+    assert(result);
+    createStatsItem(path, 0, L"C:\\b\\x.TXT", 20, now - (960 * hour));
+    createStatsItem(path, 1, L"C:\\b\\archive.tar.gz", 500, now - (2 * hour));
+
+    BinStats* stats = HeapAlloc(GetProcessHeap(),
+                                0,
+                                2 * sizeof(BinStats));
+    assert(stats != NULL);
+    initBinStats(&stats[0],
+                 now);
+    result = collectVolumeStats(&stats[0],
+                                root);
+    assert(result);
+    assert((stats[0].total.items == 5) && (stats[0].total.bytes == 1630));
+    assert((stats[0].ages[STATS_AGE_TODAY].items == 2) && (stats[0].ages[STATS_AGE_TODAY].bytes == 600));
+    assert(stats[0].ages[STATS_AGE_WEEK].bytes == 10);
+    assert(stats[0].ages[STATS_AGE_MONTH].bytes == 1000);
+    assert(stats[0].ages[STATS_AGE_OLDER].bytes == 20);
+    assert((stats[0].extensionCount == 4) && (stats[0].ownerCount == 2));
+    assert(findExtensionTotals(&stats[0], L".txt")->bytes == 30);
+    assert(findExtensionTotals(&stats[0], L".gz")->bytes == 500);
+    assert(findExtensionTotals(&stats[0], STATS_NO_EXTENSION)->bytes == 1000);
+    assert(findOwnerTotals(&stats[0], L"S-1-5-21-1-1001")->bytes == 1110);
+
+    // Merging a part adds to what is there, and new keys past the limit
+    // are counted under other
+    initBinStats(&stats[1],
+                 now);
+    for (DWORD i = 0; i < 2000; i++)
+    {
+        wchar_t name[32] = { 0 };
+        _snwprintf(name, ARRAYSIZE(name), L"C:\\f.e%u", i);
+        addStatsItem(&stats[1], L"S-1-5-21-1-1001", name, 1, now);
+    }
+    assert(stats[1].extensionCount == STATS_EXTENSION_SLOTS * STATS_FILL_PERCENT / 100);
+    assert(stats[1].otherExtensions.items == 2000 - stats[1].extensionCount);
+    mergeBinStats(&stats[0],
+                  &stats[1]);
+    assert((stats[0].total.items == 2005) && (stats[0].ages[STATS_AGE_TODAY].items == 2002));
+    assert(findOwnerTotals(&stats[0], L"S-1-5-21-1-1001")->items == 2003);
+    assert(stats[0].otherExtensions.items == 2000 - (stats[0].extensionCount - 4));
+    sortBinStats(&stats[0]);
+    assert(wcscmp(stats[0].extensions[0].extension, STATS_NO_EXTENSION) == 0);
+    assert(wcscmp(stats[0].owners[0].sid, L"S-1-5-21-1-1001") == 0);
+
+    // Every row of the report is there
+    ReportWriter* writer = HeapAlloc(GetProcessHeap(),
+                                     0,
+                                     sizeof(ReportWriter));
+    assert(writer != NULL);
+    _snwprintf(path, ARRAYSIZE(path), L"%s\\report.csv", root);
+    HANDLE hFile = CreateFileW(path,
+                               GENERIC_READ | GENERIC_WRITE,
+                               0,
+                               NULL,
+                               CREATE_ALWAYS,
+                               FILE_ATTRIBUTE_NORMAL,
+                               NULL);
+    assert(hFile != INVALID_HANDLE_VALUE);
+    initReportWriter(writer,
+                     hFile);
+    result = writeBinStats(&stats[0],
+                           STATS_FORMAT_CSV,
+                           writer);
+    assert(result);
+    char report[65536] = { 0 };
+    DWORD bytesRead = 0;
+    LARGE_INTEGER start = { 0 };
+    SetFilePointerEx(hFile, start, NULL, FILE_BEGIN);
+    ReadFile(hFile, report, sizeof(report) - 1, &bytesRead, NULL);
+    CloseHandle(hFile);
+    assert(strncmp(report, "breakdown,key,items,bytes\n", 26) == 0);
+    assert(strstr(report, "total,\"\",2005,3630\n") != NULL);
+    assert(strstr(report, "age,\"today\",2002,2600\n") != NULL);
+    assert(strstr(report, "extension,\".pdf\",1,100\n") != NULL);
+    assert(strstr(report, "owner,\"S-1-5-21-1-1002\",2,520\n") != NULL);
+
+    HeapFree(GetProcessHeap(),
+             0,
+             writer);
+    HeapFree(GetProcessHeap(),
+             0,
+             stats);
+    result = deleteTree(root, NULL);
+    assert(result);
+#endif
+}
+
+/// @brief writes the statistics as JSON or as CSV with one row per key
+/// @param stats the statistics, sorted for largest first
+/// @param format STATS_FORMAT_JSON or STATS_FORMAT_CSV
+/// @param writer where to write them
+/// @return TRUE if everything was written, FALSE if not
+BOOL writeBinStats(const BinStats* stats,
+                   DWORD format,
+                   ReportWriter* writer)
+{
+    const wchar_t* ageNames[STATS_AGE_BUCKETS] = { L"today", L"week", L"month", L"older" };
+    BOOL json = (format == STATS_FORMAT_JSON);
+    if (json)
+    {
+        writeReportText(writer, "{\n  \"items\": ");
+        writeReportNumber(writer, stats->total.items);
+        writeReportText(writer, ",\n  \"bytes\": ");
+        writeReportNumber(writer, stats->total.bytes);
+        writeReportText(writer, ",\n  \"volumes\": ");
+        writeReportNumber(writer, stats->volumes);
+        writeReportText(writer, ",\n  \"unreadable\": ");
+        writeReportNumber(writer, stats->unreadable);
+        writeReportText(writer, ",\n  \"ages\": [");
+    }
+    else
+    {
+        writeReportText(writer, "breakdown,key,items,bytes\n");
+        writeStatsRow(writer, format, "total", L"", &stats->total, TRUE);
+    }
+    for (DWORD i = 0; i < STATS_AGE_BUCKETS; i++)
+    {
+        writeStatsRow(writer, format, "age", ageNames[i], &stats->ages[i], i == 0);
+    }
+
+    // Unused slots are skipped, so this works whether or not it was sorted
+    BOOL first = TRUE;
+    writeReportText(writer, (json) ? "\n  ],\n  \"extensions\": [" : "");
+    for (DWORD i = 0; i < STATS_EXTENSION_SLOTS; i++)
+    {
+        if (stats->extensions[i].extension[0] != 0)
+        {
+            writeStatsRow(writer, format, "extension", stats->extensions[i].extension,
+                          &stats->extensions[i].totals, first);
+            first = FALSE;
+        }
+    }
+    if (stats->otherExtensions.items > 0)
+    {
+        writeStatsRow(writer, format, "extension", STATS_OTHER_KEY, &stats->otherExtensions, first);
+    }
+    first = TRUE;
+    writeReportText(writer, (json) ? "\n  ],\n  \"owners\": [" : "");
+    for (DWORD i = 0; i < STATS_OWNER_SLOTS; i++)
+    {
+        if (stats->owners[i].sid[0] != 0)
+        {
+            writeStatsRow(writer, format, "owner", stats->owners[i].sid,
+                          &stats->owners[i].totals, first);
+            first = FALSE;
+        }
+    }
+    if (stats->otherOwners.items > 0)
+    {
+        writeStatsRow(writer, format, "owner", STATS_OTHER_KEY, &stats->otherOwners, first);
+    }
+    writeReportText(writer, (json) ? "\n  ]\n}\n" : "");
+    return flushReportWriter(writer);
+}
+
+/// @brief writes one key of a breakdown
+/// @param writer where to write it
+/// @param format STATS_FORMAT_JSON or STATS_FORMAT_CSV
+/// @param breakdown the name of the breakdown, the first column of a CSV row
+/// @param key the key
+/// @param totals the totals for the key
+/// @param first TRUE for the first key of a JSON array
+static void writeStatsRow(ReportWriter* writer,
+                          DWORD format,
+                          const char* breakdown,
+                          const wchar_t* key,
+                          const StatsTotals* totals,
+                          BOOL first)
+{
+    if (format == STATS_FORMAT_CSV)
+    {
+        writeReportText(writer, breakdown);
+        writeReportText(writer, ",");
+        writeReportCsvField(writer, key);
+        writeReportText(writer, ",");
+        writeReportNumber(writer, totals->items);
+        writeReportText(writer, ",");
+        writeReportNumber(writer, totals->bytes);
+        writeReportText(writer, "\n");
+        return;
+    }
+    writeReportText(writer, (first) ? "\n    { \"key\": " : ",\n    { \"key\": ");
+    writeReportJsonString(writer, key);
+    writeReportText(writer, ", \"items\": ");
+    writeReportNumber(writer, totals->items);
+    writeReportText(writer, ", \"bytes\": ");
+    writeReportNumber(writer, totals->bytes);
+    writeReportText(writer, " }");
+}
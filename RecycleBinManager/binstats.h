@@ -0,0 +1,85 @@
+#define _CRT_SECURE_NO_WARNINGS
+
+#pragma once
+#include <Windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <wctype.h>
+#include <assert.h>
+#include "bin.h"
+#include "reportwriter.h"
+
+// Bin statistics parameters. Every item in every user's bin is read once
+// and added to three breakdowns: by the extension of the item's name, by
+// the user it belongs to (the SID folder it is in), and by how long ago it
+// was deleted. Each volume is read on its own thread into its own set of
+// tables, which are merged once all of them are done. The tables are open
+// addressing hash tables of a fixed size, so a bin with millions of items
+// costs no more memory than an empty one: once a table is three quarters
+// full, new keys are added up under "other" instead.
+
+#define STATS_EXTENSION_SLOTS   1024 // Must be a power of two
+#define STATS_EXTENSION_CCH     16 // Longer extensions count as none
+#define STATS_OWNER_SLOTS       256 // Must be a power of two
+#define STATS_FILL_PERCENT      75 // Fullest a table gets before keys go under other
+#define STATS_NO_EXTENSION      L"(none)"
+#define STATS_OTHER_KEY         L"(other)"
+
+// Age buckets, by time since deletion
+#define STATS_AGE_TODAY         0 // Less than a day
+#define STATS_AGE_WEEK          1 // Less than 7 days
+#define STATS_AGE_MONTH         2 // Less than 30 days
+#define STATS_AGE_OLDER         3
+#define STATS_AGE_BUCKETS       4
+
+// Output formats
+#define STATS_FORMAT_JSON       0
+#define STATS_FORMAT_CSV        1
+
+// Structs
+
+typedef struct StatsTotals
+{
+    ULONGLONG items;
+    ULONGLONG bytes;
+} StatsTotals;
+
+typedef struct ExtensionSlot
+{
+    wchar_t extension[STATS_EXTENSION_CCH]; // Lower case with the dot, empty if unused
+    StatsTotals totals;
+} ExtensionSlot;
+
+typedef struct OwnerSlot
+{
+    wchar_t sid[BIN_SID_MAX_CCH]; // Empty if unused
+    StatsTotals totals;
+} OwnerSlot;
+
+typedef struct BinStats
+{
+    ULONGLONG now; // FILETIME ages are measured from
+    StatsTotals total;
+    StatsTotals ages[STATS_AGE_BUCKETS];
+    ExtensionSlot extensions[STATS_EXTENSION_SLOTS]; // Packed and largest first once sorted
+    DWORD extensionCount;
+    StatsTotals otherExtensions; // Keys that did not fit in the table
+    OwnerSlot owners[STATS_OWNER_SLOTS]; // Packed and largest first once sorted
+    DWORD ownerCount;
+    StatsTotals otherOwners;
+    DWORD volumes; // Volumes read
+    DWORD unreadable; // User folders that could not be listed
+    BOOL sorted; // The tables are packed and can no longer be added to
+} BinStats;
+
+// Functions
+
+void addStatsItem(BinStats* stats, const wchar_t* sid, const wchar_t* originalPath,
+                  ULONGLONG size, ULONGLONG deletionTime);
+BOOL collectBinStats(BinStats* stats, DWORD maxThreads);
+BOOL collectVolumeStats(BinStats* stats, const wchar_t* recycleBinPath);
+void initBinStats(BinStats* stats, ULONGLONG now);
+void mergeBinStats(BinStats* stats, const BinStats* part);
+void sortBinStats(BinStats* stats);
+void testBinStats(void);
+BOOL writeBinStats(const BinStats* stats, DWORD format, ReportWriter* writer);
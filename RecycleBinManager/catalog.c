@@ -0,0 +1,634 @@
+/*
+* Compact, memory mapped catalog of the items in the Recycle Bin
+*
+* Copyright(C) 2024 ERROR_SUCCESS Software
+*
+* This program is free software : you can redistribute it and /or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.If not, see < https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#include "catalog.h"
+#include "digest.h"
+#include "ini.h"
+#include "logger.h"
+
+static DWORD hashString(const wchar_t* string, size_t length);
+static BOOL internCatalogString(CatalogBuilder* builder, const wchar_t* string,
+                                DWORD* nameOffset);
+static BOOL writeCatalogFile(const CatalogBuilder* builder, const wchar_t* catalogPath);
+
+/// @brief adds an item to a catalog that is being built
+/// @param builder the builder to add the item to
+/// @param size the size of the item in bytes
+/// @param deletionTime the FILETIME the item was deleted, as a 64 bit value
+/// @param volumeId the serial number of the volume the item lives on
+/// @param name the original path of the item
+/// @return TRUE if the item was added, FALSE if memory allocation failed
+BOOL addCatalogItem(CatalogBuilder* builder,
+                    ULONGLONG size,
+                    ULONGLONG deletionTime,
+                    DWORD volumeId,
+                    const wchar_t* name)
+{
+    if (builder->recordCount == builder->recordCapacity)
+    {
+        size_t newCapacity = builder->recordCapacity * 2;
+        CatalogRecord* newRecords = HeapReAlloc(GetProcessHeap(),
+                                                0,
+                                                builder->records,
+                                                newCapacity * sizeof(CatalogRecord));
+        if (newRecords == NULL) // Memory allocation failed
+        {
+            return FALSE;
+        }
+        builder->records = newRecords;
+        builder->recordCapacity = newCapacity;
+    }
+
+    CatalogRecord* record = &builder->records[builder->recordCount];
+    if (internCatalogString(builder,
+                            name,
+                            &record->nameOffset) == FALSE)
+    {
+        return FALSE;
+    }
+    record->size = size;
+    record->deletionTime = deletionTime;
+    record->volumeId = volumeId;
+    builder->recordCount++;
+
+    // Keep the summary statistics up to date as we go
+    builder->totalBytes += size;
+    if ((builder->oldestDeletionTime == 0) || (deletionTime < builder->oldestDeletionTime))
+    {
+        builder->oldestDeletionTime = deletionTime;
+    }
+    if (deletionTime > builder->newestDeletionTime)
+    {
+        builder->newestDeletionTime = deletionTime;
+    }
+    return TRUE;
+}
+
+/// @brief scans the Recycle Bin and writes a fresh catalog, reading every
+/// $I file, along with the digests that let it be reconciled later
+/// @param catalogPath the full path of the catalog file to write
+/// @return TRUE if the catalog was written, FALSE if not
+BOOL buildCatalog(const wchar_t* catalogPath)
+{
+    CatalogReconcile result = { 0 };
+    return reconcileCatalog(catalogPath,
+                            TRUE,
+                            &result);
+}
+
+/// @brief unmaps and closes a catalog opened with openCatalog()
+/// @param catalog the catalog to close
+void closeCatalog(Catalog* catalog)
+{
+    if (catalog->view != NULL)
+    {
+        UnmapViewOfFile(catalog->view);
+    }
+    if (catalog->hMapping != NULL)
+    {
+        CloseHandle(catalog->hMapping);
+    }
+    if ((catalog->hFile != NULL) && (catalog->hFile != INVALID_HANDLE_VALUE))
+    {
+        CloseHandle(catalog->hFile);
+    }
+    ZeroMemory(catalog,
+               sizeof(Catalog));
+}
+
+/// @brief frees the memory held by a CatalogBuilder
+/// @param builder the builder to free
+void freeCatalogBuilder(CatalogBuilder* builder)
+{
+    HANDLE hHeap = GetProcessHeap();
+    if (builder->records != NULL)
+    {
+        HeapFree(hHeap, 0, builder->records);
+    }
+    if (builder->pool != NULL)
+    {
+        HeapFree(hHeap, 0, builder->pool);
+    }
+    if (builder->hashSlots != NULL)
+    {
+        HeapFree(hHeap, 0, builder->hashSlots);
+    }
+    ZeroMemory(builder,
+               sizeof(CatalogBuilder));
+}
+
+/// @brief gets the path of the catalog file in local appdata
+/// @param catalogPath receives the full path to the catalog
+/// @param cchCatalogPath the size of catalogPath in characters
+/// @return TRUE if the path fits in the buffer, FALSE if not
+BOOL getCatalogPath(wchar_t* catalogPath,
+                    size_t cchCatalogPath)
+{
+    return getAppDataFilePath(CATALOG_FILENAME,
+                              catalogPath,
+                              cchCatalogPath);
+}
+
+/// @brief looks up a string in the catalog's string pool
+/// @param catalog an open catalog
+/// @param nameOffset the byte offset of the string within the pool
+/// @return the string, or NULL if the offset is out of range
+const wchar_t* getCatalogString(const Catalog* catalog,
+                                DWORD nameOffset)
+{
+    if ((nameOffset >= catalog->header->stringPoolSize) ||
+        (nameOffset % sizeof(wchar_t) != 0))
+    {
+        return NULL;
+    }
+    return (const wchar_t*) (catalog->stringPool + nameOffset);
+}
+
+/// @brief 32 bit FNV-1a hash of a wide string
+static DWORD hashString(const wchar_t* string,
+                        size_t length)
+{
+    DWORD hash = 2166136261u;
+    for (size_t i = 0; i < length; i++)
+    {
+        hash ^= (DWORD) string[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/// @brief prepares an empty CatalogBuilder
+/// @param builder the builder to initialize
+/// @return TRUE on success, FALSE if memory allocation failed
+BOOL initCatalogBuilder(CatalogBuilder* builder)
+{
+    HANDLE hHeap = GetProcessHeap();
+    ZeroMemory(builder,
+               sizeof(CatalogBuilder));
+    builder->records = HeapAlloc(hHeap,
+                                 0,
+                                 CATALOG_INITIAL_RECORDS * sizeof(CatalogRecord));
+    builder->pool = HeapAlloc(hHeap,
+                              0,
+                              CATALOG_INITIAL_POOL * sizeof(wchar_t));
+    builder->hashSlots = HeapAlloc(hHeap,
+                                   HEAP_ZERO_MEMORY,
+                                   CATALOG_INITIAL_HASH * sizeof(DWORD));
+    if ((builder->records == NULL) ||
+        (builder->pool == NULL) ||
+        (builder->hashSlots == NULL)) // Memory allocation failed
+    {
+        freeCatalogBuilder(builder);
+        return FALSE;
+    }
+    builder->recordCapacity = CATALOG_INITIAL_RECORDS;
+    builder->poolCapacity = CATALOG_INITIAL_POOL;
+    builder->hashCapacity = CATALOG_INITIAL_HASH;
+    return TRUE;
+}
+
+/// @brief adds a string to the pool unless an identical string is already
+/// there, using an open addressing hash table of pool offsets
+/// @param builder the builder that owns the pool
+/// @param string the string to intern
+/// @param nameOffset receives the byte offset of the string in the pool
+/// @return TRUE on success, FALSE if memory allocation failed
+static BOOL internCatalogString(CatalogBuilder* builder,
+                                const wchar_t* string,
+                                DWORD* nameOffset)
+{
+    HANDLE hHeap = GetProcessHeap();
+    size_t length = wcslen(string);
+
+    // Grow the hash table before it gets more than half full
+    if ((builder->hashCount + 1) * 2 > builder->hashCapacity)
+    {
+        size_t newCapacity = builder->hashCapacity * 2;
+        DWORD* newSlots = HeapAlloc(hHeap,
+                                    HEAP_ZERO_MEMORY,
+                                    newCapacity * sizeof(DWORD));
+        if (newSlots == NULL) // Memory allocation failed
+        {
+            return FALSE;
+        }
+        for (size_t i = 0; i < builder->hashCapacity; i++)
+        {
+            DWORD slot = builder->hashSlots[i];
+            if (slot == 0)
+            {
+                continue;
+            }
+            const wchar_t* existing = builder->pool + (slot - 1);
+            size_t index = hashString(existing, wcslen(existing)) & (newCapacity - 1);
+            while (newSlots[index] != 0)
+            {
+                index = (index + 1) & (newCapacity - 1);
+            }
+            newSlots[index] = slot;
+        }
+        HeapFree(hHeap, 0, builder->hashSlots);
+        builder->hashSlots = newSlots;
+        builder->hashCapacity = newCapacity;
+    }
+
+    // Look for an existing copy of the string
+    size_t index = hashString(string, length) & (builder->hashCapacity - 1);
+    while (builder->hashSlots[index] != 0)
+    {
+        const wchar_t* existing = builder->pool + (builder->hashSlots[index] - 1);
+        if (wcscmp(existing, string) == 0)
+        {
+            *nameOffset = (builder->hashSlots[index] - 1) * sizeof(wchar_t);
+            return TRUE;
+        }
+        index = (index + 1) & (builder->hashCapacity - 1);
+    }
+
+    // Not found, append it to the pool
+    if (builder->poolLength + length + 1 > builder->poolCapacity)
+    {
+        size_t newCapacity = builder->poolCapacity * 2;
+        while (builder->poolLength + length + 1 > newCapacity)
+        {
+            newCapacity *= 2;
+        }
+        if (newCapacity * sizeof(wchar_t) > MAXDWORD) // Offsets must fit in a DWORD
+        {
+            return FALSE;
+        }
+        wchar_t* newPool = HeapReAlloc(hHeap,
+                                       0,
+                                       builder->pool,
+                                       newCapacity * sizeof(wchar_t));
+        if (newPool == NULL) // Memory allocation failed
+        {
+            return FALSE;
+        }
+        builder->pool = newPool;
+        builder->poolCapacity = newCapacity;
+    }
+    size_t offset = builder->poolLength;
+    memcpy(builder->pool + offset,
+           string,
+           (length + 1) * sizeof(wchar_t));
+    builder->poolLength += length + 1;
+    builder->hashSlots[index] = (DWORD) offset + 1;
+    builder->hashCount++;
+    *nameOffset = (DWORD) (offset * sizeof(wchar_t));
+    return TRUE;
+}
+
+/// @brief maps a catalog file into memory and validates its layout. Nothing
+/// is parsed or copied, the records and strings are read in place.
+/// @param catalogPath the full path to the catalog file
+/// @param catalog receives the mapped catalog, close it with closeCatalog()
+/// @return TRUE if the catalog was opened and is valid, FALSE if not
+BOOL openCatalog(const wchar_t* catalogPath,
+                 Catalog* catalog)
+{
+    ZeroMemory(catalog,
+               sizeof(Catalog));
+    catalog->hFile = CreateFileW(catalogPath,
+                                 GENERIC_READ,
+                                 FILE_SHARE_READ | FILE_SHARE_DELETE,
+                                 NULL,
+                                 OPEN_EXISTING,
+                                 FILE_ATTRIBUTE_NORMAL,
+                                 NULL);
+    if (catalog->hFile == INVALID_HANDLE_VALUE)
+    {
+        return FALSE;
+    }
+
+    LARGE_INTEGER fileSize = { 0 };
+    if ((GetFileSizeEx(catalog->hFile, &fileSize) == FALSE) ||
+        (fileSize.QuadPart < (LONGLONG) sizeof(CatalogHeader)))
+    {
+        LOG(L"Catalog %s is too small\n",
+            catalogPath);
+        closeCatalog(catalog);
+        return FALSE;
+    }
+    catalog->viewSize = (ULONGLONG) fileSize.QuadPart;
+    catalog->hMapping = CreateFileMappingW(catalog->hFile,
+                                           NULL,
+                                           PAGE_READONLY,
+                                           0,
+                                           0,
+                                           NULL);
+    if (catalog->hMapping == NULL)
+    {
+        closeCatalog(catalog);
+        return FALSE;
+    }
+    catalog->view = MapViewOfFile(catalog->hMapping,
+                                  FILE_MAP_READ,
+                                  0,
+                                  0,
+                                  0);
+    if (catalog->view == NULL)
+    {
+        closeCatalog(catalog);
+        return FALSE;
+    }
+
+    // Validate the header before trusting any of the offsets in it
+    const CatalogHeader* header = (const CatalogHeader*) catalog->view;
+    ULONGLONG recordsEnd = header->recordsOffset +
+        (header->itemCount * sizeof(CatalogRecord));
+    ULONGLONG poolEnd = header->stringPoolOffset + header->stringPoolSize;
+    if ((header->magic != CATALOG_MAGIC) ||
+        (header->version != CATALOG_VERSION) ||
+        (header->headerSize != sizeof(CatalogHeader)) ||
+        (header->recordSize != sizeof(CatalogRecord)) ||
+        (header->recordsOffset < sizeof(CatalogHeader)) ||
+        (header->recordsOffset > catalog->viewSize) ||
+        (header->stringPoolOffset > catalog->viewSize) ||
+        (header->stringPoolSize > catalog->viewSize) ||
+        (header->recordsOffset % sizeof(ULONGLONG) != 0) ||
+        (header->itemCount > catalog->viewSize / sizeof(CatalogRecord)) ||
+        (recordsEnd > header->stringPoolOffset) ||
+        (poolEnd > catalog->viewSize) ||
+        (header->stringPoolSize % sizeof(wchar_t) != 0))
+    {
+        LOG(L"Catalog %s is corrupt or from another version\n",
+            catalogPath);
+        closeCatalog(catalog);
+        return FALSE;
+    }
+
+    // Every string must be terminated, which the last character guarantees
+    catalog->stringPool = catalog->view + header->stringPoolOffset;
+    if ((header->stringPoolSize > 0) &&
+        (((const wchar_t*) (catalog->stringPool + header->stringPoolSize))[-1] != 0))
+    {
+        LOG(L"Catalog %s has an unterminated string pool\n",
+            catalogPath);
+        closeCatalog(catalog);
+        return FALSE;
+    }
+    catalog->header = header;
+    catalog->records = (const CatalogRecord*) (catalog->view + header->recordsOffset);
+    return TRUE;
+}
+
+/// @brief reads only the summary statistics from a catalog file. The header
+/// lives in the first page of the file, so this costs a single page of I/O.
+/// @param catalogPath the full path to the catalog file
+/// @param header receives a copy of the header
+/// @return TRUE if the catalog exists and is valid, FALSE if not
+BOOL readCatalogHeader(const wchar_t* catalogPath,
+                       CatalogHeader* header)
+{
+    Catalog catalog = { 0 };
+    if (openCatalog(catalogPath, &catalog) == FALSE)
+    {
+        return FALSE;
+    }
+    *header = *catalog.header;
+    closeCatalog(&catalog);
+    return TRUE;
+}
+
+/// @brief builds a catalog in a temporary file and checks it can be read
+/// back in a debug build, returns immediately in a release build
+/// @param none
+void testCatalog(void)
+{
+#ifndef NDEBUG
+    wchar_t tempDirectory[MAX_PATH + 1] = { 0 };
+    wchar_t catalogPath[MAX_PATH + 1] = { 0 };
+    GetTempPathW(ARRAYSIZE(tempDirectory),
+                 tempDirectory);
+    UINT tempResult = GetTempFileNameW(tempDirectory,
+                                       L"rbm",
+                                       0,
+                                       catalogPath);
+    assert(tempResult != 0);
+
+    // Two items share a path, so the pool should only hold two strings
+    CatalogBuilder builder = { 0 };
+    BOOL result = initCatalogBuilder(&builder);
+    assert(result);
+    result = addCatalogItem(&builder, 100, 3000, 1, L"C:\\a.txt") &&
+        addCatalogItem(&builder, 200, 1000, 1, L"C:\\b.txt") &&
+        addCatalogItem(&builder, 300, 2000, 2, L"C:\\a.txt");
+    assert(result);
+    assert(builder.poolLength == 2 * (wcslen(L"C:\\a.txt") + 1));
+
+    // Force a few hash table and pool resizes
+    for (int i = 0; i < 2000; i++)
+    {
+        wchar_t name[32] = { 0 };
+        _snwprintf(name,
+                   ARRAYSIZE(name),
+                   L"D:\\file%d",
+                   i % 1000);
+        result = addCatalogItem(&builder, 1, 5000, 3, name);
+        assert(result);
+    }
+    result = writeCatalog(&builder,
+                          catalogPath);
+    assert(result);
+    freeCatalogBuilder(&builder);
+
+    Catalog catalog = { 0 };
+    result = openCatalog(catalogPath,
+                         &catalog);
+    assert(result);
+    assert(catalog.header->itemCount == 2003);
+    assert(catalog.header->totalBytes == 2600);
+    assert(catalog.header->oldestDeletionTime == 1000);
+    assert(catalog.header->newestDeletionTime == 5000);
+    assert(catalog.records[0].nameOffset == catalog.records[2].nameOffset);
+    assert(catalog.records[3].nameOffset == catalog.records[1003].nameOffset);
+    assert(wcscmp(getCatalogString(&catalog, catalog.records[1].nameOffset),
+                  L"C:\\b.txt") == 0);
+    assert(wcscmp(getCatalogString(&catalog, catalog.records[2002].nameOffset),
+                  L"D:\\file999") == 0);
+    assert(getCatalogString(&catalog, (DWORD) catalog.header->stringPoolSize) == NULL);
+    closeCatalog(&catalog);
+
+    // A file with the wrong magic number is rejected
+    HANDLE hFile = CreateFileW(catalogPath,
+                               GENERIC_WRITE,
+                               0,
+                               NULL,
+                               OPEN_EXISTING,
+                               FILE_ATTRIBUTE_NORMAL,
+                               NULL);
+    assert(hFile != INVALID_HANDLE_VALUE);
+    DWORD badMagic = 0;
+    DWORD bytesWritten = 0;
+    WriteFile(hFile,
+              &badMagic,
+              sizeof(badMagic),
+              &bytesWritten,
+              NULL);
+    CloseHandle(hFile);
+    assert(openCatalog(catalogPath, &catalog) == FALSE);
+    DeleteFileW(catalogPath);
+#endif
+}
+
+/// @brief writes a catalog to disk. The catalog is written to a temporary
+/// file first and then renamed over the old one, so readers never see a
+/// partially written catalog. Writers take turns under CATALOG_LOCK_NAME.
+/// @param builder the builder holding the catalog contents
+/// @param catalogPath the full path of the catalog file to write
+/// @return TRUE if the catalog was written, FALSE if not
+BOOL writeCatalog(const CatalogBuilder* builder,
+                  const wchar_t* catalogPath)
+{
+    HANDLE hLock = CreateMutexW(NULL,
+                                FALSE,
+                                CATALOG_LOCK_NAME);
+    if (hLock == NULL)
+    {
+        LOG(L"Failed to create the catalog lock, error code %d\n",
+            GetLastError());
+        return FALSE;
+    }
+
+    // An abandoned lock only leaves a temporary file behind, which is
+    // written over
+    DWORD wait = WaitForSingleObject(hLock,
+                                     CATALOG_LOCK_TIMEOUT_MS);
+    if ((wait != WAIT_OBJECT_0) && (wait != WAIT_ABANDONED))
+    {
+        LOG(L"Gave up waiting for another process to write %s\n",
+            catalogPath);
+        CloseHandle(hLock);
+        return FALSE;
+    }
+    BOOL result = writeCatalogFile(builder,
+                                   catalogPath);
+    ReleaseMutex(hLock);
+    CloseHandle(hLock);
+    return result;
+}
+
+/// @brief writes a catalog to its temporary file, flushes it and renames it
+/// over the old one, for writeCatalog(), which holds the catalog lock
+/// @param builder the builder holding the catalog contents
+/// @param catalogPath the full path of the catalog file to write
+/// @return TRUE if the catalog was written, FALSE if not
+static BOOL writeCatalogFile(const CatalogBuilder* builder,
+                             const wchar_t* catalogPath)
+{
+    wchar_t tempPath[MAX_PATH + 1] = { 0 };
+    int written = _snwprintf(tempPath,
+                             ARRAYSIZE(tempPath),
+                             L"%s.tmp",
+                             catalogPath);
+    tempPath[MAX_PATH] = 0;
+    if ((written < 0) || (written > MAX_PATH))
+    {
+        return FALSE;
+    }
+
+    CatalogHeader header = { 0 };
+    header.magic = CATALOG_MAGIC;
+    header.version = CATALOG_VERSION;
+    header.headerSize = sizeof(CatalogHeader);
+    header.recordSize = sizeof(CatalogRecord);
+    header.itemCount = builder->recordCount;
+    header.totalBytes = builder->totalBytes;
+    header.oldestDeletionTime = builder->oldestDeletionTime;
+    header.newestDeletionTime = builder->newestDeletionTime;
+    header.recordsOffset = sizeof(CatalogHeader);
+    header.stringPoolOffset = header.recordsOffset +
+        (builder->recordCount * sizeof(CatalogRecord));
+    header.stringPoolSize = builder->poolLength * sizeof(wchar_t);
+
+    HANDLE hFile = CreateFileW(tempPath,
+                               GENERIC_WRITE,
+                               0,
+                               NULL,
+                               CREATE_ALWAYS,
+                               FILE_ATTRIBUTE_NORMAL,
+                               NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+    {
+        LOG(L"Failed to create catalog %s, error code %d\n",
+            tempPath,
+            GetLastError());
+        return FALSE;
+    }
+
+    DWORD bytesWritten = 0;
+    BOOL result = WriteFile(hFile,
+                            &header,
+                            sizeof(header),
+                            &bytesWritten,
+                            NULL);
+    if (result && (builder->recordCount > 0))
+    {
+        result = WriteFile(hFile,
+                           builder->records,
+                           (DWORD) (builder->recordCount * sizeof(CatalogRecord)),
+                           &bytesWritten,
+                           NULL);
+    }
+    if (result && (builder->poolLength > 0))
+    {
+        result = WriteFile(hFile,
+                           builder->pool,
+                           (DWORD) (builder->poolLength * sizeof(wchar_t)),
+                           &bytesWritten,
+                           NULL);
+    }
+
+    // It must be on disk before it replaces the catalog, or a crash could
+    // leave an empty catalog behind
+    result = result && FlushFileBuffers(hFile);
+    CloseHandle(hFile);
+    if (result == FALSE)
+    {
+        LOG(L"Failed to write catalog %s\n",
+            tempPath);
+        DeleteFileW(tempPath);
+        return FALSE;
+    }
+
+    // A reader only keeps the catalog mapped for as long as it reads it
+    for (DWORD attempt = 0; ; attempt++)
+    {
+        if (MoveFileExW(tempPath,
+                        catalogPath,
+                        MOVEFILE_REPLACE_EXISTING))
+        {
+            return TRUE;
+        }
+        DWORD error = GetLastError();
+        if (((error != ERROR_ACCESS_DENIED) &&
+             (error != ERROR_SHARING_VIOLATION) &&
+             (error != ERROR_USER_MAPPED_FILE)) ||
+            (attempt + 1 >= CATALOG_REPLACE_RETRIES))
+        {
+            LOG(L"Failed to replace catalog %s, error code %d\n",
+                catalogPath,
+                error);
+            DeleteFileW(tempPath);
+            return FALSE;
+        }
+        Sleep(CATALOG_REPLACE_DELAY_MS);
+    }
+}
@@ -0,0 +1,94 @@
+#define _CRT_SECURE_NO_WARNINGS
+
+#pragma once
+#include <Windows.h>
+#include <stdio.h>
+#include <assert.h>
+
+// Catalog file format. The file is a header, followed by an array of fixed
+// width records, followed by a pool of null terminated UTF-16 strings. Each
+// distinct string is only stored once. The header carries the summary
+// statistics so they can be read without touching the records at all.
+// Bump CATALOG_VERSION whenever the layout of either struct changes.
+// Writers take a named lock, so only one at a time uses the temporary
+// file, and flush it before it is renamed over the catalog. A reader that
+// has the old catalog mapped blocks the rename, so it is retried for a
+// while before the write gives up and leaves the old catalog in place.
+
+#define CATALOG_FILENAME        L"Catalog.bin"
+#define CATALOG_MAGIC           0x43424D52 // "RMBC" when read as bytes
+#define CATALOG_VERSION         1
+#define CATALOG_INITIAL_RECORDS 256
+#define CATALOG_INITIAL_POOL    4096 // In characters
+#define CATALOG_INITIAL_HASH    512 // Must be a power of two
+#define CATALOG_LOCK_NAME       L"Local\\RecycleBinManagerCatalog" // Held while the catalog is written
+#define CATALOG_LOCK_TIMEOUT_MS 10000
+#define CATALOG_REPLACE_RETRIES 40 // Renames tried while a reader has the catalog mapped
+#define CATALOG_REPLACE_DELAY_MS 50
+
+// Structs
+
+typedef struct CatalogHeader
+{
+    DWORD magic; // Always CATALOG_MAGIC
+    DWORD version; // Always CATALOG_VERSION
+    DWORD headerSize; // sizeof(CatalogHeader)
+    DWORD recordSize; // sizeof(CatalogRecord)
+    ULONGLONG itemCount; // Number of records
+    ULONGLONG totalBytes; // Sum of the size of every record
+    ULONGLONG oldestDeletionTime; // 0 if there are no records
+    ULONGLONG newestDeletionTime; // 0 if there are no records
+    ULONGLONG recordsOffset; // Byte offset of the first record
+    ULONGLONG stringPoolOffset; // Byte offset of the string pool
+    ULONGLONG stringPoolSize; // Size of the string pool in bytes
+} CatalogHeader;
+
+typedef struct CatalogRecord
+{
+    ULONGLONG size; // Size of the item in bytes
+    ULONGLONG deletionTime; // FILETIME of the deletion, as a 64 bit value
+    DWORD volumeId; // Serial number of the volume the item lives on
+    DWORD nameOffset; // Byte offset of the original path in the string pool
+} CatalogRecord;
+
+typedef struct Catalog
+{
+    HANDLE hFile;
+    HANDLE hMapping;
+    const BYTE* view; // The mapped file, read in place
+    ULONGLONG viewSize;
+    const CatalogHeader* header;
+    const CatalogRecord* records;
+    const BYTE* stringPool;
+} Catalog;
+
+typedef struct CatalogBuilder
+{
+    CatalogRecord* records;
+    size_t recordCount;
+    size_t recordCapacity;
+    wchar_t* pool;
+    size_t poolLength; // In characters, including terminators
+    size_t poolCapacity; // In characters
+    DWORD* hashSlots; // Pool offset + 1 of each interned string, 0 if empty
+    size_t hashCapacity;
+    size_t hashCount;
+    ULONGLONG totalBytes;
+    ULONGLONG oldestDeletionTime;
+    ULONGLONG newestDeletionTime;
+} CatalogBuilder;
+
+// Functions
+
+BOOL addCatalogItem(CatalogBuilder* builder, ULONGLONG size, ULONGLONG deletionTime,
+                    DWORD volumeId, const wchar_t* name);
+BOOL buildCatalog(const wchar_t* catalogPath);
+void closeCatalog(Catalog* catalog);
+void freeCatalogBuilder(CatalogBuilder* builder);
+BOOL getCatalogPath(wchar_t* catalogPath, size_t cchCatalogPath);
+const wchar_t* getCatalogString(const Catalog* catalog, DWORD nameOffset);
+BOOL initCatalogBuilder(CatalogBuilder* builder);
+BOOL openCatalog(const wchar_t* catalogPath, Catalog* catalog);
+BOOL readCatalogHeader(const wchar_t* catalogPath, CatalogHeader* header);
+void testCatalog(void);
+BOOL writeCatalog(const CatalogBuilder* builder, const wchar_t* catalogPath);
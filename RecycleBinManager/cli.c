@@ -0,0 +1,1773 @@
+/*
+* Command line interface for scripting Recycle Bin Manager
+*
+* Copyright(C) 2024 ERROR_SUCCESS Software
+*
+* This program is free software : you can redistribute it and /or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.If not, see < https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#include "cli.h"
+#include "archive.h"
+#include "audit.h"
+#include "benchsuite.h"
+#include "binbackend.h"
+#include "bincheck.h"
+#include "binstate.h"
+#include "binstats.h"
+#include "catalog.h"
+#include "digest.h"
+#include "dirtree.h"
+#include "estimate.h"
+#include "exclusions.h"
+#include "growth.h"
+#include "maintenance.h"
+#include "parallel.h"
+#include "pathstore.h"
+#include "reclaim.h"
+#include "replay.h"
+#include "scheduler.h"
+#include "secure.h"
+#include "throttle.h"
+#include "topitems.h"
+#include "trash.h"
+#include "userbins.h"
+#include "watermark.h"
+#include "logger.h"
+
+static void getBenchFolder(int argc, wchar_t** argv, wchar_t* folder, size_t cchFolder);
+
+// Every command the program understands. Add new commands here.
+static const CliEntry cliCommands[] =
+{
+    { CLI_COMMAND_AUDIT_LOG, auditLogCommand },
+    { CLI_COMMAND_BENCH_ARCHIVE, benchArchiveCommand },
+    { CLI_COMMAND_BENCH_BIN, benchBinCommand },
+    { CLI_COMMAND_BENCH_PATHS, benchPathsCommand },
+    { CLI_COMMAND_BENCH_RULES, benchRulesCommand },
+    { CLI_COMMAND_BENCH_SECURE, benchSecureCommand },
+    { CLI_COMMAND_BENCH_SUITE, benchSuiteCommand },
+    { CLI_COMMAND_BIN_STATE, binStateCommand },
+    { CLI_COMMAND_BIN_STATS, binStatsCommand },
+    { CLI_COMMAND_CHECK_BIN, checkBinCommand },
+    { CLI_COMMAND_DUMP_CATALOG, dumpCatalogCommand },
+    { CLI_COMMAND_ESTIMATE, estimateCommand },
+    { CLI_COMMAND_EXTRACT_ARCHIVE, extractArchiveCommand },
+    { CLI_COMMAND_LIST_ARCHIVE, listArchiveCommand },
+    { CLI_COMMAND_MAINTAIN, maintainCommand },
+    { CLI_COMMAND_RECLAIM, reclaimCommand },
+    { CLI_COMMAND_RECONCILE, reconcileCommand },
+    { CLI_COMMAND_RECORD_EVENTS, recordEventsCommand },
+    { CLI_COMMAND_REPLAY_EVENTS, replayEventsCommand },
+    { CLI_COMMAND_SCHEDULE, scheduleCommand },
+    { CLI_COMMAND_SECURE_EMPTY, secureEmptyCommand },
+    { CLI_COMMAND_SELF_TEST, selfTestCommand },
+    { CLI_COMMAND_STRESS_STATE, stressStateCommand },
+    { CLI_COMMAND_TOP_ITEMS, topItemsCommand },
+    { CLI_COMMAND_TRASH, trashCommand },
+    { CLI_COMMAND_TRASH_LIST, trashListCommand },
+    { CLI_COMMAND_UNDO_EMPTY, undoEmptyCommand },
+    { CLI_COMMAND_USER_BINS, userBinsCommand },
+};
+
+/// @brief lists the events in the audit log within a time range, oldest
+/// first
+/// @param argc the number of arguments
+/// @param argv the arguments, both optional: argv[1] is the earliest time
+/// and argv[2] the latest, as YYYY-MM-DD[THH:MM[:SS]] in UTC like the output
+/// @return 0 on success, 1 if a time is not valid or the log could not be read
+int auditLogCommand(int argc,
+                    wchar_t** argv)
+{
+    wchar_t folder[MAX_PATH + 1] = { 0 };
+    ULONGLONG from = 0;
+    ULONGLONG to = MAXULONGLONG;
+    if (((argc > 1) && (parseFileTime(argv[1], FALSE, &from) == FALSE)) ||
+        ((argc > 2) && (parseFileTime(argv[2], TRUE, &to) == FALSE)))
+    {
+        writeOutput(L"Usage: %s [from [to]], as YYYY-MM-DD[THH:MM[:SS]] in UTC\n",
+                    CLI_COMMAND_AUDIT_LOG);
+        return 1;
+    }
+    if ((getAuditFolder(folder, ARRAYSIZE(folder)) == FALSE) ||
+        (queryAuditLog(folder, from, to, writeAuditEvent, NULL) == FALSE))
+    {
+        writeOutput(L"The audit log could not be read\n");
+        return 1;
+    }
+    return 0;
+}
+
+/// @brief archives and extracts synthetic files and reports the throughput
+/// and the compression ratio
+/// @param argc the number of arguments
+/// @param argv the arguments, all optional: argv[1] is the folder to work
+/// in, argv[2] the megabytes to archive and argv[3] the most compression
+/// workers
+/// @return 0 on success, 1 if the benchmark could not run or the files
+///         that came out differ from those that went in
+int benchArchiveCommand(int argc,
+                        wchar_t** argv)
+{
+    wchar_t folder[MAX_PATH + 1] = { 0 };
+    getBenchFolder(argc,
+                   argv,
+                   folder,
+                   ARRAYSIZE(folder));
+    DWORD megabytes = (argc > 2) ? wcstoul(argv[2], NULL, 10) : ARCHIVE_BENCH_MEGABYTES;
+    DWORD threads = (argc > 3) ? wcstoul(argv[3], NULL, 10) : getDefaultThreadCount();
+    ArchiveBenchmark result = { 0 };
+    if (benchmarkArchive(folder,
+                         max(megabytes, 1),
+                         threads,
+                         &result) == FALSE)
+    {
+        writeOutput(L"The archive benchmark failed\n");
+        return 1;
+    }
+    double megabytesIn = (double) result.rawBytes / 1048576.0;
+    writeOutput(L"files              %llu\n"
+                L"bytes              %llu\n"
+                L"archived bytes     %llu\n"
+                L"ratio              %.2f\n"
+                L"archive MB/s       %.1f\n"
+                L"extract MB/s       %.1f\n"
+                L"threads            %u\n"
+                L"verified           %s\n",
+                result.files,
+                result.rawBytes,
+                result.storedBytes,
+                (result.storedBytes == 0) ? 0.0 : (double) result.rawBytes / (double) result.storedBytes,
+                (result.archiveSeconds <= 0.0) ? 0.0 : megabytesIn / result.archiveSeconds,
+                (result.extractSeconds <= 0.0) ? 0.0 : megabytesIn / result.extractSeconds,
+                max(threads, 1),
+                (result.verified) ? L"yes" : L"no");
+    return (result.verified) ? 0 : 1;
+}
+
+/// @brief times filling, querying and emptying a bin held in memory
+/// @param argc the number of arguments
+/// @param argv the arguments, argv[1] is an optional number of items and
+/// argv[2] an optional number of deletes per million that fail
+/// @return 0 on success, 1 if the benchmark could not run
+int benchBinCommand(int argc,
+                    wchar_t** argv)
+{
+    ULONGLONG items = (argc > 1) ? wcstoull(argv[1], NULL, 10) : BIN_BACKEND_DEFAULT_BENCH_ITEMS;
+    DWORD failures = (argc > 2) ? wcstoul(argv[2], NULL, 10) : 0;
+    BinBackendBenchmark result = { 0 };
+    if (benchmarkBinBackend(items,
+                            failures,
+                            &result) == FALSE)
+    {
+        writeOutput(L"The bin backend benchmark failed\n");
+        return 1;
+    }
+    writeOutput(L"items              %llu\n"
+                L"failures/million   %u\n"
+                L"ns per add         %.1f\n"
+                L"ns per query       %.1f\n"
+                L"empty ms           %.1f\n"
+                L"items per second   %.0f\n"
+                L"left after empty   %llu\n"
+                L"retries            %u\n"
+                L"notifications      %llu\n",
+                result.items,
+                result.deleteFailuresPerMillion,
+                result.nanosecondsPerAdd,
+                result.nanosecondsPerQuery,
+                result.emptyMilliseconds,
+                result.itemsPerSecond,
+                result.left,
+                result.retries,
+                result.notifications);
+    return 0;
+}
+
+/// @brief reports the memory used per entry and the lookup latency of
+/// the path store
+/// @param argc the number of arguments
+/// @param argv the arguments, argv[1] is an optional number of entries
+/// @return 0 on success, 1 if the benchmark could not run
+int benchPathsCommand(int argc,
+                      wchar_t** argv)
+{
+    DWORD entries = (argc > 1) ? wcstoul(argv[1], NULL, 10) : CLI_DEFAULT_BENCH_PATHS;
+    PathStoreBenchmark result = { 0 };
+    if (benchmarkPathStore(entries,
+                           &result) == FALSE)
+    {
+        writeOutput(L"The path store benchmark failed\n");
+        return 1;
+    }
+    writeOutput(L"entries          %u\n"
+                L"bytes per entry  %.1f\n"
+                L"as plain strings %.1f\n"
+                L"ns per lookup    %.1f\n",
+                result.entries,
+                result.bytesPerEntry,
+                result.rawBytesPerEntry,
+                result.nanosecondsPerLookup);
+    return 0;
+}
+
+/// @brief reports how fast paths are checked against the exclusion rules
+/// @param argc the number of arguments
+/// @param argv the arguments, argv[1] is an optional number of rules and
+/// argv[2] an optional number of paths
+/// @return 0 on success, 1 if the benchmark could not run
+int benchRulesCommand(int argc,
+                      wchar_t** argv)
+{
+    DWORD rules = (argc > 1) ? wcstoul(argv[1], NULL, 10) : EXCLUSION_DEFAULT_BENCH_RULES;
+    DWORD paths = (argc > 2) ? wcstoul(argv[2], NULL, 10) : EXCLUSION_DEFAULT_BENCH_PATHS;
+    ExclusionBenchmark result = { 0 };
+    if (benchmarkExclusionRules(rules,
+                                paths,
+                                &result) == FALSE)
+    {
+        writeOutput(L"The exclusion rule benchmark failed\n");
+        return 1;
+    }
+    writeOutput(L"rules              %u\n"
+                L"paths              %u\n"
+                L"matches            %u\n"
+                L"dfa states         %u\n"
+                L"cache flushes      %u\n"
+                L"warm up ms         %.1f\n"
+                L"ns per path        %.1f\n"
+                L"MB per second      %.1f\n"
+                L"ns per path naive  %.1f\n",
+                result.rules,
+                result.paths,
+                result.matches,
+                result.states,
+                result.flushes,
+                result.warmupMilliseconds,
+                result.nanosecondsPerPath,
+                result.megabytesPerSecond,
+                result.naiveNanosecondsPerPath);
+    return 0;
+}
+
+/// @brief erases synthetic files and reports the throughput next to that
+/// of deleting the same files without erasing them
+/// @param argc the number of arguments
+/// @param argv the arguments, all optional: argv[1] is the folder to work
+/// in, argv[2] the megabytes to erase and argv[3] the most files erased at
+/// once
+/// @return 0 on success, 1 if the benchmark could not run or an erased
+///         file did not read back as zeros
+int benchSecureCommand(int argc,
+                       wchar_t** argv)
+{
+    wchar_t folder[MAX_PATH + 1] = { 0 };
+    getBenchFolder(argc,
+                   argv,
+                   folder,
+                   ARRAYSIZE(folder));
+    DWORD megabytes = (argc > 2) ? wcstoul(argv[2], NULL, 10) : SECURE_BENCH_MEGABYTES;
+    DWORD threads = (argc > 3) ? wcstoul(argv[3], NULL, 10) : getDefaultThreadCount();
+    SecureBenchmark result = { 0 };
+    if (benchmarkSecureErase(folder,
+                             max(megabytes, 1),
+                             threads,
+                             &result) == FALSE)
+    {
+        writeOutput(L"The secure erase benchmark failed\n");
+        return 1;
+    }
+    double megabytesErased = (double) result.bytes / 1048576.0;
+    writeOutput(L"files              %llu\n"
+                L"bytes              %llu\n"
+                L"erase MB/s         %.1f\n"
+                L"erase files/s      %.0f\n"
+                L"delete files/s     %.0f\n"
+                L"threads            %u\n"
+                L"queue depth        %u\n"
+                L"verified           %s\n",
+                result.files,
+                result.bytes,
+                (result.eraseSeconds <= 0.0) ? 0.0 : megabytesErased / result.eraseSeconds,
+                (result.eraseSeconds <= 0.0) ? 0.0 : (double) result.files / result.eraseSeconds,
+                (result.deleteSeconds <= 0.0) ? 0.0 : (double) result.files / result.deleteSeconds,
+                max(threads, 1),
+                SECURE_QUEUE_DEPTH,
+                (result.verified) ? L"yes" : L"no");
+    return (result.verified) ? 0 : 1;
+}
+
+/// @brief generates a bin folder, times every operation on it and prints
+/// the results as JSON so runs of different releases can be compared
+/// @param argc the number of arguments
+/// @param argv the arguments, all optional: argv[1] is the folder to work
+/// in, argv[2] the number of items, argv[3] the median file size in KB,
+/// argv[4] the deepest folder item and argv[5] the days deletions are
+/// spread over
+/// @return 0 on success, 1 if the benchmark could not run
+int benchSuiteCommand(int argc,
+                      wchar_t** argv)
+{
+    wchar_t folder[MAX_PATH + 1] = { 0 };
+    getBenchFolder(argc,
+                   argv,
+                   folder,
+                   ARRAYSIZE(folder));
+    TrashSpec spec = { 0 };
+    initTrashSpec(&spec);
+    if (argc > 2)
+    {
+        spec.items = wcstoul(argv[2], NULL, 10);
+    }
+    if (argc > 3)
+    {
+        spec.medianBytes = wcstoull(argv[3], NULL, 10) * 1024;
+    }
+    if (argc > 4)
+    {
+        spec.depth = wcstoul(argv[4], NULL, 10);
+    }
+    if (argc > 5)
+    {
+        spec.spreadDays = wcstoul(argv[5], NULL, 10);
+    }
+
+    BenchSuiteResult result = { 0 };
+    if (runBenchSuite(folder,
+                      &spec,
+                      &result) == FALSE)
+    {
+        writeOutput(L"{ \"error\": \"the benchmark bin could not be generated\" }\n");
+        return 1;
+    }
+    writeOutput(L"{\n"
+                L"  \"items\": %u,\n"
+                L"  \"medianBytes\": %llu,\n"
+                L"  \"depth\": %u,\n"
+                L"  \"spreadDays\": %u,\n"
+                L"  \"seed\": %llu,\n"
+                L"  \"files\": %llu,\n"
+                L"  \"folders\": %llu,\n"
+                L"  \"bytes\": %llu,\n"
+                L"  \"consistent\": %s,\n"
+                L"  \"phases\": {\n",
+                result.spec.items,
+                result.spec.medianBytes,
+                result.spec.depth,
+                result.spec.spreadDays,
+                result.spec.seed,
+                result.files,
+                result.folders,
+                result.bytes,
+                (result.consistent) ? L"true" : L"false");
+    const struct
+    {
+        const wchar_t* name;
+        const BenchPhase* phase;
+    } phases[] =
+    {
+        { L"generate", &result.generate },
+        { L"parse", &result.parse },
+        { L"query", &result.query },
+        { L"count", &result.count },
+        { L"stage", &result.stage },
+        { L"restore", &result.restore },
+        { L"swap", &result.swap },
+        { L"empty", &result.empty },
+    };
+    for (size_t i = 0; i < ARRAYSIZE(phases); i++)
+    {
+        const BenchPhase* phase = phases[i].phase;
+        double nanosecondsPerItem = (phase->items == 0) ? 0.0 :
+            (phase->milliseconds * 1e6) / (double) phase->items;
+        writeOutput(L"    \"%s\": { \"items\": %llu, \"ms\": %.3f, \"nsPerItem\": %.1f }%s\n",
+                    phases[i].name,
+                    phase->items,
+                    phase->milliseconds,
+                    nanosecondsPerItem,
+                    (i + 1 < ARRAYSIZE(phases)) ? L"," : L"");
+    }
+    writeOutput(L"  }\n"
+                L"}\n");
+    return (result.consistent) ? 0 : 1;
+}
+
+/// @brief prints the bin state published by the running instance, the way
+/// any other process can read it
+/// @param argc unused
+/// @param argv unused
+/// @return 0 on success, 1 if no instance is publishing
+int binStateCommand(int argc,
+                    wchar_t** argv)
+{
+    UNREFERENCED_PARAMETER(argc);
+    UNREFERENCED_PARAMETER(argv);
+    BinStateView view = { 0 };
+    if (openBinStateReader(NULL,
+                           &view) == FALSE)
+    {
+        writeOutput(L"No running instance is publishing the bin state\n");
+        return 1;
+    }
+    BinStateSnapshot snapshot = { 0 };
+    BOOL result = readBinState(&view,
+                               &snapshot);
+    closeBinStateView(&view);
+    if (result == FALSE)
+    {
+        writeOutput(L"The bin state could not be read\n");
+        return 1;
+    }
+    wchar_t lastChange[64] = { 0 };
+    formatFileTime(snapshot.lastChange,
+                   lastChange,
+                   ARRAYSIZE(lastChange));
+    writeOutput(L"items        %llu\n"
+                L"bytes        %llu\n"
+                L"generation   %llu\n"
+                L"last change  %s\n"
+                L"publisher    %u\n",
+                snapshot.items,
+                snapshot.bytes,
+                snapshot.generation,
+                lastChange,
+                snapshot.publisherProcessId);
+    return 0;
+}
+
+/// @brief breaks every user's bin on every volume down by extension, by
+/// owner and by age
+/// @param argc the number of arguments
+/// @param argv the arguments, argv[1] is an optional format, json (the
+/// default) or csv
+/// @return 0 on success, 1 if the bins could not be read or written out
+int binStatsCommand(int argc,
+                    wchar_t** argv)
+{
+    DWORD format = STATS_FORMAT_JSON;
+    if (argc > 1)
+    {
+        if (_wcsicmp(argv[1], L"csv") == 0)
+        {
+            format = STATS_FORMAT_CSV;
+        }
+        else if (_wcsicmp(argv[1], L"json") != 0)
+        {
+            writeOutput(L"Usage: %s [json|csv]\n",
+                        CLI_COMMAND_BIN_STATS);
+            return 1;
+        }
+    }
+    HANDLE hOutput = getOutputHandle();
+    if (hOutput == NULL)
+    {
+        return 1;
+    }
+
+    // Both are too large for the stack
+    BinStats* stats = HeapAlloc(GetProcessHeap(),
+                                0,
+                                sizeof(BinStats));
+    ReportWriter* writer = HeapAlloc(GetProcessHeap(),
+                                     0,
+                                     sizeof(ReportWriter));
+    BOOL result = ((stats != NULL) && (writer != NULL)); // Memory allocation failed
+    if (result)
+    {
+        initBinStats(stats,
+                     getCurrentFileTime());
+        result = collectBinStats(stats,
+                                 0);
+        sortBinStats(stats);
+        initReportWriter(writer,
+                         hOutput);
+        result = writeBinStats(stats,
+                               format,
+                               writer) && result;
+    }
+    if (stats != NULL)
+    {
+        HeapFree(GetProcessHeap(),
+                 0,
+                 stats);
+    }
+    if (writer != NULL)
+    {
+        HeapFree(GetProcessHeap(),
+                 0,
+                 writer);
+    }
+    return (result) ? 0 : 1;
+}
+
+/// @brief checks every bin for $I files with no $R item and $R items with
+/// no $I file, and for a catalog that no longer matches
+/// @param argc the number of arguments
+/// @param argv the arguments, argv[1] is an optional mode: report (the
+/// default) changes nothing, repair deletes orphaned $I files and
+/// quarantines orphaned $R items, delete deletes orphans on both sides
+/// @return 0 if no orphans are left, 1 if some are or a bin could not be
+/// checked
+int checkBinCommand(int argc,
+                    wchar_t** argv)
+{
+    BinCheckOptions options = { 0 };
+    initBinCheckOptions(&options);
+    if (argc > 1)
+    {
+        if (_wcsicmp(argv[1], L"repair") == 0)
+        {
+            options.mode = CHECK_REPAIR;
+        }
+        else if (_wcsicmp(argv[1], L"delete") == 0)
+        {
+            options.mode = CHECK_DELETE;
+        }
+        else if (_wcsicmp(argv[1], L"report") != 0)
+        {
+            writeOutput(L"Usage: %s [report|repair|delete]\n",
+                        CLI_COMMAND_CHECK_BIN);
+            return 1;
+        }
+    }
+    BinCheckResult result = { 0 };
+    BOOL complete = checkBin(&options,
+                             &result);
+    writeOutput(L"$I files           %llu\n"
+                L"$R items           %llu\n"
+                L"pairs              %llu\n"
+                L"orphaned $I        %llu\n"
+                L"orphaned $R        %llu (%llu bytes)\n"
+                L"repaired $I        %llu\n"
+                L"repaired $R        %llu\n"
+                L"skipped            %llu\n"
+                L"failed             %llu\n"
+                L"stale temp $I      %llu (%llu deleted)\n"
+                L"runs spilled       %llu\n"
+                L"catalog            %s\n"
+                L"time               %.1f ms\n",
+                result.infoFiles,
+                result.contentItems,
+                result.pairs,
+                result.orphanedInfo,
+                result.orphanedContent,
+                result.orphanedBytes,
+                result.repairedInfo,
+                result.repairedContent,
+                result.skipped,
+                result.failed,
+                result.staleTemp,
+                result.repairedTemp,
+                result.runs,
+                (result.catalogStale == FALSE) ? L"current" :
+                    (result.catalogRebuilt) ? L"rebuilt" : L"stale",
+                result.milliseconds);
+    if (complete == FALSE)
+    {
+        writeOutput(L"Some bins could not be checked\n");
+    }
+    ULONGLONG remaining = (result.orphanedInfo + result.orphanedContent + result.staleTemp) -
+        (result.repairedInfo + result.repairedContent + result.repairedTemp);
+    return (complete && (remaining == 0)) ? 0 : 1;
+}
+
+/// @brief prints the header and every record of a catalog file
+/// @param argc the number of arguments
+/// @param argv the arguments, argv[1] is an optional path to the catalog.
+/// The catalog in local appdata is used if no path is given.
+/// @return 0 on success, 1 if the catalog cannot be opened
+int dumpCatalogCommand(int argc,
+                       wchar_t** argv)
+{
+    wchar_t catalogPath[MAX_PATH + 1] = { 0 };
+    if (argc > 1)
+    {
+        wcsncpy(catalogPath,
+                argv[1],
+                MAX_PATH);
+    }
+    else if (getCatalogPath(catalogPath,
+                            ARRAYSIZE(catalogPath)) == FALSE)
+    {
+        writeOutput(L"Unable to locate the catalog\n");
+        return 1;
+    }
+
+    Catalog catalog = { 0 };
+    if (openCatalog(catalogPath,
+                    &catalog) == FALSE)
+    {
+        writeOutput(L"%s is not a valid catalog\n",
+                    catalogPath);
+        return 1;
+    }
+
+    const CatalogHeader* header = catalog.header;
+    wchar_t oldest[64] = { 0 };
+    wchar_t newest[64] = { 0 };
+    formatFileTime(header->oldestDeletionTime,
+                   oldest,
+                   ARRAYSIZE(oldest));
+    formatFileTime(header->newestDeletionTime,
+                   newest,
+                   ARRAYSIZE(newest));
+    writeOutput(L"catalog     %s\n"
+                L"version     %u\n"
+                L"items       %llu\n"
+                L"total bytes %llu\n"
+                L"oldest      %s\n"
+                L"newest      %s\n"
+                L"records at  %llu\n"
+                L"strings at  %llu (%llu bytes)\n\n",
+                catalogPath,
+                header->version,
+                header->itemCount,
+                header->totalBytes,
+                oldest,
+                newest,
+                header->recordsOffset,
+                header->stringPoolOffset,
+                header->stringPoolSize);
+
+    for (ULONGLONG i = 0; i < header->itemCount; i++)
+    {
+        const CatalogRecord* record = &catalog.records[i];
+        const wchar_t* name = getCatalogString(&catalog,
+                                               record->nameOffset);
+        wchar_t deleted[64] = { 0 };
+        formatFileTime(record->deletionTime,
+                       deleted,
+                       ARRAYSIZE(deleted));
+        writeOutput(L"%llu\t%llu\t%s\t%08X\t%u\t%s\n",
+                    i,
+                    record->size,
+                    deleted,
+                    record->volumeId,
+                    record->nameOffset,
+                    (name != NULL) ? name : L"<invalid offset>");
+    }
+    closeCatalog(&catalog);
+    return 0;
+}
+
+/// @brief estimates how much there is to delete in the bin and how long
+/// deleting it will take, without listing all of it
+/// @param argc the number of arguments
+/// @param argv the arguments, argv[1] is an optional number of folders to
+/// list. More folders give a closer estimate.
+/// @return 0 on success, 1 if any bin could not be read
+int estimateCommand(int argc,
+                    wchar_t** argv)
+{
+    DWORD budget = ESTIMATE_DEFAULT_BUDGET;
+    if (argc > 1)
+    {
+        budget = wcstoul(argv[1], NULL, 10);
+    }
+    ULONGLONG start = GetTickCount64();
+    TreeEstimate estimate = { 0 };
+    BOOL result = estimateEmptyCost(budget,
+                                    0,
+                                    FALSE,
+                                    &estimate);
+    writeOutput(L"items\t%.0f +/- %.0f\n",
+                estimate.items,
+                estimate.itemsMargin);
+    writeOutput(L"bytes\t%.0f +/- %.0f\n",
+                estimate.bytes,
+                estimate.bytesMargin);
+    writeOutput(L"seconds\t%.1f +/- %.1f\n",
+                estimate.seconds,
+                estimate.secondsMargin);
+    writeOutput(L"%s from %u samples and %u folder listings in %llu ms\n",
+                (estimate.exact) ? L"Exact" : L"Estimated",
+                estimate.samples,
+                estimate.listings,
+                GetTickCount64() - start);
+    if (estimate.unreadable > 0)
+    {
+        writeOutput(L"%u folders could not be read\n",
+                    estimate.unreadable);
+    }
+    return (result) ? 0 : 1;
+}
+
+/// @brief extracts one file or folder from a volume's archive, the newest
+/// copy if it was archived more than once
+/// @param argc the number of arguments
+/// @param argv the arguments: argv[1] is the drive letter of the volume it
+/// was deleted from, argv[2] its original path and argv[3] where to put it,
+/// which must not exist yet
+/// @return 0 on success, 1 if it could not be found or extracted
+int extractArchiveCommand(int argc,
+                          wchar_t** argv)
+{
+    wchar_t folder[MAX_PATH + 1] = { 0 };
+    ArchiveEntry entry = { 0 };
+    if (argc < 4)
+    {
+        writeOutput(L"Usage: %s drive path destination\n",
+                    CLI_COMMAND_EXTRACT_ARCHIVE);
+        return 1;
+    }
+    if ((getArchiveFolder(folder, ARRAYSIZE(folder)) == FALSE) ||
+        (findArchiveEntry(folder, argv[1][0], argv[2], &entry) == FALSE))
+    {
+        writeOutput(L"%s is not in the archive of %c:\n",
+                    argv[2],
+                    towupper(argv[1][0]));
+        return 1;
+    }
+    if (extractArchiveEntry(folder,
+                            argv[1][0],
+                            &entry,
+                            argv[3]) == FALSE)
+    {
+        writeOutput(L"Failed to extract %s to %s, error code %d\n",
+                    argv[2],
+                    argv[3],
+                    GetLastError());
+        return 1;
+    }
+    writeOutput(L"Extracted %s to %s\n",
+                argv[2],
+                argv[3]);
+    return 0;
+}
+
+/// @brief formats a 64 bit FILETIME as an ISO 8601 UTC timestamp
+/// @param fileTime the time to format
+/// @param buffer receives the formatted time
+/// @param cchBuffer the size of buffer in characters
+/// @return TRUE if the time was formatted, FALSE if it is invalid
+BOOL formatFileTime(ULONGLONG fileTime,
+                    wchar_t* buffer,
+                    size_t cchBuffer)
+{
+    FILETIME time = { (DWORD) fileTime, (DWORD) (fileTime >> 32) };
+    SYSTEMTIME systemTime = { 0 };
+    if ((fileTime == 0) ||
+        (FileTimeToSystemTime(&time, &systemTime) == FALSE))
+    {
+        _snwprintf(buffer,
+                   cchBuffer,
+                   L"-");
+        buffer[cchBuffer - 1] = 0;
+        return FALSE;
+    }
+    _snwprintf(buffer,
+               cchBuffer,
+               L"%04u-%02u-%02uT%02u:%02u:%02uZ",
+               systemTime.wYear,
+               systemTime.wMonth,
+               systemTime.wDay,
+               systemTime.wHour,
+               systemTime.wMinute,
+               systemTime.wSecond);
+    buffer[cchBuffer - 1] = 0;
+    return TRUE;
+}
+
+/// @brief finds the folder a benchmark works in: the one named on the
+/// command line, or the temporary folder if none was
+/// @param argc the number of arguments
+/// @param argv the arguments, argv[1] is the optional folder
+/// @param folder receives the folder, without a trailing backslash
+/// @param cchFolder the size of folder in characters
+static void getBenchFolder(int argc,
+                           wchar_t** argv,
+                           wchar_t* folder,
+                           size_t cchFolder)
+{
+    if (argc > 1)
+    {
+        wcsncpy(folder,
+                argv[1],
+                cchFolder - 1);
+        folder[cchFolder - 1] = 0;
+    }
+    else
+    {
+        GetTempPathW((DWORD) cchFolder,
+                     folder);
+    }
+    size_t length = wcslen(folder);
+    if ((length > 0) && (folder[length - 1] == L'\\'))
+    {
+        folder[length - 1] = 0;
+    }
+}
+
+/// @brief gets standard output. We are a windows subsystem program, so if
+/// output is not redirected we attach to the console of whoever started us.
+/// @param none
+/// @return standard output, NULL if there is none
+HANDLE getOutputHandle(void)
+{
+    static HANDLE hOutput = NULL;
+    if (hOutput == NULL)
+    {
+        hOutput = GetStdHandle(STD_OUTPUT_HANDLE);
+        if ((hOutput == NULL) || (hOutput == INVALID_HANDLE_VALUE))
+        {
+            AttachConsole(ATTACH_PARENT_PROCESS);
+            hOutput = GetStdHandle(STD_OUTPUT_HANDLE);
+        }
+    }
+    return (hOutput == INVALID_HANDLE_VALUE) ? NULL : hOutput;
+}
+
+/// @brief starts another copy of this program to run a command in the
+/// background, at idle priority and without a window
+/// @param arguments the switch and any arguments for it
+/// @return TRUE if the process started, FALSE if not
+BOOL launchCommand(const wchar_t* arguments)
+{
+    wchar_t exePath[MAX_PATH + 1] = { 0 };
+    DWORD length = GetModuleFileNameW(NULL,
+                                      exePath,
+                                      ARRAYSIZE(exePath));
+    if ((length == 0) || (length >= ARRAYSIZE(exePath)))
+    {
+        return FALSE;
+    }
+    wchar_t commandLine[MAX_PATH + 64] = { 0 };
+    _snwprintf(commandLine,
+               ARRAYSIZE(commandLine),
+               L"\"%s\" %s",
+               exePath,
+               arguments);
+    commandLine[ARRAYSIZE(commandLine) - 1] = 0;
+
+    STARTUPINFOW startupInfo = { sizeof(startupInfo) };
+    PROCESS_INFORMATION processInfo = { 0 };
+    if (CreateProcessW(exePath,
+                       commandLine,
+                       NULL,
+                       NULL,
+                       FALSE,
+                       IDLE_PRIORITY_CLASS | CREATE_NO_WINDOW,
+                       NULL,
+                       NULL,
+                       &startupInfo,
+                       &processInfo) == FALSE)
+    {
+        LOG(L"Failed to start %s, error code %d\n",
+            arguments,
+            GetLastError());
+        return FALSE;
+    }
+    CloseHandle(processInfo.hThread);
+    CloseHandle(processInfo.hProcess);
+    return TRUE;
+}
+
+/// @brief reads the next non-empty line of UTF-8 text. Lines may end with
+/// CRLF or LF, and a byte order mark at the start is skipped. A line that
+/// is too long for the buffer or for line, or is not UTF-8, is dropped and
+/// counted in reader->skipped.
+/// @param reader the reader, with hInput set and everything else zeroed
+/// @param line receives the line without its line ending
+/// @param cchLine the size of line in characters
+/// @return TRUE if a line was read, FALSE at the end of the input
+BOOL readInputLine(LineReader* reader,
+                   wchar_t* line,
+                   size_t cchLine)
+{
+    for (;;)
+    {
+        // Look for the end of the next line in what we have
+        char* start = reader->buffer + reader->position;
+        DWORD available = reader->length - reader->position;
+        char* end = memchr(start,
+                           '\n',
+                           available);
+        if ((end == NULL) && (reader->endOfInput == FALSE))
+        {
+            BOOL isFirstRead = (reader->length == 0);
+            if ((reader->position == 0) && (available == sizeof(reader->buffer)))
+            {
+                // The line doesn't fit, so skip it
+                LOG(L"Skipping a line longer than %d bytes\n",
+                    sizeof(reader->buffer));
+                reader->skipping = TRUE;
+                available = 0;
+            }
+            memmove(reader->buffer,
+                    start,
+                    available);
+            reader->length = available;
+            reader->position = 0;
+            DWORD bytesRead = 0;
+            if ((ReadFile(reader->hInput,
+                          reader->buffer + reader->length,
+                          sizeof(reader->buffer) - reader->length,
+                          &bytesRead,
+                          NULL) == FALSE) ||
+                (bytesRead == 0))
+            {
+                reader->endOfInput = TRUE;
+            }
+            reader->length += bytesRead;
+            if (isFirstRead &&
+                (reader->length >= 3) &&
+                (memcmp(reader->buffer, "\xEF\xBB\xBF", 3) == 0))
+            {
+                reader->position = 3;
+            }
+            continue;
+        }
+        if ((end == NULL) && (available == 0))
+        {
+            return FALSE;
+        }
+
+        // The last line doesn't need a line ending
+        DWORD lineLength = (end != NULL) ? (DWORD) (end - start) : available;
+        reader->position += lineLength + ((end != NULL) ? 1 : 0);
+        if ((lineLength > 0) && (start[lineLength - 1] == '\r'))
+        {
+            lineLength--;
+        }
+        if (reader->skipping)
+        {
+            reader->skipping = FALSE;
+            reader->skipped++;
+            continue;
+        }
+        if (lineLength == 0)
+        {
+            continue;
+        }
+        int written = MultiByteToWideChar(CP_UTF8,
+                                          0,
+                                          start,
+                                          lineLength,
+                                          line,
+                                          (int) cchLine - 1);
+        if (written <= 0)
+        {
+            LOG(L"Skipping a line that is too long or not UTF-8\n");
+            reader->skipped++;
+            continue;
+        }
+        line[written] = 0;
+        return TRUE;
+    }
+}
+
+/// @brief lists everything in a volume's archive, oldest first
+/// @param argc the number of arguments
+/// @param argv the arguments, argv[1] is the drive letter of the volume
+/// @return 0 on success, 1 if there is no archive for the volume
+int listArchiveCommand(int argc,
+                       wchar_t** argv)
+{
+    wchar_t folder[MAX_PATH + 1] = { 0 };
+    if (argc < 2)
+    {
+        writeOutput(L"Usage: %s drive\n",
+                    CLI_COMMAND_LIST_ARCHIVE);
+        return 1;
+    }
+    if ((getArchiveFolder(folder, ARRAYSIZE(folder)) == FALSE) ||
+        (listArchive(folder, argv[1][0], writeArchiveEntry, NULL) == FALSE))
+    {
+        writeOutput(L"There is no archive for %c:\n",
+                    towupper(argv[1][0]));
+        return 1;
+    }
+    return 0;
+}
+
+/// @brief runs one maintenance job straight away, with the settings in
+/// Settings.ini. The window starts itself with this switch when a job is
+/// due.
+/// @param argc the number of arguments
+/// @param argv the arguments, argv[1] is the name of the job
+/// @return 0 on success, 1 if the job failed or is unknown
+int maintainCommand(int argc,
+                    wchar_t** argv)
+{
+    if (argc < 2)
+    {
+        writeOutput(L"Usage: %s <%s|%s|%s|%s|%s>\n",
+                    argv[0],
+                    MAINTENANCE_JOB_EMPTY,
+                    MAINTENANCE_JOB_PURGE,
+                    MAINTENANCE_JOB_QUOTA,
+                    MAINTENANCE_JOB_WATERMARK,
+                    MAINTENANCE_JOB_COMPACT);
+        return 1;
+    }
+    if (runMaintenanceJob(argv[1]) == FALSE)
+    {
+        writeOutput(L"The %s job failed or does not exist\n",
+                    argv[1]);
+        return 1;
+    }
+    return 0;
+}
+
+/// @brief parses an ISO 8601 UTC time as written by formatFileTime(), to
+/// the second, minute or day
+/// @param text YYYY-MM-DD, YYYY-MM-DDTHH:MM or YYYY-MM-DDTHH:MM:SS, with an
+/// optional trailing Z
+/// @param roundUp TRUE for the last moment of the day, minute or second
+/// given, so it can end a range, FALSE for the first
+/// @param fileTime receives the time as a 64 bit FILETIME
+/// @return TRUE on success, FALSE if text is not a valid time
+BOOL parseFileTime(const wchar_t* text,
+                   BOOL roundUp,
+                   ULONGLONG* fileTime)
+{
+    SYSTEMTIME systemTime = { 0 };
+    wchar_t separator = 0;
+    unsigned int year = 0;
+    unsigned int month = 0;
+    unsigned int day = 0;
+    unsigned int hour = 0;
+    unsigned int minute = 0;
+    unsigned int second = 0;
+    int fields = swscanf(text,
+                         L"%4u-%2u-%2u%lc%2u:%2u:%2u",
+                         &year,
+                         &month,
+                         &day,
+                         &separator,
+                         &hour,
+                         &minute,
+                         &second);
+    if ((fields != 3) && (fields != 6) && (fields != 7))
+    {
+        return FALSE;
+    }
+    if ((fields > 3) && (separator != L'T') && (separator != L't') && (separator != L' '))
+    {
+        return FALSE;
+    }
+    systemTime.wYear = (WORD) year;
+    systemTime.wMonth = (WORD) month;
+    systemTime.wDay = (WORD) day;
+    systemTime.wHour = (WORD) hour;
+    systemTime.wMinute = (WORD) minute;
+    systemTime.wSecond = (WORD) second;
+    FILETIME time = { 0 };
+    if (SystemTimeToFileTime(&systemTime,
+                             &time) == FALSE)
+    {
+        return FALSE;
+    }
+    *fileTime = ((ULONGLONG) time.dwHighDateTime << 32) | time.dwLowDateTime;
+    if (roundUp)
+    {
+        ULONGLONG period = (fields == 3) ? 24ULL * 60 * 60 : (fields == 6) ? 60 : 1;
+        *fileTime += period * FILETIME_PER_SECOND - 1;
+    }
+    return TRUE;
+}
+
+/// @brief frees the space held by instant empties once their reclaim
+/// delay has passed. The program starts itself with this switch in the
+/// background, so there is normally no need to run it by hand.
+/// @param argc unused
+/// @param argv unused
+/// @return 0
+int reclaimCommand(int argc,
+                   wchar_t** argv)
+{
+    UNREFERENCED_PARAMETER(argc);
+    UNREFERENCED_PARAMETER(argv);
+    return runReclaimer();
+}
+
+/// @brief brings the catalog up to date with the bin and reports how much
+/// of the bin had to be listed and read to do it
+/// @param argc the number of arguments
+/// @param argv the arguments, argv[1] is an optional "full" to read every
+/// item again
+/// @return 0 on success, 1 if the catalog could not be written
+int reconcileCommand(int argc,
+                     wchar_t** argv)
+{
+    wchar_t catalogPath[MAX_PATH + 1] = { 0 };
+    if (getCatalogPath(catalogPath,
+                       ARRAYSIZE(catalogPath)) == FALSE)
+    {
+        writeOutput(L"Unable to locate the catalog\n");
+        return 1;
+    }
+    BOOL full = ((argc > 1) && (_wcsicmp(argv[1], L"full") == 0));
+    CatalogReconcile result = { 0 };
+    if (reconcileCatalog(catalogPath,
+                         full,
+                         &result) == FALSE)
+    {
+        writeOutput(L"The catalog could not be written\n");
+        return 1;
+    }
+    writeOutput(L"bin folders  %u (%u listed)\n"
+                L"items listed %llu\n"
+                L"buckets read %u\n"
+                L"items read   %llu\n"
+                L"items kept   %llu\n"
+                L"catalog      %s\n"
+                L"time         %.1f ms\n",
+                result.folders,
+                result.foldersListed,
+                result.itemsListed,
+                result.bucketsRead,
+                result.itemsRead,
+                result.itemsCopied,
+                (result.rewritten) ? L"rewritten" : L"already up to date",
+                result.milliseconds);
+    return 0;
+}
+
+/// @brief records every bin notification, with when it arrived and what the
+/// bin held after it, for replaying with /replayevents
+/// @param argc the number of arguments
+/// @param argv the arguments, argv[1] is the file to record to and argv[2]
+/// an optional number of seconds to listen for
+/// @return 0 on success, 1 if nothing could be recorded
+int recordEventsCommand(int argc,
+                        wchar_t** argv)
+{
+    if (argc < 2)
+    {
+        writeOutput(L"Usage: %s <file> [seconds]\n",
+                    CLI_COMMAND_RECORD_EVENTS);
+        return 1;
+    }
+    DWORD seconds = (argc > 2) ? wcstoul(argv[2], NULL, 10) : REPLAY_DEFAULT_SECONDS;
+    writeOutput(L"Recording bin notifications for %u seconds\n",
+                seconds);
+    ULONGLONG notifications = 0;
+    if (recordNotifications(argv[1],
+                            seconds,
+                            &notifications) == FALSE)
+    {
+        writeOutput(L"Unable to record to %s\n",
+                    argv[1]);
+        return 1;
+    }
+    writeOutput(L"Recorded %llu notification%s\n",
+                notifications,
+                (notifications == 1) ? L"" : L"s");
+    return 0;
+}
+
+/// @brief replays a recording from /recordevents against the refresh path
+/// and reports how it coped
+/// @param argc the number of arguments
+/// @param argv the arguments, argv[1] is the recording, argv[2] an optional
+/// speed (1 for real time, 0 for as fast as possible) and argv[3] an
+/// optional refresh policy (0 for a refresh per notification, 1 to
+/// coalesce the queued ones)
+/// @return 0 on success, 1 if the recording could not be read
+int replayEventsCommand(int argc,
+                        wchar_t** argv)
+{
+    if (argc < 2)
+    {
+        writeOutput(L"Usage: %s <file> [speed [policy]]\n",
+                    CLI_COMMAND_REPLAY_EVENTS);
+        return 1;
+    }
+    ReplaySession session = { 0 };
+    if (loadReplaySession(argv[1],
+                          &session) == FALSE)
+    {
+        writeOutput(L"%s is not a notification recording\n",
+                    argv[1]);
+        return 1;
+    }
+    ReplayOptions options = { 0 };
+    initReplayOptions(&options);
+    if (argc > 2)
+    {
+        options.speed = _wtof(argv[2]);
+    }
+    if (argc > 3)
+    {
+        options.policy = (wcstoul(argv[3], NULL, 10) == 0) ?
+            REFRESH_EACH_NOTIFICATION : REFRESH_COALESCE_QUEUED;
+    }
+    ReplayResult result = { 0 };
+    replaySession(&session,
+                  &options,
+                  &result);
+    freeReplaySession(&session);
+    writeOutput(L"notifications        %llu\n"
+                L"refreshes            %llu\n"
+                L"redundant queries    %llu\n"
+                L"most queued          %llu\n"
+                L"mean lag ms          %.1f\n"
+                L"consistent after ms  %.1f\n"
+                L"drained after ms     %.1f\n"
+                L"replay ms            %.1f\n"
+                L"wall ms              %.1f\n",
+                result.notifications,
+                result.refreshes,
+                result.redundantQueries,
+                result.maxQueued,
+                result.meanLagMicroseconds / 1000.0,
+                (double) result.consistentMicroseconds / 1000.0,
+                (double) result.drainedMicroseconds / 1000.0,
+                (double) result.durationMicroseconds / 1000.0,
+                result.wallMilliseconds);
+    return 0;
+}
+
+/// @brief runs the command given on the command line, if there is one
+/// @param handled receives TRUE if a command was run, FALSE if the
+/// program should show its dialog box as usual
+/// @return the exit code of the command
+int runCommandLine(BOOL* handled)
+{
+    *handled = FALSE;
+    int argc = 0;
+    wchar_t** argv = CommandLineToArgvW(GetCommandLineW(),
+                                        &argc);
+    if ((argv == NULL) || (argc < 2))
+    {
+        LocalFree(argv);
+        return 0;
+    }
+
+    // argv[0] is the program itself, so commands start at argv[1]
+    int exitCode = 0;
+    for (size_t i = 0; i < ARRAYSIZE(cliCommands); i++)
+    {
+        if (_wcsicmp(argv[1], cliCommands[i].name) == 0)
+        {
+            *handled = TRUE;
+            exitCode = cliCommands[i].command(argc - 1,
+                                              argv + 1);
+            break;
+        }
+    }
+    if (*handled == FALSE)
+    {
+        *handled = TRUE;
+        writeOutput(L"Unknown command %s. Valid commands are:\n",
+                    argv[1]);
+        for (size_t i = 0; i < ARRAYSIZE(cliCommands); i++)
+        {
+            writeOutput(L"  %s\n",
+                        cliCommands[i].name);
+        }
+        exitCode = 1;
+    }
+    LocalFree(argv);
+    return exitCode;
+}
+
+/// @brief runs the maintenance scheduled in Settings.ini until the
+/// process is ended, for machines where the window is not left open
+/// @param argc unused
+/// @param argv unused
+/// @return does not return while there is maintenance to run. Once the
+///         scheduler gives up this says why and returns 1.
+int scheduleCommand(int argc,
+                    wchar_t** argv)
+{
+    UNREFERENCED_PARAMETER(argc);
+    UNREFERENCED_PARAMETER(argv);
+    int result = runMaintenanceScheduler();
+    writeOutput(L"No maintenance is scheduled in Settings.ini, or the scheduler could not start\n");
+    return result;
+}
+
+/// @brief overwrites every file in the current user's bins with zeros and
+/// deletes them, whether or not SecureEmpty is set
+/// @param argc unused
+/// @param argv unused
+/// @return 0 if the bins were erased, 1 if anything was left in them
+int secureEmptyCommand(int argc,
+                       wchar_t** argv)
+{
+    UNREFERENCED_PARAMETER(argc);
+    UNREFERENCED_PARAMETER(argv);
+    ULONGLONG files = 0;
+    ULONGLONG bytes = 0;
+    BOOL result = secureEmptyBin(&files,
+                                 &bytes,
+                                 NULL);
+    writeOutput(L"Erased %llu file%s, %llu bytes\n",
+                files,
+                (files == 1) ? L"" : L"s",
+                bytes);
+    if (result == FALSE)
+    {
+        writeOutput(L"Some items could not be erased and were left in the bin\n");
+    }
+    return (result) ? 0 : 1;
+}
+
+/// @brief runs the built in self tests
+/// @param argc unused
+/// @param argv unused
+/// @return 0, a failing test stops the program with an assertion
+int selfTestCommand(int argc,
+                    wchar_t** argv)
+{
+    UNREFERENCED_PARAMETER(argc);
+    UNREFERENCED_PARAMETER(argv);
+#ifdef NDEBUG
+    writeOutput(L"Self tests are only available in a debug build\n");
+#else
+    testArchive();
+    testAudit();
+    testBenchSuite();
+    testBinBackend();
+    testBinCheck();
+    testBinState();
+    testBinStats();
+    testCatalog();
+    testCatalogDigests();
+    testDirTree();
+    testEstimate();
+    testExclusionRules();
+    testGrowth();
+    testMaintenance();
+    testPathStore();
+    testReclaim();
+    testReplay();
+    testReportWriter();
+    testScheduler();
+    testSecureErase();
+    testThrottle();
+    testTopItems();
+    testTrashPut();
+    testUserBins();
+    testWatermarks();
+    writeOutput(L"All self tests passed\n");
+#endif
+    return 0;
+}
+
+/// @brief runs concurrent readers against a publisher writing the shared
+/// bin state as fast as it can, and reports read latency and any torn reads
+/// @param argc the number of arguments
+/// @param argv the arguments, argv[1] is an optional number of readers and
+/// argv[2] an optional number of milliseconds to run for
+/// @return 0 if every snapshot was whole, 1 if not or the test could not run
+int stressStateCommand(int argc,
+                       wchar_t** argv)
+{
+    DWORD readers = (argc > 1) ? wcstoul(argv[1], NULL, 10) : BINSTATE_DEFAULT_READERS;
+    DWORD milliseconds = (argc > 2) ? wcstoul(argv[2], NULL, 10) : BINSTATE_DEFAULT_STRESS_MS;
+    BinStateStress result = { 0 };
+    if (stressBinState(readers,
+                       milliseconds,
+                       &result) == FALSE)
+    {
+        writeOutput(L"The shared state stress test could not run\n");
+        return 1;
+    }
+    writeOutput(L"readers          %u\n"
+                L"writes           %llu\n"
+                L"reads            %llu\n"
+                L"ns per read      %.1f\n"
+                L"retries          %llu\n"
+                L"gave up          %llu\n"
+                L"torn             %llu\n"
+                L"went backwards   %llu\n",
+                result.readers,
+                result.writes,
+                result.reads,
+                result.nanosecondsPerRead,
+                result.retries,
+                result.failures,
+                result.torn,
+                result.backwards);
+    return ((result.torn == 0) && (result.backwards == 0)) ? 0 : 1;
+}
+
+/// @brief prints the largest or oldest items in the bin as JSON. Only that
+/// many items are ever held in memory, however large the bin is.
+/// @param argc the number of arguments
+/// @param argv the arguments, both optional: argv[1] is how many items to
+/// list and argv[2] is size (the default) or age
+/// @return 0 on success, 1 if the bin could not be read
+int topItemsCommand(int argc,
+                    wchar_t** argv)
+{
+    DWORD count = (argc > 1) ? wcstoul(argv[1], NULL, 10) : TOP_ITEMS_DEFAULT_COUNT;
+    DWORD order = TOP_ITEMS_BY_SIZE;
+    if ((argc > 2) && (_wcsicmp(argv[2], L"age") == 0))
+    {
+        order = TOP_ITEMS_BY_AGE;
+    }
+    else if ((argc > 2) && (_wcsicmp(argv[2], L"size") != 0))
+    {
+        count = 0;
+    }
+    if ((count == 0) || (count > TOP_ITEMS_MAX_COUNT))
+    {
+        writeOutput(L"Usage: %s [count [size|age]], count from 1 to %u\n",
+                    CLI_COMMAND_TOP_ITEMS,
+                    TOP_ITEMS_MAX_COUNT);
+        return 1;
+    }
+
+    TopItems top = { 0 };
+    ULONGLONG start = getThrottleClock();
+    if ((initTopItems(&top, count, order) == FALSE) ||
+        (findTopItems(&top) == FALSE))
+    {
+        writeOutput(L"{ \"error\": \"the bin could not be read\" }\n");
+        freeTopItems(&top);
+        return 1;
+    }
+    sortTopItems(&top);
+    writeOutput(L"{\n"
+                L"  \"order\": \"%s\",\n"
+                L"  \"scanned\": %llu,\n"
+                L"  \"measured\": %llu,\n"
+                L"  \"ms\": %.3f,\n"
+                L"  \"items\": [\n",
+                (order == TOP_ITEMS_BY_AGE) ? L"age" : L"size",
+                top.scanned,
+                top.measured,
+                (getThrottleClock() - start) / 1000.0);
+    for (DWORD i = 0; i < top.count; i++)
+    {
+        wchar_t deleted[64] = { 0 };
+        formatFileTime(top.items[i].deletionTime,
+                       deleted,
+                       ARRAYSIZE(deleted));
+        writeOutput(L"    { \"bytes\": %llu, \"deleted\": \"%s\", \"path\": ",
+                    top.items[i].size,
+                    deleted);
+        writeJsonString(top.items[i].originalPath);
+        writeOutput(L" }%s\n",
+                    (i + 1 < top.count) ? L"," : L"");
+    }
+    writeOutput(L"  ]\n"
+                L"}\n");
+    freeTopItems(&top);
+    return 0;
+}
+
+/// @brief moves each path given on the command line into the Recycle Bin
+/// @param argc the number of arguments
+/// @param argv the arguments, argv[1] onwards are the paths to move
+/// @return the number of paths that could not be moved
+int trashCommand(int argc,
+                 wchar_t** argv)
+{
+    if (argc < 2)
+    {
+        writeOutput(L"Usage: %s <path> [path...]\n",
+                    CLI_COMMAND_TRASH);
+        return 1;
+    }
+    int failures = 0;
+    for (int i = 1; i < argc; i++)
+    {
+        if (trashPut(argv[i],
+                     NULL) == FALSE)
+        {
+            writeOutput(L"Failed to move %s to the Recycle Bin, error code %d\n",
+                        argv[i],
+                        GetLastError());
+            failures++;
+        }
+    }
+    return failures;
+}
+
+/// @brief moves every path listed in a file into the Recycle Bin, in
+/// batches that each share a single flush, and reports the throughput
+/// @param argc the number of arguments
+/// @param argv the arguments, argv[1] is a UTF-8 file with one path per
+/// line, or - to read the list from standard input
+/// @return the number of paths that could not be moved, 1 if the list
+/// cannot be read
+int trashListCommand(int argc,
+                     wchar_t** argv)
+{
+    if (argc < 2)
+    {
+        writeOutput(L"Usage: %s <file|%s>\n",
+                    CLI_COMMAND_TRASH_LIST,
+                    CLI_STDIN_NAME);
+        return 1;
+    }
+    LineReader* reader = HeapAlloc(GetProcessHeap(),
+                                   HEAP_ZERO_MEMORY,
+                                   sizeof(LineReader));
+    if (reader == NULL) // Memory allocation failed
+    {
+        return 1;
+    }
+    BOOL isStdin = (wcscmp(argv[1], CLI_STDIN_NAME) == 0);
+    reader->hInput = (isStdin) ? GetStdHandle(STD_INPUT_HANDLE) :
+        CreateFileW(argv[1],
+                    GENERIC_READ,
+                    FILE_SHARE_READ,
+                    NULL,
+                    OPEN_EXISTING,
+                    FILE_FLAG_SEQUENTIAL_SCAN,
+                    NULL);
+    TrashBulk bulk = { 0 };
+    if ((reader->hInput == NULL) ||
+        (reader->hInput == INVALID_HANDLE_VALUE) ||
+        (initTrashBulk(&bulk) == FALSE))
+    {
+        writeOutput(L"Unable to read %s\n",
+                    argv[1]);
+        if ((isStdin == FALSE) && (reader->hInput != INVALID_HANDLE_VALUE))
+        {
+            CloseHandle(reader->hInput);
+        }
+        HeapFree(GetProcessHeap(),
+                 0,
+                 reader);
+        return 1;
+    }
+
+    wchar_t path[MAX_PATH + 1] = { 0 };
+    while (readInputLine(reader,
+                         path,
+                         ARRAYSIZE(path)))
+    {
+        addTrashBulkPath(&bulk,
+                         path);
+    }
+
+    // A line that could not be read is a path that was never trashed
+    bulk.failed += reader->skipped;
+    TrashBulkStats stats = { 0 };
+    finishTrashBulk(&bulk,
+                    &stats);
+    if (isStdin == FALSE)
+    {
+        CloseHandle(reader->hInput);
+    }
+    HeapFree(GetProcessHeap(),
+             0,
+             reader);
+
+    writeOutput(L"moved        %llu\n"
+                L"failed       %llu\n"
+                L"seconds      %.3f\n"
+                L"items/second %.0f\n",
+                stats.succeeded,
+                stats.failed,
+                stats.seconds,
+                (stats.seconds > 0) ? (double) stats.succeeded / stats.seconds : 0.0);
+    return (stats.failed > MAXLONG) ? MAXLONG : (int) stats.failed;
+}
+
+/// @brief moves every item of an instant empty that has not been
+/// reclaimed yet back into the Recycle Bin
+/// @param argc unused
+/// @param argv unused
+/// @return 0 if every item was restored, 1 if not
+int undoEmptyCommand(int argc,
+                     wchar_t** argv)
+{
+    UNREFERENCED_PARAMETER(argc);
+    UNREFERENCED_PARAMETER(argv);
+    ULONGLONG restored = 0;
+    BOOL result = undoEmpty(&restored);
+    writeOutput(L"Restored %llu item%s\n",
+                restored,
+                (restored == 1) ? L"" : L"s");
+    return (result) ? 0 : 1;
+}
+
+/// @brief reports the bin of every user on the machine, largest first, and
+/// optionally purges them. Other users' bins can only be read when elevated.
+/// @param argc the number of arguments
+/// @param argv the arguments, argv[1] is an optional age in days to purge
+/// items older than and argv[2] an optional quota in megabytes per user.
+/// 0 turns either off.
+/// @return 0 on success, 1 if an argument is too large, the scan failed or
+///         anything could not be purged
+int userBinsCommand(int argc,
+                    wchar_t** argv)
+{
+    ULONGLONG days = (argc > 1) ? wcstoull(argv[1], NULL, 10) : 0;
+    ULONGLONG megabytes = (argc > 2) ? wcstoull(argv[2], NULL, 10) : 0;
+
+    // Check before multiplying, as a wrapped age or quota would purge far
+    // more than was asked for
+    if ((days > MAXULONGLONG / (SECONDS_PER_DAY * FILETIME_PER_SECOND)) ||
+        (megabytes > MAXULONGLONG / 1048576))
+    {
+        writeOutput(L"Usage: %s [days [megabytes]], 0 turns either off\n",
+                    CLI_COMMAND_USER_BINS);
+        return 1;
+    }
+
+    ULONGLONG cutoff = 0;
+    if (days > 0)
+    {
+        ULONGLONG age = days * SECONDS_PER_DAY * FILETIME_PER_SECOND;
+        ULONGLONG now = getCurrentFileTime();
+        cutoff = (now > age) ? now - age : 0;
+    }
+
+    UserBinReport report = { 0 };
+    if ((discoverUserBins(&report) == FALSE) ||
+        (scanUserBins(&report,
+                      0,
+                      cutoff,
+                      megabytes * 1048576) == FALSE))
+    {
+        writeOutput(L"Scanning the bins failed\n");
+        freeUserBinReport(&report);
+        return 1;
+    }
+
+    writeOutput(L"account\titems\tbytes\toldest\tpurged\tbytes freed\n");
+    ULONGLONG items = 0;
+    ULONGLONG bytes = 0;
+    ULONGLONG failed = 0;
+    ULONGLONG protectedCount = 0;
+    DWORD unreadable = 0;
+    for (DWORD i = 0; i < report.userCount; i++)
+    {
+        const UserBinTotals* user = &report.users[i];
+        wchar_t oldest[64] = L"-";
+        if (user->oldest != 0)
+        {
+            formatFileTime(user->oldest,
+                           oldest,
+                           ARRAYSIZE(oldest));
+        }
+        writeOutput(L"%s\t%llu\t%llu\t%s\t%llu\t%llu\n",
+                    user->account,
+                    user->count,
+                    user->bytes,
+                    oldest,
+                    user->purge.purged,
+                    user->purge.bytesFreed);
+        items += user->count;
+        bytes += user->bytes;
+        failed += user->purge.failed;
+        protectedCount += user->purge.protectedCount;
+        unreadable += user->unreadable;
+    }
+    writeOutput(L"%u users, %llu items, %llu bytes\n",
+                report.userCount,
+                items,
+                bytes);
+    if (unreadable > 0)
+    {
+        writeOutput(L"%u bin folders could not be read, run as administrator to include them\n",
+                    unreadable);
+    }
+    if (protectedCount > 0)
+    {
+        writeOutput(L"%llu items were kept by the [Protect] rules\n",
+                    protectedCount);
+    }
+    if (failed > 0)
+    {
+        writeOutput(L"%llu items could not be purged\n",
+                    failed);
+    }
+    freeUserBinReport(&report);
+    return (failed > 0) ? 1 : 0;
+}
+
+/// @brief writes a string to standard output as a quoted JSON string.
+/// It goes out in pieces, so it can be longer than the output buffer.
+/// @param value the string
+void writeJsonString(const wchar_t* value)
+{
+    wchar_t buffer[256] = { 0 };
+    size_t length = 0;
+    buffer[length++] = L'"';
+    for (const wchar_t* character = value; ; character++)
+    {
+        // Leave room for the longest escape, the closing quote and a terminator
+        if ((length + 8 > ARRAYSIZE(buffer)) || (*character == 0))
+        {
+            if (*character == 0)
+            {
+                buffer[length++] = L'"';
+            }
+            buffer[length] = 0;
+            writeOutput(L"%s",
+                        buffer);
+            length = 0;
+            if (*character == 0)
+            {
+                return;
+            }
+        }
+        if ((*character == L'"') || (*character == L'\\'))
+        {
+            buffer[length++] = L'\\';
+            buffer[length++] = *character;
+        }
+        else if (*character < 0x20)
+        {
+            length += _snwprintf(buffer + length,
+                                 ARRAYSIZE(buffer) - length,
+                                 L"\\u%04x",
+                                 (unsigned int) *character);
+        }
+        else
+        {
+            buffer[length++] = *character;
+        }
+    }
+}
+
+/// @brief writes formatted text to standard output as UTF-8
+/// @param format a printf style format string
+/// @param ... the format arguments
+void writeOutput(const wchar_t* format,
+                 ...)
+{
+    HANDLE hOutput = getOutputHandle();
+    if (hOutput == NULL)
+    {
+        return;
+    }
+
+    wchar_t wideBuffer[CLI_OUTPUT_BUFFER_CCH] = { 0 };
+    char utf8Buffer[CLI_OUTPUT_BUFFER_CCH * 3] = { 0 };
+    va_list args;
+    va_start(args, format);
+    _vsnwprintf(wideBuffer,
+                ARRAYSIZE(wideBuffer) - 1,
+                format,
+                args);
+    va_end(args);
+    int utf8Length = WideCharToMultiByte(CP_UTF8,
+                                         0,
+                                         wideBuffer,
+                                         -1,
+                                         utf8Buffer,
+                                         sizeof(utf8Buffer),
+                                         NULL,
+                                         NULL);
+    if (utf8Length > 1)
+    {
+        DWORD bytesWritten = 0;
+        WriteFile(hOutput,
+                  utf8Buffer,
+                  utf8Length - 1, // Don't write the terminator
+                  &bytesWritten,
+                  NULL);
+    }
+}
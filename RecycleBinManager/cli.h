@@ -0,0 +1,105 @@
+#define _CRT_SECURE_NO_WARNINGS
+
+#pragma once
+#include <Windows.h>
+#include <shellapi.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <assert.h>
+
+// Command line switches. When one of these is passed the program does its
+// work, writes the result to standard output and exits without showing
+// the dialog box.
+
+#define CLI_COMMAND_AUDIT_LOG       L"/auditlog"
+#define CLI_COMMAND_BENCH_ARCHIVE   L"/bencharchive"
+#define CLI_COMMAND_BENCH_BIN       L"/benchbin"
+#define CLI_COMMAND_BENCH_PATHS     L"/benchpaths"
+#define CLI_COMMAND_BENCH_RULES     L"/benchrules"
+#define CLI_COMMAND_BENCH_SECURE    L"/benchsecure"
+#define CLI_COMMAND_BENCH_SUITE     L"/benchsuite"
+#define CLI_COMMAND_BIN_STATE       L"/binstate"
+#define CLI_COMMAND_BIN_STATS       L"/binstats"
+#define CLI_COMMAND_CHECK_BIN       L"/checkbin"
+#define CLI_COMMAND_DUMP_CATALOG    L"/dumpcatalog"
+#define CLI_COMMAND_ESTIMATE        L"/estimate"
+#define CLI_COMMAND_EXTRACT_ARCHIVE L"/extractarchive"
+#define CLI_COMMAND_LIST_ARCHIVE    L"/listarchive"
+#define CLI_COMMAND_MAINTAIN        L"/maintain"
+#define CLI_COMMAND_RECLAIM         L"/reclaim"
+#define CLI_COMMAND_RECONCILE       L"/reconcile"
+#define CLI_COMMAND_RECORD_EVENTS   L"/recordevents"
+#define CLI_COMMAND_REPLAY_EVENTS   L"/replayevents"
+#define CLI_COMMAND_SCHEDULE        L"/schedule"
+#define CLI_COMMAND_SECURE_EMPTY    L"/secureempty"
+#define CLI_COMMAND_SELF_TEST       L"/selftest"
+#define CLI_COMMAND_STRESS_STATE    L"/stressstate"
+#define CLI_COMMAND_TOP_ITEMS       L"/topitems"
+#define CLI_COMMAND_TRASH           L"/trash"
+#define CLI_COMMAND_TRASH_LIST      L"/trashlist"
+#define CLI_COMMAND_UNDO_EMPTY      L"/undoempty"
+#define CLI_COMMAND_USER_BINS       L"/userbins"
+#define CLI_OUTPUT_BUFFER_CCH       4096
+#define CLI_DEFAULT_BENCH_PATHS     1000000
+#define CLI_LINE_BUFFER_SIZE        65536 // Bytes read from a list at a time
+#define CLI_STDIN_NAME              L"-"
+
+// Structs
+
+typedef int (*CliCommand)(int argc, wchar_t** argv);
+
+typedef struct CliEntry
+{
+    const wchar_t* name; // The switch, e.g. /selftest
+    CliCommand command; // Receives the switch as argv[0] and its arguments
+} CliEntry;
+
+typedef struct LineReader
+{
+    HANDLE hInput;
+    char buffer[CLI_LINE_BUFFER_SIZE]; // UTF-8 read from hInput
+    DWORD length; // Bytes in buffer
+    DWORD position; // Start of the next line in buffer
+    BOOL endOfInput;
+    BOOL skipping; // Dropping the rest of a line that didn't fit
+    ULONGLONG skipped; // Lines dropped as too long or not UTF-8
+} LineReader;
+
+// Functions
+
+int auditLogCommand(int argc, wchar_t** argv);
+int benchArchiveCommand(int argc, wchar_t** argv);
+int benchBinCommand(int argc, wchar_t** argv);
+int benchPathsCommand(int argc, wchar_t** argv);
+int benchRulesCommand(int argc, wchar_t** argv);
+int benchSecureCommand(int argc, wchar_t** argv);
+int benchSuiteCommand(int argc, wchar_t** argv);
+int binStateCommand(int argc, wchar_t** argv);
+int binStatsCommand(int argc, wchar_t** argv);
+int checkBinCommand(int argc, wchar_t** argv);
+int dumpCatalogCommand(int argc, wchar_t** argv);
+int estimateCommand(int argc, wchar_t** argv);
+int extractArchiveCommand(int argc, wchar_t** argv);
+BOOL formatFileTime(ULONGLONG fileTime, wchar_t* buffer, size_t cchBuffer);
+HANDLE getOutputHandle(void);
+BOOL launchCommand(const wchar_t* arguments);
+int listArchiveCommand(int argc, wchar_t** argv);
+int maintainCommand(int argc, wchar_t** argv);
+BOOL parseFileTime(const wchar_t* text, BOOL roundUp, ULONGLONG* fileTime);
+BOOL readInputLine(LineReader* reader, wchar_t* line, size_t cchLine);
+int reclaimCommand(int argc, wchar_t** argv);
+int reconcileCommand(int argc, wchar_t** argv);
+int recordEventsCommand(int argc, wchar_t** argv);
+int replayEventsCommand(int argc, wchar_t** argv);
+int runCommandLine(BOOL* handled);
+int scheduleCommand(int argc, wchar_t** argv);
+int secureEmptyCommand(int argc, wchar_t** argv);
+int selfTestCommand(int argc, wchar_t** argv);
+int stressStateCommand(int argc, wchar_t** argv);
+int topItemsCommand(int argc, wchar_t** argv);
+int trashCommand(int argc, wchar_t** argv);
+int trashListCommand(int argc, wchar_t** argv);
+int undoEmptyCommand(int argc, wchar_t** argv);
+int userBinsCommand(int argc, wchar_t** argv);
+void writeJsonString(const wchar_t* value);
+void writeOutput(const wchar_t* format, ...);
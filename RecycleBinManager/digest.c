@@ -0,0 +1,1128 @@
+/*
+* Digest tree of the bin folders, used to bring the catalog up to date
+* without reading the whole bin again
+*
+* Copyright(C) 2024 ERROR_SUCCESS Software
+*
+* This program is free software : you can redistribute it and /or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.If not, see < https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#include "digest.h"
+#include "bin.h"
+#include "dirtree.h"
+#include "ini.h"
+#include "reclaim.h"
+#include "throttle.h"
+#include "logger.h"
+
+#define DIGEST_HASH_BASIS       14695981039346656037ULL // 64 bit FNV-1a
+#define DIGEST_HASH_PRIME       1099511628211ULL
+
+typedef struct DigestEntry // A $I file in a listing
+{
+    DWORD nameOffset; // In characters, into the listing's names
+    DWORD bucket;
+} DigestEntry;
+
+typedef struct DigestListing // One bin folder while it is reconciled
+{
+    const DigestFolder* old; // The same folder in the old digests, NULL if new
+    BOOL listed; // FALSE if its last write time had not moved
+    wchar_t* names; // The names of its $I files, each null terminated
+    size_t namesLength; // In characters
+    size_t namesCapacity;
+    DigestEntry* entries;
+    DWORD count;
+    DWORD capacity;
+    DWORD* order; // Entry indices sorted by bucket
+} DigestListing;
+
+static BOOL addDigestEntry(DigestListing* listing, const wchar_t* name, size_t length,
+                           DWORD bucket);
+static BOOL copyDigestRecords(CatalogBuilder* builder, const Catalog* catalog,
+                              DWORD firstRecord, DWORD records);
+static const DigestFolder* findDigestFolder(const DigestFolder* folders, DWORD count,
+                                            const DigestFolder* folder);
+static void freeDigestListing(DigestListing* listing);
+static BOOL getCatalogStamp(const wchar_t* catalogPath, ULONGLONG* fileSize,
+                            ULONGLONG* writeTime);
+static ULONGLONG getFolderWriteTime(const wchar_t* path);
+static ULONGLONG hashDigestBytes(ULONGLONG hash, const void* bytes, size_t count);
+static ULONGLONG hashDigestFolder(const DigestFolder* folder);
+static BOOL listDigestFolder(DigestFolder* folder, DigestListing* listing);
+static BOOL readDigestBucket(CatalogBuilder* builder, const DigestFolder* folder,
+                             const DigestListing* listing, DWORD first, DWORD entries,
+                             BYTE* buffer, wchar_t* originalPath);
+static BOOL readDigestFile(const wchar_t* digestPath, const wchar_t* catalogPath,
+                           const Catalog* catalog, DigestHeader* header,
+                           DigestFolder** folders);
+static BOOL writeDigestFile(const wchar_t* digestPath, const DigestHeader* header,
+                            const DigestFolder* folders);
+
+#ifndef NDEBUG
+static void ageDigestFolder(const wchar_t* path);
+static void createDigestItem(const wchar_t* folder, DWORD index, ULONGLONG size,
+                             const wchar_t* directory);
+static ULONGLONG sumDigestCatalog(const wchar_t* catalogPath, ULONGLONG* items,
+                                  ULONGLONG* bytes);
+#endif
+
+/// @brief adds a $I file to a listing, growing it as needed
+/// @param listing the listing to add to
+/// @param name the name of the $I file
+/// @param length the length of name in characters
+/// @param bucket the bucket the name falls in
+/// @return TRUE on success, FALSE if memory allocation failed
+static BOOL addDigestEntry(DigestListing* listing,
+                           const wchar_t* name,
+                           size_t length,
+                           DWORD bucket)
+{
+    HANDLE hHeap = GetProcessHeap();
+    if (listing->count == listing->capacity)
+    {
+        DWORD newCapacity = listing->capacity * 2;
+        DigestEntry* newEntries = HeapReAlloc(hHeap,
+                                              0,
+                                              listing->entries,
+                                              newCapacity * sizeof(DigestEntry));
+        if (newEntries == NULL) // Memory allocation failed
+        {
+            return FALSE;
+        }
+        listing->entries = newEntries;
+        listing->capacity = newCapacity;
+    }
+    if (listing->namesLength + length + 1 > listing->namesCapacity)
+    {
+        size_t newCapacity = max(listing->namesCapacity * 2,
+                                 listing->namesLength + length + 1);
+        wchar_t* newNames = HeapReAlloc(hHeap,
+                                        0,
+                                        listing->names,
+                                        newCapacity * sizeof(wchar_t));
+        if (newNames == NULL) // Memory allocation failed
+        {
+            return FALSE;
+        }
+        listing->names = newNames;
+        listing->namesCapacity = newCapacity;
+    }
+
+    DigestEntry* entry = &listing->entries[listing->count++];
+    entry->nameOffset = (DWORD) listing->namesLength;
+    entry->bucket = bucket;
+    memcpy(listing->names + listing->namesLength,
+           name,
+           (length + 1) * sizeof(wchar_t));
+    listing->namesLength += length + 1;
+    return TRUE;
+}
+
+#ifndef NDEBUG
+/// @brief sets the last write time of a test folder well into the past, as
+/// if nothing had been written to it for years
+/// @param path the folder
+static void ageDigestFolder(const wchar_t* path)
+{
+    HANDLE hFolder = CreateFileW(path,
+                                 FILE_WRITE_ATTRIBUTES,
+                                 FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                                 NULL,
+                                 OPEN_EXISTING,
+                                 FILE_FLAG_BACKUP_SEMANTICS,
+                                 NULL);
+    assert(hFolder != INVALID_HANDLE_VALUE);
+    ULONGLONG old = getCurrentFileTime() - (3 * 365 * 86400ULL * FILETIME_PER_SECOND);
+    FILETIME writeTime = { 0 };
+    writeTime.dwLowDateTime = (DWORD) old;
+    writeTime.dwHighDateTime = (DWORD) (old >> 32);
+    BOOL result = SetFileTime(hFolder,
+                              NULL,
+                              NULL,
+                              &writeTime);
+    assert(result);
+    CloseHandle(hFolder);
+}
+#endif
+
+/// @brief adds a run of records from the old catalog to the new one
+/// @param builder the new catalog
+/// @param catalog the old catalog
+/// @param firstRecord the first record to copy
+/// @param records the number of records to copy
+/// @return TRUE on success, FALSE if a record is damaged or memory
+///         allocation failed
+static BOOL copyDigestRecords(CatalogBuilder* builder,
+                              const Catalog* catalog,
+                              DWORD firstRecord,
+                              DWORD records)
+{
+    for (DWORD i = firstRecord; i < firstRecord + records; i++)
+    {
+        const CatalogRecord* record = &catalog->records[i];
+        const wchar_t* name = getCatalogString(catalog,
+                                               record->nameOffset);
+        if ((name == NULL) ||
+            (addCatalogItem(builder,
+                            record->size,
+                            record->deletionTime,
+                            record->volumeId,
+                            name) == FALSE))
+        {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+#ifndef NDEBUG
+/// @brief writes a $I file into a test bin folder
+/// @param folder the bin folder
+/// @param index numbers the item, which names it and its original path
+/// @param size the size recorded for the item
+/// @param directory where the item was deleted from
+static void createDigestItem(const wchar_t* folder,
+                             DWORD index,
+                             ULONGLONG size,
+                             const wchar_t* directory)
+{
+    wchar_t path[MAX_PATH + 1] = { 0 };
+    BYTE info[BIN_INFO_HEADER_SIZE + sizeof(DWORD) + (MAX_PATH * sizeof(wchar_t))] = { 0 };
+    _snwprintf(path,
+               ARRAYSIZE(path),
+               L"%s\\file%u.txt",
+               directory,
+               index);
+    DWORD infoBytes = buildBinInfo(info,
+                                   path,
+                                   size,
+                                   1000 + index);
+    _snwprintf(path,
+               ARRAYSIZE(path),
+               L"%s\\%s%06u.txt",
+               folder,
+               BIN_INFO_PREFIX,
+               index);
+    HANDLE hFile = CreateFileW(path,
+                               GENERIC_WRITE,
+                               0,
+                               NULL,
+                               CREATE_ALWAYS,
+                               FILE_ATTRIBUTE_NORMAL,
+                               NULL);
+    assert(hFile != INVALID_HANDLE_VALUE);
+    DWORD bytesWritten = 0;
+    BOOL result = WriteFile(hFile,
+                            info,
+                            infoBytes,
+                            &bytesWritten,
+                            NULL);
+    assert(result && (bytesWritten == infoBytes));
+    CloseHandle(hFile);
+}
+#endif
+
+/// @brief finds a bin folder among the old digests
+/// @param folders the old digests
+/// @param count the number of old digests
+/// @param folder the folder to look for, by path and volume
+/// @return the old digest of the folder, or NULL if it had none
+static const DigestFolder* findDigestFolder(const DigestFolder* folders,
+                                            DWORD count,
+                                            const DigestFolder* folder)
+{
+    for (DWORD i = 0; i < count; i++)
+    {
+        if ((folders[i].volumeSerial == folder->volumeSerial) &&
+            (_wcsicmp(folders[i].path, folder->path) == 0))
+        {
+            return &folders[i];
+        }
+    }
+    return NULL;
+}
+
+/// @brief frees the memory held by a listing
+/// @param listing the listing to free
+static void freeDigestListing(DigestListing* listing)
+{
+    HANDLE hHeap = GetProcessHeap();
+    if (listing->names != NULL)
+    {
+        HeapFree(hHeap, 0, listing->names);
+    }
+    if (listing->entries != NULL)
+    {
+        HeapFree(hHeap, 0, listing->entries);
+    }
+    if (listing->order != NULL)
+    {
+        HeapFree(hHeap, 0, listing->order);
+    }
+    ZeroMemory(listing,
+               sizeof(DigestListing));
+}
+
+/// @brief gets the size and last write time of the catalog file, which tie
+/// the digests to the catalog they were written with
+/// @param catalogPath the full path to the catalog file
+/// @param fileSize receives the size of the file
+/// @param writeTime receives the last write time of the file
+/// @return TRUE on success, FALSE if the file could not be read
+static BOOL getCatalogStamp(const wchar_t* catalogPath,
+                            ULONGLONG* fileSize,
+                            ULONGLONG* writeTime)
+{
+    WIN32_FILE_ATTRIBUTE_DATA data = { 0 };
+    if (GetFileAttributesExW(catalogPath,
+                             GetFileExInfoStandard,
+                             &data) == FALSE)
+    {
+        return FALSE;
+    }
+    *fileSize = ((ULONGLONG) data.nFileSizeHigh << 32) | data.nFileSizeLow;
+    *writeTime = ((ULONGLONG) data.ftLastWriteTime.dwHighDateTime << 32) |
+        data.ftLastWriteTime.dwLowDateTime;
+    return TRUE;
+}
+
+/// @brief gets the path of the digest file in local appdata
+/// @param digestPath receives the full path to the digests
+/// @param cchDigestPath the size of digestPath in characters
+/// @return TRUE if the path fits in the buffer, FALSE if not
+BOOL getDigestPath(wchar_t* digestPath,
+                   size_t cchDigestPath)
+{
+    return getAppDataFilePath(DIGEST_FILENAME,
+                              digestPath,
+                              cchDigestPath);
+}
+
+/// @brief gets the last write time of a folder, which moves whenever a file
+/// is added to it, removed from it or renamed in it
+/// @param path the folder
+/// @return the last write time, or 0 if the folder could not be read
+static ULONGLONG getFolderWriteTime(const wchar_t* path)
+{
+    WIN32_FILE_ATTRIBUTE_DATA data = { 0 };
+    if (GetFileAttributesExW(path,
+                             GetFileExInfoStandard,
+                             &data) == FALSE)
+    {
+        return 0;
+    }
+    return ((ULONGLONG) data.ftLastWriteTime.dwHighDateTime << 32) |
+        data.ftLastWriteTime.dwLowDateTime;
+}
+
+/// @brief continues a 64 bit FNV-1a hash over some bytes
+static ULONGLONG hashDigestBytes(ULONGLONG hash,
+                                 const void* bytes,
+                                 size_t count)
+{
+    const BYTE* next = (const BYTE*) bytes;
+    for (size_t i = 0; i < count; i++)
+    {
+        hash ^= next[i];
+        hash *= DIGEST_HASH_PRIME;
+    }
+    return hash;
+}
+
+/// @brief hashes the digest and entries of every bucket of a folder
+static ULONGLONG hashDigestFolder(const DigestFolder* folder)
+{
+    ULONGLONG hash = DIGEST_HASH_BASIS;
+    for (DWORD i = 0; i < DIGEST_BUCKETS; i++)
+    {
+        hash = hashDigestBytes(hash,
+                               &folder->buckets[i].digest,
+                               sizeof(ULONGLONG));
+        hash = hashDigestBytes(hash,
+                               &folder->buckets[i].entries,
+                               sizeof(DWORD));
+    }
+    return hash;
+}
+
+/// @brief lists the $I files of a bin folder and sums them into its
+/// buckets, without opening any of them
+/// @param folder the folder, receives the digest of every bucket
+/// @param listing receives the names, sorted by bucket
+/// @return TRUE on success, FALSE if memory allocation failed
+static BOOL listDigestFolder(DigestFolder* folder,
+                             DigestListing* listing)
+{
+    HANDLE hHeap = GetProcessHeap();
+    listing->entries = HeapAlloc(hHeap,
+                                 0,
+                                 DIGEST_INITIAL_ENTRIES * sizeof(DigestEntry));
+    listing->names = HeapAlloc(hHeap,
+                               0,
+                               DIGEST_INITIAL_NAMES * sizeof(wchar_t));
+    if ((listing->entries == NULL) || (listing->names == NULL)) // Memory allocation failed
+    {
+        return FALSE;
+    }
+    listing->capacity = DIGEST_INITIAL_ENTRIES;
+    listing->namesCapacity = DIGEST_INITIAL_NAMES;
+
+    wchar_t searchPattern[MAX_PATH + 1] = { 0 };
+    _snwprintf(searchPattern,
+               ARRAYSIZE(searchPattern),
+               L"%s\\%s*",
+               folder->path,
+               BIN_INFO_PREFIX);
+    searchPattern[MAX_PATH] = 0;
+    WIN32_FIND_DATAW findData = { 0 };
+    HANDLE hFind = FindFirstFileExW(searchPattern,
+                                    FindExInfoBasic,
+                                    &findData,
+                                    FindExSearchNameMatch,
+                                    NULL,
+                                    FIND_FIRST_EX_LARGE_FETCH);
+    BOOL result = TRUE;
+    if (hFind != INVALID_HANDLE_VALUE)
+    {
+        do
+        {
+            if (findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+            {
+                continue;
+            }
+
+            // The bucket only depends on the name, so a $I file stays in
+            // its bucket when it changes
+            size_t length = wcslen(findData.cFileName);
+            ULONGLONG hash = hashDigestBytes(DIGEST_HASH_BASIS,
+                                             findData.cFileName,
+                                             length * sizeof(wchar_t));
+            DWORD bucket = (DWORD) (hash >> 32) & (DIGEST_BUCKETS - 1);
+            hash = hashDigestBytes(hash,
+                                   &findData.nFileSizeHigh,
+                                   sizeof(DWORD));
+            hash = hashDigestBytes(hash,
+                                   &findData.nFileSizeLow,
+                                   sizeof(DWORD));
+            hash = hashDigestBytes(hash,
+                                   &findData.ftLastWriteTime,
+                                   sizeof(FILETIME));
+            result = addDigestEntry(listing,
+                                    findData.cFileName,
+                                    length,
+                                    bucket);
+
+            // A sum does not depend on the order the folder is listed in
+            folder->buckets[bucket].digest += hash;
+            folder->buckets[bucket].entries++;
+        } while (result && FindNextFileW(hFind, &findData));
+        FindClose(hFind);
+    }
+    if (result == FALSE)
+    {
+        return FALSE;
+    }
+
+    // Sort the entries by bucket, keeping the order they were listed in
+    listing->order = HeapAlloc(hHeap,
+                               0,
+                               max(listing->count, 1) * sizeof(DWORD));
+    if (listing->order == NULL) // Memory allocation failed
+    {
+        return FALSE;
+    }
+    DWORD next[DIGEST_BUCKETS] = { 0 };
+    DWORD start = 0;
+    for (DWORD i = 0; i < DIGEST_BUCKETS; i++)
+    {
+        next[i] = start;
+        start += folder->buckets[i].entries;
+    }
+    for (DWORD i = 0; i < listing->count; i++)
+    {
+        listing->order[next[listing->entries[i].bucket]++] = i;
+    }
+    folder->digest = hashDigestFolder(folder);
+    return TRUE;
+}
+
+/// @brief reads the $I files of one bucket of a listed folder into the
+/// catalog
+/// @param builder the new catalog
+/// @param folder the bin folder
+/// @param listing the listing of the folder
+/// @param first the position of the bucket's first entry in listing->order
+/// @param entries the number of entries in the bucket
+/// @param buffer scratch space of at least BIN_INFO_MAX_SIZE bytes
+/// @param originalPath scratch space of BIN_PATH_MAX_CCH characters
+/// @return TRUE on success, FALSE if memory allocation failed
+static BOOL readDigestBucket(CatalogBuilder* builder,
+                             const DigestFolder* folder,
+                             const DigestListing* listing,
+                             DWORD first,
+                             DWORD entries,
+                             BYTE* buffer,
+                             wchar_t* originalPath)
+{
+    for (DWORD i = first; i < first + entries; i++)
+    {
+        const DigestEntry* entry = &listing->entries[listing->order[i]];
+        wchar_t infoPath[MAX_PATH + 1] = { 0 };
+        _snwprintf(infoPath,
+                   ARRAYSIZE(infoPath),
+                   L"%s\\%s",
+                   folder->path,
+                   listing->names + entry->nameOffset);
+        infoPath[MAX_PATH] = 0;
+
+        BinItem item = { 0 };
+        if (readBinInfoFile(infoPath,
+                            buffer,
+                            &item,
+                            originalPath,
+                            BIN_PATH_MAX_CCH) == FALSE)
+        {
+            LOG(L"Skipping unreadable bin metadata %s\n",
+                infoPath);
+            continue;
+        }
+        if (addCatalogItem(builder,
+                           item.size,
+                           item.deletionTime,
+                           folder->volumeSerial,
+                           item.originalPath) == FALSE)
+        {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+/// @brief reads the digests written with a catalog, and checks they still
+/// describe it
+/// @param digestPath the full path to the digest file
+/// @param catalogPath the full path to the catalog file
+/// @param catalog the catalog, open
+/// @param header receives the header of the digests
+/// @param folders receives the digest of every folder, free it with
+///        HeapFree()
+/// @return TRUE if the digests are valid and match the catalog, FALSE if not
+static BOOL readDigestFile(const wchar_t* digestPath,
+                           const wchar_t* catalogPath,
+                           const Catalog* catalog,
+                           DigestHeader* header,
+                           DigestFolder** folders)
+{
+    *folders = NULL;
+    HANDLE hFile = CreateFileW(digestPath,
+                               GENERIC_READ,
+                               FILE_SHARE_READ | FILE_SHARE_DELETE,
+                               NULL,
+                               OPEN_EXISTING,
+                               FILE_ATTRIBUTE_NORMAL,
+                               NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+    {
+        return FALSE;
+    }
+
+    ULONGLONG fileSize = 0;
+    ULONGLONG writeTime = 0;
+    LARGE_INTEGER digestSize = { 0 };
+    DWORD bytesRead = 0;
+    BOOL result = GetFileSizeEx(hFile, &digestSize) &&
+        ReadFile(hFile, header, sizeof(DigestHeader), &bytesRead, NULL) &&
+        (bytesRead == sizeof(DigestHeader)) &&
+        getCatalogStamp(catalogPath, &fileSize, &writeTime);
+    if (result)
+    {
+        // The catalog must be the one that was written with these digests
+        result = (header->magic == DIGEST_MAGIC) &&
+            (header->version == DIGEST_VERSION) &&
+            (header->headerSize == sizeof(DigestHeader)) &&
+            (header->folderSize == sizeof(DigestFolder)) &&
+            (header->buckets == DIGEST_BUCKETS) &&
+            (header->folders <= DIGEST_MAX_FOLDERS) &&
+            ((ULONGLONG) digestSize.QuadPart ==
+             sizeof(DigestHeader) + ((ULONGLONG) header->folders * sizeof(DigestFolder))) &&
+            (header->catalogItems == catalog->header->itemCount) &&
+            (header->catalogBytes == catalog->header->totalBytes) &&
+            (header->catalogFileSize == fileSize) &&
+            (header->catalogWriteTime == writeTime);
+    }
+    if (result && (header->folders > 0))
+    {
+        DWORD bytes = header->folders * (DWORD) sizeof(DigestFolder);
+        *folders = HeapAlloc(GetProcessHeap(),
+                             0,
+                             bytes);
+        result = (*folders != NULL) &&
+            ReadFile(hFile, *folders, bytes, &bytesRead, NULL) &&
+            (bytesRead == bytes);
+    }
+    CloseHandle(hFile);
+
+    // Every range of records has to lie within the catalog
+    for (DWORD i = 0; result && (i < header->folders); i++)
+    {
+        DigestFolder* folder = &(*folders)[i];
+        folder->path[MAX_PATH] = 0;
+        result = ((ULONGLONG) folder->firstRecord + folder->records <= header->catalogItems);
+        for (DWORD j = 0; result && (j < DIGEST_BUCKETS); j++)
+        {
+            const DigestBucket* bucket = &folder->buckets[j];
+            result = ((ULONGLONG) bucket->firstRecord + bucket->records <= header->catalogItems);
+        }
+    }
+    if (result == FALSE)
+    {
+        LOG(L"Digests %s do not match the catalog\n",
+            digestPath);
+        if (*folders != NULL)
+        {
+            HeapFree(GetProcessHeap(),
+                     0,
+                     *folders);
+            *folders = NULL;
+        }
+    }
+    return result;
+}
+
+/// @brief brings the catalog up to date with the bin folders of the current
+/// user on every fixed volume. If reconciling fails, the catalog is built
+/// again from scratch.
+/// @param catalogPath the full path to the catalog file
+/// @param full TRUE to ignore the old catalog and read every $I file
+/// @param result receives what had to be read
+/// @return TRUE if the catalog is up to date, FALSE if it could not be
+///         written
+BOOL reconcileCatalog(const wchar_t* catalogPath,
+                      BOOL full,
+                      CatalogReconcile* result)
+{
+    wchar_t digestPath[MAX_PATH + 1] = { 0 };
+    if (getDigestPath(digestPath,
+                      ARRAYSIZE(digestPath)) == FALSE)
+    {
+        return FALSE;
+    }
+
+    wchar_t paths[DIGEST_MAX_FOLDERS][MAX_PATH + 1] = { 0 };
+    const wchar_t* folders[DIGEST_MAX_FOLDERS] = { 0 };
+    DWORD volumeSerials[DIGEST_MAX_FOLDERS] = { 0 };
+    DWORD count = 0;
+    DWORD drives = GetLogicalDrives();
+    for (wchar_t driveLetter = L'A'; driveLetter <= L'Z'; driveLetter++)
+    {
+        if (((drives & (1 << (driveLetter - L'A'))) == 0) ||
+            (getBinDirectory(driveLetter,
+                             paths[count],
+                             ARRAYSIZE(paths[count])) == FALSE))
+        {
+            continue;
+        }
+        wchar_t volumeRoot[] = { driveLetter, L':', L'\\', 0 };
+        GetVolumeInformationW(volumeRoot,
+                              NULL,
+                              0,
+                              &volumeSerials[count],
+                              NULL,
+                              NULL,
+                              NULL,
+                              0);
+        folders[count] = paths[count];
+        count++;
+    }
+
+    BOOL reconciled = reconcileCatalogFolders(catalogPath,
+                                              digestPath,
+                                              folders,
+                                              volumeSerials,
+                                              count,
+                                              full,
+                                              result);
+    if ((reconciled == FALSE) && (full == FALSE))
+    {
+        LOG(L"Reconciling the catalog failed, building it again\n");
+        reconciled = reconcileCatalogFolders(catalogPath,
+                                             digestPath,
+                                             folders,
+                                             volumeSerials,
+                                             count,
+                                             TRUE,
+                                             result);
+    }
+    return reconciled;
+}
+
+/// @brief brings a catalog up to date with a set of bin folders, reading
+/// only the $I files in buckets that changed since the catalog was written
+/// @param catalogPath the full path to the catalog file
+/// @param digestPath the full path to the digest file written with it
+/// @param folders the bin folders, in the order their records are written
+/// @param volumeSerials the serial number of the volume of each folder
+/// @param count the number of folders, at most DIGEST_MAX_FOLDERS
+/// @param full TRUE to ignore the old catalog and read every $I file
+/// @param result receives what had to be read
+/// @return TRUE if the catalog is up to date, FALSE if it could not be
+///         written or memory allocation failed
+BOOL reconcileCatalogFolders(const wchar_t* catalogPath,
+                             const wchar_t* digestPath,
+                             const wchar_t** folders,
+                             const DWORD* volumeSerials,
+                             DWORD count,
+                             BOOL full,
+                             CatalogReconcile* result)
+{
+    ULONGLONG start = getThrottleClock();
+    ZeroMemory(result,
+               sizeof(CatalogReconcile));
+    if (count > DIGEST_MAX_FOLDERS)
+    {
+        return FALSE;
+    }
+    result->folders = count;
+
+    HANDLE hHeap = GetProcessHeap();
+    Catalog oldCatalog = { 0 };
+    DigestHeader oldHeader = { 0 };
+    DigestFolder* oldFolders = NULL;
+    BOOL haveOld = (full == FALSE) &&
+        openCatalog(catalogPath, &oldCatalog) &&
+        readDigestFile(digestPath, catalogPath, &oldCatalog, &oldHeader, &oldFolders);
+    DigestFolder* digests = HeapAlloc(hHeap,
+                                      HEAP_ZERO_MEMORY,
+                                      max(count, 1) * sizeof(DigestFolder));
+    DigestListing* listings = HeapAlloc(hHeap,
+                                        HEAP_ZERO_MEMORY,
+                                        max(count, 1) * sizeof(DigestListing));
+    BYTE* buffer = HeapAlloc(hHeap,
+                             0,
+                             BIN_INFO_MAX_SIZE);
+    wchar_t* originalPath = HeapAlloc(hHeap,
+                                      0,
+                                      BIN_PATH_MAX_CCH * sizeof(wchar_t));
+    BOOL reconciled = (digests != NULL) &&
+        (listings != NULL) &&
+        (buffer != NULL) &&
+        (originalPath != NULL); // Memory allocation failed if not
+
+    // A folder whose last write time has not moved since it was listed is
+    // taken from the old digests as it is. Any other folder is listed.
+    BOOL changed = (haveOld == FALSE) || (oldHeader.folders != count);
+    for (DWORD i = 0; reconciled && (i < count); i++)
+    {
+        DigestFolder* digest = &digests[i];
+        DigestListing* listing = &listings[i];
+        wcsncpy(digest->path,
+                folders[i],
+                MAX_PATH);
+        digest->volumeSerial = volumeSerials[i];
+        listing->old = (haveOld) ? findDigestFolder(oldFolders, oldHeader.folders, digest) : NULL;
+        ULONGLONG lastWriteTime = getFolderWriteTime(digest->path);
+        if ((listing->old != NULL) &&
+            (listing->old->lastWriteTime == lastWriteTime) &&
+            (lastWriteTime + (DIGEST_SETTLE_SECONDS * FILETIME_PER_SECOND) <= listing->old->listedTime))
+        {
+            *digest = *listing->old;
+            continue;
+        }
+        digest->lastWriteTime = lastWriteTime;
+        digest->listedTime = getCurrentFileTime();
+        reconciled = listDigestFolder(digest,
+                                      listing);
+        listing->listed = TRUE;
+        result->foldersListed++;
+        result->itemsListed += listing->count;
+        if ((listing->old == NULL) || (listing->old->digest != digest->digest))
+        {
+            changed = TRUE;
+        }
+    }
+
+    // With nothing changed, the catalog is kept, and the digests are only
+    // written again to remember when the folders were listed
+    CatalogBuilder builder = { 0 };
+    if (reconciled && (changed == FALSE))
+    {
+        for (DWORD i = 0; i < count; i++)
+        {
+            const DigestFolder* old = listings[i].old;
+            digests[i].firstRecord = old->firstRecord;
+            digests[i].records = old->records;
+            for (DWORD j = 0; j < DIGEST_BUCKETS; j++)
+            {
+                digests[i].buckets[j].firstRecord = old->buckets[j].firstRecord;
+                digests[i].buckets[j].records = old->buckets[j].records;
+            }
+            result->itemsCopied += old->records;
+        }
+    }
+    else if (reconciled)
+    {
+        reconciled = initCatalogBuilder(&builder);
+    }
+
+    // Otherwise each bucket whose digest is unchanged keeps its records, and
+    // only the $I files of the other buckets are read
+    for (DWORD i = 0; reconciled && changed && (i < count); i++)
+    {
+        DigestFolder* digest = &digests[i];
+        const DigestListing* listing = &listings[i];
+        DWORD next = 0; // Into listing->order
+        digest->firstRecord = (DWORD) builder.recordCount;
+        for (DWORD j = 0; reconciled && (j < DIGEST_BUCKETS); j++)
+        {
+            DigestBucket* bucket = &digest->buckets[j];
+            const DigestBucket* oldBucket = (listing->old != NULL) ? &listing->old->buckets[j] : NULL;
+            DWORD firstRecord = (DWORD) builder.recordCount;
+            if ((oldBucket != NULL) &&
+                (oldBucket->digest == bucket->digest) &&
+                (oldBucket->entries == bucket->entries))
+            {
+                reconciled = copyDigestRecords(&builder,
+                                               &oldCatalog,
+                                               oldBucket->firstRecord,
+                                               oldBucket->records);
+                result->itemsCopied += oldBucket->records;
+            }
+            else
+            {
+                reconciled = readDigestBucket(&builder,
+                                              digest,
+                                              listing,
+                                              next,
+                                              bucket->entries,
+                                              buffer,
+                                              originalPath);
+                result->bucketsRead++;
+                result->itemsRead += bucket->entries;
+            }
+            next += bucket->entries;
+            bucket->firstRecord = firstRecord;
+            bucket->records = (DWORD) builder.recordCount - firstRecord;
+        }
+        digest->records = (DWORD) builder.recordCount - digest->firstRecord;
+    }
+
+    // The old catalog is mapped, and has to be closed before it is replaced
+    closeCatalog(&oldCatalog);
+    DigestHeader header = { 0 };
+    header.magic = DIGEST_MAGIC;
+    header.version = DIGEST_VERSION;
+    header.headerSize = sizeof(DigestHeader);
+    header.folderSize = sizeof(DigestFolder);
+    header.folders = count;
+    header.buckets = DIGEST_BUCKETS;
+    header.rootDigest = DIGEST_HASH_BASIS;
+    for (DWORD i = 0; reconciled && (i < count); i++)
+    {
+        header.rootDigest = hashDigestBytes(header.rootDigest,
+                                            &digests[i].volumeSerial,
+                                            sizeof(DWORD));
+        header.rootDigest = hashDigestBytes(header.rootDigest,
+                                            &digests[i].digest,
+                                            sizeof(ULONGLONG));
+    }
+    if (reconciled && changed)
+    {
+        reconciled = writeCatalog(&builder,
+                                  catalogPath) &&
+            getCatalogStamp(catalogPath,
+                            &header.catalogFileSize,
+                            &header.catalogWriteTime);
+        header.catalogItems = builder.recordCount;
+        header.catalogBytes = builder.totalBytes;
+        result->rewritten = reconciled;
+    }
+    else if (reconciled)
+    {
+        header.catalogItems = oldHeader.catalogItems;
+        header.catalogBytes = oldHeader.catalogBytes;
+        header.catalogFileSize = oldHeader.catalogFileSize;
+        header.catalogWriteTime = oldHeader.catalogWriteTime;
+    }
+
+    // Without digests the next reconcile reads everything again, which is
+    // slow but still right
+    if (reconciled && (changed || (result->foldersListed > 0)) &&
+        (writeDigestFile(digestPath, &header, digests) == FALSE))
+    {
+        DeleteFileW(digestPath);
+    }
+
+    if (builder.records != NULL)
+    {
+        freeCatalogBuilder(&builder);
+    }
+    for (DWORD i = 0; (listings != NULL) && (i < count); i++)
+    {
+        freeDigestListing(&listings[i]);
+    }
+    if (listings != NULL)
+    {
+        HeapFree(hHeap, 0, listings);
+    }
+    if (digests != NULL)
+    {
+        HeapFree(hHeap, 0, digests);
+    }
+    if (oldFolders != NULL)
+    {
+        HeapFree(hHeap, 0, oldFolders);
+    }
+    if (buffer != NULL)
+    {
+        HeapFree(hHeap, 0, buffer);
+    }
+    if (originalPath != NULL)
+    {
+        HeapFree(hHeap, 0, originalPath);
+    }
+    result->milliseconds = (getThrottleClock() - start) / 1000.0;
+    return reconciled;
+}
+
+#ifndef NDEBUG
+/// @brief sums a hash of every record of a catalog, whatever order they are
+/// in
+/// @param catalogPath the full path to the catalog file
+/// @param items receives the number of records
+/// @param bytes receives the total size of the records
+/// @return the sum of the hashes
+static ULONGLONG sumDigestCatalog(const wchar_t* catalogPath,
+                                  ULONGLONG* items,
+                                  ULONGLONG* bytes)
+{
+    Catalog catalog = { 0 };
+    BOOL result = openCatalog(catalogPath,
+                              &catalog);
+    assert(result);
+    ULONGLONG sum = 0;
+    for (ULONGLONG i = 0; i < catalog.header->itemCount; i++)
+    {
+        const CatalogRecord* record = &catalog.records[i];
+        const wchar_t* name = getCatalogString(&catalog,
+                                               record->nameOffset);
+        assert(name != NULL);
+        ULONGLONG hash = hashDigestBytes(DIGEST_HASH_BASIS,
+                                         name,
+                                         wcslen(name) * sizeof(wchar_t));
+        hash = hashDigestBytes(hash,
+                               record,
+                               sizeof(ULONGLONG) * 2 + sizeof(DWORD));
+        sum += hash;
+    }
+    *items = catalog.header->itemCount;
+    *bytes = catalog.header->totalBytes;
+    closeCatalog(&catalog);
+    return sum;
+}
+#endif
+
+/// @brief reconciles a catalog of two fake bin folders through every path:
+/// a full build, nothing changed, folders left alone long enough to be
+/// trusted, a few items added, removed and changed, and damaged digests, in
+/// a debug build, returns immediately in a release build
+/// @param none
+void testCatalogDigests(void)
+{
+#ifndef NDEBUG
+    wchar_t tempDirectory[MAX_PATH + 1] = { 0 };
+    wchar_t root[MAX_PATH + 1] = { 0 };
+    wchar_t paths[2][MAX_PATH + 1] = { 0 };
+    wchar_t catalogPath[MAX_PATH + 1] = { 0 };
+    wchar_t digestPath[MAX_PATH + 1] = { 0 };
+    wchar_t checkPath[MAX_PATH + 1] = { 0 };
+    wchar_t checkDigestPath[MAX_PATH + 1] = { 0 };
+    wchar_t name[MAX_PATH + 1] = { 0 };
+    GetTempPathW(ARRAYSIZE(tempDirectory),
+                 tempDirectory);
+    _snwprintf(root, ARRAYSIZE(root), L"%srbmdigest%08X", tempDirectory, GetCurrentProcessId());
+    _snwprintf(paths[0], ARRAYSIZE(paths[0]), L"%s\\C", root);
+    _snwprintf(paths[1], ARRAYSIZE(paths[1]), L"%s\\D", root);
+    _snwprintf(catalogPath, ARRAYSIZE(catalogPath), L"%s\\%s", root, CATALOG_FILENAME);
+    _snwprintf(digestPath, ARRAYSIZE(digestPath), L"%s\\%s", root, DIGEST_FILENAME);
+    _snwprintf(checkPath, ARRAYSIZE(checkPath), L"%s\\Check.bin", root);
+    _snwprintf(checkDigestPath, ARRAYSIZE(checkDigestPath), L"%s\\CheckDigests.bin", root);
+    deleteTree(root, NULL);
+    BOOL result = CreateDirectoryW(root, NULL) &&
+        CreateDirectoryW(paths[0], NULL) &&
+        CreateDirectoryW(paths[1], NULL);
+    assert(result);
+    for (DWORD i = 0; i < 300; i++)
+    {
+        createDigestItem(paths[0], i, i + 1, L"C:\\Digest");
+    }
+    for (DWORD i = 0; i < 40; i++)
+    {
+        createDigestItem(paths[1], i, 1000, L"D:\\Digest");
+    }
+    const wchar_t* folders[2] = { paths[0], paths[1] };
+    DWORD volumeSerials[2] = { 1, 2 };
+
+    // Everything is read the first time
+    CatalogReconcile reconcile = { 0 };
+    result = reconcileCatalogFolders(catalogPath, digestPath, folders, volumeSerials, 2,
+                                     FALSE, &reconcile);
+    assert(result && reconcile.rewritten);
+    assert((reconcile.foldersListed == 2) && (reconcile.itemsRead == 340));
+    assert((reconcile.bucketsRead == 2 * DIGEST_BUCKETS) && (reconcile.itemsCopied == 0));
+    ULONGLONG items = 0;
+    ULONGLONG bytes = 0;
+    sumDigestCatalog(catalogPath, &items, &bytes);
+    assert((items == 340) && (bytes == (300 * 301 / 2) + (40 * 1000)));
+
+    // Straight after, the folders are too new to trust, but are listed and
+    // found unchanged
+    result = reconcileCatalogFolders(catalogPath, digestPath, folders, volumeSerials, 2,
+                                     FALSE, &reconcile);
+    assert(result && (reconcile.rewritten == FALSE));
+    assert((reconcile.foldersListed == 2) && (reconcile.itemsListed == 340));
+    assert((reconcile.itemsRead == 0) && (reconcile.itemsCopied == 340));
+
+    // Once a folder has been listed well after it was last written, it is
+    // trusted without being listed
+    ageDigestFolder(paths[0]);
+    ageDigestFolder(paths[1]);
+    result = reconcileCatalogFolders(catalogPath, digestPath, folders, volumeSerials, 2,
+                                     FALSE, &reconcile);
+    assert(result && (reconcile.rewritten == FALSE) && (reconcile.foldersListed == 2));
+    result = reconcileCatalogFolders(catalogPath, digestPath, folders, volumeSerials, 2,
+                                     FALSE, &reconcile);
+    assert(result && (reconcile.rewritten == FALSE));
+    assert((reconcile.foldersListed == 0) && (reconcile.itemsListed == 0));
+
+    // Two items added and one removed on C, and one replaced by another
+    // with the same name on D, only read the buckets they fall in
+    createDigestItem(paths[0], 300, 5000, L"C:\\Digest");
+    createDigestItem(paths[0], 301, 6000, L"C:\\Digest");
+    _snwprintf(name, ARRAYSIZE(name), L"%s\\%s%06u.txt", paths[0], BIN_INFO_PREFIX, 7);
+    result = DeleteFileW(name);
+    assert(result);
+    _snwprintf(name, ARRAYSIZE(name), L"%s\\%s%06u.txt", paths[1], BIN_INFO_PREFIX, 3);
+    result = DeleteFileW(name);
+    assert(result);
+    createDigestItem(paths[1], 3, 2000, L"D:\\Digest\\Moved");
+    result = reconcileCatalogFolders(catalogPath, digestPath, folders, volumeSerials, 2,
+                                     FALSE, &reconcile);
+    assert(result && reconcile.rewritten && (reconcile.foldersListed == 2));
+    assert((reconcile.bucketsRead >= 2) && (reconcile.bucketsRead <= 4));
+    assert((reconcile.itemsRead >= 3) && (reconcile.itemsRead < 20));
+    assert(reconcile.itemsRead + reconcile.itemsCopied == 341);
+
+    // The result is the same catalog a full build makes
+    ULONGLONG checkItems = 0;
+    ULONGLONG checkBytes = 0;
+    ULONGLONG sum = sumDigestCatalog(catalogPath, &items, &bytes);
+    result = reconcileCatalogFolders(checkPath, checkDigestPath, folders, volumeSerials, 2,
+                                     TRUE, &reconcile);
+    assert(result && (reconcile.itemsRead == 341));
+    assert(sum == sumDigestCatalog(checkPath, &checkItems, &checkBytes));
+    assert((items == 341) && (items == checkItems) && (bytes == checkBytes));
+    assert(bytes == (300 * 301 / 2) - 8 + 5000 + 6000 + (39 * 1000) + 2000);
+
+    // Digests that don't match the catalog are ignored
+    HANDLE hFile = CreateFileW(digestPath,
+                               GENERIC_WRITE,
+                               0,
+                               NULL,
+                               OPEN_EXISTING,
+                               FILE_ATTRIBUTE_NORMAL,
+                               NULL);
+    assert(hFile != INVALID_HANDLE_VALUE);
+    DWORD badMagic = 0;
+    DWORD bytesWritten = 0;
+    WriteFile(hFile,
+              &badMagic,
+              sizeof(badMagic),
+              &bytesWritten,
+              NULL);
+    CloseHandle(hFile);
+    result = reconcileCatalogFolders(catalogPath, digestPath, folders, volumeSerials, 2,
+                                     FALSE, &reconcile);
+    assert(result && reconcile.rewritten && (reconcile.itemsRead == 341));
+    assert(sum == sumDigestCatalog(catalogPath, &items, &bytes));
+
+    result = deleteTree(root, NULL);
+    assert(result);
+#endif
+}
+
+/// @brief writes the digests to disk. They are written to a temporary file
+/// first and then renamed over the old ones, like the catalog.
+/// @param digestPath the full path of the digest file to write
+/// @param header the header, with the number of folders
+/// @param folders the digest of every folder
+/// @return TRUE if the digests were written, FALSE if not
+static BOOL writeDigestFile(const wchar_t* digestPath,
+                            const DigestHeader* header,
+                            const DigestFolder* folders)
+{
+    wchar_t tempPath[MAX_PATH + 1] = { 0 };
+    int written = _snwprintf(tempPath,
+                             ARRAYSIZE(tempPath),
+                             L"%s.tmp",
+                             digestPath);
+    tempPath[MAX_PATH] = 0;
+    if ((written < 0) || (written > MAX_PATH))
+    {
+        return FALSE;
+    }
+
+    HANDLE hFile = CreateFileW(tempPath,
+                               GENERIC_WRITE,
+                               0,
+                               NULL,
+                               CREATE_ALWAYS,
+                               FILE_ATTRIBUTE_NORMAL,
+                               NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+    {
+        LOG(L"Failed to create digests %s, error code %d\n",
+            tempPath,
+            GetLastError());
+        return FALSE;
+    }
+    DWORD bytesWritten = 0;
+    BOOL result = WriteFile(hFile,
+                            header,
+                            sizeof(DigestHeader),
+                            &bytesWritten,
+                            NULL);
+    if (result && (header->folders > 0))
+    {
+        result = WriteFile(hFile,
+                           folders,
+                           header->folders * (DWORD) sizeof(DigestFolder),
+                           &bytesWritten,
+                           NULL);
+    }
+    CloseHandle(hFile);
+    if ((result == FALSE) ||
+        (MoveFileExW(tempPath,
+                     digestPath,
+                     MOVEFILE_REPLACE_EXISTING) == FALSE))
+    {
+        LOG(L"Failed to write digests %s, error code %d\n",
+            digestPath,
+            GetLastError());
+        DeleteFileW(tempPath);
+        return FALSE;
+    }
+    return TRUE;
+}
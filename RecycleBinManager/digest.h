@@ -0,0 +1,93 @@
+#define _CRT_SECURE_NO_WARNINGS
+
+#pragma once
+#include <Windows.h>
+#include <stdio.h>
+#include <assert.h>
+#include "catalog.h"
+
+// Catalog digest parameters. Building the catalog reads every $I file in
+// every bin folder, so after a restart or a missed notification the whole
+// bin used to be read again even when almost nothing in it had changed.
+// Next to the catalog we keep a digest tree of the bin: the root covers the
+// bin folder of each volume, each folder is split into DIGEST_BUCKETS
+// buckets by a hash of the $I file name, and each bucket is the sum of a
+// hash of the name, size and last write time of its $I files, all of which
+// come from listing the folder. The catalog records of a folder are written
+// bucket by bucket, so every bucket knows its range of records. Reconciling
+// walks the tree from the top. A folder whose last write time has not moved
+// since it was listed keeps its records from the old catalog without being
+// listed, which is safe because the shell writes a $I file once and never
+// changes it in place. A folder that has moved is listed again, which opens
+// nothing, and only the $I files in buckets whose digest changed are read.
+// If nothing changed, the catalog is not written at all. A folder written
+// less than DIGEST_SETTLE_SECONDS before it was listed is always listed
+// again, since FAT only keeps write times to two seconds.
+
+#define DIGEST_FILENAME         L"Digests.bin"
+#define DIGEST_MAGIC            0x44424D52 // "RMBD" when read as bytes
+#define DIGEST_VERSION          1
+#define DIGEST_BUCKETS          1024 // Per bin folder, must be a power of two
+#define DIGEST_MAX_FOLDERS      26 // One bin folder per drive letter
+#define DIGEST_SETTLE_SECONDS   2
+#define DIGEST_INITIAL_ENTRIES  1024 // $I files a listing has room for before it grows
+#define DIGEST_INITIAL_NAMES    (DIGEST_INITIAL_ENTRIES * 16) // In characters
+
+// Structs
+
+typedef struct DigestHeader
+{
+    DWORD magic; // Always DIGEST_MAGIC
+    DWORD version; // Always DIGEST_VERSION
+    DWORD headerSize; // sizeof(DigestHeader)
+    DWORD folderSize; // sizeof(DigestFolder)
+    DWORD folders; // DigestFolder entries that follow the header
+    DWORD buckets; // Always DIGEST_BUCKETS
+    ULONGLONG rootDigest; // Over the digest of every folder
+    ULONGLONG catalogItems; // The catalog these digests describe
+    ULONGLONG catalogBytes;
+    ULONGLONG catalogFileSize;
+    ULONGLONG catalogWriteTime; // Last write time of the catalog file
+} DigestHeader;
+
+typedef struct DigestBucket
+{
+    ULONGLONG digest; // Sum of the hashes of its $I files
+    DWORD entries; // $I files listed
+    DWORD firstRecord; // In the catalog
+    DWORD records; // Fewer than entries if a $I file could not be read
+    DWORD reserved;
+} DigestBucket;
+
+typedef struct DigestFolder
+{
+    wchar_t path[MAX_PATH + 1]; // The bin folder
+    DWORD volumeSerial;
+    ULONGLONG lastWriteTime; // Of the folder, just before it was listed
+    ULONGLONG listedTime; // FILETIME the folder was listed at
+    ULONGLONG digest; // Over the digest and entries of every bucket
+    DWORD firstRecord;
+    DWORD records;
+    DigestBucket buckets[DIGEST_BUCKETS];
+} DigestFolder;
+
+typedef struct CatalogReconcile
+{
+    DWORD folders; // Bin folders in the catalog
+    DWORD foldersListed; // Whose last write time had moved
+    DWORD bucketsRead; // Whose digest had changed
+    ULONGLONG itemsListed;
+    ULONGLONG itemsRead; // $I files opened
+    ULONGLONG itemsCopied; // Records kept from the old catalog
+    BOOL rewritten; // FALSE if the catalog was already up to date
+    double milliseconds;
+} CatalogReconcile;
+
+// Functions
+
+BOOL getDigestPath(wchar_t* digestPath, size_t cchDigestPath);
+BOOL reconcileCatalog(const wchar_t* catalogPath, BOOL full, CatalogReconcile* result);
+BOOL reconcileCatalogFolders(const wchar_t* catalogPath, const wchar_t* digestPath,
+                             const wchar_t** folders, const DWORD* volumeSerials,
+                             DWORD count, BOOL full, CatalogReconcile* result);
+void testCatalogDigests(void);
@@ -0,0 +1,537 @@
+/*
+* Walk and delete folder trees through handles instead of full paths
+*
+* Copyright(C) 2024 ERROR_SUCCESS Software
+*
+* This program is free software : you can redistribute it and /or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.If not, see < https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#include "dirtree.h"
+#include "throttle.h"
+#include "logger.h"
+
+// NtCreateFile is the only call that opens a file relative to a folder
+// handle, and ntdll.dll has no import library in the SDK
+typedef NTSTATUS (NTAPI* NtCreateFileFunction)(PHANDLE fileHandle, ACCESS_MASK desiredAccess,
+                                               POBJECT_ATTRIBUTES objectAttributes,
+                                               PIO_STATUS_BLOCK ioStatusBlock,
+                                               PLARGE_INTEGER allocationSize,
+                                               ULONG fileAttributes, ULONG shareAccess,
+                                               ULONG createDisposition, ULONG createOptions,
+                                               PVOID eaBuffer, ULONG eaLength);
+typedef ULONG (NTAPI* RtlNtStatusToDosErrorFunction)(NTSTATUS status);
+
+typedef struct DeleteListing
+{
+    Throttle* throttle;
+    BOOL complete; // Cleared when anything is left behind
+} DeleteListing;
+
+static NtCreateFileFunction ntCreateFile = NULL;
+static RtlNtStatusToDosErrorFunction rtlNtStatusToDosError = NULL;
+
+static BOOL deleteChild(HANDLE hDirectory, const DirEntry* entry, void* context);
+static BOOL isDotEntry(const DirEntry* entry);
+static BOOL loadNtFunctions(void);
+static BOOL sizeChild(HANDLE hDirectory, const DirEntry* entry, void* context);
+
+/// @brief turns a path into its \\?\ form, which is not limited to MAX_PATH.
+/// Relative paths are made full first.
+/// @param path the path
+/// @return the \\?\ path, NULL if it could not be built. Free it with
+///         HeapFree() on the process heap.
+wchar_t* allocLongPath(const wchar_t* path)
+{
+    DWORD cchFullPath = GetFullPathNameW(path,
+                                         0,
+                                         NULL,
+                                         NULL);
+    if (cchFullPath == 0)
+    {
+        return NULL;
+    }
+    wchar_t* fullPath = HeapAlloc(GetProcessHeap(),
+                                  0,
+                                  cchFullPath * sizeof(wchar_t));
+    if (fullPath == NULL) // Memory allocation failed
+    {
+        return NULL;
+    }
+    DWORD written = GetFullPathNameW(path,
+                                     cchFullPath,
+                                     fullPath,
+                                     NULL);
+    if ((written == 0) || (written >= cchFullPath))
+    {
+        HeapFree(GetProcessHeap(),
+                 0,
+                 fullPath);
+        return NULL;
+    }
+
+    // Device paths are left as they are, \\server\share becomes
+    // \\?\UNC\server\share and everything else gets \\?\ in front
+    const wchar_t* prefix = DIRTREE_LONG_PREFIX;
+    const wchar_t* rest = fullPath;
+    if ((wcsncmp(fullPath, L"\\\\?\\", 4) == 0) ||
+        (wcsncmp(fullPath, L"\\\\.\\", 4) == 0))
+    {
+        prefix = L"";
+    }
+    else if (wcsncmp(fullPath, L"\\\\", 2) == 0)
+    {
+        prefix = DIRTREE_LONG_UNC_PREFIX;
+        rest = fullPath + 2;
+    }
+    size_t cchLongPath = wcslen(prefix) + wcslen(rest) + 1;
+    wchar_t* longPath = HeapAlloc(GetProcessHeap(),
+                                  0,
+                                  cchLongPath * sizeof(wchar_t));
+    if (longPath != NULL)
+    {
+        _snwprintf(longPath,
+                   cchLongPath,
+                   L"%s%s",
+                   prefix,
+                   rest);
+        longPath[cchLongPath - 1] = 0;
+    }
+    HeapFree(GetProcessHeap(),
+             0,
+             fullPath);
+    return longPath;
+}
+
+/// @brief deletes one entry of a folder that is being deleted
+/// @param hDirectory the folder
+/// @param entry the entry
+/// @param context the DeleteListing
+/// @return TRUE to keep listing
+static BOOL deleteChild(HANDLE hDirectory,
+                        const DirEntry* entry,
+                        void* context)
+{
+    DeleteListing* listing = (DeleteListing*) context;
+    if (isDotEntry(entry))
+    {
+        return TRUE;
+    }
+    HANDLE hChild = openTreeChild(hDirectory,
+                                  entry,
+                                  DIRTREE_DELETE_ACCESS);
+    if (hChild == INVALID_HANDLE_VALUE)
+    {
+        DWORD error = GetLastError();
+        if ((error != ERROR_FILE_NOT_FOUND) && (error != ERROR_PATH_NOT_FOUND))
+        {
+            listing->complete = FALSE;
+        }
+        return TRUE;
+    }
+    if (deleteOpenTree(hChild,
+                       listing->throttle) == FALSE)
+    {
+        listing->complete = FALSE;
+    }
+    return TRUE;
+}
+
+/// @brief permanently deletes an open file, or an open folder and
+/// everything in it, then closes the handle. Junctions and symbolic links
+/// are removed without following them.
+/// @param hItem the file or folder, opened with DIRTREE_DELETE_ACCESS.
+/// It is closed whether or not the delete succeeds.
+/// @param throttle paces the deletes, NULL to delete at full speed
+/// @return TRUE if everything was deleted, FALSE if anything was left
+BOOL deleteOpenTree(HANDLE hItem,
+                    Throttle* throttle)
+{
+    BY_HANDLE_FILE_INFORMATION info = { 0 };
+    if (GetFileInformationByHandle(hItem,
+                                   &info) == FALSE)
+    {
+        CloseHandle(hItem);
+        return FALSE;
+    }
+    if (info.dwFileAttributes & FILE_ATTRIBUTE_READONLY)
+    {
+        // Zero times are left as they are, and so are zero attributes
+        FILE_BASIC_INFO basicInfo = { 0 };
+        basicInfo.FileAttributes = info.dwFileAttributes & ~FILE_ATTRIBUTE_READONLY;
+        if (basicInfo.FileAttributes == 0)
+        {
+            basicInfo.FileAttributes = FILE_ATTRIBUTE_NORMAL;
+        }
+        SetFileInformationByHandle(hItem,
+                                   FileBasicInfo,
+                                   &basicInfo,
+                                   sizeof(basicInfo));
+    }
+
+    ULONGLONG size = 0;
+    DeleteListing listing = { 0 };
+    listing.throttle = throttle;
+    listing.complete = TRUE;
+    if ((info.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) == 0)
+    {
+        size = ((ULONGLONG) info.nFileSizeHigh << 32) | info.nFileSizeLow;
+    }
+    else if (((info.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) == 0) &&
+             (listOpenDirectory(hItem, deleteChild, &listing) == FALSE))
+    {
+        listing.complete = FALSE;
+    }
+    return (throttledDeleteHandle(throttle,
+                                  hItem,
+                                  size) && listing.complete);
+}
+
+/// @brief checks for the . and .. entries every folder listing starts with
+/// @param entry the entry
+/// @return TRUE if it is one of them
+static BOOL isDotEntry(const DirEntry* entry)
+{
+    return (((entry->nameLength == 1) && (entry->name[0] == L'.')) ||
+            ((entry->nameLength == 2) && (entry->name[0] == L'.') && (entry->name[1] == L'.')));
+}
+
+/// @brief calls the callback for every entry in an open folder, including
+/// . and .., fetching entries in large batches straight from the handle
+/// @param hDirectory the folder, opened with FILE_LIST_DIRECTORY access
+/// @param callback the function to call for each entry
+/// @param context passed through to the callback unchanged
+/// @return TRUE if the folder was listed or the callback stopped the
+///         listing, FALSE if it could not be read
+BOOL listOpenDirectory(HANDLE hDirectory,
+                       DirEntryCallback callback,
+                       void* context)
+{
+    BYTE* buffer = HeapAlloc(GetProcessHeap(),
+                             0,
+                             DIRTREE_LIST_BUFFER_BYTES);
+    if (buffer == NULL) // Memory allocation failed
+    {
+        return FALSE;
+    }
+
+    // The first call starts from the top in case the handle was listed before
+    BOOL result = TRUE;
+    BOOL keepGoing = TRUE;
+    FILE_INFO_BY_HANDLE_CLASS infoClass = FileFullDirectoryRestartInfo;
+    while (keepGoing)
+    {
+        if (GetFileInformationByHandleEx(hDirectory,
+                                         infoClass,
+                                         buffer,
+                                         DIRTREE_LIST_BUFFER_BYTES) == FALSE)
+        {
+            result = (GetLastError() == ERROR_NO_MORE_FILES);
+            break;
+        }
+        infoClass = FileFullDirectoryInfo;
+
+        FILE_FULL_DIR_INFO* info = (FILE_FULL_DIR_INFO*) buffer;
+        for (;;)
+        {
+            DirEntry entry = { 0 };
+            entry.name = info->FileName;
+            entry.nameLength = info->FileNameLength / sizeof(wchar_t);
+            entry.attributes = info->FileAttributes;
+            if ((info->FileAttributes & FILE_ATTRIBUTE_DIRECTORY) == 0)
+            {
+                entry.size = (ULONGLONG) info->EndOfFile.QuadPart;
+            }
+            if (callback(hDirectory, &entry, context) == FALSE)
+            {
+                keepGoing = FALSE;
+                break;
+            }
+            if (info->NextEntryOffset == 0)
+            {
+                break;
+            }
+            info = (FILE_FULL_DIR_INFO*) ((BYTE*) info + info->NextEntryOffset);
+        }
+    }
+
+    HeapFree(GetProcessHeap(),
+             0,
+             buffer);
+    return result;
+}
+
+/// @brief looks up the ntdll.dll functions the first time they are needed
+/// @param none
+/// @return TRUE if they are available
+static BOOL loadNtFunctions(void)
+{
+    if (ntCreateFile == NULL)
+    {
+        HMODULE hNtdll = GetModuleHandleW(L"ntdll.dll");
+        if (hNtdll == NULL)
+        {
+            return FALSE;
+        }
+
+        // Set last, so a thread that sees it also sees the other one
+        rtlNtStatusToDosError = (RtlNtStatusToDosErrorFunction) GetProcAddress(hNtdll,
+                                                                               "RtlNtStatusToDosError");
+        ntCreateFile = (NtCreateFileFunction) GetProcAddress(hNtdll,
+                                                             "NtCreateFile");
+    }
+    return ((ntCreateFile != NULL) && (rtlNtStatusToDosError != NULL));
+}
+
+/// @brief opens an entry of an open folder by its name alone, without
+/// following it if it is a junction or symbolic link
+/// @param hDirectory the folder the entry was listed from
+/// @param entry the entry
+/// @param access the access needed, DIRTREE_READ_ACCESS or
+/// DIRTREE_DELETE_ACCESS
+/// @return the handle, INVALID_HANDLE_VALUE if it could not be opened
+///         with the reason in GetLastError()
+HANDLE openTreeChild(HANDLE hDirectory,
+                     const DirEntry* entry,
+                     DWORD access)
+{
+    if (loadNtFunctions() == FALSE)
+    {
+        SetLastError(ERROR_PROC_NOT_FOUND);
+        return INVALID_HANDLE_VALUE;
+    }
+
+    // Names in a listing are exact, so the lookup does not ignore case
+    UNICODE_STRING name = { 0 };
+    name.Buffer = (PWSTR) entry->name;
+    name.Length = (USHORT) (entry->nameLength * sizeof(wchar_t));
+    name.MaximumLength = name.Length;
+    OBJECT_ATTRIBUTES objectAttributes = { 0 };
+    InitializeObjectAttributes(&objectAttributes,
+                               &name,
+                               0,
+                               hDirectory,
+                               NULL);
+    IO_STATUS_BLOCK ioStatus = { 0 };
+    HANDLE hChild = NULL;
+    NTSTATUS status = ntCreateFile(&hChild,
+                                   access | SYNCHRONIZE,
+                                   &objectAttributes,
+                                   &ioStatus,
+                                   NULL,
+                                   0,
+                                   FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                                   FILE_OPEN,
+                                   FILE_OPEN_REPARSE_POINT | FILE_OPEN_FOR_BACKUP_INTENT |
+                                   FILE_SYNCHRONOUS_IO_NONALERT,
+                                   NULL,
+                                   0);
+    if (status < 0) // Warnings and errors
+    {
+        SetLastError(rtlNtStatusToDosError(status));
+        return INVALID_HANDLE_VALUE;
+    }
+    return hChild;
+}
+
+/// @brief opens a file or folder by path to walk it, without following
+/// it if it is a junction or symbolic link. The path can be longer than
+/// MAX_PATH.
+/// @param path the path
+/// @param access the access needed, DIRTREE_READ_ACCESS or
+/// DIRTREE_DELETE_ACCESS
+/// @return the handle, INVALID_HANDLE_VALUE if it could not be opened
+///         with the reason in GetLastError()
+HANDLE openTreePath(const wchar_t* path,
+                    DWORD access)
+{
+    wchar_t* longPath = allocLongPath(path);
+    if (longPath == NULL)
+    {
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return INVALID_HANDLE_VALUE;
+    }
+    HANDLE hItem = CreateFileW(longPath,
+                               access,
+                               FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                               NULL,
+                               OPEN_EXISTING,
+                               FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OPEN_REPARSE_POINT,
+                               NULL);
+    DWORD error = GetLastError();
+    HeapFree(GetProcessHeap(),
+             0,
+             longPath);
+    SetLastError(error);
+    return hItem;
+}
+
+/// @brief adds the size of one entry of a folder that is being sized
+/// @param hDirectory the folder
+/// @param entry the entry
+/// @param context the running total, a ULONGLONG
+/// @return TRUE to keep listing
+static BOOL sizeChild(HANDLE hDirectory,
+                      const DirEntry* entry,
+                      void* context)
+{
+    ULONGLONG* size = (ULONGLONG*) context;
+    if (isDotEntry(entry))
+    {
+        return TRUE;
+    }
+    if ((entry->attributes & FILE_ATTRIBUTE_DIRECTORY) == 0)
+    {
+        *size += entry->size;
+        return TRUE;
+    }
+    if (entry->attributes & FILE_ATTRIBUTE_REPARSE_POINT)
+    {
+        return TRUE; // Don't follow junctions out of the tree
+    }
+    HANDLE hChild = openTreeChild(hDirectory,
+                                  entry,
+                                  DIRTREE_READ_ACCESS);
+    if (hChild != INVALID_HANDLE_VALUE)
+    {
+        *size += sizeOpenTree(hChild);
+        CloseHandle(hChild);
+    }
+    return TRUE;
+}
+
+/// @brief adds up the size of an open file, or of every file in an open
+/// folder and the folders below it. Junctions are not followed.
+/// @param hItem the file or folder, opened with DIRTREE_READ_ACCESS
+/// @return the size in bytes, 0 if it could not be read
+ULONGLONG sizeOpenTree(HANDLE hItem)
+{
+    BY_HANDLE_FILE_INFORMATION info = { 0 };
+    if (GetFileInformationByHandle(hItem,
+                                   &info) == FALSE)
+    {
+        return 0;
+    }
+    if ((info.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) == 0)
+    {
+        return ((ULONGLONG) info.nFileSizeHigh << 32) | info.nFileSizeLow;
+    }
+    ULONGLONG size = 0;
+    if ((info.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) == 0)
+    {
+        listOpenDirectory(hItem,
+                          sizeChild,
+                          &size);
+    }
+    return size;
+}
+
+/// @brief builds a folder tree far deeper than MAX_PATH, then sizes and
+/// deletes it through handles in a debug build, returns immediately in a
+/// release build
+/// @param none
+void testDirTree(void)
+{
+#ifndef NDEBUG
+    const DWORD depth = 24;
+    const wchar_t* levelName = L"level-abcdefghijklmnop"; // Deep enough to pass MAX_PATH
+
+    wchar_t tempDirectory[MAX_PATH + 1] = { 0 };
+    wchar_t root[MAX_PATH + 1] = { 0 };
+    GetTempPathW(ARRAYSIZE(tempDirectory),
+                 tempDirectory);
+    _snwprintf(root,
+               ARRAYSIZE(root),
+               L"%srbmdirtree%08X",
+               tempDirectory,
+               GetCurrentProcessId());
+    root[MAX_PATH] = 0;
+
+    // \\?\ paths only hold full paths, so the test can build on the end of it
+    wchar_t* longRoot = allocLongPath(root);
+    assert(longRoot != NULL);
+    assert(wcsncmp(longRoot, DIRTREE_LONG_PREFIX, wcslen(DIRTREE_LONG_PREFIX)) == 0);
+    size_t cchPath = wcslen(longRoot) + (depth * (wcslen(levelName) + 1)) + 16;
+    wchar_t* path = HeapAlloc(GetProcessHeap(),
+                              HEAP_ZERO_MEMORY,
+                              cchPath * sizeof(wchar_t));
+    assert(path != NULL);
+    wcscpy(path,
+           longRoot);
+    BOOL result = CreateDirectoryW(path,
+                                   NULL);
+    assert(result);
+
+    // A file at every level, with the last one read only
+    ULONGLONG expectedSize = 0;
+    for (DWORD level = 0; level < depth; level++)
+    {
+        wcscat(path, L"\\");
+        wcscat(path, levelName);
+        result = CreateDirectoryW(path,
+                                  NULL);
+        assert(result);
+
+        size_t folderLength = wcslen(path);
+        wcscat(path, L"\\data.bin");
+        HANDLE hFile = CreateFileW(path,
+                                   GENERIC_WRITE,
+                                   0,
+                                   NULL,
+                                   CREATE_ALWAYS,
+                                   FILE_ATTRIBUTE_NORMAL,
+                                   NULL);
+        assert(hFile != INVALID_HANDLE_VALUE);
+        LARGE_INTEGER fileSize = { 0 };
+        fileSize.QuadPart = (level + 1) * 1000;
+        SetFilePointerEx(hFile,
+                         fileSize,
+                         NULL,
+                         FILE_BEGIN);
+        SetEndOfFile(hFile);
+        CloseHandle(hFile);
+        expectedSize += fileSize.QuadPart;
+        if (level == depth - 1)
+        {
+            SetFileAttributesW(path,
+                               FILE_ATTRIBUTE_READONLY);
+        }
+        path[folderLength] = 0;
+    }
+    assert(wcslen(path) > MAX_PATH);
+
+    // Sizing sees every level
+    HANDLE hRoot = openTreePath(root,
+                                DIRTREE_READ_ACCESS);
+    assert(hRoot != INVALID_HANDLE_VALUE);
+    assert(sizeOpenTree(hRoot) == expectedSize);
+    CloseHandle(hRoot);
+
+    // Deleting leaves nothing, including the read only file
+    hRoot = openTreePath(root,
+                         DIRTREE_DELETE_ACCESS);
+    assert(hRoot != INVALID_HANDLE_VALUE);
+    result = deleteOpenTree(hRoot,
+                            NULL);
+    assert(result);
+    assert(GetFileAttributesW(longRoot) == INVALID_FILE_ATTRIBUTES);
+
+    HeapFree(GetProcessHeap(),
+             0,
+             path);
+    HeapFree(GetProcessHeap(),
+             0,
+             longRoot);
+#endif
+}
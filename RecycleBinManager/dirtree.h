@@ -0,0 +1,48 @@
+#define _CRT_SECURE_NO_WARNINGS
+
+#pragma once
+#include <Windows.h>
+#include <winternl.h>
+#include <stdio.h>
+#include <assert.h>
+#include "throttle.h"
+
+// Folder tree parameters. Trees are walked through handles instead of
+// paths: a folder is opened once, listed in large batches straight from
+// its handle, and each child is opened relative to it by name. Nothing
+// ever builds the full path of an item below the root, so a tree can be as
+// deep as the file system allows, well past MAX_PATH, and going down a
+// level costs one open rather than formatting and parsing a longer path
+// each time. The root itself is opened through its \\?\ form, which has no
+// length limit either.
+
+#define DIRTREE_LIST_BUFFER_BYTES   (64 * 1024) // Directory entries fetched per call
+#define DIRTREE_LONG_PREFIX         L"\\\\?\\"
+#define DIRTREE_LONG_UNC_PREFIX     L"\\\\?\\UNC\\" // Replaces the leading \\ of a UNC path
+#define DIRTREE_READ_ACCESS         (FILE_LIST_DIRECTORY | FILE_READ_ATTRIBUTES | SYNCHRONIZE)
+#define DIRTREE_DELETE_ACCESS       (DELETE | FILE_LIST_DIRECTORY | FILE_READ_ATTRIBUTES | \
+                                     FILE_WRITE_ATTRIBUTES | SYNCHRONIZE)
+
+// Structs
+
+typedef struct DirEntry
+{
+    const wchar_t* name; // Not terminated
+    DWORD nameLength; // In characters
+    DWORD attributes;
+    ULONGLONG size; // 0 for folders
+} DirEntry;
+
+/// @brief called once for every entry in a folder listed by handle
+/// @return TRUE to continue listing, FALSE to stop
+typedef BOOL (*DirEntryCallback)(HANDLE hDirectory, const DirEntry* entry, void* context);
+
+// Functions
+
+wchar_t* allocLongPath(const wchar_t* path);
+BOOL deleteOpenTree(HANDLE hItem, Throttle* throttle);
+BOOL listOpenDirectory(HANDLE hDirectory, DirEntryCallback callback, void* context);
+HANDLE openTreeChild(HANDLE hDirectory, const DirEntry* entry, DWORD access);
+HANDLE openTreePath(const wchar_t* path, DWORD access);
+ULONGLONG sizeOpenTree(HANDLE hItem);
+void testDirTree(void);
@@ -0,0 +1,781 @@
+/*
+* Estimate the size of a large folder tree from a random sample of paths
+*
+* Copyright(C) 2024 ERROR_SUCCESS Software
+*
+* This program is free software : you can redistribute it and /or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.If not, see < https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#include "estimate.h"
+#include "bin.h"
+#include "catalog.h"
+#include "reclaim.h"
+#include "throttle.h"
+#include "logger.h"
+
+#define ESTIMATE_MIN_SAMPLES 2 // Needed for a spread, even past the budget
+
+typedef struct RootListing
+{
+    const TreeSampler* sampler;
+    ULONGLONG* random;
+    const wchar_t* path;
+    double items;
+    double bytes;
+    ULONGLONG directories; // Folders seen, sampled or not
+    wchar_t (*samples)[MAX_PATH + 1]; // A uniform random sample of the folders
+    DWORD sampleCount;
+    DWORD sampleCapacity;
+} RootListing;
+
+typedef struct NodeListing
+{
+    ULONGLONG* random;
+    const wchar_t* path;
+    double items;
+    double bytes;
+    ULONGLONG directories;
+    wchar_t child[MAX_PATH + 1]; // One folder picked at random, empty if too long
+} NodeListing;
+
+typedef struct CountListing
+{
+    TreeLister lister;
+    void* listerContext;
+    const wchar_t* path;
+    TreeCount* count;
+    BOOL complete;
+} CountListing;
+
+static BOOL collectNodeEntry(const TreeEntry* entry, void* context);
+static BOOL collectRootEntry(const TreeEntry* entry, void* context);
+static BOOL countEntry(const TreeEntry* entry, void* context);
+static void followRandomPath(TreeSampler* sampler, const wchar_t* start,
+                             TreeEstimate* estimate, DWORD* listings,
+                             double* items, double* bytes, BOOL* inexact);
+static double getDeleteSeconds(double items, double bytes, double itemsPerSecond,
+                               double bytesPerSecond);
+static ULONGLONG nextRandom(ULONGLONG* state);
+#ifndef NDEBUG
+typedef struct SyntheticTree
+{
+    DWORD rootFolders; // Folders at the top
+    DWORD maxBranch; // Most folders in a folder below the top
+    DWORD maxDepth;
+    DWORD maxFiles; // Most files in a folder
+} SyntheticTree;
+
+static BOOL listSyntheticTree(const wchar_t* path, TreeEntryCallback callback,
+                              void* callbackContext, void* listerContext);
+#endif
+
+/// @brief counts one entry of a folder on a random path, and keeps it as
+/// the next step of the path with the right odds if it is a folder
+/// @param entry the entry
+/// @param context the NodeListing
+/// @return TRUE to keep listing
+static BOOL collectNodeEntry(const TreeEntry* entry,
+                             void* context)
+{
+    NodeListing* listing = (NodeListing*) context;
+    listing->items += 1.0;
+    listing->bytes += (double) entry->size;
+    if (entry->directory == FALSE)
+    {
+        return TRUE;
+    }
+
+    // Reservoir of one: the n-th folder replaces the pick with odds 1/n
+    listing->directories++;
+    if ((nextRandom(listing->random) % listing->directories) == 0)
+    {
+        int written = _snwprintf(listing->child,
+                                 ARRAYSIZE(listing->child),
+                                 L"%s\\%s",
+                                 listing->path,
+                                 entry->name);
+        listing->child[MAX_PATH] = 0;
+        if ((written < 0) || (written > MAX_PATH))
+        {
+            listing->child[0] = 0;
+        }
+    }
+    return TRUE;
+}
+
+/// @brief counts one entry at the top of a tree, and keeps a uniform
+/// random sample of the folders
+/// @param entry the entry
+/// @param context the RootListing
+/// @return TRUE to keep listing, FALSE if a folder path is too long
+static BOOL collectRootEntry(const TreeEntry* entry,
+                             void* context)
+{
+    RootListing* listing = (RootListing*) context;
+    const wchar_t* skipPrefix = listing->sampler->skipPrefix;
+    if ((skipPrefix != NULL) &&
+        (wcsncmp(entry->name, skipPrefix, wcslen(skipPrefix)) == 0))
+    {
+        return TRUE;
+    }
+    listing->items += 1.0;
+    listing->bytes += (double) entry->size;
+    if (entry->directory == FALSE)
+    {
+        return TRUE;
+    }
+
+    // Reservoir sampling: the first folders fill the sample, after that
+    // the n-th folder takes a random slot with odds capacity/n
+    listing->directories++;
+    DWORD slot = listing->sampleCount;
+    if (listing->sampleCount == listing->sampleCapacity)
+    {
+        ULONGLONG pick = nextRandom(listing->random) % listing->directories;
+        if (pick >= listing->sampleCapacity)
+        {
+            return TRUE;
+        }
+        slot = (DWORD) pick;
+    }
+    else
+    {
+        listing->sampleCount++;
+    }
+    int written = _snwprintf(listing->samples[slot],
+                             MAX_PATH + 1,
+                             L"%s\\%s",
+                             listing->path,
+                             entry->name);
+    listing->samples[slot][MAX_PATH] = 0;
+    if ((written < 0) || (written > MAX_PATH))
+    {
+        listing->samples[slot][0] = 0;
+    }
+    return TRUE;
+}
+
+/// @brief counts every entry below a folder by listing all of it. This
+/// costs as much as deleting it; it is here to check estimates against.
+/// @param root the folder
+/// @param lister lists each folder
+/// @param listerContext passed to the lister
+/// @param count has the entries below root added to it
+/// @return TRUE if every folder could be listed
+BOOL countTree(const wchar_t* root,
+               TreeLister lister,
+               void* listerContext,
+               TreeCount* count)
+{
+    CountListing listing = { lister, listerContext, root, count, TRUE };
+    if (lister(root,
+               countEntry,
+               &listing,
+               listerContext) == FALSE)
+    {
+        return FALSE;
+    }
+    count->listings++;
+    return listing.complete;
+}
+
+/// @brief counts one entry for countTree(), going into it if it is a folder
+/// @param entry the entry
+/// @param context the CountListing
+/// @return TRUE to keep listing
+static BOOL countEntry(const TreeEntry* entry,
+                       void* context)
+{
+    CountListing* listing = (CountListing*) context;
+    listing->count->items++;
+    listing->count->bytes += entry->size;
+    if (entry->directory == FALSE)
+    {
+        return TRUE;
+    }
+    wchar_t childPath[MAX_PATH + 1] = { 0 };
+    int written = _snwprintf(childPath,
+                             ARRAYSIZE(childPath),
+                             L"%s\\%s",
+                             listing->path,
+                             entry->name);
+    childPath[MAX_PATH] = 0;
+    if ((written < 0) || (written > MAX_PATH) ||
+        (countTree(childPath, listing->lister, listing->listerContext, listing->count) == FALSE))
+    {
+        listing->complete = FALSE;
+    }
+    return TRUE;
+}
+
+/// @brief estimates how much there is to delete in the current user's bin
+/// on every volume, and how long deleting it will take
+/// @param budget the most folders to list across all volumes
+/// @param milliseconds the most time to spend, 0 for no limit
+/// @param throttled TRUE if the delete will go through the throttle set in
+/// Settings.ini, FALSE if it runs at full speed
+/// @param estimate receives the estimate
+/// @return TRUE if every bin could be read, FALSE if the estimate is missing
+///         some of them
+BOOL estimateEmptyCost(DWORD budget,
+                       DWORD milliseconds,
+                       BOOL throttled,
+                       TreeEstimate* estimate)
+{
+    initTreeEstimate(estimate);
+    wchar_t binDirectories[26][MAX_PATH + 1] = { 0 };
+    DWORD binCount = 0;
+    for (wchar_t driveLetter = L'A'; driveLetter <= L'Z'; driveLetter++)
+    {
+        if (getBinDirectory(driveLetter,
+                            binDirectories[binCount],
+                            ARRAYSIZE(binDirectories[binCount])))
+        {
+            binCount++;
+        }
+    }
+
+    TreeSampler sampler = { 0 };
+    sampler.lister = listDirectory;
+    sampler.deadline = (milliseconds > 0) ? GetTickCount64() + milliseconds : 0;
+    sampler.skipPrefix = RECLAIM_STAGING_PREFIX; // Already emptied
+    sampler.random = (GetTickCount64() * 0x9E3779B97F4A7C15ULL) ^
+        ((ULONGLONG) GetCurrentProcessId() << 32) ^ 1;
+    BOOL result = TRUE;
+    for (DWORD i = 0; i < binCount; i++)
+    {
+        // Share what is left of the budget between the bins still to go
+        DWORD remaining = (budget > estimate->listings) ? budget - estimate->listings : 0;
+        sampler.budget = remaining / (binCount - i);
+        if (estimateTree(&sampler,
+                         binDirectories[i],
+                         estimate) == FALSE)
+        {
+            result = FALSE;
+        }
+    }
+
+    // The shell records the size of every item, so when the catalog has the
+    // total there is no need to sample bytes. A few large files usually
+    // make up most of a bin, which makes bytes the weaker half of a sample.
+    wchar_t catalogPath[MAX_PATH + 1] = { 0 };
+    CatalogHeader header = { 0 };
+    if (getCatalogPath(catalogPath, ARRAYSIZE(catalogPath)) &&
+        readCatalogHeader(catalogPath, &header))
+    {
+        estimate->bytes = (double) header.totalBytes;
+        estimate->bytesVariance = 0.0;
+    }
+
+    double itemsPerSecond = ESTIMATE_ITEMS_PER_SECOND;
+    double bytesPerSecond = THROTTLE_UNLIMITED;
+    if (throttled)
+    {
+        Throttle throttle = { 0 };
+        loadThrottleSettings(&throttle);
+        if ((throttle.files.rate > THROTTLE_UNLIMITED) &&
+            (throttle.files.rate < itemsPerSecond))
+        {
+            itemsPerSecond = throttle.files.rate;
+        }
+        bytesPerSecond = throttle.bytes.rate;
+    }
+    finishTreeEstimate(estimate,
+                       itemsPerSecond,
+                       bytesPerSecond);
+    LOG(L"Estimated %.0f items and %.0f bytes from %u samples and %u listings\n",
+        estimate->items,
+        estimate->bytes,
+        estimate->samples,
+        estimate->listings);
+    return result;
+}
+
+/// @brief adds the estimated size of one tree to an estimate. The top of
+/// the tree is counted exactly, and a random path is followed down from
+/// each sampled folder until the budget runs out.
+/// @param sampler how to list folders and how much to spend. Its random
+/// state moves on.
+/// @param root the top of the tree, without a trailing backslash
+/// @param estimate has the tree added to it
+/// @return TRUE on success, FALSE if the top of the tree could not be
+///         listed or memory ran out
+BOOL estimateTree(TreeSampler* sampler,
+                  const wchar_t* root,
+                  TreeEstimate* estimate)
+{
+    assert(sampler->random != 0);
+    RootListing listing = { 0 };
+    listing.sampler = sampler;
+    listing.random = &sampler->random;
+    listing.path = root;
+    listing.sampleCapacity = (sampler->budget < ESTIMATE_MAX_SAMPLES) ?
+        sampler->budget : ESTIMATE_MAX_SAMPLES;
+    if (listing.sampleCapacity < ESTIMATE_MIN_SAMPLES)
+    {
+        listing.sampleCapacity = ESTIMATE_MIN_SAMPLES;
+    }
+    listing.samples = HeapAlloc(GetProcessHeap(),
+                                0,
+                                listing.sampleCapacity * sizeof(*listing.samples));
+    if (listing.samples == NULL)
+    {
+        // Memory allocation failed
+        estimate->exact = FALSE;
+        return FALSE;
+    }
+    if (sampler->lister(root,
+                        collectRootEntry,
+                        &listing,
+                        sampler->listerContext) == FALSE)
+    {
+        LOG(L"Listing %s for the estimate failed\n",
+            root);
+        estimate->unreadable++;
+        estimate->exact = FALSE;
+        HeapFree(GetProcessHeap(),
+                 0,
+                 listing.samples);
+        return FALSE;
+    }
+    DWORD listings = 1;
+    estimate->listings++;
+    estimate->items += listing.items;
+    estimate->bytes += listing.bytes;
+
+    // The sample is filled in listing order until it overflows, so shuffle
+    // it: stopping early then still leaves a uniform random sample
+    for (DWORD i = listing.sampleCount; i > 1; i--)
+    {
+        DWORD j = (DWORD) (nextRandom(&sampler->random) % i);
+        wchar_t swap[MAX_PATH + 1];
+        wcscpy(swap, listing.samples[i - 1]);
+        wcscpy(listing.samples[i - 1], listing.samples[j]);
+        wcscpy(listing.samples[j], swap);
+    }
+
+    DWORD samples = 0;
+    BOOL inexact = FALSE;
+    double itemsSum = 0.0;
+    double itemsSquares = 0.0;
+    double bytesSum = 0.0;
+    double bytesSquares = 0.0;
+    while ((samples < listing.sampleCount) &&
+           ((samples < ESTIMATE_MIN_SAMPLES) ||
+            ((listings < sampler->budget) &&
+             ((sampler->deadline == 0) || (GetTickCount64() < sampler->deadline)))))
+    {
+        double items = 0.0;
+        double bytes = 0.0;
+        if (listing.samples[samples][0] == 0)
+        {
+            inexact = TRUE; // The path was too long to follow
+        }
+        else
+        {
+            followRandomPath(sampler,
+                             listing.samples[samples],
+                             estimate,
+                             &listings,
+                             &items,
+                             &bytes,
+                             &inexact);
+        }
+        itemsSum += items;
+        itemsSquares += items * items;
+        bytesSum += bytes;
+        bytesSquares += bytes * bytes;
+        samples++;
+    }
+    HeapFree(GetProcessHeap(),
+             0,
+             listing.samples);
+    estimate->samples += samples;
+    if (listing.directories == 0)
+    {
+        return TRUE;
+    }
+
+    // Each folder at the top is estimated by the mean of the sampled ones
+    double folders = (double) listing.directories;
+    double n = (double) samples;
+    double itemsMean = itemsSum / n;
+    double bytesMean = bytesSum / n;
+    estimate->items += folders * itemsMean;
+    estimate->bytes += folders * bytesMean;
+    if ((samples == listing.directories) && (inexact == FALSE))
+    {
+        return TRUE; // Every folder was listed
+    }
+    estimate->exact = FALSE;
+    if (samples < ESTIMATE_MIN_SAMPLES)
+    {
+        // One sample has no spread, so allow for being off by all of it
+        estimate->itemsVariance += (folders * itemsMean) * (folders * itemsMean);
+        estimate->bytesVariance += (folders * bytesMean) * (folders * bytesMean);
+        return TRUE;
+    }
+    double itemsSpread = (itemsSquares - n * itemsMean * itemsMean) / (n - 1.0);
+    double bytesSpread = (bytesSquares - n * bytesMean * bytesMean) / (n - 1.0);
+    // When every path stopped at its first folder, the sample is the only
+    // source of error and shrinks as it covers more of the top
+    double correction = (inexact) ? 1.0 : 1.0 - (n / folders);
+    estimate->itemsVariance += folders * folders * max(itemsSpread, 0.0) / n * correction;
+    estimate->bytesVariance += folders * folders * max(bytesSpread, 0.0) / n * correction;
+    return TRUE;
+}
+
+/// @brief works out the confidence intervals and the time to delete once
+/// every tree has been added to an estimate
+/// @param estimate the estimate
+/// @param itemsPerSecond how many files and folders are deleted per second
+/// @param bytesPerSecond how many bytes are deleted per second,
+/// THROTTLE_UNLIMITED if that is no limit
+void finishTreeEstimate(TreeEstimate* estimate,
+                        double itemsPerSecond,
+                        double bytesPerSecond)
+{
+    assert(itemsPerSecond > 0.0);
+    if (estimate->exact)
+    {
+        estimate->itemsMargin = 0.0;
+        estimate->bytesMargin = 0.0;
+    }
+    else
+    {
+        estimate->itemsMargin = ESTIMATE_Z_95 * sqrt(estimate->itemsVariance);
+        estimate->bytesMargin = ESTIMATE_Z_95 * sqrt(estimate->bytesVariance);
+    }
+    estimate->seconds = getDeleteSeconds(estimate->items,
+                                         estimate->bytes,
+                                         itemsPerSecond,
+                                         bytesPerSecond);
+    estimate->secondsMargin = getDeleteSeconds(estimate->items + estimate->itemsMargin,
+                                               estimate->bytes + estimate->bytesMargin,
+                                               itemsPerSecond,
+                                               bytesPerSecond) - estimate->seconds;
+}
+
+/// @brief follows one random path down from a folder, listing each folder
+/// on the way. Every folder passed over stands in for its siblings, so the
+/// entries at each level count once for every path that could have been
+/// taken to get there.
+/// @param sampler how to list folders
+/// @param start the folder to start from
+/// @param estimate counts the listings and unreadable folders
+/// @param listings counts the listings for the current tree
+/// @param items receives the estimated entries below start
+/// @param bytes receives the estimated bytes below start
+/// @param inexact set to TRUE if any folder had more than one folder in it,
+/// so the path was a guess rather than the only way down
+static void followRandomPath(TreeSampler* sampler,
+                             const wchar_t* start,
+                             TreeEstimate* estimate,
+                             DWORD* listings,
+                             double* items,
+                             double* bytes,
+                             BOOL* inexact)
+{
+    wchar_t path[MAX_PATH + 1] = { 0 };
+    wcscpy(path, start);
+    double weight = 1.0;
+    for (;;)
+    {
+        NodeListing listing = { 0 };
+        listing.random = &sampler->random;
+        listing.path = path;
+        if (sampler->lister(path,
+                            collectNodeEntry,
+                            &listing,
+                            sampler->listerContext) == FALSE)
+        {
+            estimate->unreadable++;
+            *inexact = TRUE;
+            return;
+        }
+        (*listings)++;
+        estimate->listings++;
+        *items += weight * listing.items;
+        *bytes += weight * listing.bytes;
+        if (listing.directories == 0)
+        {
+            return;
+        }
+        if ((listing.directories > 1) || (listing.child[0] == 0))
+        {
+            *inexact = TRUE;
+        }
+        if (listing.child[0] == 0)
+        {
+            return; // The path was too long to follow
+        }
+        weight *= (double) listing.directories;
+        wcscpy(path, listing.child);
+    }
+}
+
+/// @brief works out how long deleting takes at the given rates
+/// @param items files and folders to delete
+/// @param bytes bytes to delete
+/// @param itemsPerSecond files and folders deleted per second
+/// @param bytesPerSecond bytes deleted per second, THROTTLE_UNLIMITED for no limit
+/// @return the time in seconds, whichever limit is hit first
+static double getDeleteSeconds(double items,
+                               double bytes,
+                               double itemsPerSecond,
+                               double bytesPerSecond)
+{
+    double seconds = items / itemsPerSecond;
+    if ((bytesPerSecond > THROTTLE_UNLIMITED) &&
+        (bytes / bytesPerSecond > seconds))
+    {
+        seconds = bytes / bytesPerSecond;
+    }
+    return seconds;
+}
+
+/// @brief starts an empty estimate, to add trees to with estimateTree()
+/// @param estimate the estimate
+void initTreeEstimate(TreeEstimate* estimate)
+{
+    ZeroMemory(estimate,
+               sizeof(*estimate));
+    estimate->exact = TRUE;
+}
+
+/// @brief lists a folder on disk. Links are listed as files, since they are
+/// deleted without being followed.
+/// @param path the folder
+/// @param callback called for every entry
+/// @param callbackContext passed to the callback
+/// @param listerContext not used
+/// @return TRUE if the folder was listed, FALSE if it could not be opened
+BOOL listDirectory(const wchar_t* path,
+                   TreeEntryCallback callback,
+                   void* callbackContext,
+                   void* listerContext)
+{
+    UNREFERENCED_PARAMETER(listerContext);
+    wchar_t searchPattern[MAX_PATH + 1] = { 0 };
+    int written = _snwprintf(searchPattern,
+                             ARRAYSIZE(searchPattern),
+                             L"%s\\*",
+                             path);
+    searchPattern[MAX_PATH] = 0;
+    if ((written < 0) || (written > MAX_PATH))
+    {
+        return FALSE;
+    }
+    WIN32_FIND_DATAW findData = { 0 };
+    HANDLE hFind = FindFirstFileExW(searchPattern,
+                                    FindExInfoBasic,
+                                    &findData,
+                                    FindExSearchNameMatch,
+                                    NULL,
+                                    FIND_FIRST_EX_LARGE_FETCH);
+    if (hFind == INVALID_HANDLE_VALUE)
+    {
+        return FALSE;
+    }
+    do
+    {
+        if ((wcscmp(findData.cFileName, L".") == 0) ||
+            (wcscmp(findData.cFileName, L"..") == 0))
+        {
+            continue;
+        }
+        TreeEntry entry = { 0 };
+        entry.name = findData.cFileName;
+        entry.directory = ((findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) &&
+                           ((findData.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) == 0));
+        if (entry.directory == FALSE)
+        {
+            entry.size = ((ULONGLONG) findData.nFileSizeHigh << 32) | findData.nFileSizeLow;
+        }
+        if (callback(&entry, callbackContext) == FALSE)
+        {
+            break;
+        }
+    } while (FindNextFileW(hFind, &findData));
+    FindClose(hFind);
+    return TRUE;
+}
+
+#ifndef NDEBUG
+/// @brief lists a folder of a synthetic tree that exists only in memory.
+/// What a folder holds is worked out from a hash of its path, so the same
+/// path always lists the same way and the tree can be as big as needed.
+/// @param path the folder, the root is L"T"
+/// @param callback called for every entry
+/// @param callbackContext passed to the callback
+/// @param listerContext the SyntheticTree
+/// @return TRUE
+static BOOL listSyntheticTree(const wchar_t* path,
+                              TreeEntryCallback callback,
+                              void* callbackContext,
+                              void* listerContext)
+{
+    const SyntheticTree* tree = (const SyntheticTree*) listerContext;
+    ULONGLONG hash = 0xCBF29CE484222325ULL; // FNV-1a
+    DWORD depth = 0;
+    for (const wchar_t* c = path; *c != 0; c++)
+    {
+        hash = (hash ^ *c) * 0x100000001B3ULL;
+        depth += (*c == L'\\');
+    }
+    hash ^= hash >> 29;
+
+    DWORD folders = 0;
+    if (depth == 0)
+    {
+        folders = tree->rootFolders;
+    }
+    else if (depth < tree->maxDepth)
+    {
+        folders = (DWORD) (hash % (tree->maxBranch + 1));
+    }
+    DWORD files = (DWORD) ((hash >> 8) % (tree->maxFiles + 1));
+    // Now and then a folder holds one very large file
+    ULONGLONG fileSize = ((hash >> 32) % 65536) + 1;
+    BOOL largeFile = ((hash >> 24) % 97 == 0);
+
+    wchar_t name[16] = { 0 };
+    TreeEntry entry = { 0 };
+    entry.name = name;
+    entry.directory = TRUE;
+    for (DWORD i = 0; i < folders; i++)
+    {
+        _snwprintf(name, ARRAYSIZE(name), L"d%u", i);
+        if (callback(&entry, callbackContext) == FALSE)
+        {
+            return TRUE;
+        }
+    }
+    entry.directory = FALSE;
+    for (DWORD i = 0; i < files; i++)
+    {
+        entry.size = (largeFile && (i == 0)) ? 100000000ULL : fileSize;
+        _snwprintf(name, ARRAYSIZE(name), L"f%u", i);
+        if (callback(&entry, callbackContext) == FALSE)
+        {
+            return TRUE;
+        }
+    }
+    return TRUE;
+}
+#endif
+
+/// @brief steps an xorshift generator
+/// @param state the generator state, never 0
+/// @return the next random number
+static ULONGLONG nextRandom(ULONGLONG* state)
+{
+    ULONGLONG x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *state = x;
+    return x;
+}
+
+#ifndef NDEBUG
+/// @brief checks the estimator against synthetic trees whose exact size is
+/// known by counting them in full
+void testEstimate(void)
+{
+    // A tree with no folders is counted exactly
+    SyntheticTree flat = { 0, 0, 0, 500 };
+    TreeCount count = { 0 };
+    assert(countTree(L"T", listSyntheticTree, &flat, &count));
+    TreeSampler sampler = { listSyntheticTree, &flat, 16, 0, NULL, 1 };
+    TreeEstimate estimate = { 0 };
+    initTreeEstimate(&estimate);
+    assert(estimateTree(&sampler, L"T", &estimate));
+    finishTreeEstimate(&estimate, 1000.0, THROTTLE_UNLIMITED);
+    assert(estimate.exact);
+    assert(estimate.items == (double) count.items);
+    assert(estimate.bytes == (double) count.bytes);
+    assert(estimate.itemsMargin == 0.0);
+    assert(estimate.seconds == estimate.items / 1000.0);
+
+    // Folders holding at most one folder are counted exactly too, as long
+    // as the budget covers every path
+    SyntheticTree chains = { 50, 1, 6, 20 };
+    ZeroMemory(&count, sizeof(count));
+    assert(countTree(L"T", listSyntheticTree, &chains, &count));
+    sampler.listerContext = &chains;
+    sampler.budget = 1000;
+    initTreeEstimate(&estimate);
+    assert(estimateTree(&sampler, L"T", &estimate));
+    finishTreeEstimate(&estimate, 1000.0, THROTTLE_UNLIMITED);
+    assert(estimate.exact);
+    assert(estimate.items == (double) count.items);
+    assert(estimate.bytes == (double) count.bytes);
+
+    // A bushy tree is estimated. Across many seeds the estimate should be
+    // unbiased, usually close, and the 95% interval should usually hold
+    // the exact count. A few very large files make up much of the bytes,
+    // and a small sample mostly misses them, so byte intervals are too
+    // narrow more often; the catalog total is used for bytes when it can be.
+    SyntheticTree bushy = { 300, 4, 6, 30 };
+    ZeroMemory(&count, sizeof(count));
+    assert(countTree(L"T", listSyntheticTree, &bushy, &count));
+    sampler.listerContext = &bushy;
+    const DWORD runs = 200;
+    DWORD itemsCovered = 0;
+    DWORD bytesCovered = 0;
+    double itemsTotal = 0.0;
+    double itemsError = 0.0;
+    double bytesTotal = 0.0;
+    DWORD listings = 0;
+    for (DWORD run = 0; run < runs; run++)
+    {
+        sampler.budget = ESTIMATE_DEFAULT_BUDGET;
+        sampler.random = 0x9E3779B97F4A7C15ULL * (run + 1);
+        initTreeEstimate(&estimate);
+        assert(estimateTree(&sampler, L"T", &estimate));
+        finishTreeEstimate(&estimate, ESTIMATE_ITEMS_PER_SECOND, THROTTLE_UNLIMITED);
+        assert(estimate.exact == FALSE);
+        assert(estimate.itemsMargin > 0.0);
+        assert(estimate.secondsMargin > 0.0);
+        itemsCovered += (fabs(estimate.items - (double) count.items) <= estimate.itemsMargin);
+        bytesCovered += (fabs(estimate.bytes - (double) count.bytes) <= estimate.bytesMargin);
+        itemsTotal += estimate.items;
+        itemsError += fabs(estimate.items - (double) count.items) / (double) count.items;
+        bytesTotal += estimate.bytes;
+        listings += estimate.listings;
+    }
+    LOG(L"Exact %llu items in %llu listings, estimates within %.1f%% on average "
+        L"from %u listings, %u%% of item intervals and %u%% of byte intervals hold the count\n",
+        count.items,
+        count.listings,
+        100.0 * itemsError / runs,
+        listings / runs,
+        100 * itemsCovered / runs,
+        100 * bytesCovered / runs);
+    assert(listings / runs < count.listings / 4);
+    assert(fabs(itemsTotal / runs - (double) count.items) < 0.03 * (double) count.items);
+    assert(fabs(bytesTotal / runs - (double) count.bytes) < 0.25 * (double) count.bytes);
+    assert(itemsError / runs < 0.25);
+    assert(itemsCovered >= runs * 85 / 100);
+
+    // A deadline that has already passed still takes the minimum sample
+    sampler.budget = ESTIMATE_DEFAULT_BUDGET;
+    sampler.deadline = 1;
+    initTreeEstimate(&estimate);
+    assert(estimateTree(&sampler, L"T", &estimate));
+    assert(estimate.samples == ESTIMATE_MIN_SAMPLES);
+}
+#endif
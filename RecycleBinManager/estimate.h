@@ -0,0 +1,89 @@
+#define _CRT_SECURE_NO_WARNINGS
+
+#pragma once
+#include <Windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <assert.h>
+
+// Empty cost estimate parameters. Counting everything in a large bin takes
+// as long as deleting it, so the cost is estimated from a sample instead.
+// The top of each tree is listed in full, then a random sample of its
+// folders is each followed down one random path, multiplying by the number
+// of folders at every level on the way (Knuth's estimator). Each path is an
+// unbiased estimate of its folder's size, and the spread between paths
+// gives the confidence interval. Sampling stops when the budget of folder
+// listings or the time limit runs out, whichever comes first.
+
+#define ESTIMATE_DEFAULT_BUDGET     256 // Folder listings per estimate
+#define ESTIMATE_MAX_SAMPLES        1024 // Most top level folders sampled
+#define ESTIMATE_MAX_MILLISECONDS   500 // Longest the dialog waits for an estimate
+#define ESTIMATE_Z_95               1.96 // 95% confidence interval
+#define ESTIMATE_ITEMS_PER_SECOND   2000.0 // Unthrottled deletes, files and folders
+
+// Structs
+
+typedef struct TreeEntry
+{
+    const wchar_t* name;
+    ULONGLONG size; // 0 for folders
+    BOOL directory; // Never set for links, they are deleted without being followed
+} TreeEntry;
+
+/// @brief called once for every entry in a folder
+/// @return TRUE to continue listing, FALSE to stop
+typedef BOOL (*TreeEntryCallback)(const TreeEntry* entry, void* context);
+
+/// @brief lists one folder. listDirectory() lists the real file system,
+/// the self test lists a synthetic tree.
+/// @return TRUE if the folder was listed, FALSE if it could not be
+typedef BOOL (*TreeLister)(const wchar_t* path, TreeEntryCallback callback,
+                           void* callbackContext, void* listerContext);
+
+typedef struct TreeSampler
+{
+    TreeLister lister;
+    void* listerContext;
+    DWORD budget; // Most folders to list in this tree
+    ULONGLONG deadline; // GetTickCount64() value to stop at, 0 for none
+    const wchar_t* skipPrefix; // Top level entries to leave out, NULL for none
+    ULONGLONG random; // Xorshift state, never 0
+} TreeSampler;
+
+typedef struct TreeEstimate
+{
+    double items; // Files and folders below the roots
+    double bytes;
+    double itemsVariance; // Variance of the items estimate
+    double bytesVariance;
+    double itemsMargin; // Half the width of the 95% interval, set by finishTreeEstimate()
+    double bytesMargin;
+    double seconds; // Expected time to delete everything
+    double secondsMargin;
+    DWORD samples; // Random paths followed
+    DWORD listings; // Folders listed
+    DWORD unreadable; // Folders that could not be listed
+    BOOL exact; // Every folder was listed, so there is no margin
+} TreeEstimate;
+
+typedef struct TreeCount
+{
+    ULONGLONG items;
+    ULONGLONG bytes;
+    ULONGLONG listings;
+} TreeCount;
+
+// Functions
+
+BOOL countTree(const wchar_t* root, TreeLister lister, void* listerContext,
+               TreeCount* count);
+BOOL estimateEmptyCost(DWORD budget, DWORD milliseconds, BOOL throttled,
+                       TreeEstimate* estimate);
+BOOL estimateTree(TreeSampler* sampler, const wchar_t* root, TreeEstimate* estimate);
+void finishTreeEstimate(TreeEstimate* estimate, double itemsPerSecond,
+                        double bytesPerSecond);
+void initTreeEstimate(TreeEstimate* estimate);
+BOOL listDirectory(const wchar_t* path, TreeEntryCallback callback,
+                   void* callbackContext, void* listerContext);
+void testEstimate(void);
@@ -0,0 +1,942 @@
+/*
+* Exclusion rules that protect items from automatic purges
+*
+* Copyright(C) 2024 ERROR_SUCCESS Software
+*
+* This program is free software : you can redistribute it and /or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.If not, see < https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#include "exclusions.h"
+#include "ini.h"
+#include "logger.h"
+
+static BOOL addPosition(ExclusionRules* rules, BYTE kind, wchar_t literal);
+static DWORD addState(ExclusionRules* rules, const DWORD* set, DWORD length);
+static void addToScratch(ExclusionRules* rules, DWORD position, BOOL entering);
+static BOOL compilePattern(ExclusionRules* rules, const wchar_t* pattern,
+                           size_t length, BOOL matchUnder);
+static int compareDwords(const void* a, const void* b);
+static void flushStates(ExclusionRules* rules);
+static BOOL matchPattern(const ExclusionRules* rules, DWORD position,
+                         const wchar_t* path, BOOL entering);
+static DWORD stepState(ExclusionRules* rules, DWORD state, DWORD characterClass);
+#ifndef NDEBUG
+static BOOL isExcludedNaive(const ExclusionRules* rules, const wchar_t* path);
+#endif
+
+/// @brief adds one position to the pattern being compiled
+/// @param rules the rules
+/// @param kind the GLOB_ kind of the position
+/// @param literal the character for GLOB_LITERAL, lower case
+/// @return TRUE on success, FALSE if memory allocation failed
+static BOOL addPosition(ExclusionRules* rules,
+                        BYTE kind,
+                        wchar_t literal)
+{
+    if (rules->positionCount == rules->positionCapacity)
+    {
+        DWORD capacity = (rules->positionCapacity == 0) ?
+            EXCLUSION_INITIAL_POSITIONS : rules->positionCapacity * 2;
+        BYTE* kinds = (rules->kinds == NULL) ?
+            HeapAlloc(GetProcessHeap(), 0, capacity) :
+            HeapReAlloc(GetProcessHeap(), 0, rules->kinds, capacity);
+        if (kinds == NULL) // Memory allocation failed
+        {
+            return FALSE;
+        }
+        rules->kinds = kinds;
+        wchar_t* literals = (rules->literals == NULL) ?
+            HeapAlloc(GetProcessHeap(), 0, capacity * sizeof(wchar_t)) :
+            HeapReAlloc(GetProcessHeap(), 0, rules->literals, capacity * sizeof(wchar_t));
+        if (literals == NULL) // Memory allocation failed
+        {
+            return FALSE;
+        }
+        rules->literals = literals;
+        rules->positionCapacity = capacity;
+    }
+
+    // Every character in a pattern gets a class of its own, shared with its
+    // upper case form, so the DFA only needs a column per class
+    if ((kind == GLOB_LITERAL) &&
+        (rules->classes[literal] == EXCLUSION_OTHER_CLASS))
+    {
+        rules->classes[literal] = (WORD) rules->classCount;
+        wchar_t upper = towupper(literal);
+        if (rules->classes[upper] == EXCLUSION_OTHER_CLASS)
+        {
+            rules->classes[upper] = (WORD) rules->classCount;
+        }
+        rules->classCharacters[rules->classCount++] = literal;
+    }
+    rules->kinds[rules->positionCount] = kind;
+    rules->literals[rules->positionCount] = literal;
+    rules->positionCount++;
+    return TRUE;
+}
+
+/// @brief finds the DFA state made of a set of positions, adding it to the
+/// cache if it is not there yet
+/// @param rules the rules
+/// @param set the positions, sorted
+/// @param length the number of positions
+/// @return the state, EXCLUSION_UNKNOWN if memory allocation failed
+static DWORD addState(ExclusionRules* rules,
+                      const DWORD* set,
+                      DWORD length)
+{
+    DWORD hash = 2166136261; // FNV-1a
+    for (DWORD i = 0; i < length; i++)
+    {
+        hash = (hash ^ set[i]) * 16777619;
+    }
+    DWORD mask = rules->stateSlotCount - 1;
+    DWORD slot = hash & mask;
+    while (rules->stateSlots[slot] != 0)
+    {
+        const DfaState* state = &rules->states[rules->stateSlots[slot] - 1];
+        if ((state->setLength == length) &&
+            (memcmp(rules->setPool + state->setOffset, set, length * sizeof(DWORD)) == 0))
+        {
+            return rules->stateSlots[slot] - 1;
+        }
+        slot = (slot + 1) & mask;
+    }
+
+    if (rules->poolLength + length > rules->poolCapacity)
+    {
+        DWORD capacity = rules->poolCapacity * 2;
+        while (rules->poolLength + length > capacity)
+        {
+            capacity *= 2;
+        }
+        DWORD* pool = HeapReAlloc(GetProcessHeap(),
+                                  0,
+                                  rules->setPool,
+                                  capacity * sizeof(DWORD));
+        if (pool == NULL) // Memory allocation failed
+        {
+            return EXCLUSION_UNKNOWN;
+        }
+        rules->setPool = pool;
+        rules->poolCapacity = capacity;
+    }
+    DWORD index = rules->stateCount++;
+    DfaState* state = &rules->states[index];
+    state->setOffset = rules->poolLength;
+    state->setLength = length;
+    state->accepting = FALSE;
+    for (DWORD i = 0; i < length; i++)
+    {
+        state->accepting |= (rules->kinds[set[i]] == GLOB_ACCEPT);
+    }
+    if (length > 0)
+    {
+        memcpy(rules->setPool + rules->poolLength,
+               set,
+               length * sizeof(DWORD));
+    }
+    rules->poolLength += length;
+
+    // Nothing leaves the empty set, so the dead state needs no work later
+    DWORD* row = rules->transitions + ((size_t) index * rules->classCount);
+    for (DWORD i = 0; i < rules->classCount; i++)
+    {
+        row[i] = (length == 0) ? EXCLUSION_DEAD_STATE : EXCLUSION_UNKNOWN;
+    }
+    rules->stateSlots[slot] = index + 1;
+    return index;
+}
+
+/// @brief adds a position to the set being built, along with every
+/// position that can be reached from it without reading a character
+/// @param rules the rules
+/// @param position the position
+/// @param entering TRUE if the position was just reached from the one
+/// before it, FALSE if it is a wildcard that has just read a character
+static void addToScratch(ExclusionRules* rules,
+                         DWORD position,
+                         BOOL entering)
+{
+    BYTE kind = rules->kinds[position];
+
+    // **\ can match nothing at all, but only straight after it is entered:
+    // once it has read a character it has to end with the backslash
+    if ((kind == GLOB_ANY_FOLDERS) && entering)
+    {
+        addToScratch(rules,
+                     position + 2,
+                     TRUE);
+    }
+    if (rules->marks[position])
+    {
+        return;
+    }
+    rules->marks[position] = TRUE;
+    rules->scratch[rules->scratchLength++] = position;
+    if ((kind == GLOB_STAR) || (kind == GLOB_ANY_PATH) || (kind == GLOB_ANY_FOLDERS))
+    {
+        addToScratch(rules,
+                     position + 1,
+                     TRUE);
+    }
+}
+
+/// @brief measures how fast paths are checked against a large set of
+/// synthetic rules, once through the DFA and once trying each rule in turn
+/// @param ruleCount the number of rules to compile
+/// @param pathCount the number of paths to check
+/// @param result receives the measurements
+/// @return TRUE on success, FALSE if memory allocation failed
+BOOL benchmarkExclusionRules(DWORD ruleCount,
+                             DWORD pathCount,
+                             ExclusionBenchmark* result)
+{
+    ZeroMemory(result,
+               sizeof(ExclusionBenchmark));
+    if ((ruleCount == 0) || (pathCount == 0))
+    {
+        return FALSE;
+    }
+
+    // A mix of file types, project folders, reports and legal holds
+    const DWORD cchRule = 64;
+    wchar_t* patterns = HeapAlloc(GetProcessHeap(),
+                                  HEAP_ZERO_MEMORY,
+                                  ((size_t) ruleCount * cchRule + 1) * sizeof(wchar_t));
+    if (patterns == NULL)
+    {
+        // Memory allocation failed
+        return FALSE;
+    }
+    wchar_t* next = patterns;
+    for (DWORD i = 0; i < ruleCount; i++)
+    {
+        const wchar_t* formats[] =
+        {
+            L"*.x%u",
+            L"*.keep%u.*",
+            L"C:\\Users\\dev\\src\\project%u\\",
+            L"D:\\Data\\*\\report%u_*.xlsx",
+            L"E:\\Legal\\case%u",
+        };
+        int written = _snwprintf(next,
+                                 cchRule,
+                                 formats[i % ARRAYSIZE(formats)],
+                                 i * 7);
+        next += (written > 0) ? written + 1 : 1;
+    }
+    *next = 0;
+    ExclusionRules rules = { 0 };
+    BOOL compiled = compileExclusionRules(&rules,
+                                          patterns);
+    HeapFree(GetProcessHeap(),
+             0,
+             patterns);
+    if (compiled == FALSE)
+    {
+        freeExclusionRules(&rules);
+        return FALSE;
+    }
+
+    // The paths are made up front so only matching is timed
+    const DWORD distinctPaths = (pathCount < 65536) ? pathCount : 65536;
+    const DWORD cchPath = 96;
+    wchar_t* paths = HeapAlloc(GetProcessHeap(),
+                               0,
+                               (size_t) distinctPaths * cchPath * sizeof(wchar_t));
+    if (paths == NULL)
+    {
+        // Memory allocation failed
+        freeExclusionRules(&rules);
+        return FALSE;
+    }
+    ULONGLONG characters = 0;
+    DWORD seed = 12345;
+    for (DWORD i = 0; i < distinctPaths; i++)
+    {
+        seed = (seed * 1664525) + 1013904223; // Numerical Recipes LCG
+        wchar_t* path = paths + ((size_t) i * cchPath);
+        switch (seed % 4)
+        {
+            case 0:
+                _snwprintf(path, cchPath, L"C:\\Users\\dev\\src\\project%u\\build\\obj\\file%u.x%u",
+                           (seed >> 8) % 2000, i, (seed >> 4) % 5000);
+                break;
+            case 1:
+                _snwprintf(path, cchPath, L"D:\\Data\\%u\\report%u_final.xlsx",
+                           i % 100, (seed >> 8) % 5000);
+                break;
+            case 2:
+                _snwprintf(path, cchPath, L"E:\\Legal\\case%u\\exhibit%u.pdf",
+                           (seed >> 8) % 5000, i);
+                break;
+            default:
+                _snwprintf(path, cchPath, L"C:\\Users\\dev\\Downloads\\setup%u.keep%u.msi",
+                           i, (seed >> 8) % 5000);
+                break;
+        }
+        path[cchPath - 1] = 0;
+    }
+
+    // The first pass over the paths builds the DFA states they need, after
+    // that every check is one table lookup per character
+    LARGE_INTEGER frequency, start, end;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&start);
+    for (DWORD i = 0; i < distinctPaths; i++)
+    {
+        isExcluded(&rules,
+                   paths + ((size_t) i * cchPath));
+    }
+    QueryPerformanceCounter(&end);
+    result->warmupMilliseconds = ((double) (end.QuadPart - start.QuadPart) * 1e3) /
+        (double) frequency.QuadPart;
+    QueryPerformanceCounter(&start);
+    for (DWORD i = 0; i < pathCount; i++)
+    {
+        const wchar_t* path = paths + ((size_t) (i % distinctPaths) * cchPath);
+        result->matches += isExcluded(&rules,
+                                      path);
+    }
+    QueryPerformanceCounter(&end);
+    double seconds = (double) (end.QuadPart - start.QuadPart) / (double) frequency.QuadPart;
+    for (DWORD i = 0; i < pathCount; i++)
+    {
+        characters += wcslen(paths + ((size_t) (i % distinctPaths) * cchPath));
+    }
+
+    // Trying every rule in turn is far slower, so time fewer paths
+    DWORD naivePaths = (distinctPaths < 2000) ? distinctPaths : 2000;
+    LARGE_INTEGER naiveStart, naiveEnd;
+    QueryPerformanceCounter(&naiveStart);
+    for (DWORD i = 0; i < naivePaths; i++)
+    {
+        const wchar_t* path = paths + ((size_t) i * cchPath);
+        for (DWORD j = 0; j < rules.patternCount; j++)
+        {
+            if (matchPattern(&rules, rules.patternStarts[j], path, TRUE))
+            {
+                result->naiveMatches++;
+                break;
+            }
+        }
+    }
+    QueryPerformanceCounter(&naiveEnd);
+
+    result->rules = ruleCount;
+    result->paths = pathCount;
+    result->states = rules.stateCount;
+    result->flushes = rules.flushes;
+    result->nanosecondsPerPath = (seconds * 1e9) / pathCount;
+    result->megabytesPerSecond = (seconds > 0.0) ?
+        ((double) characters * sizeof(wchar_t) / 1048576.0) / seconds : 0.0;
+    result->naiveNanosecondsPerPath = ((double) (naiveEnd.QuadPart - naiveStart.QuadPart) * 1e9) /
+        ((double) frequency.QuadPart * naivePaths);
+    HeapFree(GetProcessHeap(),
+             0,
+             paths);
+    freeExclusionRules(&rules);
+    return TRUE;
+}
+
+/// @brief compiles a list of patterns into one set of rules. Call
+/// freeExclusionRules() afterwards, even if this fails.
+/// @param rules the rules to fill in
+/// @param patterns null terminated patterns one after another, ending with
+/// an empty string, as read from an ini section. Blank lines and lines
+/// starting with ; or # are skipped.
+/// @return TRUE on success, FALSE if memory allocation failed
+BOOL compileExclusionRules(ExclusionRules* rules,
+                           const wchar_t* patterns)
+{
+    ZeroMemory(rules,
+               sizeof(ExclusionRules));
+    InitializeCriticalSection(&rules->lock);
+    rules->stateLimit = EXCLUSION_MAX_DFA_STATES;
+    rules->classCount = EXCLUSION_SEPARATOR_CLASS + 1;
+    rules->classes = HeapAlloc(GetProcessHeap(),
+                               HEAP_ZERO_MEMORY,
+                               65536 * sizeof(WORD));
+    rules->classCharacters = HeapAlloc(GetProcessHeap(),
+                                       HEAP_ZERO_MEMORY,
+                                       65536 * sizeof(wchar_t));
+    if ((rules->classes == NULL) || (rules->classCharacters == NULL))
+    {
+        // Memory allocation failed
+        return FALSE;
+    }
+    rules->classes[L'\\'] = EXCLUSION_SEPARATOR_CLASS;
+    rules->classes[L'/'] = EXCLUSION_SEPARATOR_CLASS;
+    rules->classCharacters[EXCLUSION_SEPARATOR_CLASS] = L'\\';
+
+    for (const wchar_t* line = patterns; *line != 0; line += wcslen(line) + 1)
+    {
+        const wchar_t* first = line;
+        while (iswspace(*first))
+        {
+            first++;
+        }
+        size_t length = wcslen(first);
+        while ((length > 0) && iswspace(first[length - 1]))
+        {
+            length--;
+        }
+        if ((length == 0) || (*first == L';') || (*first == L'#'))
+        {
+            continue;
+        }
+
+        // A plain path also protects everything under it
+        BOOL hasSeparator = FALSE;
+        BOOL hasWildcard = FALSE;
+        for (size_t i = 0; i < length; i++)
+        {
+            hasSeparator |= ((first[i] == L'\\') || (first[i] == L'/'));
+            hasWildcard |= ((first[i] == L'*') || (first[i] == L'?'));
+        }
+        BOOL endsWithSeparator = ((first[length - 1] == L'\\') || (first[length - 1] == L'/'));
+        if ((compilePattern(rules, first, length, FALSE) == FALSE) ||
+            (hasSeparator && (hasWildcard == FALSE) && (endsWithSeparator == FALSE) &&
+             (compilePattern(rules, first, length, TRUE) == FALSE)))
+        {
+            return FALSE;
+        }
+    }
+
+    // Patterns with many different characters get fewer cached states, so
+    // the transition table stays the same size
+    if (rules->stateLimit * rules->classCount > EXCLUSION_MAX_TRANSITIONS)
+    {
+        rules->stateLimit = EXCLUSION_MAX_TRANSITIONS / rules->classCount;
+    }
+    rules->states = HeapAlloc(GetProcessHeap(),
+                              0,
+                              rules->stateLimit * sizeof(DfaState));
+    rules->transitions = HeapAlloc(GetProcessHeap(),
+                                   0,
+                                   (size_t) rules->stateLimit * rules->classCount * sizeof(DWORD));
+    rules->stateSlotCount = 2;
+    while (rules->stateSlotCount < rules->stateLimit * 2)
+    {
+        rules->stateSlotCount *= 2;
+    }
+    rules->stateSlots = HeapAlloc(GetProcessHeap(),
+                                  HEAP_ZERO_MEMORY,
+                                  rules->stateSlotCount * sizeof(DWORD));
+    rules->poolCapacity = EXCLUSION_INITIAL_POOL;
+    rules->setPool = HeapAlloc(GetProcessHeap(),
+                               0,
+                               rules->poolCapacity * sizeof(DWORD));
+    rules->scratch = HeapAlloc(GetProcessHeap(),
+                               0,
+                               (rules->positionCount + 1) * sizeof(DWORD));
+    rules->marks = HeapAlloc(GetProcessHeap(),
+                             HEAP_ZERO_MEMORY,
+                             rules->positionCount + 1);
+    rules->startSet = HeapAlloc(GetProcessHeap(),
+                                0,
+                                (rules->positionCount + 1) * sizeof(DWORD));
+    if ((rules->states == NULL) || (rules->transitions == NULL) ||
+        (rules->stateSlots == NULL) || (rules->setPool == NULL) ||
+        (rules->scratch == NULL) || (rules->marks == NULL) || (rules->startSet == NULL))
+    {
+        // Memory allocation failed
+        return FALSE;
+    }
+
+    // The start state is every pattern at its first position
+    rules->scratchLength = 0;
+    for (DWORD i = 0; i < rules->patternCount; i++)
+    {
+        addToScratch(rules,
+                     rules->patternStarts[i],
+                     TRUE);
+    }
+    for (DWORD i = 0; i < rules->scratchLength; i++)
+    {
+        rules->marks[rules->scratch[i]] = FALSE;
+    }
+    qsort(rules->scratch,
+          rules->scratchLength,
+          sizeof(DWORD),
+          compareDwords);
+    memcpy(rules->startSet,
+           rules->scratch,
+           rules->scratchLength * sizeof(DWORD));
+    rules->startLength = rules->scratchLength;
+    flushStates(rules);
+
+    // With no patterns the start state is the dead state, but then nothing
+    // is ever matched
+    return ((rules->patternCount == 0) ||
+            (rules->stateCount == EXCLUSION_START_STATE + 1));
+}
+
+/// @brief adds one pattern to the rules
+/// @param rules the rules
+/// @param pattern the pattern, which need not be null terminated
+/// @param length the length of the pattern in characters
+/// @param matchUnder TRUE to match everything under the path instead of
+/// the path itself
+/// @return TRUE on success, FALSE if memory allocation failed
+static BOOL compilePattern(ExclusionRules* rules,
+                           const wchar_t* pattern,
+                           size_t length,
+                           BOOL matchUnder)
+{
+    if (rules->patternCount == rules->patternCapacity)
+    {
+        DWORD capacity = (rules->patternCapacity == 0) ? 64 : rules->patternCapacity * 2;
+        DWORD* starts = (rules->patternStarts == NULL) ?
+            HeapAlloc(GetProcessHeap(), 0, capacity * sizeof(DWORD)) :
+            HeapReAlloc(GetProcessHeap(), 0, rules->patternStarts, capacity * sizeof(DWORD));
+        if (starts == NULL) // Memory allocation failed
+        {
+            return FALSE;
+        }
+        rules->patternStarts = starts;
+        rules->patternCapacity = capacity;
+    }
+    rules->patternStarts[rules->patternCount++] = rules->positionCount;
+
+    BOOL hasSeparator = FALSE;
+    for (size_t i = 0; i < length; i++)
+    {
+        hasSeparator |= ((pattern[i] == L'\\') || (pattern[i] == L'/'));
+    }
+    BOOL result = TRUE;
+    if (hasSeparator == FALSE)
+    {
+        // A name matches in any folder
+        result &= addPosition(rules, GLOB_ANY_FOLDERS, 0);
+        result &= addPosition(rules, GLOB_LITERAL, L'\\');
+    }
+    BYTE previous = GLOB_ACCEPT;
+    for (size_t i = 0; i < length; i++)
+    {
+        wchar_t c = pattern[i];
+        BYTE kind = GLOB_LITERAL;
+        if ((c == L'*') && (i + 1 < length) && (pattern[i + 1] == L'*'))
+        {
+            i++;
+            kind = GLOB_ANY_PATH;
+            if ((i + 1 < length) && ((pattern[i + 1] == L'\\') || (pattern[i + 1] == L'/')))
+            {
+                i++;
+                kind = GLOB_ANY_FOLDERS;
+            }
+        }
+        else if (c == L'*')
+        {
+            kind = GLOB_STAR;
+        }
+        else if (c == L'?')
+        {
+            kind = GLOB_ANY_CHAR;
+        }
+
+        // Repeated stars match no more than one does
+        if ((kind == previous) && ((kind == GLOB_STAR) || (kind == GLOB_ANY_PATH)))
+        {
+            continue;
+        }
+        previous = kind;
+        if (kind == GLOB_ANY_FOLDERS)
+        {
+            result &= addPosition(rules, GLOB_ANY_FOLDERS, 0);
+            result &= addPosition(rules, GLOB_LITERAL, L'\\');
+        }
+        else
+        {
+            result &= addPosition(rules,
+                                  kind,
+                                  (kind != GLOB_LITERAL) ? 0 : (c == L'/') ? L'\\' : towlower(c));
+        }
+    }
+    BOOL endsWithSeparator = ((pattern[length - 1] == L'\\') || (pattern[length - 1] == L'/'));
+    if (matchUnder)
+    {
+        result &= addPosition(rules, GLOB_LITERAL, L'\\');
+    }
+    if ((matchUnder || (hasSeparator && endsWithSeparator)) && (previous != GLOB_ANY_PATH))
+    {
+        result &= addPosition(rules, GLOB_ANY_PATH, 0);
+    }
+    result &= addPosition(rules, GLOB_ACCEPT, 0);
+    return result;
+}
+
+/// @brief orders positions, for qsort()
+static int compareDwords(const void* a,
+                         const void* b)
+{
+    DWORD valueA = *(const DWORD*) a;
+    DWORD valueB = *(const DWORD*) b;
+    return (valueA > valueB) - (valueA < valueB);
+}
+
+/// @brief empties the DFA cache, leaving only the dead and start states
+/// @param rules the rules
+static void flushStates(ExclusionRules* rules)
+{
+    rules->stateCount = 0;
+    rules->poolLength = 0;
+    ZeroMemory(rules->stateSlots,
+               rules->stateSlotCount * sizeof(DWORD));
+    addState(rules,
+             NULL,
+             0);
+    addState(rules,
+             rules->startSet,
+             rules->startLength);
+}
+
+/// @brief frees everything in a set of rules
+/// @param rules the rules, after compileExclusionRules()
+void freeExclusionRules(ExclusionRules* rules)
+{
+    void* blocks[] =
+    {
+        rules->kinds, rules->literals, rules->patternStarts, rules->classes,
+        rules->classCharacters, rules->startSet, rules->states, rules->transitions,
+        rules->setPool, rules->stateSlots, rules->scratch, rules->marks,
+    };
+    for (DWORD i = 0; i < ARRAYSIZE(blocks); i++)
+    {
+        if (blocks[i] != NULL)
+        {
+            HeapFree(GetProcessHeap(),
+                     0,
+                     blocks[i]);
+        }
+    }
+    DeleteCriticalSection(&rules->lock);
+    ZeroMemory(rules,
+               sizeof(ExclusionRules));
+}
+
+/// @brief checks if a path matches any of the rules. Safe to call from
+/// several threads at once.
+/// @param rules the rules
+/// @param path the full path of the item, as it was before it was deleted
+/// @return TRUE if the item is protected. If memory runs out the item is
+///         treated as protected, so nothing is purged by mistake.
+BOOL isExcluded(ExclusionRules* rules,
+                const wchar_t* path)
+{
+    if (rules->patternCount == 0)
+    {
+        return FALSE;
+    }
+    EnterCriticalSection(&rules->lock);
+    DWORD state = EXCLUSION_START_STATE;
+    for (const wchar_t* c = path; (*c != 0) && (state != EXCLUSION_DEAD_STATE); c++)
+    {
+        DWORD characterClass = rules->classes[(WORD) *c];
+        DWORD next = rules->transitions[((size_t) state * rules->classCount) + characterClass];
+        if (next == EXCLUSION_UNKNOWN)
+        {
+            next = stepState(rules,
+                             state,
+                             characterClass);
+            if (next == EXCLUSION_UNKNOWN)
+            {
+                LeaveCriticalSection(&rules->lock);
+                LOG(L"Out of memory matching %s, treating it as protected\n",
+                    path);
+                return TRUE;
+            }
+        }
+        state = next;
+    }
+    BOOL excluded = rules->states[state].accepting;
+    LeaveCriticalSection(&rules->lock);
+    return excluded;
+}
+
+#ifndef NDEBUG
+/// @brief checks a path against each pattern in turn, without the DFA
+static BOOL isExcludedNaive(const ExclusionRules* rules,
+                            const wchar_t* path)
+{
+    for (DWORD i = 0; i < rules->patternCount; i++)
+    {
+        if (matchPattern(rules, rules->patternStarts[i], path, TRUE))
+        {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+#endif
+
+/// @brief compiles the patterns in the [Protect] section of Settings.ini.
+/// Call freeExclusionRules() afterwards, even if this fails.
+/// @param rules the rules to fill in, empty if there is no such section
+/// @return TRUE on success, FALSE if memory allocation failed
+BOOL loadExclusionRules(ExclusionRules* rules)
+{
+    wchar_t* section = getIniSection(INI_SECTION_PROTECT);
+    BOOL result = compileExclusionRules(rules,
+                                        (section != NULL) ? section : L"");
+    if (section != NULL)
+    {
+        HeapFree(GetProcessHeap(),
+                 0,
+                 section);
+    }
+    LOG(L"Loaded %u protection patterns\n",
+        rules->patternCount);
+    return result;
+}
+
+/// @brief matches a path against one pattern by trying every way the
+/// wildcards could match. Used to check the DFA and to compare against it.
+/// @param rules the rules
+/// @param position the position in the pattern to match from
+/// @param path the rest of the path
+/// @param entering TRUE if the position was just reached from the one before
+/// @return TRUE if the rest of the path matches the rest of the pattern
+static BOOL matchPattern(const ExclusionRules* rules,
+                         DWORD position,
+                         const wchar_t* path,
+                         BOOL entering)
+{
+    for (;;)
+    {
+        WORD characterClass = rules->classes[(WORD) *path];
+        switch (rules->kinds[position])
+        {
+            case GLOB_ACCEPT:
+                return (*path == 0);
+            case GLOB_LITERAL:
+                if ((*path == 0) ||
+                    (characterClass != rules->classes[rules->literals[position]]))
+                {
+                    return FALSE;
+                }
+                break;
+            case GLOB_ANY_CHAR:
+                if ((*path == 0) || (characterClass == EXCLUSION_SEPARATOR_CLASS))
+                {
+                    return FALSE;
+                }
+                break;
+            case GLOB_STAR:
+            case GLOB_ANY_PATH:
+            case GLOB_ANY_FOLDERS:
+                if ((rules->kinds[position] == GLOB_ANY_FOLDERS) && entering &&
+                    matchPattern(rules, position + 2, path, TRUE))
+                {
+                    return TRUE;
+                }
+                if (matchPattern(rules, position + 1, path, TRUE))
+                {
+                    return TRUE;
+                }
+                if ((*path == 0) ||
+                    ((rules->kinds[position] == GLOB_STAR) &&
+                     (characterClass == EXCLUSION_SEPARATOR_CLASS)))
+                {
+                    return FALSE;
+                }
+                path++;
+                entering = FALSE;
+                continue; // The wildcard stays where it is
+        }
+        path++;
+        position++;
+        entering = TRUE;
+    }
+}
+
+/// @brief works out where a DFA state goes on a character class and caches
+/// the answer
+/// @param rules the rules
+/// @param state the state
+/// @param characterClass the class of the character read
+/// @return the next state, EXCLUSION_UNKNOWN if memory allocation failed
+static DWORD stepState(ExclusionRules* rules,
+                       DWORD state,
+                       DWORD characterClass)
+{
+    const DfaState* from = &rules->states[state];
+    wchar_t character = rules->classCharacters[characterClass];
+    BOOL separator = (characterClass == EXCLUSION_SEPARATOR_CLASS);
+    rules->scratchLength = 0;
+    for (DWORD i = 0; i < from->setLength; i++)
+    {
+        DWORD position = rules->setPool[from->setOffset + i];
+        switch (rules->kinds[position])
+        {
+            case GLOB_LITERAL:
+                if ((characterClass != EXCLUSION_OTHER_CLASS) &&
+                    (rules->literals[position] == character))
+                {
+                    addToScratch(rules, position + 1, TRUE);
+                }
+                break;
+            case GLOB_ANY_CHAR:
+                if (separator == FALSE)
+                {
+                    addToScratch(rules, position + 1, TRUE);
+                }
+                break;
+            case GLOB_STAR:
+                if (separator == FALSE)
+                {
+                    addToScratch(rules, position, FALSE);
+                }
+                break;
+            case GLOB_ANY_PATH:
+            case GLOB_ANY_FOLDERS:
+                addToScratch(rules, position, FALSE);
+                break;
+        }
+    }
+    for (DWORD i = 0; i < rules->scratchLength; i++)
+    {
+        rules->marks[rules->scratch[i]] = FALSE;
+    }
+    qsort(rules->scratch,
+          rules->scratchLength,
+          sizeof(DWORD),
+          compareDwords);
+
+    // A full cache is emptied. The state we came from is gone with it, so
+    // its transition can't be recorded this time round.
+    if (rules->stateCount == rules->stateLimit)
+    {
+        rules->flushes++;
+        flushStates(rules);
+        return addState(rules,
+                        rules->scratch,
+                        rules->scratchLength);
+    }
+    DWORD next = addState(rules,
+                          rules->scratch,
+                          rules->scratchLength);
+    if (next != EXCLUSION_UNKNOWN)
+    {
+        rules->transitions[((size_t) state * rules->classCount) + characterClass] = next;
+    }
+    return next;
+}
+
+#ifndef NDEBUG
+/// @brief tests compiling and matching exclusion rules
+/// @param none
+void testExclusionRules(void)
+{
+    ExclusionRules rules = { 0 };
+    assert(compileExclusionRules(&rules,
+                                 L"*.sql.gz\0"
+                                 L"  /srv/legal/  \0"
+                                 L"D:\\Legal\0"
+                                 L"C:\\Users\\*\\Secret?.txt\0"
+                                 L"C:\\**\\keep\\*.doc\0"
+                                 L"; not a pattern\0"
+                                 L"\0"));
+    assert(rules.patternCount == 6); // D:\Legal is two patterns
+
+    // Names match in any folder, ignoring case
+    assert(isExcluded(&rules, L"C:\\Backups\\db.sql.gz"));
+    assert(isExcluded(&rules, L"C:\\Backups\\Nightly\\DB.SQL.GZ"));
+    assert(isExcluded(&rules, L"C:\\Backups\\db.sql.gz.old") == FALSE);
+    assert(isExcluded(&rules, L"C:\\Backups\\db.sql.gz\\inner.txt") == FALSE);
+
+    // A trailing separator protects everything under the folder
+    assert(isExcluded(&rules, L"\\srv\\legal\\brief.pdf"));
+    assert(isExcluded(&rules, L"\\SRV\\Legal\\2024\\brief.pdf"));
+    assert(isExcluded(&rules, L"\\srv\\legalese.pdf") == FALSE);
+
+    // A plain path protects itself and everything under it
+    assert(isExcluded(&rules, L"D:\\Legal"));
+    assert(isExcluded(&rules, L"d:/legal/case/exhibit.pdf"));
+    assert(isExcluded(&rules, L"D:\\LegalNotes") == FALSE);
+    assert(isExcluded(&rules, L"D:\\Other\\Legal") == FALSE);
+
+    // * and ? stay within one folder name
+    assert(isExcluded(&rules, L"C:\\Users\\bob\\Secret1.txt"));
+    assert(isExcluded(&rules, L"C:\\Users\\bob\\Secret12.txt") == FALSE);
+    assert(isExcluded(&rules, L"C:\\Users\\bob\\x\\Secret1.txt") == FALSE);
+
+    // **\ matches no folders or any number of them
+    assert(isExcluded(&rules, L"C:\\keep\\notes.doc"));
+    assert(isExcluded(&rules, L"C:\\a\\b\\keep\\notes.doc"));
+    assert(isExcluded(&rules, L"C:\\akeep\\notes.doc") == FALSE);
+    assert(isExcluded(&rules, L"C:\\keep\\a\\notes.doc") == FALSE);
+    assert(isExcluded(&rules, L"") == FALSE);
+    freeExclusionRules(&rules);
+
+    // No rules protect nothing
+    assert(compileExclusionRules(&rules, L""));
+    assert(isExcluded(&rules, L"C:\\anything") == FALSE);
+    freeExclusionRules(&rules);
+
+    // Random patterns and paths over a small alphabet must give the same
+    // answer through the DFA as through trying each pattern in turn, also
+    // while a tiny cache keeps being emptied
+    const wchar_t patternPieces[][4] = { L"a", L"b", L"*", L"?", L"**", L"\\", L"**\\" };
+    const wchar_t pathPieces[] = L"ab\\.";
+    DWORD seed = 2024;
+    for (DWORD round = 0; round < 40; round++)
+    {
+        wchar_t patterns[512] = { 0 };
+        wchar_t* next = patterns;
+        for (DWORD i = 0; i < 8; i++)
+        {
+            DWORD pieces = 1 + (seed % 6);
+            for (DWORD j = 0; j < pieces; j++)
+            {
+                seed = (seed * 1664525) + 1013904223;
+                const wchar_t* piece = patternPieces[(seed >> 16) % ARRAYSIZE(patternPieces)];
+                wcscpy(next, piece);
+                next += wcslen(piece);
+            }
+            next++;
+        }
+        *next = 0;
+        assert(compileExclusionRules(&rules, patterns));
+        if (round % 2)
+        {
+            rules.stateLimit = 8;
+        }
+        for (DWORD i = 0; i < 500; i++)
+        {
+            wchar_t path[16] = { 0 };
+            seed = (seed * 1664525) + 1013904223;
+            DWORD length = (seed >> 16) % ARRAYSIZE(path);
+            for (DWORD j = 0; j < length; j++)
+            {
+                seed = (seed * 1664525) + 1013904223;
+                path[j] = pathPieces[(seed >> 16) % (ARRAYSIZE(pathPieces) - 1)];
+            }
+            assert((isExcluded(&rules, path) != FALSE) ==
+                   (isExcludedNaive(&rules, path) != FALSE));
+        }
+        assert((round % 2 == 0) || (rules.stateCount <= 8));
+        freeExclusionRules(&rules);
+    }
+
+    // A thousand rules still make a small DFA
+    ExclusionBenchmark benchmark = { 0 };
+    assert(benchmarkExclusionRules(1000, 20000, &benchmark));
+    assert(benchmark.matches > 0);
+    assert(benchmark.matches < benchmark.paths);
+    assert(benchmark.flushes == 0);
+}
+#endif
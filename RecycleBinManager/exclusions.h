@@ -0,0 +1,106 @@
+#define _CRT_SECURE_NO_WARNINGS
+
+#pragma once
+#include <Windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <wctype.h>
+#include <assert.h>
+
+// Exclusion rule parameters. Items whose original path matches a pattern in
+// the [Protect] section of Settings.ini are never purged automatically.
+// A pattern without a backslash matches the name of the item anywhere,
+// e.g. *.sql.gz. A pattern with one matches the whole path, and a pattern
+// with no wildcards also matches everything under it, e.g. D:\Legal. * and
+// ? stay within one folder name, ** crosses folders, and a trailing
+// backslash means everything under the folder. Matching ignores case, and
+// / is the same as \.
+//
+// Every pattern is compiled into one automaton, so a path is checked in a
+// single pass over its characters however many rules there are. The
+// automaton is a DFA built lazily: each state is the set of pattern
+// positions that are still alive, and its transitions are worked out the
+// first time they are needed and cached. If the cache fills up it is
+// emptied and built again from the paths that come next.
+
+#define EXCLUSION_MAX_DFA_STATES    16384 // Cached states before the cache is emptied
+#define EXCLUSION_MAX_TRANSITIONS   (1024 * 1024) // Cells in the transition table
+#define EXCLUSION_DEAD_STATE        0 // The empty set, nothing can match any more
+#define EXCLUSION_START_STATE       1
+#define EXCLUSION_UNKNOWN           0xFFFFFFFF // Transition not worked out yet
+#define EXCLUSION_INITIAL_POSITIONS 256
+#define EXCLUSION_INITIAL_POOL      4096 // Positions in cached state sets
+#define EXCLUSION_OTHER_CLASS       0 // Characters that appear in no pattern
+#define EXCLUSION_SEPARATOR_CLASS   1 // \ and /
+#define EXCLUSION_DEFAULT_BENCH_RULES   1000
+#define EXCLUSION_DEFAULT_BENCH_PATHS   1000000
+
+// Kinds of pattern position
+#define GLOB_LITERAL                0 // One character, ignoring case
+#define GLOB_ANY_CHAR               1 // ? matches one character, not a backslash
+#define GLOB_STAR                   2 // * matches within one folder name
+#define GLOB_ANY_PATH               3 // ** matches anything, \ included
+#define GLOB_ANY_FOLDERS            4 // **\ matches nothing, or anything ending in a backslash
+#define GLOB_ACCEPT                 5 // The end of a pattern
+
+// Structs
+
+typedef struct DfaState
+{
+    DWORD setOffset; // Where the state's positions start in the set pool
+    DWORD setLength;
+    BOOL accepting; // A pattern ends here
+} DfaState;
+
+typedef struct ExclusionRules
+{
+    BYTE* kinds; // GLOB_ kind of each pattern position
+    wchar_t* literals; // Lower case character of each GLOB_LITERAL position
+    DWORD positionCount;
+    DWORD positionCapacity;
+    DWORD* patternStarts; // First position of each pattern
+    DWORD patternCount;
+    DWORD patternCapacity;
+    WORD* classes; // Character class of every UTF-16 code unit
+    wchar_t* classCharacters; // A lower case character from each class
+    DWORD classCount;
+    DWORD* startSet; // The positions the start state is made of
+    DWORD startLength;
+    DfaState* states;
+    DWORD stateCount;
+    DWORD stateLimit; // EXCLUSION_MAX_DFA_STATES, lower in the self test
+    DWORD* transitions; // Next state for each state and class
+    DWORD* setPool; // The sorted positions of every cached state
+    DWORD poolLength;
+    DWORD poolCapacity;
+    DWORD* stateSlots; // State index + 1 keyed by its set, 0 if empty
+    DWORD stateSlotCount; // Power of two
+    DWORD* scratch; // The set being built
+    BYTE* marks; // Positions already in scratch
+    DWORD scratchLength;
+    DWORD flushes; // Times the cache filled up
+    CRITICAL_SECTION lock; // The cache is built while matching
+} ExclusionRules;
+
+typedef struct ExclusionBenchmark
+{
+    DWORD rules;
+    DWORD paths;
+    DWORD matches;
+    DWORD states; // Cached DFA states at the end
+    DWORD flushes;
+    double warmupMilliseconds; // Building the DFA states on first use
+    double nanosecondsPerPath; // Once the states are built
+    double megabytesPerSecond; // Of path text
+    double naiveNanosecondsPerPath; // Trying each rule in turn
+    DWORD naiveMatches; // Among the paths timed trying each rule in turn
+} ExclusionBenchmark;
+
+// Functions
+
+BOOL benchmarkExclusionRules(DWORD rules, DWORD paths, ExclusionBenchmark* result);
+BOOL compileExclusionRules(ExclusionRules* rules, const wchar_t* patterns);
+void freeExclusionRules(ExclusionRules* rules);
+BOOL isExcluded(ExclusionRules* rules, const wchar_t* path);
+BOOL loadExclusionRules(ExclusionRules* rules);
+void testExclusionRules(void);
@@ -0,0 +1,670 @@
+/*
+* Track how fast the bin grows and forecast when it will fill up
+*
+* Copyright(C) 2024 ERROR_SUCCESS Software
+*
+* This program is free software : you can redistribute it and /or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.If not, see < https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#include "growth.h"
+#include "bin.h"
+#include "ini.h"
+#include "reclaim.h"
+#include "logger.h"
+
+static void addGrowthRingSample(GrowthRing* ring, ULONGLONG bucketLength, ULONGLONG time,
+                                ULONGLONG binBytes, ULONGLONG freeBytes);
+static void checkGrowthAlert(GrowthFile* file);
+static void considerGrowthLimit(GrowthForecast* forecast, double seconds, wchar_t driveLetter);
+static ULONGLONG getGrowthQuota(void);
+static void runGrowthAlert(const GrowthForecast* forecast);
+static void updateGrowthModel(GrowthModel* model, ULONGLONG time, double value, BOOL levelOnDrop);
+
+// The length of a sample at each resolution, in seconds
+static const ULONGLONG growthBucketSeconds[GROWTH_LEVELS] = { 60, 3600, SECONDS_PER_DAY };
+
+/// @brief adds a sample to one resolution. Once the sample falls in a new
+/// minute, hour or day, the average of the last one is added to the ring.
+/// @param ring the ring
+/// @param bucketLength how long one sample in the ring covers, as FILETIME
+/// @param time the FILETIME of the sample
+/// @param binBytes the size of the bin
+/// @param freeBytes the free space on the volume
+static void addGrowthRingSample(GrowthRing* ring,
+                                ULONGLONG bucketLength,
+                                ULONGLONG time,
+                                ULONGLONG binBytes,
+                                ULONGLONG freeBytes)
+{
+    ULONGLONG bucketStart = time - (time % bucketLength);
+    if ((ring->bucketCount > 0) && (bucketStart != ring->bucketStart))
+    {
+        GrowthSample* sample = &ring->samples[ring->next];
+        sample->time = ring->bucketStart;
+        sample->binBytes = ring->binSum / ring->bucketCount;
+        sample->freeBytes = ring->freeSum / ring->bucketCount;
+        ring->next = (ring->next + 1) % GROWTH_RING_SAMPLES;
+        if (ring->count < GROWTH_RING_SAMPLES)
+        {
+            ring->count++;
+        }
+        ring->bucketCount = 0;
+        ring->binSum = 0;
+        ring->freeSum = 0;
+    }
+    if (ring->bucketCount == 0)
+    {
+        ring->bucketStart = bucketStart;
+    }
+    ring->bucketCount++;
+    ring->binSum += binBytes;
+    ring->freeSum += freeBytes;
+}
+
+/// @brief adds a sample of a volume to every resolution and to its models.
+/// This does the same amount of work however much history there is.
+/// @param volume the volume
+/// @param time the FILETIME of the sample
+/// @param binBytes the size of the bin on the volume
+/// @param freeBytes the free space on the volume
+void addGrowthSample(GrowthVolume* volume,
+                     ULONGLONG time,
+                     ULONGLONG binBytes,
+                     ULONGLONG freeBytes)
+{
+    if (volume->firstTime == 0)
+    {
+        volume->firstTime = time;
+    }
+    for (DWORD i = 0; i < GROWTH_LEVELS; i++)
+    {
+        addGrowthRingSample(&volume->rings[i],
+                            growthBucketSeconds[i] * FILETIME_PER_SECOND,
+                            time,
+                            binBytes,
+                            freeBytes);
+    }
+    updateGrowthModel(&volume->bin,
+                      time,
+                      (double) binBytes,
+                      TRUE);
+    updateGrowthModel(&volume->free,
+                      time,
+                      (double) freeBytes,
+                      FALSE);
+}
+
+/// @brief fires the alert when the forecast first drops below the
+/// threshold, and rearms it once the forecast has recovered
+/// @param file the growth file, just sampled
+static void checkGrowthAlert(GrowthFile* file)
+{
+    int alertDays = getIniInt(INI_KEY_FORECAST_ALERT_DAYS,
+                              INI_DEFAULT_VALUE_FORECAST_ALERT_DAYS);
+    if (alertDays <= 0)
+    {
+        return;
+    }
+    GrowthForecast forecast = { 0 };
+    forecastGrowth(file,
+                   getGrowthQuota(),
+                   &forecast);
+    double threshold = (double) alertDays * SECONDS_PER_DAY;
+    if (forecast.found && (forecast.seconds < threshold))
+    {
+        if (file->alerted == FALSE)
+        {
+            file->alerted = TRUE;
+            runGrowthAlert(&forecast);
+        }
+    }
+    else if ((forecast.found == FALSE) ||
+             (forecast.seconds > threshold * GROWTH_REARM_PERCENT / 100))
+    {
+        file->alerted = FALSE;
+    }
+}
+
+/// @brief unmaps and closes a growth file
+/// @param history the growth file
+void closeGrowthHistory(GrowthHistory* history)
+{
+    if (history->file != NULL)
+    {
+        UnmapViewOfFile(history->file);
+    }
+    if (history->hMapping != NULL)
+    {
+        CloseHandle(history->hMapping);
+    }
+    if ((history->hFile != NULL) && (history->hFile != INVALID_HANDLE_VALUE))
+    {
+        CloseHandle(history->hFile);
+    }
+    ZeroMemory(history,
+               sizeof(GrowthHistory));
+}
+
+/// @brief keeps a limit in the forecast if it is the first to be reached
+/// @param forecast the forecast
+/// @param seconds how long until the limit is reached
+/// @param driveLetter the volume that runs out of space, 0 for the quota
+static void considerGrowthLimit(GrowthForecast* forecast,
+                                double seconds,
+                                wchar_t driveLetter)
+{
+    if (seconds < 0)
+    {
+        seconds = 0;
+    }
+    if ((forecast->found == FALSE) || (seconds < forecast->seconds))
+    {
+        forecast->found = TRUE;
+        forecast->seconds = seconds;
+        forecast->driveLetter = driveLetter;
+    }
+}
+
+/// @brief forecasts which limit is reached first: a volume running out of
+/// free space, or the whole bin growing past the quota. Volumes without an
+/// hour of history, or that have not been sampled for a day, are left out.
+/// @param file the growth file
+/// @param quotaBytes the most the bin may hold in bytes, 0 for no quota
+/// @param forecast receives the forecast
+/// @return TRUE if a limit will be reached, FALSE if nothing is filling up
+BOOL forecastGrowth(const GrowthFile* file,
+                    ULONGLONG quotaBytes,
+                    GrowthForecast* forecast)
+{
+    memset(forecast,
+           0,
+           sizeof(*forecast));
+    double binLevel = 0;
+    double binTrend = 0;
+    for (DWORD i = 0; i < GROWTH_VOLUMES; i++)
+    {
+        const GrowthVolume* volume = &file->volumes[i];
+        if ((volume->firstTime == 0) ||
+            (volume->bin.time + (GROWTH_STALE_SECONDS * FILETIME_PER_SECOND) < file->lastSample) ||
+            (volume->bin.time < volume->firstTime + (GROWTH_MIN_HISTORY * FILETIME_PER_SECOND)))
+        {
+            continue;
+        }
+        binLevel += volume->bin.level;
+        binTrend += volume->bin.trend;
+        if (volume->free.trend < 0)
+        {
+            considerGrowthLimit(forecast,
+                                volume->free.level / -volume->free.trend,
+                                (wchar_t) (L'A' + i));
+        }
+    }
+
+    // The quota covers the bins on every volume together
+    if ((quotaBytes > 0) && (binTrend > 0))
+    {
+        considerGrowthLimit(forecast,
+                            ((double) quotaBytes - binLevel) / binTrend,
+                            0);
+    }
+    return forecast->found;
+}
+
+/// @brief gets the full path to the growth file in the app data folder
+/// @param growthPath receives the path
+/// @param cchGrowthPath the size of growthPath in characters
+/// @return TRUE on success, FALSE if the path could not be built
+BOOL getGrowthPath(wchar_t* growthPath,
+                   size_t cchGrowthPath)
+{
+    return getAppDataFilePath(GROWTH_FILENAME,
+                              growthPath,
+                              cchGrowthPath);
+}
+
+/// @brief gets the quota from Settings.ini
+/// @param none
+/// @return the quota in bytes, 0 for none
+static ULONGLONG getGrowthQuota(void)
+{
+    int megabytes = getIniInt(INI_KEY_QUOTA_MEGABYTES,
+                              INI_DEFAULT_VALUE_QUOTA_MEGABYTES);
+    return (megabytes > 0) ? (ULONGLONG) megabytes * 1048576 : 0;
+}
+
+/// @brief gets a finished sample from a ring
+/// @param ring the ring
+/// @param age 0 for the newest sample, 1 for the one before and so on
+/// @return the sample, NULL if the ring does not go back that far
+const GrowthSample* getGrowthSample(const GrowthRing* ring,
+                                    DWORD age)
+{
+    if (age >= ring->count)
+    {
+        return NULL;
+    }
+    return &ring->samples[(ring->next + GROWTH_RING_SAMPLES - 1 - age) % GROWTH_RING_SAMPLES];
+}
+
+/// @brief maps a growth file into memory. Opened for writing, a file that
+/// is missing, or from another version, is started again from nothing.
+/// @param growthPath the full path to the growth file
+/// @param writable TRUE to sample into it, FALSE to only read it
+/// @param history receives the mapped file, close it with closeGrowthHistory()
+/// @return TRUE if the file was opened and is valid, FALSE if not
+BOOL openGrowthHistory(const wchar_t* growthPath,
+                       BOOL writable,
+                       GrowthHistory* history)
+{
+    ZeroMemory(history,
+               sizeof(GrowthHistory));
+    history->hFile = CreateFileW(growthPath,
+                                 (writable) ? (GENERIC_READ | GENERIC_WRITE) : GENERIC_READ,
+                                 FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                                 NULL,
+                                 (writable) ? OPEN_ALWAYS : OPEN_EXISTING,
+                                 FILE_ATTRIBUTE_NORMAL,
+                                 NULL);
+    if (history->hFile == INVALID_HANDLE_VALUE)
+    {
+        return FALSE;
+    }
+    LARGE_INTEGER fileSize = { 0 };
+    if ((GetFileSizeEx(history->hFile, &fileSize) == FALSE) ||
+        ((writable == FALSE) && (fileSize.QuadPart != (LONGLONG) sizeof(GrowthFile))))
+    {
+        closeGrowthHistory(history);
+        return FALSE;
+    }
+
+    // Mapping a writable file at a larger size grows it with zeros
+    BOOL fresh = (fileSize.QuadPart != (LONGLONG) sizeof(GrowthFile));
+    if (fresh && (fileSize.QuadPart > 0))
+    {
+        LARGE_INTEGER start = { 0 };
+        SetFilePointerEx(history->hFile,
+                         start,
+                         NULL,
+                         FILE_BEGIN);
+        SetEndOfFile(history->hFile);
+    }
+    history->hMapping = CreateFileMappingW(history->hFile,
+                                           NULL,
+                                           (writable) ? PAGE_READWRITE : PAGE_READONLY,
+                                           0,
+                                           sizeof(GrowthFile),
+                                           NULL);
+    if (history->hMapping == NULL)
+    {
+        closeGrowthHistory(history);
+        return FALSE;
+    }
+    history->file = MapViewOfFile(history->hMapping,
+                                  (writable) ? FILE_MAP_WRITE : FILE_MAP_READ,
+                                  0,
+                                  0,
+                                  sizeof(GrowthFile));
+    if (history->file == NULL)
+    {
+        closeGrowthHistory(history);
+        return FALSE;
+    }
+
+    GrowthFile* file = history->file;
+    if (fresh ||
+        (file->magic != GROWTH_MAGIC) ||
+        (file->version != GROWTH_VERSION) ||
+        (file->fileSize != sizeof(GrowthFile)))
+    {
+        if (writable == FALSE)
+        {
+            closeGrowthHistory(history);
+            return FALSE;
+        }
+        LOG(L"Starting growth tracking afresh in %s\n",
+            growthPath);
+        ZeroMemory(file,
+                   sizeof(GrowthFile));
+        file->magic = GROWTH_MAGIC;
+        file->version = GROWTH_VERSION;
+        file->fileSize = sizeof(GrowthFile);
+    }
+    return TRUE;
+}
+
+/// @brief reads the forecast from the growth file, for showing while the
+/// process that samples keeps writing to it
+/// @param forecast receives the forecast, counted from now
+/// @return TRUE if a limit will be reached, FALSE if nothing is filling up
+///         or there is no recent history
+BOOL readGrowthForecast(GrowthForecast* forecast)
+{
+    memset(forecast,
+           0,
+           sizeof(*forecast));
+    wchar_t growthPath[MAX_PATH + 1] = { 0 };
+    GrowthHistory history = { 0 };
+    if ((getGrowthPath(growthPath, ARRAYSIZE(growthPath)) == FALSE) ||
+        (openGrowthHistory(growthPath, FALSE, &history) == FALSE))
+    {
+        return FALSE;
+    }
+    ULONGLONG now = getCurrentFileTime();
+    ULONGLONG lastSample = history.file->lastSample;
+    BOOL found = (now < lastSample + (GROWTH_STALE_SECONDS * FILETIME_PER_SECOND)) &&
+        forecastGrowth(history.file,
+                       getGrowthQuota(),
+                       forecast);
+    closeGrowthHistory(&history);
+    if (found && (now > lastSample))
+    {
+        forecast->seconds -= (double) ((now - lastSample) / FILETIME_PER_SECOND);
+        if (forecast->seconds < 0)
+        {
+            forecast->seconds = 0;
+        }
+    }
+    forecast->found = found;
+    return found;
+}
+
+/// @brief logs the forecast and runs the ForecastAlertCommand, if there is
+/// one, with the volume (or quota) and the days left as arguments
+/// @param forecast the forecast that crossed the threshold
+static void runGrowthAlert(const GrowthForecast* forecast)
+{
+    wchar_t limit[8] = { 0 };
+    _snwprintf(limit,
+               ARRAYSIZE(limit),
+               (forecast->driveLetter != 0) ? L"%c:" : L"quota",
+               forecast->driveLetter);
+    limit[ARRAYSIZE(limit) - 1] = 0;
+    ULONGLONG days = (ULONGLONG) (forecast->seconds / SECONDS_PER_DAY);
+    LOG(L"Forecast to reach the %s limit in %llu days\n",
+        limit,
+        days);
+
+    wchar_t command[GROWTH_COMMAND_CCH] = { 0 };
+    if (getIniString(INI_KEY_FORECAST_ALERT_COMMAND,
+                     command,
+                     ARRAYSIZE(command)) == FALSE)
+    {
+        return;
+    }
+    wchar_t commandLine[GROWTH_COMMAND_CCH + 32] = { 0 };
+    _snwprintf(commandLine,
+               ARRAYSIZE(commandLine),
+               L"%s %s %llu",
+               command,
+               limit,
+               days);
+    commandLine[ARRAYSIZE(commandLine) - 1] = 0;
+
+    STARTUPINFOW startupInfo = { sizeof(startupInfo) };
+    PROCESS_INFORMATION processInfo = { 0 };
+    if (CreateProcessW(NULL,
+                       commandLine,
+                       NULL,
+                       NULL,
+                       FALSE,
+                       CREATE_NO_WINDOW,
+                       NULL,
+                       NULL,
+                       &startupInfo,
+                       &processInfo) == FALSE)
+    {
+        LOG(L"Failed to run %s, error code %d\n",
+            commandLine,
+            GetLastError());
+        return;
+    }
+    CloseHandle(processInfo.hThread);
+    CloseHandle(processInfo.hProcess);
+}
+
+/// @brief samples the bin size and free space of every fixed volume into
+/// the growth file, and fires the alert if the forecast has crossed the
+/// threshold
+/// @param none
+/// @return TRUE on success, FALSE if the growth file could not be opened
+BOOL sampleGrowth(void)
+{
+    wchar_t growthPath[MAX_PATH + 1] = { 0 };
+    GrowthHistory history = { 0 };
+    if ((getGrowthPath(growthPath, ARRAYSIZE(growthPath)) == FALSE) ||
+        (openGrowthHistory(growthPath, TRUE, &history) == FALSE))
+    {
+        return FALSE;
+    }
+    ULONGLONG now = getCurrentFileTime();
+    DWORD drives = GetLogicalDrives();
+    for (DWORD i = 0; i < GROWTH_VOLUMES; i++)
+    {
+        wchar_t volumeRoot[] = { (wchar_t) (L'A' + i), L':', L'\\', 0 };
+        if (((drives & (1 << i)) == 0) ||
+            (GetDriveTypeW(volumeRoot) != DRIVE_FIXED))
+        {
+            continue;
+        }
+        SHQUERYRBINFO info = { sizeof(SHQUERYRBINFO) };
+        ULARGE_INTEGER available = { 0 };
+        if ((SHQueryRecycleBinW(volumeRoot, &info) != S_OK) ||
+            (GetDiskFreeSpaceExW(volumeRoot, &available, NULL, NULL) == FALSE))
+        {
+            continue;
+        }
+        addGrowthSample(&history.file->volumes[i],
+                        now,
+                        (ULONGLONG) info.i64Size,
+                        available.QuadPart);
+    }
+    history.file->lastSample = now;
+    checkGrowthAlert(history.file);
+    closeGrowthHistory(&history);
+    return TRUE;
+}
+
+/// @brief tests downsampling, the models and the forecast on made up
+/// samples, and that a growth file survives being reopened, in a debug
+/// build, returns immediately in a release build
+/// @param none
+void testGrowth(void)
+{
+#ifndef NDEBUG
+    // The file is too large for the stack of a worker thread
+    GrowthFile* file = HeapAlloc(GetProcessHeap(),
+                                 HEAP_ZERO_MEMORY,
+                                 sizeof(GrowthFile));
+    assert(file != NULL);
+
+    // A day of C: gaining 1 MB a minute in the bin and losing 2 MB a minute
+    // of free space, starting at midnight
+    ULONGLONG minute = 60 * FILETIME_PER_SECOND;
+    ULONGLONG start = 154000 * SECONDS_PER_DAY * FILETIME_PER_SECOND;
+    ULONGLONG megabyte = 1048576;
+    GrowthVolume* volume = &file->volumes[L'C' - L'A'];
+    for (ULONGLONG i = 0; i <= 1440; i++)
+    {
+        addGrowthSample(volume,
+                        start + (i * minute),
+                        (1000 + i) * megabyte,
+                        (100000 - (2 * i)) * megabyte);
+    }
+    file->lastSample = start + (1440 * minute);
+
+    // Minutes are kept as they are, hours are averaged, and the day is done
+    const GrowthSample* sample = getGrowthSample(&volume->rings[0], 0);
+    assert((volume->rings[0].count == GROWTH_RING_SAMPLES) && (sample != NULL));
+    assert((sample->time == start + (1439 * minute)) && (sample->binBytes == 2439 * megabyte));
+    sample = getGrowthSample(&volume->rings[1], 0);
+    assert((volume->rings[1].count == 24) && (sample != NULL));
+    assert((sample->time == start + (1380 * minute)) && (sample->binBytes == (24095 * megabyte) / 10));
+    assert((volume->rings[2].count == 1) && (getGrowthSample(&volume->rings[2], 1) == NULL));
+    assert(getGrowthSample(&volume->rings[2], 0)->time == start);
+
+    // The trends settle on the real rates, to within a few percent after a day
+    double binRate = (double) megabyte / 60;
+    assert((volume->bin.trend > binRate * 0.97) && (volume->bin.trend < binRate * 1.03));
+    assert((volume->free.trend < -2 * binRate * 0.97) && (volume->free.trend > -2 * binRate * 1.03));
+
+    // Free space runs out in about 48560 minutes, a 3 GB quota is reached
+    // in about 632 minutes and wins
+    GrowthForecast forecast = { 0 };
+    BOOL result = forecastGrowth(file,
+                                 0,
+                                 &forecast);
+    assert(result && (forecast.driveLetter == L'C'));
+    assert((forecast.seconds > 48560 * 60 * 0.97) && (forecast.seconds < 48560 * 60 * 1.03));
+    result = forecastGrowth(file,
+                            3072 * megabyte,
+                            &forecast);
+    assert(result && (forecast.driveLetter == 0));
+    assert((forecast.seconds > 632 * 60 * 0.95) && (forecast.seconds < 632 * 60 * 1.05));
+
+    // Emptying the bin is not a trend, and a volume gone for a day is ignored
+    addGrowthSample(volume,
+                    start + (1441 * minute),
+                    0,
+                    99000 * megabyte);
+    assert((volume->bin.level == 0) && (volume->bin.trend > binRate * 0.97));
+    file->lastSample = start + (1441 * minute) + (GROWTH_STALE_SECONDS * FILETIME_PER_SECOND) + 1;
+    result = forecastGrowth(file,
+                            3072 * megabyte,
+                            &forecast);
+    assert(result == FALSE);
+
+    // A new volume needs an hour of history before it is forecast
+    memset(file,
+           0,
+           sizeof(GrowthFile));
+    for (ULONGLONG i = 0; i < 30; i++)
+    {
+        addGrowthSample(&file->volumes[3],
+                        start + (i * minute),
+                        i * megabyte,
+                        (1000 - i) * megabyte);
+    }
+    file->lastSample = start + (29 * minute);
+    result = forecastGrowth(file,
+                            0,
+                            &forecast);
+    assert(result == FALSE);
+    HeapFree(GetProcessHeap(),
+             0,
+             file);
+
+    // Samples written through the mapping are there when it is reopened,
+    // and a file from another version is started again
+    wchar_t tempDirectory[MAX_PATH + 1] = { 0 };
+    wchar_t growthPath[MAX_PATH + 1] = { 0 };
+    GetTempPathW(ARRAYSIZE(tempDirectory),
+                 tempDirectory);
+    _snwprintf(growthPath,
+               ARRAYSIZE(growthPath),
+               L"%srbmgrowth%08X.bin",
+               tempDirectory,
+               GetCurrentProcessId());
+    growthPath[MAX_PATH] = 0;
+    DeleteFileW(growthPath);
+    GrowthHistory history = { 0 };
+    result = openGrowthHistory(growthPath,
+                               FALSE,
+                               &history);
+    assert(result == FALSE);
+    result = openGrowthHistory(growthPath,
+                               TRUE,
+                               &history);
+    assert(result);
+    addGrowthSample(&history.file->volumes[2],
+                    start,
+                    5,
+                    7);
+    history.file->lastSample = start;
+    closeGrowthHistory(&history);
+    result = openGrowthHistory(growthPath,
+                               FALSE,
+                               &history);
+    assert(result && (history.file->lastSample == start));
+    assert(history.file->volumes[2].rings[0].binSum == 5);
+    closeGrowthHistory(&history);
+
+    HANDLE hFile = CreateFileW(growthPath,
+                               GENERIC_WRITE,
+                               0,
+                               NULL,
+                               OPEN_EXISTING,
+                               FILE_ATTRIBUTE_NORMAL,
+                               NULL);
+    assert(hFile != INVALID_HANDLE_VALUE);
+    DWORD oldVersion[2] = { GROWTH_MAGIC, GROWTH_VERSION + 1 };
+    DWORD written = 0;
+    WriteFile(hFile,
+              oldVersion,
+              sizeof(oldVersion),
+              &written,
+              NULL);
+    CloseHandle(hFile);
+    result = openGrowthHistory(growthPath,
+                               FALSE,
+                               &history);
+    assert(result == FALSE);
+    result = openGrowthHistory(growthPath,
+                               TRUE,
+                               &history);
+    assert(result && (history.file->lastSample == 0));
+    closeGrowthHistory(&history);
+    DeleteFileW(growthPath);
+#endif
+}
+
+/// @brief moves a model on to a new sample. The level is pulled towards the
+/// sample and the trend towards the change in level, each by how long it
+/// has been since the last sample, so samples need not be evenly spaced.
+/// @param model the model
+/// @param time the FILETIME of the sample. A sample that is not newer than
+/// the last one, after the clock was turned back, is ignored.
+/// @param value the sample
+/// @param levelOnDrop TRUE if a drop is a cleanup rather than a trend, like
+/// emptying the bin: the level drops with it and the trend carries on
+static void updateGrowthModel(GrowthModel* model,
+                              ULONGLONG time,
+                              double value,
+                              BOOL levelOnDrop)
+{
+    if (model->time == 0)
+    {
+        model->level = value;
+        model->trend = 0;
+        model->time = time;
+        return;
+    }
+    if (time <= model->time)
+    {
+        return;
+    }
+    double seconds = (double) (time - model->time) / FILETIME_PER_SECOND;
+    model->time = time;
+    if (levelOnDrop && (value < model->level))
+    {
+        model->level = value;
+        return;
+    }
+    double predicted = model->level + (model->trend * seconds);
+    double levelWeight = seconds / (seconds + GROWTH_LEVEL_SMOOTHING);
+    double trendWeight = seconds / (seconds + GROWTH_TREND_SMOOTHING);
+    double level = predicted + (levelWeight * (value - predicted));
+    model->trend += trendWeight * (((level - model->level) / seconds) - model->trend);
+    model->level = level;
+}
@@ -0,0 +1,107 @@
+#define _CRT_SECURE_NO_WARNINGS
+
+#pragma once
+#include <Windows.h>
+#include <shellapi.h>
+#include <stdio.h>
+#include <assert.h>
+#include "scheduler.h"
+
+// Growth tracking parameters. Once a minute, the size of the bin and the
+// free space on each fixed volume are added to a ring file in the app data
+// folder at three resolutions: minutes, hours and days. Each resolution is
+// a ring of fixed length that samples are averaged into until their minute,
+// hour or day is over, so the file never grows and a sample costs the same
+// however long the bin has been tracked. Each sample also updates a model
+// of the bin size and of the free space, a level and a trend that are both
+// exponentially smoothed, from which the time until the bin reaches the
+// quota or the volume runs out of space is forecast. When that drops below
+// ForecastAlertDays, the ForecastAlertCommand is run once, and again only
+// after the forecast has recovered. Bump GROWTH_VERSION whenever the layout
+// of any struct in the file changes.
+
+#define GROWTH_FILENAME         L"Growth.bin"
+#define GROWTH_MAGIC            0x47424D52 // "RMBG" when read as bytes
+#define GROWTH_VERSION          1
+#define GROWTH_SAMPLE_INTERVAL  60 // Seconds between samples
+#define GROWTH_VOLUMES          26 // One for each drive letter
+#define GROWTH_LEVELS           3 // Minutes, hours and days
+#define GROWTH_RING_SAMPLES     120 // 2 hours of minutes, 5 days of hours, 4 months of days
+#define GROWTH_LEVEL_SMOOTHING  900 // Seconds over which the level settles
+#define GROWTH_TREND_SMOOTHING  21600 // Seconds over which the trend settles
+#define GROWTH_MIN_HISTORY      3600 // Seconds of samples before a volume is forecast
+#define GROWTH_STALE_SECONDS    SECONDS_PER_DAY // Volumes not sampled since are ignored
+#define GROWTH_REARM_PERCENT    150 // Forecast must recover past this much of the threshold
+#define GROWTH_COMMAND_CCH      1024
+
+// Structs
+
+typedef struct GrowthSample
+{
+    ULONGLONG time; // FILETIME the sample's minute, hour or day started
+    ULONGLONG binBytes;
+    ULONGLONG freeBytes;
+} GrowthSample;
+
+typedef struct GrowthRing
+{
+    GrowthSample samples[GROWTH_RING_SAMPLES];
+    DWORD next; // Where the next finished sample goes
+    DWORD count; // Samples in the ring, at most GROWTH_RING_SAMPLES
+    ULONGLONG bucketStart; // FILETIME the unfinished sample started, 0 if none
+    ULONGLONG bucketCount; // Samples added up into the unfinished one
+    ULONGLONG binSum;
+    ULONGLONG freeSum;
+} GrowthRing;
+
+typedef struct GrowthModel
+{
+    double level; // Smoothed value in bytes
+    double trend; // Smoothed change in bytes per second
+    ULONGLONG time; // FILETIME of the last sample, 0 before the first
+} GrowthModel;
+
+typedef struct GrowthVolume
+{
+    ULONGLONG firstTime; // FILETIME of the first sample, 0 if never sampled
+    GrowthModel bin;
+    GrowthModel free;
+    GrowthRing rings[GROWTH_LEVELS];
+} GrowthVolume;
+
+typedef struct GrowthFile
+{
+    DWORD magic; // Always GROWTH_MAGIC
+    DWORD version; // Always GROWTH_VERSION
+    DWORD fileSize; // sizeof(GrowthFile)
+    BOOL alerted; // The alert fired and has not been rearmed
+    ULONGLONG lastSample; // FILETIME of the last sample of any volume
+    GrowthVolume volumes[GROWTH_VOLUMES]; // Indexed by drive letter
+} GrowthFile;
+
+typedef struct GrowthHistory
+{
+    HANDLE hFile;
+    HANDLE hMapping;
+    GrowthFile* file; // The mapped file, read and written in place
+} GrowthHistory;
+
+typedef struct GrowthForecast
+{
+    BOOL found; // A limit will be reached
+    double seconds; // From the last sample until it is
+    wchar_t driveLetter; // The volume that runs out of space, 0 for the quota
+} GrowthForecast;
+
+// Functions
+
+void addGrowthSample(GrowthVolume* volume, ULONGLONG time, ULONGLONG binBytes,
+                     ULONGLONG freeBytes);
+void closeGrowthHistory(GrowthHistory* history);
+BOOL forecastGrowth(const GrowthFile* file, ULONGLONG quotaBytes, GrowthForecast* forecast);
+BOOL getGrowthPath(wchar_t* growthPath, size_t cchGrowthPath);
+const GrowthSample* getGrowthSample(const GrowthRing* ring, DWORD age);
+BOOL openGrowthHistory(const wchar_t* growthPath, BOOL writable, GrowthHistory* history);
+BOOL readGrowthForecast(GrowthForecast* forecast);
+BOOL sampleGrowth(void);
+void testGrowth(void);
@@ -21,6 +21,19 @@
 #include "ini.h"
 #include "logger.h"
 
+static wchar_t appDataIniPath[MAX_PATH + 1] = { 0 };
+static BOOL appDataIniPathIsTooLong = FALSE;
+static INIT_ONCE appDataIniPathOnce = INIT_ONCE_STATIC_INIT;
+static wchar_t localAppData[MAX_PATH + 1] = { 0 };
+static INIT_ONCE localAppDataOnce = INIT_ONCE_STATIC_INIT;
+static wchar_t progDirIniPath[MAX_PATH + 1] = { 0 };
+static BOOL progDirIniPathIsTooLong = FALSE;
+static INIT_ONCE progDirIniPathOnce = INIT_ONCE_STATIC_INIT;
+
+static BOOL CALLBACK findAppDataIniPath(PINIT_ONCE initOnce, void* parameter, void** context);
+static BOOL CALLBACK findLocalAppDataDirectory(PINIT_ONCE initOnce, void* parameter, void** context);
+static BOOL CALLBACK findProgramDirIniPath(PINIT_ONCE initOnce, void* parameter, void** context);
+
 /// @brief checks for the existence of the ini file in the program's 
 /// directory or localappdata
 /// @param none
@@ -194,124 +207,248 @@ BOOL createIniIfNonexistent(void)
     return FALSE;
 }
 
-/// @brief gets the path to the ini file in appdata
-/// @param none
-/// @return the path to the ini file, including the filename
-wchar_t* getAppDataIniPath(void)
+/// @brief builds the path to the ini file in appdata for
+/// getAppDataIniPath()
+/// @param initOnce unused
+/// @param parameter unused
+/// @param context unused
+/// @return TRUE, a path that is too long stays too long
+static BOOL CALLBACK findAppDataIniPath(PINIT_ONCE initOnce,
+                                        void* parameter,
+                                        void** context)
 {
-    static BOOL pathIsTooLong = FALSE;
-    static wchar_t appDataIniPath[MAX_PATH + 1] = { 0 };
-    if (pathIsTooLong)
+    UNREFERENCED_PARAMETER(initOnce);
+    UNREFERENCED_PARAMETER(parameter);
+    UNREFERENCED_PARAMETER(context);
+    wchar_t* appDataDir = getLocalAppDataDirectory();
+
+    // Check if resulting path is too long. We need 3 slashes.
+    size_t pathLength = wcslen(appDataDir) +
+        wcslen(PROGRAM_VENDOR) +
+        wcslen(PROGRAM_NAME) +
+        wcslen(INI_FILENAME) +
+        3;
+    if (pathLength > MAX_PATH)
     {
-        return NULL;
+        appDataIniPathIsTooLong = TRUE;
     }
-    else if (appDataIniPath[0] == 0)
+
+    // Otherwise, build the path
+    else
     {
-        wchar_t* appDataDir = getLocalAppDataDirectory();
-
-        // Check if resulting path is too long. We need 3 slashes.
-        size_t pathLength = wcslen(appDataDir) +
-            wcslen(PROGRAM_VENDOR) +
-            wcslen(PROGRAM_NAME) +
-            wcslen(INI_FILENAME) +
-            3;
-        if (pathLength > MAX_PATH)
-        {
-            pathIsTooLong = TRUE;
-        }
+        _snwprintf(appDataIniPath,
+                   ARRAYSIZE(appDataIniPath),
+                   L"%s\\%s\\%s\\%s",
+                   appDataDir,
+                   PROGRAM_VENDOR,
+                   PROGRAM_NAME,
+                   INI_FILENAME);
+    }
+    return TRUE;
+}
 
-        // Otherwise, build the path
-        else
-        {
-            _snwprintf(appDataIniPath,
-                       ARRAYSIZE(appDataIniPath),
-                       L"%s\\%s\\%s\\%s",
-                       appDataDir,
-                       PROGRAM_VENDOR,
-                       PROGRAM_NAME,
-                       INI_FILENAME);
-        }
+/// @brief looks up the local appdata directory for
+/// getLocalAppDataDirectory()
+/// @param initOnce unused
+/// @param parameter unused
+/// @param context unused
+/// @return TRUE if it was found, FALSE to try again on the next call
+static BOOL CALLBACK findLocalAppDataDirectory(PINIT_ONCE initOnce,
+                                               void* parameter,
+                                               void** context)
+{
+    UNREFERENCED_PARAMETER(initOnce);
+    UNREFERENCED_PARAMETER(parameter);
+    UNREFERENCED_PARAMETER(context);
+    wchar_t* localAppDataKnownFolder;
+    HRESULT result = SHGetKnownFolderPath(&FOLDERID_LocalAppData,
+                                          0,
+                                          NULL,
+                                          &localAppDataKnownFolder);
+    if (result == S_OK)
+    {
+        LOG(L"Local AppData is: %s\n",
+            localAppDataKnownFolder);
+        wcscpy(localAppData,
+               localAppDataKnownFolder);
+    }
+    else
+    {
+        LOG(L"Failed to get local appdata folder!\n");
     }
-    return appDataIniPath;
+    CoTaskMemFree(localAppDataKnownFolder);
+    return (result == S_OK);
 }
 
-/// @brief gets the local appdata directory using its known folder ID
-/// @param none
-/// @return the local appdata directory
-wchar_t* getLocalAppDataDirectory(void)
+/// @brief builds the path to the ini file in the program's directory for
+/// getProgramDirIniPath()
+/// @param initOnce unused
+/// @param parameter unused
+/// @param context unused
+/// @return TRUE, a path that is too long stays too long
+static BOOL CALLBACK findProgramDirIniPath(PINIT_ONCE initOnce,
+                                           void* parameter,
+                                           void** context)
+{
+    UNREFERENCED_PARAMETER(initOnce);
+    UNREFERENCED_PARAMETER(parameter);
+    UNREFERENCED_PARAMETER(context);
+    wchar_t progDir[MAX_PATH + 1] = { 0 };
+    GetModuleFileNameW(NULL,
+                       progDir,
+                       MAX_PATH);
+    PathCchRemoveFileSpec(progDir,
+                          MAX_PATH);
+
+    // We need to add a character for the \ we're going to add the path
+    size_t pathLength = wcslen(progDir) + wcslen(INI_FILENAME) + 1;
+
+    // Check if the resulting path will be too long
+    if (pathLength > MAX_PATH)
+    {
+        LOG(L"%s %s %s\n",
+            L"The file path",
+            progDir,
+            L"is too long.");
+        progDirIniPathIsTooLong = TRUE;
+        return TRUE;
+    }
+
+    // If not, create the path and store it in progDirIniPath
+    _snwprintf(progDirIniPath,
+               ARRAYSIZE(progDirIniPath),
+               L"%s\\%s",
+               progDir,
+               INI_FILENAME);
+    LOG(L"%s %s\n",
+        L"Settings.ini path:",
+        progDirIniPath);
+    return TRUE;
+}
+
+/// @brief gets the path to a file in the program's local appdata folder,
+/// creating the folder if it does not already exist
+/// @param fileName the name of the file
+/// @param path receives the full path to the file
+/// @param cchPath the size of path in characters
+/// @return TRUE if the path fits in the buffer, FALSE if not
+BOOL getAppDataFilePath(const wchar_t* fileName,
+                        wchar_t* path,
+                        size_t cchPath)
 {
-    static wchar_t localAppData[MAX_PATH + 1] = { 0 };
+    wchar_t* localAppData = getLocalAppDataDirectory();
     if (localAppData[0] == 0)
     {
-        wchar_t* localAppDataKnownFolder;
-        HRESULT result = SHGetKnownFolderPath(&FOLDERID_LocalAppData,
-                                              0,
-                                              NULL,
-                                              &localAppDataKnownFolder);
-        if (result == S_OK)
-        {
-            LOG(L"Local AppData is: %s\n",
-                localAppDataKnownFolder);
-            wcscpy(localAppData,
-                   localAppDataKnownFolder);
-        }
-        else
-        {
-            LOG(L"Failed to get local appdata folder!\n");
-        }
-        CoTaskMemFree(localAppDataKnownFolder);
+        return FALSE;
     }
+    createAppDataDirIfNonexistent();
+    int written = _snwprintf(path,
+                             cchPath,
+                             L"%s\\%s\\%s\\%s",
+                             localAppData,
+                             PROGRAM_VENDOR,
+                             PROGRAM_NAME,
+                             fileName);
+    path[cchPath - 1] = 0;
+    return ((written >= 0) && ((size_t) written < cchPath));
+}
+
+/// @brief gets the path to the ini file in appdata. It is built once,
+/// whichever thread asks first.
+/// @param none
+/// @return the path to the ini file, including the filename
+wchar_t* getAppDataIniPath(void)
+{
+    InitOnceExecuteOnce(&appDataIniPathOnce,
+                        findAppDataIniPath,
+                        NULL,
+                        NULL);
+    return appDataIniPathIsTooLong ? NULL : appDataIniPath;
+}
+
+/// @brief gets the local appdata directory using its known folder ID. It
+/// is looked up once, whichever thread asks first.
+/// @param none
+/// @return the local appdata directory
+wchar_t* getLocalAppDataDirectory(void)
+{
+    InitOnceExecuteOnce(&localAppDataOnce,
+                        findLocalAppDataDirectory,
+                        NULL,
+                        NULL);
     return localAppData;
 }
 
-/// @brief gets the path to the ini file in the program's directory
+/// @brief gets the path to the ini file in the program's directory. It is
+/// built once, whichever thread asks first.
 /// @param none
 /// @return the path to the ini file, including the filename
 wchar_t* getProgramDirIniPath(void)
 {
-    static BOOL pathIsTooLong = FALSE;
-    static wchar_t progDirIniPath[MAX_PATH + 1] = { 0 };
+    InitOnceExecuteOnce(&progDirIniPathOnce,
+                        findProgramDirIniPath,
+                        NULL,
+                        NULL);
+    return progDirIniPathIsTooLong ? NULL : progDirIniPath;
+}
 
-    // If we know the path is too long, return NULL
-    if (pathIsTooLong)
+/// @brief get an optional numeric setting in the ini file. Unlike
+/// getIniSetting(), the key does not have to be present.
+/// @param key the key name of the setting to retrieve
+/// @param defaultValue returned if the key is missing or there is a
+/// problem with the ini file
+/// @return the setting
+int getIniInt(const wchar_t* key,
+              int defaultValue)
+{
+    wchar_t* iniPath = checkForIni();
+    if (iniPath == NULL)
     {
-        return NULL;
+        return defaultValue;
     }
+    return GetPrivateProfileIntW(INI_SECTION_NAME,
+                                 key,
+                                 defaultValue,
+                                 iniPath);
+}
 
-    else if (progDirIniPath[0] == 0)
+/// @brief get every line of a section in the ini file
+/// @param section the name of the section
+/// @return the lines as null terminated strings one after another, ending
+///         with an empty string. NULL if there is no ini file or memory
+///         allocation failed. Free it with HeapFree().
+wchar_t* getIniSection(const wchar_t* section)
+{
+    wchar_t* iniPath = checkForIni();
+    if (iniPath == NULL)
+    {
+        return NULL;
+    }
+    DWORD cchBuffer = 4096;
+    for (;;)
     {
-        // Otherwise, try building the file path
-        GetModuleFileNameW(NULL,
-                           progDirIniPath,
-                           MAX_PATH);
-        PathCchRemoveFileSpec(progDirIniPath,
-                              MAX_PATH);
-
-        // We need to add a character for the \ we're going to add the path
-        size_t pathLength = wcslen(progDirIniPath) + wcslen(INI_FILENAME) + 1;
-
-        // Check if the resulting path will be too long
-        if (pathLength > MAX_PATH)
+        wchar_t* buffer = HeapAlloc(GetProcessHeap(),
+                                    0,
+                                    cchBuffer * sizeof(wchar_t));
+        if (buffer == NULL)
         {
-            LOG(L"%s %s %s\n",
-                L"The file path",
-                progDirIniPath,
-                L"is too long.");
-            pathIsTooLong = TRUE;
+            // Memory allocation failed
             return NULL;
         }
-
-        // If not, create the path and store it in appDataIniPath
-        _snwprintf(progDirIniPath,
-                   ARRAYSIZE(progDirIniPath),
-                   L"%s\\%s",
-                   progDirIniPath,
-                   INI_FILENAME);
-        LOG(L"%s %s\n",
-            L"Settings.ini path:",
-            progDirIniPath);
+        DWORD copied = GetPrivateProfileSectionW(section,
+                                                 buffer,
+                                                 cchBuffer,
+                                                 iniPath);
+        // A full buffer is reported as its size less two
+        if (copied < cchBuffer - 2)
+        {
+            return buffer;
+        }
+        HeapFree(GetProcessHeap(),
+                 0,
+                 buffer);
+        cchBuffer *= 2;
     }
-    return progDirIniPath;
 }
 
 /// @brief get a setting in the ini file
@@ -339,6 +476,31 @@ BOOL getIniSetting(wchar_t* key)
     return ((fileSetting == 1) ? TRUE : FALSE);
 }
 
+/// @brief get a text setting in the ini file
+/// @param key the key name of the setting
+/// @param buffer receives the setting, empty if it is not set
+/// @param cchBuffer the size of buffer in characters
+/// @return TRUE if the setting is set and fit in buffer, FALSE if not
+BOOL getIniString(const wchar_t* key,
+                  wchar_t* buffer,
+                  DWORD cchBuffer)
+{
+    buffer[0] = 0;
+    wchar_t* iniPath = checkForIni();
+    if (iniPath == NULL)
+    {
+        return FALSE;
+    }
+    DWORD copied = GetPrivateProfileStringW(INI_SECTION_NAME,
+                                            key,
+                                            L"",
+                                            buffer,
+                                            cchBuffer,
+                                            iniPath);
+    // A value that was cut short is reported as the size less one
+    return ((copied > 0) && (copied < cchBuffer - 1));
+}
+
 /// @brief saves a setting to the ini file
 /// @param iniPath the path to the ini file
 /// @param key the key of the setting
@@ -14,8 +14,46 @@
 #define PROGRAM_NAME                            L"Recycle Bin Manager"    
 #define INI_FILENAME                            L"Settings.ini"
 #define INI_SECTION_NAME                        L"Settings"
+#define INI_SECTION_PROTECT                     L"Protect" // Optional, one pattern per line
+#define INI_SECTION_WATERMARKS                  L"Watermarks" // Optional, one volume per line
 #define INI_KEY_SHOW_DELETE_DIALOG              L"ShowDeleteDialog"
 #define INI_DEFAULT_VALUE_SHOW_DELETE_DIALOG    TRUE
+#define INI_KEY_INSTANT_EMPTY                   L"InstantEmpty" // Optional
+#define INI_DEFAULT_VALUE_INSTANT_EMPTY         FALSE
+#define INI_KEY_SWAP_EMPTY                      L"SwapEmpty" // Optional
+#define INI_DEFAULT_VALUE_SWAP_EMPTY            FALSE
+#define INI_KEY_SECURE_EMPTY                    L"SecureEmpty" // Optional
+#define INI_DEFAULT_VALUE_SECURE_EMPTY          FALSE
+#define INI_KEY_RECLAIM_DELAY                   L"ReclaimDelaySeconds" // Optional
+#define INI_DEFAULT_VALUE_RECLAIM_DELAY         300
+#define INI_KEY_THROTTLE_FILES                  L"ThrottleFilesPerSecond" // Optional
+#define INI_DEFAULT_VALUE_THROTTLE_FILES        0 // No limit
+#define INI_KEY_THROTTLE_MEGABYTES              L"ThrottleMegabytesPerSecond" // Optional
+#define INI_DEFAULT_VALUE_THROTTLE_MEGABYTES    0 // No limit
+#define INI_KEY_SCHEDULED_EMPTY_TIME            L"ScheduledEmptyTime" // Optional, HHMM
+#define INI_DEFAULT_VALUE_SCHEDULED_EMPTY_TIME  -1 // Off
+#define INI_KEY_IDLE_EMPTY_MINUTES              L"IdleEmptyMinutes" // Optional
+#define INI_DEFAULT_VALUE_IDLE_EMPTY_MINUTES    0 // Off
+#define INI_KEY_PURGE_AFTER_DAYS                L"PurgeAfterDays" // Optional
+#define INI_DEFAULT_VALUE_PURGE_AFTER_DAYS      0 // Off
+#define INI_KEY_QUOTA_MEGABYTES                 L"QuotaMegabytes" // Optional
+#define INI_DEFAULT_VALUE_QUOTA_MEGABYTES       0 // Off
+#define INI_KEY_SCHEDULE_JITTER_MINUTES         L"ScheduleJitterMinutes" // Optional
+#define INI_DEFAULT_VALUE_SCHEDULE_JITTER       15
+#define INI_KEY_TRACK_GROWTH                    L"TrackGrowth" // Optional
+#define INI_DEFAULT_VALUE_TRACK_GROWTH          TRUE
+#define INI_KEY_FORECAST_ALERT_DAYS             L"ForecastAlertDays" // Optional
+#define INI_DEFAULT_VALUE_FORECAST_ALERT_DAYS   7
+#define INI_KEY_FORECAST_ALERT_COMMAND          L"ForecastAlertCommand" // Optional, a command line
+#define INI_KEY_ARCHIVE_PURGED                  L"ArchivePurged" // Optional
+#define INI_DEFAULT_VALUE_ARCHIVE_PURGED        FALSE
+#define INI_KEY_ARCHIVE_FOLDER                  L"ArchiveFolder" // Optional, the app data folder if not set
+#define INI_KEY_ARCHIVE_MAX_MEGABYTES           L"ArchiveMaxMegabytes" // Optional
+#define INI_DEFAULT_VALUE_ARCHIVE_MAX_MEGABYTES 4096 // 0 lets an archive grow forever
+#define INI_KEY_AUDIT_LOG                       L"AuditLog" // Optional
+#define INI_DEFAULT_VALUE_AUDIT_LOG             FALSE
+#define INI_KEY_AUDIT_KEEP_DAYS                 L"AuditKeepDays" // Optional
+#define INI_DEFAULT_VALUE_AUDIT_KEEP_DAYS       365 // 0 keeps sealed segments forever
 #define INI_COMMENT                             "; ShowDeleteDialog controls \
 if a confirmation dialog appears when emptying the recycle bin.\r\n\
 ; Set to 1 to be prompted before the recycle bin is emptied.\r\n\
@@ -29,9 +67,13 @@ char* convertWideToUtf8(wchar_t* wString);
 void createAppDataDirIfNonexistent(void);
 BOOL createIni(wchar_t* iniPath);
 BOOL createIniIfNonexistent(void);
+BOOL getAppDataFilePath(const wchar_t* fileName, wchar_t* path, size_t cchPath);
 wchar_t* getAppDataIniPath(void);
 wchar_t* getLocalAppDataDirectory(void);
 wchar_t* getProgramDirIniPath(void);
+int getIniInt(const wchar_t* key, int defaultValue);
+wchar_t* getIniSection(const wchar_t* section);
 BOOL getIniSetting(wchar_t* key);
+BOOL getIniString(const wchar_t* key, wchar_t* buffer, DWORD cchBuffer);
 BOOL saveSettingToIni(wchar_t* iniPath, wchar_t* key, BOOL value);
 void testIni(void);
\ No newline at end of file
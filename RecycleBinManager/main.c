@@ -18,7 +18,21 @@
 */
 
 #pragma once
+#include "audit.h"
+#include "bin.h"
+#include "binbackend.h"
+#include "binstate.h"
+#include "catalog.h"
+#include "cli.h"
+#include "digest.h"
+#include "estimate.h"
+#include "growth.h"
 #include "ini.h"
+#include "maintenance.h"
+#include "reclaim.h"
+#include "scheduler.h"
+#include "secure.h"
+#include "topitems.h"
 #include "logger.h"
 #include <Windows.h>
 #include <windowsx.h>
@@ -40,17 +54,32 @@
 
 #define ALIGNMENT_DWORD 4
 #define ALIGNMENT_WORD  2
+#define FILETIME_PER_DAY 864000000000ULL // 100ns intervals in a day
+#define EMPTY_BUTTON_TITLE      L"Empty Recycle Bin"
+#define UNDO_EMPTY_BUTTON_TITLE L"Undo Empty" // Shown while an instant empty can be undone
+#define TOP_ITEMS_BUTTON_TITLE  L"Largest Items"
+#define SECURE_EMPTY_STATUS     L"Securely erasing the Recycle Bin..." // Shown until it is done
+#define SECURE_EMPTY_MENU_TITLE L"Securely Empty Recycle Bin"
+#define REFRESH_DELAY_MS        250 // Notifications within this are one refresh
+#define CLOSE_WAIT_MS           5000 // Longest the window waits for its threads when it closes
 #define TOOLTIP_TEXT    L"Determines whether the delete confirmation \
 dialog is displayed"
 
 // IDs
 
 #define WM_CUSTOM_SHUPDATEIMAGE (WM_USER + 100)
+#define WM_CUSTOM_REFRESHED     (WM_USER + 101) // The catalog refresh thread is done
+#define WM_CUSTOM_SECURE_EMPTIED (WM_USER + 102) // The secure empty thread is done
 #define ID_BUTTON_OPEN_BIN      100
 #define ID_BUTTON_EMPTY_BIN     200
 #define ID_CHECKBOX_SHOW_DIALOG 300
 #define ID_TOOLTIP_SHOW_DIALOG  400
+#define ID_TEXT_STATUS          500
+#define ID_BUTTON_TOP_ITEMS     600
+#define ID_MENU_SECURE_EMPTY    0x0010 // In the system menu, so the low four bits must be clear
 #define ID_CHECKBOX_SUBCLASS    1
+#define ID_TIMER_SCHEDULER      1
+#define ID_TIMER_REFRESH        2
 #define ID_ICON_FULL_BIN        32 // Part of Shell32, do not change
 #define ID_ICON_EMPTY_BIN       31 // Part of Shell32, do not change
 
@@ -62,14 +91,39 @@ typedef struct Tooltip
     TTTOOLINFOW toolInfo; // The Toolnfo for the tooltip
 } Tooltip;
 
+typedef struct RefreshJob
+{
+    HWND hWndDialog; // Gets WM_CUSTOM_REFRESHED when the job is done
+    HANDLE hThread; // NULL while no refresh is running
+    volatile LONG cancel; // Set when the window closes, so nothing is posted
+    BOOL binIsFull; // As isBinFull() returned it once the catalog was refreshed
+    BOOL showUndo; // The bin was empty and an instant empty could be undone
+} RefreshJob;
+
+typedef struct SecureEmptyJob
+{
+    HWND hWndDialog; // Gets WM_CUSTOM_SECURE_EMPTIED when the job is done
+    HANDLE hThread; // NULL while no secure empty is running
+    volatile LONG cancel; // Set when the window closes, stops before the next file
+    ULONGLONG files; // Erased
+    ULONGLONG bytes; // Overwritten
+    BOOL result; // FALSE if anything was left in the bin
+} SecureEmptyJob;
+
 // Dialog box helper functions
 
 void* alignPointer(void* pointer, ULONG_PTR alignment);
 void centerWindow(HWND hWnd);
 size_t copyAndReturnLengthWithTerminator(const wchar_t* source, wchar_t* dest);
 int createDialogBox(HINSTANCE hInstance, HWND hWndOwner);
-void updateGui(HWND hWnd);
-void testGuiState(HWND hWnd, unsigned long registrationId);
+void formatByteSize(ULONGLONG bytes, wchar_t* buffer, size_t cchBuffer);
+void formatDuration(double seconds, wchar_t* buffer, size_t cchBuffer);
+void refreshCatalog(void);
+DWORD WINAPI refreshCatalogThread(void* jobPointer);
+void startCatalogRefresh(HWND hWndDialog, RefreshJob* job);
+void updateGui(HWND hWnd, BOOL binIsFull, BOOL showUndo);
+void testGuiState(HWND hWnd, unsigned long registrationId, BOOL binIsFull, BOOL showUndo);
+void updateStatusText(HWND hWndDialog);
 
 // Checkbox helper functions
 
@@ -80,8 +134,15 @@ void setCheckboxState(HWND hWndDialog, BOOL setCheck);
 
 // Recycle Bin helpr functions
 
+BOOL confirmEmpty(HWND hWndDialog, BOOL instant);
+void finishSecureEmpty(SecureEmptyJob* job);
+void instantEmpty(HWND hWndDialog);
 BOOL isBinFull(void);
 unsigned long registerForShellNotifs(HWND hWnd);
+void secureEmpty(HWND hWndDialog, SecureEmptyJob* job);
+DWORD WINAPI secureEmptyThread(void* jobPointer);
+void setSchedulerTimer(HWND hWndDialog, const Scheduler* scheduler);
+void showTopItems(HWND hWndDialog);
 
 // Window procedures
 
@@ -156,7 +217,7 @@ size_t copyAndReturnLengthWithTerminator(const wchar_t* source,
 int createDialogBox(HINSTANCE hInstance,
                     HWND hWndOwner)
 {
-    WORD numControls = 3;
+    WORD numControls = 5;
     short borderPadding = 3; // The amount of padding around the window border
     short buttonPadding = 2; // The amount of padding between buttons
     short buttonWidth = 80;
@@ -164,12 +225,15 @@ int createDialogBox(HINSTANCE hInstance,
     short checkboxPadding = 7; // The amount of padding to the left of the checkbox
     short checkboxHeight = 10;
     short checkboxWidth = buttonWidth;
+    short statusHeight = 24; // Three lines of text
     WORD fontSize = 11;
     const wchar_t* fontName = L"Segoe UI";
     const wchar_t* windowTitle = L"Recycle Bin Manager";
     const wchar_t* openButtonTitle = L"Open Recycle Bin";
-    const wchar_t* emptyButtonTitle = L"Empty Recycle Bin";
+    const wchar_t* emptyButtonTitle = EMPTY_BUTTON_TITLE;
+    const wchar_t* topItemsButtonTitle = TOP_ITEMS_BUTTON_TITLE;
     const wchar_t* showDialogCheckboxTitle = L"Show delete dialog";
+    const wchar_t* statusTitle = L"";
 
     DLGITEMTEMPLATE* dialogItemTemplate;
     WORD* wordPointer;
@@ -190,8 +254,9 @@ int createDialogBox(HINSTANCE hInstance,
     dialogTemplate->x = 0;
     dialogTemplate->y = 0;
     dialogTemplate->cx = buttonWidth + (2 * borderPadding);
-    dialogTemplate->cy = (buttonHeight * 2) +
+    dialogTemplate->cy = (buttonHeight * 3) +
         checkboxHeight +
+        statusHeight +
         (borderPadding * 2) +
         (buttonPadding * (numControls - 1));
 
@@ -259,14 +324,36 @@ int createDialogBox(HINSTANCE hInstance,
                                                      wideStringPointer);
     *wordPointer++ = 0; // There is no additional data
 
+    // Third button
+    wordPointer = alignPointer(wordPointer,
+                               ALIGNMENT_DWORD);
+    dialogItemTemplate = (DLGITEMTEMPLATE*) wordPointer;
+    dialogItemTemplate->x = borderPadding;
+    dialogItemTemplate->y = borderPadding + (2 * buttonPadding) + (2 * buttonHeight);
+    dialogItemTemplate->cx = buttonWidth;
+    dialogItemTemplate->cy = buttonHeight;
+    dialogItemTemplate->id = ID_BUTTON_TOP_ITEMS;
+    dialogItemTemplate->style = WS_CHILD | WS_VISIBLE | WS_TABSTOP;
+
+    wordPointer = (WORD*) alignPointer(dialogItemTemplate + 1,
+                                       ALIGNMENT_WORD);
+    *wordPointer++ = 0xFFFF; // Use a system class
+    *wordPointer++ = 0x0080; // Button class
+
+    wideStringPointer = (wchar_t*) alignPointer(wordPointer,
+                                                ALIGNMENT_WORD);
+    wordPointer += copyAndReturnLengthWithTerminator(topItemsButtonTitle,
+                                                     wideStringPointer);
+    *wordPointer++ = 0; // There is no additional data
+
     // Checkbox
     wordPointer = alignPointer(wordPointer,
                                ALIGNMENT_DWORD);
     dialogItemTemplate = (DLGITEMTEMPLATE*) wordPointer;
     dialogItemTemplate->x = checkboxPadding;
     dialogItemTemplate->y = borderPadding +
-        (2 * buttonPadding) +
-        (2 * buttonHeight);
+        (3 * buttonPadding) +
+        (3 * buttonHeight);
     dialogItemTemplate->cx = checkboxWidth;
     dialogItemTemplate->cy = checkboxHeight;
     dialogItemTemplate->id = ID_CHECKBOX_SHOW_DIALOG;
@@ -283,6 +370,31 @@ int createDialogBox(HINSTANCE hInstance,
                                                      wideStringPointer);
     *wordPointer++ = 0; // There is no additional data
 
+    // Status text
+    wordPointer = alignPointer(wordPointer,
+                               ALIGNMENT_DWORD);
+    dialogItemTemplate = (DLGITEMTEMPLATE*) wordPointer;
+    dialogItemTemplate->x = borderPadding;
+    dialogItemTemplate->y = borderPadding +
+        (4 * buttonPadding) +
+        (3 * buttonHeight) +
+        checkboxHeight;
+    dialogItemTemplate->cx = buttonWidth;
+    dialogItemTemplate->cy = statusHeight;
+    dialogItemTemplate->id = ID_TEXT_STATUS;
+    dialogItemTemplate->style = WS_CHILD | WS_VISIBLE | SS_CENTER | SS_NOPREFIX;
+
+    wordPointer = (WORD*) alignPointer(dialogItemTemplate + 1,
+                                       ALIGNMENT_WORD);
+    *wordPointer++ = 0xFFFF; // Use a system class
+    *wordPointer++ = 0x0082; // Static class
+
+    wideStringPointer = (wchar_t*) alignPointer(wordPointer,
+                                                ALIGNMENT_WORD);
+    wordPointer += copyAndReturnLengthWithTerminator(statusTitle,
+                                                     wideStringPointer);
+    *wordPointer++ = 0; // There is no additional data
+
     // Create the dialog box
     INT_PTR result = DialogBoxIndirectParamW(hInstance,
                                              dialogTemplate,
@@ -301,12 +413,165 @@ int createDialogBox(HINSTANCE hInstance,
     return (result == -1) ? -1 : 0;
 }
 
-/// @brief update the dialog box controls to reflect the current state of the bin
+/// @brief formats a size in bytes for display, e.g. 1.5 GB
+/// @param bytes the size to format
+/// @param buffer receives the formatted size
+/// @param cchBuffer the size of buffer in characters
+void formatByteSize(ULONGLONG bytes,
+                    wchar_t* buffer,
+                    size_t cchBuffer)
+{
+    const wchar_t* units[] = { L"bytes", L"KB", L"MB", L"GB", L"TB", L"PB" };
+    double size = (double) bytes;
+    int unit = 0;
+    while ((size >= 1024.0) && (unit < ARRAYSIZE(units) - 1))
+    {
+        size /= 1024.0;
+        unit++;
+    }
+    if (unit == 0)
+    {
+        _snwprintf(buffer,
+                   cchBuffer,
+                   L"%llu %s",
+                   bytes,
+                   units[unit]);
+    }
+    else
+    {
+        _snwprintf(buffer,
+                   cchBuffer,
+                   L"%.1f %s",
+                   size,
+                   units[unit]);
+    }
+    buffer[cchBuffer - 1] = 0;
+}
+
+/// @brief formats a length of time for display, e.g. 3 minutes
+/// @param seconds the length of time
+/// @param buffer receives the formatted time
+/// @param cchBuffer the size of buffer in characters
+void formatDuration(double seconds,
+                    wchar_t* buffer,
+                    size_t cchBuffer)
+{
+    if (seconds < 1.0)
+    {
+        _snwprintf(buffer,
+                   cchBuffer,
+                   L"less than a second");
+    }
+    else if (seconds < 90.0)
+    {
+        _snwprintf(buffer,
+                   cchBuffer,
+                   L"%.0f seconds",
+                   seconds);
+    }
+    else if (seconds < 90.0 * 60.0)
+    {
+        _snwprintf(buffer,
+                   cchBuffer,
+                   L"%.0f minutes",
+                   seconds / 60.0);
+    }
+    else if (seconds < 48.0 * 3600.0)
+    {
+        _snwprintf(buffer,
+                   cchBuffer,
+                   L"%.1f hours",
+                   seconds / 3600.0);
+    }
+    else
+    {
+        _snwprintf(buffer,
+                   cchBuffer,
+                   L"%.0f days",
+                   seconds / 86400.0);
+    }
+    buffer[cchBuffer - 1] = 0;
+}
+
+/// @brief brings the catalog the status text is read from up to date,
+/// reading only the parts of the bin that changed since it was written
+/// @param none
+void refreshCatalog(void)
+{
+    wchar_t catalogPath[MAX_PATH + 1] = { 0 };
+    if (getCatalogPath(catalogPath,
+                       ARRAYSIZE(catalogPath)))
+    {
+        CatalogReconcile reconcile = { 0 };
+        BOOL result = reconcileCatalog(catalogPath,
+                                       FALSE,
+                                       &reconcile);
+        if (result == FALSE)
+        {
+            LOG(L"Failed to rebuild the catalog at %s\n",
+                catalogPath);
+        }
+    }
+}
+
+/// @brief refreshes the catalog and finds out what the empty button should
+/// do off the dialog thread, then tells the dialog so it can show the
+/// result, unless it is closing
+/// @param jobPointer the RefreshJob
+/// @return always 0
+DWORD WINAPI refreshCatalogThread(void* jobPointer)
+{
+    RefreshJob* job = jobPointer;
+    refreshCatalog();
+
+    // Looking for an empty to undo waits on the staging lock
+    job->binIsFull = isBinFull();
+    job->showUndo = (job->binIsFull == FALSE) && canUndoEmpty();
+    if (job->cancel == 0)
+    {
+        PostMessageW(job->hWndDialog,
+                     WM_CUSTOM_REFRESHED,
+                     0,
+                     0);
+    }
+    return 0;
+}
+
+/// @brief starts refreshing the catalog on its own thread. The dialog gets
+/// WM_CUSTOM_REFRESHED when it is done, and must not start another before.
+/// If the thread can't be started, the catalog is refreshed before this
+/// returns.
 /// @param hWndDialog a window handle to the dialog box
-void updateGui(HWND hWndDialog)
+/// @param job receives the running job, which must not already be running
+void startCatalogRefresh(HWND hWndDialog,
+                         RefreshJob* job)
 {
-    BOOL binIsFull = isBinFull();
+    memset(job,
+           0,
+           sizeof(RefreshJob));
+    job->hWndDialog = hWndDialog;
+    job->hThread = CreateThread(NULL,
+                                0,
+                                refreshCatalogThread,
+                                job,
+                                0,
+                                NULL);
+    if (job->hThread == NULL)
+    {
+        LOG(L"Failed to start the catalog refresh, error code %d\n",
+            GetLastError());
+        refreshCatalogThread(job);
+    }
+}
 
+/// @brief update the dialog box controls to reflect the current state of the bin
+/// @param hWndDialog a window handle to the dialog box
+/// @param binIsFull TRUE if the bin has items, as found by the last refresh
+/// @param showUndo TRUE to offer to undo an instant empty instead of emptying
+void updateGui(HWND hWndDialog,
+               BOOL binIsFull,
+               BOOL showUndo)
+{
     // Set the icon. We need to add one to the icon ID to get the correct 
     // icon from Shell32. I am unsure why this is the case.
     int icon = ((binIsFull) ? ID_ICON_FULL_BIN : ID_ICON_EMPTY_BIN) + 1;
@@ -321,12 +586,90 @@ void updateGui(HWND hWndDialog)
                  ICON_BIG,
                  (LPARAM) hIcon);
 
-    // Enable or disable the empty button
+    // Enable or disable the empty button. While the bin is empty it can
+    // undo an instant empty instead.
+    SetDlgItemTextW(hWndDialog,
+                    ID_BUTTON_EMPTY_BIN,
+                    (showUndo) ? UNDO_EMPTY_BUTTON_TITLE : EMPTY_BUTTON_TITLE);
     EnableWindow(GetDlgItem(hWndDialog,
                             ID_BUTTON_EMPTY_BIN),
-                 binIsFull);
+                 (binIsFull == TRUE) || showUndo);
+    EnableWindow(GetDlgItem(hWndDialog,
+                            ID_BUTTON_TOP_ITEMS),
+                 binIsFull == TRUE);
     SetFocus(GetDlgItem(hWndDialog,
                         ID_BUTTON_OPEN_BIN));
+    updateStatusText(hWndDialog);
+}
+
+/// @brief shows the item count, total size, age of the oldest item and
+/// when the bin is forecast to fill up. This only reads the header of the
+/// catalog and the growth file, so it is cheap enough to call before the
+/// bin has been scanned at all.
+/// @param hWndDialog a window handle to the dialog box
+void updateStatusText(HWND hWndDialog)
+{
+    wchar_t catalogPath[MAX_PATH + 1] = { 0 };
+    wchar_t status[128] = { 0 };
+    CatalogHeader header = { 0 };
+    if ((getCatalogPath(catalogPath, ARRAYSIZE(catalogPath)) == FALSE) ||
+        (readCatalogHeader(catalogPath, &header) == FALSE))
+    {
+        SetDlgItemTextW(hWndDialog,
+                        ID_TEXT_STATUS,
+                        L"");
+        return;
+    }
+
+    // Other processes read the state from here rather than scanning
+    publishBinState(header.itemCount,
+                    header.totalBytes);
+
+    if (header.itemCount == 0)
+    {
+        _snwprintf(status,
+                   ARRAYSIZE(status),
+                   L"The bin is empty");
+    }
+    else
+    {
+        wchar_t size[32] = { 0 };
+        formatByteSize(header.totalBytes,
+                       size,
+                       ARRAYSIZE(size));
+        ULONGLONG now = getCurrentFileTime();
+        ULONGLONG oldestAgeDays = (now > header.oldestDeletionTime) ?
+            ((now - header.oldestDeletionTime) / FILETIME_PER_DAY) : 0;
+        _snwprintf(status,
+                   ARRAYSIZE(status),
+                   L"%llu item%s, %s\nOldest: %llu day%s ago",
+                   header.itemCount,
+                   (header.itemCount == 1) ? L"" : L"s",
+                   size,
+                   oldestAgeDays,
+                   (oldestAgeDays == 1) ? L"" : L"s");
+
+        // Warn before the bin fills a volume or reaches the quota
+        GrowthForecast forecast = { 0 };
+        if (readGrowthForecast(&forecast))
+        {
+            wchar_t duration[32] = { 0 };
+            wchar_t volume[] = { forecast.driveLetter, L':', 0 };
+            size_t length = wcslen(status);
+            formatDuration(forecast.seconds,
+                           duration,
+                           ARRAYSIZE(duration));
+            _snwprintf(status + length,
+                       ARRAYSIZE(status) - length,
+                       L"\n%s full in %s",
+                       (forecast.driveLetter != 0) ? volume : L"Quota",
+                       duration);
+        }
+    }
+    status[ARRAYSIZE(status) - 1] = 0;
+    SetDlgItemTextW(hWndDialog,
+                    ID_TEXT_STATUS,
+                    status);
 }
 
 /// @brief verifies that the dialog box controls are consistent with the bin state
@@ -334,8 +677,12 @@ void updateGui(HWND hWndDialog)
 /// @param hWndDialog a handle to the dialog window
 /// @param registrationId the current registration ID for shell notifications.
 /// If this is is 0 (registration failed), the GUI will not update
+/// @param binIsFull what the refresh found, as passed to updateGui()
+/// @param showUndo whether the refresh found an empty to undo
 void testGuiState(HWND hWndDialog,
-                  unsigned long registrationId)
+                  unsigned long registrationId,
+                  BOOL binIsFull,
+                  BOOL showUndo)
 {
     // If debugging is not enabled, we don't have assert, 
     // and these tests are counterproductive
@@ -347,8 +694,8 @@ void testGuiState(HWND hWndDialog,
         return;
     }
 
-    // Get the actual state of the recycle bin
-    BOOL binIsFull = isBinFull();
+    // The bin may have changed since the refresh, so the controls are
+    // checked against what it found rather than the bin itself
 
     // There wasn't a problem with querying the recycle bin
     assert(binIsFull > -1);
@@ -376,7 +723,7 @@ void testGuiState(HWND hWndDialog,
     assert(iconId == ((binIsFull) ? ID_ICON_FULL_BIN : ID_ICON_EMPTY_BIN));
 
     // Check empty button 
-    assert(btnEmptyEnabled == binIsFull);
+    assert(btnEmptyEnabled == ((binIsFull == TRUE) || showUndo));
 #endif
 }
 
@@ -476,6 +823,141 @@ void setCheckboxState(HWND hWndDialog,
                     (setCheck) ? BST_CHECKED : BST_UNCHECKED);
 }
 
+/// @brief asks the user to confirm emptying the bin, saying how much there
+/// is to delete and how long it should take. The size of a large bin is
+/// estimated from a sample, so this never waits long.
+/// @param hWndDialog a window handle to the dialog box
+/// @param instant TRUE for an instant empty, whose space is freed in the
+/// background through the throttle
+/// @return TRUE if the user chose to empty the bin
+BOOL confirmEmpty(HWND hWndDialog,
+                  BOOL instant)
+{
+    TreeEstimate estimate = { 0 };
+    estimateEmptyCost(ESTIMATE_DEFAULT_BUDGET,
+                      ESTIMATE_MAX_MILLISECONDS,
+                      instant,
+                      &estimate);
+    wchar_t size[32] = { 0 };
+    wchar_t duration[32] = { 0 };
+    wchar_t longest[32] = { 0 };
+    formatByteSize((ULONGLONG) estimate.bytes,
+                   size,
+                   ARRAYSIZE(size));
+    formatDuration(estimate.seconds,
+                   duration,
+                   ARRAYSIZE(duration));
+    formatDuration(estimate.seconds + estimate.secondsMargin,
+                   longest,
+                   ARRAYSIZE(longest));
+
+    wchar_t cost[256] = { 0 };
+    const wchar_t* action = (instant) ? L"Freeing the space in the background" : L"Deleting them";
+    if (estimate.exact)
+    {
+        _snwprintf(cost,
+                   ARRAYSIZE(cost),
+                   L"There are %.0f files and folders taking up %s. %s should take about %s.",
+                   estimate.items,
+                   size,
+                   action,
+                   duration);
+    }
+    else
+    {
+        _snwprintf(cost,
+                   ARRAYSIZE(cost),
+                   L"There are about %.0f files and folders (give or take %.0f) taking up %s. "
+                   L"%s should take about %s, probably no more than %s.",
+                   estimate.items,
+                   estimate.itemsMargin,
+                   size,
+                   action,
+                   duration,
+                   longest);
+    }
+    cost[ARRAYSIZE(cost) - 1] = 0;
+
+    wchar_t message[512] = { 0 };
+    _snwprintf(message,
+               ARRAYSIZE(message),
+               L"Are you sure you want to permanently delete all of the items in the"
+               L" Recycle Bin?%s\n\n%s",
+               (instant) ? L"\n\nThis can be undone until the space has been reclaimed." : L"",
+               cost);
+    message[ARRAYSIZE(message) - 1] = 0;
+    return (MessageBoxW(hWndDialog,
+                        message,
+                        L"Empty Recycle Bin",
+                        MB_ICONWARNING | MB_YESNO) == IDYES);
+}
+
+/// @brief shows the outcome of a secure empty once its thread is done, and
+/// gives the dialog back its controls
+/// @param job the job, which is reset
+void finishSecureEmpty(SecureEmptyJob* job)
+{
+    if (job->hThread != NULL)
+    {
+        WaitForSingleObject(job->hThread,
+                            INFINITE);
+        CloseHandle(job->hThread);
+        job->hThread = NULL;
+    }
+    LOG(L"Secure empty done, %llu files and %llu bytes erased\n",
+        job->files,
+        job->bytes);
+    if (job->result == FALSE)
+    {
+        MessageBoxW(job->hWndDialog,
+                    L"Some items could not be erased and were left in the Recycle Bin.",
+                    L"Empty Recycle Bin",
+                    MB_ICONWARNING);
+    }
+    EnableMenuItem(GetSystemMenu(job->hWndDialog,
+                                 FALSE),
+                   ID_MENU_SECURE_EMPTY,
+                   MF_BYCOMMAND | MF_ENABLED);
+
+    // The controls come back once the refresh has seen the bin
+    PostMessageW(job->hWndDialog,
+                 WM_CUSTOM_SHUPDATEIMAGE,
+                 0,
+                 0);
+}
+
+/// @brief empties the bin by moving its contents into staging folders and
+/// starts the background process that deletes them. The bin shows as
+/// empty straight away, and the empty can be undone until the space is
+/// reclaimed.
+/// @param hWndDialog a window handle to the dialog box
+void instantEmpty(HWND hWndDialog)
+{
+    // The shell's own confirmation is not available here, so ask ourselves
+    if (isShowDeleteDialogChecked(hWndDialog) &&
+        (confirmEmpty(hWndDialog, TRUE) == FALSE))
+    {
+        return;
+    }
+    ULONGLONG moved = 0;
+    if (emptyToStaging(getReclaimDelay(),
+                       &moved) == FALSE)
+    {
+        MessageBoxW(hWndDialog,
+                    L"Some items could not be removed from the Recycle Bin.",
+                    L"Empty Recycle Bin",
+                    MB_ICONWARNING);
+    }
+    if (moved > 0)
+    {
+        launchReclaimer();
+    }
+    PostMessageW(hWndDialog,
+                 WM_CUSTOM_SHUPDATEIMAGE,
+                 0,
+                 0);
+}
+
 /// @brief checks if the Recycle Bin is currently full
 /// @param none
 /// @return TRUE if bin is full, 
@@ -484,40 +966,31 @@ void setCheckboxState(HWND hWndDialog,
 BOOL isBinFull(void)
 {
     // Get recycle bin information
-    SHQUERYRBINFO info = { sizeof(SHQUERYRBINFO) };
-    int result = SHQueryRecycleBinW(L"",
-                                    &info);
-    if (result != S_OK)
+    const BinBackend* backend = getBinBackend();
+    ULONGLONG items = 0;
+    ULONGLONG bytes = 0;
+    if (backend->query(backend->context,
+                       &items,
+                       &bytes) == FALSE)
     {
-        LOG(L"Querying the recycle bin failed with HRESULT %d\n",
+        LOG(L"Querying the %s recycle bin failed with error %lu\n",
+            backend->name,
             GetLastError());
         return -1;
     }
-    return ((info.i64NumItems == 0) ? FALSE : TRUE);
+    return ((items == 0) ? FALSE : TRUE);
 }
 
-/// @brief register for notifications from the shell
+/// @brief register for notifications from the bin backend
 /// @param hWnd the window handle that will receive the notifications  
 /// @return the registration ID if registration succeeds,
 ///         0 if registation fails
 unsigned long registerForShellNotifs(HWND hWnd)
 {
-    // Even though we can retrieve a PIDL for the recycle bin, it does not generate 
-    // filesystem  events (create, delete, update, etc.) when files are "moved" there 
-    // or deleted. There does appear to be a reliable way to track state changes of 
-    // the recycle bin, and that is via the UPDATEIMAGE notification, which fires 
-    // because the shell needs to update the recycle bin icon when it is 
-    // emptied or becomes full. We do not need to track a specific PIDL since this 
-    // is a global notification.
-    SHChangeNotifyEntry const entries[] = { NULL, FALSE };
-    int sources = SHCNRF_ShellLevel | SHCNRF_InterruptLevel | SHCNRF_NewDelivery;
-    long events = SHCNE_UPDATEIMAGE;
-    unsigned long registrationId = SHChangeNotifyRegister(hWnd,
-                                                          sources,
-                                                          events,
-                                                          WM_CUSTOM_SHUPDATEIMAGE,
-                                                          ARRAYSIZE(entries),
-                                                          entries);
+    const BinBackend* backend = getBinBackend();
+    unsigned long registrationId = backend->watch(backend->context,
+                                                  hWnd,
+                                                  WM_CUSTOM_SHUPDATEIMAGE);
     if (registrationId == 0)
     {
         LOG(L"Registration for shell event notifications failed!\n");
@@ -531,6 +1004,171 @@ unsigned long registerForShellNotifs(HWND hWnd)
     return registrationId;
 }
 
+/// @brief empties the bin by overwriting every file in it before deleting
+/// it, for the secure empty item in the system menu. Nothing is staged, so
+/// this can't be undone. The erase runs on its own thread. The menu item
+/// stays disabled until finishSecureEmpty() is called for
+/// WM_CUSTOM_SECURE_EMPTIED, and the buttons until the refresh after it.
+/// @param hWndDialog a window handle to the dialog box
+/// @param job receives the running job, which must not already be running
+void secureEmpty(HWND hWndDialog,
+                 SecureEmptyJob* job)
+{
+    if (isShowDeleteDialogChecked(hWndDialog) &&
+        (confirmEmpty(hWndDialog, FALSE) == FALSE))
+    {
+        return;
+    }
+    memset(job,
+           0,
+           sizeof(SecureEmptyJob));
+    job->hWndDialog = hWndDialog;
+    EnableMenuItem(GetSystemMenu(hWndDialog,
+                                 FALSE),
+                   ID_MENU_SECURE_EMPTY,
+                   MF_BYCOMMAND | MF_GRAYED);
+    EnableWindow(GetDlgItem(hWndDialog,
+                            ID_BUTTON_EMPTY_BIN),
+                 FALSE);
+    EnableWindow(GetDlgItem(hWndDialog,
+                            ID_BUTTON_TOP_ITEMS),
+                 FALSE);
+    SetDlgItemTextW(hWndDialog,
+                    ID_TEXT_STATUS,
+                    SECURE_EMPTY_STATUS);
+    job->hThread = CreateThread(NULL,
+                                0,
+                                secureEmptyThread,
+                                job,
+                                0,
+                                NULL);
+    if (job->hThread == NULL)
+    {
+        LOG(L"Failed to start the secure empty, error code %d\n",
+            GetLastError());
+        secureEmptyThread(job);
+    }
+}
+
+/// @brief erases the bin for secureEmpty(), then tells the dialog
+/// @param jobPointer the SecureEmptyJob
+/// @return always 0
+DWORD WINAPI secureEmptyThread(void* jobPointer)
+{
+    SecureEmptyJob* job = jobPointer;
+    job->result = secureEmptyBin(&job->files,
+                                 &job->bytes,
+                                 &job->cancel);
+    PostMessageW(job->hWndDialog,
+                 WM_CUSTOM_SECURE_EMPTIED,
+                 0,
+                 0);
+    return 0;
+}
+
+/// @brief sets the timer that wakes the dialog for the next scheduled
+/// maintenance job. It fires at least once a minute so a clock change or a
+/// resume from sleep is noticed.
+/// @param hWndDialog a window handle to the dialog box
+/// @param scheduler the scheduler
+void setSchedulerTimer(HWND hWndDialog,
+                       const Scheduler* scheduler)
+{
+    ULONGLONG wait = getSecondsUntilNextJob(scheduler);
+    if (wait > MAINTENANCE_MAX_WAIT)
+    {
+        wait = MAINTENANCE_MAX_WAIT;
+    }
+    SetTimer(hWndDialog,
+             ID_TIMER_SCHEDULER,
+             (UINT) ((wait > 0) ? wait : 1) * 1000,
+             NULL);
+}
+
+/// @brief shows the largest and the oldest items in the bin. They are
+/// streamed out of the catalog, which is rewritten on every notification,
+/// so this never has to read the bin itself.
+/// @param hWndDialog a window handle to the dialog box
+void showTopItems(HWND hWndDialog)
+{
+    wchar_t catalogPath[MAX_PATH + 1] = { 0 };
+    Catalog catalog = { 0 };
+    if ((getCatalogPath(catalogPath, ARRAYSIZE(catalogPath)) == FALSE) ||
+        (openCatalog(catalogPath, &catalog) == FALSE))
+    {
+        MessageBoxW(hWndDialog,
+                    L"The contents of the Recycle Bin could not be read.",
+                    TOP_ITEMS_BUTTON_TITLE,
+                    MB_ICONWARNING);
+        return;
+    }
+    TopItems tops[2] = { 0 };
+    BOOL result = (initTopItems(&tops[0], TOP_ITEMS_DIALOG_COUNT, TOP_ITEMS_BY_SIZE) &&
+                   initTopItems(&tops[1], TOP_ITEMS_DIALOG_COUNT, TOP_ITEMS_BY_AGE) &&
+                   findCatalogTopItems(&catalog, &tops[0]) &&
+                   findCatalogTopItems(&catalog, &tops[1]));
+    closeCatalog(&catalog);
+
+    size_t cchMessage = ARRAYSIZE(tops) * (TOP_ITEMS_DIALOG_COUNT + 1) * (MAX_PATH + 64);
+    wchar_t* message = HeapAlloc(GetProcessHeap(),
+                                 HEAP_ZERO_MEMORY,
+                                 cchMessage * sizeof(wchar_t));
+    if ((result == FALSE) || (message == NULL)) // Memory allocation failed
+    {
+        if (message != NULL)
+        {
+            HeapFree(GetProcessHeap(),
+                     0,
+                     message);
+        }
+        freeTopItems(&tops[0]);
+        freeTopItems(&tops[1]);
+        return;
+    }
+
+    // Paths are cut off at MAX_PATH so a deep one can't crowd out the rest
+    size_t length = 0;
+    ULONGLONG now = getCurrentFileTime();
+    for (DWORD i = 0; i < ARRAYSIZE(tops); i++)
+    {
+        sortTopItems(&tops[i]);
+        int written = _snwprintf(message + length,
+                                 cchMessage - length - 1,
+                                 L"%s%s\n",
+                                 (i > 0) ? L"\n" : L"",
+                                 (tops[i].order == TOP_ITEMS_BY_SIZE) ? L"Largest" : L"Oldest");
+        length += (written > 0) ? written : 0;
+        for (DWORD j = 0; j < tops[i].count; j++)
+        {
+            const TopItem* item = &tops[i].items[j];
+            wchar_t size[32] = { 0 };
+            formatByteSize(item->size,
+                           size,
+                           ARRAYSIZE(size));
+            ULONGLONG ageDays = (now > item->deletionTime) ?
+                ((now - item->deletionTime) / FILETIME_PER_DAY) : 0;
+            written = _snwprintf(message + length,
+                                 cchMessage - length - 1,
+                                 L"%s, %llu day%s ago: %.*s\n",
+                                 size,
+                                 ageDays,
+                                 (ageDays == 1) ? L"" : L"s",
+                                 MAX_PATH,
+                                 item->originalPath);
+            length += (written > 0) ? written : 0;
+        }
+    }
+    MessageBoxW(hWndDialog,
+                (tops[0].count > 0) ? message : L"The Recycle Bin is empty.",
+                TOP_ITEMS_BUTTON_TITLE,
+                MB_ICONINFORMATION);
+    HeapFree(GetProcessHeap(),
+             0,
+             message);
+    freeTopItems(&tops[0]);
+    freeTopItems(&tops[1]);
+}
+
 /// @brief the window procedure for the checkbox control
 /// @param hWndCheckbox a window handle to the checkbox control
 /// @param msg the window message
@@ -658,6 +1296,20 @@ INT_PTR CALLBACK dialogProc(HWND hWndDialog,
     // This holds the registration ID we receive after calling SHChangeNotifyRegister
     static unsigned long registrationId = 0;
 
+    // Scheduled maintenance, run from here unless /schedule already is
+    static Scheduler scheduler = { 0 };
+    static HANDLE hSchedulerLock = NULL;
+
+    // A storm of notifications is coalesced into one catalog refresh at a
+    // time, which runs on its own thread
+    static RefreshJob refreshJob = { 0 };
+    static BOOL refreshQueued = FALSE; // ID_TIMER_REFRESH is set
+    static BOOL refreshAgain = FALSE; // Notified while a refresh was running
+    static BOOL showingUndo = FALSE; // The empty button undoes, as of the last refresh
+
+    // A secure empty runs on its own thread and the window stays responsive
+    static SecureEmptyJob secureEmptyJob = { 0 };
+
     UNREFERENCED_PARAMETER(lParam);
     switch (msg)
     {
@@ -678,11 +1330,64 @@ INT_PTR CALLBACK dialogProc(HWND hWndDialog,
                 }
                 case ID_BUTTON_EMPTY_BIN:
                 {
-                    DWORD emptyOperationFlags = (isShowDeleteDialogChecked(hWndDialog)) ?
-                        0 : (SHERB_NOCONFIRMATION | SHERB_NOPROGRESSUI);
-                    SHEmptyRecycleBinW(hWndDialog,
-                                       NULL,
-                                       emptyOperationFlags);
+                    if (showingUndo)
+                    {
+                        ULONGLONG restored = 0;
+                        undoEmpty(&restored);
+                        PostMessageW(hWndDialog,
+                                     WM_CUSTOM_SHUPDATEIMAGE,
+                                     0,
+                                     0);
+                        return TRUE;
+                    }
+                    if (getIniInt(INI_KEY_INSTANT_EMPTY,
+                                  INI_DEFAULT_VALUE_INSTANT_EMPTY) == 1)
+                    {
+                        instantEmpty(hWndDialog);
+                        return TRUE;
+                    }
+                    // A silent empty deletes at full speed, which can stall
+                    // everything else on the disk. With a throttle set, hand
+                    // the items to the reclaimer instead, due straight away.
+                    // Anything that could not be staged is left to the shell.
+                    if ((isShowDeleteDialogChecked(hWndDialog) == FALSE) &&
+                        isThrottleConfigured())
+                    {
+                        ULONGLONG moved = 0;
+                        BOOL staged = emptyToStaging(0,
+                                                     &moved);
+                        if (moved > 0)
+                        {
+                            launchReclaimer();
+                        }
+                        if (staged)
+                        {
+                            PostMessageW(hWndDialog,
+                                         WM_CUSTOM_SHUPDATEIMAGE,
+                                         0,
+                                         0);
+                            return TRUE;
+                        }
+                    }
+                    // Our own confirmation replaces the shell's so it can say
+                    // how much there is to delete and how long it will take
+                    DWORD emptyOperationFlags = SHERB_NOCONFIRMATION | SHERB_NOPROGRESSUI;
+                    if (isShowDeleteDialogChecked(hWndDialog))
+                    {
+                        if (confirmEmpty(hWndDialog, FALSE) == FALSE)
+                        {
+                            return TRUE;
+                        }
+                        emptyOperationFlags = SHERB_NOCONFIRMATION;
+                    }
+                    getBinBackend()->empty(getBinBackend()->context,
+                                           hWndDialog,
+                                           emptyOperationFlags);
+                    return TRUE;
+                }
+                case ID_BUTTON_TOP_ITEMS:
+                {
+                    showTopItems(hWndDialog);
                     return TRUE;
                 }
                 case ID_CHECKBOX_SHOW_DIALOG:
@@ -700,6 +1405,19 @@ INT_PTR CALLBACK dialogProc(HWND hWndDialog,
             }
             break;
         }
+        case WM_SYSCOMMAND:
+        {
+            if ((wParam & 0xFFF0) != ID_MENU_SECURE_EMPTY)
+            {
+                break;
+            }
+            if (secureEmptyJob.hThread == NULL)
+            {
+                secureEmpty(hWndDialog,
+                            &secureEmptyJob);
+            }
+            return TRUE;
+        }
         case WM_CLOSE:
         {
             DestroyWindow(hWndDialog);
@@ -710,19 +1428,67 @@ INT_PTR CALLBACK dialogProc(HWND hWndDialog,
             saveSettingToIni(checkForIni(),
                              INI_KEY_SHOW_DELETE_DIALOG,
                              isShowDeleteDialogChecked(hWndDialog));
+            stopPublishingBinState();
+            KillTimer(hWndDialog,
+                      ID_TIMER_REFRESH);
+
+            // Threads that are still running are told to stop and given a
+            // while to do it. One that takes longer ends with the process:
+            // an erase only gets as far as the files it had started on, and
+            // the catalog is only ever replaced whole.
+            InterlockedExchange(&refreshJob.cancel,
+                                1);
+            InterlockedExchange(&secureEmptyJob.cancel,
+                                1);
+            HANDLE threads[2] = { 0 };
+            DWORD threadCount = 0;
+            if (refreshJob.hThread != NULL)
+            {
+                threads[threadCount++] = refreshJob.hThread;
+            }
+            if (secureEmptyJob.hThread != NULL)
+            {
+                threads[threadCount++] = secureEmptyJob.hThread;
+            }
+            if ((threadCount > 0) &&
+                (WaitForMultipleObjects(threadCount,
+                                        threads,
+                                        TRUE,
+                                        CLOSE_WAIT_MS) == WAIT_TIMEOUT))
+            {
+                LOG(L"Closing without waiting any longer for background work\n");
+            }
+            for (DWORD i = 0; i < threadCount; i++)
+            {
+                CloseHandle(threads[i]);
+            }
+            refreshJob.hThread = NULL;
+            secureEmptyJob.hThread = NULL;
             if (registrationId > 0)
             {
-                SHChangeNotifyDeregister(registrationId);
+                getBinBackend()->unwatch(getBinBackend()->context,
+                                         registrationId);
+            }
+            if (hSchedulerLock != NULL)
+            {
+                KillTimer(hWndDialog,
+                          ID_TIMER_SCHEDULER);
+                releaseSchedulerLock(hSchedulerLock);
+                hSchedulerLock = NULL;
             }
             PostQuitMessage(0);
             return TRUE;
         }
         case WM_INITDIALOG:
         {
-            // Configure GUI to reflect the current state of the bin
-            updateGui(hWndDialog);
-            testGuiState(hWndDialog,
-                         registrationId);
+            // Configure GUI to reflect the current state of the bin, and
+            // share it with other processes
+            startPublishingBinState();
+
+            // The buttons stay off until the first refresh has seen the bin
+            updateGui(hWndDialog,
+                      FALSE,
+                      FALSE);
 
             //Configure GUI to reflect current ini settings
             setCheckboxState(hWndDialog,
@@ -745,14 +1511,129 @@ INT_PTR CALLBACK dialogProc(HWND hWndDialog,
                               (SUBCLASSPROC) checkboxProc,
                               ID_CHECKBOX_SUBCLASS,
                               (DWORD_PTR) tooltip);
+
+            // Secure erase can't be undone, so it has its own menu item
+            // rather than taking over the empty button
+            HMENU hSystemMenu = GetSystemMenu(hWndDialog,
+                                              FALSE);
+            if (hSystemMenu != NULL)
+            {
+                AppendMenuW(hSystemMenu,
+                            MF_SEPARATOR,
+                            0,
+                            NULL);
+                AppendMenuW(hSystemMenu,
+                            MF_STRING,
+                            ID_MENU_SECURE_EMPTY,
+                            SECURE_EMPTY_MENU_TITLE);
+            }
+
+            // Finish reclaiming anything left over from a previous run
+            if (hasStagingFolders())
+            {
+                launchReclaimer();
+            }
+
+            // Take over scheduled maintenance while the window is open
+            hSchedulerLock = acquireSchedulerLock(0);
+            if ((hSchedulerLock != NULL) &&
+                (initMaintenanceScheduler(&scheduler,
+                                          TRUE) == FALSE))
+            {
+                releaseSchedulerLock(hSchedulerLock);
+                hSchedulerLock = NULL;
+            }
+            if (hSchedulerLock != NULL)
+            {
+                setSchedulerTimer(hWndDialog,
+                                  &scheduler);
+            }
+
+            // The status text above came from the last catalog we wrote.
+            // Reconcile once the dialog is on screen so it catches up.
+            PostMessageW(hWndDialog,
+                         WM_CUSTOM_SHUPDATEIMAGE,
+                         0,
+                         0);
+            return TRUE;
+        }
+        case WM_TIMER:
+        {
+            if (wParam == ID_TIMER_REFRESH)
+            {
+                KillTimer(hWndDialog,
+                          ID_TIMER_REFRESH);
+                refreshQueued = FALSE;
+                startCatalogRefresh(hWndDialog,
+                                    &refreshJob);
+                return TRUE;
+            }
+            if (wParam != ID_TIMER_SCHEDULER)
+            {
+                break;
+            }
+            runDueJobs(&scheduler);
+            setSchedulerTimer(hWndDialog,
+                              &scheduler);
             return TRUE;
         }
         case WM_CUSTOM_SHUPDATEIMAGE:
         {
             LOG(L"ShUpdateImage event fired.\n");
-            updateGui(hWndDialog);
-            testGuiState(hWndDialog,
-                         registrationId);
+            if (refreshJob.hThread != NULL)
+            {
+                refreshAgain = TRUE;
+            }
+            else if (refreshQueued == FALSE)
+            {
+                refreshQueued = (SetTimer(hWndDialog,
+                                          ID_TIMER_REFRESH,
+                                          REFRESH_DELAY_MS,
+                                          NULL) != 0);
+            }
+            return TRUE;
+        }
+        case WM_CUSTOM_SECURE_EMPTIED:
+        {
+            finishSecureEmpty(&secureEmptyJob);
+            return TRUE;
+        }
+        case WM_CUSTOM_REFRESHED:
+        {
+            if (refreshJob.hThread != NULL)
+            {
+                WaitForSingleObject(refreshJob.hThread,
+                                    INFINITE);
+                CloseHandle(refreshJob.hThread);
+                refreshJob.hThread = NULL;
+            }
+
+            // The controls stay as secureEmpty() left them until it is done
+            if (secureEmptyJob.hThread == NULL)
+            {
+                showingUndo = refreshJob.showUndo;
+                updateGui(hWndDialog,
+                          refreshJob.binIsFull,
+                          refreshJob.showUndo);
+                testGuiState(hWndDialog,
+                             registrationId,
+                             refreshJob.binIsFull,
+                             refreshJob.showUndo);
+            }
+            if (refreshAgain)
+            {
+                refreshAgain = FALSE;
+                PostMessageW(hWndDialog,
+                             WM_CUSTOM_SHUPDATEIMAGE,
+                             0,
+                             0);
+            }
+
+            // Whatever changed the bin may have used up a volume's space
+            if (hSchedulerLock != NULL)
+            {
+                checkFreeSpace();
+            }
             return TRUE;
         }
     }
@@ -764,7 +1645,8 @@ INT_PTR CALLBACK dialogProc(HWND hWndDialog,
 /// @param hPrevInstance 
 /// @param cmdLine 
 /// @param cmdShow 
-/// @return result of dialog box creation
+/// @return result of dialog box creation, or the exit code of the command
+/// if one was given on the command line
 int WINAPI wWinMain(_In_ HINSTANCE hInstance,
                     _In_opt_ HINSTANCE hPrevInstance,
                     _In_ wchar_t* cmdLine,
@@ -774,6 +1656,16 @@ int WINAPI wWinMain(_In_ HINSTANCE hInstance,
     UNREFERENCED_PARAMETER(cmdLine);
     UNREFERENCED_PARAMETER(cmdShow);
 
+    // Run a command instead of showing the dialog if one was given
+    BOOL handled = FALSE;
+    int exitCode = runCommandLine(&handled);
+    if (handled)
+    {
+        // Write out any events the command queued
+        closeAuditLog();
+        return exitCode;
+    }
+
     // Initialize common controls (needed to give our window a modern appearance)
     INITCOMMONCONTROLSEX initControls =
     {
@@ -784,6 +1676,8 @@ int WINAPI wWinMain(_In_ HINSTANCE hInstance,
 
     BOOL creationResult = createIniIfNonexistent();
     assert(creationResult);
-    return createDialogBox(hInstance,
-                           NULL);
+    int result = createDialogBox(hInstance,
+                                 NULL);
+    closeAuditLog();
+    return result;
 }
\ No newline at end of file
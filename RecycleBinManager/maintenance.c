@@ -0,0 +1,743 @@
+/*
+* Scheduled maintenance: emptying, purging and quota checks on a timer
+*
+* Copyright(C) 2024 ERROR_SUCCESS Software
+*
+* This program is free software : you can redistribute it and /or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.If not, see < https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#include "maintenance.h"
+#include "archive.h"
+#include "audit.h"
+#include "bin.h"
+#include "catalog.h"
+#include "cli.h"
+#include "growth.h"
+#include "ini.h"
+#include "reclaim.h"
+#include "secure.h"
+#include "throttle.h"
+#include "watermark.h"
+#include "logger.h"
+
+static BOOL checkFreeSpaceTask(const wchar_t* name, void* context);
+static BOOL compactCatalog(void);
+static int comparePurgeItems(const void* a, const void* b);
+static BOOL launchMaintenanceTask(const wchar_t* name, void* context);
+static BOOL runMaintenanceTask(const wchar_t* name, void* context);
+static BOOL sampleGrowthTask(const wchar_t* name, void* context);
+
+// Watermarks from Settings.ini, loaded with the rest of the schedule
+static WatermarkPolicy watermarks = { 0 };
+static BOOL residentWatermarks = FALSE;
+static ULONGLONG lastWatermarkPurge = 0; // FILETIME a purge last started
+
+/// @brief opens and takes the lock that makes sure only one process runs
+/// scheduled maintenance
+/// @param timeout how long to wait for it in milliseconds, can be INFINITE
+/// @return the lock, NULL if another process holds it or it could not be
+///         created
+HANDLE acquireSchedulerLock(DWORD timeout)
+{
+    HANDLE hLock = CreateMutexW(NULL,
+                                FALSE,
+                                MAINTENANCE_LOCK_NAME);
+    if (hLock == NULL)
+    {
+        return NULL;
+    }
+
+    // An abandoned lock just means the last holder exited without letting go
+    DWORD result = WaitForSingleObject(hLock,
+                                       timeout);
+    if ((result != WAIT_OBJECT_0) && (result != WAIT_ABANDONED))
+    {
+        CloseHandle(hLock);
+        return NULL;
+    }
+    return hLock;
+}
+
+/// @brief starts a watermark purge if a volume has less free space than its
+/// low watermark. This only asks each volume for its free space, so it is
+/// cheap enough to call on every bin notification.
+/// @param none
+/// @return TRUE if no volume is low or a purge was started or done, FALSE
+///         if it failed
+BOOL checkFreeSpace(void)
+{
+    if ((watermarks.volumeMask == 0) ||
+        (findLowVolumes(&watermarks) == 0))
+    {
+        return TRUE;
+    }
+
+    // Notifications come in storms, and a purge that could not free enough
+    // would otherwise start again on every one of them
+    ULONGLONG now = getCurrentFileTime();
+    if (now < lastWatermarkPurge + (WATERMARK_CHECK_INTERVAL * FILETIME_PER_SECOND))
+    {
+        return TRUE;
+    }
+    lastWatermarkPurge = now;
+    if (residentWatermarks)
+    {
+        return launchMaintenanceTask(NULL,
+                                     (void*) MAINTENANCE_JOB_WATERMARK);
+    }
+    return runMaintenanceJob(MAINTENANCE_JOB_WATERMARK);
+}
+
+/// @brief checks for a low volume on the timer
+/// @param name unused
+/// @param context unused
+/// @return TRUE if no volume is low or a purge was started or done, FALSE
+///         if it failed
+static BOOL checkFreeSpaceTask(const wchar_t* name,
+                               void* context)
+{
+    UNREFERENCED_PARAMETER(name);
+    UNREFERENCED_PARAMETER(context);
+    return checkFreeSpace();
+}
+
+/// @brief adds an item found in the bin to a purge list. This is a
+/// BinItemCallback, so it can be passed to enumerateBinItems(). Protected
+/// items are left out of the list, and don't count towards a quota.
+/// @param item the item
+/// @param context the purge list
+/// @return TRUE to keep enumerating, FALSE if memory ran out
+BOOL collectPurgeItem(const BinItem* item,
+                      void* context)
+{
+    PurgeList* list = context;
+    if ((list->exclusions != NULL) &&
+        isExcluded(list->exclusions,
+                   item->originalPath))
+    {
+        list->protectedCount++;
+        return TRUE;
+    }
+    if (list->count == list->capacity)
+    {
+        DWORD capacity = (list->capacity == 0) ? MAINTENANCE_INITIAL_ITEMS : list->capacity * 2;
+        PurgeItem* items = (list->items == NULL) ?
+            HeapAlloc(GetProcessHeap(),
+                      0,
+                      capacity * sizeof(PurgeItem)) :
+            HeapReAlloc(GetProcessHeap(),
+                        0,
+                        list->items,
+                        capacity * sizeof(PurgeItem));
+        if (items == NULL) // Memory allocation failed
+        {
+            list->outOfMemory = TRUE;
+            return FALSE;
+        }
+        list->items = items;
+        list->capacity = capacity;
+    }
+
+    const wchar_t* originalPath = (item->originalPath != NULL) ? item->originalPath : L"";
+    size_t cchInfoPath = wcslen(item->infoPath) + 1;
+    size_t cchContentPath = wcslen(item->contentPath) + 1;
+    size_t cchOriginalPath = wcslen(originalPath) + 1;
+    wchar_t* paths = HeapAlloc(GetProcessHeap(),
+                               0,
+                               (cchInfoPath + cchContentPath + cchOriginalPath) * sizeof(wchar_t));
+    if (paths == NULL) // Memory allocation failed
+    {
+        list->outOfMemory = TRUE;
+        return FALSE;
+    }
+    memcpy(paths,
+           item->infoPath,
+           cchInfoPath * sizeof(wchar_t));
+    memcpy(paths + cchInfoPath,
+           item->contentPath,
+           cchContentPath * sizeof(wchar_t));
+    memcpy(paths + cchInfoPath + cchContentPath,
+           originalPath,
+           cchOriginalPath * sizeof(wchar_t));
+
+    PurgeItem* purgeItem = &list->items[list->count++];
+    purgeItem->size = item->size;
+    purgeItem->deletionTime = item->deletionTime;
+    purgeItem->infoPath = paths;
+    list->totalBytes += item->size;
+    return TRUE;
+}
+
+/// @brief rescans the bin and rewrites the catalog from scratch, which
+/// drops every string that is no longer used from its pool
+/// @param none
+/// @return TRUE if the catalog was written, FALSE if not
+static BOOL compactCatalog(void)
+{
+    wchar_t catalogPath[MAX_PATH + 1] = { 0 };
+    if (getCatalogPath(catalogPath,
+                       ARRAYSIZE(catalogPath)) == FALSE)
+    {
+        return FALSE;
+    }
+    return buildCatalog(catalogPath);
+}
+
+/// @brief orders purge items oldest first, for qsort()
+static int comparePurgeItems(const void* a,
+                             const void* b)
+{
+    ULONGLONG timeA = ((const PurgeItem*) a)->deletionTime;
+    ULONGLONG timeB = ((const PurgeItem*) b)->deletionTime;
+    return (timeA > timeB) - (timeA < timeB);
+}
+
+/// @brief frees a purge list and everything in it
+/// @param list the list
+void freePurgeList(PurgeList* list)
+{
+    for (DWORD i = 0; i < list->count; i++)
+    {
+        HeapFree(GetProcessHeap(),
+                 0,
+                 list->items[i].infoPath);
+    }
+    if (list->items != NULL)
+    {
+        HeapFree(GetProcessHeap(),
+                 0,
+                 list->items);
+    }
+    memset(list,
+           0,
+           sizeof(*list));
+}
+
+/// @brief sets up a scheduler with the maintenance jobs from Settings.ini
+/// @param scheduler the scheduler
+/// @param resident TRUE to hand each job to a background process, FALSE to
+/// run the jobs in this process
+/// @return TRUE if any maintenance is scheduled, FALSE if there is none
+BOOL initMaintenanceScheduler(Scheduler* scheduler,
+                              BOOL resident)
+{
+    initScheduler(scheduler,
+                  NULL,
+                  NULL,
+                  0);
+    ScheduledTask task = (resident) ? launchMaintenanceTask : runMaintenanceTask;
+    int jitterMinutes = getIniInt(INI_KEY_SCHEDULE_JITTER_MINUTES,
+                                  INI_DEFAULT_VALUE_SCHEDULE_JITTER);
+    ULONGLONG jitter = (jitterMinutes > 0) ? (ULONGLONG) jitterMinutes * 60 : 0;
+
+    int emptyTime = getIniInt(INI_KEY_SCHEDULED_EMPTY_TIME,
+                              INI_DEFAULT_VALUE_SCHEDULED_EMPTY_TIME);
+    if (emptyTime >= 0)
+    {
+        int hours = emptyTime / 100;
+        int minutes = emptyTime % 100;
+        if ((hours < 24) && (minutes < 60))
+        {
+            addScheduledJob(scheduler,
+                            L"nightly empty",
+                            SCHEDULE_DAILY,
+                            (ULONGLONG) (hours * 3600) + (minutes * 60),
+                            jitter,
+                            task,
+                            (void*) MAINTENANCE_JOB_EMPTY);
+        }
+        else
+        {
+            LOG(L"Ignoring %s, %d is not a time in HHMM form\n",
+                INI_KEY_SCHEDULED_EMPTY_TIME,
+                emptyTime);
+        }
+    }
+    int idleMinutes = getIniInt(INI_KEY_IDLE_EMPTY_MINUTES,
+                                INI_DEFAULT_VALUE_IDLE_EMPTY_MINUTES);
+    if (idleMinutes > 0)
+    {
+        addScheduledJob(scheduler,
+                        L"idle empty",
+                        SCHEDULE_IDLE,
+                        (ULONGLONG) idleMinutes * 60,
+                        0,
+                        task,
+                        (void*) MAINTENANCE_JOB_EMPTY);
+    }
+    if (getIniInt(INI_KEY_PURGE_AFTER_DAYS,
+                  INI_DEFAULT_VALUE_PURGE_AFTER_DAYS) > 0)
+    {
+        addScheduledJob(scheduler,
+                        L"purge",
+                        SCHEDULE_INTERVAL,
+                        MAINTENANCE_PURGE_INTERVAL,
+                        jitter,
+                        task,
+                        (void*) MAINTENANCE_JOB_PURGE);
+    }
+    if (getIniInt(INI_KEY_QUOTA_MEGABYTES,
+                  INI_DEFAULT_VALUE_QUOTA_MEGABYTES) > 0)
+    {
+        addScheduledJob(scheduler,
+                        L"quota check",
+                        SCHEDULE_INTERVAL,
+                        MAINTENANCE_QUOTA_INTERVAL,
+                        jitter,
+                        task,
+                        (void*) MAINTENANCE_JOB_QUOTA);
+    }
+    residentWatermarks = resident;
+    if (loadWatermarkPolicy(&watermarks))
+    {
+        addScheduledJob(scheduler,
+                        L"free space check",
+                        SCHEDULE_INTERVAL,
+                        WATERMARK_CHECK_INTERVAL,
+                        0,
+                        checkFreeSpaceTask,
+                        NULL);
+    }
+
+    // Anything else being scheduled means we are trusted to run unattended,
+    // so tidy up the catalog overnight as well
+    if (scheduler->jobCount > 0)
+    {
+        addScheduledJob(scheduler,
+                        L"catalog compaction",
+                        SCHEDULE_DAILY,
+                        MAINTENANCE_COMPACT_TIME,
+                        jitter,
+                        task,
+                        (void*) MAINTENANCE_JOB_COMPACT);
+    }
+
+    // Sampling only reads the bin and the free space, so it is on unless
+    // turned off, and is done in this process
+    if (getIniInt(INI_KEY_TRACK_GROWTH,
+                  INI_DEFAULT_VALUE_TRACK_GROWTH) > 0)
+    {
+        addScheduledJob(scheduler,
+                        L"growth sample",
+                        SCHEDULE_INTERVAL,
+                        GROWTH_SAMPLE_INTERVAL,
+                        0,
+                        sampleGrowthTask,
+                        NULL);
+    }
+    return (scheduler->jobCount > 0);
+}
+
+/// @brief runs a maintenance job in a background copy of the program
+/// @param name unused
+/// @param context the name of the job to pass to /maintain
+/// @return TRUE if the process started, FALSE if not
+static BOOL launchMaintenanceTask(const wchar_t* name,
+                                  void* context)
+{
+    UNREFERENCED_PARAMETER(name);
+    wchar_t arguments[64] = { 0 };
+    _snwprintf(arguments,
+               ARRAYSIZE(arguments),
+               L"%s %s",
+               CLI_COMMAND_MAINTAIN,
+               (const wchar_t*) context);
+    arguments[ARRAYSIZE(arguments) - 1] = 0;
+    return launchCommand(arguments);
+}
+
+/// @brief permanently deletes the oldest items in the bin, either those
+/// deleted before a cutoff, or enough to bring the bin under a quota
+/// @param cutoff items deleted before this FILETIME are purged, 0 for none
+/// @param quotaBytes the most the bin may hold in bytes, 0 for no quota
+/// @param result receives what was purged
+/// @return TRUE if everything that should have gone was purged, FALSE if not
+BOOL purgeBin(ULONGLONG cutoff,
+              ULONGLONG quotaBytes,
+              PurgeResult* result)
+{
+    memset(result,
+           0,
+           sizeof(*result));
+    ExclusionRules exclusions = { 0 };
+    if (loadExclusionRules(&exclusions) == FALSE)
+    {
+        freeExclusionRules(&exclusions);
+        return FALSE;
+    }
+    PurgeList list = { 0 };
+    list.exclusions = &exclusions;
+    if ((enumerateBinItems(collectPurgeItem,
+                           &list) == FALSE) ||
+        list.outOfMemory)
+    {
+        freePurgeList(&list);
+        freeExclusionRules(&exclusions);
+        return FALSE;
+    }
+    freeExclusionRules(&exclusions);
+    result->protectedCount = list.protectedCount;
+    Throttle throttle = { 0 };
+    loadThrottleSettings(&throttle);
+    purgeItems(&list,
+               cutoff,
+               quotaBytes,
+               &throttle,
+               result);
+    freePurgeList(&list);
+    if (result->purged > 0)
+    {
+        SHUpdateRecycleBinIcon();
+    }
+    return (result->failed == 0);
+}
+
+/// @brief permanently deletes the oldest items in a purge list, either
+/// those deleted before a cutoff, or enough to bring the list under a quota
+/// @param list the items, which are left sorted oldest first
+/// @param cutoff items deleted before this FILETIME are purged, 0 for none
+/// @param quotaBytes the most the items may add up to in bytes, 0 for no quota
+/// @param throttle paces the deletes, NULL to delete at full speed
+/// @param result what was purged is added to this
+void purgeItems(PurgeList* list,
+                ULONGLONG cutoff,
+                ULONGLONG quotaBytes,
+                Throttle* throttle,
+                PurgeResult* result)
+{
+    if (list->count > 0)
+    {
+        qsort(list->items,
+              list->count,
+              sizeof(PurgeItem),
+              comparePurgeItems);
+    }
+    DWORD purgeCount = selectPurgeItems(list->items,
+                                        list->count,
+                                        list->totalBytes,
+                                        cutoff,
+                                        quotaBytes);
+
+    // With ArchivePurged set, only the items that are safely in the
+    // archive, or that the list leaves out of it, are deleted. The rest
+    // stay in the bin for the next purge.
+    BOOL* deletable = NULL;
+    if ((purgeCount > 0) && (list->archive != PURGE_ARCHIVE_NONE) && isArchiveEnabled())
+    {
+        deletable = HeapAlloc(GetProcessHeap(),
+                              0,
+                              purgeCount * sizeof(BOOL));
+        if (deletable == NULL)
+        {
+            // Memory allocation failed
+            result->failed += purgeCount;
+            return;
+        }
+        archivePurgeItems(list->items,
+                          purgeCount,
+                          (list->archive == PURGE_ARCHIVE_OTHER_VOLUMES),
+                          deletable);
+    }
+
+    // The content goes first, so a failure never leaves content the bin
+    // can no longer see
+    for (DWORD i = 0; i < purgeCount; i++)
+    {
+        const PurgeItem* item = &list->items[i];
+        if ((deletable != NULL) && (deletable[i] == FALSE))
+        {
+            result->failed++;
+            continue;
+        }
+        const wchar_t* contentPath = item->infoPath + wcslen(item->infoPath) + 1;
+        if (deleteTree(contentPath,
+                       throttle) &&
+            DeleteFileW(item->infoPath))
+        {
+            result->purged++;
+            result->bytesFreed += item->size;
+            auditEvent(AUDIT_OP_PURGE,
+                       contentPath + wcslen(contentPath) + 1,
+                       item->size,
+                       1);
+        }
+        else
+        {
+            LOG(L"Failed to purge %s, error code %d\n",
+                contentPath,
+                GetLastError());
+            result->failed++;
+        }
+    }
+    if (deletable != NULL)
+    {
+        HeapFree(GetProcessHeap(),
+                 0,
+                 deletable);
+    }
+}
+
+/// @brief lets go of the scheduler lock
+/// @param hLock the lock from acquireSchedulerLock(), can be NULL
+void releaseSchedulerLock(HANDLE hLock)
+{
+    if (hLock != NULL)
+    {
+        ReleaseMutex(hLock);
+        CloseHandle(hLock);
+    }
+}
+
+/// @brief runs one maintenance job now, with the settings in Settings.ini
+/// @param job one of the MAINTENANCE_JOB_ names
+/// @return TRUE if the job succeeded, FALSE if it failed or is unknown
+BOOL runMaintenanceJob(const wchar_t* job)
+{
+    if (_wcsicmp(job,
+                 MAINTENANCE_JOB_COMPACT) == 0)
+    {
+        return compactCatalog();
+    }
+
+    BOOL result = TRUE;
+    if (_wcsicmp(job,
+                 MAINTENANCE_JOB_EMPTY) == 0)
+    {
+        // Staged items could be undone, which is what a secure empty
+        // must never allow, so it erases the bin in place instead
+        if (isSecureEmptyEnabled())
+        {
+            ULONGLONG files = 0;
+            ULONGLONG bytes = 0;
+            result = secureEmptyBin(&files,
+                                    &bytes,
+                                    NULL);
+        }
+        else
+        {
+            ULONGLONG moved = 0;
+            result = emptyToStaging(getReclaimDelay(),
+                                    &moved);
+            if (moved > 0)
+            {
+                launchReclaimer();
+            }
+            LOG(L"Scheduled empty moved %llu items\n",
+                moved);
+        }
+    }
+    else if ((_wcsicmp(job,
+                       MAINTENANCE_JOB_PURGE) == 0) ||
+             (_wcsicmp(job,
+                       MAINTENANCE_JOB_QUOTA) == 0))
+    {
+        ULONGLONG cutoff = 0;
+        ULONGLONG quotaBytes = 0;
+        if (_wcsicmp(job,
+                     MAINTENANCE_JOB_PURGE) == 0)
+        {
+            int days = getIniInt(INI_KEY_PURGE_AFTER_DAYS,
+                                 INI_DEFAULT_VALUE_PURGE_AFTER_DAYS);
+            if (days <= 0)
+            {
+                return TRUE;
+            }
+            ULONGLONG age = (ULONGLONG) days * SECONDS_PER_DAY * FILETIME_PER_SECOND;
+            ULONGLONG now = getCurrentFileTime();
+            cutoff = (now > age) ? now - age : 0;
+        }
+        else
+        {
+            int megabytes = getIniInt(INI_KEY_QUOTA_MEGABYTES,
+                                      INI_DEFAULT_VALUE_QUOTA_MEGABYTES);
+            if (megabytes <= 0)
+            {
+                return TRUE;
+            }
+            quotaBytes = (ULONGLONG) megabytes * 1048576;
+        }
+        PurgeResult purge = { 0 };
+        result = purgeBin(cutoff,
+                          quotaBytes,
+                          &purge);
+        LOG(L"Scheduled %s purged %llu items, %llu bytes, %llu failed, %llu protected\n",
+            job,
+            purge.purged,
+            purge.bytesFreed,
+            purge.failed,
+            purge.protectedCount);
+    }
+    else if (_wcsicmp(job,
+                      MAINTENANCE_JOB_WATERMARK) == 0)
+    {
+        WatermarkPolicy policy = { 0 };
+        if (loadWatermarkPolicy(&policy) == FALSE)
+        {
+            return TRUE;
+        }
+        WatermarkResult watermark = { 0 };
+        result = purgeLowVolumes(&policy,
+                                 &watermark);
+        if (watermark.lowVolumes == 0)
+        {
+            return result;
+        }
+        LOG(L"Watermark purge freed %llu items, %llu bytes, %llu failed, %llu protected, %s\n",
+            watermark.purge.purged,
+            watermark.purge.bytesFreed,
+            watermark.purge.failed,
+            watermark.purge.protectedCount,
+            (watermark.restoredVolumes == watermark.lowVolumes) ?
+                L"every volume is back above its high watermark" :
+                L"some volumes are still low");
+    }
+    else
+    {
+        return FALSE;
+    }
+
+    // Keep the catalog in step with the bin for when the window next opens
+    compactCatalog();
+    return result;
+}
+
+/// @brief runs scheduled maintenance in this process until it is ended.
+/// While the window is open and doing the maintenance itself this waits,
+/// and takes over once the window closes.
+/// @param none
+/// @return 1 if there is no maintenance scheduled or the scheduler lock
+///         could not be taken, otherwise does not return
+int runMaintenanceScheduler(void)
+{
+    HANDLE hLock = acquireSchedulerLock(INFINITE);
+    if (hLock == NULL)
+    {
+        return 1;
+    }
+
+    // Maintenance is never urgent, so keep out of the way like the reclaimer
+    SetPriorityClass(GetCurrentProcess(),
+                     PROCESS_MODE_BACKGROUND_BEGIN);
+    Scheduler scheduler = { 0 };
+    if (initMaintenanceScheduler(&scheduler,
+                                 FALSE) == FALSE)
+    {
+        releaseSchedulerLock(hLock);
+        return 1;
+    }
+    for (;;)
+    {
+        runDueJobs(&scheduler);
+
+        // Look at the clock at least once a minute, so a clock change or a
+        // resume from sleep is noticed without waiting out a long sleep
+        ULONGLONG wait = getSecondsUntilNextJob(&scheduler);
+        if (wait > MAINTENANCE_MAX_WAIT)
+        {
+            wait = MAINTENANCE_MAX_WAIT;
+        }
+        Sleep((DWORD) ((wait > 0) ? wait : 1) * 1000);
+    }
+}
+
+/// @brief runs a maintenance job in this process
+/// @param name unused
+/// @param context the name of the job
+/// @return TRUE if the job succeeded, FALSE if not
+static BOOL runMaintenanceTask(const wchar_t* name,
+                               void* context)
+{
+    UNREFERENCED_PARAMETER(name);
+    return runMaintenanceJob(context);
+}
+
+/// @brief samples the bin for growth tracking on the timer
+/// @param name unused
+/// @param context unused
+/// @return TRUE on success, FALSE if the growth file could not be opened
+static BOOL sampleGrowthTask(const wchar_t* name,
+                             void* context)
+{
+    UNREFERENCED_PARAMETER(name);
+    UNREFERENCED_PARAMETER(context);
+    return sampleGrowth();
+}
+
+/// @brief works out how many of the oldest items to purge
+/// @param items the items in the bin, oldest first
+/// @param count the number of items
+/// @param totalBytes the size of all of the items together
+/// @param cutoff items deleted before this FILETIME are purged, 0 for none
+/// @param quotaBytes the most the bin may hold in bytes, 0 for no quota
+/// @return how many items from the start of the list to purge
+DWORD selectPurgeItems(const PurgeItem* items,
+                       DWORD count,
+                       ULONGLONG totalBytes,
+                       ULONGLONG cutoff,
+                       ULONGLONG quotaBytes)
+{
+    DWORD selected = 0;
+    ULONGLONG remaining = totalBytes;
+    while (selected < count)
+    {
+        BOOL expired = (items[selected].deletionTime < cutoff);
+        BOOL overQuota = ((quotaBytes > 0) && (remaining > quotaBytes));
+        if ((expired == FALSE) && (overQuota == FALSE))
+        {
+            break;
+        }
+        remaining -= items[selected].size;
+        selected++;
+    }
+    return selected;
+}
+
+/// @brief tests picking the items a purge removes
+/// @param none
+void testMaintenance(void)
+{
+#ifndef NDEBUG
+    PurgeItem items[] =
+    {
+        { 300, 40, NULL },
+        { 100, 10, NULL },
+        { 200, 30, NULL },
+        { 400, 20, NULL },
+    };
+    qsort(items,
+          ARRAYSIZE(items),
+          sizeof(PurgeItem),
+          comparePurgeItems);
+    assert((items[0].deletionTime == 10) && (items[3].deletionTime == 40));
+
+    // Nothing to do without a cutoff or a quota
+    assert(selectPurgeItems(items, 4, 1000, 0, 0) == 0);
+
+    // Everything deleted before the cutoff goes, nothing after it
+    assert(selectPurgeItems(items, 4, 1000, 30, 0) == 2);
+    assert(selectPurgeItems(items, 4, 1000, 100, 0) == 4);
+
+    // The oldest go until the rest fit in the quota
+    assert(selectPurgeItems(items, 4, 1000, 0, 1000) == 0);
+    assert(selectPurgeItems(items, 4, 1000, 0, 999) == 1);
+    assert(selectPurgeItems(items, 4, 1000, 0, 300) == 3);
+    assert(selectPurgeItems(items, 4, 1000, 0, 1) == 4);
+
+    // Whichever removes more wins
+    assert(selectPurgeItems(items, 4, 1000, 15, 600) == 2);
+    assert(selectPurgeItems(items, 4, 1000, 35, 600) == 3);
+    assert(selectPurgeItems(NULL, 0, 0, 100, 1) == 0);
+#endif
+}
@@ -0,0 +1,83 @@
+#define _CRT_SECURE_NO_WARNINGS
+
+#pragma once
+#include <Windows.h>
+#include <shellapi.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include "bin.h"
+#include "exclusions.h"
+#include "scheduler.h"
+#include "throttle.h"
+
+// Maintenance parameters. Scheduled maintenance is set up in Settings.ini
+// and runs either while the window is open or headless with /schedule,
+// never both at once: whichever holds the scheduler lock does the work.
+// The window hands each job to a background copy of the program so the
+// window never blocks, while /schedule runs the jobs itself. A scheduled
+// empty is always an instant empty, so it can be undone until the space
+// is reclaimed. Free space watermarks are checked on the timer and on
+// every bin notification, and a purge only starts once a volume is low.
+// Growth is sampled once a minute by whichever holds the lock.
+
+#define MAINTENANCE_JOB_EMPTY       L"empty"
+#define MAINTENANCE_JOB_PURGE       L"purge"
+#define MAINTENANCE_JOB_QUOTA       L"quota"
+#define MAINTENANCE_JOB_COMPACT     L"compact"
+#define MAINTENANCE_JOB_WATERMARK   L"watermark"
+#define MAINTENANCE_LOCK_NAME       L"Local\\RecycleBinManagerScheduler"
+#define MAINTENANCE_PURGE_INTERVAL  3600 // Seconds between purges of old items
+#define MAINTENANCE_QUOTA_INTERVAL  900 // Seconds between quota checks
+#define MAINTENANCE_COMPACT_TIME    (3 * 3600) // Rebuild the catalog at 03:00
+#define MAINTENANCE_MAX_WAIT        60 // Most seconds between looks at the clock
+#define MAINTENANCE_INITIAL_ITEMS   256
+#define PURGE_ARCHIVE_ALL           0 // With ArchivePurged set, archive every item first
+#define PURGE_ARCHIVE_OTHER_VOLUMES 1 // Not items on the archive folder's volume
+#define PURGE_ARCHIVE_NONE          2 // Never, for items that are not the caller's
+
+// Structs
+
+typedef struct PurgeItem
+{
+    ULONGLONG size; // Size of the item in bytes, as recorded by the shell
+    ULONGLONG deletionTime; // FILETIME of the deletion, as a 64 bit value
+    wchar_t* infoPath; // Followed by the $R path, then the original path, each terminated
+} PurgeItem;
+
+typedef struct PurgeList
+{
+    PurgeItem* items;
+    DWORD count;
+    DWORD capacity;
+    ULONGLONG totalBytes;
+    BOOL outOfMemory; // The list is missing items and must not be used
+    ExclusionRules* exclusions; // Matching items are left out, NULL for none
+    ULONGLONG protectedCount; // Items left out because they matched
+    DWORD archive; // A PURGE_ARCHIVE_ value
+} PurgeList;
+
+typedef struct PurgeResult
+{
+    ULONGLONG purged; // Items deleted
+    ULONGLONG bytesFreed;
+    ULONGLONG failed; // Items that could not be deleted
+    ULONGLONG protectedCount; // Items kept because they matched an exclusion rule
+} PurgeResult;
+
+// Functions
+
+HANDLE acquireSchedulerLock(DWORD timeout);
+BOOL checkFreeSpace(void);
+BOOL collectPurgeItem(const BinItem* item, void* context);
+void freePurgeList(PurgeList* list);
+BOOL initMaintenanceScheduler(Scheduler* scheduler, BOOL resident);
+BOOL purgeBin(ULONGLONG cutoff, ULONGLONG quotaBytes, PurgeResult* result);
+void purgeItems(PurgeList* list, ULONGLONG cutoff, ULONGLONG quotaBytes,
+                Throttle* throttle, PurgeResult* result);
+void releaseSchedulerLock(HANDLE hLock);
+BOOL runMaintenanceJob(const wchar_t* job);
+int runMaintenanceScheduler(void);
+DWORD selectPurgeItems(const PurgeItem* items, DWORD count, ULONGLONG totalBytes,
+                       ULONGLONG cutoff, ULONGLONG quotaBytes);
+void testMaintenance(void);
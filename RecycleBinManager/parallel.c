@@ -0,0 +1,111 @@
+/*
+* Minimal parallel for loop on top of plain Win32 threads
+*
+* Copyright(C) 2024 ERROR_SUCCESS Software
+*
+* This program is free software : you can redistribute it and /or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.If not, see < https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#include "parallel.h"
+#include "logger.h"
+
+static DWORD WINAPI parallelWorker(void* loopPointer);
+
+/// @brief gets the number of threads to use for I/O bound work
+/// @param none
+/// @return the number of logical processors, at least 1 and at most
+///         PARALLEL_MAX_THREADS
+DWORD getDefaultThreadCount(void)
+{
+    SYSTEM_INFO systemInfo = { 0 };
+    GetSystemInfo(&systemInfo);
+    DWORD threads = systemInfo.dwNumberOfProcessors;
+    if (threads < 1)
+    {
+        threads = 1;
+    }
+    return (threads > PARALLEL_MAX_THREADS) ? PARALLEL_MAX_THREADS : threads;
+}
+
+/// @brief calls task for every index from 0 to count - 1 using up to
+/// maxThreads threads, and returns once every call has finished. The
+/// calling thread does its share of the work too.
+/// @param count the number of indexes
+/// @param maxThreads the most threads to use, including the caller
+/// @param task the function to call for each index
+/// @param context passed through to the task unchanged
+void parallelFor(DWORD count,
+                 DWORD maxThreads,
+                 ParallelTask task,
+                 void* context)
+{
+    ParallelLoop loop = { 0 };
+    loop.task = task;
+    loop.context = context;
+    loop.count = count;
+    loop.next = 0;
+
+    DWORD threadCount = (maxThreads > PARALLEL_MAX_THREADS) ? PARALLEL_MAX_THREADS : maxThreads;
+    if (threadCount > count)
+    {
+        threadCount = count;
+    }
+
+    // If a thread can't be created, the threads we do have pick up the slack
+    HANDLE threads[PARALLEL_MAX_THREADS] = { 0 };
+    DWORD started = 0;
+    for (DWORD i = 1; i < threadCount; i++)
+    {
+        threads[started] = CreateThread(NULL,
+                                        0,
+                                        parallelWorker,
+                                        &loop,
+                                        0,
+                                        NULL);
+        if (threads[started] != NULL)
+        {
+            started++;
+        }
+    }
+    parallelWorker(&loop);
+    if (started > 0)
+    {
+        WaitForMultipleObjects(started,
+                               threads,
+                               TRUE,
+                               INFINITE);
+    }
+    for (DWORD i = 0; i < started; i++)
+    {
+        CloseHandle(threads[i]);
+    }
+}
+
+/// @brief thread procedure that runs tasks until the range is used up
+static DWORD WINAPI parallelWorker(void* loopPointer)
+{
+    ParallelLoop* loop = (ParallelLoop*) loopPointer;
+    for (;;)
+    {
+        LONG index = InterlockedIncrement(&loop->next) - 1;
+        if ((DWORD) index >= loop->count)
+        {
+            break;
+        }
+        loop->task((DWORD) index,
+                   loop->context);
+    }
+    return 0;
+}
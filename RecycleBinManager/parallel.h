@@ -0,0 +1,28 @@
+#define _CRT_SECURE_NO_WARNINGS
+
+#pragma once
+#include <Windows.h>
+#include <assert.h>
+
+// Parallel loop parameters. Work is handed out one index at a time from a
+// shared counter, so slow items don't hold up a whole slice of the range.
+
+#define PARALLEL_MAX_THREADS    64
+
+// Structs
+
+/// @brief called once for every index in the range, from any thread
+typedef void (*ParallelTask)(DWORD index, void* context);
+
+typedef struct ParallelLoop
+{
+    ParallelTask task;
+    void* context;
+    DWORD count;
+    LONG volatile next; // The next index to hand out
+} ParallelLoop;
+
+// Functions
+
+DWORD getDefaultThreadCount(void);
+void parallelFor(DWORD count, DWORD maxThreads, ParallelTask task, void* context);
@@ -0,0 +1,786 @@
+/*
+* Trie of interned path components for holding millions of bin item paths
+*
+* Copyright(C) 2024 ERROR_SUCCESS Software
+*
+* This program is free software : you can redistribute it and /or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.If not, see < https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#include "pathstore.h"
+#include "logger.h"
+
+static DWORD addChildNode(PathStore* store, DWORD parent, DWORD component);
+static DWORD findChildNode(const PathStore* store, DWORD parent, DWORD component);
+static DWORD findComponent(const PathStore* store, const wchar_t* name, size_t length);
+static BOOL growChildSlots(PathStore* store);
+static BOOL growComponentSlots(PathStore* store);
+static DWORD hashChild(DWORD parent, DWORD component);
+static DWORD hashComponent(const wchar_t* name, size_t length);
+static DWORD internComponent(PathStore* store, const wchar_t* name, size_t length);
+static BOOL isPathSeparator(wchar_t character);
+static const wchar_t* nextPathComponent(const wchar_t* path, BOOL isFirst, size_t* length);
+
+/// @brief adds a node below parent. The caller must have checked that
+/// the child does not already exist.
+/// @param store the path store
+/// @param parent the parent node, or PATH_STORE_NO_NODE for a root
+/// @param component the interned component name of the new node
+/// @return the id of the new node, or PATH_STORE_NO_NODE if memory
+/// allocation failed
+static DWORD addChildNode(PathStore* store,
+                          DWORD parent,
+                          DWORD component)
+{
+    HANDLE hHeap = GetProcessHeap();
+    if (store->nodeCount == PATH_STORE_NO_NODE - 1)
+    {
+        return PATH_STORE_NO_NODE;
+    }
+    if (store->nodeCount == store->nodeCapacity)
+    {
+        DWORD newCapacity = store->nodeCapacity * 2;
+        PathNode* newNodes = HeapReAlloc(hHeap,
+                                         0,
+                                         store->nodes,
+                                         (size_t) newCapacity * sizeof(PathNode));
+        if (newNodes == NULL) // Memory allocation failed
+        {
+            return PATH_STORE_NO_NODE;
+        }
+        store->nodes = newNodes;
+        BYTE* newFlags = HeapReAlloc(hHeap,
+                                     HEAP_ZERO_MEMORY,
+                                     store->nodeFlags,
+                                     newCapacity);
+        if (newFlags == NULL) // Memory allocation failed
+        {
+            return PATH_STORE_NO_NODE;
+        }
+        store->nodeFlags = newFlags;
+        store->nodeCapacity = newCapacity;
+    }
+
+    // Keep the child table at most half full
+    if ((store->nodeCount + 1) * 2 > store->childSlotCount)
+    {
+        if (growChildSlots(store) == FALSE)
+        {
+            return PATH_STORE_NO_NODE;
+        }
+    }
+
+    DWORD id = store->nodeCount++;
+    PathNode* node = &store->nodes[id];
+    node->parent = parent;
+    node->firstChild = PATH_STORE_NO_NODE;
+    node->component = component;
+
+    // New nodes go to the front of their parent's list of children
+    if (parent == PATH_STORE_NO_NODE)
+    {
+        node->nextSibling = store->firstRoot;
+        store->firstRoot = id;
+    }
+    else
+    {
+        node->nextSibling = store->nodes[parent].firstChild;
+        store->nodes[parent].firstChild = id;
+    }
+
+    DWORD mask = store->childSlotCount - 1;
+    DWORD index = hashChild(parent, component) & mask;
+    while (store->childSlots[index] != 0)
+    {
+        index = (index + 1) & mask;
+    }
+    store->childSlots[index] = id + 1;
+    return id;
+}
+
+/// @brief adds a path to the store. Adding the same path twice returns
+/// the same id. Paths are compared without regard to case.
+/// @param store the path store
+/// @param path the full path to add, either \ or / may separate components
+/// @return the id of the path, or PATH_STORE_NO_NODE if the path is
+/// empty, has a component that is too long or memory allocation failed
+DWORD addPath(PathStore* store,
+              const wchar_t* path)
+{
+    DWORD node = PATH_STORE_NO_NODE;
+    size_t length = 0;
+    const wchar_t* name = nextPathComponent(path,
+                                            TRUE,
+                                            &length);
+    while (name != NULL)
+    {
+        DWORD component = internComponent(store,
+                                          name,
+                                          length);
+        if (component == PATH_STORE_NO_NODE)
+        {
+            return PATH_STORE_NO_NODE;
+        }
+        DWORD child = findChildNode(store,
+                                    node,
+                                    component);
+        if (child == PATH_STORE_NO_NODE)
+        {
+            child = addChildNode(store,
+                                 node,
+                                 component);
+            if (child == PATH_STORE_NO_NODE)
+            {
+                return PATH_STORE_NO_NODE;
+            }
+        }
+        node = child;
+        name = nextPathComponent(name + length,
+                                 FALSE,
+                                 &length);
+    }
+
+    if ((node != PATH_STORE_NO_NODE) &&
+        ((store->nodeFlags[node] & PATH_NODE_ITEM) == 0))
+    {
+        store->nodeFlags[node] |= PATH_NODE_ITEM;
+        store->itemCount++;
+    }
+    return node;
+}
+
+/// @brief measures the memory used per entry and the lookup latency of a
+/// store filled with synthetic paths shaped like a trashed build tree
+/// @param entries the number of paths to add
+/// @param result receives the measurements
+/// @return TRUE on success, FALSE if memory allocation failed or a path
+///         that was added could not be found
+BOOL benchmarkPathStore(DWORD entries,
+                        PathStoreBenchmark* result)
+{
+    PathStore store = { 0 };
+    ZeroMemory(result,
+               sizeof(PathStoreBenchmark));
+    if ((entries == 0) || (initPathStore(&store) == FALSE))
+    {
+        return FALSE;
+    }
+
+    ULONGLONG rawBytes = 0;
+    wchar_t path[MAX_PATH + 1] = { 0 };
+    for (DWORD i = 0; i < entries; i++)
+    {
+        int length = _snwprintf(path,
+                                ARRAYSIZE(path),
+                                L"C:\\Users\\dev\\src\\project%u\\build\\obj\\module%u\\file%u.obj",
+                                i / 10000,
+                                (i / 100) % 100,
+                                i % 100);
+        path[MAX_PATH] = 0;
+        rawBytes += ((ULONGLONG) length + 1) * sizeof(wchar_t);
+        if (addPath(&store, path) == PATH_STORE_NO_NODE)
+        {
+            freePathStore(&store);
+            return FALSE;
+        }
+    }
+
+    // Look up a spread of entries many times over
+    DWORD lookups = 0;
+    DWORD seed = 12345;
+    LARGE_INTEGER frequency, start, end;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&start);
+    for (DWORD round = 0; round < 1000000; round++)
+    {
+        seed = (seed * 1664525) + 1013904223; // Numerical Recipes LCG
+        DWORD i = seed % entries;
+        _snwprintf(path,
+                   ARRAYSIZE(path),
+                   L"C:\\Users\\dev\\src\\project%u\\build\\obj\\module%u\\file%u.obj",
+                   i / 10000,
+                   (i / 100) % 100,
+                   i % 100);
+        path[MAX_PATH] = 0;
+        if (findPath(&store, path) != PATH_STORE_NO_NODE)
+        {
+            lookups++;
+        }
+    }
+    QueryPerformanceCounter(&end);
+
+    // Every path looked up was added above, so a miss means the store is broken
+    if (lookups != 1000000)
+    {
+        LOG(L"The path store found %u of 1000000 paths it holds\n",
+            lookups);
+        freePathStore(&store);
+        return FALSE;
+    }
+
+    result->entries = entries;
+    result->bytesPerEntry = (double) getPathStoreBytesUsed(&store) / entries;
+    result->rawBytesPerEntry = (double) rawBytes / entries;
+    result->nanosecondsPerLookup = ((double) (end.QuadPart - start.QuadPart) * 1e9) /
+        ((double) frequency.QuadPart * 1000000.0);
+    freePathStore(&store);
+    return TRUE;
+}
+
+/// @brief calls the callback for every item at or below a path
+/// @param store the path store
+/// @param prefix the path of the subtree to enumerate
+/// @param callback the function to call for each item
+/// @param context passed through to the callback unchanged
+/// @return TRUE if the subtree exists, FALSE if not
+BOOL enumeratePathSubtree(const PathStore* store,
+                          const wchar_t* prefix,
+                          PathStoreCallback callback,
+                          void* context)
+{
+    DWORD root = findPath(store,
+                          prefix);
+    if (root == PATH_STORE_NO_NODE)
+    {
+        return FALSE;
+    }
+
+    // Walk the subtree depth first using the child and sibling links, so
+    // no stack is needed however deep the tree is
+    DWORD node = root;
+    while (node != PATH_STORE_NO_NODE)
+    {
+        if (store->nodeFlags[node] & PATH_NODE_ITEM)
+        {
+            if (callback(store, node, context) == FALSE)
+            {
+                return TRUE;
+            }
+        }
+
+        if (store->nodes[node].firstChild != PATH_STORE_NO_NODE)
+        {
+            node = store->nodes[node].firstChild;
+            continue;
+        }
+        while ((node != root) &&
+               (store->nodes[node].nextSibling == PATH_STORE_NO_NODE))
+        {
+            node = store->nodes[node].parent;
+        }
+        node = (node == root) ? PATH_STORE_NO_NODE : store->nodes[node].nextSibling;
+    }
+    return TRUE;
+}
+
+#ifndef NDEBUG
+/// @brief PathStoreCallback used by the tests to count items
+static BOOL countPathStoreItem(const PathStore* store,
+                               DWORD id,
+                               void* count)
+{
+    UNREFERENCED_PARAMETER(store);
+    UNREFERENCED_PARAMETER(id);
+    (*(DWORD*) count)++;
+    return TRUE;
+}
+#endif
+
+/// @brief looks up a child node in the child hash table
+static DWORD findChildNode(const PathStore* store,
+                           DWORD parent,
+                           DWORD component)
+{
+    DWORD mask = store->childSlotCount - 1;
+    DWORD index = hashChild(parent, component) & mask;
+    while (store->childSlots[index] != 0)
+    {
+        DWORD id = store->childSlots[index] - 1;
+        if ((store->nodes[id].parent == parent) &&
+            (store->nodes[id].component == component))
+        {
+            return id;
+        }
+        index = (index + 1) & mask;
+    }
+    return PATH_STORE_NO_NODE;
+}
+
+/// @brief looks up an interned component name without adding it
+static DWORD findComponent(const PathStore* store,
+                           const wchar_t* name,
+                           size_t length)
+{
+    DWORD mask = store->componentSlotCount - 1;
+    DWORD index = hashComponent(name, length) & mask;
+    while (store->componentSlots[index] != 0)
+    {
+        DWORD id = store->componentSlots[index] - 1;
+        const PathComponent* component = &store->components[id];
+        if ((component->length == length) &&
+            (_wcsnicmp(store->pool + component->offset, name, length) == 0))
+        {
+            return id;
+        }
+        index = (index + 1) & mask;
+    }
+    return PATH_STORE_NO_NODE;
+}
+
+/// @brief looks up the id of a path without adding it
+/// @param store the path store
+/// @param path the full path to look up
+/// @return the id of the path, or PATH_STORE_NO_NODE if it is not in the
+/// store. Directories that only exist as parents of items also have ids.
+DWORD findPath(const PathStore* store,
+               const wchar_t* path)
+{
+    DWORD node = PATH_STORE_NO_NODE;
+    size_t length = 0;
+    const wchar_t* name = nextPathComponent(path,
+                                            TRUE,
+                                            &length);
+    while (name != NULL)
+    {
+        DWORD component = findComponent(store,
+                                        name,
+                                        length);
+        if (component == PATH_STORE_NO_NODE)
+        {
+            return PATH_STORE_NO_NODE;
+        }
+        node = findChildNode(store,
+                             node,
+                             component);
+        if (node == PATH_STORE_NO_NODE)
+        {
+            return PATH_STORE_NO_NODE;
+        }
+        name = nextPathComponent(name + length,
+                                 FALSE,
+                                 &length);
+    }
+    return node;
+}
+
+/// @brief frees the memory held by a path store
+/// @param store the path store to free
+void freePathStore(PathStore* store)
+{
+    HANDLE hHeap = GetProcessHeap();
+    void* allocations[] =
+    {
+        store->nodes,
+        store->nodeFlags,
+        store->components,
+        store->pool,
+        store->componentSlots,
+        store->childSlots
+    };
+    for (size_t i = 0; i < ARRAYSIZE(allocations); i++)
+    {
+        if (allocations[i] != NULL)
+        {
+            HeapFree(hHeap, 0, allocations[i]);
+        }
+    }
+    ZeroMemory(store,
+               sizeof(PathStore));
+}
+
+/// @brief rebuilds the full path of a node
+/// @param store the path store
+/// @param id the id of the node
+/// @param buffer receives the path if it fits
+/// @param cchBuffer the size of buffer in characters
+/// @return the length of the path in characters, not including the
+/// terminator. If this is not less than cchBuffer nothing was written.
+size_t getPathFromId(const PathStore* store,
+                     DWORD id,
+                     wchar_t* buffer,
+                     size_t cchBuffer)
+{
+    if (id >= store->nodeCount)
+    {
+        return 0;
+    }
+
+    // Measure first, then fill the buffer from the end backwards
+    size_t length = 0;
+    for (DWORD node = id; node != PATH_STORE_NO_NODE; node = store->nodes[node].parent)
+    {
+        length += store->components[store->nodes[node].component].length;
+        if (store->nodes[node].parent != PATH_STORE_NO_NODE)
+        {
+            length++; // Separator
+        }
+    }
+    if (length >= cchBuffer)
+    {
+        return length;
+    }
+
+    size_t position = length;
+    buffer[position] = 0;
+    for (DWORD node = id; node != PATH_STORE_NO_NODE; node = store->nodes[node].parent)
+    {
+        const PathComponent* component = &store->components[store->nodes[node].component];
+        position -= component->length;
+        memcpy(buffer + position,
+               store->pool + component->offset,
+               component->length * sizeof(wchar_t));
+        if (store->nodes[node].parent != PATH_STORE_NO_NODE)
+        {
+            buffer[--position] = L'\\';
+        }
+    }
+    return length;
+}
+
+/// @brief gets the number of bytes of memory held by a path store
+/// @param store the path store
+/// @return the total size of every allocation the store owns
+size_t getPathStoreBytesUsed(const PathStore* store)
+{
+    return ((size_t) store->nodeCapacity * (sizeof(PathNode) + sizeof(BYTE))) +
+        ((size_t) store->componentCapacity * sizeof(PathComponent)) +
+        ((size_t) store->poolCapacity * sizeof(wchar_t)) +
+        ((size_t) store->componentSlotCount * sizeof(DWORD)) +
+        ((size_t) store->childSlotCount * sizeof(DWORD));
+}
+
+/// @brief doubles the size of the child hash table and rehashes it
+static BOOL growChildSlots(PathStore* store)
+{
+    DWORD newCount = store->childSlotCount * 2;
+    DWORD* newSlots = HeapAlloc(GetProcessHeap(),
+                                HEAP_ZERO_MEMORY,
+                                (size_t) newCount * sizeof(DWORD));
+    if (newSlots == NULL) // Memory allocation failed
+    {
+        return FALSE;
+    }
+    DWORD mask = newCount - 1;
+    for (DWORD id = 0; id < store->nodeCount; id++)
+    {
+        DWORD index = hashChild(store->nodes[id].parent, store->nodes[id].component) & mask;
+        while (newSlots[index] != 0)
+        {
+            index = (index + 1) & mask;
+        }
+        newSlots[index] = id + 1;
+    }
+    HeapFree(GetProcessHeap(),
+             0,
+             store->childSlots);
+    store->childSlots = newSlots;
+    store->childSlotCount = newCount;
+    return TRUE;
+}
+
+/// @brief doubles the size of the component hash table and rehashes it
+static BOOL growComponentSlots(PathStore* store)
+{
+    DWORD newCount = store->componentSlotCount * 2;
+    DWORD* newSlots = HeapAlloc(GetProcessHeap(),
+                                HEAP_ZERO_MEMORY,
+                                (size_t) newCount * sizeof(DWORD));
+    if (newSlots == NULL) // Memory allocation failed
+    {
+        return FALSE;
+    }
+    DWORD mask = newCount - 1;
+    for (DWORD id = 0; id < store->componentCount; id++)
+    {
+        const PathComponent* component = &store->components[id];
+        DWORD index = hashComponent(store->pool + component->offset,
+                                    component->length) & mask;
+        while (newSlots[index] != 0)
+        {
+            index = (index + 1) & mask;
+        }
+        newSlots[index] = id + 1;
+    }
+    HeapFree(GetProcessHeap(),
+             0,
+             store->componentSlots);
+    store->componentSlots = newSlots;
+    store->componentSlotCount = newCount;
+    return TRUE;
+}
+
+/// @brief mixes a parent id and a component id into a hash
+static DWORD hashChild(DWORD parent,
+                       DWORD component)
+{
+    ULONGLONG key = ((ULONGLONG) parent << 32) | component;
+    key ^= key >> 33;
+    key *= 0xFF51AFD7ED558CCDULL; // MurmurHash3 finalizer
+    key ^= key >> 33;
+    return (DWORD) key;
+}
+
+/// @brief case insensitive 32 bit FNV-1a hash of a component name
+static DWORD hashComponent(const wchar_t* name,
+                           size_t length)
+{
+    DWORD hash = 2166136261u;
+    for (size_t i = 0; i < length; i++)
+    {
+        hash ^= (DWORD) towupper(name[i]);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/// @brief prepares an empty path store
+/// @param store the path store to initialize
+/// @return TRUE on success, FALSE if memory allocation failed
+BOOL initPathStore(PathStore* store)
+{
+    HANDLE hHeap = GetProcessHeap();
+    ZeroMemory(store,
+               sizeof(PathStore));
+    store->nodes = HeapAlloc(hHeap,
+                             0,
+                             PATH_STORE_INITIAL_NODES * sizeof(PathNode));
+    store->nodeFlags = HeapAlloc(hHeap,
+                                 HEAP_ZERO_MEMORY,
+                                 PATH_STORE_INITIAL_NODES);
+    store->components = HeapAlloc(hHeap,
+                                  0,
+                                  PATH_STORE_INITIAL_NODES * sizeof(PathComponent));
+    store->pool = HeapAlloc(hHeap,
+                            0,
+                            PATH_STORE_INITIAL_POOL * sizeof(wchar_t));
+    store->componentSlots = HeapAlloc(hHeap,
+                                      HEAP_ZERO_MEMORY,
+                                      PATH_STORE_INITIAL_HASH * sizeof(DWORD));
+    store->childSlots = HeapAlloc(hHeap,
+                                  HEAP_ZERO_MEMORY,
+                                  PATH_STORE_INITIAL_HASH * sizeof(DWORD));
+    if ((store->nodes == NULL) ||
+        (store->nodeFlags == NULL) ||
+        (store->components == NULL) ||
+        (store->pool == NULL) ||
+        (store->componentSlots == NULL) ||
+        (store->childSlots == NULL)) // Memory allocation failed
+    {
+        freePathStore(store);
+        return FALSE;
+    }
+    store->nodeCapacity = PATH_STORE_INITIAL_NODES;
+    store->componentCapacity = PATH_STORE_INITIAL_NODES;
+    store->poolCapacity = PATH_STORE_INITIAL_POOL;
+    store->componentSlotCount = PATH_STORE_INITIAL_HASH;
+    store->childSlotCount = PATH_STORE_INITIAL_HASH;
+    store->firstRoot = PATH_STORE_NO_NODE;
+    return TRUE;
+}
+
+/// @brief returns the index of a component name, adding it to the pool if
+/// it has not been seen before
+static DWORD internComponent(PathStore* store,
+                             const wchar_t* name,
+                             size_t length)
+{
+    HANDLE hHeap = GetProcessHeap();
+    if (length > PATH_STORE_MAX_COMPONENT)
+    {
+        return PATH_STORE_NO_NODE;
+    }
+    DWORD existing = findComponent(store,
+                                   name,
+                                   length);
+    if (existing != PATH_STORE_NO_NODE)
+    {
+        return existing;
+    }
+
+    if ((store->componentCount + 1) * 2 > store->componentSlotCount)
+    {
+        if (growComponentSlots(store) == FALSE)
+        {
+            return PATH_STORE_NO_NODE;
+        }
+    }
+    if (store->componentCount == store->componentCapacity)
+    {
+        DWORD newCapacity = store->componentCapacity * 2;
+        PathComponent* newComponents = HeapReAlloc(hHeap,
+                                                   0,
+                                                   store->components,
+                                                   (size_t) newCapacity * sizeof(PathComponent));
+        if (newComponents == NULL) // Memory allocation failed
+        {
+            return PATH_STORE_NO_NODE;
+        }
+        store->components = newComponents;
+        store->componentCapacity = newCapacity;
+    }
+    if ((ULONGLONG) store->poolLength + length > store->poolCapacity)
+    {
+        ULONGLONG newCapacity = (ULONGLONG) store->poolCapacity * 2;
+        while ((ULONGLONG) store->poolLength + length > newCapacity)
+        {
+            newCapacity *= 2;
+        }
+        if (newCapacity > MAXDWORD)
+        {
+            return PATH_STORE_NO_NODE;
+        }
+        wchar_t* newPool = HeapReAlloc(hHeap,
+                                       0,
+                                       store->pool,
+                                       (size_t) newCapacity * sizeof(wchar_t));
+        if (newPool == NULL) // Memory allocation failed
+        {
+            return PATH_STORE_NO_NODE;
+        }
+        store->pool = newPool;
+        store->poolCapacity = (DWORD) newCapacity;
+    }
+
+    // Component names are not terminated, the length is stored instead
+    DWORD id = store->componentCount++;
+    PathComponent* component = &store->components[id];
+    component->offset = store->poolLength;
+    component->length = (WORD) length;
+    component->reserved = 0;
+    memcpy(store->pool + store->poolLength,
+           name,
+           length * sizeof(wchar_t));
+    store->poolLength += (DWORD) length;
+
+    DWORD mask = store->componentSlotCount - 1;
+    DWORD index = hashComponent(name, length) & mask;
+    while (store->componentSlots[index] != 0)
+    {
+        index = (index + 1) & mask;
+    }
+    store->componentSlots[index] = id + 1;
+    return id;
+}
+
+/// @brief checks if a character separates path components
+static BOOL isPathSeparator(wchar_t character)
+{
+    return ((character == L'\\') || (character == L'/'));
+}
+
+/// @brief finds the next component of a path. Leading separators are kept
+/// as part of the first component so UNC paths such as \\server\share and
+/// rooted paths such as /srv survive a round trip through the store.
+/// @param path the remaining part of the path
+/// @param isFirst TRUE if path is the start of the full path
+/// @param length receives the length of the component in characters
+/// @return the start of the component, or NULL if there are none left
+static const wchar_t* nextPathComponent(const wchar_t* path,
+                                        BOOL isFirst,
+                                        size_t* length)
+{
+    const wchar_t* start = path;
+    if (isFirst == FALSE)
+    {
+        while (isPathSeparator(*start))
+        {
+            start++;
+        }
+    }
+    const wchar_t* end = start;
+    while (isPathSeparator(*end))
+    {
+        end++;
+    }
+    while ((*end != 0) && (isPathSeparator(*end) == FALSE))
+    {
+        end++;
+    }
+    if (end == start)
+    {
+        return NULL;
+    }
+    *length = end - start;
+    return start;
+}
+
+/// @brief exercises the path store in a debug build, returns immediately
+/// in a release build
+/// @param none
+void testPathStore(void)
+{
+#ifndef NDEBUG
+    PathStore store = { 0 };
+    BOOL result = initPathStore(&store);
+    assert(result);
+
+    DWORD a = addPath(&store, L"/srv/build/out/a.o");
+    DWORD b = addPath(&store, L"/srv/build/out/b.o");
+    DWORD c = addPath(&store, L"/srv/build/c.txt");
+    DWORD d = addPath(&store, L"/srv/other/d.txt");
+    DWORD e = addPath(&store, L"C:\\Users\\dev\\e.txt");
+    assert((a != PATH_STORE_NO_NODE) && (b != a) && (c != b) && (d != c) && (e != d));
+
+    // Adding the same path again, with different case or separators,
+    // returns the same id
+    assert(addPath(&store, L"/srv/build/out/a.o") == a);
+    assert(addPath(&store, L"/SRV/Build/OUT/A.O") == a);
+    assert(addPath(&store, L"C:/Users/dev/e.txt") == e);
+    assert(store.itemCount == 5);
+    assert(findPath(&store, L"/srv/build/out/b.o") == b);
+    assert(findPath(&store, L"/srv/build/out/missing.o") == PATH_STORE_NO_NODE);
+
+    // Paths survive a round trip, including their leading separator
+    wchar_t buffer[MAX_PATH + 1] = { 0 };
+    size_t length = getPathFromId(&store, a, buffer, ARRAYSIZE(buffer));
+    assert(length == wcslen(L"/srv\\build\\out\\a.o"));
+    assert(wcscmp(buffer, L"/srv\\build\\out\\a.o") == 0);
+    length = getPathFromId(&store, e, buffer, ARRAYSIZE(buffer));
+    assert(wcscmp(buffer, L"C:\\Users\\dev\\e.txt") == 0);
+    assert(getPathFromId(&store, e, buffer, 4) == length);
+    addPath(&store, L"\\\\server\\share\\f.txt");
+    assert(findPath(&store, L"\\\\server\\share\\f.txt") != PATH_STORE_NO_NODE);
+
+    // Everything trashed from /srv/build
+    DWORD count = 0;
+    assert(enumeratePathSubtree(&store, L"/srv/build", countPathStoreItem, &count));
+    assert(count == 3);
+    count = 0;
+    assert(enumeratePathSubtree(&store, L"/srv", countPathStoreItem, &count));
+    assert(count == 4);
+    assert(enumeratePathSubtree(&store, L"/nowhere", countPathStoreItem, &count) == FALSE);
+
+    // Force every table to grow, earlier ids must stay valid
+    for (DWORD i = 0; i < 20000; i++)
+    {
+        _snwprintf(buffer,
+                   ARRAYSIZE(buffer),
+                   L"D:\\tree%u\\dir%u\\file%u.bin",
+                   i % 7,
+                   i % 301,
+                   i);
+        buffer[MAX_PATH] = 0;
+        assert(addPath(&store, buffer) != PATH_STORE_NO_NODE);
+    }
+    assert(findPath(&store, L"/srv/build/out/a.o") == a);
+    assert(findPath(&store, L"D:\\tree3\\dir10\\file9040.bin") != PATH_STORE_NO_NODE);
+    assert(store.itemCount == 20006);
+    freePathStore(&store);
+
+    // The benchmark fails if it cannot find a path it added
+    PathStoreBenchmark benchmark = { 0 };
+    assert(benchmarkPathStore(20000, &benchmark));
+    assert(benchmark.entries == 20000);
+#endif
+}
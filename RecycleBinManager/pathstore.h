@@ -0,0 +1,83 @@
+#define _CRT_SECURE_NO_WARNINGS
+
+#pragma once
+#include <Windows.h>
+#include <stdio.h>
+#include <wctype.h>
+#include <assert.h>
+
+// Path store parameters. Paths are split into components and stored as a
+// trie, so every directory is stored once no matter how many items were
+// deleted from it. Component names are interned as well, so a name like
+// "obj" or "Debug" that appears under many directories is only stored once.
+// The id of a node never changes, so it can be used as a 32 bit handle for
+// an item.
+
+#define PATH_STORE_NO_NODE          0xFFFFFFFF
+#define PATH_STORE_MAX_COMPONENT    0xFFFF // Longest component in characters
+#define PATH_STORE_INITIAL_NODES    1024
+#define PATH_STORE_INITIAL_POOL     8192 // In characters
+#define PATH_STORE_INITIAL_HASH     2048 // Must be a power of two
+#define PATH_NODE_ITEM              0x0001 // The node was added with addPath()
+
+// Structs
+
+typedef struct PathNode
+{
+    DWORD parent; // PATH_STORE_NO_NODE for a root such as C:
+    DWORD firstChild; // PATH_STORE_NO_NODE if there are no children
+    DWORD nextSibling; // PATH_STORE_NO_NODE if this is the last child
+    DWORD component; // Index into the component table
+} PathNode;
+
+typedef struct PathComponent
+{
+    DWORD offset; // Offset into the pool in characters
+    WORD length; // Length in characters, there is no terminator
+    WORD reserved; // Keeps the struct 8 bytes
+} PathComponent;
+
+typedef struct PathStore
+{
+    PathNode* nodes;
+    BYTE* nodeFlags; // PATH_NODE_ flags for each node
+    DWORD nodeCount;
+    DWORD nodeCapacity;
+    DWORD firstRoot; // Roots are linked through nextSibling
+    DWORD itemCount;
+    PathComponent* components;
+    DWORD componentCount;
+    DWORD componentCapacity;
+    wchar_t* pool;
+    DWORD poolLength;
+    DWORD poolCapacity;
+    DWORD* componentSlots; // Component index + 1, 0 if empty
+    DWORD componentSlotCount; // Power of two
+    DWORD* childSlots; // Node index + 1 keyed by (parent, component), 0 if empty
+    DWORD childSlotCount; // Power of two
+} PathStore;
+
+typedef struct PathStoreBenchmark
+{
+    DWORD entries; // Number of paths added
+    double bytesPerEntry; // Memory used by the store divided by entries
+    double rawBytesPerEntry; // Average size of the paths as plain strings
+    double nanosecondsPerLookup; // Average time for findPath()
+} PathStoreBenchmark;
+
+/// @brief called for every item under a subtree
+/// @return TRUE to continue enumerating, FALSE to stop
+typedef BOOL (*PathStoreCallback)(const PathStore* store, DWORD id, void* context);
+
+// Functions
+
+DWORD addPath(PathStore* store, const wchar_t* path);
+BOOL benchmarkPathStore(DWORD entries, PathStoreBenchmark* result);
+BOOL enumeratePathSubtree(const PathStore* store, const wchar_t* prefix,
+                          PathStoreCallback callback, void* context);
+DWORD findPath(const PathStore* store, const wchar_t* path);
+void freePathStore(PathStore* store);
+size_t getPathFromId(const PathStore* store, DWORD id, wchar_t* buffer, size_t cchBuffer);
+size_t getPathStoreBytesUsed(const PathStore* store);
+BOOL initPathStore(PathStore* store);
+void testPathStore(void);
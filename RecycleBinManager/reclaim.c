@@ -0,0 +1,1398 @@
+/*
+* Instant empty: stage the bin contents and reclaim the space in the background
+*
+* Copyright(C) 2024 ERROR_SUCCESS Software
+*
+* This program is free software : you can redistribute it and /or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.If not, see < https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#include "reclaim.h"
+#include "archive.h"
+#include "audit.h"
+#include "bin.h"
+#include "cli.h"
+#include "dirtree.h"
+#include "ini.h"
+#include "throttle.h"
+#include "trash.h"
+#include "logger.h"
+
+static BOOL buildChildPath(const wchar_t* directory, const wchar_t* name,
+                           wchar_t* path);
+static BOOL canSwapBinDirectory(const wchar_t* binDirectory);
+static BOOL findStagingFolder(BOOL requireItems);
+static void moveOwnFolders(const wchar_t* stagingPath, const wchar_t* binDirectory);
+static void reclaimStagingFolder(const wchar_t* stagingPath, HANDLE hLock,
+                                 Throttle* throttle, ReclaimPass* pass);
+static void recoverEverySwapFolder(void);
+#ifndef NDEBUG
+static void createTestFile(const wchar_t* directory, const wchar_t* name);
+#endif
+
+/// @brief opens and takes the lock that keeps the reclaimer from deleting
+/// items while they are being moved. It is only ever held for renames, so
+/// a wait longer than RECLAIM_LOCK_TIMEOUT_MS means something is stuck.
+/// @param none
+/// @return the lock, NULL if it could not be created or taken in time, in
+///         which case nothing may be moved. Pass it to releaseStagingLock().
+HANDLE acquireStagingLock(void)
+{
+    HANDLE hLock = CreateMutexW(NULL,
+                                FALSE,
+                                RECLAIM_LOCK_NAME);
+    if (hLock == NULL)
+    {
+        return NULL;
+    }
+
+    // An abandoned lock is fine, nothing it protects is left half done
+    DWORD wait = WaitForSingleObject(hLock,
+                                     RECLAIM_LOCK_TIMEOUT_MS);
+    if ((wait != WAIT_OBJECT_0) && (wait != WAIT_ABANDONED))
+    {
+        LOG(L"Gave up waiting for the staging lock\n");
+        CloseHandle(hLock);
+        return NULL;
+    }
+    return hLock;
+}
+
+/// @brief joins a folder and a name found inside it
+/// @param directory the folder
+/// @param name the name of the child
+/// @param path receives the path, MAX_PATH + 1 characters
+/// @return TRUE if the path fits, FALSE if not
+static BOOL buildChildPath(const wchar_t* directory,
+                           const wchar_t* name,
+                           wchar_t* path)
+{
+    int written = _snwprintf(path,
+                             MAX_PATH + 1,
+                             L"%s\\%s",
+                             directory,
+                             name);
+    path[MAX_PATH] = 0;
+    return ((written >= 0) && (written <= MAX_PATH));
+}
+
+/// @brief checks if a bin folder is on a file system where swapBinDirectory()
+/// keeps everything the shell relies on, which is NTFS or ReFS
+/// @param binDirectory the bin folder
+/// @return TRUE if it is, FALSE if the bin folder should be staged item by item
+static BOOL canSwapBinDirectory(const wchar_t* binDirectory)
+{
+    wchar_t volumeRoot[MAX_PATH + 1] = { 0 };
+    wchar_t fileSystem[MAX_PATH + 1] = { 0 };
+    if ((GetVolumePathNameW(binDirectory, volumeRoot, ARRAYSIZE(volumeRoot)) == FALSE) ||
+        (GetVolumeInformationW(volumeRoot,
+                               NULL,
+                               0,
+                               NULL,
+                               NULL,
+                               NULL,
+                               fileSystem,
+                               ARRAYSIZE(fileSystem)) == FALSE))
+    {
+        return FALSE;
+    }
+    return ((_wcsicmp(fileSystem, L"NTFS") == 0) || (_wcsicmp(fileSystem, L"ReFS") == 0));
+}
+
+/// @brief checks if there is an instant empty that can still be undone
+/// @param none
+/// @return TRUE if a staging folder on any volume still holds items
+BOOL canUndoEmpty(void)
+{
+    return findStagingFolder(TRUE);
+}
+
+/// @brief permanently deletes a file, or a folder and everything in it.
+/// Junctions and symbolic links are removed without following them. The
+/// tree is walked through handles, so it can go deeper than MAX_PATH.
+/// @param path the full path of the file or folder
+/// @param throttle paces the deletes, NULL to delete at full speed
+/// @return TRUE if everything was deleted, FALSE if anything was left
+BOOL deleteTree(const wchar_t* path,
+                Throttle* throttle)
+{
+    HANDLE hItem = openTreePath(path,
+                                DIRTREE_DELETE_ACCESS);
+    if (hItem == INVALID_HANDLE_VALUE)
+    {
+        DWORD error = GetLastError();
+        return ((error == ERROR_FILE_NOT_FOUND) || (error == ERROR_PATH_NOT_FOUND));
+    }
+    return deleteOpenTree(hItem,
+                          throttle);
+}
+
+/// @brief empties the bin on every volume by moving its items into a new
+/// staging folder. Call launchReclaimer() afterwards to free the space.
+/// @param reclaimDelay how long the empty can be undone, in FILETIME units
+/// @param itemsMoved receives the number of items that were moved. A bin
+/// folder swapped out whole counts as one.
+/// @return TRUE if every volume was emptied, FALSE if any items were left
+BOOL emptyToStaging(ULONGLONG reclaimDelay,
+                    ULONGLONG* itemsMoved)
+{
+    *itemsMoved = 0;
+    ULONGLONG due = getCurrentFileTime() + reclaimDelay;
+    BOOL swap = (getIniInt(INI_KEY_SWAP_EMPTY, INI_DEFAULT_VALUE_SWAP_EMPTY) > 0);
+    BOOL result = TRUE;
+    for (wchar_t driveLetter = L'A'; driveLetter <= L'Z'; driveLetter++)
+    {
+        wchar_t binDirectory[MAX_PATH + 1] = { 0 };
+        if (getBinDirectory(driveLetter,
+                            binDirectory,
+                            ARRAYSIZE(binDirectory)) == FALSE)
+        {
+            continue;
+        }
+        ULONGLONG itemsBefore = *itemsMoved;
+        if ((swap == FALSE) ||
+            (canSwapBinDirectory(binDirectory) == FALSE) ||
+            (swapBinDirectory(binDirectory, due, itemsMoved) == FALSE))
+        {
+            if (stageBinDirectory(binDirectory,
+                                  due,
+                                  itemsMoved) == FALSE)
+            {
+                result = FALSE;
+            }
+        }
+        // Sizes are not known until the reclaimer deletes the items
+        if (*itemsMoved > itemsBefore)
+        {
+            auditEvent(AUDIT_OP_EMPTY,
+                       binDirectory,
+                       0,
+                       *itemsMoved - itemsBefore);
+        }
+    }
+    if (*itemsMoved > 0)
+    {
+        SHUpdateRecycleBinIcon();
+    }
+    return result;
+}
+
+/// @brief looks for staging folders on every volume
+/// @param requireItems TRUE to only count staging folders that still hold
+/// an item that can be restored
+/// @return TRUE if one was found
+static BOOL findStagingFolder(BOOL requireItems)
+{
+    recoverEverySwapFolder();
+    for (wchar_t driveLetter = L'A'; driveLetter <= L'Z'; driveLetter++)
+    {
+        wchar_t binDirectory[MAX_PATH + 1] = { 0 };
+        wchar_t searchPattern[MAX_PATH + 1] = { 0 };
+        if ((getBinDirectory(driveLetter, binDirectory, ARRAYSIZE(binDirectory)) == FALSE) ||
+            (buildChildPath(binDirectory, RECLAIM_STAGING_PREFIX L"*", searchPattern) == FALSE))
+        {
+            continue;
+        }
+        WIN32_FIND_DATAW findData = { 0 };
+        HANDLE hFind = FindFirstFileExW(searchPattern,
+                                        FindExInfoBasic,
+                                        &findData,
+                                        FindExSearchLimitToDirectories,
+                                        NULL,
+                                        0);
+        if (hFind == INVALID_HANDLE_VALUE)
+        {
+            continue;
+        }
+        BOOL found = FALSE;
+        do
+        {
+            if ((findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) == 0)
+            {
+                continue;
+            }
+            if (requireItems == FALSE)
+            {
+                found = TRUE;
+                break;
+            }
+            wchar_t stagingPath[MAX_PATH + 1] = { 0 };
+            wchar_t infoPattern[MAX_PATH + 1] = { 0 };
+            WIN32_FIND_DATAW infoData = { 0 };
+            if (buildChildPath(binDirectory, findData.cFileName, stagingPath) &&
+                buildChildPath(stagingPath, BIN_INFO_PREFIX L"*", infoPattern))
+            {
+                HANDLE hInfoFind = FindFirstFileExW(infoPattern,
+                                                    FindExInfoBasic,
+                                                    &infoData,
+                                                    FindExSearchNameMatch,
+                                                    NULL,
+                                                    0);
+                if (hInfoFind != INVALID_HANDLE_VALUE)
+                {
+                    FindClose(hInfoFind);
+                    found = TRUE;
+                }
+            }
+        } while ((found == FALSE) && FindNextFileW(hFind, &findData));
+        FindClose(hFind);
+        if (found)
+        {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+/// @brief gets how long an instant empty can be undone, from Settings.ini
+/// @param none
+/// @return the delay in FILETIME units
+ULONGLONG getReclaimDelay(void)
+{
+    int delaySeconds = getIniInt(INI_KEY_RECLAIM_DELAY,
+                                 INI_DEFAULT_VALUE_RECLAIM_DELAY);
+    return (delaySeconds > 0) ? (ULONGLONG) delaySeconds * FILETIME_PER_SECOND : 0;
+}
+
+/// @brief checks if there is anything left for the reclaimer to do
+/// @param none
+/// @return TRUE if there is a staging folder on any volume
+BOOL hasStagingFolders(void)
+{
+    return findStagingFolder(FALSE);
+}
+
+/// @brief starts a background copy of this program that deletes staging
+/// folders once their reclaim delay has passed. If one is already running
+/// the new copy exits straight away.
+/// @param none
+/// @return TRUE if the process was started, FALSE if not
+BOOL launchReclaimer(void)
+{
+    return launchCommand(CLI_COMMAND_RECLAIM);
+}
+
+/// @brief moves the folders we keep in a bin folder, and desktop.ini, back
+/// out of a staging folder the bin folder was swapped into. Earlier staging
+/// folders, quarantined orphans and desktop.ini belong to the bin folder,
+/// not to this empty.
+/// @param stagingPath the staging folder
+/// @param binDirectory the bin folder
+static void moveOwnFolders(const wchar_t* stagingPath,
+                           const wchar_t* binDirectory)
+{
+    wchar_t ownPattern[MAX_PATH + 1] = { 0 };
+    wchar_t stagedPath[MAX_PATH + 1] = { 0 };
+    wchar_t binPath[MAX_PATH + 1] = { 0 };
+    if (buildChildPath(stagingPath, RECLAIM_DESKTOP_INI, stagedPath) &&
+        buildChildPath(binDirectory, RECLAIM_DESKTOP_INI, binPath))
+    {
+        MoveFileExW(stagedPath,
+                    binPath,
+                    0);
+    }
+    if (buildChildPath(stagingPath, RECLAIM_OWN_PATTERN, ownPattern) == FALSE)
+    {
+        return;
+    }
+    WIN32_FIND_DATAW findData = { 0 };
+    HANDLE hFind = FindFirstFileExW(ownPattern,
+                                    FindExInfoBasic,
+                                    &findData,
+                                    FindExSearchLimitToDirectories,
+                                    NULL,
+                                    0);
+    if (hFind == INVALID_HANDLE_VALUE)
+    {
+        return;
+    }
+    do
+    {
+        if (((findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0) &&
+            buildChildPath(stagingPath, findData.cFileName, stagedPath) &&
+            buildChildPath(binDirectory, findData.cFileName, binPath))
+        {
+            MoveFileExW(stagedPath,
+                        binPath,
+                        0);
+        }
+    } while (FindNextFileW(hFind, &findData));
+    FindClose(hFind);
+}
+
+/// @brief deletes every staging folder in a bin folder that is due
+/// @param binDirectory the bin folder
+/// @param now folders due at or before this FILETIME are deleted
+/// @param hLock the staging lock, can be NULL
+/// @param throttle paces the deletes, NULL to delete at full speed
+/// @param pass counts what was reclaimed and when the next folder is due
+/// @return TRUE if the bin folder could be read, FALSE if not
+BOOL reclaimBinDirectory(const wchar_t* binDirectory,
+                         ULONGLONG now,
+                         HANDLE hLock,
+                         Throttle* throttle,
+                         ReclaimPass* pass)
+{
+    wchar_t searchPattern[MAX_PATH + 1] = { 0 };
+    if (buildChildPath(binDirectory,
+                       RECLAIM_STAGING_PREFIX L"*",
+                       searchPattern) == FALSE)
+    {
+        return FALSE;
+    }
+    WIN32_FIND_DATAW findData = { 0 };
+    HANDLE hFind = FindFirstFileExW(searchPattern,
+                                    FindExInfoBasic,
+                                    &findData,
+                                    FindExSearchLimitToDirectories,
+                                    NULL,
+                                    0);
+    if (hFind == INVALID_HANDLE_VALUE)
+    {
+        return (GetLastError() == ERROR_FILE_NOT_FOUND);
+    }
+
+    do
+    {
+        ULONGLONG due = 0;
+        if (((findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) == 0) ||
+            (wcslen(findData.cFileName) != RECLAIM_STAGING_CCH) ||
+            (swscanf(findData.cFileName + ARRAYSIZE(RECLAIM_STAGING_PREFIX) - 1,
+                     L"%16llX",
+                     &due) != 1))
+        {
+            continue;
+        }
+        if (due > now)
+        {
+            if ((pass->nextDue == 0) || (due < pass->nextDue))
+            {
+                pass->nextDue = due;
+            }
+            pass->pending++;
+            continue;
+        }
+        wchar_t stagingPath[MAX_PATH + 1] = { 0 };
+        if (buildChildPath(binDirectory,
+                           findData.cFileName,
+                           stagingPath))
+        {
+            reclaimStagingFolder(stagingPath,
+                                 hLock,
+                                 throttle,
+                                 pass);
+        }
+    } while (FindNextFileW(hFind, &findData));
+    FindClose(hFind);
+    return TRUE;
+}
+
+/// @brief deletes everything in a staging folder and then the folder. Each
+/// item is claimed under the staging lock by renaming its $I, which takes
+/// it out of reach of an undo, and deleted after the lock is released, so
+/// a throttled delete never keeps an undo waiting. With ArchivePurged
+/// set, nothing is deleted until everything is safely in the archive.
+/// @param stagingPath the staging folder
+/// @param hLock the staging lock, can be NULL
+/// @param throttle paces the deletes, NULL to delete at full speed
+/// @param pass counts the items that were deleted
+static void reclaimStagingFolder(const wchar_t* stagingPath,
+                                 HANDLE hLock,
+                                 Throttle* throttle,
+                                 ReclaimPass* pass)
+{
+    wchar_t searchPattern[MAX_PATH + 1] = { 0 };
+    if (buildChildPath(stagingPath,
+                       BIN_INFO_PREFIX L"*",
+                       searchPattern) == FALSE)
+    {
+        return;
+    }
+    if (isArchiveEnabled() &&
+        (archiveStagedItems(stagingPath) == FALSE))
+    {
+        // The next reclaimer tries again
+        LOG(L"Failed to archive %s, leaving it for now\n",
+            stagingPath);
+        return;
+    }
+    WIN32_FIND_DATAW findData = { 0 };
+    HANDLE hFind = FindFirstFileExW(searchPattern,
+                                    FindExInfoBasic,
+                                    &findData,
+                                    FindExSearchNameMatch,
+                                    NULL,
+                                    FIND_FIRST_EX_LARGE_FETCH);
+    if (hFind != INVALID_HANDLE_VALUE)
+    {
+        do
+        {
+            wchar_t infoPath[MAX_PATH + 1] = { 0 };
+            wchar_t claimedPath[MAX_PATH + 1] = { 0 };
+            wchar_t contentPath[MAX_PATH + 1] = { 0 };
+            if ((buildChildPath(stagingPath, findData.cFileName, infoPath) == FALSE) ||
+                (buildChildPath(stagingPath, findData.cFileName, claimedPath) == FALSE) ||
+                (buildChildPath(stagingPath, findData.cFileName, contentPath) == FALSE))
+            {
+                continue;
+            }
+            // $I, $D and $R are the same length, so the prefix is at the same place
+            claimedPath[wcslen(stagingPath) + 2] = RECLAIM_CLAIMED_PREFIX[1];
+            contentPath[wcslen(stagingPath) + 2] = BIN_CONTENT_PREFIX[1];
+
+            if (hLock != NULL)
+            {
+                WaitForSingleObject(hLock,
+                                    INFINITE);
+            }
+            BOOL claimed = MoveFileExW(infoPath,
+                                       claimedPath,
+                                       0);
+            if (hLock != NULL)
+            {
+                ReleaseMutex(hLock);
+            }
+            if (claimed &&
+                deleteTree(contentPath, throttle) &&
+                DeleteFileW(claimedPath))
+            {
+                pass->reclaimed++;
+            }
+        } while (FindNextFileW(hFind, &findData));
+        FindClose(hFind);
+    }
+
+    // Whatever is left has no $I, so nobody can restore it
+    if (deleteTree(stagingPath, throttle) == FALSE)
+    {
+        LOG(L"Failed to reclaim all of %s\n",
+            stagingPath);
+    }
+}
+
+/// @brief runs recoverSwapFolders() for the current user's bin folder on
+/// every volume, including one whose bin folder is missing because a swap
+/// was cut short before the fresh folder was made
+/// @param none
+static void recoverEverySwapFolder(void)
+{
+    wchar_t* sid = getCurrentUserSid();
+    if (sid == NULL)
+    {
+        return;
+    }
+    ULONGLONG recovered = 0;
+    for (wchar_t driveLetter = L'A'; driveLetter <= L'Z'; driveLetter++)
+    {
+        wchar_t volumeRoot[] = { driveLetter, L':', L'\\', 0 };
+        wchar_t binDirectory[MAX_PATH + 1] = { 0 };
+        if (GetDriveTypeW(volumeRoot) != DRIVE_FIXED)
+        {
+            continue;
+        }
+        int written = _snwprintf(binDirectory,
+                                 ARRAYSIZE(binDirectory),
+                                 L"%c:\\%s\\%s",
+                                 driveLetter,
+                                 BIN_FOLDER_NAME,
+                                 sid);
+        binDirectory[MAX_PATH] = 0;
+        if ((written > 0) && (written <= MAX_PATH))
+        {
+            recoverSwapFolders(binDirectory,
+                               &recovered);
+        }
+    }
+    if (recovered > 0)
+    {
+        SHUpdateRecycleBinIcon();
+    }
+}
+
+/// @brief recovers a bin folder that swapBinDirectory() left next to itself
+/// when it was cut short. If the bin folder is missing, the swapped folder
+/// is moved back in its place. If there is a bin folder again, made by the
+/// swap or by the shell, the swapped folder becomes the staging folder it
+/// was on its way to, so the empty can still be undone or reclaimed.
+/// @param binDirectory the bin folder, which need not exist
+/// @param foldersRecovered incremented for every swapped folder recovered
+/// @return TRUE if there is nothing left to recover, FALSE if anything was left
+BOOL recoverSwapFolders(const wchar_t* binDirectory,
+                        ULONGLONG* foldersRecovered)
+{
+    wchar_t searchPattern[MAX_PATH + 1] = { 0 };
+    const wchar_t* name = wcsrchr(binDirectory, L'\\');
+    if (name == NULL)
+    {
+        return FALSE;
+    }
+    int parentLength = (int) (name - binDirectory);
+    int written = _snwprintf(searchPattern,
+                             ARRAYSIZE(searchPattern),
+                             L"%.*s\\%s*",
+                             parentLength,
+                             binDirectory,
+                             RECLAIM_SWAP_PREFIX);
+    searchPattern[MAX_PATH] = 0;
+    if ((written < 0) || (written > MAX_PATH))
+    {
+        return FALSE;
+    }
+    WIN32_FIND_DATAW findData = { 0 };
+    HANDLE hFind = FindFirstFileExW(searchPattern,
+                                    FindExInfoBasic,
+                                    &findData,
+                                    FindExSearchLimitToDirectories,
+                                    NULL,
+                                    0);
+    if (hFind == INVALID_HANDLE_VALUE)
+    {
+        return TRUE;
+    }
+
+    // The lock keeps us from catching a swap that is still running
+    HANDLE hLock = acquireStagingLock();
+    if (hLock == NULL)
+    {
+        FindClose(hFind);
+        return FALSE;
+    }
+    BOOL result = TRUE;
+    do
+    {
+        // Named after the due time and the SID of the bin folder
+        const wchar_t* dueText = findData.cFileName + ARRAYSIZE(RECLAIM_SWAP_PREFIX) - 1;
+        wchar_t* end = NULL;
+        ULONGLONG due = wcstoull(dueText, &end, 16);
+        if (((findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) == 0) ||
+            (end != dueText + 16) || (*end != L'.') ||
+            (_wcsicmp(end + 1, name + 1) != 0))
+        {
+            continue;
+        }
+        wchar_t swapPath[MAX_PATH + 1] = { 0 };
+        wchar_t stagingPath[MAX_PATH + 1] = { 0 };
+        written = _snwprintf(swapPath,
+                             ARRAYSIZE(swapPath),
+                             L"%.*s\\%s",
+                             parentLength,
+                             binDirectory,
+                             findData.cFileName);
+        swapPath[MAX_PATH] = 0;
+        if ((written < 0) || (written > MAX_PATH))
+        {
+            result = FALSE;
+            continue;
+        }
+
+        if (GetFileAttributesW(binDirectory) == INVALID_FILE_ATTRIBUTES)
+        {
+            if (MoveFileExW(swapPath, binDirectory, 0) == FALSE)
+            {
+                LOG(L"Failed to move %s back to %s, error code %d\n",
+                    swapPath,
+                    binDirectory,
+                    GetLastError());
+                result = FALSE;
+                continue;
+            }
+            (*foldersRecovered)++;
+            LOG(L"Moved %s back to %s\n",
+                swapPath,
+                binDirectory);
+            continue;
+        }
+
+        written = _snwprintf(stagingPath,
+                             ARRAYSIZE(stagingPath),
+                             L"%s\\%s%016llX",
+                             binDirectory,
+                             RECLAIM_STAGING_PREFIX,
+                             due);
+        stagingPath[MAX_PATH] = 0;
+        if ((written < 0) || (written > MAX_PATH) ||
+            (MoveFileExW(swapPath, stagingPath, 0) == FALSE))
+        {
+            LOG(L"Failed to move %s to %s, error code %d\n",
+                swapPath,
+                stagingPath,
+                GetLastError());
+            result = FALSE;
+            continue;
+        }
+        // A swap cut short right after making the fresh folder has not given
+        // it the attributes of the old one yet
+        SetFileAttributesW(binDirectory,
+                           GetFileAttributesW(binDirectory) |
+                           (findData.dwFileAttributes & (FILE_ATTRIBUTE_HIDDEN | FILE_ATTRIBUTE_SYSTEM)));
+        SetFileAttributesW(stagingPath,
+                           FILE_ATTRIBUTE_HIDDEN);
+        moveOwnFolders(stagingPath,
+                       binDirectory);
+        (*foldersRecovered)++;
+        LOG(L"Moved %s to %s\n",
+            swapPath,
+            stagingPath);
+    } while (FindNextFileW(hFind, &findData));
+    FindClose(hFind);
+    releaseStagingLock(hLock);
+    return result;
+}
+
+/// @brief releases a lock taken with acquireStagingLock()
+/// @param hLock the lock, can be NULL
+void releaseStagingLock(HANDLE hLock)
+{
+    if (hLock != NULL)
+    {
+        ReleaseMutex(hLock);
+        CloseHandle(hLock);
+    }
+}
+
+/// @brief undoes instant empties of one bin folder by moving every item
+/// that has not been reclaimed yet out of its staging folders
+/// @param binDirectory the bin folder
+/// @param itemsRestored incremented for every item moved back
+/// @return TRUE if every item was restored, FALSE if any were left
+BOOL restoreBinDirectory(const wchar_t* binDirectory,
+                         ULONGLONG* itemsRestored)
+{
+    wchar_t searchPattern[MAX_PATH + 1] = { 0 };
+    if (buildChildPath(binDirectory,
+                       RECLAIM_STAGING_PREFIX L"*",
+                       searchPattern) == FALSE)
+    {
+        return FALSE;
+    }
+    WIN32_FIND_DATAW findData = { 0 };
+    HANDLE hFind = FindFirstFileExW(searchPattern,
+                                    FindExInfoBasic,
+                                    &findData,
+                                    FindExSearchLimitToDirectories,
+                                    NULL,
+                                    0);
+    if (hFind == INVALID_HANDLE_VALUE)
+    {
+        return TRUE;
+    }
+
+    HANDLE hLock = acquireStagingLock();
+    if (hLock == NULL)
+    {
+        FindClose(hFind);
+        return FALSE;
+    }
+
+    // Auditing needs each item's original path, which only its $I file has
+    BYTE* info = NULL;
+    wchar_t* originalPath = NULL;
+    if (isAuditEnabled())
+    {
+        info = HeapAlloc(GetProcessHeap(),
+                         0,
+                         BIN_INFO_MAX_SIZE);
+        originalPath = HeapAlloc(GetProcessHeap(),
+                                 0,
+                                 BIN_PATH_MAX_CCH * sizeof(wchar_t));
+    }
+
+    BOOL result = TRUE;
+    do
+    {
+        wchar_t stagingPath[MAX_PATH + 1] = { 0 };
+        wchar_t infoPattern[MAX_PATH + 1] = { 0 };
+        if (((findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) == 0) ||
+            (buildChildPath(binDirectory, findData.cFileName, stagingPath) == FALSE) ||
+            (buildChildPath(stagingPath, BIN_INFO_PREFIX L"*", infoPattern) == FALSE))
+        {
+            continue;
+        }
+        WIN32_FIND_DATAW infoData = { 0 };
+        HANDLE hInfoFind = FindFirstFileExW(infoPattern,
+                                            FindExInfoBasic,
+                                            &infoData,
+                                            FindExSearchNameMatch,
+                                            NULL,
+                                            FIND_FIRST_EX_LARGE_FETCH);
+        if (hInfoFind == INVALID_HANDLE_VALUE)
+        {
+            continue;
+        }
+        do
+        {
+            wchar_t stagedInfo[MAX_PATH + 1] = { 0 };
+            wchar_t stagedContent[MAX_PATH + 1] = { 0 };
+            wchar_t binInfo[MAX_PATH + 1] = { 0 };
+            wchar_t binContent[MAX_PATH + 1] = { 0 };
+            if ((buildChildPath(stagingPath, infoData.cFileName, stagedInfo) == FALSE) ||
+                (buildChildPath(stagingPath, infoData.cFileName, stagedContent) == FALSE) ||
+                (buildChildPath(binDirectory, infoData.cFileName, binInfo) == FALSE) ||
+                (buildChildPath(binDirectory, infoData.cFileName, binContent) == FALSE))
+            {
+                result = FALSE;
+                continue;
+            }
+            stagedContent[wcslen(stagingPath) + 2] = BIN_CONTENT_PREFIX[1];
+            binContent[wcslen(binDirectory) + 2] = BIN_CONTENT_PREFIX[1];
+
+            // Put the contents back first, so the item only shows up in
+            // the bin once it is whole again
+            if (MoveFileExW(stagedContent, binContent, 0) == FALSE)
+            {
+                result = FALSE;
+                continue;
+            }
+            if (MoveFileExW(stagedInfo, binInfo, 0) == FALSE)
+            {
+                MoveFileExW(binContent,
+                            stagedContent,
+                            0);
+                result = FALSE;
+                continue;
+            }
+            (*itemsRestored)++;
+            BinItem item = { 0 };
+            if ((info != NULL) && (originalPath != NULL) &&
+                readBinInfoFile(binInfo,
+                                info,
+                                &item,
+                                originalPath,
+                                BIN_PATH_MAX_CCH))
+            {
+                auditEvent(AUDIT_OP_RESTORE,
+                           originalPath,
+                           item.size,
+                           1);
+            }
+        } while (FindNextFileW(hInfoFind, &infoData));
+        FindClose(hInfoFind);
+
+        // This only succeeds if nothing is left in it
+        RemoveDirectoryW(stagingPath);
+    } while (FindNextFileW(hFind, &findData));
+    FindClose(hFind);
+    releaseStagingLock(hLock);
+    if (info != NULL)
+    {
+        HeapFree(GetProcessHeap(),
+                 0,
+                 info);
+    }
+    if (originalPath != NULL)
+    {
+        HeapFree(GetProcessHeap(),
+                 0,
+                 originalPath);
+    }
+    return result;
+}
+
+/// @brief deletes staging folders as their reclaim delay passes, until
+/// there are none left. This is what the background process started by
+/// launchReclaimer() runs. Only one reclaimer runs at a time.
+/// @param none
+/// @return the exit code of the process, always 0
+int runReclaimer(void)
+{
+    HANDLE hInstance = CreateMutexW(NULL,
+                                    TRUE,
+                                    RECLAIM_INSTANCE_NAME);
+    if ((hInstance == NULL) || (GetLastError() == ERROR_ALREADY_EXISTS))
+    {
+        if (hInstance != NULL)
+        {
+            CloseHandle(hInstance);
+        }
+        return 0;
+    }
+
+    // Lowers our CPU, I/O and memory priority so reclaiming never gets in
+    // the way of anything the user is doing. On top of that the throttle
+    // keeps to the limits in Settings.ini and backs off when the disk is
+    // busy, since low priority I/O still competes for the same disk.
+    SetPriorityClass(GetCurrentProcess(),
+                     PROCESS_MODE_BACKGROUND_BEGIN);
+    HANDLE hLock = CreateMutexW(NULL,
+                                FALSE,
+                                RECLAIM_LOCK_NAME);
+    Throttle throttle = { 0 };
+    loadThrottleSettings(&throttle);
+    recoverEverySwapFolder();
+
+    // A trash put that crashed leaves temporary $I files in the bin folder
+    // that nothing else ever removes
+    for (wchar_t driveLetter = L'A'; driveLetter <= L'Z'; driveLetter++)
+    {
+        wchar_t binDirectory[MAX_PATH + 1] = { 0 };
+        ULONGLONG found = 0;
+        ULONGLONG deleted = 0;
+        if (getBinDirectory(driveLetter,
+                            binDirectory,
+                            ARRAYSIZE(binDirectory)))
+        {
+            sweepTrashTempFiles(binDirectory,
+                                TRASH_TEMP_GRACE_SECONDS,
+                                TRUE,
+                                &found,
+                                &deleted);
+        }
+    }
+
+    ULONGLONG reclaimed = 0;
+    for (;;)
+    {
+        ReclaimPass pass = { 0 };
+        for (wchar_t driveLetter = L'A'; driveLetter <= L'Z'; driveLetter++)
+        {
+            wchar_t binDirectory[MAX_PATH + 1] = { 0 };
+            if (getBinDirectory(driveLetter,
+                                binDirectory,
+                                ARRAYSIZE(binDirectory)))
+            {
+                reclaimBinDirectory(binDirectory,
+                                    getCurrentFileTime(),
+                                    hLock,
+                                    &throttle,
+                                    &pass);
+            }
+        }
+        reclaimed += pass.reclaimed;
+        if (pass.nextDue == 0)
+        {
+            break;
+        }
+
+        // Sleep until the next staging folder is due. If the empty is
+        // undone in the meantime, the next pass simply finds nothing.
+        ULONGLONG now = getCurrentFileTime();
+        ULONGLONG wait = (pass.nextDue > now) ? ((pass.nextDue - now) / 10000) + 1 : 1;
+        Sleep((wait > MAXDWORD - 1) ? MAXDWORD - 1 : (DWORD) wait);
+    }
+
+    LOG(L"Reclaimed %llu items, waited %llu ms for the throttle\n",
+        reclaimed,
+        throttle.waitedMicroseconds / 1000);
+    if (hLock != NULL)
+    {
+        CloseHandle(hLock);
+    }
+    ReleaseMutex(hInstance);
+    CloseHandle(hInstance);
+    return 0;
+}
+
+/// @brief empties one bin folder by moving its items into a new staging
+/// folder. Each move is a rename within the volume, so this takes the same
+/// time whatever the size of the items.
+/// @param binDirectory the bin folder
+/// @param due when the items may be reclaimed, which names the staging folder
+/// @param itemsMoved incremented for every item moved
+/// @return TRUE if every item was moved, FALSE if any were left
+BOOL stageBinDirectory(const wchar_t* binDirectory,
+                       ULONGLONG due,
+                       ULONGLONG* itemsMoved)
+{
+    wchar_t stagingPath[MAX_PATH + 1] = { 0 };
+    wchar_t infoPattern[MAX_PATH + 1] = { 0 };
+    int written = _snwprintf(stagingPath,
+                             ARRAYSIZE(stagingPath),
+                             L"%s\\%s%016llX",
+                             binDirectory,
+                             RECLAIM_STAGING_PREFIX,
+                             due);
+    stagingPath[MAX_PATH] = 0;
+    if ((written < 0) || (written > MAX_PATH) ||
+        (buildChildPath(binDirectory, BIN_INFO_PREFIX L"*", infoPattern) == FALSE))
+    {
+        return FALSE;
+    }
+
+    WIN32_FIND_DATAW findData = { 0 };
+    HANDLE hFind = FindFirstFileExW(infoPattern,
+                                    FindExInfoBasic,
+                                    &findData,
+                                    FindExSearchNameMatch,
+                                    NULL,
+                                    FIND_FIRST_EX_LARGE_FETCH);
+    if (hFind == INVALID_HANDLE_VALUE)
+    {
+        return TRUE; // Already empty
+    }
+    if ((CreateDirectoryW(stagingPath, NULL) == FALSE) &&
+        (GetLastError() != ERROR_ALREADY_EXISTS))
+    {
+        FindClose(hFind);
+        return FALSE;
+    }
+    SetFileAttributesW(stagingPath,
+                       FILE_ATTRIBUTE_HIDDEN);
+
+    // Explorer only lists items that have a $I file, so each item leaves
+    // the bin the moment its $I is moved. The $R goes second and, if it
+    // cannot be moved, the $I is put back so the item stays whole.
+    HANDLE hLock = acquireStagingLock();
+    if (hLock == NULL)
+    {
+        FindClose(hFind);
+        RemoveDirectoryW(stagingPath);
+        return FALSE;
+    }
+    BOOL result = TRUE;
+    ULONGLONG moved = 0;
+    do
+    {
+        wchar_t binInfo[MAX_PATH + 1] = { 0 };
+        wchar_t binContent[MAX_PATH + 1] = { 0 };
+        wchar_t stagedInfo[MAX_PATH + 1] = { 0 };
+        wchar_t stagedContent[MAX_PATH + 1] = { 0 };
+        if ((buildChildPath(binDirectory, findData.cFileName, binInfo) == FALSE) ||
+            (buildChildPath(binDirectory, findData.cFileName, binContent) == FALSE) ||
+            (buildChildPath(stagingPath, findData.cFileName, stagedInfo) == FALSE) ||
+            (buildChildPath(stagingPath, findData.cFileName, stagedContent) == FALSE))
+        {
+            result = FALSE;
+            continue;
+        }
+        binContent[wcslen(binDirectory) + 2] = BIN_CONTENT_PREFIX[1];
+        stagedContent[wcslen(stagingPath) + 2] = BIN_CONTENT_PREFIX[1];
+
+        if (MoveFileExW(binInfo, stagedInfo, 0) == FALSE)
+        {
+            result = FALSE;
+            continue;
+        }
+        if ((MoveFileExW(binContent, stagedContent, 0) == FALSE) &&
+            (GetLastError() != ERROR_FILE_NOT_FOUND))
+        {
+            MoveFileExW(stagedInfo,
+                        binInfo,
+                        0);
+            result = FALSE;
+            continue;
+        }
+        moved++;
+    } while (FindNextFileW(hFind, &findData));
+    FindClose(hFind);
+    releaseStagingLock(hLock);
+
+    if (moved == 0)
+    {
+        RemoveDirectoryW(stagingPath);
+    }
+    *itemsMoved += moved;
+    LOG(L"Moved %llu items from %s to %s\n",
+        moved,
+        binDirectory,
+        stagingPath);
+    return result;
+}
+
+/// @brief empties one bin folder by renaming the whole folder into a
+/// staging folder inside a fresh copy of itself, with the same security and
+/// attributes. This is a handful of renames however many items the bin
+/// holds, and the staging folder is reclaimed and undone like any other.
+/// The folders we keep in the bin folder and desktop.ini are moved back.
+/// @param binDirectory the bin folder
+/// @param due when the items may be reclaimed, which names the staging folder
+/// @param binsSwapped incremented if the bin folder was swapped
+/// @return TRUE if the bin folder was swapped or already empty, FALSE if it
+///         was left as it was and should be staged item by item instead
+BOOL swapBinDirectory(const wchar_t* binDirectory,
+                      ULONGLONG due,
+                      ULONGLONG* binsSwapped)
+{
+    wchar_t stagingPath[MAX_PATH + 1] = { 0 };
+    wchar_t swapPath[MAX_PATH + 1] = { 0 };
+    wchar_t infoPattern[MAX_PATH + 1] = { 0 };
+    const wchar_t* name = wcsrchr(binDirectory, L'\\');
+    int written = _snwprintf(stagingPath,
+                             ARRAYSIZE(stagingPath),
+                             L"%s\\%s%016llX",
+                             binDirectory,
+                             RECLAIM_STAGING_PREFIX,
+                             due);
+    stagingPath[MAX_PATH] = 0;
+    if ((name == NULL) || (written < 0) || (written > MAX_PATH) ||
+        (buildChildPath(binDirectory, BIN_INFO_PREFIX L"*", infoPattern) == FALSE))
+    {
+        return FALSE;
+    }
+
+    // The bin folder can't be moved into itself, so it goes next to itself
+    // under a name that is not a SID first. The SID stays at the end so
+    // recoverSwapFolders() knows whose bin folder it was.
+    written = _snwprintf(swapPath,
+                         ARRAYSIZE(swapPath),
+                         L"%.*s\\%s%016llX.%s",
+                         (int) (name - binDirectory),
+                         binDirectory,
+                         RECLAIM_SWAP_PREFIX,
+                         due,
+                         name + 1);
+    swapPath[MAX_PATH] = 0;
+    if ((written < 0) || (written > MAX_PATH) ||
+        (GetFileAttributesW(stagingPath) != INVALID_FILE_ATTRIBUTES))
+    {
+        return FALSE;
+    }
+
+    WIN32_FIND_DATAW findData = { 0 };
+    HANDLE hFind = FindFirstFileExW(infoPattern,
+                                    FindExInfoBasic,
+                                    &findData,
+                                    FindExSearchNameMatch,
+                                    NULL,
+                                    0);
+    if (hFind == INVALID_HANDLE_VALUE)
+    {
+        return TRUE; // Already empty
+    }
+    FindClose(hFind);
+
+    DWORD attributes = GetFileAttributesW(binDirectory);
+    DWORD securityBytes = 0;
+    SECURITY_INFORMATION securityInformation = OWNER_SECURITY_INFORMATION |
+                                               GROUP_SECURITY_INFORMATION |
+                                               DACL_SECURITY_INFORMATION;
+    GetFileSecurityW(binDirectory,
+                     securityInformation,
+                     NULL,
+                     0,
+                     &securityBytes);
+    if ((attributes == INVALID_FILE_ATTRIBUTES) || (securityBytes == 0))
+    {
+        return FALSE;
+    }
+    PSECURITY_DESCRIPTOR securityDescriptor = HeapAlloc(GetProcessHeap(),
+                                                        0,
+                                                        securityBytes);
+    if (securityDescriptor == NULL)
+    {
+        // Memory allocation failed
+        return FALSE;
+    }
+    if (GetFileSecurityW(binDirectory,
+                         securityInformation,
+                         securityDescriptor,
+                         securityBytes,
+                         &securityBytes) == FALSE)
+    {
+        HeapFree(GetProcessHeap(),
+                 0,
+                 securityDescriptor);
+        return FALSE;
+    }
+
+    // The rename fails if anything in the bin folder is open, and nothing
+    // has changed by then. Once the fresh folder is in place, the old one
+    // only has to be moved inside it.
+    HANDLE hLock = acquireStagingLock();
+    if (hLock == NULL)
+    {
+        HeapFree(GetProcessHeap(),
+                 0,
+                 securityDescriptor);
+        return FALSE;
+    }
+    SECURITY_ATTRIBUTES securityAttributes = { sizeof(securityAttributes), securityDescriptor, FALSE };
+    BOOL result = MoveFileExW(binDirectory,
+                              swapPath,
+                              0);
+    if (result &&
+        (CreateDirectoryW(binDirectory, &securityAttributes) == FALSE))
+    {
+        // Left for recoverSwapFolders() if it can't be moved back now
+        if (MoveFileExW(swapPath, binDirectory, 0) == FALSE)
+        {
+            LOG(L"Failed to move %s back to %s, error code %d\n",
+                swapPath,
+                binDirectory,
+                GetLastError());
+        }
+        result = FALSE;
+    }
+    HeapFree(GetProcessHeap(),
+             0,
+             securityDescriptor);
+    if (result == FALSE)
+    {
+        releaseStagingLock(hLock);
+        return FALSE;
+    }
+    SetFileAttributesW(binDirectory,
+                       attributes);
+    if (MoveFileExW(swapPath, stagingPath, 0) == FALSE)
+    {
+        // Swap back, the fresh folder is still empty. If that fails too the
+        // bin folder is left for recoverSwapFolders().
+        DWORD error = GetLastError();
+        if ((RemoveDirectoryW(binDirectory) == FALSE) ||
+            (MoveFileExW(swapPath, binDirectory, 0) == FALSE))
+        {
+            LOG(L"Failed to move %s back to %s, error code %d\n",
+                swapPath,
+                binDirectory,
+                GetLastError());
+        }
+        LOG(L"Failed to move %s to %s, error code %d\n",
+            swapPath,
+            stagingPath,
+            error);
+        releaseStagingLock(hLock);
+        return FALSE;
+    }
+    SetFileAttributesW(stagingPath,
+                       FILE_ATTRIBUTE_HIDDEN);
+    moveOwnFolders(stagingPath,
+                   binDirectory);
+    releaseStagingLock(hLock);
+
+    (*binsSwapped)++;
+    LOG(L"Swapped %s out to %s\n",
+        binDirectory,
+        stagingPath);
+    return TRUE;
+}
+
+#ifndef NDEBUG
+/// @brief creates an empty file for testReclaim()
+/// @param directory the folder to create it in
+/// @param name the name of the file
+static void createTestFile(const wchar_t* directory,
+                           const wchar_t* name)
+{
+    wchar_t path[MAX_PATH + 1] = { 0 };
+    BOOL result = buildChildPath(directory,
+                                 name,
+                                 path);
+    assert(result);
+    HANDLE hFile = CreateFileW(path,
+                               GENERIC_WRITE,
+                               0,
+                               NULL,
+                               CREATE_ALWAYS,
+                               FILE_ATTRIBUTE_NORMAL,
+                               NULL);
+    assert(hFile != INVALID_HANDLE_VALUE);
+    CloseHandle(hFile);
+}
+#endif
+
+/// @brief stages, restores and reclaims a fake bin folder in a debug
+/// build, returns immediately in a release build
+/// @param none
+void testReclaim(void)
+{
+#ifndef NDEBUG
+    wchar_t tempDirectory[MAX_PATH + 1] = { 0 };
+    wchar_t binDirectory[MAX_PATH + 1] = { 0 };
+    wchar_t folderItem[MAX_PATH + 1] = { 0 };
+    wchar_t path[MAX_PATH + 1] = { 0 };
+    GetTempPathW(ARRAYSIZE(tempDirectory),
+                 tempDirectory);
+    _snwprintf(binDirectory,
+               ARRAYSIZE(binDirectory),
+               L"%srbmreclaim%08X",
+               tempDirectory,
+               GetCurrentProcessId());
+    binDirectory[MAX_PATH] = 0;
+    deleteTree(binDirectory, NULL);
+    BOOL result = CreateDirectoryW(binDirectory,
+                                   NULL);
+    assert(result);
+
+    // A file and a folder with something in it
+    createTestFile(binDirectory, L"$IABC123.txt");
+    createTestFile(binDirectory, L"$RABC123.txt");
+    createTestFile(binDirectory, L"$IDEF456");
+    buildChildPath(binDirectory, L"$RDEF456", folderItem);
+    result = CreateDirectoryW(folderItem,
+                              NULL);
+    assert(result);
+    createTestFile(folderItem, L"inside.txt");
+
+    // Staging leaves nothing behind
+    ULONGLONG count = 0;
+    result = stageBinDirectory(binDirectory,
+                               1,
+                               &count);
+    assert(result);
+    assert(count == 2);
+    buildChildPath(binDirectory, L"$IABC123.txt", path);
+    assert(GetFileAttributesW(path) == INVALID_FILE_ATTRIBUTES);
+    assert(GetFileAttributesW(folderItem) == INVALID_FILE_ATTRIBUTES);
+
+    // Undo puts everything back
+    count = 0;
+    result = restoreBinDirectory(binDirectory,
+                                 &count);
+    assert(result);
+    assert(count == 2);
+    assert(GetFileAttributesW(path) != INVALID_FILE_ATTRIBUTES);
+    buildChildPath(folderItem, L"inside.txt", path);
+    assert(GetFileAttributesW(path) != INVALID_FILE_ATTRIBUTES);
+
+    // Nothing is reclaimed before it is due, everything is after
+    count = 0;
+    result = stageBinDirectory(binDirectory,
+                               1,
+                               &count);
+    assert(result);
+    ReclaimPass pass = { 0 };
+    result = reclaimBinDirectory(binDirectory,
+                                 0,
+                                 NULL,
+                                 NULL,
+                                 &pass);
+    assert(result);
+    assert((pass.reclaimed == 0) && (pass.pending == 1) && (pass.nextDue == 1));
+    memset(&pass, 0, sizeof(pass));
+    result = reclaimBinDirectory(binDirectory,
+                                 1,
+                                 NULL,
+                                 NULL,
+                                 &pass);
+    assert(result);
+    assert((pass.reclaimed == 2) && (pass.pending == 0) && (pass.nextDue == 0));
+    _snwprintf(path,
+               ARRAYSIZE(path),
+               L"%s\\%s%016llX",
+               binDirectory,
+               RECLAIM_STAGING_PREFIX,
+               1ULL);
+    assert(GetFileAttributesW(path) == INVALID_FILE_ATTRIBUTES);
+
+    // Swapping moves everything at once, keeps our own folders in the
+    // bin folder, and is undone and reclaimed like staging
+    createTestFile(binDirectory, L"$IABC123.txt");
+    createTestFile(binDirectory, L"$RABC123.txt");
+    createTestFile(binDirectory, RECLAIM_DESKTOP_INI);
+    buildChildPath(binDirectory, RECLAIM_STAGING_PREFIX L"0000000000000001", path);
+    result = CreateDirectoryW(path,
+                              NULL);
+    assert(result);
+    count = 0;
+    result = swapBinDirectory(binDirectory,
+                              2,
+                              &count);
+    assert(result);
+    assert(count == 1);
+    assert(GetFileAttributesW(path) != INVALID_FILE_ATTRIBUTES);
+    buildChildPath(binDirectory, RECLAIM_DESKTOP_INI, path);
+    assert(GetFileAttributesW(path) != INVALID_FILE_ATTRIBUTES);
+    buildChildPath(binDirectory, L"$IABC123.txt", path);
+    assert(GetFileAttributesW(path) == INVALID_FILE_ATTRIBUTES);
+    count = 0;
+    result = restoreBinDirectory(binDirectory,
+                                 &count);
+    assert(result);
+    assert(count == 1);
+    assert(GetFileAttributesW(path) != INVALID_FILE_ATTRIBUTES);
+    count = 0;
+    result = swapBinDirectory(binDirectory,
+                              2,
+                              &count);
+    assert(result);
+    memset(&pass, 0, sizeof(pass));
+    result = reclaimBinDirectory(binDirectory,
+                                 2,
+                                 NULL,
+                                 NULL,
+                                 &pass);
+    assert(result);
+    assert((pass.reclaimed == 1) && (pass.pending == 0));
+    assert(GetFileAttributesW(path) == INVALID_FILE_ATTRIBUTES);
+
+    // A swap cut short before the fresh folder was made is moved back
+    wchar_t swapPath[MAX_PATH + 1] = { 0 };
+    _snwprintf(swapPath,
+               ARRAYSIZE(swapPath),
+               L"%s%s%016llX.%s",
+               tempDirectory,
+               RECLAIM_SWAP_PREFIX,
+               3ULL,
+               wcsrchr(binDirectory, L'\\') + 1);
+    swapPath[MAX_PATH] = 0;
+    createTestFile(binDirectory, L"$IABC123.txt");
+    createTestFile(binDirectory, L"$RABC123.txt");
+    result = MoveFileExW(binDirectory,
+                         swapPath,
+                         0);
+    assert(result);
+    count = 0;
+    result = recoverSwapFolders(binDirectory,
+                                &count);
+    assert(result);
+    assert(count == 1);
+    assert(GetFileAttributesW(swapPath) == INVALID_FILE_ATTRIBUTES);
+    assert(GetFileAttributesW(path) != INVALID_FILE_ATTRIBUTES);
+
+    // One cut short after that becomes a staging folder that can be undone
+    result = MoveFileExW(binDirectory,
+                         swapPath,
+                         0);
+    assert(result);
+    result = CreateDirectoryW(binDirectory,
+                              NULL);
+    assert(result);
+    count = 0;
+    result = recoverSwapFolders(binDirectory,
+                                &count);
+    assert(result);
+    assert(count == 1);
+    assert(GetFileAttributesW(swapPath) == INVALID_FILE_ATTRIBUTES);
+    assert(GetFileAttributesW(path) == INVALID_FILE_ATTRIBUTES);
+    count = 0;
+    result = restoreBinDirectory(binDirectory,
+                                 &count);
+    assert(result);
+    assert(count == 1);
+    assert(GetFileAttributesW(path) != INVALID_FILE_ATTRIBUTES);
+
+    result = deleteTree(binDirectory, NULL);
+    assert(result);
+#endif
+}
+
+/// @brief undoes instant empties on every volume by moving every item that
+/// has not been reclaimed yet back into the bin
+/// @param itemsRestored receives the number of items restored
+/// @return TRUE if every item was restored, FALSE if any were left
+BOOL undoEmpty(ULONGLONG* itemsRestored)
+{
+    *itemsRestored = 0;
+    recoverEverySwapFolder();
+    BOOL result = TRUE;
+    for (wchar_t driveLetter = L'A'; driveLetter <= L'Z'; driveLetter++)
+    {
+        wchar_t binDirectory[MAX_PATH + 1] = { 0 };
+        if (getBinDirectory(driveLetter,
+                            binDirectory,
+                            ARRAYSIZE(binDirectory)) == FALSE)
+        {
+            continue;
+        }
+        if (restoreBinDirectory(binDirectory,
+                                itemsRestored) == FALSE)
+        {
+            result = FALSE;
+        }
+    }
+    if (*itemsRestored > 0)
+    {
+        SHUpdateRecycleBinIcon();
+    }
+    return result;
+}
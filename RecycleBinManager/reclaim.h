@@ -0,0 +1,63 @@
+#define _CRT_SECURE_NO_WARNINGS
+
+#pragma once
+#include <Windows.h>
+#include <shlobj_core.h>
+#include <stdio.h>
+#include <assert.h>
+#include "throttle.h"
+
+// Instant empty parameters. Emptying renames every item in the bin into a
+// hidden staging folder next to it, which is a metadata change no matter
+// how large the items are. The staging folder is named after the time it
+// becomes due, and a background process deletes it once that time has
+// passed. Until then the empty can be undone by renaming the items back.
+// Deleting goes through a Throttle so a busy disk is not swamped. Staging
+// folders are on disk, so anything that was not reclaimed before a
+// restart is picked up the next time we run. With SwapEmpty set, a bin
+// folder on NTFS or ReFS is instead renamed whole into a staging folder
+// inside a fresh copy of itself, which is a few renames however many items
+// there are. Other file systems, and a bin folder that can't be renamed
+// because something in it is open, are staged item by item. A swap cut
+// short by a crash leaves the bin folder next to itself under a swap name,
+// and the next look for staging folders puts it back or into staging.
+
+#define RECLAIM_STAGING_PREFIX  L"~RBMEmpty" // Followed by the due time in hex
+#define RECLAIM_STAGING_CCH     (ARRAYSIZE(RECLAIM_STAGING_PREFIX) - 1 + 16)
+#define RECLAIM_SWAP_PREFIX     L"~RBMSwap" // Followed by the due time in hex, a dot and the SID
+#define RECLAIM_OWN_PATTERN     L"~RBM*" // Our own folders, moved back out of a swapped bin
+#define RECLAIM_DESKTOP_INI     L"desktop.ini" // The shell's, moved back out of a swapped bin
+#define RECLAIM_LOCK_NAME       L"Local\\RecycleBinManagerStaging" // Held while items move
+#define RECLAIM_LOCK_TIMEOUT_MS 5000 // Longest wait for it before giving up
+#define RECLAIM_CLAIMED_PREFIX  L"$D" // Replaces $I once the reclaimer has claimed an item
+#define RECLAIM_INSTANCE_NAME   L"Local\\RecycleBinManagerReclaimer" // Held by the reclaimer
+#define FILETIME_PER_SECOND     10000000ULL
+
+// Structs
+
+typedef struct ReclaimPass
+{
+    ULONGLONG reclaimed; // Items deleted in this pass
+    ULONGLONG pending; // Items still waiting for their delay to pass
+    ULONGLONG nextDue; // FILETIME the next pending staging folder is due, 0 if none
+} ReclaimPass;
+
+// Functions
+
+HANDLE acquireStagingLock(void);
+BOOL canUndoEmpty(void);
+BOOL deleteTree(const wchar_t* path, Throttle* throttle);
+BOOL emptyToStaging(ULONGLONG reclaimDelay, ULONGLONG* itemsMoved);
+ULONGLONG getReclaimDelay(void);
+BOOL hasStagingFolders(void);
+BOOL launchReclaimer(void);
+BOOL reclaimBinDirectory(const wchar_t* binDirectory, ULONGLONG now,
+                         HANDLE hLock, Throttle* throttle, ReclaimPass* pass);
+BOOL recoverSwapFolders(const wchar_t* binDirectory, ULONGLONG* foldersRecovered);
+void releaseStagingLock(HANDLE hLock);
+BOOL restoreBinDirectory(const wchar_t* binDirectory, ULONGLONG* itemsRestored);
+int runReclaimer(void);
+BOOL stageBinDirectory(const wchar_t* binDirectory, ULONGLONG due, ULONGLONG* itemsMoved);
+BOOL swapBinDirectory(const wchar_t* binDirectory, ULONGLONG due, ULONGLONG* binsSwapped);
+void testReclaim(void);
+BOOL undoEmpty(ULONGLONG* itemsRestored);
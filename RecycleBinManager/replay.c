@@ -0,0 +1,614 @@
+/*
+* Record bin notifications and replay them against the refresh path
+*
+* Copyright(C) 2024 ERROR_SUCCESS Software
+*
+* This program is free software : you can redistribute it and /or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.If not, see < https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#include "replay.h"
+#include "throttle.h"
+#include "logger.h"
+
+typedef struct ReplayClock
+{
+    double speed; // REPLAY_AS_FAST_AS_POSSIBLE for the fake clock
+    ULONGLONG origin; // getThrottleClock() when the replay started
+    ULONGLONG fakeNow; // Replay time on the fake clock
+} ReplayClock;
+
+static LRESULT CALLBACK recorderProc(HWND hWnd, UINT msg, WPARAM wParam, LPARAM lParam);
+static ULONGLONG replayNow(const ReplayClock* clock);
+static void replayWaitUntil(ReplayClock* clock, ULONGLONG until);
+
+/// @brief adds an event to the end of a session
+/// @param session the session
+/// @param event the event, no earlier than the last one
+/// @return TRUE on success, FALSE if memory ran out
+BOOL addReplayEvent(ReplaySession* session,
+                    const ReplayEvent* event)
+{
+    if (session->count == session->capacity)
+    {
+        ULONGLONG capacity = (session->capacity == 0) ? REPLAY_INITIAL_EVENTS : session->capacity * 2;
+        ReplayEvent* events = (session->events == NULL) ?
+            HeapAlloc(GetProcessHeap(),
+                      0,
+                      (SIZE_T) (capacity * sizeof(ReplayEvent))) :
+            HeapReAlloc(GetProcessHeap(),
+                        0,
+                        session->events,
+                        (SIZE_T) (capacity * sizeof(ReplayEvent)));
+        if (events == NULL)
+        {
+            // Memory allocation failed
+            return FALSE;
+        }
+        session->events = events;
+        session->capacity = capacity;
+    }
+    session->events[session->count++] = *event;
+    return TRUE;
+}
+
+/// @brief closes a recording
+/// @param recorder the recorder
+void closeReplayRecorder(ReplayRecorder* recorder)
+{
+    if (recorder->hFile != INVALID_HANDLE_VALUE)
+    {
+        CloseHandle(recorder->hFile);
+        recorder->hFile = INVALID_HANDLE_VALUE;
+    }
+}
+
+/// @brief frees the events of a session
+/// @param session the session
+void freeReplaySession(ReplaySession* session)
+{
+    if (session->events != NULL)
+    {
+        HeapFree(GetProcessHeap(),
+                 0,
+                 session->events);
+    }
+    memset(session,
+           0,
+           sizeof(ReplaySession));
+}
+
+/// @brief fills in the default replay options: the fake clock, the refresh
+/// policy the dialog uses, and refresh costs close to a real one
+/// @param options receives the defaults
+void initReplayOptions(ReplayOptions* options)
+{
+    options->speed = REPLAY_AS_FAST_AS_POSSIBLE;
+    options->policy = REFRESH_EACH_NOTIFICATION;
+    options->refreshMicroseconds = REPLAY_REFRESH_US;
+    options->refreshNanosecondsPerItem = REPLAY_REFRESH_NS_PER_ITEM;
+}
+
+/// @brief reads a recording
+/// @param path the recording
+/// @param session receives the events, free with freeReplaySession()
+/// @return TRUE on success, FALSE if the file is missing or not a recording
+BOOL loadReplaySession(const wchar_t* path,
+                       ReplaySession* session)
+{
+    memset(session,
+           0,
+           sizeof(ReplaySession));
+    HANDLE hFile = CreateFileW(path,
+                               GENERIC_READ,
+                               FILE_SHARE_READ,
+                               NULL,
+                               OPEN_EXISTING,
+                               FILE_FLAG_SEQUENTIAL_SCAN,
+                               NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+    {
+        return FALSE;
+    }
+
+    ReplayHeader header = { 0 };
+    DWORD read = 0;
+    LARGE_INTEGER fileSize = { 0 };
+    BOOL success = GetFileSizeEx(hFile,
+                                 &fileSize) &&
+        ReadFile(hFile,
+                 &header,
+                 sizeof(header),
+                 &read,
+                 NULL) &&
+        (read == sizeof(header)) &&
+        (header.magic == REPLAY_MAGIC) &&
+        (header.version == REPLAY_VERSION) &&
+        (header.headerSize == sizeof(ReplayHeader)) &&
+        (header.eventSize == sizeof(ReplayEvent));
+    ULONGLONG eventBytes = (success) ? (ULONGLONG) fileSize.QuadPart - sizeof(header) : 0;
+    if (success && (eventBytes > 0) && (eventBytes <= MAXDWORD))
+    {
+        // A recording cut off by a crash loses at most its last event
+        session->capacity = eventBytes / sizeof(ReplayEvent);
+        session->events = HeapAlloc(GetProcessHeap(),
+                                    0,
+                                    (SIZE_T) eventBytes);
+        success = (session->events != NULL) &&
+            ReadFile(hFile,
+                     session->events,
+                     (DWORD) eventBytes,
+                     &read,
+                     NULL) &&
+            (read == (DWORD) eventBytes);
+        session->count = session->capacity;
+    }
+    CloseHandle(hFile);
+    if ((success == FALSE) || (session->count == 0))
+    {
+        freeReplaySession(session);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/// @brief starts a recording and writes the current state of the bin as
+/// its first event
+/// @param path the file to record to, replaced if it exists
+/// @param backend the bin to query after each notification
+/// @param recorder receives the recorder, close with closeReplayRecorder()
+/// @return TRUE on success, FALSE if the file could not be written
+BOOL openReplayRecorder(const wchar_t* path,
+                        const BinBackend* backend,
+                        ReplayRecorder* recorder)
+{
+    memset(recorder,
+           0,
+           sizeof(ReplayRecorder));
+    recorder->backend = backend;
+    recorder->hFile = CreateFileW(path,
+                                  GENERIC_WRITE,
+                                  FILE_SHARE_READ,
+                                  NULL,
+                                  CREATE_ALWAYS,
+                                  FILE_ATTRIBUTE_NORMAL,
+                                  NULL);
+    if (recorder->hFile == INVALID_HANDLE_VALUE)
+    {
+        return FALSE;
+    }
+    ReplayHeader header = { 0 };
+    header.magic = REPLAY_MAGIC;
+    header.version = REPLAY_VERSION;
+    header.headerSize = sizeof(ReplayHeader);
+    header.eventSize = sizeof(ReplayEvent);
+    DWORD written = 0;
+    recorder->start = getThrottleClock();
+    if ((WriteFile(recorder->hFile,
+                   &header,
+                   sizeof(header),
+                   &written,
+                   NULL) == FALSE) ||
+        (written != sizeof(header)) ||
+        (recordReplayEvent(recorder,
+                           0) == FALSE))
+    {
+        closeReplayRecorder(recorder);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/// @brief records every bin notification for a while
+/// @param path the file to record to, replaced if it exists
+/// @param seconds how long to listen for
+/// @param notifications receives the number of notifications recorded
+/// @return TRUE on success, FALSE if the recording could not be made
+BOOL recordNotifications(const wchar_t* path,
+                         DWORD seconds,
+                         ULONGLONG* notifications)
+{
+    *notifications = 0;
+    ReplayRecorder recorder = { 0 };
+    if (openReplayRecorder(path,
+                           getBinBackend(),
+                           &recorder) == FALSE)
+    {
+        return FALSE;
+    }
+
+    // A message-only window is enough to receive the notifications
+    WNDCLASSW windowClass = { 0 };
+    windowClass.lpfnWndProc = recorderProc;
+    windowClass.hInstance = GetModuleHandleW(NULL);
+    windowClass.lpszClassName = REPLAY_WINDOW_CLASS;
+    RegisterClassW(&windowClass);
+    HWND hWnd = CreateWindowExW(0,
+                                REPLAY_WINDOW_CLASS,
+                                L"",
+                                0,
+                                0,
+                                0,
+                                0,
+                                0,
+                                HWND_MESSAGE,
+                                NULL,
+                                windowClass.hInstance,
+                                NULL);
+    if (hWnd == NULL)
+    {
+        closeReplayRecorder(&recorder);
+        return FALSE;
+    }
+    SetWindowLongPtrW(hWnd,
+                      GWLP_USERDATA,
+                      (LONG_PTR) &recorder);
+    ULONG registrationId = recorder.backend->watch(recorder.backend->context,
+                                                   hWnd,
+                                                   WM_REPLAY_NOTIFICATION);
+    if (registrationId == 0)
+    {
+        DestroyWindow(hWnd);
+        closeReplayRecorder(&recorder);
+        return FALSE;
+    }
+
+    ULONGLONG deadline = GetTickCount64() + ((ULONGLONG) seconds * 1000);
+    for (ULONGLONG now = GetTickCount64(); now < deadline; now = GetTickCount64())
+    {
+        MsgWaitForMultipleObjects(0,
+                                  NULL,
+                                  FALSE,
+                                  (DWORD) (deadline - now),
+                                  QS_ALLINPUT);
+        MSG msg = { 0 };
+        while (PeekMessageW(&msg,
+                            NULL,
+                            0,
+                            0,
+                            PM_REMOVE))
+        {
+            TranslateMessage(&msg);
+            DispatchMessageW(&msg);
+        }
+    }
+
+    recorder.backend->unwatch(recorder.backend->context,
+                              registrationId);
+    DestroyWindow(hWnd);
+    *notifications = recorder.events - 1;
+    closeReplayRecorder(&recorder);
+    return TRUE;
+}
+
+/// @brief window procedure of the recorder's message-only window
+/// @param hWnd the window, its user data is the ReplayRecorder
+/// @param msg the message
+/// @param wParam for a shell notification, the handle to lock
+/// @param lParam for a shell notification, the process ID to lock it with
+/// @return the result of the message
+static LRESULT CALLBACK recorderProc(HWND hWnd,
+                                     UINT msg,
+                                     WPARAM wParam,
+                                     LPARAM lParam)
+{
+    if (msg != WM_REPLAY_NOTIFICATION)
+    {
+        return DefWindowProcW(hWnd,
+                              msg,
+                              wParam,
+                              lParam);
+    }
+    ReplayRecorder* recorder = (ReplayRecorder*) GetWindowLongPtrW(hWnd,
+                                                                   GWLP_USERDATA);
+    ULONGLONG microseconds = getThrottleClock() - recorder->start;
+
+    // Shell notifications are delivered in shared memory that has to be
+    // locked and unlocked to be released. The memory backend posts zeroes.
+    if (lParam != 0)
+    {
+        PIDLIST_ABSOLUTE* pidls = NULL;
+        LONG event = 0;
+        HANDLE hLock = SHChangeNotification_Lock((HANDLE) wParam,
+                                                 (DWORD) lParam,
+                                                 &pidls,
+                                                 &event);
+        if (hLock != NULL)
+        {
+            SHChangeNotification_Unlock(hLock);
+        }
+    }
+    if (recordReplayEvent(recorder,
+                          microseconds) == FALSE)
+    {
+        LOG(L"Failed to record a notification, error %lu\n",
+            GetLastError());
+    }
+    return 0;
+}
+
+/// @brief queries the bin and writes what it holds as an event
+/// @param recorder the recorder
+/// @param microseconds when the notification arrived, since recording started
+/// @return TRUE on success, FALSE if the bin could not be queried or the
+///         event could not be written
+BOOL recordReplayEvent(ReplayRecorder* recorder,
+                       ULONGLONG microseconds)
+{
+    ReplayEvent event = { 0 };
+    event.microseconds = microseconds;
+    if (recorder->backend->query(recorder->backend->context,
+                                 &event.items,
+                                 &event.bytes) == FALSE)
+    {
+        return FALSE;
+    }
+    DWORD written = 0;
+    if ((WriteFile(recorder->hFile,
+                   &event,
+                   sizeof(event),
+                   &written,
+                   NULL) == FALSE) ||
+        (written != sizeof(event)))
+    {
+        return FALSE;
+    }
+    recorder->events++;
+    return TRUE;
+}
+
+/// @brief reads the replay clock
+/// @param clock the clock
+/// @return the replay time in microseconds
+static ULONGLONG replayNow(const ReplayClock* clock)
+{
+    if (clock->speed <= REPLAY_AS_FAST_AS_POSSIBLE)
+    {
+        return clock->fakeNow;
+    }
+    return (ULONGLONG) ((double) (getThrottleClock() - clock->origin) * clock->speed);
+}
+
+/// @brief feeds a recording to a model of the dialog's refresh path and
+/// measures how it copes. Notifications queue up like window messages
+/// while a refresh runs. A refresh reads the bin as it is when the refresh
+/// starts, then takes its cost in time before the dialog shows it.
+/// @param session the recording
+/// @param options the clock, refresh policy and refresh cost
+/// @param result receives the measurements
+/// @return TRUE on success, FALSE if the session has no events
+BOOL replaySession(const ReplaySession* session,
+                   const ReplayOptions* options,
+                   ReplayResult* result)
+{
+    memset(result,
+           0,
+           sizeof(ReplayResult));
+    if (session->count == 0)
+    {
+        return FALSE;
+    }
+    LARGE_INTEGER frequency, start, end;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&start);
+
+    ReplayClock clock = { 0 };
+    clock.speed = options->speed;
+    clock.origin = getThrottleClock();
+    ReplayEvent world = session->events[0]; // What the bin holds
+    ReplayEvent shown = world; // What the dialog shows
+    ULONGLONG lastEvent = session->events[session->count - 1].microseconds;
+    BOOL lastShown = (session->count == 1);
+    ULONGLONG next = 1;
+    ULONGLONG queued = 0;
+    ULONGLONG unseen = 0; // Notifications no refresh has read the bin after
+    double unseenTimes = 0.0; // The sum of their arrival times
+    double lag = 0.0;
+    while ((next < session->count) || (queued > 0))
+    {
+        if (queued == 0)
+        {
+            replayWaitUntil(&clock,
+                            session->events[next].microseconds);
+        }
+        ULONGLONG now = replayNow(&clock);
+        while ((next < session->count) && (session->events[next].microseconds <= now))
+        {
+            world = session->events[next];
+            unseenTimes += (double) world.microseconds;
+            unseen++;
+            queued++;
+            result->notifications++;
+            next++;
+        }
+        result->maxQueued = max(result->maxQueued, queued);
+        if (queued == 0)
+        {
+            continue;
+        }
+        queued = (options->policy == REFRESH_COALESCE_QUEUED) ? 0 : queued - 1;
+
+        // The refresh reads the bin now and shows it once its work is done
+        ReplayEvent read = world;
+        BOOL readsLast = (next == session->count);
+        ULONGLONG readUnseen = unseen;
+        double readUnseenTimes = unseenTimes;
+        unseen = 0;
+        unseenTimes = 0.0;
+        replayWaitUntil(&clock,
+                        now + options->refreshMicroseconds +
+                        ((read.items * options->refreshNanosecondsPerItem) / 1000));
+        ULONGLONG done = replayNow(&clock);
+        result->refreshes++;
+        if ((read.items == shown.items) && (read.bytes == shown.bytes))
+        {
+            result->redundantQueries++;
+        }
+        shown = read;
+        lag += ((double) readUnseen * (double) done) - readUnseenTimes;
+        if (readsLast && (lastShown == FALSE))
+        {
+            result->consistentMicroseconds = done - lastEvent;
+            lastShown = TRUE;
+        }
+    }
+    result->meanLagMicroseconds = (result->notifications == 0) ? 0.0 :
+        lag / (double) result->notifications;
+    result->durationMicroseconds = replayNow(&clock);
+    result->drainedMicroseconds = (result->durationMicroseconds > lastEvent) ?
+        result->durationMicroseconds - lastEvent : 0;
+    QueryPerformanceCounter(&end);
+    result->wallMilliseconds = ((double) (end.QuadPart - start.QuadPart) * 1e3) /
+        (double) frequency.QuadPart;
+    return TRUE;
+}
+
+/// @brief waits on the replay clock
+/// @param clock the clock. The fake clock jumps, the real one sleeps and
+/// then spins off the last fraction of a millisecond.
+/// @param until the replay time to wait for
+static void replayWaitUntil(ReplayClock* clock,
+                            ULONGLONG until)
+{
+    if (clock->speed <= REPLAY_AS_FAST_AS_POSSIBLE)
+    {
+        clock->fakeNow = max(clock->fakeNow, until);
+        return;
+    }
+    ULONGLONG now = replayNow(clock);
+    if (until <= now)
+    {
+        return;
+    }
+    double realMicroseconds = (double) (until - now) / clock->speed;
+    if (realMicroseconds >= 1000.0)
+    {
+        Sleep((DWORD) (realMicroseconds / 1000.0));
+    }
+    while (replayNow(clock) < until)
+    {
+        YieldProcessor();
+    }
+}
+
+/// @brief checks recording round trips through a file and that replaying a
+/// storm shows the cost of refreshing for every notification, in a debug
+/// build, returns immediately in a release build
+/// @param none
+void testReplay(void)
+{
+#ifndef NDEBUG
+    // Record from a memory bin with made up times
+    wchar_t path[MAX_PATH + 1] = { 0 };
+    wchar_t tempDirectory[MAX_PATH + 1] = { 0 };
+    GetTempPathW(ARRAYSIZE(tempDirectory),
+                 tempDirectory);
+    _snwprintf(path,
+               ARRAYSIZE(path),
+               L"%srbmreplay%08X.bin",
+               tempDirectory,
+               GetCurrentProcessId());
+    path[MAX_PATH] = 0;
+    MemoryBin bin = { 0 };
+    BinBackend backend = { 0 };
+    initMemoryBin(&bin,
+                  NULL,
+                  &backend);
+    ReplayRecorder recorder = { 0 };
+    BOOL result = openReplayRecorder(path,
+                                     &backend,
+                                     &recorder);
+    assert(result);
+    for (ULONGLONG i = 1; i <= 10; i++)
+    {
+        addMemoryBinItems(&bin,
+                          1,
+                          1000);
+        result = recordReplayEvent(&recorder,
+                                   i * 100);
+        assert(result);
+    }
+    closeReplayRecorder(&recorder);
+    freeMemoryBin(&bin);
+    ReplaySession session = { 0 };
+    result = loadReplaySession(path,
+                               &session);
+    assert(result);
+    assert(session.count == 11);
+    assert((session.events[0].items == 0) && (session.events[0].microseconds == 0));
+    assert((session.events[10].items == 10) && (session.events[10].bytes == 10000));
+    assert(session.events[10].microseconds == 1000);
+    freeReplaySession(&session);
+    DeleteFileW(path);
+
+    // A storm: a notification every millisecond for a second, each
+    // refresh taking 5ms
+    ReplayEvent event = { 0 };
+    addReplayEvent(&session,
+                   &event);
+    for (ULONGLONG i = 1; i <= 1000; i++)
+    {
+        event.microseconds = i * 1000;
+        event.items = i;
+        event.bytes = i * 4096;
+        result = addReplayEvent(&session,
+                                &event);
+        assert(result);
+    }
+    ReplayOptions options = { 0 };
+    initReplayOptions(&options);
+    options.refreshMicroseconds = 5000;
+    options.refreshNanosecondsPerItem = 0;
+    ReplayResult each = { 0 };
+    result = replaySession(&session,
+                           &options,
+                           &each);
+    assert(result);
+    assert((each.notifications == 1000) && (each.refreshes == 1000));
+    assert(each.redundantQueries > 700);
+    assert(each.maxQueued > 700);
+
+    // Each refresh reads the bin as it is, so the dialog is right soon after
+    // the storm ends, but it stays busy working through stale messages
+    assert(each.consistentMicroseconds <= 10000);
+    assert(each.drainedMicroseconds > 3000000);
+
+    // Reading the bin once for everything that is queued keeps up
+    options.policy = REFRESH_COALESCE_QUEUED;
+    ReplayResult coalesced = { 0 };
+    result = replaySession(&session,
+                           &options,
+                           &coalesced);
+    assert(result);
+    assert(coalesced.notifications == 1000);
+    assert((coalesced.refreshes > 150) && (coalesced.refreshes < 250));
+    assert(coalesced.redundantQueries == 0);
+    assert(coalesced.consistentMicroseconds <= 10000);
+    assert(coalesced.meanLagMicroseconds <= 10000.0);
+    assert(coalesced.drainedMicroseconds <= 10000);
+
+    // Nothing changing costs a redundant query for every notification
+    for (ULONGLONG i = 1; i < session.count; i++)
+    {
+        session.events[i].items = 0;
+        session.events[i].bytes = 0;
+    }
+    options.policy = REFRESH_EACH_NOTIFICATION;
+    result = replaySession(&session,
+                           &options,
+                           &each);
+    assert(result && (each.redundantQueries == each.refreshes));
+    freeReplaySession(&session);
+#endif
+}
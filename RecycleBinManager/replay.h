@@ -0,0 +1,99 @@
+#define _CRT_SECURE_NO_WARNINGS
+
+#pragma once
+#include <Windows.h>
+#include <stdio.h>
+#include <assert.h>
+#include "binbackend.h"
+
+// Notification replay parameters. A recording is a header followed by
+// fixed width events, each one the time a bin notification arrived and
+// what the bin held just after it. The first event is the state of the bin
+// when recording started rather than a notification. Replaying feeds the
+// events to a model of the dialog's refresh path, which handles one
+// message at a time and queries the bin each time it refreshes, so storms
+// of notifications during a bulk delete can be measured and tuned without
+// the shell. Replays run against a fake clock as fast as possible, or
+// against the real one at any speed.
+
+#define REPLAY_MAGIC                0x4E424D52 // "RMBN" when read as bytes
+#define REPLAY_VERSION              1
+#define REPLAY_INITIAL_EVENTS       1024
+#define REPLAY_DEFAULT_SECONDS      60 // How long /recordevents listens for
+#define REPLAY_AS_FAST_AS_POSSIBLE  0.0
+#define REPLAY_REFRESH_US           2000 // Fixed cost of a refresh: the query, icon and status text
+#define REPLAY_REFRESH_NS_PER_ITEM  500 // Rebuilding the catalog, for each item in the bin
+#define REPLAY_WINDOW_CLASS         L"RecycleBinManagerRecorder"
+#define WM_REPLAY_NOTIFICATION      (WM_USER + 101)
+
+// Refresh policies
+#define REFRESH_EACH_NOTIFICATION   0 // What the dialog does, one refresh for every message
+#define REFRESH_COALESCE_QUEUED     1 // One refresh for every message waiting in the queue
+
+// Structs
+
+typedef struct ReplayHeader
+{
+    DWORD magic; // Always REPLAY_MAGIC
+    DWORD version; // Always REPLAY_VERSION
+    DWORD headerSize; // sizeof(ReplayHeader)
+    DWORD eventSize; // sizeof(ReplayEvent)
+} ReplayHeader;
+
+typedef struct ReplayEvent
+{
+    ULONGLONG microseconds; // Since recording started
+    ULONGLONG items; // In the bin just after the notification
+    ULONGLONG bytes;
+} ReplayEvent;
+
+typedef struct ReplayRecorder
+{
+    HANDLE hFile;
+    ULONGLONG start; // getThrottleClock() when recording started
+    ULONGLONG events; // Written so far, including the starting state
+    const BinBackend* backend; // Queried for the state after each notification
+} ReplayRecorder;
+
+typedef struct ReplaySession
+{
+    ReplayEvent* events;
+    ULONGLONG count;
+    ULONGLONG capacity;
+} ReplaySession;
+
+typedef struct ReplayOptions
+{
+    double speed; // 1.0 for real time, REPLAY_AS_FAST_AS_POSSIBLE for a fake clock
+    DWORD policy; // REFRESH_ value
+    DWORD refreshMicroseconds; // Fixed cost of one refresh
+    DWORD refreshNanosecondsPerItem; // Added for each item in the bin
+} ReplayOptions;
+
+typedef struct ReplayResult
+{
+    ULONGLONG notifications;
+    ULONGLONG refreshes; // Each refresh queries the bin once
+    ULONGLONG redundantQueries; // Refreshes that found what was already shown
+    ULONGLONG maxQueued; // Most notifications waiting at once
+    double meanLagMicroseconds; // From a notification until a refresh reflects it
+    ULONGLONG consistentMicroseconds; // From the last notification until the dialog is right
+    ULONGLONG drainedMicroseconds; // From the last notification until none are left queued
+    ULONGLONG durationMicroseconds; // Of the replay, in replay time
+    double wallMilliseconds; // What the replay took
+} ReplayResult;
+
+// Functions
+
+BOOL addReplayEvent(ReplaySession* session, const ReplayEvent* event);
+void closeReplayRecorder(ReplayRecorder* recorder);
+void freeReplaySession(ReplaySession* session);
+void initReplayOptions(ReplayOptions* options);
+BOOL loadReplaySession(const wchar_t* path, ReplaySession* session);
+BOOL openReplayRecorder(const wchar_t* path, const BinBackend* backend,
+                        ReplayRecorder* recorder);
+BOOL recordNotifications(const wchar_t* path, DWORD seconds, ULONGLONG* notifications);
+BOOL recordReplayEvent(ReplayRecorder* recorder, ULONGLONG microseconds);
+BOOL replaySession(const ReplaySession* session, const ReplayOptions* options,
+                   ReplayResult* result);
+void testReplay(void);
@@ -0,0 +1,309 @@
+/*
+* Write large reports as UTF-8 through a fixed buffer
+*
+* Copyright(C) 2024 ERROR_SUCCESS Software
+*
+* This program is free software : you can redistribute it and /or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.If not, see < https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#include "reportwriter.h"
+#include "logger.h"
+
+static char* reserveReportBytes(ReportWriter* writer, DWORD bytes);
+static void writeReportCodePoint(ReportWriter* writer, DWORD codePoint);
+static void writeReportWide(ReportWriter* writer, const wchar_t* value, BOOL json);
+
+/// @brief writes out everything waiting in the buffer
+/// @param writer the writer
+/// @return TRUE if everything written so far reached the output, FALSE if
+///         any of it was lost
+BOOL flushReportWriter(ReportWriter* writer)
+{
+    if ((writer->length > 0) && (writer->failed == FALSE))
+    {
+        DWORD bytesWritten = 0;
+        writer->failed = ((WriteFile(writer->hOutput,
+                                     writer->buffer,
+                                     writer->length,
+                                     &bytesWritten,
+                                     NULL) == FALSE) ||
+                          (bytesWritten != writer->length));
+    }
+    writer->length = 0;
+    return (writer->failed == FALSE);
+}
+
+/// @brief starts a writer
+/// @param writer receives the writer
+/// @param hOutput where to write, a file, pipe or console
+void initReportWriter(ReportWriter* writer,
+                      HANDLE hOutput)
+{
+    writer->hOutput = hOutput;
+    writer->length = 0;
+    writer->failed = FALSE;
+}
+
+/// @brief makes room at the end of the buffer, flushing it first if needed
+/// @param writer the writer
+/// @param bytes how much room, at most REPORT_WRITER_BYTES
+/// @return where to write the bytes, NULL if an earlier write failed
+static char* reserveReportBytes(ReportWriter* writer,
+                                DWORD bytes)
+{
+    if ((writer->length + bytes > sizeof(writer->buffer)) &&
+        (flushReportWriter(writer) == FALSE))
+    {
+        return NULL;
+    }
+    if (writer->failed)
+    {
+        return NULL;
+    }
+    char* destination = writer->buffer + writer->length;
+    writer->length += bytes;
+    return destination;
+}
+
+/// @brief tests numbers, escaping and a report larger than the buffer, in
+/// a debug build, returns immediately in a release build
+/// @param none
+void testReportWriter(void)
+{
+#ifndef NDEBUG
+    wchar_t tempDirectory[MAX_PATH + 1] = { 0 };
+    wchar_t path[MAX_PATH + 1] = { 0 };
+    GetTempPathW(ARRAYSIZE(tempDirectory),
+                 tempDirectory);
+    _snwprintf(path,
+               ARRAYSIZE(path),
+               L"%srbmreport%08X.txt",
+               tempDirectory,
+               GetCurrentProcessId());
+    path[MAX_PATH] = 0;
+    HANDLE hFile = CreateFileW(path,
+                               GENERIC_READ | GENERIC_WRITE,
+                               0,
+                               NULL,
+                               CREATE_ALWAYS,
+                               FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE,
+                               NULL);
+    assert(hFile != INVALID_HANDLE_VALUE);
+
+    // The writer is too large for the stack of a worker thread
+    ReportWriter* writer = HeapAlloc(GetProcessHeap(),
+                                     0,
+                                     sizeof(ReportWriter));
+    assert(writer != NULL);
+    initReportWriter(writer,
+                     hFile);
+    writeReportNumber(writer, 0);
+    writeReportText(writer, ",");
+    writeReportNumber(writer, 18446744073709551615ULL);
+    writeReportText(writer, ",");
+    writeReportJsonString(writer, L"C:\\x\"y\n\x00E9\xD83D\xDE00");
+    writeReportText(writer, ",");
+    writeReportCsvField(writer, L"a\"b,c");
+    const char expected[] = "0,18446744073709551615,"
+        "\"C:\\\\x\\\"y\\u000a\xC3\xA9\xF0\x9F\x98\x80\","
+        "\"a\"\"b,c\"";
+    BOOL result = flushReportWriter(writer);
+    assert(result);
+
+    char actual[sizeof(expected) + 16] = { 0 };
+    DWORD bytesRead = 0;
+    LARGE_INTEGER start = { 0 };
+    SetFilePointerEx(hFile,
+                     start,
+                     NULL,
+                     FILE_BEGIN);
+    ReadFile(hFile,
+             actual,
+             sizeof(actual),
+             &bytesRead,
+             NULL);
+    assert((bytesRead == sizeof(expected) - 1) && (memcmp(actual, expected, bytesRead) == 0));
+
+    // More than the buffer holds goes out in pieces, with nothing lost
+    for (DWORD i = 0; i < 10000; i++)
+    {
+        writeReportNumber(writer,
+                          1000000 + i);
+    }
+    result = flushReportWriter(writer);
+    assert(result);
+    LARGE_INTEGER size = { 0 };
+    GetFileSizeEx(hFile,
+                  &size);
+    assert(size.QuadPart == (LONGLONG) ((sizeof(expected) - 1) + (10000 * 7)));
+    HeapFree(GetProcessHeap(),
+             0,
+             writer);
+    CloseHandle(hFile);
+#endif
+}
+
+/// @brief writes one Unicode code point as UTF-8
+/// @param writer the writer
+/// @param codePoint the code point
+static void writeReportCodePoint(ReportWriter* writer,
+                                 DWORD codePoint)
+{
+    char* destination = reserveReportBytes(writer,
+                                           (codePoint < 0x80) ? 1 :
+                                           (codePoint < 0x800) ? 2 :
+                                           (codePoint < 0x10000) ? 3 : 4);
+    if (destination == NULL)
+    {
+        return;
+    }
+    if (codePoint < 0x80)
+    {
+        destination[0] = (char) codePoint;
+    }
+    else if (codePoint < 0x800)
+    {
+        destination[0] = (char) (0xC0 | (codePoint >> 6));
+        destination[1] = (char) (0x80 | (codePoint & 0x3F));
+    }
+    else if (codePoint < 0x10000)
+    {
+        destination[0] = (char) (0xE0 | (codePoint >> 12));
+        destination[1] = (char) (0x80 | ((codePoint >> 6) & 0x3F));
+        destination[2] = (char) (0x80 | (codePoint & 0x3F));
+    }
+    else
+    {
+        destination[0] = (char) (0xF0 | (codePoint >> 18));
+        destination[1] = (char) (0x80 | ((codePoint >> 12) & 0x3F));
+        destination[2] = (char) (0x80 | ((codePoint >> 6) & 0x3F));
+        destination[3] = (char) (0x80 | (codePoint & 0x3F));
+    }
+}
+
+/// @brief writes a string as one CSV field, quoted, with quotes doubled
+/// @param writer the writer
+/// @param value the string
+void writeReportCsvField(ReportWriter* writer,
+                         const wchar_t* value)
+{
+    writeReportWide(writer,
+                    value,
+                    FALSE);
+}
+
+/// @brief writes a string as a quoted JSON string
+/// @param writer the writer
+/// @param value the string
+void writeReportJsonString(ReportWriter* writer,
+                           const wchar_t* value)
+{
+    writeReportWide(writer,
+                    value,
+                    TRUE);
+}
+
+/// @brief writes a number in decimal
+/// @param writer the writer
+/// @param value the number
+void writeReportNumber(ReportWriter* writer,
+                       ULONGLONG value)
+{
+    // Digits come out backwards, so fill a scratch area from the end
+    char digits[REPORT_NUMBER_CHARS] = { 0 };
+    DWORD count = 0;
+    do
+    {
+        digits[REPORT_NUMBER_CHARS - ++count] = (char) ('0' + (value % 10));
+        value /= 10;
+    } while (value > 0);
+    char* destination = reserveReportBytes(writer,
+                                           count);
+    if (destination != NULL)
+    {
+        memcpy(destination,
+               digits + REPORT_NUMBER_CHARS - count,
+               count);
+    }
+}
+
+/// @brief writes ASCII text as it is
+/// @param writer the writer
+/// @param text the text
+void writeReportText(ReportWriter* writer,
+                     const char* text)
+{
+    for (size_t remaining = strlen(text); remaining > 0;)
+    {
+        DWORD chunk = (DWORD) min(remaining, sizeof(writer->buffer));
+        char* destination = reserveReportBytes(writer,
+                                               chunk);
+        if (destination == NULL)
+        {
+            return;
+        }
+        memcpy(destination,
+               text,
+               chunk);
+        text += chunk;
+        remaining -= chunk;
+    }
+}
+
+/// @brief writes a UTF-16 string as a quoted UTF-8 string
+/// @param writer the writer
+/// @param value the string
+/// @param json TRUE to escape it for JSON, FALSE for CSV
+static void writeReportWide(ReportWriter* writer,
+                            const wchar_t* value,
+                            BOOL json)
+{
+    writeReportCodePoint(writer,
+                         '"');
+    for (const wchar_t* character = value; *character != 0; character++)
+    {
+        DWORD codePoint = (WORD) *character;
+        if ((codePoint >= 0xD800) && (codePoint < 0xDC00) &&
+            (character[1] >= 0xDC00) && (character[1] < 0xE000))
+        {
+            codePoint = 0x10000 + ((codePoint - 0xD800) << 10) + ((WORD) character[1] - 0xDC00);
+            character++;
+        }
+        if (codePoint == '"')
+        {
+            writeReportText(writer,
+                            (json) ? "\\\"" : "\"\"");
+        }
+        else if (json && (codePoint == '\\'))
+        {
+            writeReportText(writer,
+                            "\\\\");
+        }
+        else if (json && (codePoint < 0x20))
+        {
+            char escape[7] = { '\\', 'u', '0', '0', "0123456789abcdef"[codePoint >> 4],
+                               "0123456789abcdef"[codePoint & 0xF], 0 };
+            writeReportText(writer,
+                            escape);
+        }
+        else
+        {
+            writeReportCodePoint(writer,
+                                 codePoint);
+        }
+    }
+    writeReportCodePoint(writer,
+                         '"');
+}
@@ -0,0 +1,36 @@
+#define _CRT_SECURE_NO_WARNINGS
+
+#pragma once
+#include <Windows.h>
+#include <stdio.h>
+#include <assert.h>
+
+// Report writer parameters. Reports over millions of items are written
+// through one fixed buffer that is filled with UTF-8 directly, numbers and
+// strings included, and handed to WriteFile() whenever it fills up. Nothing
+// is allocated and nothing goes through printf, so the writer costs the
+// same however large the report is.
+
+#define REPORT_WRITER_BYTES     16384
+#define REPORT_NUMBER_CHARS     20 // Digits in the largest ULONGLONG
+#define REPORT_UTF8_MAX_BYTES   4 // Longest UTF-8 sequence for one code point
+
+// Structs
+
+typedef struct ReportWriter
+{
+    HANDLE hOutput;
+    DWORD length; // Bytes waiting in buffer
+    BOOL failed; // A write failed, everything after it is dropped
+    char buffer[REPORT_WRITER_BYTES];
+} ReportWriter;
+
+// Functions
+
+BOOL flushReportWriter(ReportWriter* writer);
+void initReportWriter(ReportWriter* writer, HANDLE hOutput);
+void testReportWriter(void);
+void writeReportCsvField(ReportWriter* writer, const wchar_t* value);
+void writeReportJsonString(ReportWriter* writer, const wchar_t* value);
+void writeReportNumber(ReportWriter* writer, ULONGLONG value);
+void writeReportText(ReportWriter* writer, const char* text);
@@ -0,0 +1,720 @@
+/*
+* Timer wheel scheduler for running maintenance jobs at set times
+*
+* Copyright(C) 2024 ERROR_SUCCESS Software
+*
+* This program is free software : you can redistribute it and /or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.If not, see < https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#include "scheduler.h"
+#include "logger.h"
+
+static void armJob(Scheduler* scheduler, ScheduledJob* job, ULONGLONG now);
+static void cascadeWheelSlot(TimerWheel* wheel, DWORD level, DWORD index);
+static WheelTimer** getWheelSlot(TimerWheel* wheel, ULONGLONG expires);
+static ULONGLONG makeJitterSeed(void);
+static ULONGLONG nextRandom(Scheduler* scheduler);
+static void runJob(WheelTimer* timer, void* context);
+#ifndef NDEBUG
+static ULONGLONG fakeClock(void);
+static ULONGLONG fakeIdle(void);
+static BOOL countingTask(const wchar_t* name, void* context);
+static void recordTimer(WheelTimer* timer, void* context);
+static ULONGLONG fakeNow = 0;
+static ULONGLONG fakeIdleSeconds = 0;
+#endif
+
+#ifndef NDEBUG
+/// @brief the clock testScheduler() runs the scheduler on
+static ULONGLONG fakeClock(void)
+{
+    return fakeNow;
+}
+
+/// @brief the idle time testScheduler() runs the scheduler on
+static ULONGLONG fakeIdle(void)
+{
+    return fakeIdleSeconds;
+}
+
+/// @brief counts its runs in the DWORD it is given
+static BOOL countingTask(const wchar_t* name,
+                         void* context)
+{
+    UNREFERENCED_PARAMETER(name);
+    (*(DWORD*) context)++;
+    return TRUE;
+}
+
+/// @brief checks a timer fires on the tick it was due and counts it
+static void recordTimer(WheelTimer* timer,
+                        void* context)
+{
+    assert(timer->slot == NULL);
+    assert(timer->expires == fakeNow);
+    (*(DWORD*) context)++;
+}
+#endif
+
+/// @brief adds a job to a scheduler and works out when it first runs
+/// @param scheduler the scheduler
+/// @param name the name of the job, which is passed to the task
+/// @param kind how the job is scheduled
+/// @param seconds for SCHEDULE_DAILY the local time of day in seconds after
+/// midnight, for SCHEDULE_INTERVAL the seconds between runs, for
+/// SCHEDULE_IDLE how many seconds without input count as idle
+/// @param jitter the most seconds each run is pushed back by at random
+/// @param task the work to do
+/// @param context passed to the task
+/// @return TRUE if the job was added, FALSE if the scheduler is full or
+///         the schedule makes no sense
+BOOL addScheduledJob(Scheduler* scheduler,
+                     const wchar_t* name,
+                     ScheduleKind kind,
+                     ULONGLONG seconds,
+                     ULONGLONG jitter,
+                     ScheduledTask task,
+                     void* context)
+{
+    if ((scheduler->jobCount >= SCHEDULER_MAX_JOBS) ||
+        ((kind == SCHEDULE_DAILY) && (seconds >= SECONDS_PER_DAY)) ||
+        ((kind != SCHEDULE_DAILY) && (seconds == 0)) ||
+        (jitter >= WHEEL_RANGE))
+    {
+        return FALSE;
+    }
+    ScheduledJob* job = &scheduler->jobs[scheduler->jobCount++];
+    memset(job,
+           0,
+           sizeof(*job));
+    job->name = name;
+    job->kind = kind;
+    job->seconds = seconds;
+    job->jitter = jitter;
+    job->task = task;
+    job->context = context;
+    armJob(scheduler,
+           job,
+           scheduler->wheel.now);
+    return TRUE;
+}
+
+/// @brief puts a timer into the wheel. A timer that is already due fires
+/// on the next tick.
+/// @param wheel the wheel
+/// @param timer the timer, which must not be in a wheel already
+/// @param expires the tick the timer is due
+void addWheelTimer(TimerWheel* wheel,
+                   WheelTimer* timer,
+                   ULONGLONG expires)
+{
+    assert(timer->slot == NULL);
+    if (expires <= wheel->now)
+    {
+        expires = wheel->now + 1;
+    }
+    timer->expires = expires;
+    timer->slot = getWheelSlot(wheel,
+                               expires);
+    timer->previous = NULL;
+    timer->next = *timer->slot;
+    if (timer->next != NULL)
+    {
+        timer->next->previous = timer;
+    }
+    *timer->slot = timer;
+    wheel->count++;
+}
+
+/// @brief processes every tick up to and including now, firing each timer
+/// as its tick comes up
+/// @param wheel the wheel
+/// @param now the tick to advance to
+/// @param callback called for every timer that fires
+/// @param context passed to the callback
+void advanceTimerWheel(TimerWheel* wheel,
+                       ULONGLONG now,
+                       WheelCallback callback,
+                       void* context)
+{
+    while (wheel->now < now)
+    {
+        // Nothing can fire, so there is nothing to walk through
+        if (wheel->count == 0)
+        {
+            wheel->now = now;
+            break;
+        }
+
+        // Whenever a level turns over, the slot of the level above that
+        // has just come into range is spread out over the levels below
+        ULONGLONG tick = wheel->now + 1;
+        if ((tick & WHEEL_SLOT_MASK) == 0)
+        {
+            for (DWORD level = 1; level < WHEEL_LEVELS; level++)
+            {
+                DWORD index = (DWORD) (tick >> (WHEEL_SLOT_BITS * level)) & WHEEL_SLOT_MASK;
+                cascadeWheelSlot(wheel,
+                                 level,
+                                 index);
+                if (index != 0)
+                {
+                    break;
+                }
+            }
+        }
+
+        // Detach the slot before firing, so callbacks can add timers again
+        wheel->now = tick;
+        WheelTimer* timer = wheel->slots[0][tick & WHEEL_SLOT_MASK];
+        wheel->slots[0][tick & WHEEL_SLOT_MASK] = NULL;
+        while (timer != NULL)
+        {
+            WheelTimer* next = timer->next;
+            timer->next = NULL;
+            timer->previous = NULL;
+            timer->slot = NULL;
+            wheel->count--;
+            callback(timer,
+                     context);
+            timer = next;
+        }
+    }
+}
+
+/// @brief works out when a job next runs and puts it into the wheel
+/// @param scheduler the scheduler
+/// @param job the job, which must not be in the wheel
+/// @param now the time to work forward from
+static void armJob(Scheduler* scheduler,
+                   ScheduledJob* job,
+                   ULONGLONG now)
+{
+    ULONGLONG due = 0;
+    switch (job->kind)
+    {
+        case SCHEDULE_DAILY:
+        {
+            due = (now - (now % SECONDS_PER_DAY)) + job->seconds;
+            if (due <= now)
+            {
+                due += SECONDS_PER_DAY;
+            }
+            break;
+        }
+        case SCHEDULE_INTERVAL:
+        {
+            due = now + job->seconds;
+            break;
+        }
+        case SCHEDULE_IDLE:
+        {
+            // Input is not an event we can wait on, so idle jobs poll
+            due = now + SCHEDULER_IDLE_POLL;
+            break;
+        }
+    }
+
+    // Idle time is already different on every machine, so only the other
+    // kinds are jittered
+    if ((job->kind != SCHEDULE_IDLE) && (job->jitter > 0))
+    {
+        due += nextRandom(scheduler) % (job->jitter + 1);
+    }
+    addWheelTimer(&scheduler->wheel,
+                  &job->timer,
+                  due);
+}
+
+/// @brief takes every timer out of a slot and files it again, which puts
+/// it into a lower level now that it is closer
+/// @param wheel the wheel
+/// @param level the level of the slot
+/// @param index the slot within the level
+static void cascadeWheelSlot(TimerWheel* wheel,
+                             DWORD level,
+                             DWORD index)
+{
+    WheelTimer* timer = wheel->slots[level][index];
+    wheel->slots[level][index] = NULL;
+    while (timer != NULL)
+    {
+        WheelTimer* next = timer->next;
+        timer->slot = NULL;
+        wheel->count--;
+        addWheelTimer(wheel,
+                      timer,
+                      timer->expires);
+        timer = next;
+    }
+}
+
+/// @brief reads how long it has been since the user last used the mouse
+/// or keyboard in this session. This is the idle time a scheduler uses
+/// unless it is given another one.
+/// @param none
+/// @return seconds since the last input, 0 if it can't be told
+ULONGLONG getIdleSeconds(void)
+{
+    LASTINPUTINFO info = { sizeof(info) };
+    if (GetLastInputInfo(&info) == FALSE)
+    {
+        return 0;
+    }
+    return (ULONGLONG) (GetTickCount() - info.dwTime) / 1000;
+}
+
+/// @brief reads the local time in seconds since 1 January 1601. This is
+/// the clock a scheduler uses unless it is given another one.
+/// @param none
+/// @return the local time in seconds
+ULONGLONG getLocalClockSeconds(void)
+{
+    FILETIME utc = { 0 };
+    FILETIME local = { 0 };
+    GetSystemTimeAsFileTime(&utc);
+    FileTimeToLocalFileTime(&utc,
+                            &local);
+    return (((ULONGLONG) local.dwHighDateTime << 32) | local.dwLowDateTime) / 10000000ULL;
+}
+
+/// @brief works out how long until the earliest job is due, so a caller
+/// can sleep until then
+/// @param scheduler the scheduler
+/// @return seconds until the next job, 0 if one is due now, or
+///         SECONDS_PER_DAY if there are no jobs
+ULONGLONG getSecondsUntilNextJob(const Scheduler* scheduler)
+{
+    ULONGLONG now = scheduler->clock();
+    ULONGLONG wait = SECONDS_PER_DAY;
+    for (DWORD i = 0; i < scheduler->jobCount; i++)
+    {
+        ULONGLONG expires = scheduler->jobs[i].timer.expires;
+        if (expires <= now)
+        {
+            return 0;
+        }
+        if (expires - now < wait)
+        {
+            wait = expires - now;
+        }
+    }
+    return wait;
+}
+
+/// @brief finds the slot a timer belongs in. Timers further away than the
+/// wheel reaches are parked in the furthest slot of the top level, and
+/// filed again from there once it comes into range.
+/// @param wheel the wheel
+/// @param expires the tick the timer is due, after wheel->now
+/// @return the head of the list for the slot
+static WheelTimer** getWheelSlot(TimerWheel* wheel,
+                                 ULONGLONG expires)
+{
+    ULONGLONG next = wheel->now + 1;
+    if (expires - next >= WHEEL_RANGE)
+    {
+        expires = next + WHEEL_RANGE - 1;
+    }
+    ULONGLONG delta = expires - next;
+    DWORD level = 0;
+    while (delta >= (1ULL << (WHEEL_SLOT_BITS * (level + 1))))
+    {
+        level++;
+    }
+    DWORD index = (DWORD) (expires >> (WHEEL_SLOT_BITS * level)) & WHEEL_SLOT_MASK;
+    return &wheel->slots[level][index];
+}
+
+/// @brief sets up a scheduler with no jobs
+/// @param scheduler the scheduler
+/// @param clock the clock to use, NULL for getLocalClockSeconds()
+/// @param idle the idle time to use, NULL for getIdleSeconds()
+/// @param seed seeds the jitter, 0 to pick one that is different on every
+/// machine and every run
+void initScheduler(Scheduler* scheduler,
+                   SchedulerClock clock,
+                   SchedulerIdle idle,
+                   ULONGLONG seed)
+{
+    memset(scheduler,
+           0,
+           sizeof(*scheduler));
+    scheduler->clock = (clock != NULL) ? clock : getLocalClockSeconds;
+    scheduler->idle = (idle != NULL) ? idle : getIdleSeconds;
+    scheduler->random = (seed != 0) ? seed : makeJitterSeed();
+    if (scheduler->random == 0) // Xorshift never leaves 0
+    {
+        scheduler->random = 0x9E3779B97F4A7C15ULL;
+    }
+    initTimerWheel(&scheduler->wheel,
+                   scheduler->clock());
+}
+
+/// @brief sets up an empty timer wheel
+/// @param wheel the wheel
+/// @param now the current tick
+void initTimerWheel(TimerWheel* wheel,
+                    ULONGLONG now)
+{
+    memset(wheel,
+           0,
+           sizeof(*wheel));
+    wheel->now = now;
+}
+
+/// @brief makes a jitter seed from the computer name, so machines that
+/// start at the same moment still spread out, and from the time and
+/// process so restarts don't repeat the same offsets
+/// @param none
+/// @return the seed
+static ULONGLONG makeJitterSeed(void)
+{
+    ULONGLONG hash = 0xCBF29CE484222325ULL; // FNV-1a
+    wchar_t computerName[MAX_COMPUTERNAME_LENGTH + 1] = { 0 };
+    DWORD cchComputerName = ARRAYSIZE(computerName);
+    if (GetComputerNameW(computerName,
+                         &cchComputerName))
+    {
+        for (DWORD i = 0; i < cchComputerName; i++)
+        {
+            hash = (hash ^ computerName[i]) * 0x100000001B3ULL;
+        }
+    }
+    return hash ^
+        (GetTickCount64() * 0x9E3779B97F4A7C15ULL) ^
+        ((ULONGLONG) GetCurrentProcessId() << 32);
+}
+
+/// @brief steps the scheduler's xorshift generator
+/// @param scheduler the scheduler
+/// @return the next random number
+static ULONGLONG nextRandom(Scheduler* scheduler)
+{
+    ULONGLONG x = scheduler->random;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    scheduler->random = x;
+    return x;
+}
+
+/// @brief takes a timer out of the wheel before it fires. Does nothing if
+/// the timer is not in the wheel.
+/// @param wheel the wheel
+/// @param timer the timer
+void removeWheelTimer(TimerWheel* wheel,
+                      WheelTimer* timer)
+{
+    if (timer->slot == NULL)
+    {
+        return;
+    }
+    if (timer->previous != NULL)
+    {
+        timer->previous->next = timer->next;
+    }
+    else
+    {
+        *timer->slot = timer->next;
+    }
+    if (timer->next != NULL)
+    {
+        timer->next->previous = timer->previous;
+    }
+    timer->next = NULL;
+    timer->previous = NULL;
+    timer->slot = NULL;
+    wheel->count--;
+}
+
+/// @brief runs every job that has come due since the last call. Runs that
+/// were missed while the machine was asleep are made up once, not once
+/// for every one that was missed.
+/// @param scheduler the scheduler
+/// @return the number of jobs that ran
+DWORD runDueJobs(Scheduler* scheduler)
+{
+    DWORD before = 0;
+    for (DWORD i = 0; i < scheduler->jobCount; i++)
+    {
+        before += scheduler->jobs[i].runs + scheduler->jobs[i].failures;
+    }
+
+    // The wheel can only move forwards. If the clock was set back, start
+    // the wheel again from the new time and work every job out afresh.
+    ULONGLONG now = scheduler->clock();
+    if (now < scheduler->wheel.now)
+    {
+        LOG(L"The clock went back %llu seconds, rescheduling\n",
+            scheduler->wheel.now - now);
+        initTimerWheel(&scheduler->wheel,
+                       now);
+        for (DWORD i = 0; i < scheduler->jobCount; i++)
+        {
+            scheduler->jobs[i].timer.slot = NULL;
+            armJob(scheduler,
+                   &scheduler->jobs[i],
+                   now);
+        }
+    }
+    advanceTimerWheel(&scheduler->wheel,
+                      now,
+                      runJob,
+                      scheduler);
+
+    DWORD after = 0;
+    for (DWORD i = 0; i < scheduler->jobCount; i++)
+    {
+        after += scheduler->jobs[i].runs + scheduler->jobs[i].failures;
+    }
+    return after - before;
+}
+
+/// @brief fires a job whose timer has come up and schedules its next run
+/// @param timer the job's timer
+/// @param context the scheduler
+static void runJob(WheelTimer* timer,
+                   void* context)
+{
+    Scheduler* scheduler = context;
+    ScheduledJob* job = (ScheduledJob*) timer;
+    BOOL run = TRUE;
+    if (job->kind == SCHEDULE_IDLE)
+    {
+        // Run once when the machine goes idle, then wait for it to be
+        // used again before running another time
+        if (scheduler->idle() < job->seconds)
+        {
+            job->idleRan = FALSE;
+            run = FALSE;
+        }
+        else
+        {
+            run = (job->idleRan == FALSE);
+            job->idleRan = TRUE;
+        }
+    }
+    if (run)
+    {
+        LOG(L"Running scheduled job %s\n",
+            job->name);
+        if (job->task(job->name,
+                      job->context))
+        {
+            job->runs++;
+        }
+        else
+        {
+            job->failures++;
+            LOG(L"Scheduled job %s failed\n",
+                job->name);
+        }
+    }
+
+    // Work forward from the clock rather than the tick the job was due, so
+    // runs missed while asleep are made up once and a long run isn't
+    // followed straight away by another
+    armJob(scheduler,
+           job,
+           scheduler->clock());
+}
+
+/// @brief tests the timer wheel and the scheduler on a fake clock
+/// @param none
+void testScheduler(void)
+{
+#ifndef NDEBUG
+    // Timers in every level, and beyond the top, fire on their own tick
+    TimerWheel wheel = { 0 };
+    fakeNow = 5;
+    initTimerWheel(&wheel,
+                   fakeNow);
+    ULONGLONG expiries[] = { 1, 6, 63, 64, 65, 4095, 4096, 4161, 300000,
+                             WHEEL_RANGE + 77 };
+    WheelTimer timers[ARRAYSIZE(expiries)] = { 0 };
+    for (DWORD i = 0; i < ARRAYSIZE(expiries); i++)
+    {
+        addWheelTimer(&wheel,
+                      &timers[i],
+                      expiries[i]);
+    }
+    assert(timers[0].expires == 6); // Already due, so it fires next tick
+    WheelTimer cancelled = { 0 };
+    addWheelTimer(&wheel,
+                  &cancelled,
+                  100);
+    removeWheelTimer(&wheel,
+                     &cancelled);
+    assert(wheel.count == ARRAYSIZE(expiries));
+    DWORD fired = 0;
+    for (DWORD i = 0; i < ARRAYSIZE(expiries); i++)
+    {
+        // Step up to each expiry a tick at a time near the end, so an early
+        // or late firing is caught by recordTimer()
+        ULONGLONG target = timers[i].expires;
+        while (fakeNow < target)
+        {
+            fakeNow = (target - fakeNow > 3) ? target - 3 : fakeNow + 1;
+            advanceTimerWheel(&wheel,
+                              fakeNow,
+                              recordTimer,
+                              &fired);
+        }
+        assert(timers[i].slot == NULL);
+    }
+    assert((fired == ARRAYSIZE(expiries)) && (wheel.count == 0));
+
+    // A daily job runs at its time each day, and only once
+    Scheduler scheduler = { 0 };
+    DWORD runs = 0;
+    fakeNow = (10 * SECONDS_PER_DAY) + 3600;
+    initScheduler(&scheduler,
+                  fakeClock,
+                  fakeIdle,
+                  1);
+    addScheduledJob(&scheduler,
+                    L"daily",
+                    SCHEDULE_DAILY,
+                    7200,
+                    0,
+                    countingTask,
+                    &runs);
+    fakeNow += 3599;
+    assert(runDueJobs(&scheduler) == 0);
+    assert(getSecondsUntilNextJob(&scheduler) == 1);
+    fakeNow += 1;
+    assert((runDueJobs(&scheduler) == 1) && (runs == 1));
+    fakeNow += 1800;
+    assert(runDueJobs(&scheduler) == 0);
+    fakeNow += SECONDS_PER_DAY;
+    assert((runDueJobs(&scheduler) == 1) && (runs == 2));
+
+    // Three days asleep only make up one run
+    fakeNow += 3 * SECONDS_PER_DAY;
+    assert((runDueJobs(&scheduler) == 1) && (runs == 3));
+
+    // Setting the clock back a day runs the job again at the next 02:00
+    fakeNow -= SECONDS_PER_DAY;
+    assert(runDueJobs(&scheduler) == 0);
+    fakeNow += SECONDS_PER_DAY - (fakeNow % SECONDS_PER_DAY) + 7200;
+    assert((runDueJobs(&scheduler) == 1) && (runs == 4));
+
+    // Jitter keeps each run inside its window, and varies between days
+    runs = 0;
+    fakeNow = 20 * SECONDS_PER_DAY;
+    initScheduler(&scheduler,
+                  fakeClock,
+                  fakeIdle,
+                  12345);
+    addScheduledJob(&scheduler,
+                    L"jittered",
+                    SCHEDULE_DAILY,
+                    7200,
+                    600,
+                    countingTask,
+                    &runs);
+    ULONGLONG firstOffset = 0;
+    BOOL varied = FALSE;
+    for (DWORD day = 0; day < 5; day++)
+    {
+        DWORD before = runs;
+        for (DWORD second = 0; second < SECONDS_PER_DAY; second += 10)
+        {
+            fakeNow = ((20 + day) * SECONDS_PER_DAY) + second;
+            if (runDueJobs(&scheduler) > 0)
+            {
+                assert((second >= 7200) && (second <= 7810));
+                if (day == 0)
+                {
+                    firstOffset = second;
+                }
+                varied |= (firstOffset != second);
+            }
+        }
+        assert(runs == before + 1);
+    }
+    assert(varied);
+
+    // An interval job runs every so often
+    runs = 0;
+    fakeNow = 1000;
+    initScheduler(&scheduler,
+                  fakeClock,
+                  fakeIdle,
+                  1);
+    addScheduledJob(&scheduler,
+                    L"interval",
+                    SCHEDULE_INTERVAL,
+                    90,
+                    0,
+                    countingTask,
+                    &runs);
+    for (DWORD i = 0; i < 30; i++)
+    {
+        fakeNow += 30;
+        runDueJobs(&scheduler);
+    }
+    assert(runs == 10);
+
+    // An idle job runs once per idle period
+    runs = 0;
+    fakeIdleSeconds = 0;
+    initScheduler(&scheduler,
+                  fakeClock,
+                  fakeIdle,
+                  1);
+    addScheduledJob(&scheduler,
+                    L"idle",
+                    SCHEDULE_IDLE,
+                    600,
+                    0,
+                    countingTask,
+                    &runs);
+    fakeNow += 10 * SCHEDULER_IDLE_POLL;
+    runDueJobs(&scheduler);
+    assert(runs == 0);
+    fakeIdleSeconds = 700;
+    for (DWORD i = 0; i < 10; i++)
+    {
+        fakeNow += SCHEDULER_IDLE_POLL;
+        runDueJobs(&scheduler);
+    }
+    assert(runs == 1);
+    fakeIdleSeconds = 0;
+    fakeNow += SCHEDULER_IDLE_POLL;
+    runDueJobs(&scheduler);
+    fakeIdleSeconds = 700;
+    fakeNow += SCHEDULER_IDLE_POLL;
+    runDueJobs(&scheduler);
+    assert(runs == 2);
+
+    // Schedules that make no sense are turned away
+    assert(addScheduledJob(&scheduler,
+                           L"bad",
+                           SCHEDULE_DAILY,
+                           SECONDS_PER_DAY,
+                           0,
+                           countingTask,
+                           &runs) == FALSE);
+    assert(addScheduledJob(&scheduler,
+                           L"bad",
+                           SCHEDULE_INTERVAL,
+                           0,
+                           0,
+                           countingTask,
+                           &runs) == FALSE);
+#endif
+}
@@ -0,0 +1,105 @@
+#define _CRT_SECURE_NO_WARNINGS
+
+#pragma once
+#include <Windows.h>
+#include <stdio.h>
+#include <assert.h>
+
+// Scheduler parameters. Pending runs are kept in a hierarchical timer wheel
+// with a one second tick. Level 0 has one slot per second, and every level
+// above it has slots 64 times wider than the level below. A timer is filed
+// in the lowest level whose range reaches it and drops a level each time
+// the level above turns over, so adding, cancelling and firing a timer are
+// constant time no matter how far away it is. Runs can be pushed back by a
+// random jitter so that many machines sharing a schedule don't all hit the
+// same storage at the same second.
+
+#define WHEEL_SLOT_BITS         6
+#define WHEEL_SLOTS             (1 << WHEEL_SLOT_BITS)
+#define WHEEL_SLOT_MASK         (WHEEL_SLOTS - 1)
+#define WHEEL_LEVELS            4 // 64^4 seconds is a little over six months
+#define WHEEL_RANGE             (1ULL << (WHEEL_SLOT_BITS * WHEEL_LEVELS))
+#define SCHEDULER_MAX_JOBS      8
+#define SCHEDULER_IDLE_POLL     30 // Seconds between checks of an idle job
+#define SECONDS_PER_DAY         86400ULL
+
+// Structs
+
+typedef enum ScheduleKind
+{
+    SCHEDULE_DAILY, // Every day at a local time
+    SCHEDULE_INTERVAL, // Every so many seconds
+    SCHEDULE_IDLE, // Once each time there has been no input for a while
+} ScheduleKind;
+
+typedef struct WheelTimer
+{
+    struct WheelTimer* next;
+    struct WheelTimer* previous;
+    struct WheelTimer** slot; // Head of the list the timer is on, NULL if it is not in the wheel
+    ULONGLONG expires; // Tick the timer is due
+} WheelTimer;
+
+typedef struct TimerWheel
+{
+    ULONGLONG now; // Last tick that was processed
+    DWORD count; // Timers in the wheel
+    WheelTimer* slots[WHEEL_LEVELS][WHEEL_SLOTS];
+} TimerWheel;
+
+/// @brief called for every timer that expires while the wheel advances.
+/// The timer is out of the wheel by then and can be added again.
+typedef void (*WheelCallback)(WheelTimer* timer, void* context);
+
+/// @brief returns the local wall clock time in seconds from any fixed point
+/// that falls on a midnight
+typedef ULONGLONG (*SchedulerClock)(void);
+
+/// @brief returns how many seconds it has been since the last user input
+typedef ULONGLONG (*SchedulerIdle)(void);
+
+/// @brief the work behind a scheduled job
+/// @return TRUE if the job succeeded, FALSE if not
+typedef BOOL (*ScheduledTask)(const wchar_t* name, void* context);
+
+typedef struct ScheduledJob
+{
+    WheelTimer timer; // Must come first, a fired timer is cast back to its job
+    const wchar_t* name;
+    ScheduleKind kind;
+    ULONGLONG seconds; // Time after midnight, interval or idle time, depending on kind
+    ULONGLONG jitter; // Most seconds a run is pushed back by at random
+    ScheduledTask task;
+    void* context;
+    BOOL idleRan; // SCHEDULE_IDLE only, already ran in this idle period
+    DWORD runs;
+    DWORD failures;
+} ScheduledJob;
+
+typedef struct Scheduler
+{
+    TimerWheel wheel;
+    ScheduledJob jobs[SCHEDULER_MAX_JOBS];
+    DWORD jobCount;
+    SchedulerClock clock;
+    SchedulerIdle idle;
+    ULONGLONG random; // Xorshift state for the jitter
+} Scheduler;
+
+// Functions
+
+BOOL addScheduledJob(Scheduler* scheduler, const wchar_t* name, ScheduleKind kind,
+                     ULONGLONG seconds, ULONGLONG jitter, ScheduledTask task,
+                     void* context);
+void addWheelTimer(TimerWheel* wheel, WheelTimer* timer, ULONGLONG expires);
+void advanceTimerWheel(TimerWheel* wheel, ULONGLONG now, WheelCallback callback,
+                       void* context);
+ULONGLONG getIdleSeconds(void);
+ULONGLONG getLocalClockSeconds(void);
+ULONGLONG getSecondsUntilNextJob(const Scheduler* scheduler);
+void initScheduler(Scheduler* scheduler, SchedulerClock clock, SchedulerIdle idle,
+                   ULONGLONG seed);
+void initTimerWheel(TimerWheel* wheel, ULONGLONG now);
+void removeWheelTimer(TimerWheel* wheel, WheelTimer* timer);
+DWORD runDueJobs(Scheduler* scheduler);
+void testScheduler(void);
@@ -0,0 +1,1109 @@
+/*
+* Securely erase the bin by overwriting files before deleting them
+*
+* Copyright(C) 2024 ERROR_SUCCESS Software
+*
+* This program is free software : you can redistribute it and /or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.If not, see < https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#include "secure.h"
+#include "audit.h"
+#include "bin.h"
+#include "ini.h"
+#include "parallel.h"
+#include "reclaim.h"
+#include "throttle.h"
+#include "logger.h"
+
+#define SECURE_PASS_ITEM    0 // Everything inside a folder item
+#define SECURE_PASS_CONTENT 1 // The top of a bin folder, all but the $I files
+#define SECURE_PASS_INFO    2 // The $I files at the top of a bin folder
+
+typedef struct SecureWalk
+{
+    SecureEraser* eraser;
+    DWORD pass; // One of the SECURE_PASS_ values
+} SecureWalk;
+
+static void clearReadOnly(HANDLE hItem, DWORD attributes);
+static BOOL eraseChild(HANDLE hDirectory, const DirEntry* entry, void* context);
+static BOOL eraseOpenFolder(SecureEraser* eraser, HANDLE hFolder);
+static void eraseSecureFile(DWORD index, void* context);
+static BOOL isZeroFile(const wchar_t* path, ULONGLONG bytes, BYTE* buffer);
+static BOOL overwriteBuffered(SecureEraser* eraser, HANDLE hFile, ULONGLONG size);
+static BOOL overwriteUnbuffered(SecureEraser* eraser, HANDLE hFile, ULONGLONG size);
+static BOOL queueSecureFile(SecureEraser* eraser, HANDLE hFile, ULONGLONG size);
+static BOOL writeSecureFile(const wchar_t* path, const BYTE* contents, ULONGLONG bytes);
+
+/// @brief creates the same synthetic files in two folders, erases one and
+/// deletes the other, and checks a file erased without deleting it
+/// @param folder where to create the files, which are removed afterwards
+/// @param megabytes how much to create in each folder
+/// @param threads the most files erased at once
+/// @param result receives the throughput
+/// @return TRUE if the benchmark ran, FALSE if the files could not be
+///         created or erased
+BOOL benchmarkSecureErase(const wchar_t* folder,
+                          DWORD megabytes,
+                          DWORD threads,
+                          SecureBenchmark* result)
+{
+    memset(result,
+           0,
+           sizeof(SecureBenchmark));
+    wchar_t root[MAX_PATH + 1] = { 0 };
+    wchar_t eraseDirectory[MAX_PATH + 1] = { 0 };
+    wchar_t deleteDirectory[MAX_PATH + 1] = { 0 };
+    wchar_t checkPath[MAX_PATH + 1] = { 0 };
+    _snwprintf(root,
+               ARRAYSIZE(root),
+               L"%s\\rbmsecure%08X",
+               folder,
+               GetCurrentProcessId());
+    root[MAX_PATH] = 0;
+    _snwprintf(eraseDirectory,
+               ARRAYSIZE(eraseDirectory),
+               L"%s\\erase",
+               root);
+    eraseDirectory[MAX_PATH] = 0;
+    _snwprintf(deleteDirectory,
+               ARRAYSIZE(deleteDirectory),
+               L"%s\\delete",
+               root);
+    deleteDirectory[MAX_PATH] = 0;
+    _snwprintf(checkPath,
+               ARRAYSIZE(checkPath),
+               L"%s\\check.dat",
+               root);
+    checkPath[MAX_PATH] = 0;
+    deleteTree(root,
+               NULL);
+
+    BYTE* contents = HeapAlloc(GetProcessHeap(),
+                               0,
+                               SECURE_BUFFER_BYTES);
+    SecureEraser* eraser = HeapAlloc(GetProcessHeap(),
+                                     0,
+                                     sizeof(SecureEraser));
+    BOOL success = (contents != NULL) && (eraser != NULL) &&
+        CreateDirectoryW(root, NULL) &&
+        CreateDirectoryW(eraseDirectory, NULL) &&
+        CreateDirectoryW(deleteDirectory, NULL);
+    if (contents != NULL)
+    {
+        memset(contents,
+               0xA5,
+               SECURE_BUFFER_BYTES);
+    }
+
+    // Sizes run from a few bytes up to SECURE_BENCH_FILE_MB and are rarely
+    // a whole number of sectors, so the last write of most files is rounded
+    ULONGLONG target = (ULONGLONG) megabytes * 1048576;
+    for (DWORD i = 0; success && (result->bytes < target); i++)
+    {
+        wchar_t erasePath[MAX_PATH + 1] = { 0 };
+        wchar_t deletePath[MAX_PATH + 1] = { 0 };
+        _snwprintf(erasePath,
+                   ARRAYSIZE(erasePath),
+                   L"%s\\%06u.dat",
+                   eraseDirectory,
+                   i);
+        _snwprintf(deletePath,
+                   ARRAYSIZE(deletePath),
+                   L"%s\\%06u.dat",
+                   deleteDirectory,
+                   i);
+        ULONGLONG bytes = (((ULONGLONG) i * 2654435761ULL) % ((ULONGLONG) SECURE_BENCH_FILE_MB * 1048576)) + 1;
+        success = writeSecureFile(erasePath, contents, bytes) &&
+            writeSecureFile(deletePath, contents, bytes);
+        result->files++;
+        result->bytes += bytes;
+    }
+
+    // One file is erased and kept, so the overwrite itself can be checked
+    ULONGLONG checkBytes = ((ULONGLONG) SECURE_BENCH_FILE_MB * 1048576) / 3;
+    if (success)
+    {
+        success = writeSecureFile(checkPath,
+                                  contents,
+                                  checkBytes) &&
+            openSecureEraser(eraser,
+                             threads);
+        if (success)
+        {
+            eraser->keepFiles = TRUE;
+            success = secureEraseTree(eraser,
+                                      checkPath);
+            success = closeSecureEraser(eraser) && success;
+        }
+        result->verified = success &&
+            isZeroFile(checkPath,
+                       checkBytes,
+                       contents);
+    }
+
+    LARGE_INTEGER frequency = { 0 };
+    LARGE_INTEGER start = { 0 };
+    LARGE_INTEGER end = { 0 };
+    QueryPerformanceFrequency(&frequency);
+    if (success)
+    {
+        QueryPerformanceCounter(&start);
+        success = openSecureEraser(eraser,
+                                   threads);
+        if (success)
+        {
+            success = secureEraseTree(eraser,
+                                      eraseDirectory);
+            success = closeSecureEraser(eraser) && success;
+        }
+        QueryPerformanceCounter(&end);
+        result->eraseSeconds = (double) (end.QuadPart - start.QuadPart) / (double) frequency.QuadPart;
+        result->verified = result->verified &&
+            (eraser->files == result->files) &&
+            (eraser->bytes == result->bytes) &&
+            (GetFileAttributesW(eraseDirectory) == INVALID_FILE_ATTRIBUTES);
+    }
+    if (success)
+    {
+        QueryPerformanceCounter(&start);
+        success = deleteTree(deleteDirectory,
+                             NULL);
+        QueryPerformanceCounter(&end);
+        result->deleteSeconds = (double) (end.QuadPart - start.QuadPart) / (double) frequency.QuadPart;
+    }
+
+    if (contents != NULL)
+    {
+        HeapFree(GetProcessHeap(),
+                 0,
+                 contents);
+    }
+    if (eraser != NULL)
+    {
+        HeapFree(GetProcessHeap(),
+                 0,
+                 eraser);
+    }
+    deleteTree(root,
+               NULL);
+    return success;
+}
+
+/// @brief clears the read only attribute of an open file or folder, which
+/// would keep it from being written or deleted
+/// @param hItem the item, opened with FILE_WRITE_ATTRIBUTES access
+/// @param attributes its attributes
+static void clearReadOnly(HANDLE hItem,
+                          DWORD attributes)
+{
+    if ((attributes & FILE_ATTRIBUTE_READONLY) == 0)
+    {
+        return;
+    }
+    // Zero times are left as they are, and so are zero attributes
+    FILE_BASIC_INFO basicInfo = { 0 };
+    basicInfo.FileAttributes = attributes & ~FILE_ATTRIBUTE_READONLY;
+    if (basicInfo.FileAttributes == 0)
+    {
+        basicInfo.FileAttributes = FILE_ATTRIBUTE_NORMAL;
+    }
+    SetFileInformationByHandle(hItem,
+                               FileBasicInfo,
+                               &basicInfo,
+                               sizeof(basicInfo));
+}
+
+/// @brief erases whatever is left in the batch and frees the eraser's
+/// buffer. The counts stay readable.
+/// @param eraser the eraser
+/// @return TRUE if the last batch was erased in full
+BOOL closeSecureEraser(SecureEraser* eraser)
+{
+    BOOL result = flushSecureEraser(eraser);
+    if (eraser->zeros != NULL)
+    {
+        VirtualFree(eraser->zeros,
+                    0,
+                    MEM_RELEASE);
+        eraser->zeros = NULL;
+    }
+    return result;
+}
+
+/// @brief erases one entry of a folder that is being erased. Files with
+/// something in them are queued, everything else is dealt with here.
+/// @param hDirectory the folder
+/// @param entry the entry
+/// @param context the SecureWalk
+/// @return TRUE to keep listing
+static BOOL eraseChild(HANDLE hDirectory,
+                       const DirEntry* entry,
+                       void* context)
+{
+    SecureWalk* walk = (SecureWalk*) context;
+    SecureEraser* eraser = walk->eraser;
+    if ((eraser->cancel != NULL) &&
+        (*eraser->cancel != 0))
+    {
+        return FALSE;
+    }
+    if (((entry->nameLength == 1) && (entry->name[0] == L'.')) ||
+        ((entry->nameLength == 2) && (entry->name[0] == L'.') && (entry->name[1] == L'.')))
+    {
+        return TRUE;
+    }
+
+    // At the top of a bin folder, the shell's desktop.ini and our own
+    // staging folders stay, and each $I waits until its $R has gone
+    if (walk->pass != SECURE_PASS_ITEM)
+    {
+        size_t ownLength = ARRAYSIZE(RECLAIM_OWN_PATTERN) - 2; // Without the * and the terminator
+        if (((entry->nameLength == ARRAYSIZE(RECLAIM_DESKTOP_INI) - 1) &&
+             (_wcsnicmp(entry->name, RECLAIM_DESKTOP_INI, entry->nameLength) == 0)) ||
+            ((entry->nameLength >= ownLength) &&
+             (_wcsnicmp(entry->name, RECLAIM_OWN_PATTERN, ownLength) == 0)))
+        {
+            return TRUE;
+        }
+        BOOL isInfo = (entry->nameLength > 2) &&
+            (_wcsnicmp(entry->name, BIN_INFO_PREFIX, 2) == 0);
+        if (isInfo != (walk->pass == SECURE_PASS_INFO))
+        {
+            return TRUE;
+        }
+        if (isInfo && (entry->nameLength <= MAX_PATH))
+        {
+            wchar_t contentName[MAX_PATH + 1] = { 0 };
+            memcpy(contentName,
+                   entry->name,
+                   entry->nameLength * sizeof(wchar_t));
+            contentName[1] = BIN_CONTENT_PREFIX[1];
+            DirEntry content = *entry;
+            content.name = contentName;
+            HANDLE hContent = openTreeChild(hDirectory,
+                                            &content,
+                                            FILE_READ_ATTRIBUTES);
+            if (hContent != INVALID_HANDLE_VALUE)
+            {
+                CloseHandle(hContent);
+                return TRUE;
+            }
+
+            // A $R that is there but can't be opened is not gone
+            DWORD error = GetLastError();
+            if ((error != ERROR_FILE_NOT_FOUND) && (error != ERROR_PATH_NOT_FOUND))
+            {
+                eraser->failed++;
+                return TRUE;
+            }
+        }
+    }
+
+    if ((entry->attributes & FILE_ATTRIBUTE_DIRECTORY) &&
+        ((entry->attributes & FILE_ATTRIBUTE_REPARSE_POINT) == 0))
+    {
+        HANDLE hFolder = openTreeChild(hDirectory,
+                                       entry,
+                                       DIRTREE_DELETE_ACCESS);
+        if (hFolder == INVALID_HANDLE_VALUE)
+        {
+            eraser->failed++;
+            return TRUE;
+        }
+        eraseOpenFolder(eraser,
+                        hFolder);
+        return TRUE;
+    }
+
+    // Junctions and symbolic links are removed without following them, and
+    // there is nothing to overwrite in an empty file
+    BOOL overwrite = ((entry->attributes & FILE_ATTRIBUTE_REPARSE_POINT) == 0) &&
+        (entry->size > 0);
+    if ((overwrite == FALSE) ||
+        (entry->attributes & FILE_ATTRIBUTE_READONLY))
+    {
+        HANDLE hItem = openTreeChild(hDirectory,
+                                     entry,
+                                     DIRTREE_DELETE_ACCESS);
+        if (hItem == INVALID_HANDLE_VALUE)
+        {
+            eraser->failed++;
+            return TRUE;
+        }
+        clearReadOnly(hItem,
+                      entry->attributes);
+        if (overwrite || eraser->keepFiles)
+        {
+            CloseHandle(hItem);
+        }
+        else if (throttledDeleteHandle(NULL, hItem, 0) == FALSE)
+        {
+            eraser->failed++;
+            return TRUE;
+        }
+        if (overwrite == FALSE)
+        {
+            eraser->files++;
+            return TRUE;
+        }
+    }
+    HANDLE hFile = openTreeChild(hDirectory,
+                                 entry,
+                                 SECURE_FILE_ACCESS);
+    if (hFile == INVALID_HANDLE_VALUE)
+    {
+        eraser->failed++;
+        return TRUE;
+    }
+    queueSecureFile(eraser,
+                    hFile,
+                    entry->size);
+    return TRUE;
+}
+
+/// @brief erases everything in an open folder, then deletes the folder
+/// once the files queued from it are gone, and closes it
+/// @param eraser the eraser
+/// @param hFolder the folder, opened with DIRTREE_DELETE_ACCESS
+/// @return TRUE if the folder and everything in it was erased
+static BOOL eraseOpenFolder(SecureEraser* eraser,
+                            HANDLE hFolder)
+{
+    ULONGLONG failed = eraser->failed;
+    BY_HANDLE_FILE_INFORMATION info = { 0 };
+    if (GetFileInformationByHandle(hFolder,
+                                   &info))
+    {
+        clearReadOnly(hFolder,
+                      info.dwFileAttributes);
+    }
+    SecureWalk walk = { eraser, SECURE_PASS_ITEM };
+    if (listOpenDirectory(hFolder,
+                          eraseChild,
+                          &walk) == FALSE)
+    {
+        eraser->failed++;
+    }
+    flushSecureEraser(eraser);
+    if ((eraser->keepFiles) ||
+        (eraser->failed != failed))
+    {
+        // A folder with something left in it can't be deleted anyway
+        CloseHandle(hFolder);
+    }
+    else if (throttledDeleteHandle(NULL, hFolder, 0) == FALSE)
+    {
+        eraser->failed++;
+    }
+    return (eraser->failed == failed);
+}
+
+/// @brief overwrites one file of the batch and deletes it, from any thread
+/// @param index the file in the batch
+/// @param context the SecureEraser
+static void eraseSecureFile(DWORD index,
+                            void* context)
+{
+    SecureEraser* eraser = (SecureEraser*) context;
+    SecureFile* file = &eraser->batch[index];
+
+    // Zeroing a file that is hard linked from outside the bin would destroy
+    // it under every other name, so only this link is deleted
+    BY_HANDLE_FILE_INFORMATION info = { 0 };
+    if (GetFileInformationByHandle(file->hFile,
+                                   &info) == FALSE)
+    {
+        CloseHandle(file->hFile);
+        file->hFile = INVALID_HANDLE_VALUE;
+        return;
+    }
+    if (info.nNumberOfLinks > 1)
+    {
+        file->linked = TRUE;
+        if (eraser->keepFiles)
+        {
+            CloseHandle(file->hFile);
+            file->erased = TRUE;
+        }
+        else
+        {
+            file->erased = throttledDeleteHandle(NULL,
+                                                 file->hFile,
+                                                 0);
+        }
+        file->hFile = INVALID_HANDLE_VALUE;
+        return;
+    }
+
+    // A second handle to the same file, unbuffered and overlapped, so the
+    // zeros go straight to its clusters with several writes in flight
+    BOOL overwritten = FALSE;
+    HANDLE hUnbuffered = ReOpenFile(file->hFile,
+                                    SECURE_FILE_ACCESS,
+                                    FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                                    FILE_FLAG_NO_BUFFERING | FILE_FLAG_WRITE_THROUGH |
+                                    FILE_FLAG_OVERLAPPED);
+    if (hUnbuffered != INVALID_HANDLE_VALUE)
+    {
+        overwritten = overwriteUnbuffered(eraser,
+                                          hUnbuffered,
+                                          file->size);
+        CloseHandle(hUnbuffered);
+    }
+    if (overwritten == FALSE)
+    {
+        overwritten = overwriteBuffered(eraser,
+                                        file->hFile,
+                                        file->size);
+    }
+
+    if (overwritten == FALSE)
+    {
+        CloseHandle(file->hFile);
+    }
+    else if (eraser->keepFiles)
+    {
+        CloseHandle(file->hFile);
+        file->erased = TRUE;
+    }
+    else
+    {
+        file->erased = throttledDeleteHandle(NULL,
+                                             file->hFile,
+                                             file->size);
+    }
+    file->hFile = INVALID_HANDLE_VALUE;
+}
+
+/// @brief erases the files in the batch in parallel and adds them up
+/// @param eraser the eraser
+/// @return TRUE if every file in the batch was erased
+BOOL flushSecureEraser(SecureEraser* eraser)
+{
+    if (eraser->batchCount == 0)
+    {
+        return TRUE;
+    }
+    parallelFor(eraser->batchCount,
+                eraser->threads,
+                eraseSecureFile,
+                eraser);
+    BOOL result = TRUE;
+    for (DWORD i = 0; i < eraser->batchCount; i++)
+    {
+        if (eraser->batch[i].erased)
+        {
+            eraser->files++;
+            eraser->bytes += (eraser->batch[i].linked) ? 0 : eraser->batch[i].size;
+        }
+        else
+        {
+            eraser->failed++;
+            result = FALSE;
+        }
+    }
+    eraser->batchCount = 0;
+    return result;
+}
+
+/// @brief checks if secure erase is turned on in Settings.ini
+/// @param none
+/// @return TRUE if a scheduled empty should erase the bin
+BOOL isSecureEmptyEnabled(void)
+{
+    return (getIniInt(INI_KEY_SECURE_EMPTY,
+                      INI_DEFAULT_VALUE_SECURE_EMPTY) > 0);
+}
+
+/// @brief checks that a file has the expected size and only zeros in it
+/// @param path the file
+/// @param bytes its expected size
+/// @param buffer SECURE_BUFFER_BYTES to read into
+/// @return TRUE if it does
+static BOOL isZeroFile(const wchar_t* path,
+                       ULONGLONG bytes,
+                       BYTE* buffer)
+{
+    HANDLE hFile = CreateFileW(path,
+                               GENERIC_READ,
+                               FILE_SHARE_READ,
+                               NULL,
+                               OPEN_EXISTING,
+                               FILE_FLAG_SEQUENTIAL_SCAN,
+                               NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+    {
+        return FALSE;
+    }
+    BOOL result = TRUE;
+    ULONGLONG total = 0;
+    for (;;)
+    {
+        DWORD bytesRead = 0;
+        if (ReadFile(hFile,
+                     buffer,
+                     SECURE_BUFFER_BYTES,
+                     &bytesRead,
+                     NULL) == FALSE)
+        {
+            result = FALSE;
+            break;
+        }
+        if (bytesRead == 0)
+        {
+            break;
+        }
+        for (DWORD i = 0; i < bytesRead; i++)
+        {
+            if (buffer[i] != 0)
+            {
+                result = FALSE;
+                break;
+            }
+        }
+        total += bytesRead;
+    }
+    CloseHandle(hFile);
+    return (result && (total == bytes));
+}
+
+/// @brief starts an eraser
+/// @param eraser the eraser
+/// @param threads the most files erased at once, 0 for one per processor
+/// @return TRUE if the eraser can be used, FALSE if memory ran out
+BOOL openSecureEraser(SecureEraser* eraser,
+                      DWORD threads)
+{
+    memset(eraser,
+           0,
+           sizeof(SecureEraser));
+    eraser->threads = (threads == 0) ? getDefaultThreadCount() : threads;
+
+    // Committed pages start out zeroed and are page aligned, which covers
+    // any sector size. Read only, so a stray write can't spoil them.
+    eraser->zeros = VirtualAlloc(NULL,
+                                 SECURE_BUFFER_BYTES,
+                                 MEM_COMMIT | MEM_RESERVE,
+                                 PAGE_READONLY);
+    return (eraser->zeros != NULL);
+}
+
+/// @brief overwrites a file with zeros through the cache, then flushes it.
+/// Used for files that can't be written unbuffered.
+/// @param eraser the eraser, for its zeros
+/// @param hFile the file, opened for synchronous writes
+/// @param size the size of the file
+/// @return TRUE if the whole file was overwritten and flushed
+static BOOL overwriteBuffered(SecureEraser* eraser,
+                              HANDLE hFile,
+                              ULONGLONG size)
+{
+    LARGE_INTEGER start = { 0 };
+    if (SetFilePointerEx(hFile,
+                         start,
+                         NULL,
+                         FILE_BEGIN) == FALSE)
+    {
+        return FALSE;
+    }
+    for (ULONGLONG offset = 0; offset < size;)
+    {
+        DWORD bytes = (DWORD) min(size - offset, SECURE_BUFFER_BYTES);
+        DWORD bytesWritten = 0;
+        if ((WriteFile(hFile, eraser->zeros, bytes, &bytesWritten, NULL) == FALSE) ||
+            (bytesWritten != bytes))
+        {
+            return FALSE;
+        }
+        offset += bytes;
+    }
+    return FlushFileBuffers(hFile);
+}
+
+/// @brief overwrites a file with zeros, keeping up to SECURE_QUEUE_DEPTH
+/// writes in flight. The last write is rounded up to SECURE_ALIGNMENT and
+/// the size put back afterwards.
+/// @param eraser the eraser, for its zeros
+/// @param hFile the file, opened unbuffered, write through and overlapped
+/// @param size the size of the file
+/// @return TRUE if every write completed in full
+static BOOL overwriteUnbuffered(SecureEraser* eraser,
+                                HANDLE hFile,
+                                ULONGLONG size)
+{
+    OVERLAPPED overlapped[SECURE_QUEUE_DEPTH] = { 0 };
+    DWORD lengths[SECURE_QUEUE_DEPTH] = { 0 };
+    BOOL result = TRUE;
+    for (DWORD i = 0; i < SECURE_QUEUE_DEPTH; i++)
+    {
+        overlapped[i].hEvent = CreateEventW(NULL,
+                                            TRUE,
+                                            FALSE,
+                                            NULL);
+        if (overlapped[i].hEvent == NULL)
+        {
+            result = FALSE;
+        }
+    }
+
+    // Writes are issued until the queue is full, then the oldest is waited
+    // for, so a slot is only reused once its write has completed
+    ULONGLONG total = (size + SECURE_ALIGNMENT - 1) & ~((ULONGLONG) SECURE_ALIGNMENT - 1);
+    ULONGLONG offset = 0;
+    ULONGLONG issued = 0;
+    ULONGLONG completed = 0;
+    while (result && ((offset < total) || (completed < issued)))
+    {
+        if ((offset < total) && ((issued - completed) < SECURE_QUEUE_DEPTH))
+        {
+            DWORD slot = (DWORD) (issued % SECURE_QUEUE_DEPTH);
+            lengths[slot] = (DWORD) min(total - offset, SECURE_BUFFER_BYTES);
+            overlapped[slot].Offset = (DWORD) offset;
+            overlapped[slot].OffsetHigh = (DWORD) (offset >> 32);
+            if ((WriteFile(hFile, eraser->zeros, lengths[slot], NULL, &overlapped[slot]) == FALSE) &&
+                (GetLastError() != ERROR_IO_PENDING))
+            {
+                result = FALSE;
+                break;
+            }
+            offset += lengths[slot];
+            issued++;
+            continue;
+        }
+        DWORD slot = (DWORD) (completed % SECURE_QUEUE_DEPTH);
+        DWORD bytesWritten = 0;
+        if ((GetOverlappedResult(hFile, &overlapped[slot], &bytesWritten, TRUE) == FALSE) ||
+            (bytesWritten != lengths[slot]))
+        {
+            result = FALSE;
+        }
+        completed++;
+    }
+
+    // A write still in flight after a failure must finish before its
+    // OVERLAPPED goes away
+    while (completed < issued)
+    {
+        DWORD bytesWritten = 0;
+        GetOverlappedResult(hFile,
+                            &overlapped[completed % SECURE_QUEUE_DEPTH],
+                            &bytesWritten,
+                            TRUE);
+        completed++;
+    }
+    for (DWORD i = 0; i < SECURE_QUEUE_DEPTH; i++)
+    {
+        if (overlapped[i].hEvent != NULL)
+        {
+            CloseHandle(overlapped[i].hEvent);
+        }
+    }
+
+    if (result && (total != size))
+    {
+        FILE_END_OF_FILE_INFO endOfFile = { 0 };
+        endOfFile.EndOfFile.QuadPart = (LONGLONG) size;
+        result = SetFileInformationByHandle(hFile,
+                                            FileEndOfFileInfo,
+                                            &endOfFile,
+                                            sizeof(endOfFile));
+    }
+    return (result && FlushFileBuffers(hFile));
+}
+
+/// @brief adds a file to the batch, erasing the batch first if it is full
+/// @param eraser the eraser
+/// @param hFile the file, opened with SECURE_FILE_ACCESS. The eraser
+/// closes it.
+/// @param size the size of the file
+/// @return TRUE if the batch that had to be erased first was erased in full
+static BOOL queueSecureFile(SecureEraser* eraser,
+                            HANDLE hFile,
+                            ULONGLONG size)
+{
+    BOOL result = TRUE;
+    if (eraser->batchCount == SECURE_BATCH_FILES)
+    {
+        result = flushSecureEraser(eraser);
+    }
+    SecureFile* file = &eraser->batch[eraser->batchCount];
+    file->hFile = hFile;
+    file->size = size;
+    file->erased = FALSE;
+    file->linked = FALSE;
+    eraser->batchCount++;
+    return result;
+}
+
+/// @brief erases every bin folder of the current user, on every volume
+/// @param filesErased receives the number of files erased
+/// @param bytesErased receives the number of bytes overwritten
+/// @param cancel made non-zero by another thread to stop the erase before
+/// its next file, NULL if it can't be cancelled
+/// @return TRUE if every item was erased, FALSE if any were left in the bin
+BOOL secureEmptyBin(ULONGLONG* filesErased,
+                    ULONGLONG* bytesErased,
+                    volatile LONG* cancel)
+{
+    *filesErased = 0;
+    *bytesErased = 0;
+    SecureEraser* eraser = HeapAlloc(GetProcessHeap(),
+                                     0,
+                                     sizeof(SecureEraser));
+    if (eraser == NULL)
+    {
+        // Memory allocation failed
+        return FALSE;
+    }
+    if (openSecureEraser(eraser,
+                         0) == FALSE)
+    {
+        HeapFree(GetProcessHeap(),
+                 0,
+                 eraser);
+        return FALSE;
+    }
+    eraser->cancel = cancel;
+    BOOL result = TRUE;
+    for (wchar_t driveLetter = L'A'; driveLetter <= L'Z'; driveLetter++)
+    {
+        wchar_t binDirectory[MAX_PATH + 1] = { 0 };
+        if ((cancel != NULL) &&
+            (*cancel != 0))
+        {
+            result = FALSE;
+            break;
+        }
+        if (getBinDirectory(driveLetter,
+                            binDirectory,
+                            ARRAYSIZE(binDirectory)) == FALSE)
+        {
+            continue;
+        }
+        ULONGLONG filesBefore = eraser->files;
+        ULONGLONG bytesBefore = eraser->bytes;
+        if (secureEraseBinDirectory(eraser,
+                                    binDirectory) == FALSE)
+        {
+            result = FALSE;
+        }
+        if (eraser->files > filesBefore)
+        {
+            auditEvent(AUDIT_OP_ERASE,
+                       binDirectory,
+                       eraser->bytes - bytesBefore,
+                       eraser->files - filesBefore);
+        }
+    }
+    result = closeSecureEraser(eraser) && result;
+    *filesErased = eraser->files;
+    *bytesErased = eraser->bytes;
+    LOG(L"Securely erased %llu files, %llu bytes, %llu left\n",
+        eraser->files,
+        eraser->bytes,
+        eraser->failed);
+    HeapFree(GetProcessHeap(),
+             0,
+             eraser);
+    if (*filesErased > 0)
+    {
+        SHUpdateRecycleBinIcon();
+    }
+    return result;
+}
+
+/// @brief erases every item in one bin folder. The $R files and folders go
+/// first, then each $I whose $R is gone, so an item that could not be
+/// erased is still whole in the bin.
+/// @param eraser the eraser
+/// @param binDirectory the bin folder, which is kept
+/// @return TRUE if every item was erased
+BOOL secureEraseBinDirectory(SecureEraser* eraser,
+                             const wchar_t* binDirectory)
+{
+    ULONGLONG failed = eraser->failed;
+    HANDLE hDirectory = openTreePath(binDirectory,
+                                     DIRTREE_READ_ACCESS);
+    if (hDirectory == INVALID_HANDLE_VALUE)
+    {
+        DWORD error = GetLastError();
+        return ((error == ERROR_FILE_NOT_FOUND) || (error == ERROR_PATH_NOT_FOUND));
+    }
+    for (DWORD pass = SECURE_PASS_CONTENT; pass <= SECURE_PASS_INFO; pass++)
+    {
+        SecureWalk walk = { eraser, pass };
+        if (listOpenDirectory(hDirectory,
+                              eraseChild,
+                              &walk) == FALSE)
+        {
+            eraser->failed++;
+        }
+        flushSecureEraser(eraser);
+    }
+    CloseHandle(hDirectory);
+    return (eraser->failed == failed);
+}
+
+/// @brief erases a file, or a folder and everything in it
+/// @param eraser the eraser
+/// @param path the full path of the file or folder
+/// @return TRUE if all of it was erased or it did not exist
+BOOL secureEraseTree(SecureEraser* eraser,
+                     const wchar_t* path)
+{
+    ULONGLONG failed = eraser->failed;
+    HANDLE hItem = openTreePath(path,
+                                DIRTREE_DELETE_ACCESS);
+    if (hItem == INVALID_HANDLE_VALUE)
+    {
+        DWORD error = GetLastError();
+        return ((error == ERROR_FILE_NOT_FOUND) || (error == ERROR_PATH_NOT_FOUND));
+    }
+    BY_HANDLE_FILE_INFORMATION info = { 0 };
+    if (GetFileInformationByHandle(hItem,
+                                   &info) == FALSE)
+    {
+        CloseHandle(hItem);
+        eraser->failed++;
+        return FALSE;
+    }
+    if ((info.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) &&
+        ((info.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) == 0))
+    {
+        return eraseOpenFolder(eraser,
+                               hItem);
+    }
+    clearReadOnly(hItem,
+                  info.dwFileAttributes);
+    CloseHandle(hItem);
+    HANDLE hFile = openTreePath(path,
+                                SECURE_FILE_ACCESS);
+    if (hFile == INVALID_HANDLE_VALUE)
+    {
+        eraser->failed++;
+        return FALSE;
+    }
+    queueSecureFile(eraser,
+                    hFile,
+                    ((ULONGLONG) info.nFileSizeHigh << 32) | info.nFileSizeLow);
+    flushSecureEraser(eraser);
+    return (eraser->failed == failed);
+}
+
+/// @brief creates a file filled with a repeating buffer
+/// @param path the file, which must not exist
+/// @param contents SECURE_BUFFER_BYTES to repeat
+/// @param bytes the size of the file
+/// @return TRUE if the file was created in full
+static BOOL writeSecureFile(const wchar_t* path,
+                            const BYTE* contents,
+                            ULONGLONG bytes)
+{
+    HANDLE hFile = CreateFileW(path,
+                               GENERIC_WRITE,
+                               0,
+                               NULL,
+                               CREATE_NEW,
+                               FILE_ATTRIBUTE_NORMAL,
+                               NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+    {
+        return FALSE;
+    }
+    BOOL result = TRUE;
+    for (ULONGLONG offset = 0; result && (offset < bytes);)
+    {
+        DWORD chunk = (DWORD) min(bytes - offset, SECURE_BUFFER_BYTES);
+        DWORD bytesWritten = 0;
+        result = WriteFile(hFile,
+                           contents,
+                           chunk,
+                           &bytesWritten,
+                           NULL) &&
+            (bytesWritten == chunk);
+        offset += chunk;
+    }
+    CloseHandle(hFile);
+    return result;
+}
+
+/// @brief erases a file in place and a bin folder with items, our own
+/// folders and an item that is held open in a debug build, returns
+/// immediately in a release build
+/// @param none
+void testSecureErase(void)
+{
+#ifndef NDEBUG
+    wchar_t tempDirectory[MAX_PATH + 1] = { 0 };
+    wchar_t root[MAX_PATH + 1] = { 0 };
+    wchar_t path[MAX_PATH + 1] = { 0 };
+    GetTempPathW(ARRAYSIZE(tempDirectory),
+                 tempDirectory);
+    _snwprintf(root,
+               ARRAYSIZE(root),
+               L"%srbmsecure%08X",
+               tempDirectory,
+               GetCurrentProcessId());
+    root[MAX_PATH] = 0;
+    deleteTree(root, NULL);
+    BOOL result = CreateDirectoryW(root,
+                                   NULL);
+    assert(result);
+    BYTE* contents = HeapAlloc(GetProcessHeap(),
+                               0,
+                               SECURE_BUFFER_BYTES);
+    SecureEraser* eraser = HeapAlloc(GetProcessHeap(),
+                                     0,
+                                     sizeof(SecureEraser));
+    assert((contents != NULL) && (eraser != NULL));
+    memset(contents,
+           0x5A,
+           SECURE_BUFFER_BYTES);
+
+    // A file of several writes that ends part way into a sector is zeroed
+    // and keeps its size
+    ULONGLONG bigBytes = (SECURE_BUFFER_BYTES * 5) + 1234;
+    _snwprintf(path, ARRAYSIZE(path), L"%s\\kept.dat", root);
+    result = writeSecureFile(path, contents, bigBytes);
+    assert(result);
+    result = openSecureEraser(eraser,
+                              2);
+    assert(result);
+    eraser->keepFiles = TRUE;
+    result = secureEraseTree(eraser,
+                             path);
+    assert(result);
+    result = closeSecureEraser(eraser);
+    assert(result);
+    assert((eraser->files == 1) && (eraser->bytes == bigBytes) && (eraser->failed == 0));
+    result = isZeroFile(path,
+                        bigBytes,
+                        contents);
+    assert(result);
+    DeleteFileW(path);
+    memset(contents,
+           0x5A,
+           SECURE_BUFFER_BYTES);
+
+    // A bin folder with a file item, a folder item holding a read only
+    // file, an empty file and a subfolder, an item whose $R is held open,
+    // desktop.ini and a staging folder
+    _snwprintf(path, ARRAYSIZE(path), L"%s\\$IAAAAAA.txt", root);
+    result = writeSecureFile(path, contents, 100);
+    assert(result);
+    _snwprintf(path, ARRAYSIZE(path), L"%s\\$RAAAAAA.txt", root);
+    result = writeSecureFile(path, contents, 5000);
+    assert(result);
+    _snwprintf(path, ARRAYSIZE(path), L"%s\\$IBBBBBB", root);
+    result = writeSecureFile(path, contents, 100);
+    assert(result);
+    _snwprintf(path, ARRAYSIZE(path), L"%s\\$RBBBBBB", root);
+    result = CreateDirectoryW(path, NULL);
+    assert(result);
+    _snwprintf(path, ARRAYSIZE(path), L"%s\\$RBBBBBB\\sub", root);
+    result = CreateDirectoryW(path, NULL);
+    assert(result);
+    _snwprintf(path, ARRAYSIZE(path), L"%s\\$RBBBBBB\\sub\\readonly.dat", root);
+    result = writeSecureFile(path, contents, SECURE_BUFFER_BYTES + 1);
+    assert(result);
+    SetFileAttributesW(path,
+                       FILE_ATTRIBUTE_READONLY);
+    _snwprintf(path, ARRAYSIZE(path), L"%s\\$RBBBBBB\\empty.txt", root);
+    result = writeSecureFile(path, contents, 0);
+    assert(result);
+    _snwprintf(path, ARRAYSIZE(path), L"%s\\$ICCCCCC.txt", root);
+    result = writeSecureFile(path, contents, 100);
+    assert(result);
+    _snwprintf(path, ARRAYSIZE(path), L"%s\\$RCCCCCC.txt", root);
+    result = writeSecureFile(path, contents, 10);
+    assert(result);
+    HANDLE hHeld = CreateFileW(path,
+                               GENERIC_READ,
+                               0,
+                               NULL,
+                               OPEN_EXISTING,
+                               FILE_ATTRIBUTE_NORMAL,
+                               NULL);
+    assert(hHeld != INVALID_HANDLE_VALUE);
+    _snwprintf(path, ARRAYSIZE(path), L"%s\\$IDDDDDD.txt", root);
+    result = writeSecureFile(path, contents, 100);
+    assert(result);
+    wchar_t linkPath[MAX_PATH + 1] = { 0 };
+    _snwprintf(linkPath, ARRAYSIZE(linkPath), L"%srbmsecurelink%08X.txt", tempDirectory, GetCurrentProcessId());
+    DeleteFileW(linkPath);
+    result = writeSecureFile(linkPath, contents, 3000);
+    assert(result);
+    _snwprintf(path, ARRAYSIZE(path), L"%s\\$RDDDDDD.txt", root);
+    result = CreateHardLinkW(path,
+                             linkPath,
+                             NULL);
+    assert(result);
+    _snwprintf(path, ARRAYSIZE(path), L"%s\\%s", root, RECLAIM_DESKTOP_INI);
+    result = writeSecureFile(path, contents, 10);
+    assert(result);
+    _snwprintf(path, ARRAYSIZE(path), L"%s\\%s0000000000000001", root, RECLAIM_STAGING_PREFIX);
+    result = CreateDirectoryW(path, NULL);
+    assert(result);
+
+    result = openSecureEraser(eraser,
+                              2);
+    assert(result);
+    result = secureEraseBinDirectory(eraser,
+                                     root);
+    assert(result == FALSE);
+    result = closeSecureEraser(eraser);
+    assert(result);
+    assert(eraser->files == 7);
+    assert(eraser->bytes == 100 + 5000 + 100 + SECURE_BUFFER_BYTES + 1 + 100);
+    assert(eraser->failed == 1);
+    CloseHandle(hHeld);
+
+    // The hard linked $R is gone from the bin, untouched under its other name
+    _snwprintf(path, ARRAYSIZE(path), L"%s\\$RDDDDDD.txt", root);
+    assert(GetFileAttributesW(path) == INVALID_FILE_ATTRIBUTES);
+    result = isZeroFile(linkPath,
+                        3000,
+                        contents);
+    assert(result == FALSE);
+    memset(contents,
+           0x5A,
+           SECURE_BUFFER_BYTES);
+    result = DeleteFileW(linkPath);
+    assert(result);
+
+    _snwprintf(path, ARRAYSIZE(path), L"%s\\$IAAAAAA.txt", root);
+    assert(GetFileAttributesW(path) == INVALID_FILE_ATTRIBUTES);
+    _snwprintf(path, ARRAYSIZE(path), L"%s\\$RBBBBBB", root);
+    assert(GetFileAttributesW(path) == INVALID_FILE_ATTRIBUTES);
+    _snwprintf(path, ARRAYSIZE(path), L"%s\\$ICCCCCC.txt", root);
+    assert(GetFileAttributesW(path) != INVALID_FILE_ATTRIBUTES);
+    _snwprintf(path, ARRAYSIZE(path), L"%s\\$RCCCCCC.txt", root);
+    assert(GetFileAttributesW(path) != INVALID_FILE_ATTRIBUTES);
+    _snwprintf(path, ARRAYSIZE(path), L"%s\\%s", root, RECLAIM_DESKTOP_INI);
+    assert(GetFileAttributesW(path) != INVALID_FILE_ATTRIBUTES);
+    _snwprintf(path, ARRAYSIZE(path), L"%s\\%s0000000000000001", root, RECLAIM_STAGING_PREFIX);
+    assert(GetFileAttributesW(path) != INVALID_FILE_ATTRIBUTES);
+
+    HeapFree(GetProcessHeap(),
+             0,
+             contents);
+    HeapFree(GetProcessHeap(),
+             0,
+             eraser);
+    deleteTree(root,
+               NULL);
+#endif
+}
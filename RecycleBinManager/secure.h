@@ -0,0 +1,80 @@
+#define _CRT_SECURE_NO_WARNINGS
+
+#pragma once
+#include <Windows.h>
+#include <shlobj_core.h>
+#include <stdio.h>
+#include <assert.h>
+#include "dirtree.h"
+
+// Secure erase parameters. The secure empty item in the window's system
+// menu, /secureempty and, with SecureEmpty set, a scheduled empty overwrite
+// every file in the bin with zeros before deleting it, instead of handing
+// the bin to the shell or the reclaimer. The empty button never does.
+// Files are written unbuffered and straight through to the disk, so the
+// zeros land on the clusters the file holds rather than in the cache, from
+// one page aligned buffer that every write shares. Each file keeps several
+// large writes in flight, and a batch of files is erased in parallel. A
+// file is only deleted once all of its writes have completed, and a $I file
+// is only erased once its $R is gone, so an item that can't be overwritten
+// stays whole in the bin. Compressed, sparse and encrypted files, which
+// can't be written unbuffered, are overwritten through the cache and then
+// flushed. Items already in a staging folder are left to the reclaimer. A
+// file with more than one hard link is still live data under its other
+// names, so only the link in the bin is deleted and nothing is overwritten.
+// An erase that is cancelled finishes the files it has already started on
+// and leaves the rest whole in the bin.
+
+#define SECURE_BUFFER_BYTES     (1024 * 1024) // Per write
+#define SECURE_ALIGNMENT        4096 // Unbuffered writes are rounded up to this, covers 512 and 4K sectors
+#define SECURE_QUEUE_DEPTH      4 // Writes in flight per file
+#define SECURE_BATCH_FILES      64 // Files erased in parallel
+#define SECURE_FILE_ACCESS      (DELETE | FILE_READ_ATTRIBUTES | FILE_WRITE_ATTRIBUTES | \
+                                 FILE_WRITE_DATA | SYNCHRONIZE)
+#define SECURE_BENCH_MEGABYTES  256
+#define SECURE_BENCH_FILE_MB    16 // Largest synthetic file
+
+// Structs
+
+typedef struct SecureFile // A file waiting in the batch
+{
+    HANDLE hFile; // Opened with SECURE_FILE_ACCESS, closed once erased
+    ULONGLONG size;
+    BOOL erased; // Overwritten and deleted
+    BOOL linked; // Hard linked elsewhere, so only the link was deleted
+} SecureFile;
+
+typedef struct SecureEraser
+{
+    SecureFile batch[SECURE_BATCH_FILES];
+    DWORD batchCount; // Files queued in the batch
+    DWORD threads;
+    BYTE* zeros; // SECURE_BUFFER_BYTES, page aligned and never written
+    BOOL keepFiles; // Overwrite without deleting, only to check the overwrite
+    volatile LONG* cancel; // Made non-zero by another thread to stop before the next file, NULL for never
+    ULONGLONG files; // Erased and deleted
+    ULONGLONG bytes; // Overwritten
+    ULONGLONG failed; // Files or folders left behind
+} SecureEraser;
+
+typedef struct SecureBenchmark
+{
+    ULONGLONG files;
+    ULONGLONG bytes;
+    double eraseSeconds;
+    double deleteSeconds; // The same files deleted without erasing them
+    BOOL verified; // Every file read back as zeros before it was deleted
+} SecureBenchmark;
+
+// Functions
+
+BOOL benchmarkSecureErase(const wchar_t* folder, DWORD megabytes, DWORD threads,
+                          SecureBenchmark* result);
+BOOL closeSecureEraser(SecureEraser* eraser);
+BOOL flushSecureEraser(SecureEraser* eraser);
+BOOL isSecureEmptyEnabled(void);
+BOOL openSecureEraser(SecureEraser* eraser, DWORD threads);
+BOOL secureEmptyBin(ULONGLONG* filesErased, ULONGLONG* bytesErased, volatile LONG* cancel);
+BOOL secureEraseBinDirectory(SecureEraser* eraser, const wchar_t* binDirectory);
+BOOL secureEraseTree(SecureEraser* eraser, const wchar_t* path);
+void testSecureErase(void);
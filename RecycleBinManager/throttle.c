@@ -0,0 +1,372 @@
+/*
+* Rate limiting and adaptive backoff for deleting large amounts of data
+*
+* Copyright(C) 2024 ERROR_SUCCESS Software
+*
+* This program is free software : you can redistribute it and /or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.If not, see < https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#include "throttle.h"
+#include "ini.h"
+#include "logger.h"
+
+static void initTokenBucket(TokenBucket* bucket, double rate, ULONGLONG now);
+static ULONGLONG takeTokens(TokenBucket* bucket, double amount, double backoff,
+                            ULONGLONG now);
+#ifndef NDEBUG
+static ULONGLONG fakeClock(void);
+static void fakeSleep(DWORD milliseconds);
+static ULONGLONG fakeNow = 0;
+#endif
+
+#ifndef NDEBUG
+/// @brief the clock testThrottle() runs the throttle on
+static ULONGLONG fakeClock(void)
+{
+    return fakeNow;
+}
+
+/// @brief moves the fake clock forward instead of sleeping
+static void fakeSleep(DWORD milliseconds)
+{
+    fakeNow += (ULONGLONG) milliseconds * 1000;
+}
+#endif
+
+/// @brief reads the performance counter in microseconds. This is the
+/// clock a throttle uses unless it is given another one.
+/// @param none
+/// @return microseconds since an arbitrary fixed point
+ULONGLONG getThrottleClock(void)
+{
+    static LARGE_INTEGER frequency = { 0 };
+    if (frequency.QuadPart == 0)
+    {
+        QueryPerformanceFrequency(&frequency);
+    }
+    LARGE_INTEGER now = { 0 };
+    QueryPerformanceCounter(&now);
+    return (ULONGLONG) ((now.QuadPart / frequency.QuadPart) * 1000000) +
+        (ULONGLONG) (((now.QuadPart % frequency.QuadPart) * 1000000) / frequency.QuadPart);
+}
+
+/// @brief sets up a throttle
+/// @param throttle the throttle
+/// @param filesPerSecond the most files to delete per second, or
+/// THROTTLE_UNLIMITED
+/// @param bytesPerSecond the most bytes to delete per second, or
+/// THROTTLE_UNLIMITED
+/// @param clock the clock to use, NULL for getThrottleClock()
+/// @param sleep the way to wait, NULL for Sleep()
+void initThrottle(Throttle* throttle,
+                  double filesPerSecond,
+                  double bytesPerSecond,
+                  ThrottleClock clock,
+                  ThrottleSleep sleep)
+{
+    memset(throttle,
+           0,
+           sizeof(*throttle));
+    throttle->clock = (clock != NULL) ? clock : getThrottleClock;
+    throttle->sleep = (sleep != NULL) ? sleep : Sleep;
+    throttle->backoff = 1.0;
+    ULONGLONG now = throttle->clock();
+    initTokenBucket(&throttle->files,
+                    filesPerSecond,
+                    now);
+    initTokenBucket(&throttle->bytes,
+                    bytesPerSecond,
+                    now);
+}
+
+/// @brief sets up a full token bucket holding one second's worth of tokens
+/// @param bucket the bucket
+/// @param rate tokens per second, or THROTTLE_UNLIMITED
+/// @param now the current time in microseconds
+static void initTokenBucket(TokenBucket* bucket,
+                            double rate,
+                            ULONGLONG now)
+{
+    bucket->rate = (rate > 0.0) ? rate : THROTTLE_UNLIMITED;
+    bucket->capacity = (rate > 1.0) ? rate : 1.0;
+    bucket->tokens = bucket->capacity;
+    bucket->lastRefill = now;
+}
+
+/// @brief checks if Settings.ini asks for deletes to be throttled
+/// @param none
+/// @return TRUE if a file or byte limit is set
+BOOL isThrottleConfigured(void)
+{
+    return (getIniInt(INI_KEY_THROTTLE_FILES, INI_DEFAULT_VALUE_THROTTLE_FILES) > 0) ||
+        (getIniInt(INI_KEY_THROTTLE_MEGABYTES, INI_DEFAULT_VALUE_THROTTLE_MEGABYTES) > 0);
+}
+
+/// @brief sets up a throttle with the limits in Settings.ini
+/// @param throttle the throttle
+void loadThrottleSettings(Throttle* throttle)
+{
+    int filesPerSecond = getIniInt(INI_KEY_THROTTLE_FILES,
+                                   INI_DEFAULT_VALUE_THROTTLE_FILES);
+    int megabytesPerSecond = getIniInt(INI_KEY_THROTTLE_MEGABYTES,
+                                       INI_DEFAULT_VALUE_THROTTLE_MEGABYTES);
+    initThrottle(throttle,
+                 (filesPerSecond > 0) ? (double) filesPerSecond : THROTTLE_UNLIMITED,
+                 (megabytesPerSecond > 0) ? megabytesPerSecond * BYTES_PER_MEGABYTE : THROTTLE_UNLIMITED,
+                 NULL,
+                 NULL);
+    LOG(L"Deletes limited to %d files and %d MB per second\n",
+        filesPerSecond,
+        megabytesPerSecond);
+}
+
+/// @brief takes tokens from a bucket, refilling it first
+/// @param bucket the bucket
+/// @param amount the number of tokens to take
+/// @param backoff divides the refill rate while the disk is busy
+/// @param now the current time in microseconds
+/// @return how long to wait in microseconds before the tokens are paid for
+static ULONGLONG takeTokens(TokenBucket* bucket,
+                            double amount,
+                            double backoff,
+                            ULONGLONG now)
+{
+    if (bucket->rate == THROTTLE_UNLIMITED)
+    {
+        return 0;
+    }
+    double rate = bucket->rate / backoff;
+    if (now > bucket->lastRefill)
+    {
+        bucket->tokens += rate * (double) (now - bucket->lastRefill) / 1000000.0;
+        if (bucket->tokens > bucket->capacity)
+        {
+            bucket->tokens = bucket->capacity;
+        }
+    }
+    bucket->lastRefill = now;
+
+    // Take the tokens even if there are not enough. A file bigger than the
+    // bucket still gets deleted, it just takes more than a second to pay off.
+    bucket->tokens -= amount;
+    if (bucket->tokens >= 0.0)
+    {
+        return 0;
+    }
+    return (ULONGLONG) ((-bucket->tokens / rate) * 1000000.0);
+}
+
+/// @brief checks the throttle against a fake clock in a debug build,
+/// returns immediately in a release build
+/// @param none
+void testThrottle(void)
+{
+#ifndef NDEBUG
+    // A second's worth of files goes through at once, the rest are paced
+    Throttle throttle = { 0 };
+    fakeNow = 0;
+    initThrottle(&throttle,
+                 10.0,
+                 THROTTLE_UNLIMITED,
+                 fakeClock,
+                 fakeSleep);
+    for (int i = 0; i < 10; i++)
+    {
+        throttleAcquire(&throttle,
+                        0);
+    }
+    assert(fakeNow == 0);
+    for (int i = 0; i < 40; i++)
+    {
+        throttleAcquire(&throttle,
+                        0);
+    }
+    assert((fakeNow >= 3990000) && (fakeNow <= 4050000));
+
+    // Bytes are paced the same way, and a file bigger than the bucket
+    // still goes through
+    fakeNow = 0;
+    initThrottle(&throttle,
+                 THROTTLE_UNLIMITED,
+                 BYTES_PER_MEGABYTE,
+                 fakeClock,
+                 fakeSleep);
+    for (int i = 0; i < 5; i++)
+    {
+        throttleAcquire(&throttle,
+                        (ULONGLONG) BYTES_PER_MEGABYTE);
+    }
+    assert((fakeNow >= 3990000) && (fakeNow <= 4050000));
+    throttleAcquire(&throttle,
+                    (ULONGLONG) (3 * BYTES_PER_MEGABYTE));
+    assert((fakeNow >= 6990000) && (fakeNow <= 7050000));
+
+    // Slow deletes make the throttle back off, and it recovers once they
+    // are fast again
+    fakeNow = 0;
+    initThrottle(&throttle,
+                 10.0,
+                 THROTTLE_UNLIMITED,
+                 fakeClock,
+                 fakeSleep);
+    for (int i = 0; i < 20; i++)
+    {
+        throttleRecordLatency(&throttle,
+                              100);
+    }
+    assert(throttle.backoff == 1.0);
+    for (int i = 0; i < 5; i++)
+    {
+        throttleRecordLatency(&throttle,
+                              20000);
+    }
+    assert(throttle.backoff > 1.0);
+
+    // While backed off, the same 50 files take longer
+    double backoff = throttle.backoff;
+    for (int i = 0; i < 50; i++)
+    {
+        throttleAcquire(&throttle,
+                        0);
+    }
+    assert(fakeNow > 4000000 * backoff * 0.9);
+    for (int i = 0; i < 200; i++)
+    {
+        throttleRecordLatency(&throttle,
+                              100);
+    }
+    assert(throttle.backoff == 1.0);
+#endif
+}
+
+/// @brief waits until the throttle allows another file of the given size
+/// to be deleted
+/// @param throttle the throttle
+/// @param bytes the size of the file
+void throttleAcquire(Throttle* throttle,
+                     ULONGLONG bytes)
+{
+    ULONGLONG now = throttle->clock();
+    ULONGLONG fileWait = takeTokens(&throttle->files,
+                                    1.0,
+                                    throttle->backoff,
+                                    now);
+    ULONGLONG byteWait = takeTokens(&throttle->bytes,
+                                    (double) bytes,
+                                    throttle->backoff,
+                                    now);
+    ULONGLONG wait = (fileWait > byteWait) ? fileWait : byteWait;
+
+    // Without limits there is nothing to slow down, so leave the disk idle
+    // in proportion to how far we have backed off
+    if ((throttle->files.rate == THROTTLE_UNLIMITED) &&
+        (throttle->bytes.rate == THROTTLE_UNLIMITED) &&
+        (throttle->backoff > 1.0))
+    {
+        wait = (ULONGLONG) ((throttle->backoff - 1.0) * throttle->recentLatency);
+    }
+
+    throttle->waitedMicroseconds += wait;
+    while (wait > 0)
+    {
+        ULONGLONG milliseconds = (wait + 999) / 1000;
+        if (milliseconds > THROTTLE_MAX_SLEEP_MS)
+        {
+            milliseconds = THROTTLE_MAX_SLEEP_MS;
+        }
+        throttle->sleep((DWORD) milliseconds);
+        wait = (wait > milliseconds * 1000) ? wait - (milliseconds * 1000) : 0;
+    }
+}
+
+/// @brief marks an open file or empty folder for deletion once the
+/// throttle allows it, then closes the handle, which is when it goes. The
+/// time that takes is fed back into the throttle.
+/// @param throttle the throttle, or NULL to delete straight away
+/// @param hFile the file or folder, opened with DELETE access. It is
+/// closed either way.
+/// @param bytes the size of the file
+/// @return TRUE if it was deleted, FALSE if not
+BOOL throttledDeleteHandle(Throttle* throttle,
+                           HANDLE hFile,
+                           ULONGLONG bytes)
+{
+    ULONGLONG start = 0;
+    if (throttle != NULL)
+    {
+        throttleAcquire(throttle,
+                        bytes);
+        start = throttle->clock();
+    }
+    FILE_DISPOSITION_INFO disposition = { 0 };
+    disposition.DeleteFile = TRUE;
+    BOOL result = SetFileInformationByHandle(hFile,
+                                             FileDispositionInfo,
+                                             &disposition,
+                                             sizeof(disposition));
+    DWORD error = GetLastError();
+    CloseHandle(hFile);
+    if (throttle != NULL)
+    {
+        throttleRecordLatency(throttle,
+                              throttle->clock() - start);
+    }
+    SetLastError(error);
+    return result;
+}
+
+/// @brief updates the latency averages with the time a delete took and
+/// adjusts the backoff. Doubling on a busy disk and easing off slowly
+/// afterwards keeps us from flapping between the two.
+/// @param throttle the throttle
+/// @param microseconds how long the delete took
+void throttleRecordLatency(Throttle* throttle,
+                           ULONGLONG microseconds)
+{
+    double latency = (double) microseconds;
+    if (throttle->baselineLatency == 0.0)
+    {
+        throttle->baselineLatency = latency;
+        throttle->recentLatency = latency;
+        return;
+    }
+    throttle->recentLatency += THROTTLE_FAST_WEIGHT * (latency - throttle->recentLatency);
+
+    double busyLatency = throttle->baselineLatency * THROTTLE_BUSY_FACTOR;
+    if (busyLatency < THROTTLE_MIN_BUSY_US)
+    {
+        busyLatency = THROTTLE_MIN_BUSY_US;
+    }
+    if (throttle->recentLatency > busyLatency)
+    {
+        throttle->backoff *= 2.0;
+        if (throttle->backoff > THROTTLE_MAX_BACKOFF)
+        {
+            throttle->backoff = THROTTLE_MAX_BACKOFF;
+        }
+        return;
+    }
+
+    // Only learn the baseline while the disk is calm
+    throttle->baselineLatency += THROTTLE_SLOW_WEIGHT * (latency - throttle->baselineLatency);
+    if (throttle->recentLatency < throttle->baselineLatency * THROTTLE_CALM_FACTOR)
+    {
+        throttle->backoff *= THROTTLE_BACKOFF_DECAY;
+        if (throttle->backoff < 1.0)
+        {
+            throttle->backoff = 1.0;
+        }
+    }
+}
@@ -0,0 +1,64 @@
+#define _CRT_SECURE_NO_WARNINGS
+
+#pragma once
+#include <Windows.h>
+#include <stdio.h>
+#include <assert.h>
+
+// Deletion throttle parameters. Deletes are paced by two token buckets, one
+// for files and one for bytes, each holding one second's worth of tokens
+// so short bursts go through at full speed. On top of that the throttle
+// watches how long each delete takes: when it rises well above what it
+// was when things were quiet, the disk is busy with someone else's work
+// and we back off until it recovers.
+
+#define THROTTLE_UNLIMITED          0.0
+#define THROTTLE_FAST_WEIGHT        0.25 // EWMA weight of the latest delete latency
+#define THROTTLE_SLOW_WEIGHT        0.01 // EWMA weight for the quiet baseline
+#define THROTTLE_BUSY_FACTOR        4.0 // Latency this much above baseline means busy
+#define THROTTLE_CALM_FACTOR        1.5 // Latency this close to baseline means calm
+#define THROTTLE_MIN_BUSY_US        2000.0 // Never call the disk busy below this latency
+#define THROTTLE_MAX_BACKOFF        64.0
+#define THROTTLE_BACKOFF_DECAY      0.9
+#define THROTTLE_MAX_SLEEP_MS       1000 // Longest single sleep, so a stop is seen quickly
+#define BYTES_PER_MEGABYTE          1048576.0
+
+// Structs
+
+/// @brief returns the current time in microseconds from any fixed point
+typedef ULONGLONG (*ThrottleClock)(void);
+
+/// @brief waits for the given number of milliseconds
+typedef void (*ThrottleSleep)(DWORD milliseconds);
+
+typedef struct TokenBucket
+{
+    double rate; // Tokens added per second, THROTTLE_UNLIMITED for no limit
+    double capacity; // Most tokens the bucket can hold
+    double tokens; // Can go negative after a large request, which is then paid off
+    ULONGLONG lastRefill; // Microseconds
+} TokenBucket;
+
+typedef struct Throttle
+{
+    TokenBucket files;
+    TokenBucket bytes;
+    double baselineLatency; // Slow moving average of delete latency in microseconds
+    double recentLatency; // Fast moving average of delete latency in microseconds
+    double backoff; // Every wait is multiplied by this, 1 when the disk is calm
+    ThrottleClock clock;
+    ThrottleSleep sleep;
+    ULONGLONG waitedMicroseconds; // Total time spent waiting, for reporting
+} Throttle;
+
+// Functions
+
+ULONGLONG getThrottleClock(void);
+void initThrottle(Throttle* throttle, double filesPerSecond, double bytesPerSecond,
+                  ThrottleClock clock, ThrottleSleep sleep);
+BOOL isThrottleConfigured(void);
+void loadThrottleSettings(Throttle* throttle);
+void testThrottle(void);
+void throttleAcquire(Throttle* throttle, ULONGLONG bytes);
+BOOL throttledDeleteHandle(Throttle* throttle, HANDLE hFile, ULONGLONG bytes);
+void throttleRecordLatency(Throttle* throttle, ULONGLONG microseconds);
@@ -0,0 +1,322 @@
+/*
+* Find the largest and oldest items in the Recycle Bin in bounded memory
+*
+* Copyright(C) 2024 ERROR_SUCCESS Software
+*
+* This program is free software : you can redistribute it and /or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.If not, see < https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#include "topitems.h"
+#include "trash.h"
+#include "logger.h"
+
+static BOOL outranksTopItem(DWORD order, const TopItem* a, const TopItem* b);
+static void siftTopItemDown(TopItems* top, DWORD count, DWORD index);
+static void siftTopItemUp(TopItems* top, DWORD index);
+
+/// @brief offers an item found in the bin to a top items query. This is a
+/// BinItemCallback, so it can be passed to enumerateBinItems(). A folder
+/// the shell recorded no size for is measured, anything else uses the
+/// recorded size.
+/// @param item the item
+/// @param context the TopItems
+/// @return TRUE to keep enumerating, FALSE if memory ran out
+BOOL collectTopItem(const BinItem* item,
+                    void* context)
+{
+    TopItems* top = context;
+    ULONGLONG size = item->size;
+    if (size == 0)
+    {
+        DWORD attributes = GetFileAttributesW(item->contentPath);
+        if ((attributes != INVALID_FILE_ATTRIBUTES) &&
+            (attributes & FILE_ATTRIBUTE_DIRECTORY))
+        {
+            size = getTreeSize(item->contentPath);
+            top->measured++;
+        }
+    }
+    return offerTopItem(top,
+                        size,
+                        item->deletionTime,
+                        item->originalPath);
+}
+
+/// @brief streams every record in a catalog through a top items query
+/// @param catalog the open catalog
+/// @param top the query, from initTopItems()
+/// @return TRUE on success, FALSE if memory ran out
+BOOL findCatalogTopItems(const Catalog* catalog,
+                         TopItems* top)
+{
+    for (ULONGLONG i = 0; i < catalog->header->itemCount; i++)
+    {
+        const CatalogRecord* record = &catalog->records[i];
+        if (offerTopItem(top,
+                         record->size,
+                         record->deletionTime,
+                         getCatalogString(catalog, record->nameOffset)) == FALSE)
+        {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+/// @brief streams every item in the current user's bin on every volume
+/// through a top items query
+/// @param top the query, from initTopItems()
+/// @return TRUE on success, FALSE if the bin could not be read or memory
+///         ran out
+BOOL findTopItems(TopItems* top)
+{
+    return (enumerateBinItems(collectTopItem,
+                              top) &&
+            (top->outOfMemory == FALSE));
+}
+
+/// @brief frees a top items query and everything it kept
+/// @param top the query
+void freeTopItems(TopItems* top)
+{
+    for (DWORD i = 0; i < top->count; i++)
+    {
+        HeapFree(GetProcessHeap(),
+                 0,
+                 top->items[i].originalPath);
+    }
+    if (top->items != NULL)
+    {
+        HeapFree(GetProcessHeap(),
+                 0,
+                 top->items);
+    }
+    memset(top,
+           0,
+           sizeof(*top));
+}
+
+/// @brief starts a top items query
+/// @param top receives the query. Pass it to freeTopItems() either way.
+/// @param count how many items to keep, between 1 and TOP_ITEMS_MAX_COUNT
+/// @param order TOP_ITEMS_BY_SIZE or TOP_ITEMS_BY_AGE
+/// @return TRUE on success, FALSE if memory could not be allocated
+BOOL initTopItems(TopItems* top,
+                  DWORD count,
+                  DWORD order)
+{
+    memset(top,
+           0,
+           sizeof(*top));
+    top->order = order;
+    top->capacity = (count == 0) ? 1 : min(count, TOP_ITEMS_MAX_COUNT);
+    top->items = HeapAlloc(GetProcessHeap(),
+                           0,
+                           top->capacity * sizeof(TopItem));
+    return (top->items != NULL);
+}
+
+/// @brief offers one item to a top items query. It is kept if there is
+/// room or it outranks the weakest item kept so far, which is dropped.
+/// @param top the query
+/// @param size the size of the item in bytes
+/// @param deletionTime when the item was deleted
+/// @param originalPath where the item was deleted from, copied if kept
+/// @return TRUE on success, FALSE if the item made the cut but memory ran out
+BOOL offerTopItem(TopItems* top,
+                  ULONGLONG size,
+                  ULONGLONG deletionTime,
+                  const wchar_t* originalPath)
+{
+    top->scanned++;
+    TopItem candidate = { size, deletionTime, NULL };
+    if ((top->count == top->capacity) &&
+        (outranksTopItem(top->order, &candidate, &top->items[0]) == FALSE))
+    {
+        return TRUE;
+    }
+
+    size_t cchPath = wcslen(originalPath) + 1;
+    candidate.originalPath = HeapAlloc(GetProcessHeap(),
+                                       0,
+                                       cchPath * sizeof(wchar_t));
+    if (candidate.originalPath == NULL) // Memory allocation failed
+    {
+        top->outOfMemory = TRUE;
+        return FALSE;
+    }
+    memcpy(candidate.originalPath,
+           originalPath,
+           cchPath * sizeof(wchar_t));
+    if (top->count < top->capacity)
+    {
+        top->items[top->count] = candidate;
+        siftTopItemUp(top,
+                      top->count++);
+        return TRUE;
+    }
+    HeapFree(GetProcessHeap(),
+             0,
+             top->items[0].originalPath);
+    top->items[0] = candidate;
+    siftTopItemDown(top,
+                    top->count,
+                    0);
+    return TRUE;
+}
+
+/// @brief checks if one item ranks above another. Ties go to the older
+/// item by size, and to the larger item by age, so the order is stable.
+/// @param order TOP_ITEMS_BY_SIZE or TOP_ITEMS_BY_AGE
+/// @param a the first item
+/// @param b the second item
+/// @return TRUE if a ranks above b
+static BOOL outranksTopItem(DWORD order,
+                            const TopItem* a,
+                            const TopItem* b)
+{
+    if (order == TOP_ITEMS_BY_AGE)
+    {
+        return (a->deletionTime < b->deletionTime) ||
+            ((a->deletionTime == b->deletionTime) && (a->size > b->size));
+    }
+    return (a->size > b->size) ||
+        ((a->size == b->size) && (a->deletionTime < b->deletionTime));
+}
+
+/// @brief moves an item down the heap until no child is weaker than it
+/// @param top the query
+/// @param count the number of items in the heap
+/// @param index the item to move
+static void siftTopItemDown(TopItems* top,
+                            DWORD count,
+                            DWORD index)
+{
+    for (;;)
+    {
+        DWORD weakest = index;
+        DWORD left = (2 * index) + 1;
+        DWORD right = left + 1;
+        if ((left < count) &&
+            outranksTopItem(top->order, &top->items[weakest], &top->items[left]))
+        {
+            weakest = left;
+        }
+        if ((right < count) &&
+            outranksTopItem(top->order, &top->items[weakest], &top->items[right]))
+        {
+            weakest = right;
+        }
+        if (weakest == index)
+        {
+            return;
+        }
+        TopItem swap = top->items[index];
+        top->items[index] = top->items[weakest];
+        top->items[weakest] = swap;
+        index = weakest;
+    }
+}
+
+/// @brief moves an item up the heap until its parent is weaker than it
+/// @param top the query
+/// @param index the item to move
+static void siftTopItemUp(TopItems* top,
+                          DWORD index)
+{
+    while (index > 0)
+    {
+        DWORD parent = (index - 1) / 2;
+        if (outranksTopItem(top->order, &top->items[index], &top->items[parent]))
+        {
+            return;
+        }
+        TopItem swap = top->items[index];
+        top->items[index] = top->items[parent];
+        top->items[parent] = swap;
+        index = parent;
+    }
+}
+
+/// @brief puts the items kept by a query in order, best first. This sorts
+/// the heap in place, so no more items can be offered afterwards.
+/// @param top the query
+void sortTopItems(TopItems* top)
+{
+    // Moving the weakest to the end each time leaves the best at the start
+    for (DWORD remaining = top->count; remaining > 1; remaining--)
+    {
+        TopItem swap = top->items[0];
+        top->items[0] = top->items[remaining - 1];
+        top->items[remaining - 1] = swap;
+        siftTopItemDown(top,
+                        remaining - 1,
+                        0);
+    }
+}
+
+/// @brief tests that the heap keeps exactly what a full sort would
+/// @param none
+void testTopItems(void)
+{
+#ifndef NDEBUG
+    // Sizes 0 to 999 in a scrambled order, deleted in a different one
+    TopItems bySize = { 0 };
+    TopItems byAge = { 0 };
+    BOOL result = initTopItems(&bySize,
+                               10,
+                               TOP_ITEMS_BY_SIZE);
+    assert(result);
+    result = initTopItems(&byAge,
+                          5,
+                          TOP_ITEMS_BY_AGE);
+    assert(result);
+    for (DWORD i = 0; i < 1000; i++)
+    {
+        ULONGLONG size = (i * 7919) % 1000;
+        ULONGLONG deletionTime = 5000 + ((i * 104729) % 1000);
+        offerTopItem(&bySize, size, deletionTime, L"C:\\item");
+        offerTopItem(&byAge, size, deletionTime, L"C:\\item");
+    }
+    assert((bySize.count == 10) && (bySize.scanned == 1000));
+    sortTopItems(&bySize);
+    sortTopItems(&byAge);
+    for (DWORD i = 0; i < 10; i++)
+    {
+        assert(bySize.items[i].size == 999 - i);
+    }
+    for (DWORD i = 0; i < 5; i++)
+    {
+        assert(byAge.items[i].deletionTime == 5000 + i);
+    }
+    freeTopItems(&bySize);
+    freeTopItems(&byAge);
+
+    // Fewer items than K are all kept, and equal sizes go oldest first
+    result = initTopItems(&bySize,
+                          10,
+                          TOP_ITEMS_BY_SIZE);
+    assert(result);
+    offerTopItem(&bySize, 100, 30, L"C:\\newer");
+    offerTopItem(&bySize, 100, 10, L"C:\\older");
+    offerTopItem(&bySize, 50, 20, L"C:\\smaller");
+    sortTopItems(&bySize);
+    assert(bySize.count == 3);
+    assert(wcscmp(bySize.items[0].originalPath, L"C:\\older") == 0);
+    assert(wcscmp(bySize.items[1].originalPath, L"C:\\newer") == 0);
+    assert(wcscmp(bySize.items[2].originalPath, L"C:\\smaller") == 0);
+    freeTopItems(&bySize);
+#endif
+}
@@ -0,0 +1,58 @@
+#define _CRT_SECURE_NO_WARNINGS
+
+#pragma once
+#include <Windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include "bin.h"
+#include "catalog.h"
+
+// Top items parameters. "What is taking up the bin?" is answered by
+// streaming over every item once and keeping only the best K seen so far
+// in a heap whose root is the weakest of them, so memory stays at K items
+// however many are in the bin, and each item costs one comparison unless
+// it makes the cut. The dialog streams over the catalog, whose sizes are
+// rewritten on every bin notification. Reading the bin itself uses the
+// size the shell recorded in each $I file, and only measures a folder
+// when the shell recorded nothing for it.
+
+#define TOP_ITEMS_DEFAULT_COUNT 10
+#define TOP_ITEMS_MAX_COUNT     10000
+#define TOP_ITEMS_DIALOG_COUNT  8 // Of each kind shown by the dialog
+
+// Orders
+#define TOP_ITEMS_BY_SIZE       0 // Largest first
+#define TOP_ITEMS_BY_AGE        1 // Oldest deletion first
+
+// Structs
+
+typedef struct TopItem
+{
+    ULONGLONG size; // In bytes
+    ULONGLONG deletionTime; // FILETIME of the deletion, as a 64 bit value
+    wchar_t* originalPath; // A copy, owned by the item
+} TopItem;
+
+typedef struct TopItems
+{
+    DWORD order; // TOP_ITEMS_BY_ value
+    DWORD capacity; // K
+    DWORD count; // Items kept, at most capacity
+    TopItem* items; // A heap with the weakest item first, until sortTopItems()
+    ULONGLONG scanned; // Items offered
+    ULONGLONG measured; // Folders that had to be sized because no size was recorded
+    BOOL outOfMemory; // An item that made the cut could not be kept
+} TopItems;
+
+// Functions
+
+BOOL collectTopItem(const BinItem* item, void* context);
+BOOL findCatalogTopItems(const Catalog* catalog, TopItems* top);
+BOOL findTopItems(TopItems* top);
+void freeTopItems(TopItems* top);
+BOOL initTopItems(TopItems* top, DWORD count, DWORD order);
+BOOL offerTopItem(TopItems* top, ULONGLONG size, ULONGLONG deletionTime,
+                  const wchar_t* originalPath);
+void sortTopItems(TopItems* top);
+void testTopItems(void);
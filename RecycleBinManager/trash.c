@@ -0,0 +1,992 @@
+/*
+* Move files and folders into the Recycle Bin without going through the shell
+*
+* Copyright(C) 2024 ERROR_SUCCESS Software
+*
+* This program is free software : you can redistribute it and /or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.If not, see < https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#include "trash.h"
+#include "audit.h"
+#include "bin.h"
+#include "dirtree.h"
+#include "parallel.h"
+#include "reclaim.h"
+#include "logger.h"
+
+static void commitTrashBatch(TrashBulk* bulk);
+static void flushBulkItem(DWORD index, void* bulkPointer);
+static void flushTrashBatch(TrashBulk* bulk);
+static void generateTrashSuffix(wchar_t* suffix);
+static DWORD getBulkVolume(TrashBulk* bulk, const wchar_t* volumeRoot);
+static void prepareBulkItem(DWORD index, void* bulkPointer);
+static BOOL publishBulkItem(TrashBulkItem* item);
+#ifndef NDEBUG
+static BOOL removeTestBinItem(const BinItem* item, void* prefix);
+#endif
+
+/// @brief queues a path for a bulk put. Every TRASH_BULK_BATCH paths the
+/// batch is committed, so the caller can stream any number of paths
+/// through without holding them all in memory.
+/// @param bulk a bulk put started with initTrashBulk()
+/// @param path the path of the item, relative paths are allowed
+/// @return TRUE if the path was queued, FALSE if it is too long
+BOOL addTrashBulkPath(TrashBulk* bulk,
+                      const wchar_t* path)
+{
+    if (wcslen(path) > MAX_PATH)
+    {
+        LOG(L"The path %s is too long\n",
+            path);
+        bulk->failed++;
+        return FALSE;
+    }
+    TrashBulkItem* item = &bulk->items[bulk->count];
+    wcsncpy(item->path,
+            path,
+            MAX_PATH);
+    item->path[MAX_PATH] = 0;
+    bulk->count++;
+    if (bulk->count == TRASH_BULK_BATCH)
+    {
+        commitTrashBatch(bulk);
+    }
+    return TRUE;
+}
+
+/// @brief picks a random name for a new bin item. The $I and $R names share
+/// the suffix, and files keep their extension so Explorer shows the
+/// right icon.
+/// @param binDirectory the bin folder the item is going into
+/// @param originalPath the full path of the item, or NULL for a folder
+/// @param name receives the paths
+/// @return TRUE if the paths fit, FALSE if they are too long
+BOOL buildTrashName(const wchar_t* binDirectory,
+                    const wchar_t* originalPath,
+                    TrashName* name)
+{
+    const wchar_t* extension = L"";
+    if (originalPath != NULL)
+    {
+        const wchar_t* fileName = wcsrchr(originalPath, L'\\');
+        const wchar_t* dot = wcsrchr(originalPath, L'.');
+        if ((dot != NULL) && ((fileName == NULL) || (dot > fileName)))
+        {
+            extension = dot;
+        }
+    }
+
+    wchar_t suffix[BIN_SUFFIX_CCH + 1] = { 0 };
+    generateTrashSuffix(suffix);
+    int infoLength = _snwprintf(name->infoPath,
+                                ARRAYSIZE(name->infoPath),
+                                L"%s\\%s%s%s",
+                                binDirectory,
+                                BIN_INFO_PREFIX,
+                                suffix,
+                                extension);
+    int contentLength = _snwprintf(name->contentPath,
+                                   ARRAYSIZE(name->contentPath),
+                                   L"%s\\%s%s%s",
+                                   binDirectory,
+                                   BIN_CONTENT_PREFIX,
+                                   suffix,
+                                   extension);
+    int tempLength = _snwprintf(name->tempPath,
+                                ARRAYSIZE(name->tempPath),
+                                L"%s\\%s%s.tmp",
+                                binDirectory,
+                                TRASH_TEMP_PREFIX,
+                                suffix);
+    name->infoPath[MAX_PATH] = 0;
+    name->contentPath[MAX_PATH] = 0;
+    name->tempPath[MAX_PATH] = 0;
+    return ((infoLength >= 0) && (infoLength <= MAX_PATH) &&
+            (contentLength >= 0) && (contentLength <= MAX_PATH) &&
+            (tempLength >= 0) && (tempLength <= MAX_PATH));
+}
+
+/// @brief moves every queued item of a bulk put into the bin. There is one
+/// flush for the whole batch instead of one per item.
+/// @param bulk the bulk put
+static void commitTrashBatch(TrashBulk* bulk)
+{
+    if (bulk->count == 0)
+    {
+        return;
+    }
+
+    // Reserve names and write the temporary $I files in parallel. Most of
+    // the time goes into opening files, which the file system is happy to
+    // do on many threads at once.
+    bulk->deletionTime = getCurrentFileTime();
+    parallelFor(bulk->count,
+                bulk->threads,
+                prepareBulkItem,
+                bulk);
+
+    // Make every $I of the batch durable before any item moves
+    flushTrashBatch(bulk);
+
+    // The renames all go into the same folder and are serialised by the
+    // file system anyway, so they are done on this thread
+    const wchar_t* lastFolder = NULL;
+    size_t lastFolderLength = 0;
+    for (DWORD i = 0; i < bulk->count; i++)
+    {
+        TrashBulkItem* item = &bulk->items[i];
+        BOOL result = FALSE;
+        if (item->state == TRASH_BULK_USE_SHELL)
+        {
+            result = trashPutWithShell(item->fullPath);
+        }
+        else if (item->state == TRASH_BULK_WRITTEN)
+        {
+            result = publishBulkItem(item);
+        }
+        if (result == FALSE)
+        {
+            bulk->failed++;
+            continue;
+        }
+        item->state = TRASH_BULK_DONE;
+        bulk->succeeded++;
+
+        // Tell Explorer about each folder once rather than each item
+        const wchar_t* fileName = wcsrchr(item->fullPath, L'\\');
+        size_t folderLength = (fileName != NULL) ? (size_t) (fileName - item->fullPath) : 0;
+        if ((lastFolder == NULL) ||
+            (folderLength != lastFolderLength) ||
+            (_wcsnicmp(lastFolder, item->fullPath, folderLength) != 0))
+        {
+            wchar_t folder[MAX_PATH + 1] = { 0 };
+            wcsncpy(folder,
+                    item->fullPath,
+                    folderLength);
+            SHChangeNotify(SHCNE_UPDATEDIR,
+                           SHCNF_PATHW,
+                           folder,
+                           NULL);
+            lastFolder = item->fullPath;
+            lastFolderLength = folderLength;
+        }
+    }
+    bulk->count = 0;
+}
+
+/// @brief commits whatever is left of a bulk put and releases it
+/// @param bulk a bulk put started with initTrashBulk()
+/// @param stats receives the totals for the whole bulk put, can be NULL
+void finishTrashBulk(TrashBulk* bulk,
+                     TrashBulkStats* stats)
+{
+    if (bulk->items != NULL)
+    {
+        commitTrashBatch(bulk);
+        HeapFree(GetProcessHeap(),
+                 0,
+                 bulk->items);
+        bulk->items = NULL;
+    }
+    for (DWORD i = 0; i < bulk->volumeCount; i++)
+    {
+        if (bulk->volumes[i].hVolume != INVALID_HANDLE_VALUE)
+        {
+            CloseHandle(bulk->volumes[i].hVolume);
+        }
+    }
+    bulk->volumeCount = 0;
+    if (bulk->succeeded > 0)
+    {
+        SHUpdateRecycleBinIcon();
+    }
+
+    if (stats != NULL)
+    {
+        LARGE_INTEGER now = { 0 };
+        LARGE_INTEGER frequency = { 0 };
+        QueryPerformanceCounter(&now);
+        QueryPerformanceFrequency(&frequency);
+        stats->succeeded = bulk->succeeded;
+        stats->failed = bulk->failed;
+        stats->seconds = (double) (now.QuadPart - bulk->start.QuadPart) /
+            (double) frequency.QuadPart;
+    }
+}
+
+/// @brief flushes and closes the temporary $I file of one item, unless
+/// its whole volume has already been flushed
+/// @param index the item
+/// @param bulkPointer the bulk put
+static void flushBulkItem(DWORD index,
+                          void* bulkPointer)
+{
+    TrashBulk* bulk = (TrashBulk*) bulkPointer;
+    TrashBulkItem* item = &bulk->items[index];
+    if (item->state != TRASH_BULK_WRITTEN)
+    {
+        return;
+    }
+    BOOL flushed = (item->volume < bulk->volumeCount) &&
+        bulk->volumes[item->volume].flushed;
+    if ((flushed == FALSE) &&
+        (FlushFileBuffers(item->hInfo) == FALSE))
+    {
+        item->state = TRASH_BULK_FAILED;
+    }
+    CloseHandle(item->hInfo);
+    item->hInfo = INVALID_HANDLE_VALUE;
+    if (item->state == TRASH_BULK_FAILED)
+    {
+        DeleteFileW(item->name.tempPath);
+    }
+}
+
+/// @brief makes the $I files of a batch durable. NTFS has no way to flush
+/// a single folder, but flushing a volume handle writes out everything
+/// dirty on the volume in one go, so we do that once per volume where we
+/// are allowed to. Where we are not, the files are flushed on many
+/// threads at once, which lets NTFS share each log write between them.
+/// @param bulk the bulk put
+static void flushTrashBatch(TrashBulk* bulk)
+{
+    for (DWORD i = 0; i < bulk->volumeCount; i++)
+    {
+        bulk->volumes[i].flushed = FALSE;
+    }
+    BOOL used[TRASH_BULK_MAX_VOLUMES] = { 0 };
+    for (DWORD i = 0; i < bulk->count; i++)
+    {
+        TrashBulkItem* item = &bulk->items[i];
+        if (item->state == TRASH_BULK_WRITTEN)
+        {
+            item->volume = getBulkVolume(bulk,
+                                         item->volumeRoot);
+            if (item->volume < bulk->volumeCount)
+            {
+                used[item->volume] = TRUE;
+            }
+        }
+    }
+    for (DWORD i = 0; i < bulk->volumeCount; i++)
+    {
+        if (used[i] && (bulk->volumes[i].hVolume != INVALID_HANDLE_VALUE))
+        {
+            bulk->volumes[i].flushed = FlushFileBuffers(bulk->volumes[i].hVolume);
+        }
+    }
+    parallelFor(bulk->count,
+                bulk->threads,
+                flushBulkItem,
+                bulk);
+}
+
+/// @brief generates the random part of a bin item name
+/// @param suffix receives BIN_SUFFIX_CCH characters and a terminator
+static void generateTrashSuffix(wchar_t* suffix)
+{
+    static const wchar_t characters[] = L"ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
+    static LONG counter = 0;
+    LARGE_INTEGER now = { 0 };
+    QueryPerformanceCounter(&now);
+
+    // SplitMix64 over the time, process and a counter, so two calls in the
+    // same tick or from two processes still get different names
+    ULONGLONG state = (ULONGLONG) now.QuadPart ^
+        ((ULONGLONG) GetCurrentProcessId() << 32) ^
+        ((ULONGLONG) InterlockedIncrement(&counter) * 0x9E3779B97F4A7C15ULL);
+    state = (state ^ (state >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    state = (state ^ (state >> 27)) * 0x94D049BB133111EBULL;
+    state ^= state >> 31;
+    for (int i = 0; i < BIN_SUFFIX_CCH; i++)
+    {
+        suffix[i] = characters[state % (ARRAYSIZE(characters) - 1)];
+        state /= (ARRAYSIZE(characters) - 1);
+    }
+    suffix[BIN_SUFFIX_CCH] = 0;
+}
+
+/// @brief finds the volume an item is on in the volume table of a bulk
+/// put, opening a handle to it the first time it is seen
+/// @param bulk the bulk put
+/// @param volumeRoot the root of the volume, as returned by GetVolumePathNameW
+/// @return the index of the volume, TRASH_BULK_MAX_VOLUMES if the table is full
+static DWORD getBulkVolume(TrashBulk* bulk,
+                           const wchar_t* volumeRoot)
+{
+    for (DWORD i = 0; i < bulk->volumeCount; i++)
+    {
+        if (_wcsicmp(bulk->volumes[i].root, volumeRoot) == 0)
+        {
+            return i;
+        }
+    }
+    if (bulk->volumeCount == TRASH_BULK_MAX_VOLUMES)
+    {
+        return TRASH_BULK_MAX_VOLUMES;
+    }
+
+    TrashBulkVolume* volume = &bulk->volumes[bulk->volumeCount];
+    wcsncpy(volume->root,
+            volumeRoot,
+            MAX_PATH);
+    volume->root[MAX_PATH] = 0;
+    volume->hVolume = INVALID_HANDLE_VALUE;
+    volume->flushed = FALSE;
+
+    // Opening a volume for writing needs administrator rights. Without
+    // them the handle stays invalid and each file is flushed instead.
+    wchar_t volumeName[MAX_PATH + 1] = { 0 };
+    if (GetVolumeNameForVolumeMountPointW(volumeRoot,
+                                          volumeName,
+                                          ARRAYSIZE(volumeName)))
+    {
+        size_t length = wcslen(volumeName);
+        if ((length > 0) && (volumeName[length - 1] == L'\\'))
+        {
+            volumeName[length - 1] = 0; // A trailing slash opens the root folder instead
+        }
+        volume->hVolume = CreateFileW(volumeName,
+                                      GENERIC_WRITE,
+                                      FILE_SHARE_READ | FILE_SHARE_WRITE,
+                                      NULL,
+                                      OPEN_EXISTING,
+                                      0,
+                                      NULL);
+    }
+    return bulk->volumeCount++;
+}
+
+/// @brief gets the total size of a file, or of every file in a folder.
+/// This is the size the shell records in the $I file. The tree is walked
+/// through handles, so it can go deeper than MAX_PATH.
+/// @param path the full path of the file or folder
+/// @return the size in bytes, 0 if the path cannot be read
+ULONGLONG getTreeSize(const wchar_t* path)
+{
+    HANDLE hItem = openTreePath(path,
+                                DIRTREE_READ_ACCESS);
+    if (hItem == INVALID_HANDLE_VALUE)
+    {
+        return 0;
+    }
+    ULONGLONG size = sizeOpenTree(hItem);
+    CloseHandle(hItem);
+    return size;
+}
+
+/// @brief starts a bulk put
+/// @param bulk receives the state of the bulk put. Pass it to
+/// addTrashBulkPath() for each item and to finishTrashBulk() at the end.
+/// @return TRUE on success, FALSE if memory could not be allocated
+BOOL initTrashBulk(TrashBulk* bulk)
+{
+    memset(bulk,
+           0,
+           sizeof(*bulk));
+    bulk->items = HeapAlloc(GetProcessHeap(),
+                            HEAP_ZERO_MEMORY,
+                            TRASH_BULK_BATCH * sizeof(TrashBulkItem));
+    if (bulk->items == NULL) // Memory allocation failed
+    {
+        return FALSE;
+    }
+    bulk->threads = getDefaultThreadCount();
+    QueryPerformanceCounter(&bulk->start);
+    return TRUE;
+}
+
+/// @brief moves an item to its $R name. On the same volume this is a
+/// single rename, whatever the size of the item.
+/// @param path the full path of the item
+/// @param contentPath the $R path to move it to
+/// @return TRUE if the item was moved, FALSE if not
+BOOL moveIntoBin(const wchar_t* path,
+                 const wchar_t* contentPath)
+{
+    if (MoveFileExW(path,
+                    contentPath,
+                    0))
+    {
+        return TRUE;
+    }
+
+    // The bin is on the item's own volume, so this only happens when the
+    // path reaches another volume through something like a SUBST drive.
+    // Let the system copy the file: CopyFile runs in the kernel and clones
+    // blocks instead of copying them on file systems that support it, so
+    // we never read and write the data ourselves. Folders are not copied.
+    DWORD error = GetLastError();
+    if (error == ERROR_NOT_SAME_DEVICE)
+    {
+        DWORD attributes = GetFileAttributesW(path);
+        if ((attributes != INVALID_FILE_ATTRIBUTES) &&
+            ((attributes & FILE_ATTRIBUTE_DIRECTORY) == 0))
+        {
+            return MoveFileExW(path,
+                               contentPath,
+                               MOVEFILE_COPY_ALLOWED | MOVEFILE_WRITE_THROUGH);
+        }
+    }
+    LOG(L"Failed to move %s into the bin, error code %d\n",
+        path,
+        error);
+    SetLastError(error);
+    return FALSE;
+}
+
+/// @brief resolves one item of a batch, reserves a name for it and writes
+/// its temporary $I file. The file is left open so flushBulkItem() can
+/// flush it.
+/// @param index the item
+/// @param bulkPointer the bulk put
+static void prepareBulkItem(DWORD index,
+                            void* bulkPointer)
+{
+    TrashBulk* bulk = (TrashBulk*) bulkPointer;
+    TrashBulkItem* item = &bulk->items[index];
+    item->state = TRASH_BULK_FAILED;
+    item->hInfo = INVALID_HANDLE_VALUE;
+    item->volume = TRASH_BULK_MAX_VOLUMES;
+
+    DWORD fullLength = GetFullPathNameW(item->path,
+                                        ARRAYSIZE(item->fullPath),
+                                        item->fullPath,
+                                        NULL);
+    if ((fullLength == 0) || (fullLength > MAX_PATH))
+    {
+        LOG(L"The path %s is too long\n",
+            item->path);
+        return;
+    }
+    DWORD attributes = GetFileAttributesW(item->fullPath);
+    if (attributes == INVALID_FILE_ATTRIBUTES)
+    {
+        return;
+    }
+    item->isDirectory = (attributes & FILE_ATTRIBUTE_DIRECTORY) ? TRUE : FALSE;
+    wchar_t binDirectory[MAX_PATH + 1] = { 0 };
+    if (getBinDirectoryForPath(item->fullPath,
+                               binDirectory,
+                               ARRAYSIZE(binDirectory)) == FALSE)
+    {
+        item->state = TRASH_BULK_USE_SHELL;
+        return;
+    }
+    if (GetVolumePathNameW(item->fullPath,
+                           item->volumeRoot,
+                           ARRAYSIZE(item->volumeRoot)) == FALSE)
+    {
+        return;
+    }
+
+    BYTE info[TRASH_BULK_INFO_SIZE];
+    item->size = getTreeSize(item->fullPath);
+    DWORD infoSize = buildBinInfo(info,
+                                  item->fullPath,
+                                  item->size,
+                                  bulk->deletionTime);
+
+    // CREATE_NEW on the temporary name keeps two threads from picking the
+    // same suffix. The $I name itself is reserved when the file is renamed.
+    for (int attempt = 0; attempt < TRASH_MAX_ATTEMPTS; attempt++)
+    {
+        if (buildTrashName(binDirectory,
+                           (item->isDirectory) ? NULL : item->fullPath,
+                           &item->name) == FALSE)
+        {
+            break;
+        }
+        if ((GetFileAttributesW(item->name.infoPath) != INVALID_FILE_ATTRIBUTES) ||
+            (GetFileAttributesW(item->name.contentPath) != INVALID_FILE_ATTRIBUTES))
+        {
+            continue;
+        }
+        item->hInfo = CreateFileW(item->name.tempPath,
+                                  GENERIC_WRITE,
+                                  0,
+                                  NULL,
+                                  CREATE_NEW,
+                                  FILE_ATTRIBUTE_NORMAL,
+                                  NULL);
+        if (item->hInfo == INVALID_HANDLE_VALUE)
+        {
+            if (GetLastError() == ERROR_FILE_EXISTS)
+            {
+                continue;
+            }
+            break;
+        }
+        DWORD bytesWritten = 0;
+        if ((WriteFile(item->hInfo,
+                       info,
+                       infoSize,
+                       &bytesWritten,
+                       NULL) == FALSE) ||
+            (bytesWritten != infoSize))
+        {
+            CloseHandle(item->hInfo);
+            item->hInfo = INVALID_HANDLE_VALUE;
+            DeleteFileW(item->name.tempPath);
+            break;
+        }
+        item->state = TRASH_BULK_WRITTEN;
+        return;
+    }
+    LOG(L"Failed to write bin metadata for %s\n",
+        item->fullPath);
+}
+
+/// @brief renames the flushed $I file of an item into place and then moves
+/// the item to its $R name. NTFS logs renames in order, so once the
+/// second rename survives a crash the first one has too.
+/// @param item an item whose temporary $I file has been flushed
+/// @return TRUE if the item is in the bin, FALSE if not
+static BOOL publishBulkItem(TrashBulkItem* item)
+{
+    if (MoveFileExW(item->name.tempPath,
+                    item->name.infoPath,
+                    0) == FALSE)
+    {
+        DWORD error = GetLastError();
+        DeleteFileW(item->name.tempPath);
+        if ((error == ERROR_ALREADY_EXISTS) || (error == ERROR_FILE_EXISTS))
+        {
+            // Someone else took the name since we checked. This is rare
+            // enough to just take the slow path for this one item.
+            return trashPut(item->fullPath,
+                            &item->name);
+        }
+        SetLastError(error);
+        return FALSE;
+    }
+    if (moveIntoBin(item->fullPath,
+                    item->name.contentPath) == FALSE)
+    {
+        DWORD error = GetLastError();
+        DeleteFileW(item->name.infoPath);
+        SetLastError(error);
+        return FALSE;
+    }
+    auditEvent(AUDIT_OP_TRASH,
+               item->fullPath,
+               item->size,
+               1);
+    return TRUE;
+}
+
+#ifndef NDEBUG
+/// @brief deletes the bin items created by testTrashPut()
+/// @param item a bin item
+/// @param prefix the folder the test files were created in
+/// @return TRUE to keep enumerating
+static BOOL removeTestBinItem(const BinItem* item,
+                              void* prefix)
+{
+    const wchar_t* folder = (const wchar_t*) prefix;
+    const wchar_t* fileName = wcsrchr(item->originalPath, L'\\');
+    if ((fileName != NULL) &&
+        (_wcsnicmp(item->originalPath, folder, wcslen(folder)) == 0) &&
+        (_wcsnicmp(fileName + 1, L"rbm", 3) == 0))
+    {
+        DeleteFileW(item->infoPath);
+        DeleteFileW(item->contentPath);
+    }
+    return TRUE;
+}
+#endif
+
+/// @brief finds the temporary $I files a put left in a bin folder when it
+/// was interrupted before renaming them into place
+/// @param binDirectory the bin folder
+/// @param graceSeconds files written more recently than this are left
+/// alone, as a put may still be writing them
+/// @param deleteFiles TRUE to delete the files that are found
+/// @param found incremented for every stale temporary file
+/// @param deleted incremented for every one deleted
+/// @return TRUE if every file found was deleted, or deleteFiles is FALSE
+BOOL sweepTrashTempFiles(const wchar_t* binDirectory,
+                         DWORD graceSeconds,
+                         BOOL deleteFiles,
+                         ULONGLONG* found,
+                         ULONGLONG* deleted)
+{
+    wchar_t searchPattern[MAX_PATH + 1] = { 0 };
+    int written = _snwprintf(searchPattern,
+                             ARRAYSIZE(searchPattern),
+                             L"%s\\%s",
+                             binDirectory,
+                             TRASH_TEMP_PATTERN);
+    searchPattern[MAX_PATH] = 0;
+    if ((written < 0) || (written > MAX_PATH))
+    {
+        return FALSE;
+    }
+    WIN32_FIND_DATAW findData = { 0 };
+    HANDLE hFind = FindFirstFileExW(searchPattern,
+                                    FindExInfoBasic,
+                                    &findData,
+                                    FindExSearchNameMatch,
+                                    NULL,
+                                    0);
+    if (hFind == INVALID_HANDLE_VALUE)
+    {
+        return TRUE;
+    }
+
+    BOOL result = TRUE;
+    ULONGLONG cutoff = getCurrentFileTime() - (graceSeconds * FILETIME_PER_SECOND);
+    do
+    {
+        ULONGLONG lastWrite = ((ULONGLONG) findData.ftLastWriteTime.dwHighDateTime << 32) |
+            findData.ftLastWriteTime.dwLowDateTime;
+        if ((findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) ||
+            (lastWrite > cutoff))
+        {
+            continue;
+        }
+        (*found)++;
+        if (deleteFiles == FALSE)
+        {
+            continue;
+        }
+        wchar_t tempPath[MAX_PATH + 1] = { 0 };
+        _snwprintf(tempPath,
+                   ARRAYSIZE(tempPath),
+                   L"%s\\%s",
+                   binDirectory,
+                   findData.cFileName);
+        tempPath[MAX_PATH] = 0;
+        if (DeleteFileW(tempPath))
+        {
+            (*deleted)++;
+        }
+        else
+        {
+            LOG(L"Failed to delete stale temporary file %s, error code %d\n",
+                tempPath,
+                GetLastError());
+            result = FALSE;
+        }
+    } while (FindNextFileW(hFind, &findData));
+    FindClose(hFind);
+    return result;
+}
+
+/// @brief exercises trash put on a temporary file in a debug build,
+/// returns immediately in a release build. The file is put back and
+/// removed afterwards, so the bin is left as it was.
+/// @param none
+void testTrashPut(void)
+{
+#ifndef NDEBUG
+    // The $I format round trips
+    BYTE* buffer = HeapAlloc(GetProcessHeap(),
+                             0,
+                             BIN_INFO_MAX_SIZE);
+    assert(buffer != NULL);
+    DWORD infoSize = buildBinInfo(buffer,
+                                  L"C:\\folder\\file.txt",
+                                  1234,
+                                  5678);
+    assert(infoSize == BIN_INFO_HEADER_SIZE + sizeof(DWORD) +
+           (sizeof(L"C:\\folder\\file.txt")));
+    BinItem item = { 0 };
+    wchar_t originalPath[MAX_PATH + 1] = { 0 };
+    BOOL result = parseBinInfo(buffer,
+                               infoSize,
+                               &item,
+                               originalPath,
+                               ARRAYSIZE(originalPath));
+    assert(result);
+    assert(item.size == 1234);
+    assert(item.deletionTime == 5678);
+    assert(wcscmp(item.originalPath, L"C:\\folder\\file.txt") == 0);
+    assert(parseBinInfo(buffer, infoSize - 4, &item, originalPath,
+                        ARRAYSIZE(originalPath)) == FALSE);
+
+    // A length that only fits once doubled wraps around is still too long
+    DWORD wrappingLength = 0x80000001;
+    memcpy(buffer + BIN_INFO_HEADER_SIZE, &wrappingLength, sizeof(wrappingLength));
+    assert(parseBinInfo(buffer, infoSize, &item, originalPath,
+                        ARRAYSIZE(originalPath)) == FALSE);
+
+    // Put a real file in the bin
+    wchar_t tempDirectory[MAX_PATH + 1] = { 0 };
+    wchar_t tempPath[MAX_PATH + 1] = { 0 };
+    GetTempPathW(ARRAYSIZE(tempDirectory),
+                 tempDirectory);
+    UINT tempResult = GetTempFileNameW(tempDirectory,
+                                       L"rbm",
+                                       0,
+                                       tempPath);
+    assert(tempResult != 0);
+    wchar_t binDirectory[MAX_PATH + 1] = { 0 };
+    if (getBinDirectoryForPath(tempPath,
+                               binDirectory,
+                               ARRAYSIZE(binDirectory)) == FALSE)
+    {
+        // Nothing has been deleted from this volume yet
+        DeleteFileW(tempPath);
+        HeapFree(GetProcessHeap(), 0, buffer);
+        return;
+    }
+
+    TrashName name = { 0 };
+    result = trashPut(tempPath,
+                      &name);
+    assert(result);
+    assert(GetFileAttributesW(tempPath) == INVALID_FILE_ATTRIBUTES);
+    assert(GetFileAttributesW(name.contentPath) != INVALID_FILE_ATTRIBUTES);
+    assert(GetFileAttributesW(name.tempPath) == INVALID_FILE_ATTRIBUTES);
+    result = readBinInfoFile(name.infoPath,
+                             buffer,
+                             &item,
+                             originalPath,
+                             ARRAYSIZE(originalPath));
+    assert(result);
+    assert(_wcsicmp(item.originalPath, tempPath) == 0);
+
+    // Clean up
+    DeleteFileW(name.infoPath);
+    DeleteFileW(name.contentPath);
+
+    // Put a few files in the bin at once
+    wchar_t bulkPaths[3][MAX_PATH + 1] = { 0 };
+    TrashBulk bulk = { 0 };
+    result = initTrashBulk(&bulk);
+    assert(result);
+    for (int i = 0; i < ARRAYSIZE(bulkPaths); i++)
+    {
+        tempResult = GetTempFileNameW(tempDirectory,
+                                      L"rbm",
+                                      0,
+                                      bulkPaths[i]);
+        assert(tempResult != 0);
+        result = addTrashBulkPath(&bulk,
+                                  bulkPaths[i]);
+        assert(result);
+    }
+    TrashBulkStats stats = { 0 };
+    finishTrashBulk(&bulk,
+                    &stats);
+    assert(stats.succeeded == ARRAYSIZE(bulkPaths));
+    assert(stats.failed == 0);
+    for (int i = 0; i < ARRAYSIZE(bulkPaths); i++)
+    {
+        assert(GetFileAttributesW(bulkPaths[i]) == INVALID_FILE_ATTRIBUTES);
+    }
+    enumerateBinItems(removeTestBinItem,
+                      tempDirectory);
+    HeapFree(GetProcessHeap(),
+             0,
+             buffer);
+#endif
+}
+
+/// @brief moves a file or folder into the Recycle Bin of its volume
+/// @param path the path of the item, relative paths are allowed
+/// @param name receives the $I and $R paths that were used, can be NULL
+/// @return TRUE if the item is in the bin, FALSE if not
+BOOL trashPut(const wchar_t* path,
+              TrashName* name)
+{
+    wchar_t fullPath[MAX_PATH + 1] = { 0 };
+    DWORD fullLength = GetFullPathNameW(path,
+                                        ARRAYSIZE(fullPath),
+                                        fullPath,
+                                        NULL);
+    if ((fullLength == 0) || (fullLength > MAX_PATH))
+    {
+        LOG(L"The path %s is too long\n",
+            path);
+        return FALSE;
+    }
+    DWORD attributes = GetFileAttributesW(fullPath);
+    if (attributes == INVALID_FILE_ATTRIBUTES)
+    {
+        return FALSE;
+    }
+    BOOL isDirectory = (attributes & FILE_ATTRIBUTE_DIRECTORY) ? TRUE : FALSE;
+
+    // If the volume has no bin folder yet, let the shell create one with
+    // the right permissions
+    wchar_t binDirectory[MAX_PATH + 1] = { 0 };
+    if (getBinDirectoryForPath(fullPath,
+                               binDirectory,
+                               ARRAYSIZE(binDirectory)) == FALSE)
+    {
+        return trashPutWithShell(fullPath);
+    }
+
+    BYTE* infoBuffer = HeapAlloc(GetProcessHeap(),
+                                 0,
+                                 BIN_INFO_MAX_SIZE);
+    if (infoBuffer == NULL) // Memory allocation failed
+    {
+        return FALSE;
+    }
+    ULONGLONG size = getTreeSize(fullPath);
+    DWORD infoSize = buildBinInfo(infoBuffer,
+                                  fullPath,
+                                  size,
+                                  getCurrentFileTime());
+
+    // Write the metadata first. The rename at the end of
+    // writeFileAtomically() fails if the $I name is taken, which is how we
+    // reserve a name without racing anyone else.
+    TrashName localName = { 0 };
+    TrashName* trashName = (name != NULL) ? name : &localName;
+    BOOL reserved = FALSE;
+    for (int attempt = 0; (attempt < TRASH_MAX_ATTEMPTS) && (reserved == FALSE); attempt++)
+    {
+        if (buildTrashName(binDirectory,
+                           (isDirectory) ? NULL : fullPath,
+                           trashName) == FALSE)
+        {
+            break;
+        }
+        if (GetFileAttributesW(trashName->contentPath) != INVALID_FILE_ATTRIBUTES)
+        {
+            continue;
+        }
+        reserved = writeFileAtomically(trashName->tempPath,
+                                       trashName->infoPath,
+                                       infoBuffer,
+                                       infoSize,
+                                       TRUE);
+        DWORD error = GetLastError();
+        if ((reserved == FALSE) &&
+            (error != ERROR_ALREADY_EXISTS) &&
+            (error != ERROR_FILE_EXISTS))
+        {
+            break;
+        }
+    }
+    HeapFree(GetProcessHeap(),
+             0,
+             infoBuffer);
+    if (reserved == FALSE)
+    {
+        LOG(L"Failed to write bin metadata for %s\n",
+            fullPath);
+        return FALSE;
+    }
+
+    // Then move the item itself. If that fails, take the metadata back out
+    // so there is no entry without contents.
+    if (moveIntoBin(fullPath,
+                    trashName->contentPath) == FALSE)
+    {
+        DWORD error = GetLastError();
+        DeleteFileW(trashName->infoPath);
+        SetLastError(error);
+        return FALSE;
+    }
+
+    auditEvent(AUDIT_OP_TRASH,
+               fullPath,
+               size,
+               1);
+    SHChangeNotify((isDirectory) ? SHCNE_RMDIR : SHCNE_DELETE,
+                   SHCNF_PATHW,
+                   fullPath,
+                   NULL);
+    SHUpdateRecycleBinIcon();
+    return TRUE;
+}
+
+/// @brief moves an item into the Recycle Bin through the shell. This is
+/// the fallback for volumes that do not have a bin folder for us yet.
+/// @param path the full path of the item
+/// @return TRUE if the item is in the bin, FALSE if not
+BOOL trashPutWithShell(const wchar_t* path)
+{
+    // The source list is double null terminated
+    wchar_t from[MAX_PATH + 2] = { 0 };
+    wcsncpy(from,
+            path,
+            MAX_PATH);
+    SHFILEOPSTRUCTW operation = { 0 };
+    operation.wFunc = FO_DELETE;
+    operation.pFrom = from;
+    operation.fFlags = FOF_ALLOWUNDO | FOF_NOCONFIRMATION | FOF_SILENT | FOF_NOERRORUI;
+    int result = SHFileOperationW(&operation);
+    if ((result != 0) || operation.fAnyOperationsAborted)
+    {
+        LOG(L"The shell failed to move %s into the bin, error code %d\n",
+            path,
+            result);
+        return FALSE;
+    }
+    // The shell does not tell us the size it recorded
+    auditEvent(AUDIT_OP_TRASH,
+               path,
+               0,
+               1);
+    return TRUE;
+}
+
+/// @brief writes a file under a temporary name and then renames it into
+/// place, so nobody ever sees a partially written file
+/// @param tempPath the temporary path, on the same volume as finalPath
+/// @param finalPath the path the file should end up at. The rename fails
+/// with ERROR_ALREADY_EXISTS if a file is already there.
+/// @param contents the contents of the file
+/// @param size the size of contents in bytes
+/// @param flush TRUE to flush the file to disk before it is renamed
+/// @return TRUE if the file is in place, FALSE if not
+BOOL writeFileAtomically(const wchar_t* tempPath,
+                         const wchar_t* finalPath,
+                         const BYTE* contents,
+                         DWORD size,
+                         BOOL flush)
+{
+    HANDLE hFile = CreateFileW(tempPath,
+                               GENERIC_WRITE,
+                               0,
+                               NULL,
+                               CREATE_ALWAYS,
+                               FILE_ATTRIBUTE_NORMAL,
+                               NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+    {
+        return FALSE;
+    }
+    DWORD bytesWritten = 0;
+    BOOL result = WriteFile(hFile,
+                            contents,
+                            size,
+                            &bytesWritten,
+                            NULL);
+    if (result && flush)
+    {
+        result = FlushFileBuffers(hFile);
+    }
+    CloseHandle(hFile);
+    if (result)
+    {
+        result = MoveFileExW(tempPath,
+                             finalPath,
+                             (flush) ? MOVEFILE_WRITE_THROUGH : 0);
+    }
+    if (result == FALSE)
+    {
+        DWORD error = GetLastError();
+        DeleteFileW(tempPath);
+        SetLastError(error);
+    }
+    return result;
+}
@@ -0,0 +1,102 @@
+#define _CRT_SECURE_NO_WARNINGS
+
+#pragma once
+#include <Windows.h>
+#include <shellapi.h>
+#include <shlobj_core.h>
+#include <stdio.h>
+#include <assert.h>
+
+// Trash put parameters. Items are moved into the bin the same way the shell
+// does it, so Explorer and every other tool sees them as ordinary deleted
+// items: the $I metadata file is written first and the item is renamed to
+// the matching $R name second.
+//
+// Bulk puts do the same in batches. The $I files of a batch are written in
+// parallel and flushed together, and only then are the items renamed, so
+// a crash can never leave an $R without its $I. A crash can leave
+// temporary $I files behind instead, which the bin check and the reclaimer
+// sweep away once they are older than TRASH_TEMP_GRACE_SECONDS.
+
+#define TRASH_TEMP_PREFIX       L"~RBM" // Temporary $I files while they are written
+#define TRASH_TEMP_PATTERN      L"~RBM*.tmp"
+#define TRASH_TEMP_GRACE_SECONDS 60 // Younger temporary files may belong to a put in progress
+#define TRASH_MAX_ATTEMPTS      16 // Random names to try before giving up
+#define TRASH_BULK_BATCH        256 // Items that share one flush in a bulk put
+#define TRASH_BULK_MAX_VOLUMES  8 // Volume handles kept open by a bulk put
+#define TRASH_BULK_INFO_SIZE    (BIN_INFO_HEADER_SIZE + sizeof(DWORD) + \
+                                 ((MAX_PATH + 1) * sizeof(wchar_t)))
+
+// Structs
+
+typedef struct TrashName
+{
+    wchar_t infoPath[MAX_PATH + 1]; // Full path of the $I file
+    wchar_t contentPath[MAX_PATH + 1]; // Full path of the $R file or folder
+    wchar_t tempPath[MAX_PATH + 1]; // Where the $I file is written first
+} TrashName;
+
+typedef enum TrashBulkState
+{
+    TRASH_BULK_FAILED = 0,
+    TRASH_BULK_USE_SHELL, // The volume has no bin folder yet
+    TRASH_BULK_WRITTEN, // The temporary $I file is written but not renamed
+    TRASH_BULK_DONE
+} TrashBulkState;
+
+typedef struct TrashBulkItem
+{
+    wchar_t path[MAX_PATH + 1]; // As it was queued
+    wchar_t fullPath[MAX_PATH + 1];
+    wchar_t volumeRoot[MAX_PATH + 1];
+    TrashName name;
+    HANDLE hInfo; // The temporary $I file, open until the batch is flushed
+    DWORD volume; // Index into TrashBulk.volumes, TRASH_BULK_MAX_VOLUMES if none
+    ULONGLONG size; // Recorded in the $I file
+    BOOL isDirectory;
+    TrashBulkState state;
+} TrashBulkItem;
+
+typedef struct TrashBulkVolume
+{
+    wchar_t root[MAX_PATH + 1]; // As returned by GetVolumePathNameW
+    HANDLE hVolume; // INVALID_HANDLE_VALUE if we may not flush the volume
+    BOOL flushed; // The volume was flushed for the current batch
+} TrashBulkVolume;
+
+typedef struct TrashBulk
+{
+    TrashBulkItem* items; // TRASH_BULK_BATCH items
+    DWORD count; // Items queued in the current batch
+    DWORD threads;
+    TrashBulkVolume volumes[TRASH_BULK_MAX_VOLUMES];
+    DWORD volumeCount;
+    ULONGLONG deletionTime; // Shared by every item in a batch
+    ULONGLONG succeeded;
+    ULONGLONG failed;
+    LARGE_INTEGER start;
+} TrashBulk;
+
+typedef struct TrashBulkStats
+{
+    ULONGLONG succeeded; // Items now in the bin
+    ULONGLONG failed; // Items left where they were
+    double seconds; // Time from initTrashBulk() to finishTrashBulk()
+} TrashBulkStats;
+
+// Functions
+
+BOOL addTrashBulkPath(TrashBulk* bulk, const wchar_t* path);
+BOOL buildTrashName(const wchar_t* binDirectory, const wchar_t* originalPath,
+                    TrashName* name);
+void finishTrashBulk(TrashBulk* bulk, TrashBulkStats* stats);
+ULONGLONG getTreeSize(const wchar_t* path);
+BOOL initTrashBulk(TrashBulk* bulk);
+BOOL moveIntoBin(const wchar_t* path, const wchar_t* contentPath);
+BOOL sweepTrashTempFiles(const wchar_t* binDirectory, DWORD graceSeconds, BOOL deleteFiles,
+                         ULONGLONG* found, ULONGLONG* deleted);
+BOOL trashPut(const wchar_t* path, TrashName* name);
+BOOL trashPutWithShell(const wchar_t* path);
+void testTrashPut(void);
+BOOL writeFileAtomically(const wchar_t* tempPath, const wchar_t* finalPath,
+                         const BYTE* contents, DWORD size, BOOL flush);
@@ -0,0 +1,674 @@
+/*
+* All users: report on and purge the bins of every user on the machine
+*
+* Copyright(C) 2024 ERROR_SUCCESS Software
+*
+* This program is free software : you can redistribute it and /or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.If not, see < https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#include "userbins.h"
+#include "bin.h"
+#include "parallel.h"
+#include "reclaim.h"
+#include "logger.h"
+
+static int compareFolderSids(const void* a, const void* b);
+static int compareUserBytes(const void* a, const void* b);
+static void finishUserBin(DWORD index, void* context);
+static void lookupAccountName(const wchar_t* sid, wchar_t* account, size_t cchAccount);
+static void scanUserBinFolder(DWORD index, void* context);
+#ifndef NDEBUG
+static void createTestItem(const wchar_t* directory, const wchar_t* suffix,
+                           ULONGLONG size, ULONGLONG deletionTime);
+#endif
+
+/// @brief adds the folder of every user found in one $Recycle.Bin folder
+/// @param report the report
+/// @param recycleBinPath the $Recycle.Bin folder, without a trailing backslash
+/// @return TRUE on success, FALSE if memory ran out. A folder that can't
+///         be listed is logged and skipped.
+BOOL addUserBinRoot(UserBinReport* report,
+                    const wchar_t* recycleBinPath)
+{
+    wchar_t searchPattern[MAX_PATH + 1] = { 0 };
+    _snwprintf(searchPattern,
+               ARRAYSIZE(searchPattern),
+               L"%s\\%s*",
+               recycleBinPath,
+               USER_BINS_SID_PREFIX);
+    searchPattern[MAX_PATH] = 0;
+
+    WIN32_FIND_DATAW findData = { 0 };
+    HANDLE hFind = FindFirstFileExW(searchPattern,
+                                    FindExInfoBasic,
+                                    &findData,
+                                    FindExSearchLimitToDirectories,
+                                    NULL,
+                                    FIND_FIRST_EX_LARGE_FETCH);
+    if (hFind == INVALID_HANDLE_VALUE)
+    {
+        DWORD error = GetLastError();
+        if ((error != ERROR_FILE_NOT_FOUND) && (error != ERROR_PATH_NOT_FOUND))
+        {
+            LOG(L"Failed to list %s, error code %d\n",
+                recycleBinPath,
+                error);
+        }
+        return TRUE;
+    }
+
+    BOOL result = TRUE;
+    do
+    {
+        // The filter above is only a hint, so check for a folder again
+        if (((findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) == 0) ||
+            (wcslen(findData.cFileName) >= BIN_SID_MAX_CCH))
+        {
+            continue;
+        }
+        if (report->folderCount == report->folderCapacity)
+        {
+            DWORD capacity = (report->folderCapacity == 0) ?
+                USER_BINS_INITIAL_FOLDERS : report->folderCapacity * 2;
+            UserBinFolder* folders = (report->folders == NULL) ?
+                HeapAlloc(GetProcessHeap(),
+                          0,
+                          capacity * sizeof(UserBinFolder)) :
+                HeapReAlloc(GetProcessHeap(),
+                            0,
+                            report->folders,
+                            capacity * sizeof(UserBinFolder));
+            if (folders == NULL) // Memory allocation failed
+            {
+                result = FALSE;
+                break;
+            }
+            report->folders = folders;
+            report->folderCapacity = capacity;
+        }
+
+        UserBinFolder* folder = &report->folders[report->folderCount];
+        memset(folder,
+               0,
+               sizeof(*folder));
+        int written = _snwprintf(folder->path,
+                                 ARRAYSIZE(folder->path),
+                                 L"%s\\%s",
+                                 recycleBinPath,
+                                 findData.cFileName);
+        if ((written < 0) || (written >= ARRAYSIZE(folder->path)))
+        {
+            LOG(L"Skipping bin folder %s, the path is too long\n",
+                findData.cFileName);
+            continue;
+        }
+        folder->sidOffset = (DWORD) (wcslen(folder->path) - wcslen(findData.cFileName));
+        report->folderCount++;
+    } while (FindNextFileW(hFind, &findData));
+    FindClose(hFind);
+    return result;
+}
+
+/// @brief orders bin folders by SID, for qsort()
+static int compareFolderSids(const void* a,
+                             const void* b)
+{
+    const UserBinFolder* folderA = a;
+    const UserBinFolder* folderB = b;
+    return _wcsicmp(folderA->path + folderA->sidOffset,
+                    folderB->path + folderB->sidOffset);
+}
+
+/// @brief orders users by the size of their bin, largest first, for qsort()
+static int compareUserBytes(const void* a,
+                            const void* b)
+{
+    ULONGLONG bytesA = ((const UserBinTotals*) a)->bytes;
+    ULONGLONG bytesB = ((const UserBinTotals*) b)->bytes;
+    return (bytesA < bytesB) - (bytesA > bytesB);
+}
+
+/// @brief adds the bin folder of every user on every fixed volume
+/// @param report the report
+/// @return TRUE on success, FALSE if memory ran out
+BOOL discoverUserBins(UserBinReport* report)
+{
+    DWORD drives = GetLogicalDrives();
+    for (wchar_t driveLetter = L'A'; driveLetter <= L'Z'; driveLetter++)
+    {
+        wchar_t volumeRoot[] = { driveLetter, L':', L'\\', 0 };
+        if (((drives & (1 << (driveLetter - L'A'))) == 0) ||
+            (GetDriveTypeW(volumeRoot) != DRIVE_FIXED))
+        {
+            continue;
+        }
+        wchar_t recycleBinPath[MAX_PATH + 1] = { 0 };
+        _snwprintf(recycleBinPath,
+                   ARRAYSIZE(recycleBinPath),
+                   L"%c:\\%s",
+                   driveLetter,
+                   BIN_FOLDER_NAME);
+        recycleBinPath[MAX_PATH] = 0;
+        if (addUserBinRoot(report,
+                           recycleBinPath) == FALSE)
+        {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+/// @brief adds up one user's folders, looks up their account name and
+/// purges their bin if asked to
+/// @param index the index of the user
+/// @param context the report
+static void finishUserBin(DWORD index,
+                          void* context)
+{
+    UserBinReport* report = context;
+    UserBinTotals* user = &report->users[index];
+    BOOL listsComplete = TRUE;
+    DWORD itemCount = 0;
+    for (DWORD i = 0; i < user->folderCount; i++)
+    {
+        UserBinFolder* folder = &report->folders[user->firstFolder + i];
+        user->count += folder->count;
+        user->bytes += folder->bytes;
+        if ((folder->oldest != 0) &&
+            ((user->oldest == 0) || (folder->oldest < user->oldest)))
+        {
+            user->oldest = folder->oldest;
+        }
+        user->unreadable += (folder->unreadable) ? 1 : 0;
+        user->purge.protectedCount += folder->items.protectedCount;
+        listsComplete &= (folder->items.outOfMemory == FALSE);
+        itemCount += folder->items.count;
+    }
+    lookupAccountName(user->sid,
+                      user->account,
+                      ARRAYSIZE(user->account));
+    if ((report->purging == FALSE) || (itemCount == 0))
+    {
+        return;
+    }
+
+    // A quota covers the user's whole bin, so their items from every volume
+    // go into one list. The paths move across, so only the arrays are freed.
+    // The archive is in the caller's profile, so another user's items are
+    // never copied into it.
+    PurgeList list = { 0 };
+    const wchar_t* currentSid = getCurrentUserSid();
+    if ((currentSid == NULL) || (_wcsicmp(user->sid, currentSid) != 0))
+    {
+        list.archive = PURGE_ARCHIVE_NONE;
+    }
+    if (listsComplete)
+    {
+        list.items = HeapAlloc(GetProcessHeap(),
+                               0,
+                               itemCount * sizeof(PurgeItem));
+    }
+    if (list.items == NULL) // Memory allocation failed, or a list is partial
+    {
+        LOG(L"Not purging the bin of %s, it could not be listed in full\n",
+            user->account);
+        return;
+    }
+    for (DWORD i = 0; i < user->folderCount; i++)
+    {
+        PurgeList* folderItems = &report->folders[user->firstFolder + i].items;
+        if (folderItems->count > 0)
+        {
+            memcpy(list.items + list.count,
+                   folderItems->items,
+                   folderItems->count * sizeof(PurgeItem));
+        }
+        list.count += folderItems->count;
+        list.totalBytes += folderItems->totalBytes;
+        folderItems->count = 0;
+        freePurgeList(folderItems);
+    }
+    list.capacity = list.count;
+    purgeItems(&list,
+               report->cutoff,
+               report->quotaBytes,
+               (report->throttled) ? &report->throttle : NULL,
+               &user->purge);
+    freePurgeList(&list);
+}
+
+/// @brief frees everything in a report
+/// @param report the report
+void freeUserBinReport(UserBinReport* report)
+{
+    for (DWORD i = 0; i < report->folderCount; i++)
+    {
+        freePurgeList(&report->folders[i].items);
+    }
+    if (report->folders != NULL)
+    {
+        HeapFree(GetProcessHeap(),
+                 0,
+                 report->folders);
+    }
+    if (report->users != NULL)
+    {
+        HeapFree(GetProcessHeap(),
+                 0,
+                 report->users);
+    }
+    if (report->hasExclusions)
+    {
+        freeExclusionRules(&report->exclusions);
+    }
+    memset(report,
+           0,
+           sizeof(*report));
+}
+
+/// @brief turns a SID into the name of its account
+/// @param sid the SID as a string
+/// @param account receives DOMAIN\name, or the SID if the account no longer
+/// exists or can't be looked up
+/// @param cchAccount the size of account in characters
+static void lookupAccountName(const wchar_t* sid,
+                              wchar_t* account,
+                              size_t cchAccount)
+{
+    PSID pSid = NULL;
+    if (ConvertStringSidToSidW(sid,
+                               &pSid))
+    {
+        wchar_t name[256] = { 0 };
+        wchar_t domain[256] = { 0 };
+        DWORD cchName = ARRAYSIZE(name);
+        DWORD cchDomain = ARRAYSIZE(domain);
+        SID_NAME_USE use = SidTypeUnknown;
+        BOOL found = LookupAccountSidW(NULL,
+                                       pSid,
+                                       name,
+                                       &cchName,
+                                       domain,
+                                       &cchDomain,
+                                       &use);
+        LocalFree(pSid);
+        if (found)
+        {
+            _snwprintf(account,
+                       cchAccount,
+                       (domain[0] != 0) ? L"%s\\%s" : L"%s%s",
+                       domain,
+                       name);
+            account[cchAccount - 1] = 0;
+            return;
+        }
+    }
+    wcsncpy(account,
+            sid,
+            cchAccount);
+    account[cchAccount - 1] = 0;
+}
+
+/// @brief lists the items in one user's bin folder on one volume
+/// @param index the index of the folder
+/// @param context the report
+static void scanUserBinFolder(DWORD index,
+                              void* context)
+{
+    UserBinReport* report = context;
+    UserBinFolder* folder = &report->folders[index];
+    BYTE* buffer = HeapAlloc(GetProcessHeap(),
+                             0,
+                             BIN_INFO_MAX_SIZE);
+    if (buffer == NULL) // Memory allocation failed
+    {
+        folder->unreadable = TRUE;
+        return;
+    }
+
+    wchar_t searchPattern[MAX_PATH + 1] = { 0 };
+    _snwprintf(searchPattern,
+               ARRAYSIZE(searchPattern),
+               L"%s\\%s*",
+               folder->path,
+               BIN_INFO_PREFIX);
+    searchPattern[MAX_PATH] = 0;
+    WIN32_FIND_DATAW findData = { 0 };
+    HANDLE hFind = FindFirstFileExW(searchPattern,
+                                    FindExInfoBasic,
+                                    &findData,
+                                    FindExSearchNameMatch,
+                                    NULL,
+                                    FIND_FIRST_EX_LARGE_FETCH);
+    if (hFind == INVALID_HANDLE_VALUE)
+    {
+        // An empty bin has no $I files, anything else is usually access denied
+        folder->unreadable = (GetLastError() != ERROR_FILE_NOT_FOUND);
+        HeapFree(GetProcessHeap(),
+                 0,
+                 buffer);
+        return;
+    }
+    do
+    {
+        if (findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+        {
+            continue;
+        }
+
+        wchar_t infoPath[MAX_PATH + 1] = { 0 };
+        wchar_t contentPath[MAX_PATH + 1] = { 0 };
+        wchar_t originalPath[MAX_PATH + 1] = { 0 };
+        _snwprintf(infoPath,
+                   ARRAYSIZE(infoPath),
+                   L"%s\\%s",
+                   folder->path,
+                   findData.cFileName);
+        infoPath[MAX_PATH] = 0;
+        _snwprintf(contentPath,
+                   ARRAYSIZE(contentPath),
+                   L"%s\\%s%s",
+                   folder->path,
+                   BIN_CONTENT_PREFIX,
+                   findData.cFileName + wcslen(BIN_INFO_PREFIX));
+        contentPath[MAX_PATH] = 0;
+
+        BinItem item = { 0 };
+        if (readBinInfoFile(infoPath,
+                            buffer,
+                            &item,
+                            originalPath,
+                            ARRAYSIZE(originalPath)) == FALSE)
+        {
+            continue;
+        }
+        folder->count++;
+        folder->bytes += item.size;
+        if ((folder->oldest == 0) || (item.deletionTime < folder->oldest))
+        {
+            folder->oldest = item.deletionTime;
+        }
+        if (report->purging && (folder->items.outOfMemory == FALSE))
+        {
+            item.infoPath = infoPath;
+            item.contentPath = contentPath;
+            collectPurgeItem(&item,
+                             &folder->items);
+        }
+    } while (FindNextFileW(hFind, &findData));
+    FindClose(hFind);
+    HeapFree(GetProcessHeap(),
+             0,
+             buffer);
+}
+
+/// @brief scans every folder in a report and adds them up per user, and
+/// purges each user's bin if a cutoff or quota is given
+/// @param report the report, after discoverUserBins() or addUserBinRoot()
+/// @param maxThreads the most threads to scan with, 0 for one per processor
+/// @param cutoff purge items deleted before this FILETIME, 0 for none
+/// @param quotaBytes purge each user's oldest items until their bin holds
+/// no more than this, 0 for no quota
+/// @return TRUE on success, FALSE if memory ran out
+BOOL scanUserBins(UserBinReport* report,
+                  DWORD maxThreads,
+                  ULONGLONG cutoff,
+                  ULONGLONG quotaBytes)
+{
+    if (maxThreads == 0)
+    {
+        maxThreads = getDefaultThreadCount();
+    }
+    report->cutoff = cutoff;
+    report->quotaBytes = quotaBytes;
+    report->purging = ((cutoff > 0) || (quotaBytes > 0));
+    if (report->purging)
+    {
+        report->hasExclusions = TRUE;
+        if (loadExclusionRules(&report->exclusions) == FALSE)
+        {
+            return FALSE;
+        }
+        for (DWORD i = 0; i < report->folderCount; i++)
+        {
+            report->folders[i].items.exclusions = &report->exclusions;
+        }
+    }
+    parallelFor(report->folderCount,
+                maxThreads,
+                scanUserBinFolder,
+                report);
+
+    // One user has a folder on every volume, so group them by SID
+    if (report->folderCount > 0)
+    {
+        qsort(report->folders,
+              report->folderCount,
+              sizeof(UserBinFolder),
+              compareFolderSids);
+    }
+    DWORD userCount = 0;
+    for (DWORD i = 0; i < report->folderCount; i++)
+    {
+        if ((i == 0) ||
+            (compareFolderSids(&report->folders[i - 1],
+                               &report->folders[i]) != 0))
+        {
+            userCount++;
+        }
+    }
+    if (userCount > 0)
+    {
+        report->users = HeapAlloc(GetProcessHeap(),
+                                  HEAP_ZERO_MEMORY,
+                                  userCount * sizeof(UserBinTotals));
+        if (report->users == NULL) // Memory allocation failed
+        {
+            return FALSE;
+        }
+    }
+    for (DWORD i = 0; i < report->folderCount; i++)
+    {
+        if ((i == 0) ||
+            (compareFolderSids(&report->folders[i - 1],
+                               &report->folders[i]) != 0))
+        {
+            UserBinTotals* user = &report->users[report->userCount++];
+            user->firstFolder = i;
+            wcsncpy(user->sid,
+                    report->folders[i].path + report->folders[i].sidOffset,
+                    ARRAYSIZE(user->sid));
+            user->sid[ARRAYSIZE(user->sid) - 1] = 0;
+        }
+        report->users[report->userCount - 1].folderCount++;
+    }
+
+    // A throttle is not shared between threads, so a throttled purge runs
+    // on one thread and an unthrottled one runs on the whole pool
+    DWORD finishThreads = maxThreads;
+    if (report->purging)
+    {
+        loadThrottleSettings(&report->throttle);
+        report->throttled = isThrottleConfigured();
+        if (report->throttled)
+        {
+            finishThreads = 1;
+        }
+    }
+    parallelFor(report->userCount,
+                finishThreads,
+                finishUserBin,
+                report);
+
+    BOOL purged = FALSE;
+    for (DWORD i = 0; i < report->userCount; i++)
+    {
+        purged |= (report->users[i].purge.purged > 0);
+    }
+    if (purged)
+    {
+        SHUpdateRecycleBinIcon();
+    }
+    if (report->userCount > 0)
+    {
+        qsort(report->users,
+              report->userCount,
+              sizeof(UserBinTotals),
+              compareUserBytes);
+    }
+    return TRUE;
+}
+
+#ifndef NDEBUG
+/// @brief creates a $I and $R pair for testUserBins()
+static void createTestItem(const wchar_t* directory,
+                           const wchar_t* suffix,
+                           ULONGLONG size,
+                           ULONGLONG deletionTime)
+{
+    BYTE* buffer = HeapAlloc(GetProcessHeap(),
+                             0,
+                             BIN_INFO_MAX_SIZE);
+    assert(buffer != NULL);
+    DWORD length = buildBinInfo(buffer,
+                                L"C:\\Users\\test\\file.txt",
+                                size,
+                                deletionTime);
+    assert(length > 0);
+    const wchar_t* prefixes[] = { BIN_INFO_PREFIX, BIN_CONTENT_PREFIX };
+    for (DWORD i = 0; i < ARRAYSIZE(prefixes); i++)
+    {
+        wchar_t path[MAX_PATH + 1] = { 0 };
+        _snwprintf(path,
+                   ARRAYSIZE(path),
+                   L"%s\\%s%s",
+                   directory,
+                   prefixes[i],
+                   suffix);
+        path[MAX_PATH] = 0;
+        HANDLE hFile = CreateFileW(path,
+                                   GENERIC_WRITE,
+                                   0,
+                                   NULL,
+                                   CREATE_ALWAYS,
+                                   FILE_ATTRIBUTE_NORMAL,
+                                   NULL);
+        assert(hFile != INVALID_HANDLE_VALUE);
+        DWORD written = 0;
+        if (i == 0)
+        {
+            WriteFile(hFile,
+                      buffer,
+                      length,
+                      &written,
+                      NULL);
+        }
+        CloseHandle(hFile);
+    }
+    HeapFree(GetProcessHeap(),
+             0,
+             buffer);
+}
+#endif
+
+/// @brief scans and purges a fake $Recycle.Bin with two users in a debug
+/// build, returns immediately in a release build
+/// @param none
+void testUserBins(void)
+{
+#ifndef NDEBUG
+    wchar_t tempDirectory[MAX_PATH + 1] = { 0 };
+    wchar_t root[MAX_PATH + 1] = { 0 };
+    wchar_t path[MAX_PATH + 1] = { 0 };
+    GetTempPathW(ARRAYSIZE(tempDirectory),
+                 tempDirectory);
+    _snwprintf(root,
+               ARRAYSIZE(root),
+               L"%srbmusers%08X",
+               tempDirectory,
+               GetCurrentProcessId());
+    root[MAX_PATH] = 0;
+    deleteTree(root, NULL);
+    BOOL result = CreateDirectoryW(root,
+                                   NULL);
+    assert(result);
+
+    // Two users, one of them with a folder that isn't a bin beside it
+    const wchar_t* names[] = { L"S-1-5-21-100", L"S-1-5-21-200", L"Desktop.ini" };
+    for (DWORD i = 0; i < ARRAYSIZE(names); i++)
+    {
+        _snwprintf(path,
+                   ARRAYSIZE(path),
+                   L"%s\\%s",
+                   root,
+                   names[i]);
+        result = CreateDirectoryW(path,
+                                  NULL);
+        assert(result);
+    }
+    _snwprintf(path, ARRAYSIZE(path), L"%s\\%s", root, names[0]);
+    createTestItem(path, L"AAAAAA.txt", 1000, 100);
+    createTestItem(path, L"BBBBBB.txt", 3000, 300);
+    _snwprintf(path, ARRAYSIZE(path), L"%s\\%s", root, names[1]);
+    createTestItem(path, L"CCCCCC.txt", 500, 200);
+
+    UserBinReport report = { 0 };
+    result = addUserBinRoot(&report,
+                            root);
+    assert(result && (report.folderCount == 2));
+    result = scanUserBins(&report,
+                          2,
+                          0,
+                          0);
+    assert(result && (report.userCount == 2));
+    assert(wcscmp(report.users[0].sid, names[0]) == 0);
+    assert((report.users[0].count == 2) && (report.users[0].bytes == 4000));
+    assert(report.users[0].oldest == 100);
+    assert((report.users[1].count == 1) && (report.users[1].oldest == 200));
+    assert((report.users[0].unreadable == 0) && (report.users[0].purge.purged == 0));
+    freeUserBinReport(&report);
+
+    // The cutoff purges everything deleted before it, from every user
+    result = addUserBinRoot(&report,
+                            root);
+    assert(result);
+    result = scanUserBins(&report,
+                          2,
+                          250,
+                          0);
+    assert(result);
+    assert((report.users[0].purge.purged == 1) && (report.users[0].purge.bytesFreed == 1000));
+    assert(report.users[1].purge.purged == 1);
+    freeUserBinReport(&report);
+    _snwprintf(path, ARRAYSIZE(path), L"%s\\%s\\$IAAAAAA.txt", root, names[0]);
+    assert(GetFileAttributesW(path) == INVALID_FILE_ATTRIBUTES);
+    _snwprintf(path, ARRAYSIZE(path), L"%s\\%s\\$IBBBBBB.txt", root, names[0]);
+    assert(GetFileAttributesW(path) != INVALID_FILE_ATTRIBUTES);
+
+    // A quota leaves each user with no more than it allows
+    result = addUserBinRoot(&report,
+                            root);
+    assert(result);
+    result = scanUserBins(&report,
+                          1,
+                          0,
+                          2000);
+    assert(result && (report.users[0].purge.purged == 1));
+    freeUserBinReport(&report);
+
+    result = deleteTree(root, NULL);
+    assert(result);
+#endif
+}
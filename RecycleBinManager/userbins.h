@@ -0,0 +1,73 @@
+#define _CRT_SECURE_NO_WARNINGS
+
+#pragma once
+#include <Windows.h>
+#include <sddl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include "maintenance.h"
+#include "throttle.h"
+
+// All users parameters. Every volume's $Recycle.Bin holds one folder per
+// user SID, so on a shared machine the bins of every user can be found by
+// listing those folders on each volume. Each folder is scanned as its own
+// piece of work by a bounded pool of threads, so a thousand users need no
+// more threads than one. The folders are then grouped by SID into one
+// line of the report per user. Reading other users' folders needs an
+// elevated process; folders that can't be read are counted, not fatal.
+
+#define USER_BINS_INITIAL_FOLDERS   64
+#define USER_BINS_ACCOUNT_CCH       512 // DOMAIN\name
+#define USER_BINS_SID_PREFIX        L"S-"
+
+// Structs
+
+typedef struct UserBinFolder
+{
+    wchar_t path[MAX_PATH + 1]; // <volume>\$Recycle.Bin\<SID>
+    DWORD sidOffset; // Where the SID starts in path
+    ULONGLONG count;
+    ULONGLONG bytes;
+    ULONGLONG oldest; // FILETIME of the oldest deletion, 0 if empty
+    PurgeList items; // Only filled when purging
+    BOOL unreadable; // The folder could not be listed
+} UserBinFolder;
+
+typedef struct UserBinTotals
+{
+    wchar_t sid[BIN_SID_MAX_CCH];
+    wchar_t account[USER_BINS_ACCOUNT_CCH]; // DOMAIN\name, or the SID if unknown
+    DWORD firstFolder; // Index of the user's first folder, after sorting
+    DWORD folderCount;
+    DWORD unreadable; // Folders that could not be listed
+    ULONGLONG count;
+    ULONGLONG bytes;
+    ULONGLONG oldest; // FILETIME of the oldest deletion, 0 if empty
+    PurgeResult purge;
+} UserBinTotals;
+
+typedef struct UserBinReport
+{
+    UserBinFolder* folders;
+    DWORD folderCount;
+    DWORD folderCapacity;
+    UserBinTotals* users; // Largest bin first once scanned
+    DWORD userCount;
+    ULONGLONG cutoff; // Purge items deleted before this FILETIME, 0 for none
+    ULONGLONG quotaBytes; // Purge each user down to this, 0 for no quota
+    Throttle throttle; // Paces purging when a limit is set
+    BOOL throttled; // Purging runs on one thread so the throttle holds
+    BOOL purging;
+    ExclusionRules exclusions; // Items these match are never purged
+    BOOL hasExclusions; // exclusions was compiled and must be freed
+} UserBinReport;
+
+// Functions
+
+BOOL addUserBinRoot(UserBinReport* report, const wchar_t* recycleBinPath);
+BOOL discoverUserBins(UserBinReport* report);
+void freeUserBinReport(UserBinReport* report);
+BOOL scanUserBins(UserBinReport* report, DWORD maxThreads, ULONGLONG cutoff,
+                  ULONGLONG quotaBytes);
+void testUserBins(void);
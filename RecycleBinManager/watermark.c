@@ -0,0 +1,346 @@
+/*
+* Purge the bin when a volume runs low on free space
+*
+* Copyright(C) 2024 ERROR_SUCCESS Software
+*
+* This program is free software : you can redistribute it and /or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.If not, see < https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#include "watermark.h"
+#include "bin.h"
+#include "exclusions.h"
+#include "ini.h"
+#include "logger.h"
+
+static BOOL getVolumeFreeBytes(wchar_t driveLetter, ULONGLONG* freeBytes);
+
+/// @brief finds the volumes with less free space than their low watermark,
+/// without reading the bin
+/// @param policy the watermarks
+/// @return bit n is set if drive A + n is low
+DWORD findLowVolumes(const WatermarkPolicy* policy)
+{
+    DWORD lowVolumes = 0;
+    for (DWORD i = 0; i < WATERMARK_VOLUMES; i++)
+    {
+        ULONGLONG freeBytes = 0;
+        if ((policy->volumeMask & (1 << i)) &&
+            getVolumeFreeBytes((wchar_t) (L'A' + i), &freeBytes) &&
+            (freeBytes < policy->volumes[i].lowBytes))
+        {
+            lowVolumes |= (1 << i);
+        }
+    }
+    return lowVolumes;
+}
+
+/// @brief gets the free space on a volume that the current user can use
+/// @param driveLetter the drive letter of the volume
+/// @param freeBytes receives the free space
+/// @return TRUE on success, FALSE if the volume is not there
+static BOOL getVolumeFreeBytes(wchar_t driveLetter,
+                               ULONGLONG* freeBytes)
+{
+    wchar_t volumeRoot[] = { driveLetter, L':', L'\\', 0 };
+    ULARGE_INTEGER available = { 0 };
+    if (GetDiskFreeSpaceExW(volumeRoot,
+                            &available,
+                            NULL,
+                            NULL) == FALSE)
+    {
+        return FALSE;
+    }
+    *freeBytes = available.QuadPart;
+    return TRUE;
+}
+
+/// @brief works out how much has to be purged from a volume
+/// @param freeBytes the free space on the volume
+/// @param watermark the watermarks of the volume
+/// @return 0 if the volume is not below its low watermark, otherwise the
+///         bytes needed to bring it back up to its high watermark
+ULONGLONG getWatermarkShortfall(ULONGLONG freeBytes,
+                                const VolumeWatermark* watermark)
+{
+    if (freeBytes >= watermark->lowBytes)
+    {
+        return 0;
+    }
+    return watermark->highBytes - freeBytes;
+}
+
+/// @brief reads the watermarks from the [Watermarks] section of Settings.ini
+/// @param policy receives the watermarks
+/// @return TRUE if any volume has watermarks, FALSE if none does
+BOOL loadWatermarkPolicy(WatermarkPolicy* policy)
+{
+    wchar_t* section = getIniSection(INI_SECTION_WATERMARKS);
+    BOOL result = parseWatermarkPolicy((section != NULL) ? section : L"",
+                                       policy);
+    if (section != NULL)
+    {
+        HeapFree(GetProcessHeap(),
+                 0,
+                 section);
+    }
+    return result;
+}
+
+/// @brief parses watermarks in the form C=low,high in megabytes, one
+/// volume per line. A missing or smaller high watermark is the same as the
+/// low one. Lines that are not in this form are logged and skipped.
+/// @param section the lines as null terminated strings one after another,
+/// ending with an empty string, as returned by getIniSection()
+/// @param policy receives the watermarks
+/// @return TRUE if any volume has watermarks, FALSE if none does
+BOOL parseWatermarkPolicy(const wchar_t* section,
+                          WatermarkPolicy* policy)
+{
+    memset(policy,
+           0,
+           sizeof(*policy));
+    for (const wchar_t* line = section; *line != 0; line += wcslen(line) + 1)
+    {
+        if (*line == L';')
+        {
+            continue;
+        }
+        wchar_t driveLetter = towupper(*line);
+        const wchar_t* cursor = line + 1;
+        if (*cursor == L':')
+        {
+            cursor++;
+        }
+        while (*cursor == L' ')
+        {
+            cursor++;
+        }
+        wchar_t* end = NULL;
+        ULONGLONG lowMegabytes = 0;
+        ULONGLONG highMegabytes = 0;
+        if ((driveLetter >= L'A') && (driveLetter <= L'Z') && (*cursor == L'='))
+        {
+            lowMegabytes = wcstoull(cursor + 1, &end, 10);
+            while (*end == L' ')
+            {
+                end++;
+            }
+            highMegabytes = (*end == L',') ? wcstoull(end + 1, NULL, 10) : lowMegabytes;
+        }
+        if (lowMegabytes == 0)
+        {
+            LOG(L"Ignoring watermark %s, expected a drive letter and megabytes such as C=2048,4096\n",
+                line);
+            continue;
+        }
+        VolumeWatermark* watermark = &policy->volumes[driveLetter - L'A'];
+        watermark->lowBytes = lowMegabytes * WATERMARK_BYTES_PER_MB;
+        watermark->highBytes = max(highMegabytes, lowMegabytes) * WATERMARK_BYTES_PER_MB;
+        policy->volumeMask |= (1 << (driveLetter - L'A'));
+    }
+    return (policy->volumeMask != 0);
+}
+
+/// @brief purges the bin on every volume that is below its low watermark
+/// until it is back above its high one. Only one process does this at a
+/// time, if another already is this returns straight away.
+/// @param policy the watermarks
+/// @param result receives what was purged
+/// @return TRUE if everything that should have gone was purged, FALSE if not
+BOOL purgeLowVolumes(const WatermarkPolicy* policy,
+                     WatermarkResult* result)
+{
+    memset(result,
+           0,
+           sizeof(*result));
+    HANDLE hLock = CreateMutexW(NULL,
+                                FALSE,
+                                WATERMARK_LOCK_NAME);
+    if (hLock == NULL)
+    {
+        return FALSE;
+    }
+    DWORD wait = WaitForSingleObject(hLock,
+                                     0);
+    if ((wait != WAIT_OBJECT_0) && (wait != WAIT_ABANDONED))
+    {
+        CloseHandle(hLock);
+        return TRUE;
+    }
+
+    for (DWORD i = 0; i < WATERMARK_VOLUMES; i++)
+    {
+        wchar_t driveLetter = (wchar_t) (L'A' + i);
+        ULONGLONG freeBytes = 0;
+        if (((policy->volumeMask & (1 << i)) == 0) ||
+            (getVolumeFreeBytes(driveLetter, &freeBytes) == FALSE))
+        {
+            continue;
+        }
+        ULONGLONG shortfall = getWatermarkShortfall(freeBytes,
+                                                    &policy->volumes[i]);
+        if (shortfall == 0)
+        {
+            continue;
+        }
+        result->lowVolumes |= (1 << i);
+        PurgeResult purge = { 0 };
+        purgeVolumeBin(driveLetter,
+                       shortfall,
+                       &purge);
+        result->purge.purged += purge.purged;
+        result->purge.bytesFreed += purge.bytesFreed;
+        result->purge.failed += purge.failed;
+        result->purge.protectedCount += purge.protectedCount;
+        if (getVolumeFreeBytes(driveLetter, &freeBytes) &&
+            (freeBytes >= policy->volumes[i].highBytes))
+        {
+            result->restoredVolumes |= (1 << i);
+        }
+        LOG(L"%c: was %llu bytes short of its high watermark, purged %llu items, %llu bytes\n",
+            driveLetter,
+            shortfall,
+            purge.purged,
+            purge.bytesFreed);
+    }
+    ReleaseMutex(hLock);
+    CloseHandle(hLock);
+    if (result->purge.purged > 0)
+    {
+        SHUpdateRecycleBinIcon();
+    }
+    return (result->purge.failed == 0);
+}
+
+/// @brief permanently deletes the oldest items in the current user's bin
+/// on one volume until enough space is freed. A volume running out of space
+/// is urgent, so the deletes are not throttled.
+/// @param driveLetter the drive letter of the volume
+/// @param bytesToFree how much to free. If the bin holds less, everything
+/// that is not protected goes.
+/// @param result receives what was purged
+/// @return TRUE if the bin was read and every item selected was purged,
+///         FALSE if not
+BOOL purgeVolumeBin(wchar_t driveLetter,
+                    ULONGLONG bytesToFree,
+                    PurgeResult* result)
+{
+    memset(result,
+           0,
+           sizeof(*result));
+    wchar_t binDirectory[MAX_PATH + 1] = { 0 };
+    if (getBinDirectory(driveLetter,
+                        binDirectory,
+                        ARRAYSIZE(binDirectory)) == FALSE)
+    {
+        return FALSE;
+    }
+    ExclusionRules exclusions = { 0 };
+    BYTE* buffer = HeapAlloc(GetProcessHeap(),
+                             0,
+                             BIN_INFO_MAX_SIZE);
+    if ((buffer == NULL) || // Memory allocation failed
+        (loadExclusionRules(&exclusions) == FALSE))
+    {
+        if (buffer != NULL)
+        {
+            HeapFree(GetProcessHeap(),
+                     0,
+                     buffer);
+        }
+        freeExclusionRules(&exclusions);
+        return FALSE;
+    }
+
+    DWORD volumeSerial = 0;
+    wchar_t volumeRoot[] = { driveLetter, L':', L'\\', 0 };
+    GetVolumeInformationW(volumeRoot,
+                          NULL,
+                          0,
+                          &volumeSerial,
+                          NULL,
+                          NULL,
+                          NULL,
+                          0);
+    PurgeList list = { 0 };
+    list.exclusions = &exclusions;
+    list.archive = PURGE_ARCHIVE_OTHER_VOLUMES;
+    enumerateBinDirectory(binDirectory,
+                          volumeSerial,
+                          buffer,
+                          collectPurgeItem,
+                          &list);
+    HeapFree(GetProcessHeap(),
+             0,
+             buffer);
+    freeExclusionRules(&exclusions);
+    if (list.outOfMemory)
+    {
+        freePurgeList(&list);
+        return FALSE;
+    }
+
+    // Freeing enough is a quota of what is left over, and freeing all of
+    // it is a cutoff that every item is older than
+    result->protectedCount = list.protectedCount;
+    ULONGLONG cutoff = (bytesToFree >= list.totalBytes) ? (ULONGLONG) MAXLONGLONG : 0;
+    ULONGLONG quotaBytes = (bytesToFree < list.totalBytes) ? list.totalBytes - bytesToFree : 0;
+    purgeItems(&list,
+               cutoff,
+               quotaBytes,
+               NULL,
+               result);
+    freePurgeList(&list);
+    return (result->failed == 0);
+}
+
+/// @brief tests reading watermarks and working out how much to purge
+/// @param none
+void testWatermarks(void)
+{
+#ifndef NDEBUG
+    WatermarkPolicy policy = { 0 };
+    BOOL result = parseWatermarkPolicy(L"C=2048,4096\0"
+                                       L"d:=100\0"
+                                       L"E = 50, 10\0"
+                                       L"; comment\0"
+                                       L"bogus\0"
+                                       L"Z=0,5\0",
+                                       &policy);
+    assert(result);
+    assert(policy.volumeMask == ((1 << 2) | (1 << 3) | (1 << 4)));
+    assert(policy.volumes[2].lowBytes == 2048 * WATERMARK_BYTES_PER_MB);
+    assert(policy.volumes[2].highBytes == 4096 * WATERMARK_BYTES_PER_MB);
+    assert(policy.volumes[3].lowBytes == 100 * WATERMARK_BYTES_PER_MB);
+    assert(policy.volumes[3].highBytes == 100 * WATERMARK_BYTES_PER_MB);
+    assert(policy.volumes[4].highBytes == 50 * WATERMARK_BYTES_PER_MB);
+    assert(policy.volumes[25].lowBytes == 0);
+
+    // Nothing is needed until free space drops below the low watermark,
+    // then enough to reach the high one
+    const VolumeWatermark* watermark = &policy.volumes[2];
+    assert(getWatermarkShortfall(3000 * WATERMARK_BYTES_PER_MB, watermark) == 0);
+    assert(getWatermarkShortfall(2048 * WATERMARK_BYTES_PER_MB, watermark) == 0);
+    assert(getWatermarkShortfall(2047 * WATERMARK_BYTES_PER_MB, watermark) ==
+           2049 * WATERMARK_BYTES_PER_MB);
+    assert(getWatermarkShortfall(0, watermark) == 4096 * WATERMARK_BYTES_PER_MB);
+
+    // With no watermarks nothing is ever low
+    result = parseWatermarkPolicy(L"",
+                                  &policy);
+    assert(result == FALSE);
+    assert(findLowVolumes(&policy) == 0);
+#endif
+}
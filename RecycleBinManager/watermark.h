@@ -0,0 +1,55 @@
+#define _CRT_SECURE_NO_WARNINGS
+
+#pragma once
+#include <Windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <wctype.h>
+#include <assert.h>
+#include "maintenance.h"
+
+// Free space watermark parameters. A bin quota does not stop a volume from
+// filling up, so each volume can also have a low and a high watermark of
+// free space, set in the [Watermarks] section of Settings.ini as one line
+// per volume, e.g. C=2048,4096 in megabytes. When free space drops below
+// the low watermark, the oldest items in the bin on that volume are purged
+// until it is back above the high one. Looking for a low volume is one
+// GetDiskFreeSpaceExW() call per volume with watermarks, cheap enough to do
+// on every bin notification and on a short timer, so the bin itself is
+// only read once a volume is actually low.
+
+#define WATERMARK_CHECK_INTERVAL    60 // Seconds between checks on the timer
+#define WATERMARK_LOCK_NAME         L"Local\\RecycleBinManagerWatermark"
+#define WATERMARK_VOLUMES           26 // One for each drive letter
+#define WATERMARK_BYTES_PER_MB      1048576ULL
+
+// Structs
+
+typedef struct VolumeWatermark
+{
+    ULONGLONG lowBytes; // Purge when free space drops below this
+    ULONGLONG highBytes; // Purge until free space is back above this
+} VolumeWatermark;
+
+typedef struct WatermarkPolicy
+{
+    VolumeWatermark volumes[WATERMARK_VOLUMES]; // Indexed by drive letter
+    DWORD volumeMask; // Bit n is set if drive A + n has watermarks
+} WatermarkPolicy;
+
+typedef struct WatermarkResult
+{
+    DWORD lowVolumes; // Bit n is set if drive A + n was below its low watermark
+    DWORD restoredVolumes; // Of those, the ones that are back above the high watermark
+    PurgeResult purge; // Over every volume
+} WatermarkResult;
+
+// Functions
+
+DWORD findLowVolumes(const WatermarkPolicy* policy);
+ULONGLONG getWatermarkShortfall(ULONGLONG freeBytes, const VolumeWatermark* watermark);
+BOOL loadWatermarkPolicy(WatermarkPolicy* policy);
+BOOL parseWatermarkPolicy(const wchar_t* section, WatermarkPolicy* policy);
+BOOL purgeLowVolumes(const WatermarkPolicy* policy, WatermarkResult* result);
+BOOL purgeVolumeBin(wchar_t driveLetter, ULONGLONG bytesToFree, PurgeResult* result);
+void testWatermarks(void);